@@ -0,0 +1,1061 @@
+#include "../common/common.h"
+#include "libmetcli.h"
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+// Buckets in the table of outstanding requests
+#define METCLI_BUCKETS          64
+// Hex digits in each half of a request identifier
+#define METCLI_ID_DIGITS        8
+
+// What an outstanding request completes
+#define METCLI_PENDING_CALLBACK 0
+#define METCLI_PENDING_FUTURE   1
+#define METCLI_PENDING_WRITE    2
+#define METCLI_PENDING_READ     3
+
+struct _MetcliFuture
+{
+	BOOL                    done;
+	// Set once the caller is done with the future, it then goes with the request
+	BOOL                    released;
+	DWORD                   result;
+	Packet *                response;
+};
+
+// A write waiting for room in its channel's window, the data follows it
+typedef struct _MetcliChunk
+{
+	DWORD                   length;
+	struct _MetcliChunk *   next;
+} MetcliChunk;
+
+// A read in flight, its data is handed over once the reads before it have been
+typedef struct _MetcliRead
+{
+	DWORD                   sequence;
+	BOOL                    done;
+	DWORD                   result;
+	Packet *                response;
+	struct _MetcliRead *    next;
+} MetcliRead;
+
+typedef struct _MetcliChannel
+{
+	DWORD                   id;
+	MetcliChannelHandlers   handlers;
+	// Most reads and writes in flight
+	DWORD                   window;
+	DWORD                   inFlight;
+	// Sequence number of the next read or write
+	DWORD                   sequence;
+	// Length of each read while the channel is being read, zero otherwise
+	DWORD                   readLength;
+	// Bytes queued or in flight
+	DWORD                   queued;
+	MetcliChunk *           chunks;
+	MetcliChunk *           chunksTail;
+	// Reads in flight, in sequence order
+	MetcliRead *            reads;
+	MetcliRead *            readsTail;
+	struct _MetcliChannel * next;
+} MetcliChannel;
+
+typedef struct _MetcliPending
+{
+	DWORD                   id;
+	DWORD                   kind;
+	// Time at which the request times out, zero for never
+	QWORD                   deadline;
+	MetcliCallback          callback;
+	LPVOID                  context;
+	// Channel and sequence number for channel reads and writes
+	DWORD                   channelId;
+	DWORD                   sequence;
+	DWORD                   length;
+	struct _MetcliPending * next;
+} MetcliPending;
+
+struct _MetcliClient
+{
+	MetcliOutput            output;
+	LPVOID                  outputContext;
+	MetcliRequestHandler    requestHandler;
+	LPVOID                  requestContext;
+
+	// Request identifiers are the salt followed by a counter
+	DWORD                   salt;
+	DWORD                   nextId;
+	DWORD                   outstanding;
+	MetcliPending *         pending[METCLI_BUCKETS];
+
+	MetcliChannel *         channels;
+
+	// Received bytes that don't make up a whole packet yet
+	PUCHAR                  input;
+	DWORD                   inputLength;
+	DWORD                   inputSize;
+
+	// Buffer that outgoing packets are laid out in
+	PUCHAR                  scratch;
+	DWORD                   scratchSize;
+};
+
+static VOID metcli_pump(MetcliClient *client, DWORD channelId);
+
+/*
+ * Get the time used for request timeouts, in milliseconds
+ */
+static QWORD metcli_clock()
+{
+#ifdef _WIN32
+	return (QWORD)GetTickCount();
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+/*
+ * Parse a run of hex digits from a request identifier
+ */
+static BOOL metcli_parse_hex(PCHAR digits, DWORD *value)
+{
+	DWORD index;
+	CHAR c;
+
+	*value = 0;
+
+	for (index = 0; index < METCLI_ID_DIGITS; index++)
+	{
+		c = digits[index];
+
+		if (c >= '0' && c <= '9')
+			*value = (*value << 4) | (c - '0');
+		else if (c >= 'a' && c <= 'f')
+			*value = (*value << 4) | (c - 'a' + 10);
+		else
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Find the state of an attached channel
+ */
+static MetcliChannel *metcli_channel_find(MetcliClient *client, DWORD channelId)
+{
+	MetcliChannel *channel;
+
+	for (channel = client->channels; channel; channel = channel->next)
+	{
+		if (channel->id == channelId)
+			break;
+	}
+
+	return channel;
+}
+
+/*
+ * Send a packet to the server, the packet is destroyed
+ */
+static DWORD metcli_send(MetcliClient *client, Packet *packet)
+{
+	DWORD length = sizeof(TlvHeader) + packet->payloadLength;
+	PUCHAR scratch;
+	DWORD res;
+
+	do
+	{
+		if (length > client->scratchSize)
+		{
+			if (!(scratch = (PUCHAR)realloc(client->scratch, length)))
+			{
+				res = ERROR_NOT_ENOUGH_MEMORY;
+				break;
+			}
+
+			client->scratch     = scratch;
+			client->scratchSize = length;
+		}
+
+		packet->header.length = htonl(length);
+
+		memcpy(client->scratch, &packet->header, sizeof(TlvHeader));
+		if (packet->payloadLength)
+			memcpy(client->scratch + sizeof(TlvHeader), packet->payload, packet->payloadLength);
+
+		res = client->output(client->outputContext, client->scratch, length);
+
+	} while (0);
+
+	packet_destroy(packet);
+
+	return res;
+}
+
+/*
+ * Send a request and keep track of it until it completes. The request is
+ * destroyed either way, and nothing is tracked if it couldn't be sent.
+ */
+static DWORD metcli_issue(MetcliClient *client, Packet *request, DWORD timeout,
+		MetcliPending *pending)
+{
+	MetcliPending **bucket;
+	CHAR requestId[METCLI_ID_DIGITS * 2 + 1];
+	DWORD res;
+
+	pending->id       = client->nextId++;
+	pending->deadline = timeout ? metcli_clock() + timeout : 0;
+
+	sprintf(requestId, "%08x%08x", client->salt, pending->id);
+
+	if ((res = packet_add_tlv_string(request, TLV_TYPE_REQUEST_ID, requestId)) != ERROR_SUCCESS)
+	{
+		packet_destroy(request);
+		return res;
+	}
+
+	if ((res = metcli_send(client, request)) != ERROR_SUCCESS)
+		return res;
+
+	bucket = &client->pending[pending->id % METCLI_BUCKETS];
+
+	pending->next = *bucket;
+	*bucket       = pending;
+
+	client->outstanding++;
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Stop tracking the request with the given identifier
+ */
+static MetcliPending *metcli_take(MetcliClient *client, DWORD id)
+{
+	MetcliPending **link;
+	MetcliPending *pending;
+
+	for (link = &client->pending[id % METCLI_BUCKETS]; (pending = *link); link = &pending->next)
+	{
+		if (pending->id == id)
+		{
+			*link = pending->next;
+			client->outstanding--;
+			break;
+		}
+	}
+
+	return pending;
+}
+
+/*
+ * Hand over the data of the channel's completed reads, in sequence order
+ */
+static VOID metcli_deliver_reads(MetcliClient *client, DWORD channelId)
+{
+	MetcliChannel *channel;
+	MetcliRead *read;
+	BOOL ended;
+	Tlv data;
+
+	while ((channel = metcli_channel_find(client, channelId))
+		&& (read = channel->reads) && read->done)
+	{
+		if (!(channel->reads = read->next))
+			channel->readsTail = NULL;
+
+		// A failed or empty read is the end of the channel's data. Reads that
+		// were already in flight behind it end up here too, but only the first
+		// one stops the reading.
+		ended = FALSE;
+
+		if (read->result != ERROR_SUCCESS ||
+		    !packet_get_tlv_value_uint(read->response, TLV_TYPE_LENGTH))
+		{
+			ended = (channel->readLength != 0);
+			channel->readLength = 0;
+		}
+		else if (channel->handlers.data &&
+		         packet_get_tlv(read->response, TLV_TYPE_CHANNEL_DATA, &data) == ERROR_SUCCESS)
+		{
+			// Synchronous channels return the data in the response, the rest
+			// write it to us separately before responding
+			channel->handlers.data(client, channelId, channel->handlers.context,
+					data.buffer, data.header.length);
+		}
+
+		if (ended && channel->handlers.readEnd)
+			channel->handlers.readEnd(client, channelId, channel->handlers.context,
+					read->result);
+
+		packet_destroy(read->response);
+		free(read);
+	}
+}
+
+/*
+ * Complete a request with its response, which is destroyed unless a future
+ * holds on to it. The response is NULL if the request timed out or was
+ * cancelled.
+ */
+static VOID metcli_complete(MetcliClient *client, MetcliPending *pending,
+		DWORD result, Packet *response)
+{
+	MetcliChannel *channel;
+	MetcliFuture *future;
+	MetcliRead *read;
+
+	switch (pending->kind)
+	{
+		case METCLI_PENDING_CALLBACK:
+			if (pending->callback)
+				pending->callback(client, pending->context, result, response);
+			break;
+
+		case METCLI_PENDING_FUTURE:
+			future = (MetcliFuture *)pending->context;
+
+			if (future->released)
+			{
+				free(future);
+				break;
+			}
+
+			future->done     = TRUE;
+			future->result   = result;
+			future->response = response;
+			response         = NULL;
+			break;
+
+		case METCLI_PENDING_WRITE:
+			if (!(channel = metcli_channel_find(client, pending->channelId)))
+				break;
+
+			channel->inFlight--;
+			channel->queued -= pending->length;
+
+			if (channel->handlers.written)
+				channel->handlers.written(client, pending->channelId,
+						channel->handlers.context, result, pending->length);
+
+			metcli_pump(client, pending->channelId);
+			break;
+
+		case METCLI_PENDING_READ:
+			if (!(channel = metcli_channel_find(client, pending->channelId)))
+				break;
+
+			channel->inFlight--;
+
+			for (read = channel->reads; read; read = read->next)
+			{
+				if (read->sequence == pending->sequence)
+				{
+					read->done     = TRUE;
+					read->result   = response ? result : ERROR_TIMEOUT;
+					read->response = response;
+					response       = NULL;
+					break;
+				}
+			}
+
+			metcli_deliver_reads(client, pending->channelId);
+			metcli_pump(client, pending->channelId);
+			break;
+	}
+
+	packet_destroy(response);
+	free(pending);
+}
+
+/*
+ * Match a response up with its request
+ */
+static VOID metcli_handle_response(MetcliClient *client, Packet *response)
+{
+	MetcliPending *pending = NULL;
+	DWORD salt, id;
+	Tlv requestId;
+
+	if (packet_get_tlv_string(response, TLV_TYPE_REQUEST_ID, &requestId) == ERROR_SUCCESS
+		&& requestId.header.length > METCLI_ID_DIGITS * 2
+		&& metcli_parse_hex((PCHAR)requestId.buffer, &salt) && salt == client->salt
+		&& metcli_parse_hex((PCHAR)requestId.buffer + METCLI_ID_DIGITS, &id))
+	{
+		pending = metcli_take(client, id);
+	}
+
+	// Responses to requests that timed out, or that somebody else sent, are dropped
+	if (!pending)
+	{
+		packet_destroy(response);
+		return;
+	}
+
+	metcli_complete(client, pending, packet_get_tlv_value_uint(response, TLV_TYPE_RESULT), response);
+}
+
+/*
+ * Handle a request made by the server. Channel data and channel closes are
+ * handled here, anything else goes to the request handler.
+ */
+static VOID metcli_handle_request(MetcliClient *client, Packet *request)
+{
+	PCHAR method = packet_get_tlv_value_string(request, TLV_TYPE_METHOD);
+	MetcliChannelHandlers handlers;
+	MetcliChannel *channel;
+	Packet *response;
+	DWORD result = ERROR_SUCCESS;
+	DWORD channelId = 0;
+	DWORD length = 0;
+	Tlv group, data;
+
+	if (method && !strcmp(method, "core_channel_write"))
+	{
+		// Data the server writes to us of its own accord comes in a group
+		if (packet_get_tlv(request, TLV_TYPE_CHANNEL_DATA_GROUP, &group) == ERROR_SUCCESS)
+		{
+			if (packet_get_tlv_group_entry(request, &group, TLV_TYPE_CHANNEL_ID, &data) == ERROR_SUCCESS
+				&& data.header.length == sizeof(DWORD))
+				channelId = ntohl(*(LPDWORD)data.buffer);
+
+			result = packet_get_tlv_group_entry(request, &group, TLV_TYPE_CHANNEL_DATA, &data);
+		}
+		else
+		{
+			channelId = packet_get_tlv_value_uint(request, TLV_TYPE_CHANNEL_ID);
+			result    = packet_get_tlv(request, TLV_TYPE_CHANNEL_DATA, &data);
+		}
+
+		if (result == ERROR_SUCCESS)
+		{
+			if (!(channel = metcli_channel_find(client, channelId)))
+			{
+				result = ERROR_NOT_FOUND;
+			}
+			else
+			{
+				length = data.header.length;
+
+				if (channel->handlers.data)
+					channel->handlers.data(client, channelId, channel->handlers.context,
+							data.buffer, length);
+			}
+		}
+	}
+	else if (method && !strcmp(method, "core_channel_close"))
+	{
+		channelId = packet_get_tlv_value_uint(request, TLV_TYPE_CHANNEL_ID);
+
+		if (!(channel = metcli_channel_find(client, channelId)))
+		{
+			result = ERROR_NOT_FOUND;
+		}
+		else
+		{
+			handlers = channel->handlers;
+
+			metcli_channel_detach(client, channelId);
+
+			if (handlers.closed)
+				handlers.closed(client, channelId, handlers.context);
+		}
+	}
+	else
+	{
+		result = client->requestHandler
+			? client->requestHandler(client, client->requestContext, request)
+			: ERROR_NOT_SUPPORTED;
+	}
+
+	if ((response = packet_create_response(request)))
+	{
+		if (channelId)
+		{
+			packet_add_tlv_uint(response, TLV_TYPE_CHANNEL_ID, channelId);
+			packet_add_tlv_uint(response, TLV_TYPE_LENGTH, length);
+		}
+
+		packet_add_tlv_uint(response, TLV_TYPE_RESULT, result);
+
+		metcli_send(client, response);
+	}
+
+	packet_destroy(request);
+}
+
+/*
+ * Create a client that sends its packets through the given output routine
+ */
+MetcliClient *metcli_create(MetcliOutput output, LPVOID context)
+{
+	MetcliClient *client;
+
+	if (!(client = (MetcliClient *)calloc(1, sizeof(MetcliClient))))
+		return NULL;
+
+	client->output        = output;
+	client->outputContext = context;
+	client->salt          = ((DWORD)rand() << 16) ^ (DWORD)rand() ^ (DWORD)time(NULL);
+
+	return client;
+}
+
+/*
+ * Destroy a client. Outstanding requests fail with ERROR_INVALID_HANDLE, the
+ * completion routines must not use the client any more.
+ */
+VOID metcli_destroy(MetcliClient *client)
+{
+	MetcliPending *pending;
+	DWORD index;
+
+	if (!client)
+		return;
+
+	// Channels go first, so their reads and writes are simply dropped
+	while (client->channels)
+		metcli_channel_detach(client, client->channels->id);
+
+	for (index = 0; index < METCLI_BUCKETS; index++)
+	{
+		while ((pending = client->pending[index]))
+		{
+			client->pending[index] = pending->next;
+			client->outstanding--;
+
+			metcli_complete(client, pending, ERROR_INVALID_HANDLE, NULL);
+		}
+	}
+
+	if (client->input)
+		free(client->input);
+
+	if (client->scratch)
+		free(client->scratch);
+
+	free(client);
+}
+
+/*
+ * Hand the client bytes that were received from the server. Every whole
+ * packet among them is dispatched before this returns, and the rest are kept
+ * until more arrive.
+ */
+DWORD metcli_input(MetcliClient *client, PUCHAR buffer, DWORD length)
+{
+	DWORD offset = 0, packetLength;
+	TlvHeader header;
+	Packet *packet;
+	PUCHAR input;
+	DWORD res = ERROR_SUCCESS;
+
+	if (client->inputLength + length > client->inputSize)
+	{
+		if (!(input = (PUCHAR)realloc(client->input, client->inputLength + length)))
+			return ERROR_NOT_ENOUGH_MEMORY;
+
+		client->input     = input;
+		client->inputSize = client->inputLength + length;
+	}
+
+	memcpy(client->input + client->inputLength, buffer, length);
+	client->inputLength += length;
+
+	while (client->inputLength - offset >= sizeof(TlvHeader))
+	{
+		memcpy(&header, client->input + offset, sizeof(TlvHeader));
+
+		packetLength = ntohl(header.length);
+
+		if (packetLength < sizeof(TlvHeader))
+		{
+			res = ERROR_INVALID_DATA;
+			break;
+		}
+
+		if (client->inputLength - offset < packetLength)
+			break;
+
+		if (!(packet = (Packet *)calloc(1, sizeof(Packet))))
+		{
+			res = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		packet->header        = header;
+		packet->payloadLength = packetLength - sizeof(TlvHeader);
+
+		if (packet->payloadLength &&
+		    !(packet->payload = (PUCHAR)malloc(packet->payloadLength)))
+		{
+			free(packet);
+			res = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		memcpy(packet->payload, client->input + offset + sizeof(TlvHeader), packet->payloadLength);
+		offset += packetLength;
+
+		switch (packet_get_type(packet))
+		{
+			case PACKET_TLV_TYPE_RESPONSE:
+			case PACKET_TLV_TYPE_PLAIN_RESPONSE:
+				metcli_handle_response(client, packet);
+				break;
+			case PACKET_TLV_TYPE_REQUEST:
+			case PACKET_TLV_TYPE_PLAIN_REQUEST:
+				metcli_handle_request(client, packet);
+				break;
+			default:
+				packet_destroy(packet);
+				break;
+		}
+	}
+
+	client->inputLength -= offset;
+	if (client->inputLength)
+		memmove(client->input, client->input + offset, client->inputLength);
+
+	return res;
+}
+
+/*
+ * Time out requests whose time is up. Returns the number of milliseconds
+ * until the next one does, or METCLI_NO_DEADLINE, which the caller can use as
+ * the timeout of its event loop.
+ */
+DWORD metcli_tick(MetcliClient *client)
+{
+	MetcliPending *expired = NULL, *pending, **link;
+	QWORD now = metcli_clock(), next = 0;
+	DWORD index;
+
+	for (index = 0; index < METCLI_BUCKETS; index++)
+	{
+		link = &client->pending[index];
+
+		while ((pending = *link))
+		{
+			if (pending->deadline && pending->deadline <= now)
+			{
+				*link = pending->next;
+				client->outstanding--;
+
+				pending->next = expired;
+				expired       = pending;
+				continue;
+			}
+
+			if (pending->deadline && (!next || pending->deadline < next))
+				next = pending->deadline;
+
+			link = &pending->next;
+		}
+	}
+
+	// Completion routines can send new requests, so they run once the table
+	// has been walked
+	while ((pending = expired))
+	{
+		expired = pending->next;
+		metcli_complete(client, pending, ERROR_TIMEOUT, NULL);
+	}
+
+	return next ? (DWORD)(next - now) : METCLI_NO_DEADLINE;
+}
+
+/*
+ * Get the number of requests that are waiting for a response
+ */
+DWORD metcli_outstanding(MetcliClient *client)
+{
+	return client->outstanding;
+}
+
+/*
+ * Set the handler for requests made by the server that the client doesn't
+ * handle itself. Without one, they are answered with ERROR_NOT_SUPPORTED.
+ */
+VOID metcli_set_request_handler(MetcliClient *client,
+		MetcliRequestHandler handler, LPVOID context)
+{
+	client->requestHandler = handler;
+	client->requestContext = context;
+}
+
+/*
+ * Send a request without waiting for it. The completion routine is called
+ * with the response, or without one once the timeout, in milliseconds, has
+ * passed. A timeout of zero waits forever. The request is destroyed, and the
+ * completion routine is never called if the request couldn't be sent.
+ */
+DWORD metcli_request(MetcliClient *client, Packet *request, DWORD timeout,
+		MetcliCallback callback, LPVOID context)
+{
+	MetcliPending *pending;
+	DWORD res;
+
+	if (!(pending = (MetcliPending *)calloc(1, sizeof(MetcliPending))))
+	{
+		packet_destroy(request);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	pending->kind     = METCLI_PENDING_CALLBACK;
+	pending->callback = callback;
+	pending->context  = context;
+
+	if ((res = metcli_issue(client, request, timeout, pending)) != ERROR_SUCCESS)
+		free(pending);
+
+	return res;
+}
+
+/*
+ * Send a request without waiting for it, and get a future that completes with
+ * its response. Returns NULL if the request couldn't be sent.
+ */
+MetcliFuture *metcli_request_future(MetcliClient *client, Packet *request,
+		DWORD timeout)
+{
+	MetcliPending *pending;
+	MetcliFuture *future;
+
+	if (!(future = (MetcliFuture *)calloc(1, sizeof(MetcliFuture))))
+	{
+		packet_destroy(request);
+		return NULL;
+	}
+
+	if (!(pending = (MetcliPending *)calloc(1, sizeof(MetcliPending))))
+	{
+		packet_destroy(request);
+		free(future);
+		return NULL;
+	}
+
+	pending->kind    = METCLI_PENDING_FUTURE;
+	pending->context = future;
+
+	if (metcli_issue(client, request, timeout, pending) != ERROR_SUCCESS)
+	{
+		free(pending);
+		free(future);
+		return NULL;
+	}
+
+	return future;
+}
+
+/*
+ * Check whether a future has completed
+ */
+BOOL metcli_future_done(MetcliFuture *future)
+{
+	return future->done;
+}
+
+/*
+ * Get the result of a completed future, ERROR_TIMEOUT if it timed out
+ */
+DWORD metcli_future_result(MetcliFuture *future)
+{
+	return future->result;
+}
+
+/*
+ * Get the response of a completed future, NULL if there isn't one. The
+ * response belongs to the future.
+ */
+Packet *metcli_future_response(MetcliFuture *future)
+{
+	return future->response;
+}
+
+/*
+ * Let go of a future. If it hasn't completed yet, it is freed when it does.
+ */
+VOID metcli_future_release(MetcliFuture *future)
+{
+	if (!future)
+		return;
+
+	if (!future->done)
+	{
+		future->released = TRUE;
+		return;
+	}
+
+	packet_destroy(future->response);
+	free(future);
+}
+
+/*
+ * Send the channel's queued writes and reads while there is room in its window
+ */
+static VOID metcli_pump(MetcliClient *client, DWORD channelId)
+{
+	MetcliChannel *channel;
+	MetcliPending *pending;
+	MetcliChunk *chunk;
+	MetcliRead *read;
+	Packet *request;
+	DWORD res;
+
+	while ((channel = metcli_channel_find(client, channelId))
+		&& channel->inFlight < channel->window
+		&& (channel->chunks || channel->readLength))
+	{
+		if (!(pending = (MetcliPending *)calloc(1, sizeof(MetcliPending))))
+			break;
+
+		pending->channelId = channelId;
+		pending->sequence  = channel->sequence;
+
+		if ((chunk = channel->chunks))
+		{
+			pending->kind   = METCLI_PENDING_WRITE;
+			pending->length = chunk->length;
+
+			if (!(channel->chunks = chunk->next))
+				channel->chunksTail = NULL;
+
+			if ((request = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_write")))
+			{
+				packet_add_tlv_uint(request, TLV_TYPE_CHANNEL_ID, channelId);
+				packet_add_tlv_raw(request, TLV_TYPE_CHANNEL_DATA, (PUCHAR)(chunk + 1), chunk->length);
+				packet_add_tlv_uint(request, TLV_TYPE_LENGTH, chunk->length);
+				packet_add_tlv_uint(request, TLV_TYPE_CHANNEL_SEQUENCE, pending->sequence);
+			}
+
+			free(chunk);
+
+			res = request ? metcli_issue(client, request, 0, pending) : ERROR_NOT_ENOUGH_MEMORY;
+
+			if (res != ERROR_SUCCESS)
+			{
+				channel->queued -= pending->length;
+
+				if (channel->handlers.written)
+					channel->handlers.written(client, channelId, channel->handlers.context,
+							res, pending->length);
+
+				free(pending);
+				break;
+			}
+		}
+		else
+		{
+			pending->kind = METCLI_PENDING_READ;
+
+			if (!(read = (MetcliRead *)calloc(1, sizeof(MetcliRead))))
+			{
+				free(pending);
+				break;
+			}
+
+			read->sequence = pending->sequence;
+
+			if ((request = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_read")))
+			{
+				packet_add_tlv_uint(request, TLV_TYPE_CHANNEL_ID, channelId);
+				packet_add_tlv_uint(request, TLV_TYPE_LENGTH, channel->readLength);
+				packet_add_tlv_uint(request, TLV_TYPE_CHANNEL_SEQUENCE, pending->sequence);
+			}
+
+			res = request ? metcli_issue(client, request, 0, pending) : ERROR_NOT_ENOUGH_MEMORY;
+
+			if (res != ERROR_SUCCESS)
+			{
+				free(read);
+				free(pending);
+
+				channel->readLength = 0;
+
+				if (channel->handlers.readEnd)
+					channel->handlers.readEnd(client, channelId, channel->handlers.context, res);
+				break;
+			}
+
+			if (channel->readsTail)
+				channel->readsTail->next = read;
+			else
+				channel->reads = read;
+
+			channel->readsTail = read;
+		}
+
+		channel->inFlight++;
+		channel->sequence++;
+	}
+}
+
+/*
+ * Start keeping track of a channel, so that its data and closure are handed
+ * to the given handlers and it can be read and written. The handlers are
+ * copied.
+ */
+DWORD metcli_channel_attach(MetcliClient *client, DWORD channelId,
+		MetcliChannelHandlers *handlers)
+{
+	MetcliChannel *channel;
+
+	if (metcli_channel_find(client, channelId))
+		return ERROR_INVALID_PARAMETER;
+
+	if (!(channel = (MetcliChannel *)calloc(1, sizeof(MetcliChannel))))
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	channel->id     = channelId;
+	channel->window = METCLI_DEFAULT_WINDOW;
+
+	if (handlers)
+		channel->handlers = *handlers;
+
+	channel->next    = client->channels;
+	client->channels = channel;
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Stop keeping track of a channel. Queued writes are dropped, and the
+ * responses to reads and writes that are in flight are ignored.
+ */
+VOID metcli_channel_detach(MetcliClient *client, DWORD channelId)
+{
+	MetcliChannel **link, *channel;
+	MetcliChunk *chunk;
+	MetcliRead *read;
+
+	for (link = &client->channels; (channel = *link); link = &channel->next)
+	{
+		if (channel->id == channelId)
+			break;
+	}
+
+	if (!channel)
+		return;
+
+	*link = channel->next;
+
+	while ((chunk = channel->chunks))
+	{
+		channel->chunks = chunk->next;
+		free(chunk);
+	}
+
+	while ((read = channel->reads))
+	{
+		channel->reads = read->next;
+		packet_destroy(read->response);
+		free(read);
+	}
+
+	free(channel);
+}
+
+/*
+ * Set the most reads and writes that a channel has in flight at once
+ */
+DWORD metcli_channel_set_window(MetcliClient *client, DWORD channelId,
+		DWORD window)
+{
+	MetcliChannel *channel;
+
+	if (!(channel = metcli_channel_find(client, channelId)))
+		return ERROR_NOT_FOUND;
+
+	if (!window || window > METCLI_MAX_WINDOW)
+		return ERROR_INVALID_PARAMETER;
+
+	channel->window = window;
+
+	metcli_pump(client, channelId);
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Queue data to be written to a channel. The data is copied and sent in
+ * chunks of up to METCLI_CHUNK_SIZE bytes as the channel's window allows,
+ * the written handler hears about each chunk as it is acknowledged.
+ */
+DWORD metcli_channel_write(MetcliClient *client, DWORD channelId,
+		PUCHAR buffer, DWORD length)
+{
+	MetcliChannel *channel;
+	MetcliChunk *chunk;
+	DWORD chunkLength;
+
+	if (!(channel = metcli_channel_find(client, channelId)))
+		return ERROR_NOT_FOUND;
+
+	while (length)
+	{
+		chunkLength = length < METCLI_CHUNK_SIZE ? length : METCLI_CHUNK_SIZE;
+
+		if (!(chunk = (MetcliChunk *)malloc(sizeof(MetcliChunk) + chunkLength)))
+			return ERROR_NOT_ENOUGH_MEMORY;
+
+		chunk->length = chunkLength;
+		chunk->next   = NULL;
+		memcpy(chunk + 1, buffer, chunkLength);
+
+		if (channel->chunksTail)
+			channel->chunksTail->next = chunk;
+		else
+			channel->chunks = chunk;
+
+		channel->chunksTail = chunk;
+		channel->queued    += chunkLength;
+
+		buffer += chunkLength;
+		length -= chunkLength;
+	}
+
+	metcli_pump(client, channelId);
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Keep reading a channel, with reads of the given length, until it runs out
+ * of data. The data goes to the data handler and the readEnd handler hears
+ * about the end. A length of zero stops the reading, reads in flight still
+ * complete.
+ */
+DWORD metcli_channel_read(MetcliClient *client, DWORD channelId, DWORD length)
+{
+	MetcliChannel *channel;
+
+	if (!(channel = metcli_channel_find(client, channelId)))
+		return ERROR_NOT_FOUND;
+
+	channel->readLength = length;
+
+	metcli_pump(client, channelId);
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Get the number of bytes written to a channel that the server hasn't
+ * acknowledged yet, so callers can hold off while too much is queued
+ */
+DWORD metcli_channel_queued(MetcliClient *client, DWORD channelId)
+{
+	MetcliChannel *channel;
+
+	if (!(channel = metcli_channel_find(client, channelId)))
+		return 0;
+
+	return channel->queued;
+}
@@ -0,0 +1,106 @@
+#ifndef _METERPRETER_CLIENT_LIBMETCLI_H
+#define _METERPRETER_CLIENT_LIBMETCLI_H
+
+/*
+ * libmetcli -- a non-blocking client for the meterpreter protocol
+ *
+ * The library doesn't do any I/O of its own, so it fits into whatever event
+ * loop the caller already has. Bytes read from the server are handed to
+ * metcli_input, the packets the library wants sent are handed to the output
+ * routine, and metcli_tick is called now and then to time out requests.
+ * Sockets, SSL and threads are up to the caller, and a client must only be
+ * used from one thread at a time.
+ *
+ * Any number of requests can be outstanding at once, each one completing
+ * through a callback or a future. Channel reads and writes are pipelined,
+ * with up to a window's worth of them in flight on each channel. They carry
+ * TLV_TYPE_CHANNEL_SEQUENCE, so the server runs them in the order they were
+ * queued in, and the data they return is handed over in that order too.
+ */
+
+#include "../common/common.h"
+
+// Most bytes carried by a single channel write
+#define METCLI_CHUNK_SIZE       (64 * 1024)
+// Reads and writes in flight on a channel, unless it is given a window of its own
+#define METCLI_DEFAULT_WINDOW   8
+// Largest window a channel can be given
+#define METCLI_MAX_WINDOW       256
+// Returned by metcli_tick when no request has a timeout
+#define METCLI_NO_DEADLINE      ((DWORD)-1)
+
+typedef struct _MetcliClient MetcliClient;
+typedef struct _MetcliFuture MetcliFuture;
+
+// Output routine -- sends a packet's bytes to the server. A failure is
+// reported back by the metcli call that produced the packet.
+typedef DWORD (*MetcliOutput)(LPVOID context, PUCHAR buffer, DWORD length);
+
+// Completion routine for a request. The response is NULL if the request timed
+// out or was cancelled, and is destroyed once the routine returns.
+typedef VOID (*MetcliCallback)(MetcliClient *client, LPVOID context,
+		DWORD result, Packet *response);
+
+// Handler for requests made by the server that the library doesn't handle
+// itself. The result is sent back in the response.
+typedef DWORD (*MetcliRequestHandler)(MetcliClient *client, LPVOID context,
+		Packet *request);
+
+// Routines that hear about what happens on a channel, any of them can be NULL
+typedef struct _MetcliChannelHandlers
+{
+	LPVOID context;
+
+	// Data from the channel, in order, whether the server pushed it or a read
+	// returned it
+	VOID (*data)(MetcliClient *client, DWORD channelId, LPVOID context,
+			PUCHAR buffer, DWORD length);
+	// A queued write has been acknowledged by the server
+	VOID (*written)(MetcliClient *client, DWORD channelId, LPVOID context,
+			DWORD result, DWORD length);
+	// Reading has stopped, at the end of the channel's data if the result is
+	// ERROR_SUCCESS
+	VOID (*readEnd)(MetcliClient *client, DWORD channelId, LPVOID context,
+			DWORD result);
+	// The server closed the channel, it has been detached
+	VOID (*closed)(MetcliClient *client, DWORD channelId, LPVOID context);
+} MetcliChannelHandlers;
+
+/*
+ * Client lifetime and event loop integration
+ */
+LINKAGE MetcliClient *metcli_create(MetcliOutput output, LPVOID context);
+LINKAGE VOID metcli_destroy(MetcliClient *client);
+LINKAGE DWORD metcli_input(MetcliClient *client, PUCHAR buffer, DWORD length);
+LINKAGE DWORD metcli_tick(MetcliClient *client);
+LINKAGE DWORD metcli_outstanding(MetcliClient *client);
+LINKAGE VOID metcli_set_request_handler(MetcliClient *client,
+		MetcliRequestHandler handler, LPVOID context);
+
+/*
+ * Requests
+ */
+LINKAGE DWORD metcli_request(MetcliClient *client, Packet *request,
+		DWORD timeout, MetcliCallback callback, LPVOID context);
+LINKAGE MetcliFuture *metcli_request_future(MetcliClient *client,
+		Packet *request, DWORD timeout);
+LINKAGE BOOL metcli_future_done(MetcliFuture *future);
+LINKAGE DWORD metcli_future_result(MetcliFuture *future);
+LINKAGE Packet *metcli_future_response(MetcliFuture *future);
+LINKAGE VOID metcli_future_release(MetcliFuture *future);
+
+/*
+ * Pipelined channel I/O
+ */
+LINKAGE DWORD metcli_channel_attach(MetcliClient *client, DWORD channelId,
+		MetcliChannelHandlers *handlers);
+LINKAGE VOID metcli_channel_detach(MetcliClient *client, DWORD channelId);
+LINKAGE DWORD metcli_channel_set_window(MetcliClient *client, DWORD channelId,
+		DWORD window);
+LINKAGE DWORD metcli_channel_write(MetcliClient *client, DWORD channelId,
+		PUCHAR buffer, DWORD length);
+LINKAGE DWORD metcli_channel_read(MetcliClient *client, DWORD channelId,
+		DWORD length);
+LINKAGE DWORD metcli_channel_queued(MetcliClient *client, DWORD channelId);
+
+#endif
@@ -115,7 +115,7 @@ DWORD cmd_read(Remote *remote, UINT argc, CHAR **argv)
 	ChannelCompletionRoutine complete;
 	DWORD channelId = 0, length = 4096;
 	DWORD res = ERROR_SUCCESS;
-	Channel *channel;
+	Channel *channel = NULL;
 
 	do
 	{
@@ -133,7 +133,7 @@ DWORD cmd_read(Remote *remote, UINT argc, CHAR **argv)
 		if (argc > 2)
 			length = strtoul(argv[2], NULL, 10);
 
-		if (!(channel = channel_find_by_id(channelId)))
+		if (!(channel = channel_find_by_id(remote, channelId)))
 		{
 			console_write_output("Error: Could not locate channel %lu.\n", 
 					channelId);
@@ -157,6 +157,9 @@ DWORD cmd_read(Remote *remote, UINT argc, CHAR **argv)
 
 	} while (0);
 
+	if (channel)
+		channel_release(channel);
+
 	return ERROR_SUCCESS;
 }
 
@@ -194,7 +197,7 @@ DWORD cmd_write(Remote *remote, UINT argc, CHAR **argv)
 	ChannelCompletionRoutine complete;
 	DWORD channelId = 0;
 	DWORD res = ERROR_SUCCESS;
-	Channel *channel;
+	Channel *channel = NULL;
 	DWORD length = 0;
 	LONG bytesRead;
 	PCHAR buffer = NULL;
@@ -214,7 +217,7 @@ DWORD cmd_write(Remote *remote, UINT argc, CHAR **argv)
 
 		channelId = strtoul(argv[1], NULL, 10);
 
-		if (!(channel = channel_find_by_id(channelId)))
+		if (!(channel = channel_find_by_id(remote, channelId)))
 		{
 			console_write_output("Error: Could not locate channel %lu.\n", 
 					channelId);
@@ -282,6 +285,9 @@ DWORD cmd_write(Remote *remote, UINT argc, CHAR **argv)
 
 	} while (0);
 
+	if (channel)
+		channel_release(channel);
+
 	return ERROR_SUCCESS;
 }
 
@@ -296,7 +302,7 @@ DWORD cmd_close(Remote *remote, UINT argc, CHAR **argv)
 {
 	DWORD res = ERROR_SUCCESS;
 	DWORD channelId;
-	Channel *channel;
+	Channel *channel = NULL;
 
 	do
 	{
@@ -311,7 +317,7 @@ DWORD cmd_close(Remote *remote, UINT argc, CHAR **argv)
 		channelId = strtoul(argv[1], NULL, 10);
 
 		// Find the channel
-		if (!(channel = channel_find_by_id(channelId)))
+		if (!(channel = channel_find_by_id(remote, channelId)))
 		{
 			console_write_output("Error: Could not locate channel id %lu.\n", 
 					channelId);
@@ -330,6 +336,9 @@ DWORD cmd_close(Remote *remote, UINT argc, CHAR **argv)
 
 	} while (0);
 
+	if (channel)
+		channel_release(channel);
+
 	return res;
 }
 
@@ -372,7 +381,7 @@ DWORD cmd_interact(Remote *remote, UINT argc, CHAR **argv)
 {
 	ChannelCompletionRoutine complete;
 	DWORD res = ERROR_SUCCESS;
-	Channel *channel;
+	Channel *channel = NULL;
 
 	do
 	{
@@ -385,7 +394,7 @@ DWORD cmd_interact(Remote *remote, UINT argc, CHAR **argv)
 		}
 
 		// Try to find the channel context from the supplied identifier
-		if (!(channel = channel_find_by_id(strtoul(argv[1], NULL, 10))))
+		if (!(channel = channel_find_by_id(remote, strtoul(argv[1], NULL, 10))))
 		{
 			console_write_output(
 					"Error: The channel identifier %s could not be found.\n",
@@ -409,6 +418,9 @@ DWORD cmd_interact(Remote *remote, UINT argc, CHAR **argv)
 
 	} while (0);
 
+	if (channel)
+		channel_release(channel);
+
 	return res;
 }
 
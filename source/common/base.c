@@ -15,6 +15,9 @@ extern DWORD remote_request_core_channel_seek( Remote *remote, Packet *packet );
 extern DWORD remote_request_core_channel_eof( Remote *remote, Packet *packet );
 extern DWORD remote_request_core_channel_tell( Remote *remote, Packet *packet );
 extern DWORD remote_request_core_channel_interact( Remote *remote, Packet *packet );
+extern DWORD remote_request_core_channel_set_limits( Remote *remote, Packet *packet );
+extern DWORD remote_request_core_channel_stats( Remote *remote, Packet *packet );
+extern DWORD remote_request_core_bwtest( Remote *remote, Packet *packet );
 
 extern DWORD remote_request_core_crypto_negotiate( Remote *remote, Packet *packet );
 
@@ -30,6 +33,7 @@ extern DWORD remote_request_core_transport_setcerthash(Remote* remote, Packet* p
 extern BOOL remote_request_core_transport_change( Remote *remote, Packet *packet, DWORD* pResult );
 #endif
 extern BOOL remote_request_core_migrate( Remote *remote, Packet *packet, DWORD* pResult );
+extern BOOL remote_request_core_ping( Remote *remote, Packet *packet, DWORD* pResult );
 
 // Local remote response implementors
 extern DWORD remote_response_core_console_write( Remote *remote, Packet *packet );
@@ -37,6 +41,12 @@ extern DWORD remote_response_core_console_write( Remote *remote, Packet *packet
 extern DWORD remote_response_core_channel_open( Remote *remote, Packet *packet );
 extern DWORD remote_response_core_channel_close( Remote *remote, Packet *packet );
 
+// Argument schemas for the hot channel requests
+extern TlvSchema CoreChannelRequestSchema;
+extern TlvSchema CoreChannelWriteRequestSchema;
+extern TlvSchema CoreChannelReadRequestSchema;
+extern TlvSchema CoreChannelSeekRequestSchema;
+
 DWORD remote_request_core_console_write( Remote *remote, Packet *packet )
 {
 	return ERROR_SUCCESS;
@@ -67,17 +77,24 @@ Command baseCommands[] =
 	// Native Channel commands
 	// this overloads the "core_channel_open" in the base command list
 	COMMAND_REQ_REP("core_channel_open", remote_request_core_channel_open, remote_response_core_channel_open),
-	COMMAND_REQ("core_channel_write", remote_request_core_channel_write),
+	COMMAND_REQ_SCHEMA("core_channel_write", remote_request_core_channel_write, CoreChannelWriteRequestSchema),
 	COMMAND_REQ_REP("core_channel_close", remote_request_core_channel_close, remote_response_core_channel_close),
 
 	// Buffered/Pool channel commands
-	COMMAND_REQ("core_channel_read", remote_request_core_channel_read),
+	COMMAND_REQ_SCHEMA("core_channel_read", remote_request_core_channel_read, CoreChannelReadRequestSchema),
 	// Pool channel commands
-	COMMAND_REQ("core_channel_seek", remote_request_core_channel_seek),
-	COMMAND_REQ("core_channel_eof", remote_request_core_channel_eof),
-	COMMAND_REQ("core_channel_tell", remote_request_core_channel_tell),
+	COMMAND_REQ_SCHEMA("core_channel_seek", remote_request_core_channel_seek, CoreChannelSeekRequestSchema),
+	COMMAND_REQ_SCHEMA("core_channel_eof", remote_request_core_channel_eof, CoreChannelRequestSchema),
+	COMMAND_REQ_SCHEMA("core_channel_tell", remote_request_core_channel_tell, CoreChannelRequestSchema),
 	// Soon to be deprecated
 	COMMAND_REQ("core_channel_interact", remote_request_core_channel_interact),
+	// Rate limits on outbound channel data
+	COMMAND_REQ("core_channel_set_limits", remote_request_core_channel_set_limits),
+	// Per-channel traffic counters
+	COMMAND_REQ("core_channel_stats", remote_request_core_channel_stats),
+	// Link diagnostics
+	COMMAND_INLINE_REQ("core_ping", remote_request_core_ping),
+	COMMAND_REQ("core_bwtest", remote_request_core_bwtest),
 	// Crypto
 	COMMAND_REQ("core_crypto_negotiate", remote_request_core_crypto_negotiate),
 	// timeouts
@@ -90,6 +107,8 @@ Command baseCommands[] =
 	// transport switching
 	COMMAND_INLINE_REQ("core_transport_change", remote_request_core_transport_change),
 #endif
+	// Command cache
+	COMMAND_REQ("core_cache", request_core_cache),
 	// Migration
 	COMMAND_INLINE_REQ("core_migrate", remote_request_core_migrate),
 	// Shutdown
@@ -207,6 +226,12 @@ DWORD command_deregister(Command *command)
 			current->next->prev = prev;
 		}
 
+		// Cached responses refer to the command
+		if (current->request.cacheTtl)
+		{
+			command_cache_flush(current);
+		}
+
 		// Deallocate it
 		free(current);
 
@@ -218,20 +243,275 @@ DWORD command_deregister(Command *command)
 	return res;
 }
 
-/*! @brief A list of all command threads currenlty executing. */
-LIST * commandThreadList = NULL;
+/*!
+ * @brief Command groups registered with \c command_register_group.
+ */
+CommandGroup* commandGroups = NULL;
+
+static DWORD command_group_stub(Remote *remote, Packet *packet);
+
+/*!
+ * @brief Attempt to locate the extension command that implements a method, ignoring group stubs.
+ * @param method String that identifies the command.
+ * @returns Pointer to the command entry in the extensions command list, or \c NULL.
+ */
+static Command* command_locate_implementation(LPCSTR method)
+{
+	Command* command;
+
+	for (command = extensionCommands; command; command = command->next)
+	{
+		if (command->request.handler != command_group_stub && strcmp(command->method, method) == 0)
+		{
+			return command;
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * @brief Request handler that stands in for every method of a command group.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Pointer to the request packet.
+ * @returns Indication of success or failure.
+ * @remark The first call asks the client for the group's image. Every call waits for
+ *         the image to be loaded and is then handed to the real command. Clients that
+ *         haven't advertised \c CLIENT_CAPABILITY_LOADLIB_REQUEST would never answer,
+ *         so their calls fail straight away with \c ERROR_NOT_SUPPORTED instead.
+ */
+static DWORD command_group_stub(Remote *remote, Packet *packet)
+{
+	CommandGroup* group;
+	Command* command = NULL;
+	LPCSTR method = packet_get_tlv_value_string(packet, TLV_TYPE_METHOD);
+	Packet* request;
+	Packet* response;
+	DWORD index;
+	DWORD waited = 0;
+	DWORD result = ERROR_NOT_FOUND;
+
+	do
+	{
+		if (!method)
+		{
+			break;
+		}
+
+		for (group = commandGroups; group; group = group->next)
+		{
+			for (index = 0; group->methods[index] && strcmp(group->methods[index], method); index++)
+			{
+			}
+
+			if (group->methods[index])
+			{
+				break;
+			}
+		}
+
+		if (!group)
+		{
+			break;
+		}
+
+		if (!group->loaded && !(remote->client_capabilities & CLIENT_CAPABILITY_LOADLIB_REQUEST))
+		{
+			dprintf("[GROUP] %s is implemented by %s, which the client can't be asked for", method, group->image);
+			result = ERROR_NOT_SUPPORTED;
+			break;
+		}
+
+#ifdef _WIN32
+		if (!group->loaded && InterlockedCompareExchange(&group->requested, 1, 0) == 0)
+#else
+		if (!group->loaded && __atomic_cmpxchg(0, 1, (volatile int *)&group->requested) == 0)
+#endif
+		{
+			dprintf("[GROUP] %s is implemented by %s, asking for it", method, group->image);
+			if ((request = packet_create(PACKET_TLV_TYPE_REQUEST, "core_loadlib_request")) != NULL)
+			{
+				packet_add_tlv_string(request, TLV_TYPE_LIBRARY_PATH, group->image);
+				PACKET_TRANSMIT(remote, request, NULL);
+			}
+		}
+
+		while (!group->loaded && waited < COMMAND_GROUP_TIMEOUT)
+		{
+			if (!event_poll(group->event, 1000))
+			{
+				waited++;
+			}
+		}
+
+		if (!group->loaded)
+		{
+			dprintf("[GROUP] %s was not loaded in time", group->image);
+			// let the next call ask again
+			group->requested = 0;
+			break;
+		}
+
+		// the event resets when it wakes a waiter, so pass the wake up on to any others
+		event_signal(group->event);
+
+		command = command_locate_implementation(method);
+	} while (0);
+
+	if (command == NULL || command->request.handler == NULL)
+	{
+		// the macro names its response more than once, so it can't be created inline
+		response = packet_create_response(packet);
+		packet_transmit_response(result, remote, response);
+		return result;
+	}
+
+	if (command_validate_arguments(command, packet) != ERROR_SUCCESS)
+	{
+		response = packet_create_response(packet);
+		packet_transmit_response(ERROR_INVALID_PARAMETER, remote, response);
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	return command->request.handler(remote, packet);
+}
+
+/*!
+ * @brief Register a group of commands that are implemented by a separate image.
+ * @param group Pointer to the group, which must remain valid until it is deregistered.
+ * @return `ERROR_SUCCESS` when the group's stubs were registered, otherwise returns the error.
+ * @remark Methods that an already loaded image implements don't get a stub.
+ */
+DWORD command_register_group(CommandGroup *group)
+{
+	Command stub = COMMAND_REQ(NULL, command_group_stub);
+	DWORD index;
+	DWORD res = ERROR_SUCCESS;
+
+	if (!(group->event = event_create()))
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	group->requested = 0;
+	group->loaded = FALSE;
+
+	for (index = 0; group->methods[index] && res == ERROR_SUCCESS; index++)
+	{
+		if (command_locate_implementation(group->methods[index]))
+		{
+			group->loaded = TRUE;
+			continue;
+		}
+
+		stub.method = group->methods[index];
+		res = command_register(&stub);
+	}
+
+	group->next = commandGroups;
+	commandGroups = group;
+
+	return res;
+}
+
+/*!
+ * @brief Deregister a group of commands, removing any stubs that are still registered.
+ * @param group Pointer to the group that was passed to \c command_register_group.
+ */
+VOID command_deregister_group(CommandGroup *group)
+{
+	CommandGroup** link;
+	Command* current;
+	Command* next;
+	DWORD index;
+
+	for (link = &commandGroups; *link; link = &(*link)->next)
+	{
+		if (*link == group)
+		{
+			*link = group->next;
+			break;
+		}
+	}
+
+	for (current = extensionCommands; current; current = next)
+	{
+		next = current->next;
+
+		if (current->request.handler != command_group_stub)
+		{
+			continue;
+		}
+
+		for (index = 0; group->methods[index] && strcmp(group->methods[index], current->method); index++)
+		{
+		}
+
+		if (group->methods[index])
+		{
+			if (current->prev)
+			{
+				current->prev->next = current->next;
+			}
+			else
+			{
+				extensionCommands = current->next;
+			}
+
+			if (current->next)
+			{
+				current->next->prev = current->prev;
+			}
+
+			free(current);
+		}
+	}
+
+	event_destroy(group->event);
+	group->event = NULL;
+}
+
+/*!
+ * @brief Notify the command groups that an extension image has been loaded.
+ * @param name Name of the extension that was loaded.
+ * @remark Calls that are waiting for the group the extension implements are released.
+ */
+VOID command_group_loaded(LPCSTR name)
+{
+	CommandGroup* group;
+
+	for (group = commandGroups; group; group = group->next)
+	{
+		if (strcmp(group->name, name) == 0)
+		{
+			dprintf("[GROUP] %s has been loaded", group->image);
+			group->loaded = TRUE;
+			event_signal(group->event);
+		}
+	}
+}
+
+#ifndef _WIN32
+/*! @brief Number of attempts to start the zombie thread reaper, only the first one does. */
+int commandReaperStarted = 0;
+#endif
 
 /*!
- * @brief Block untill all running command threads have finished.
+ * @brief Block untill all command threads running on behalf of a session have finished.
+ * @param remote Pointer to the \c Remote of the session.
  */
-VOID command_join_threads(VOID)
+VOID command_join_threads(Remote *remote)
 {
-	while (list_count(commandThreadList) > 0)
+	while (list_count(remote->command_threads) > 0)
 	{
-		THREAD * thread = (THREAD *)list_get(commandThreadList, 0);
-		if (thread)
+		THREAD * thread = (THREAD *)list_get(remote->command_threads, 0);
+
+		// a finishing command thread destroys itself if it gets to take itself
+		// off the list first, so only join the threads taken off it here
+		if (thread && list_remove(remote->command_threads, thread))
 		{
 			thread_join(thread);
+			thread_destroy(thread);
 		}
 	}
 }
@@ -324,7 +604,8 @@ BOOL command_process_inline(Command *baseCommand, Command *extensionCommand, Rem
 						dprintf("[DISPATCH] executing inline request handler %s", lpMethod);
 						serverContinue = command->request.inline_handler(remote, packet, &result) && serverContinue;
 					}
-					else
+					// commands registered for one direction only have nothing to run for the other
+					else if (command->request.handler)
 					{
 						dprintf("[DISPATCH] executing request handler %s", lpMethod);
 						result = command->request.handler(remote, packet);
@@ -337,7 +618,7 @@ BOOL command_process_inline(Command *baseCommand, Command *extensionCommand, Rem
 						dprintf("[DISPATCH] executing inline response handler %s", lpMethod);
 						serverContinue = command->response.inline_handler(remote, packet, &result) && serverContinue;
 					}
-					else
+					else if (command->response.handler)
 					{
 						dprintf("[DISPATCH] executing response handler %s", lpMethod);
 						result = command->response.handler(remote, packet);
@@ -447,6 +728,7 @@ BOOL command_handle(Remote *remote, Packet *packet)
 	Command** commands = NULL;
 	Packet* response = NULL;
 	PCHAR lpMethod = NULL;
+	PacketTlvType packetTlvType;
 	Tlv methodTlv;
 
 	do
@@ -462,6 +744,20 @@ BOOL command_handle(Remote *remote, Packet *packet)
 		baseCommand = command_locate_base(lpMethod);
 		extensionCommand = command_locate_extension(lpMethod);
 
+		packetTlvType = packet_get_type(packet);
+		if (packetTlvType == PACKET_TLV_TYPE_REQUEST || packetTlvType == PACKET_TLV_TYPE_PLAIN_REQUEST)
+		{
+			command_cache_invalidate(lpMethod);
+
+			// cacheable requests that have been answered recently don't need their handler
+			if (baseCommand == NULL && extensionCommand && extensionCommand->request.cacheTtl
+				&& command_cache_answer(remote, extensionCommand, packet))
+			{
+				packet_destroy(packet);
+				break;
+			}
+		}
+
 		if (baseCommand == NULL && extensionCommand == NULL) {
 			dprintf("[DISPATCH] Command not found: %s", lpMethod);
 			// We have no matching command for this packet, so it won't get handled. We
@@ -491,6 +787,9 @@ BOOL command_handle(Remote *remote, Packet *packet)
 			if (cpt)
 			{
 				dprintf("[DISPATCH] created command_process_thread 0x%08X, handle=0x%08X", cpt, cpt->handle);
+
+				// listed before it runs, so that command_join_threads can't miss it
+				list_add(remote->command_threads, cpt);
 				thread_run(cpt);
 			}
 		}
@@ -537,29 +836,22 @@ DWORD THREADCALL command_process_thread(THREAD * thread)
 		return ERROR_INVALID_DATA;
 	}
 
-	if (commandThreadList == NULL)
-	{
-		commandThreadList = list_create();
-		if (commandThreadList == NULL)
-		{
-			return ERROR_INVALID_HANDLE;
-		}
-
 #ifndef _WIN32
+	// the reaper is shared by every session in the process
+	if (__atomic_inc(&commandReaperStarted) == 0)
+	{
 		pthread_t tid;
 		pthread_create(&tid, NULL, reap_zombie_thread, NULL);
 		dprintf("reap_zombie_thread created, thread_id : 0x%x",tid);
-#endif
 	}
-
-	list_add(commandThreadList, thread);
+#endif
 
 	// invoke processing inline, passing in both commands
 	dprintf("[COMMAND] About to execute inline -> Commands: %p Command1: %p Command2: %p", commands, *commands, *(commands + 1));
 	command_process_inline(*commands, *(commands + 1), remote, packet);
 	dprintf("[COMMAND] Executed inline -> Commands: %p Command1: %p Command2: %p", commands, *commands, *(commands + 1));
 
-	if (list_remove(commandThreadList, thread))
+	if (list_remove(remote->command_threads, thread))
 	{
 		thread_destroy(thread);
 	}
@@ -617,6 +909,12 @@ DWORD command_validate_arguments(Command *command, Packet *packet)
 	else
 		dispatcher = &command->request;
 
+	// Commands with a schema are validated (and decoded) in a single pass
+	if (dispatcher->schema)
+	{
+		return packet_validate_schema(packet, dispatcher->schema);
+	}
+
 	// Enumerate the arguments, validating the meta types of each
 	for (commandIndex = 0, packetIndex = 0;
 		((packet_enum_tlv(packet, packetIndex, TLV_TYPE_ANY, &current) == ERROR_SUCCESS)
@@ -39,6 +39,31 @@ typedef BOOL(*INLINE_DISPATCH_ROUTINE)(Remote *remote, Packet *packet, DWORD* re
  * @remarks The request handler will be executed on a separate thread.
  */
 #define COMMAND_REP(name, repHandler) { name, { EMPTY_DISPATCH_HANDLER }, { repHandler, NULL, EMPTY_TLV } }
+/*!
+ * @brief Helper macro that defines a command instance with a request handler whose
+ *        arguments are validated against a TLV schema.
+ * @remarks The request handler will be executed on a separate thread. The decoded
+ *          arguments are cached on the packet, so the handler's own \c packet_decode
+ *          call with the same schema does not walk the packet again.
+ */
+#define COMMAND_REQ_SCHEMA(name, reqHandler, schema) { name, { reqHandler, NULL, EMPTY_TLV, &schema }, { EMPTY_DISPATCH_HANDLER } }
+/*!
+ * @brief Helper macro that defines a command instance with a request handler whose
+ *        successful responses are cached.
+ * @remarks Repeats of a request with the same arguments within \c ttl seconds are
+ *          answered from the cache without running the handler. \c invalidatedBy is
+ *          an optional \c NULL terminated list of methods that flush the cached
+ *          responses when they are called. A \c ttl of zero disables caching.
+ * @sa command_cache.h
+ */
+#define COMMAND_REQ_CACHED(name, reqHandler, ttl, invalidatedBy) { name, { reqHandler, NULL, EMPTY_TLV, NULL, ttl, invalidatedBy }, { EMPTY_DISPATCH_HANDLER } }
+/*!
+ * @brief Helper macro that defines a command instance with a request handler whose
+ *        arguments are validated against a TLV schema and whose responses are cached.
+ * @sa COMMAND_REQ_SCHEMA
+ * @sa COMMAND_REQ_CACHED
+ */
+#define COMMAND_REQ_SCHEMA_CACHED(name, reqHandler, schema, ttl, invalidatedBy) { name, { reqHandler, NULL, EMPTY_TLV, &schema, ttl, invalidatedBy }, { EMPTY_DISPATCH_HANDLER } }
 /*!
  * @brief Helper macro that defines a command instance with both a request and response handler.
  * @remarks The request handler will be executed on a separate thread.
@@ -82,6 +107,20 @@ typedef struct
 	TlvMetaType             argumentTypes[MAX_CHECKED_ARGUMENTS];
 	/*! @brief The number of entries in the \c argumentTypes array. */
 	DWORD                   numArgumentTypes;
+
+	/*!
+	 * @brief Optional schema that the packet is validated against.
+	 * @remark When specified, this replaces the generic argument validation.
+	 */
+	TlvSchema*              schema;
+
+	/*!
+	 * @brief Number of seconds that successful responses are cached for.
+	 * @remark Zero, the default, means that responses are never cached.
+	 */
+	DWORD                   cacheTtl;
+	/*! @brief Optional \c NULL terminated list of methods that invalidate the cached responses. */
+	LPCSTR*                 cacheInvalidatedBy;
 } PacketDispatcher;
 
 /*!
@@ -98,12 +137,41 @@ typedef struct command
 	struct command   *prev;      ///< Pointer to the previous command in the command list.
 } Command;
 
+/*!
+ * @brief A group of extension commands whose implementation lives in a separate image.
+ * @details Registering a group installs a stub for each of its methods. The first
+ *          time one of the stubs is called, the client is asked to load the group's
+ *          image with an unsolicited \c core_loadlib_request, and the call is held
+ *          until the image has registered the real commands, which then handle it.
+ *          Only sessions whose client advertised \c CLIENT_CAPABILITY_LOADLIB_REQUEST
+ *          are asked, the stubs fail for any other until the image is loaded.
+ */
+typedef struct _CommandGroup
+{
+	LPCSTR  name;       ///< Extension name reported by the group's image.
+	LPCSTR  image;      ///< Name of the image, sent to the client so that it knows what to load.
+	LPCSTR* methods;    ///< NULL terminated list of the methods implemented by the image.
+
+	// Internal -- not stored
+	LONG    requested;  ///< Non-zero once the client has been asked for the image.
+	BOOL    loaded;     ///< Set once the image has registered its commands.
+	struct _EVENT* event;          ///< Signalled when the image has been loaded.
+	struct _CommandGroup* next;    ///< Pointer to the next registered group.
+} CommandGroup;
+
+/*! @brief Number of seconds a stub waits for its group's image to be loaded. */
+#define COMMAND_GROUP_TIMEOUT  60
+
 LINKAGE void command_register_all(Command commands[]);
 LINKAGE void command_deregister_all(Command commands[]);
 LINKAGE DWORD command_register(Command *command);
 LINKAGE DWORD command_deregister(Command *command);
 
-LINKAGE VOID command_join_threads( VOID );
+LINKAGE DWORD command_register_group(CommandGroup *group);
+LINKAGE VOID command_deregister_group(CommandGroup *group);
+LINKAGE VOID command_group_loaded(LPCSTR name);
+
+LINKAGE VOID command_join_threads( Remote *remote );
 
 LINKAGE BOOL command_handle( Remote *remote, Packet *packet );
 
@@ -1,5 +1,66 @@
 #include "common.h"
 
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+/*!
+ * @brief Arguments common to the channel requests that only identify a channel.
+ */
+#define CORE_CHANNEL_FIELDS(F, S) \
+	F(S, UINT, channelId, TLV_TYPE_CHANNEL_ID, TLV_SCHEMA_REQUIRED)
+TLV_SCHEMA_DECLARE(CoreChannelRequest, CORE_CHANNEL_FIELDS)
+TLV_SCHEMA_DEFINE(CoreChannelRequest, CORE_CHANNEL_FIELDS)
+
+/*! @brief Arguments for \c core_channel_write. */
+#define CORE_CHANNEL_WRITE_FIELDS(F, S) \
+	F(S, UINT, channelId, TLV_TYPE_CHANNEL_ID, TLV_SCHEMA_REQUIRED) \
+	F(S, RAW, data, TLV_TYPE_CHANNEL_DATA, TLV_SCHEMA_REQUIRED)
+TLV_SCHEMA_DECLARE(CoreChannelWriteRequest, CORE_CHANNEL_WRITE_FIELDS)
+TLV_SCHEMA_DEFINE(CoreChannelWriteRequest, CORE_CHANNEL_WRITE_FIELDS)
+
+/*! @brief Arguments for \c core_channel_read. */
+#define CORE_CHANNEL_READ_FIELDS(F, S) \
+	F(S, UINT, channelId, TLV_TYPE_CHANNEL_ID, TLV_SCHEMA_REQUIRED) \
+	F(S, UINT, length, TLV_TYPE_LENGTH, TLV_SCHEMA_REQUIRED)
+TLV_SCHEMA_DECLARE(CoreChannelReadRequest, CORE_CHANNEL_READ_FIELDS)
+TLV_SCHEMA_DEFINE(CoreChannelReadRequest, CORE_CHANNEL_READ_FIELDS)
+
+/*! @brief Arguments for \c core_channel_seek. */
+#define CORE_CHANNEL_SEEK_FIELDS(F, S) \
+	F(S, UINT, channelId, TLV_TYPE_CHANNEL_ID, TLV_SCHEMA_REQUIRED) \
+	F(S, UINT, offset, TLV_TYPE_SEEK_OFFSET, 0) \
+	F(S, QWORD, offset64, TLV_TYPE_SEEK_OFFSET64, 0) \
+	F(S, UINT, whence, TLV_TYPE_SEEK_WHENCE, 0)
+TLV_SCHEMA_DECLARE(CoreChannelSeekRequest, CORE_CHANNEL_SEEK_FIELDS)
+TLV_SCHEMA_DEFINE(CoreChannelSeekRequest, CORE_CHANNEL_SEEK_FIELDS)
+
+/*! @brief Arguments for \c core_bwtest. */
+#define CORE_BWTEST_FIELDS(F, S) \
+	F(S, QWORD, length, TLV_TYPE_BWTEST_LENGTH, TLV_SCHEMA_REQUIRED) \
+	F(S, UINT, direction, TLV_TYPE_BWTEST_DIRECTION, 0) \
+	F(S, UINT, chunk, TLV_TYPE_BWTEST_CHUNK, 0)
+TLV_SCHEMA_DECLARE(CoreBwTestRequest, CORE_BWTEST_FIELDS)
+TLV_SCHEMA_DEFINE(CoreBwTestRequest, CORE_BWTEST_FIELDS)
+
+/*! @brief Number of bytes in each write of a \c core_bwtest when none is given. */
+#define BWTEST_DEFAULT_CHUNK    (64 * 1024)
+/*! @brief Largest number of bytes in each write of a \c core_bwtest. */
+#define BWTEST_MAX_CHUNK        (1024 * 1024)
+
+/*! @brief State of a \c core_bwtest channel. */
+typedef struct _BwTestContext
+{
+	Remote* remote;
+	Channel* channel;
+	THREAD* thread;           ///< Thread writing the data when the server sends, NULL when it receives.
+	QWORD length;             ///< Number of bytes to send or to expect.
+	QWORD transferred;        ///< Number of bytes sent or received so far.
+	QWORD start;              ///< Time of the first write, in microseconds.
+	ULONG chunk;              ///< Number of bytes in each write when the server sends.
+	BOOL finished;            ///< Set once the results have been sent.
+} BwTestContext;
+
 /*
  * core_channel_open
  * -----------------
@@ -39,7 +100,7 @@ DWORD remote_request_core_channel_open(Remote *remote, Packet *packet)
 		response = packet_create_response(packet);
 		
 		// Did the response allocation fail?
-		if ((!response) || (!(newChannel = channel_create(0, flags))))
+		if ((!response) || (!(newChannel = channel_create(remote, 0, flags))))
 		{
 			res = ERROR_NOT_ENOUGH_MEMORY;
 			break;
@@ -96,7 +157,7 @@ DWORD remote_response_core_channel_open(Remote *remote, Packet *packet)
 		}
 
 		// Create a local instance of the channel with the supplied identifier
-		if (!(newChannel = channel_create(channelId, 0)))
+		if (!(newChannel = channel_create(remote, channelId, 0)))
 		{
 			res = ERROR_NOT_ENOUGH_MEMORY;
 			break;
@@ -112,20 +173,29 @@ DWORD remote_response_core_channel_open(Remote *remote, Packet *packet)
  * ------------------
  *
  * Write data from a channel into the local output buffer for it
+ *
+ * opt: TLV_TYPE_CHANNEL_SEQUENCE -- Runs the write in sequence with the
+ *                                   channel's other pipelined requests
  */
 DWORD remote_request_core_channel_write(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
-	DWORD res = ERROR_SUCCESS, channelId, written = 0;
+	DWORD res = ERROR_SUCCESS, channelId = 0, written = 0;
+	CoreChannelWriteRequest args;
 	Tlv channelData;
 	Channel * channel = NULL;
+	QWORD start;
 
 	do
 	{
-		channelId = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID);
+		if ((res = packet_decode(packet, &CoreChannelWriteRequestSchema, &args)) != ERROR_SUCCESS)
+			break;
+
+		channelId = args.channelId;
+		channelData = args.data;
 
 		// Try to locate the specified channel
-		if (!(channel = channel_find_by_id(channelId)))
+		if (!(channel = channel_find_by_id(remote, channelId)))
 		{
 			res = ERROR_NOT_FOUND;
 			break;
@@ -133,9 +203,9 @@ DWORD remote_request_core_channel_write(Remote *remote, Packet *packet)
 
 		lock_acquire( channel->lock );
 
-		// Get the channel data buffer
-		if ((res = packet_get_tlv(packet, TLV_TYPE_CHANNEL_DATA, &channelData)) != ERROR_SUCCESS)
-			break;
+		channel_wait_sequence(channel, packet);
+
+		start = channel_stats_clock();
 
 		// Handle the write operation differently based on the class of channel
 		switch (channel_get_class(channel))
@@ -159,10 +229,15 @@ DWORD remote_request_core_channel_write(Remote *remote, Packet *packet)
 				break;
 		}
 
+		channel_stats_transfer(channel, CHANNEL_STATS_INBOUND, written, res, start);
+
 	} while (0);
 
 	if( channel )
+	{
 		lock_release( channel->lock );
+		channel_release( channel );
+	}
 
 	// Transmit the acknowledgement
 	if (response)
@@ -187,13 +262,18 @@ DWORD remote_request_core_channel_write(Remote *remote, Packet *packet)
  *
  * req: TLV_TYPE_CHANNEL_ID -- The channel identifier to read from
  * req: TLV_TYPE_LENGTH     -- The number of bytes to read
+ * opt: TLV_TYPE_CHANNEL_SEQUENCE -- Runs the read in sequence with the
+ *                                   channel's other pipelined requests
  */
 DWORD remote_request_core_channel_read(Remote *remote, Packet *packet)
 {
-	DWORD res = ERROR_SUCCESS, bytesToRead, bytesRead, channelId;
+	DWORD res = ERROR_SUCCESS, bytesToRead, bytesRead = 0, channelId = 0;
+	CoreChannelReadRequest args;
 	Packet *response = packet_create_response(packet);
 	PUCHAR temporaryBuffer = NULL;
+	PUCHAR readBuffer = NULL;
 	Channel *channel = NULL;
+	TlvType dataType = TLV_TYPE_CHANNEL_DATA;
 
 	do
 	{
@@ -203,12 +283,15 @@ DWORD remote_request_core_channel_read(Remote *remote, Packet *packet)
 			break;
 		}
 
+		if ((res = packet_decode(packet, &CoreChannelReadRequestSchema, &args)) != ERROR_SUCCESS)
+			break;
+
 		// Get the number of bytes to read
-		bytesToRead = packet_get_tlv_value_uint(packet, TLV_TYPE_LENGTH);
-		channelId   = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID);
+		bytesToRead = args.length;
+		channelId   = args.channelId;
 
 		// Try to locate the specified channel
-		if (!(channel = channel_find_by_id(channelId)))
+		if (!(channel = channel_find_by_id(remote, channelId)))
 		{
 			res = ERROR_NOT_FOUND;
 			break;
@@ -216,8 +299,21 @@ DWORD remote_request_core_channel_read(Remote *remote, Packet *packet)
 
 		lock_acquire( channel->lock );
 
-		// Allocate temporary storage
-		if (!(temporaryBuffer = (PUCHAR)malloc(bytesToRead)))
+		channel_wait_sequence(channel, packet);
+
+		// if the channel data is ment to be compressed, compress it!
+		if( channel_is_flag( channel, CHANNEL_FLAG_COMPRESS ) )
+			dataType = TLV_TYPE_CHANNEL_DATA|TLV_META_TYPE_COMPRESSED;
+
+		// Synchronous channels return the data in the response, so read it
+		// straight into the response payload rather than via a temporary
+		// buffer. Everything else still needs storage of its own.
+		if (channel_is_flag(channel, CHANNEL_FLAG_SYNCHRONOUS))
+		{
+			if ((res = packet_reserve_tlv(response, dataType, bytesToRead, &readBuffer)) != ERROR_SUCCESS)
+				break;
+		}
+		else if (!(readBuffer = temporaryBuffer = (PUCHAR)malloc(bytesToRead)))
 		{
 			res = ERROR_NOT_ENOUGH_MEMORY;
 			break;
@@ -230,7 +326,7 @@ DWORD remote_request_core_channel_read(Remote *remote, Packet *packet)
 			// depending on the mode of the channel.
 			case CHANNEL_CLASS_BUFFERED:
 				// Read in from local
-				res = channel_read_from_buffered(channel, temporaryBuffer, 
+				res = channel_read_from_buffered(channel, readBuffer, 
 				    bytesToRead, (PULONG)&bytesRead);
 				break;
 			// Handle read I/O for the pool class
@@ -238,7 +334,7 @@ DWORD remote_request_core_channel_read(Remote *remote, Packet *packet)
 				// If the channel has a read handler
 				if (channel->ops.pool.read)
 					res = channel->ops.pool.read(channel, packet, 
-							channel->ops.pool.native.context, temporaryBuffer, 
+							channel->ops.pool.native.context, readBuffer, 
 							bytesToRead, &bytesRead);
 				else
 					res = ERROR_NOT_SUPPORTED;
@@ -247,32 +343,35 @@ DWORD remote_request_core_channel_read(Remote *remote, Packet *packet)
 				res = ERROR_NOT_SUPPORTED;
 		}
 
-		// If we've so far been successful and we have a temporary buffer...
-		if ((res == ERROR_SUCCESS) &&(temporaryBuffer) && (bytesRead))
+		// If the data went directly into the response, close off the TLV
+		if (!temporaryBuffer)
 		{
-			// If the channel should operate synchronously, add the data to theresponse
-			if (channel_is_flag(channel, CHANNEL_FLAG_SYNCHRONOUS))
-			{
-				// if the channel data is ment to be compressed, compress it!
-				if( channel_is_flag( channel, CHANNEL_FLAG_COMPRESS ) )
-					packet_add_tlv_raw(response, TLV_TYPE_CHANNEL_DATA|TLV_META_TYPE_COMPRESSED, temporaryBuffer, bytesRead);
-				else
-					packet_add_tlv_raw(response, TLV_TYPE_CHANNEL_DATA, temporaryBuffer, bytesRead);
-
-				res = ERROR_SUCCESS;
-			}
-			// Otherwise, asynchronously write the buffer to the remote endpoint
+			if ((res == ERROR_SUCCESS) && (bytesRead))
+				res = packet_commit_tlv(response, bytesRead);
 			else
-			{
-				if ((res = channel_write(channel, remote, NULL, 0, temporaryBuffer, bytesRead, NULL)) != ERROR_SUCCESS)
-					break;
-			}
+				packet_cancel_tlv(response);
+
+			channel_stats_transfer(channel, CHANNEL_STATS_OUTBOUND, bytesRead, res, 0);
+		}
+		// A failed read is counted here, channel_write counts the rest
+		else if (res != ERROR_SUCCESS)
+		{
+			channel_stats_transfer(channel, CHANNEL_STATS_OUTBOUND, 0, res, 0);
+		}
+		// Otherwise, asynchronously write the buffer to the remote endpoint
+		else if ((res == ERROR_SUCCESS) && (bytesRead))
+		{
+			if ((res = channel_write(channel, remote, NULL, 0, temporaryBuffer, bytesRead, NULL)) != ERROR_SUCCESS)
+				break;
 		}
 
 	} while (0);
 	
 	if( channel )
+	{
 		lock_release( channel->lock );
+		channel_release( channel );
+	}
 
 	if (temporaryBuffer)
 		free(temporaryBuffer);
@@ -312,7 +411,7 @@ DWORD remote_request_core_channel_close(Remote *remote, Packet *packet)
 		channelId = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID);
 
 		// Try to locate the specified channel
-		if (!(channel = channel_find_by_id(channelId)))
+		if (!(channel = channel_find_by_id(remote, channelId)))
 		{
 			res = ERROR_NOT_FOUND;
 			break;
@@ -328,6 +427,9 @@ DWORD remote_request_core_channel_close(Remote *remote, Packet *packet)
 
 	} while (0);
 
+	if (channel)
+		channel_release(channel);
+
 	// Transmit the acknowledgement
 	if (response)
 	{
@@ -358,7 +460,7 @@ DWORD remote_response_core_channel_close(Remote *remote, Packet *packet)
 		channelId = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID);
 
 		// Try to locate the specified channel
-		if (!(channel = channel_find_by_id(channelId)))
+		if (!(channel = channel_find_by_id(remote, channelId)))
 		{
 			res = ERROR_NOT_FOUND;
 			break;
@@ -369,6 +471,9 @@ DWORD remote_response_core_channel_close(Remote *remote, Packet *packet)
 
 	} while (0);
 
+	if (channel)
+		channel_release(channel);
+
 	return res;
 }
 
@@ -379,6 +484,7 @@ DWORD remote_response_core_channel_close(Remote *remote, Packet *packet)
  *
  * req: TLV_TYPE_CHANNEL_ID  -- The channel identifier to seek on
  * req: TLV_TYPE_SEEK_OFFSET -- The offset to seek to
+ * opt: TLV_TYPE_SEEK_OFFSET64 -- The offset to seek to, in place of the 32-bit one
  * req: TLV_TYPE_SEEK_WHENCE -- The relativity to which the offset refers
  */
 DWORD remote_request_core_channel_seek(Remote *remote, Packet *packet)
@@ -386,12 +492,23 @@ DWORD remote_request_core_channel_seek(Remote *remote, Packet *packet)
 	Channel *channel = NULL;
 	Packet *response = packet_create_response(packet);
 	DWORD result = ERROR_SUCCESS;
+	CoreChannelSeekRequest args;
+	LONGLONG offset;
+	Tlv offsetTlv;
 
 	do
 	{
+		if ((result = packet_decode(packet, &CoreChannelSeekRequestSchema, &args)) != ERROR_SUCCESS)
+			break;
+
+		// Older clients only send the 32-bit offset, which is signed
+		if (packet_get_tlv(packet, TLV_TYPE_SEEK_OFFSET64, &offsetTlv) == ERROR_SUCCESS)
+			offset = (LONGLONG)args.offset64;
+		else
+			offset = (LONG)args.offset;
+
 		// Lookup the channel by its identifier
-		if (!(channel = channel_find_by_id(
-				packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID))))
+		if (!(channel = channel_find_by_id(remote, args.channelId)))
 		{
 			result = ERROR_NOT_FOUND;
 			break;
@@ -410,15 +527,17 @@ DWORD remote_request_core_channel_seek(Remote *remote, Packet *packet)
 		if (channel->ops.pool.seek)
 			result = channel->ops.pool.seek(channel, packet, 
 					channel->ops.pool.native.context, 
-					(LONG)packet_get_tlv_value_uint(packet, TLV_TYPE_SEEK_OFFSET),
-					packet_get_tlv_value_uint(packet, TLV_TYPE_SEEK_WHENCE));
+					offset, args.whence);
 		else
 			result = ERROR_NOT_SUPPORTED;
 
 	} while (0);
 	
 	if( channel )
+	{
 		lock_release( channel->lock );
+		channel_release( channel );
+	}
 
 	// Transmit the result
 	packet_transmit_response(result, remote, response);
@@ -438,12 +557,15 @@ DWORD remote_request_core_channel_eof(Remote *remote, Packet *packet)
 	Packet *response = packet_create_response(packet);
 	DWORD result = ERROR_SUCCESS;
 	BOOL isEof = FALSE;
+	CoreChannelRequest args;
 
 	do
 	{
+		if ((result = packet_decode(packet, &CoreChannelRequestSchema, &args)) != ERROR_SUCCESS)
+			break;
+
 		// Lookup the channel by its identifier
-		if (!(channel = channel_find_by_id(
-				packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID))))
+		if (!(channel = channel_find_by_id(remote, args.channelId)))
 		{
 			result = ERROR_NOT_FOUND;
 			break;
@@ -469,7 +591,10 @@ DWORD remote_request_core_channel_eof(Remote *remote, Packet *packet)
 	} while (0);
 	
 	if( channel )
+	{
 		lock_release( channel->lock );
+		channel_release( channel );
+	}
 
 	// Add the EOF flag
 	packet_add_tlv_bool(response, TLV_TYPE_BOOL, isEof);
@@ -485,19 +610,25 @@ DWORD remote_request_core_channel_eof(Remote *remote, Packet *packet)
  * -----------------
  *
  * req: TLV_TYPE_CHANNEL_ID  -- The channel identifier to check tell on
+ *
+ * The position is returned both as TLV_TYPE_SEEK_POS, cut down to 32 bits
+ * for older clients, and in full as TLV_TYPE_SEEK_POS64.
  */
 DWORD remote_request_core_channel_tell(Remote *remote, Packet *packet)
 {
 	Channel *channel = NULL;
 	Packet *response = packet_create_response(packet);
 	DWORD result = ERROR_SUCCESS;
-	LONG offset = 0;
+	LONGLONG offset = 0;
+	CoreChannelRequest args;
 
 	do
 	{
+		if ((result = packet_decode(packet, &CoreChannelRequestSchema, &args)) != ERROR_SUCCESS)
+			break;
+
 		// Lookup the channel by its identifier
-		if (!(channel = channel_find_by_id(
-				packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID))))
+		if (!(channel = channel_find_by_id(remote, args.channelId)))
 		{
 			result = ERROR_NOT_FOUND;
 			break;
@@ -523,10 +654,14 @@ DWORD remote_request_core_channel_tell(Remote *remote, Packet *packet)
 	} while (0);
 
 	if( channel )
+	{
 		lock_release( channel->lock );
+		channel_release( channel );
+	}
 
 	// Add the offset
-	packet_add_tlv_uint(response, TLV_TYPE_SEEK_POS, offset);
+	packet_add_tlv_uint(response, TLV_TYPE_SEEK_POS, (UINT)offset);
+	packet_add_tlv_qword(response, TLV_TYPE_SEEK_POS64, (QWORD)offset);
 
 	// Transmit the response
 	packet_transmit_response(result, remote, response);
@@ -555,7 +690,7 @@ DWORD remote_request_core_channel_interact(Remote *remote, Packet *packet)
 	interact  = packet_get_tlv_value_bool(packet, TLV_TYPE_BOOL);
 
 	// If the channel is found, set the interactive flag accordingly
-	if ((channel = channel_find_by_id(channelId)))
+	if ((channel = channel_find_by_id(remote, channelId)))
 	{
 		lock_acquire( channel->lock );
 
@@ -576,6 +711,7 @@ DWORD remote_request_core_channel_interact(Remote *remote, Packet *packet)
 		channel_set_interactive(channel, interact);
 
 		lock_release( channel->lock );
+		channel_release( channel );
 	}
 
 	// Send the response to the requestor so that the interaction can be 
@@ -585,6 +721,437 @@ DWORD remote_request_core_channel_interact(Remote *remote, Packet *packet)
 	return ERROR_SUCCESS;
 }
 
+/*
+ * core_channel_set_limits
+ * -----------------------
+ *
+ * Sets the rate limit on the outbound data of a channel, or on that of all of
+ * the session's channels together, and returns the limit's counters. Without
+ * a rate the limit is left alone, so the counters can be polled.
+ *
+ * opt: TLV_TYPE_CHANNEL_ID  -- The channel to limit, the whole session if absent
+ * opt: TLV_TYPE_LIMIT_RATE  -- The limit in bytes per second, zero to lift it
+ * opt: TLV_TYPE_LIMIT_BURST -- The number of bytes that can be sent in a burst,
+ *                              a second's worth if absent
+ */
+DWORD remote_request_core_channel_set_limits(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	Channel *channel = NULL;
+	TokenBucket **limit = &remote->channel_limit;
+	LOCK *lock = remote->lock;
+	TokenBucket snapshot;
+	DWORD channelId, rate, burst;
+	DWORD result = ERROR_SUCCESS;
+	Tlv rateTlv;
+
+	if (!response)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	channelId = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID);
+	burst     = packet_get_tlv_value_uint(packet, TLV_TYPE_LIMIT_BURST);
+
+	memset(&snapshot, 0, sizeof(snapshot));
+
+	do
+	{
+		if (channelId)
+		{
+			if (!(channel = channel_find_by_id(remote, channelId)))
+			{
+				result = ERROR_NOT_FOUND;
+				lock = NULL;
+				break;
+			}
+
+			lock = channel->lock;
+			limit = &channel->limit;
+		}
+
+		// the session's bucket is created by whichever request sets a limit first
+		lock_acquire( lock );
+
+		if (packet_get_tlv(packet, TLV_TYPE_LIMIT_RATE, &rateTlv) == ERROR_SUCCESS)
+		{
+			rate = packet_get_tlv_value_uint(packet, TLV_TYPE_LIMIT_RATE);
+
+			dprintf( "[DISPATCH] limiting channel %u to %u bytes/s, %u byte bursts", channelId, rate, burst );
+
+			// the bucket is kept once it exists, so the counters outlive the limit
+			if (*limit)
+			{
+				token_bucket_set(*limit, rate, burst);
+			}
+			else if (rate && !(*limit = token_bucket_create(rate, burst)))
+			{
+				result = ERROR_NOT_ENOUGH_MEMORY;
+				break;
+			}
+		}
+
+		if (*limit)
+		{
+			token_bucket_snapshot(*limit, &snapshot);
+		}
+
+	} while (0);
+
+	if (lock)
+		lock_release( lock );
+
+	if (channel)
+		channel_release( channel );
+
+	packet_add_tlv_uint(response, TLV_TYPE_LIMIT_RATE, snapshot.rate);
+	packet_add_tlv_uint(response, TLV_TYPE_LIMIT_BURST, snapshot.burst);
+	packet_add_tlv_qword(response, TLV_TYPE_LIMIT_BYTES, snapshot.bytes);
+	packet_add_tlv_uint(response, TLV_TYPE_LIMIT_THROTTLED, snapshot.throttled);
+	packet_add_tlv_qword(response, TLV_TYPE_LIMIT_DELAY, snapshot.delayed);
+
+	packet_transmit_response(result, remote, response);
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * core_channel_stats
+ * ------------------
+ *
+ * Returns the traffic counters of every channel in the session, one
+ * TLV_TYPE_CHANNEL_STATS group per channel.
+ */
+DWORD remote_request_core_channel_stats(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	Packet *group;
+	Channel *channel;
+	ChannelStatsSnapshot snapshot;
+	DWORD result = ERROR_SUCCESS;
+
+	lock_acquire(remote->channel_lock);
+
+	for (channel = remote->channel_list; channel; channel = channel->next)
+	{
+		if (!(group = packet_create_group()))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		channel_stats_snapshot(channel, &snapshot);
+
+		packet_add_tlv_uint(group, TLV_TYPE_CHANNEL_ID, channel->identifier);
+		packet_add_tlv_uint(group, TLV_TYPE_CHANNEL_CLASS, channel->cls);
+		if (channel->type)
+			packet_add_tlv_string(group, TLV_TYPE_CHANNEL_TYPE, channel->type);
+		packet_add_tlv_qword(group, TLV_TYPE_CHANNEL_BYTES_IN, snapshot.bytesIn);
+		packet_add_tlv_uint(group, TLV_TYPE_CHANNEL_PACKETS_IN, snapshot.packetsIn);
+		packet_add_tlv_qword(group, TLV_TYPE_CHANNEL_BYTES_OUT, snapshot.bytesOut);
+		packet_add_tlv_uint(group, TLV_TYPE_CHANNEL_PACKETS_OUT, snapshot.packetsOut);
+		packet_add_tlv_uint(group, TLV_TYPE_CHANNEL_BUFFERED, snapshot.buffered);
+		packet_add_tlv_qword(group, TLV_TYPE_CHANNEL_BLOCKED, snapshot.blocked);
+		packet_add_tlv_uint(group, TLV_TYPE_CHANNEL_ERRORS, snapshot.errors);
+		packet_add_tlv_uint(group, TLV_TYPE_CHANNEL_IDLE, snapshot.idle);
+
+		packet_add_group(response, TLV_TYPE_CHANNEL_STATS, group);
+	}
+
+	lock_release(remote->channel_lock);
+
+	packet_transmit_response(result, remote, response);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Get the time used by the link diagnostics, in microseconds.
+ * @return The current time, relative to an arbitrary epoch.
+ */
+static QWORD diagnostic_clock()
+{
+#ifdef _WIN32
+	return (QWORD)GetTickCount() * 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/*
+ * core_ping
+ * ---------
+ *
+ * Echoes the request back straight away, so the requester can time the round
+ * trip. It runs inline, so no command thread is started for it. The server's
+ * times tell how much of the round trip was spent on the server.
+ *
+ * opt: TLV_TYPE_PING_DATA      -- Data to echo back
+ * opt: TLV_TYPE_PING_TIMESTAMP -- The requester's time, echoed back unchanged
+ */
+BOOL remote_request_core_ping(Remote *remote, Packet *packet, DWORD* pResult)
+{
+	QWORD received = diagnostic_clock();
+	Packet *response = packet_create_response(packet);
+	DWORD result = ERROR_SUCCESS;
+	Tlv data;
+
+	do
+	{
+		if (!response)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		if (packet_get_tlv(packet, TLV_TYPE_PING_DATA, &data) == ERROR_SUCCESS)
+		{
+			packet_add_tlv_raw(response, TLV_TYPE_PING_DATA, data.buffer, data.header.length);
+		}
+
+		packet_add_tlv_qword(response, TLV_TYPE_PING_TIMESTAMP, packet_get_tlv_value_qword(packet, TLV_TYPE_PING_TIMESTAMP));
+		packet_add_tlv_qword(response, TLV_TYPE_PING_RECEIVED, received);
+		packet_add_tlv_uint(response, TLV_TYPE_RESULT, ERROR_SUCCESS);
+		packet_add_tlv_qword(response, TLV_TYPE_PING_SENT, diagnostic_clock());
+
+		result = PACKET_TRANSMIT(remote, response, NULL);
+
+	} while (0);
+
+	*pResult = result;
+
+	return TRUE;
+}
+
+/*!
+ * @brief Finish a bandwidth test by closing its channel.
+ * @param ctx Pointer to the test's context.
+ * @remark The close carries the number of bytes that were moved and the time
+ *         between the first write and now.
+ */
+static VOID bwtest_finish(BwTestContext *ctx)
+{
+	QWORD length = htonq(ctx->transferred);
+	QWORD elapsed = htonq(ctx->start ? diagnostic_clock() - ctx->start : 0);
+	Tlv entries[2];
+
+	ctx->finished = TRUE;
+
+	dprintf("[DISPATCH] bandwidth test on channel %u finished", channel_get_id(ctx->channel));
+
+	entries[0].header.type   = TLV_TYPE_BWTEST_LENGTH;
+	entries[0].header.length = sizeof(QWORD);
+	entries[0].buffer        = (PUCHAR)&length;
+
+	entries[1].header.type   = TLV_TYPE_BWTEST_ELAPSED;
+	entries[1].header.length = sizeof(QWORD);
+	entries[1].buffer        = (PUCHAR)&elapsed;
+
+	channel_close(ctx->channel, ctx->remote, entries, 2, NULL);
+}
+
+/*!
+ * @brief Produce bandwidth test data straight into the outgoing packet.
+ * @remark The data is a different byte for each write, so there is nothing
+ *         for compression to take advantage of across writes.
+ */
+static DWORD bwtest_fill(Channel *channel, LPVOID context, PUCHAR buffer,
+		ULONG bufferSize, PULONG bytesFilled)
+{
+	BwTestContext *ctx = (BwTestContext *)context;
+
+	memset(buffer, (int)(ctx->transferred / ctx->chunk) & 0xFF, bufferSize);
+	*bytesFilled = bufferSize;
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Thread that writes a bandwidth test's data as fast as the channel takes it.
+ * @param thread Pointer to the thread, the first parameter is the test's context.
+ * @return Indication of success or failure.
+ */
+static DWORD THREADCALL bwtest_send_thread(THREAD *thread)
+{
+	BwTestContext *ctx = (BwTestContext *)thread->parameter1;
+	DWORD result = ERROR_SUCCESS;
+	ULONG length, written;
+
+	ctx->start = diagnostic_clock();
+
+	while (ctx->transferred < ctx->length && !event_poll(thread->sigterm, 0))
+	{
+		length = (ctx->length - ctx->transferred < ctx->chunk) ? (ULONG)(ctx->length - ctx->transferred) : ctx->chunk;
+
+		if ((result = channel_write_fill(ctx->channel, ctx->remote, length, bwtest_fill, ctx, &written)) != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		ctx->transferred += written;
+	}
+
+	// only report back if the test wasn't cut short by the channel being closed
+	if (!event_poll(thread->sigterm, 0))
+	{
+		bwtest_finish(ctx);
+	}
+
+	return result;
+}
+
+/*!
+ * @brief Native write handler for a bandwidth test that the server receives.
+ * @remark The data is thrown away, the test finishes once enough of it has arrived.
+ */
+static DWORD bwtest_write(Channel *channel, Packet *request, LPVOID context,
+		LPVOID buffer, DWORD bufferSize, LPDWORD bytesWritten)
+{
+	BwTestContext *ctx = (BwTestContext *)context;
+
+	// writes are made with the channel's lock held, so the counters are safe
+	if (!ctx->start)
+	{
+		ctx->start = diagnostic_clock();
+	}
+
+	ctx->transferred += bufferSize;
+	*bytesWritten = bufferSize;
+
+	if (!ctx->finished && ctx->transferred >= ctx->length)
+	{
+		bwtest_finish(ctx);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Native close handler for a bandwidth test, stops the writing thread if there is one.
+ */
+static DWORD bwtest_close(Channel *channel, Packet *request, LPVOID context)
+{
+	BwTestContext *ctx = (BwTestContext *)context;
+
+	if (ctx->thread)
+	{
+		thread_sigterm(ctx->thread);
+		thread_join(ctx->thread);
+		thread_destroy(ctx->thread);
+	}
+
+	free(ctx);
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * core_bwtest
+ * -----------
+ *
+ * Opens a channel for measuring throughput. When the server sends, it writes
+ * the given number of bytes to the channel as fast as the channel takes them.
+ * When it receives, it throws away whatever is written to the channel. Either
+ * way, the server closes the channel once the bytes have been moved, and the
+ * close carries TLV_TYPE_BWTEST_LENGTH and TLV_TYPE_BWTEST_ELAPSED, the time
+ * between the first write and the last as the server saw it.
+ *
+ * req: TLV_TYPE_BWTEST_LENGTH    -- The number of bytes to move
+ * opt: TLV_TYPE_BWTEST_DIRECTION -- BWTEST_DIRECTION_DOWNLOAD if absent, or
+ *                                   BWTEST_DIRECTION_UPLOAD
+ * opt: TLV_TYPE_BWTEST_CHUNK     -- The number of bytes in each write when the
+ *                                   server sends, 64KB if absent
+ */
+DWORD remote_request_core_bwtest(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	BwTestContext *ctx = NULL;
+	CoreBwTestRequest args;
+	StreamChannelOps chops;
+	DWORD result = ERROR_SUCCESS;
+
+	do
+	{
+		if ((result = packet_decode(packet, &CoreBwTestRequestSchema, &args)) != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		if (!args.length || args.direction > BWTEST_DIRECTION_UPLOAD)
+		{
+			result = ERROR_INVALID_PARAMETER;
+			break;
+		}
+
+		if (!(ctx = (BwTestContext *)calloc(1, sizeof(BwTestContext))))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		ctx->remote = remote;
+		ctx->length = args.length;
+		ctx->chunk  = args.chunk ? args.chunk : BWTEST_DEFAULT_CHUNK;
+
+		if (ctx->chunk > BWTEST_MAX_CHUNK)
+		{
+			ctx->chunk = BWTEST_MAX_CHUNK;
+		}
+
+		memset(&chops, 0, sizeof(chops));
+		chops.native.context = ctx;
+		chops.native.close   = bwtest_close;
+
+		if (args.direction == BWTEST_DIRECTION_UPLOAD)
+		{
+			chops.native.write = bwtest_write;
+		}
+
+		if (!(ctx->channel = channel_create_stream(remote, 0, 0, &chops)))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		if (args.direction == BWTEST_DIRECTION_DOWNLOAD
+			&& !(ctx->thread = thread_create(bwtest_send_thread, ctx, NULL, NULL)))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		dprintf("[DISPATCH] bandwidth test on channel %u, direction %u", channel_get_id(ctx->channel), args.direction);
+
+		packet_add_tlv_uint(response, TLV_TYPE_CHANNEL_ID, channel_get_id(ctx->channel));
+
+	} while (0);
+
+	if (result != ERROR_SUCCESS && ctx)
+	{
+		// destroying the channel frees the context too
+		if (ctx->channel)
+		{
+			channel_destroy(ctx->channel, packet);
+		}
+		else
+		{
+			free(ctx);
+		}
+
+		ctx = NULL;
+	}
+
+	packet_transmit_response(result, remote, response);
+
+	// the data only follows once the requester knows about the channel
+	if (ctx && ctx->thread)
+	{
+		thread_run(ctx->thread);
+	}
+
+	return ERROR_SUCCESS;
+}
+
 /*
  * core_crypto_negotiate
  * ---------------------
@@ -1,5 +1,9 @@
 #include "common.h"
 
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
 // List insertion and removal 
 VOID channel_add_list_entry(Channel *channel);
 VOID channel_remove_list_entry(Channel *channel);
@@ -16,18 +20,18 @@ VOID channel_read_buffer(Channel *channel, ChannelBuffer *buffer,
 ChannelCompletionRoutine *channel_duplicate_completion_routine(
 		ChannelCompletionRoutine *in);
 
-// Linked list of allocated channels
-Channel *channelList = NULL;
+// Channel identifiers are unique across every session in the process
 DWORD channelIdPool  = 0;
 
 /*
- * Create a new channel, optionally with a supplied identifier.
+ * Create a new channel that belongs to the given remote's session, optionally
+ * with a supplied identifier.
  *
  * If the identifier is zero, a new unique identifier is allocated.
  *
  * TODO: identifier conflicts due to being able to supply an id
  */
-Channel *channel_create(DWORD identifier, DWORD flags)
+Channel *channel_create(Remote *remote, DWORD identifier, DWORD flags)
 {
 	Channel *channel = NULL;
 
@@ -41,14 +45,23 @@ Channel *channel_create(DWORD identifier, DWORD flags)
 		memset(channel, 0, sizeof(Channel));
 
 		// Set the channel's unique identifier
-		channel->identifier  = (!identifier) ? ++channelIdPool : identifier;
+#ifdef _WIN32
+		channel->identifier  = (!identifier) ? (DWORD)InterlockedIncrement((LONG *)&channelIdPool) : identifier;
+#else
+		channel->identifier  = (!identifier) ? (DWORD)__atomic_inc((volatile int *)&channelIdPool) + 1 : identifier;
+#endif
 		channel->interactive = FALSE;
 		channel->flags       = flags;
 		channel->cls         = CHANNEL_CLASS_BUFFERED;
 		channel->lock        = lock_create();
+		channel->references  = 1;
+		channel->remote      = remote;
 
 		memset(&channel->ops, 0, sizeof(channel->ops));
 
+		// Idle time is counted from the channel's creation
+		channel->stats.lastActivity = (LONG)(channel_stats_clock() / 1000);
+
 		// Initialize the channel's buffered default IO handler
 		// to the internal buffering methods
 		channel_set_buffered_io_handler(channel, &channel->ops.buffered,
@@ -66,10 +79,10 @@ Channel *channel_create(DWORD identifier, DWORD flags)
  * Creates a stream-based channel with initialized operations.  An example of
  * streaming channel is TCP.
  */
-LINKAGE Channel *channel_create_stream(DWORD identifier, 
+LINKAGE Channel *channel_create_stream(Remote *remote, DWORD identifier, 
 		DWORD flags, StreamChannelOps *ops)
 {
-	Channel *channel = channel_create(identifier, flags);
+	Channel *channel = channel_create(remote, identifier, flags);
 
 	if (channel)
 	{
@@ -88,10 +101,10 @@ LINKAGE Channel *channel_create_stream(DWORD identifier,
  * Creates a datagram-based channel with initialized operations.  An example of
  * a datagram channel is UDP.
  */
-LINKAGE Channel *channel_create_datagram(DWORD identifier, 
+LINKAGE Channel *channel_create_datagram(Remote *remote, DWORD identifier, 
 		DWORD flags, DatagramChannelOps *ops)
 {
-	Channel *channel = channel_create(identifier, flags);
+	Channel *channel = channel_create(remote, identifier, flags);
 
 	if (channel)
 	{
@@ -110,10 +123,10 @@ LINKAGE Channel *channel_create_datagram(DWORD identifier,
  * Creates a pool-based channel with initialized operations.  An example of a
  * pool channel is one that operates on a file.
  */
-LINKAGE Channel *channel_create_pool(DWORD identifier, 
+LINKAGE Channel *channel_create_pool(Remote *remote, DWORD identifier, 
 		DWORD flags, PoolChannelOps *ops)
 {
-	Channel *channel = channel_create(identifier, flags);
+	Channel *channel = channel_create(remote, identifier, flags);
 
 	if (channel)
 	{
@@ -156,11 +169,9 @@ VOID channel_destroy(Channel *channel, Packet *request)
 	// Remove the channel from the list of channels
 	channel_remove_list_entry(channel);
 
-	lock_destroy( channel->lock );
-
-	// Destroy the channel context
-	dprintf( "[CHANNEL] Free up the channel context 0x%p", channel );
-	free(channel);
+	// Drop the list's reference, the channel is freed once anyone that looked
+	// it up before it was removed is done with it
+	channel_release(channel);
 }
 
 /*
@@ -171,6 +182,14 @@ DWORD channel_get_id(Channel *channel)
 	return channel->identifier;
 }
 
+/*
+ * Get the remote whose session the channel belongs to
+ */
+Remote *channel_get_remote(Channel *channel)
+{
+	return channel->remote;
+}
+
 /*
  * Set the type of channel, such as process, fs, etc.
  */
@@ -241,6 +260,15 @@ BOOL channel_is_interactive(Channel *channel)
 	return channel->interactive;
 }
 
+/*
+ * Set the scheduler waitable that produces the channel's outbound data, so that
+ * the waitable can be paused while the channel is held back by a rate limit
+ */
+VOID channel_set_waitable(Channel *channel, HANDLE waitable)
+{
+	channel->waitable = waitable;
+}
+
 /*
  * Set the buffered buffer direct IO handler
  */
@@ -255,6 +283,318 @@ PVOID channel_get_buffered_io_context(Channel *channel)
 	return channel->ops.buffered.dioContext;
 }
 
+/*
+ * A pipelined read or write that is waiting for its turn on a channel
+ */
+typedef struct _ChannelSequenceWaiter
+{
+	DWORD                          sequence;
+	// Signalled when the channel's sequence reaches the waiter's
+	EVENT *                        turn;
+	struct _ChannelSequenceWaiter *next;
+} ChannelSequenceWaiter;
+
+/*
+ * Check whether a waiting read or write is the first in line, the only one
+ * that gives up on the requests before it when its wait runs out. The others
+ * keep waiting, and are woken in turn as the sequence moves on.
+ */
+static BOOL channel_sequence_first(Channel *channel, ChannelSequenceWaiter *waiter)
+{
+	ChannelSequenceWaiter *current;
+
+	for (current = channel->sequenceWaiters; current; current = current->next)
+	{
+		if ((LONG)(current->sequence - waiter->sequence) < 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Wait for a pipelined read or write to have its turn on the channel.
+ *
+ * Every request is handled on a thread of its own, so requests can reach the
+ * channel in a different order to the one they were sent in. Requests that
+ * carry TLV_TYPE_CHANNEL_SEQUENCE are run in the order of their sequence
+ * numbers instead, which starts at zero for each channel. Should one never
+ * turn up, the first one after it carries on after CHANNEL_SEQUENCE_TIMEOUT
+ * and the rest follow it in order.
+ *
+ * A request that is early waits on an event of its own, which is signalled
+ * by whichever request moves the sequence up to it.
+ *
+ * The channel's lock must be held, it is let go of while waiting.
+ */
+VOID channel_wait_sequence(Channel *channel, Packet *request)
+{
+	ChannelSequenceWaiter waiter, **link;
+	DWORD sequence;
+	QWORD now, deadline;
+	Tlv sequenceTlv;
+
+	if (packet_get_tlv(request, TLV_TYPE_CHANNEL_SEQUENCE, &sequenceTlv) != ERROR_SUCCESS)
+		return;
+
+	sequence = packet_get_tlv_value_uint(request, TLV_TYPE_CHANNEL_SEQUENCE);
+
+	// Without an event to wait on the request just goes out of turn
+	if ((LONG)(sequence - channel->sequence) > 0 && (waiter.turn = event_create()) != NULL)
+	{
+		waiter.sequence = sequence;
+		waiter.next = channel->sequenceWaiters;
+		channel->sequenceWaiters = &waiter;
+
+		deadline = channel_stats_clock() + (QWORD)CHANNEL_SEQUENCE_TIMEOUT * 1000;
+
+		while ((LONG)(sequence - channel->sequence) > 0)
+		{
+			now = channel_stats_clock();
+			if (now >= deadline)
+			{
+				if (channel_sequence_first(channel, &waiter))
+					break;
+
+				// Somebody ahead is still waiting, and will wake us when it goes
+				deadline = now + (QWORD)CHANNEL_SEQUENCE_TIMEOUT * 1000;
+			}
+
+			lock_release(channel->lock);
+			event_poll(waiter.turn, (DWORD)((deadline - now + 999) / 1000));
+			lock_acquire(channel->lock);
+		}
+
+		for (link = &channel->sequenceWaiters; *link; link = &(*link)->next)
+		{
+			if (*link == &waiter)
+			{
+				*link = waiter.next;
+				break;
+			}
+		}
+
+		event_destroy(waiter.turn);
+
+		if ((LONG)(sequence - channel->sequence) > 0)
+			dprintf("[CHANNEL] channel %u gave up waiting for request %u", channel->identifier, channel->sequence);
+	}
+
+	// Requests that turn up late don't wind the sequence back
+	if ((LONG)(sequence + 1 - channel->sequence) > 0)
+	{
+		ChannelSequenceWaiter *current;
+
+		channel->sequence = sequence + 1;
+
+		// Wake the request that is next, and any that the sequence has moved past
+		for (current = channel->sequenceWaiters; current; current = current->next)
+		{
+			if ((LONG)(current->sequence - channel->sequence) <= 0)
+				event_signal(current->turn);
+		}
+	}
+}
+
+/*
+ * Add to one of a channel's 64 bit counters without taking a lock
+ */
+static VOID channel_counter_add(ChannelCounter *counter, ULONG value)
+{
+	ULONG previous;
+	BOOL wraps;
+
+	if (!value)
+		return;
+
+	while (TRUE)
+	{
+		previous = (ULONG)counter->low;
+		wraps = previous + value < previous;
+
+		// Readers have to know about the carry before the low half wraps
+		if (wraps)
+		{
+#ifdef _WIN32
+			InterlockedIncrement(&counter->carrying);
+#else
+			__atomic_inc((volatile int *)&counter->carrying);
+#endif
+		}
+
+#ifdef _WIN32
+		if (InterlockedCompareExchange(&counter->low, (LONG)(previous + value), (LONG)previous) == (LONG)previous)
+#else
+		if (__atomic_cmpxchg((int)previous, (int)(previous + value), (volatile int *)&counter->low) == 0)
+#endif
+			break;
+
+		if (wraps)
+		{
+#ifdef _WIN32
+			InterlockedDecrement(&counter->carrying);
+#else
+			__atomic_dec((volatile int *)&counter->carrying);
+#endif
+		}
+	}
+
+	// Carry into the high half when the low half wraps
+	if (wraps)
+	{
+#ifdef _WIN32
+		InterlockedIncrement(&counter->high);
+		InterlockedDecrement(&counter->carrying);
+#else
+		__atomic_inc((volatile int *)&counter->high);
+		__atomic_dec((volatile int *)&counter->carrying);
+#endif
+	}
+}
+
+/*
+ * Read one of a channel's 64 bit counters
+ *
+ * The low half can wrap after the high half has been read. Its carry was
+ * announced before the wrap and is only withdrawn once the high half has
+ * been bumped, so the read is retried while a carry is announced, or if the
+ * high half has changed by the time the announcement has gone.
+ */
+static QWORD channel_counter_read(ChannelCounter *counter)
+{
+	ULONG high, low;
+
+	do
+	{
+		high = (ULONG)counter->high;
+		low  = (ULONG)counter->low;
+	} while (counter->carrying != 0 || high != (ULONG)counter->high);
+
+	return ((QWORD)high << 32) | low;
+}
+
+/*
+ * Get the time used by the channel statistics, in microseconds
+ */
+QWORD channel_stats_clock()
+{
+#ifdef _WIN32
+	return (QWORD)GetTickCount() * 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/*
+ * Count a read or write on a channel. The length is counted as a packet in
+ * the given direction when the transfer worked and moved data, and the time
+ * since start, as given by channel_stats_clock, is counted as time blocked.
+ */
+VOID channel_stats_transfer(Channel *channel, DWORD direction, ULONG length,
+		DWORD result, QWORD start)
+{
+	ChannelStats *stats = &channel->stats;
+	QWORD now = channel_stats_clock();
+
+	if (result != ERROR_SUCCESS)
+	{
+#ifdef _WIN32
+		InterlockedIncrement(&stats->errors);
+#else
+		__atomic_inc((volatile int *)&stats->errors);
+#endif
+	}
+	else if (length)
+	{
+		if (direction == CHANNEL_STATS_INBOUND)
+		{
+			channel_counter_add(&stats->bytesIn, length);
+#ifdef _WIN32
+			InterlockedIncrement(&stats->packetsIn);
+#else
+			__atomic_inc((volatile int *)&stats->packetsIn);
+#endif
+		}
+		else
+		{
+			channel_counter_add(&stats->bytesOut, length);
+#ifdef _WIN32
+			InterlockedIncrement(&stats->packetsOut);
+#else
+			__atomic_inc((volatile int *)&stats->packetsOut);
+#endif
+		}
+	}
+
+	if (start && now > start)
+		channel_counter_add(&stats->blocked, (ULONG)(now - start));
+
+	// A plain store will do, any of the racing writers' times is fine
+	stats->lastActivity = (LONG)(now / 1000);
+}
+
+/*
+ * Take a copy of a channel's counters
+ */
+VOID channel_stats_snapshot(Channel *channel, ChannelStatsSnapshot *snapshot)
+{
+	ChannelStats *stats = &channel->stats;
+
+	memset(snapshot, 0, sizeof(ChannelStatsSnapshot));
+
+	snapshot->bytesIn    = channel_counter_read(&stats->bytesIn);
+	snapshot->packetsIn  = (DWORD)stats->packetsIn;
+	snapshot->bytesOut   = channel_counter_read(&stats->bytesOut);
+	snapshot->packetsOut = (DWORD)stats->packetsOut;
+	snapshot->blocked    = channel_counter_read(&stats->blocked) / 1000;
+	snapshot->errors     = (DWORD)stats->errors;
+	snapshot->idle       = (DWORD)(channel_stats_clock() / 1000) - (DWORD)stats->lastActivity;
+
+	if (channel->cls == CHANNEL_CLASS_BUFFERED)
+		snapshot->buffered = channel->ops.buffered.currentSize;
+}
+
+/*
+ * Charge outbound channel data to the channel's and the session's rate limits.
+ * When either one is overdrawn the channel's waitable is paused by the scheduler
+ * until the debt is paid off, or if the channel has no waitable the calling
+ * thread waits it out instead.
+ */
+static VOID channel_throttle(Channel *channel, ULONG length)
+{
+	TokenBucket *limit = channel->limit;
+	TokenBucket *sessionLimit = channel->remote ? channel->remote->channel_limit : NULL;
+	DWORD delay = 0;
+	DWORD sessionDelay = 0;
+
+	if (limit)
+		delay = token_bucket_consume(limit, length);
+
+	if (sessionLimit)
+		sessionDelay = token_bucket_consume(sessionLimit, length);
+
+	if (sessionDelay > delay)
+		delay = sessionDelay;
+
+	if (!delay)
+		return;
+
+	dprintf("[CHANNEL] channel %u is over its rate limit, holding off for %u ms", channel->identifier, delay);
+
+	channel_counter_add(&channel->stats.blocked, delay * 1000);
+
+	if (channel->waitable && scheduler_delay_waitable(channel->waitable, delay) == ERROR_SUCCESS)
+		return;
+
+#ifdef _WIN32
+	Sleep(delay);
+#else
+	usleep(delay * 1000);
+#endif
+}
+
 /*
  * Write the supplied buffer to the remote endpoint of the channel.
  *
@@ -269,6 +609,7 @@ DWORD channel_write_to_remote(Remote *remote, Channel *channel, PUCHAR chunk,
 	DWORD res = ERROR_SUCCESS;
 	Tlv entries[2];
 	DWORD idNbo;
+	QWORD start = 0;
 
 	do
 	{
@@ -298,11 +639,16 @@ DWORD channel_write_to_remote(Remote *remote, Channel *channel, PUCHAR chunk,
 		if ((res = packet_add_tlv_group(request, TLV_TYPE_CHANNEL_DATA_GROUP, entries, 2)) != ERROR_SUCCESS)
 			break;
 
+		channel_throttle(channel, chunkLength);
+
 		// Transmit the packet
+		start = channel_stats_clock();
 		res = PACKET_TRANSMIT(remote, request, NULL);
 
 	} while (0);
 
+	channel_stats_transfer(channel, CHANNEL_STATS_OUTBOUND, chunkLength, res, start);
+
 	return res;
 }
 
@@ -394,7 +740,7 @@ DWORD _channel_packet_completion_routine(Remote *remote, Packet *packet,
 {
 	ChannelCompletionRoutine *comp = (ChannelCompletionRoutine *)context;
 	DWORD channelId = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID);
-	Channel *channel = channel_find_by_id(channelId);
+	Channel *channel = channel_find_by_id(remote, channelId);
 	DWORD res = ERROR_NOT_FOUND;
 
 
@@ -458,6 +804,9 @@ DWORD _channel_packet_completion_routine(Remote *remote, Packet *packet,
 	dprintf( "[CHANNEL] freeing up the completion context" );
 	free(comp);
 
+	if (channel)
+		channel_release(channel);
+
 	return res;
 }
 
@@ -579,6 +928,7 @@ DWORD channel_write(Channel *channel, Remote *remote, Tlv *addend,
 	LPCSTR method = "core_channel_write";
 	Packet *request;
 	Tlv methodTlv;
+	QWORD start = 0;
 
 	do
 	{
@@ -624,11 +974,91 @@ DWORD channel_write(Channel *channel, Remote *remote, Tlv *addend,
 			realRequestCompletion = &requestCompletion;
 		}
 
+		channel_throttle(channel, length);
+
 		// Transmit the packet with the supplied completion routine, if any.
+		start = channel_stats_clock();
 		res = PACKET_TRANSMIT(remote, request, realRequestCompletion);
 
 	} while (0);
 
+	channel_stats_transfer(channel, CHANNEL_STATS_OUTBOUND, length, res, start);
+
+	return res;
+}
+
+/*
+ * Write to the remote end of the channel, letting the supplied fill routine
+ * produce up to length bytes straight into the outgoing packet. This saves
+ * the copy that channel_write makes of a caller-owned buffer. Nothing is
+ * sent if the fill routine fails or produces no data.
+ */
+DWORD channel_write_fill(Channel *channel, Remote *remote, ULONG length,
+	ChannelFillRoutine fill, LPVOID context, PULONG bytesWritten)
+{
+	DWORD res = ERROR_SUCCESS;
+	Packet *request;
+	PUCHAR buffer = NULL;
+	ULONG filled = 0;
+	TlvType dataType = TLV_TYPE_CHANNEL_DATA;
+	QWORD start = 0;
+
+	do
+	{
+		// Allocate a request packet
+		if (!(request = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_write")))
+		{
+			res = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		// Add the channel identifier
+		packet_add_tlv_uint(request, TLV_TYPE_CHANNEL_ID, channel_get_id(channel));
+
+		// if the channel data is ment to be compressed, compress it!
+		if (channel_is_flag(channel, CHANNEL_FLAG_COMPRESS))
+		{
+			dataType = TLV_TYPE_CHANNEL_DATA | TLV_META_TYPE_COMPRESSED;
+		}
+
+		if ((res = packet_reserve_tlv(request, dataType, length, &buffer)) != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		if ((res = fill(channel, context, buffer, length, &filled)) != ERROR_SUCCESS || !filled)
+		{
+			break;
+		}
+
+		if ((res = packet_commit_tlv(request, filled)) != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		packet_add_tlv_uint(request, TLV_TYPE_LENGTH, filled);
+
+		channel_throttle(channel, filled);
+
+		// Transmit the packet, this also destroys it
+		start = channel_stats_clock();
+		res = PACKET_TRANSMIT(remote, request, NULL);
+		request = NULL;
+
+	} while (0);
+
+	channel_stats_transfer(channel, CHANNEL_STATS_OUTBOUND, filled, res, start);
+
+	if (request)
+	{
+		packet_destroy(request);
+	}
+
+	if (bytesWritten)
+	{
+		*bytesWritten = filled;
+	}
+
 	return res;
 }
 
@@ -748,56 +1178,100 @@ DWORD channel_interact(Channel *channel, Remote *remote, Tlv *addend,
  *********************/
 
 /*
- * Find a channel context by its identifier
+ * Find a channel context in the given remote's session by its identifier. The
+ * channel is returned with a reference held, so it stays valid even if another
+ * thread destroys it meanwhile; the caller must pass it to channel_release.
  */
-Channel *channel_find_by_id(DWORD id)
+Channel *channel_find_by_id(Remote *remote, DWORD id)
 {
 	Channel *current;
 
-	for (current = channelList; current; current = current->next)
+	lock_acquire(remote->channel_lock);
+
+	for (current = remote->channel_list; current; current = current->next)
 	{
 		if (current->identifier == id)
 		{
+#ifdef _WIN32
+			InterlockedIncrement(&current->references);
+#else
+			__atomic_inc((volatile int *)&current->references);
+#endif
 			break;
 		}
 	}
 
+	lock_release(remote->channel_lock);
+
 	return current;
 }
 
 /*
- * Insert a channel into the channel list
+ * Drop a reference to a channel, freeing it once the last one is gone
+ */
+VOID channel_release(Channel *channel)
+{
+#ifdef _WIN32
+	if (InterlockedDecrement(&channel->references) != 0)
+		return;
+#else
+	// bionic's __atomic_dec returns the value from before the decrement
+	if (__atomic_dec((volatile int *)&channel->references) != 1)
+		return;
+#endif
+
+	lock_destroy( channel->lock );
+
+	token_bucket_destroy( channel->limit );
+
+	// Destroy the channel context
+	dprintf( "[CHANNEL] Free up the channel context 0x%p", channel );
+	free(channel);
+}
+
+/*
+ * Insert a channel into its session's channel list
  */
 VOID channel_add_list_entry(Channel *channel)
 {
-	if (channelList)
+	Remote *remote = channel->remote;
+
+	lock_acquire(remote->channel_lock);
+
+	if (remote->channel_list)
 	{
-		channelList->prev = channel;
+		remote->channel_list->prev = channel;
 	}
 
-	channel->next = channelList;
-	channel->prev = NULL;
-	channelList   = channel;
+	channel->next        = remote->channel_list;
+	channel->prev        = NULL;
+	remote->channel_list = channel;
+
+	lock_release(remote->channel_lock);
 }
 
 /*
- * Remove a channel from the channel list
+ * Remove a channel from its session's channel list
  */
 VOID channel_remove_list_entry(Channel *channel)
 {
+	lock_acquire(channel->remote->channel_lock);
+
 	if (channel->prev)
 	{
 		channel->prev->next = channel->next;
 	}
 	else
 	{
-		channelList = channel->next;
+		channel->remote->channel_list = channel->next;
 	}
 
 	if (channel->next)
 	{
 		channel->next->prev = channel->prev;
 	}
+
+	lock_release(channel->remote->channel_lock);
 }
 
 /**************
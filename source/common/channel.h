@@ -23,6 +23,11 @@ typedef DWORD (*DirectIoHandler)(struct _Channel *channel,
 		struct _ChannelBuffer *buffer, LPVOID context, ChannelDioMode mode, 
 		PUCHAR chunk, ULONG length, PULONG bytesXfered);
 
+// Fill routine -- used by channel_write_fill to produce channel data directly
+// into the outgoing packet rather than into an intermediate buffer.
+typedef DWORD (*ChannelFillRoutine)(struct _Channel *channel, LPVOID context,
+		PUCHAR buffer, ULONG bufferSize, PULONG bytesFilled);
+
 // Asynchronous completion routines -- used with channel_open, channel_read, 
 // etc.
 typedef DWORD (*ChannelOpenCompletionRoutine)(Remote *remote,
@@ -101,9 +106,9 @@ typedef struct _PoolChannelOps
 	DWORD (*eof)(struct _Channel *channel, Packet *request,
 			LPVOID context, LPBOOL isEof);
 	DWORD (*seek)(struct _Channel *channel, Packet *request,
-			LPVOID context, LONG offset, DWORD whence);
+			LPVOID context, LONGLONG offset, DWORD whence);
 	DWORD (*tell)(struct _Channel *channel, Packet *request,
-			LPVOID context, LPLONG offset);
+			LPVOID context, PLONGLONG offset);
 } PoolChannelOps;
 
 /*
@@ -114,6 +119,60 @@ typedef struct _PoolChannelOps
 #define CHANNEL_CLASS_DATAGRAM 2
 #define CHANNEL_CLASS_POOL     3
 
+/*
+ * Directions for the channel statistics
+ */
+#define CHANNEL_STATS_INBOUND  0
+#define CHANNEL_STATS_OUTBOUND 1
+
+// A 64 bit counter kept as two halves, so that it can be bumped without a
+// lock on platforms that only have 32 bit atomics. The high half is bumped
+// after the low half wraps, and a reader that could see the low half wrapped
+// without the high half's carry retries, so a read is never 4GB short.
+typedef struct _ChannelCounter
+{
+	volatile LONG low;
+	volatile LONG high;
+	// Adds that have wrapped, or are about to wrap, the low half and have
+	// yet to carry into the high half
+	volatile LONG carrying;
+} ChannelCounter;
+
+// Counters that describe the traffic a channel has seen. They are bumped by
+// whichever thread moves the data, without taking the channel's lock.
+typedef struct _ChannelStats
+{
+	// Bytes and packets written to the channel by the remote side
+	ChannelCounter        bytesIn;
+	volatile LONG         packetsIn;
+	// Bytes and packets sent from the channel to the remote side
+	ChannelCounter        bytesOut;
+	volatile LONG         packetsOut;
+	// Microseconds spent writing to the channel's native handle, sending its
+	// data or held back by a rate limit
+	ChannelCounter        blocked;
+	// Number of reads and writes that failed
+	volatile LONG         errors;
+	// Time of the last read or write, in milliseconds
+	volatile LONG         lastActivity;
+} ChannelStats;
+
+// A consistent copy of a channel's counters
+typedef struct _ChannelStatsSnapshot
+{
+	QWORD                 bytesIn;
+	DWORD                 packetsIn;
+	QWORD                 bytesOut;
+	DWORD                 packetsOut;
+	// Bytes waiting in the channel's buffer, for buffered channels
+	ULONG                 buffered;
+	// Milliseconds spent blocked
+	QWORD                 blocked;
+	DWORD                 errors;
+	// Milliseconds since the last read or write
+	DWORD                 idle;
+} ChannelStatsSnapshot;
+
 typedef struct _Channel
 {
 	// The channel's identifier 
@@ -128,6 +187,8 @@ typedef struct _Channel
 	ULONG                 flags;
 	// Lock for synchronizing communication to a channel
 	LOCK *                lock;
+	// References held by the channel list and by channel_find_by_id callers
+	LONG                  references;
 	// The buffered output buffer (as in being outputted bufferedly)
 	union
 	{
@@ -137,6 +198,18 @@ typedef struct _Channel
 		PoolChannelOps     pool;
 	}                     ops;
 
+	// The session the channel belongs to
+	Remote *              remote;
+	// The scheduler waitable that produces the channel's outbound data, if any
+	HANDLE                waitable;
+	// Limit on the rate of the channel's outbound data, if one has been set
+	struct _TokenBucket * limit;
+	// Traffic counters
+	ChannelStats          stats;
+	// Sequence number of the next pipelined read or write to run
+	DWORD                 sequence;
+	// Pipelined reads and writes that are waiting for their turn
+	struct _ChannelSequenceWaiter *sequenceWaiters;
 	// Internal attributes for list
 	struct _Channel       *prev;
 	struct _Channel       *next;
@@ -144,19 +217,24 @@ typedef struct _Channel
 
 #define CHANNEL_CHUNK_SIZE 4096
 
+// Longest time, in milliseconds, that a pipelined read or write waits for the
+// ones before it to arrive
+#define CHANNEL_SEQUENCE_TIMEOUT 5000
+
 /*
  * Channel manipulation
  */
-LINKAGE Channel *channel_create(DWORD identifier, DWORD flags);
-LINKAGE Channel *channel_create_stream(DWORD identifier, 
+LINKAGE Channel *channel_create(Remote *remote, DWORD identifier, DWORD flags);
+LINKAGE Channel *channel_create_stream(Remote *remote, DWORD identifier, 
 		DWORD flags, StreamChannelOps *ops);
-LINKAGE Channel *channel_create_datagram(DWORD identifier, 
+LINKAGE Channel *channel_create_datagram(Remote *remote, DWORD identifier, 
 		DWORD flags, DatagramChannelOps *ops);
-LINKAGE Channel *channel_create_pool(DWORD identifier, 
+LINKAGE Channel *channel_create_pool(Remote *remote, DWORD identifier, 
 		DWORD flags, PoolChannelOps *ops);
 LINKAGE VOID channel_destroy(Channel *channel, Packet *request);
 
 LINKAGE DWORD channel_get_id(Channel *channel);
+LINKAGE Remote *channel_get_remote(Channel *channel);
 
 LINKAGE VOID channel_set_type(Channel *channel, PCHAR type);
 LINKAGE PCHAR channel_get_type(Channel *channel);
@@ -170,6 +248,8 @@ LINKAGE ULONG channel_get_flags(Channel *channel);
 LINKAGE VOID channel_set_interactive(Channel *channel, BOOL interactive);
 LINKAGE BOOL channel_is_interactive(Channel *channel);
 
+LINKAGE VOID channel_set_waitable(Channel *channel, HANDLE waitable);
+
 LINKAGE DWORD channel_write_to_remote(Remote *remote, Channel *channel, 
 		PUCHAR chunk, ULONG chunkLength, PULONG bytesWritten);
 
@@ -184,6 +264,14 @@ LINKAGE PVOID channel_get_buffered_io_context(Channel *channel);
 LINKAGE VOID channel_set_native_io_context(Channel *channel, LPVOID context);
 LINKAGE LPVOID channel_get_native_io_context(Channel *channel);
 
+LINKAGE VOID channel_wait_sequence(Channel *channel, Packet *request);
+
+LINKAGE QWORD channel_stats_clock();
+LINKAGE VOID channel_stats_transfer(Channel *channel, DWORD direction,
+		ULONG length, DWORD result, QWORD start);
+LINKAGE VOID channel_stats_snapshot(Channel *channel,
+		ChannelStatsSnapshot *snapshot);
+
 LINKAGE DWORD channel_default_io_handler(Channel *channel, 
 		ChannelBuffer *buffer, LPVOID context, ChannelDioMode mode, 
 		PUCHAR chunk, ULONG length, PULONG bytesXfered);
@@ -202,6 +290,8 @@ LINKAGE DWORD channel_read(Channel *channel, Remote *remote, Tlv *addend,
 LINKAGE DWORD channel_write(Channel *channel, Remote *remote, Tlv *addend,
 		DWORD addendLength, PUCHAR buffer, ULONG length, 
 		ChannelCompletionRoutine *completionRoutine);
+LINKAGE DWORD channel_write_fill(Channel *channel, Remote *remote, ULONG length,
+		ChannelFillRoutine fill, LPVOID context, PULONG bytesWritten);
 LINKAGE DWORD channel_close(Channel *channel, Remote *remote, Tlv *addend,
 		DWORD addendLength, ChannelCompletionRoutine *completionRoutine);
 LINKAGE DWORD channel_interact(Channel *channel, Remote *remote, Tlv *addend,
@@ -211,6 +301,7 @@ LINKAGE DWORD channel_interact(Channel *channel, Remote *remote, Tlv *addend,
 /*
  * Channel searching
  */
-LINKAGE Channel *channel_find_by_id(DWORD id);
+LINKAGE Channel *channel_find_by_id(Remote *remote, DWORD id);
+LINKAGE VOID channel_release(Channel *channel);
 
 #endif
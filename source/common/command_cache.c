@@ -0,0 +1,525 @@
+/*!
+ * @file command_cache.c
+ * @brief Definitions for caching the responses of idempotent commands.
+ */
+#include "common.h"
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+/*! @brief A cached response, or a cache miss that is waiting for its response. */
+typedef struct _CommandCacheEntry
+{
+	struct _CommandCacheEntry* next;  ///< Next entry in the bucket or the pending list.
+	Command* command;                 ///< Registered command the response belongs to.
+	ULONG hash;                       ///< Hash of \c key.
+	PUCHAR key;                       ///< Request TLVs, without the request identifier.
+	ULONG keyLength;                  ///< Size of \c key in bytes.
+	PUCHAR response;                  ///< Response TLVs, without the method and request identifier.
+	ULONG responseLength;             ///< Size of \c response in bytes.
+	Remote* remote;                   ///< Session the pending response will be sent on.
+	PCHAR requestId;                  ///< Request identifier of the pending response.
+	QWORD expires;                    ///< Time at which the entry is dropped, in milliseconds.
+	DWORD generation;                 ///< Value of \c cacheGeneration when the miss started.
+} CommandCacheEntry;
+
+/*! @brief Cached responses, hashed by key. */
+static CommandCacheEntry* cacheBuckets[COMMAND_CACHE_BUCKETS];
+/*! @brief Cache misses whose handlers haven't responded yet. */
+static CommandCacheEntry* cachePending = NULL;
+/*! @brief Number of entries in \c cacheBuckets. */
+static DWORD cacheEntries = 0;
+/*! @brief Bumped by every invalidation that matches a cached response or a pending miss. */
+static DWORD cacheGeneration = 0;
+/*! @brief Number of requests answered from the cache. */
+static DWORD cacheHits = 0;
+/*! @brief Number of cacheable requests that had to run their handler. */
+static DWORD cacheMisses = 0;
+/*! @brief Guards all of the above. Created by the first session to use the cache. */
+static LOCK* cacheLock = NULL;
+
+/*!
+ * @brief Take the cache lock, creating it if no session has done so yet.
+ * @return Indication of whether the lock is held.
+ */
+static BOOL cache_acquire()
+{
+	LOCK* lock = cacheLock;
+
+	if (lock == NULL)
+	{
+		if ((lock = lock_create()) == NULL)
+		{
+			return FALSE;
+		}
+
+		// sessions may start in parallel, so only one of them gets to install its lock
+#ifdef _WIN32
+		if (InterlockedCompareExchangePointer((PVOID *)&cacheLock, lock, NULL) != NULL)
+#else
+		if (__atomic_cmpxchg(0, (int)lock, (volatile int *)&cacheLock) != 0)
+#endif
+		{
+			lock_destroy(lock);
+		}
+	}
+
+	lock_acquire(cacheLock);
+	return TRUE;
+}
+
+/*!
+ * @brief Release the cache lock.
+ */
+static VOID cache_release()
+{
+	lock_release(cacheLock);
+}
+
+/*!
+ * @brief Get the current time in milliseconds.
+ * @return The current time, relative to an arbitrary epoch.
+ */
+static QWORD cache_now()
+{
+#ifdef _WIN32
+	return (QWORD)GetTickCount();
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+/*!
+ * @brief Copy the TLVs of a packet, leaving out the request identifier and, optionally, the method.
+ * @param packet Pointer to the packet to copy the TLVs from.
+ * @param skipMethod Indicates whether the \c TLV_TYPE_METHOD TLV is left out.
+ * @param length Pointer that receives the size of the copy.
+ * @return Pointer to the copy, which the caller frees, or \c NULL on failure.
+ */
+static PUCHAR cache_copy_tlvs(Packet *packet, BOOL skipMethod, ULONG *length)
+{
+	PUCHAR copy = (PUCHAR)malloc(packet->payloadLength ? packet->payloadLength : 1);
+	ULONG offset = 0;
+	ULONG copied = 0;
+	TlvHeader header;
+	DWORD tlvLength, tlvType;
+
+	if (!copy)
+	{
+		return NULL;
+	}
+
+	while (offset + sizeof(TlvHeader) <= packet->payloadLength)
+	{
+		memcpy(&header, packet->payload + offset, sizeof(TlvHeader));
+		tlvLength = ntohl(header.length);
+		tlvType = ntohl(header.type);
+
+		if (tlvLength < sizeof(TlvHeader) || tlvLength > packet->payloadLength - offset)
+		{
+			break;
+		}
+
+		if (tlvType != TLV_TYPE_REQUEST_ID && !(skipMethod && tlvType == TLV_TYPE_METHOD))
+		{
+			memcpy(copy + copied, packet->payload + offset, tlvLength);
+			copied += tlvLength;
+		}
+
+		offset += tlvLength;
+	}
+
+	*length = copied;
+	return copy;
+}
+
+/*!
+ * @brief Hash a cache key (FNV-1a).
+ * @param key Pointer to the key.
+ * @param length Size of the key in bytes.
+ * @return The hash of the key.
+ */
+static ULONG cache_hash(PUCHAR key, ULONG length)
+{
+	ULONG hash = 2166136261U;
+	ULONG index;
+
+	for (index = 0; index < length; index++)
+	{
+		hash = (hash ^ key[index]) * 16777619U;
+	}
+
+	return hash;
+}
+
+/*!
+ * @brief Release an entry that has been unlinked from the cache.
+ * @param entry Pointer to the entry.
+ */
+static VOID cache_free(CommandCacheEntry *entry)
+{
+	SAFE_FREE(entry->key);
+	SAFE_FREE(entry->response);
+	SAFE_FREE(entry->requestId);
+	free(entry);
+}
+
+/*!
+ * @brief Drop the cached responses, and optionally the pending misses, that match a condition.
+ * @param match Routine that returns \c TRUE for the entries to drop.
+ * @param param Parameter passed to \c match.
+ * @param pending Indicates whether pending misses are dropped as well.
+ * @return The number of entries that were dropped.
+ * @remark The cache lock must be held.
+ */
+static DWORD cache_drop(BOOL(*match)(CommandCacheEntry *entry, LPVOID param), LPVOID param, BOOL pending)
+{
+	CommandCacheEntry** link;
+	CommandCacheEntry* entry;
+	DWORD bucket;
+	DWORD dropped = 0;
+
+	for (bucket = 0; bucket < (pending ? COMMAND_CACHE_BUCKETS + 1 : COMMAND_CACHE_BUCKETS); bucket++)
+	{
+		link = bucket < COMMAND_CACHE_BUCKETS ? &cacheBuckets[bucket] : &cachePending;
+
+		while ((entry = *link) != NULL)
+		{
+			if (match(entry, param))
+			{
+				*link = entry->next;
+				if (entry->response)
+				{
+					cacheEntries--;
+				}
+				cache_free(entry);
+				dropped++;
+			}
+			else
+			{
+				link = &entry->next;
+			}
+		}
+	}
+
+	return dropped;
+}
+
+/*! @brief Matches entries that have expired at the time pointed to by \c param. */
+static BOOL cache_match_expired(CommandCacheEntry *entry, LPVOID param)
+{
+	return entry->expires <= *(QWORD*)param;
+}
+
+/*! @brief Matches the entries of the command \c param, or all entries if it is \c NULL. */
+static BOOL cache_match_command(CommandCacheEntry *entry, LPVOID param)
+{
+	return param == NULL || entry->command == (Command*)param;
+}
+
+/*! @brief Matches the entries that are invalidated by the method \c param. */
+static BOOL cache_match_invalidated(CommandCacheEntry *entry, LPVOID param)
+{
+	LPCSTR* methods = entry->command->request.cacheInvalidatedBy;
+
+	while (methods && *methods)
+	{
+		if (strcmp(*methods++, (LPCSTR)param) == 0)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*!
+ * @brief Answer a request from the command cache.
+ * @param remote Pointer to the \c Remote instance the request arrived on.
+ * @param command Pointer to the cacheable command the request is for.
+ * @param packet Pointer to the request.
+ * @return Indication of whether the request was answered.
+ * @retval TRUE The cached response has been sent, the handler must not be run.
+ * @retval FALSE The handler has to be run. Its response will be cached if it succeeds.
+ * @remark The caller still owns, and destroys, \c packet in either case.
+ */
+BOOL command_cache_answer(Remote *remote, Command *command, Packet *packet)
+{
+	CommandCacheEntry* entry;
+	CommandCacheEntry* pending = NULL;
+	Packet* response = NULL;
+	PUCHAR payload;
+	PUCHAR key;
+	ULONG keyLength;
+	ULONG hash;
+	QWORD now = cache_now();
+	Tlv requestId;
+
+	if (!(key = cache_copy_tlvs(packet, FALSE, &keyLength)))
+	{
+		return FALSE;
+	}
+
+	hash = cache_hash(key, keyLength);
+
+	if (!cache_acquire())
+	{
+		free(key);
+		return FALSE;
+	}
+
+	for (entry = cacheBuckets[hash % COMMAND_CACHE_BUCKETS]; entry; entry = entry->next)
+	{
+		if (entry->hash == hash && entry->keyLength == keyLength
+			&& entry->command == command && entry->expires > now
+			&& memcmp(entry->key, key, keyLength) == 0)
+		{
+			break;
+		}
+	}
+
+	if (entry)
+	{
+		// copy the cached TLVs in behind the method and request identifier
+		if ((response = packet_create_response(packet)) != NULL
+			&& (payload = (PUCHAR)realloc(response->payload, response->payloadLength + entry->responseLength)) != NULL)
+		{
+			memcpy(payload + response->payloadLength, entry->response, entry->responseLength);
+			response->payload = payload;
+			response->payloadLength += entry->responseLength;
+			response->header.length = htonl(sizeof(TlvHeader) + response->payloadLength);
+			cacheHits++;
+		}
+		else
+		{
+			entry = NULL;
+		}
+	}
+
+	if (!entry)
+	{
+		cacheMisses++;
+
+		if (packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID, &requestId) == ERROR_SUCCESS
+			&& (pending = (CommandCacheEntry*)calloc(1, sizeof(CommandCacheEntry))) != NULL
+			&& (pending->requestId = _strdup((PCHAR)requestId.buffer)) != NULL)
+		{
+			pending->command = command;
+			pending->hash = hash;
+			pending->key = key;
+			pending->keyLength = keyLength;
+			pending->remote = remote;
+			pending->expires = now + COMMAND_CACHE_PENDING_TTL * 1000;
+			pending->generation = cacheGeneration;
+			pending->next = cachePending;
+			cachePending = pending;
+			key = NULL;
+		}
+		else if (pending)
+		{
+			free(pending);
+		}
+	}
+
+	cache_release();
+
+	SAFE_FREE(key);
+
+	if (entry)
+	{
+		dprintf("[CACHE] answered %s from the cache", command->method);
+		PACKET_TRANSMIT(remote, response, NULL);
+		return TRUE;
+	}
+
+	if (response)
+	{
+		packet_destroy(response);
+	}
+
+	return FALSE;
+}
+
+/*!
+ * @brief Cache an outbound packet if it is the response to a request that missed the cache.
+ * @param remote Pointer to the \c Remote instance the packet is being sent on.
+ * @param packet Pointer to the decrypted packet.
+ * @remark Only successful responses are cached, and only if nothing has invalidated
+ *         the cache since the request missed it, as the handler may have seen the old state.
+ */
+VOID command_cache_response(Remote *remote, Packet *packet)
+{
+	CommandCacheEntry** link;
+	CommandCacheEntry* entry;
+	CommandCacheEntry* current;
+	PacketTlvType type = packet_get_type(packet);
+	QWORD now;
+	Tlv requestId;
+	DWORD bucket;
+
+	// quick check without the lock, nothing is pending most of the time
+	if (cachePending == NULL
+		|| (type != PACKET_TLV_TYPE_RESPONSE && type != PACKET_TLV_TYPE_PLAIN_RESPONSE)
+		|| packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID, &requestId) != ERROR_SUCCESS)
+	{
+		return;
+	}
+
+	now = cache_now();
+
+	if (!cache_acquire())
+	{
+		return;
+	}
+
+	for (link = &cachePending; (entry = *link) != NULL; link = &entry->next)
+	{
+		if (entry->remote == remote && strcmp(entry->requestId, (PCHAR)requestId.buffer) == 0)
+		{
+			*link = entry->next;
+			break;
+		}
+	}
+
+	do
+	{
+		if (!entry)
+		{
+			break;
+		}
+
+		if (entry->generation != cacheGeneration
+			|| packet_get_tlv_value_uint(packet, TLV_TYPE_RESULT) != ERROR_SUCCESS
+			|| !(entry->response = cache_copy_tlvs(packet, TRUE, &entry->responseLength)))
+		{
+			cache_free(entry);
+			break;
+		}
+
+		SAFE_FREE(entry->requestId);
+		entry->remote = NULL;
+		entry->expires = now + (QWORD)entry->command->request.cacheTtl * 1000;
+
+		cache_drop(cache_match_expired, &now, TRUE);
+
+		// a newer response replaces an older one for the same request
+		bucket = entry->hash % COMMAND_CACHE_BUCKETS;
+		for (link = &cacheBuckets[bucket]; (current = *link) != NULL; link = &current->next)
+		{
+			if (current->hash == entry->hash && current->keyLength == entry->keyLength
+				&& current->command == entry->command
+				&& memcmp(current->key, entry->key, entry->keyLength) == 0)
+			{
+				*link = current->next;
+				cacheEntries--;
+				cache_free(current);
+				break;
+			}
+		}
+
+		if (cacheEntries >= COMMAND_CACHE_MAX_ENTRIES)
+		{
+			cache_free(entry);
+			break;
+		}
+
+		entry->next = cacheBuckets[bucket];
+		cacheBuckets[bucket] = entry;
+		cacheEntries++;
+
+		dprintf("[CACHE] cached the response to %s for %u seconds", entry->command->method, entry->command->request.cacheTtl);
+	} while (0);
+
+	cache_release();
+}
+
+/*!
+ * @brief Drop the cached responses that are invalidated by a method.
+ * @param method The method of a request that has just arrived.
+ * @remark Pending misses that the method invalidates stay pending, but the generation
+ *         is bumped so that their responses aren't cached when they arrive.
+ */
+VOID command_cache_invalidate(LPCSTR method)
+{
+	CommandCacheEntry* entry;
+	BOOL matched = FALSE;
+
+	// a miss is registered before its handler runs, so one that this doesn't see started afterwards
+	if ((cacheEntries == 0 && cachePending == NULL) || !cache_acquire())
+	{
+		return;
+	}
+
+	for (entry = cachePending; entry && !matched; entry = entry->next)
+	{
+		matched = cache_match_invalidated(entry, (LPVOID)method);
+	}
+
+	if (cache_drop(cache_match_invalidated, (LPVOID)method, FALSE) || matched)
+	{
+		cacheGeneration++;
+	}
+
+	cache_release();
+}
+
+/*!
+ * @brief Drop the cached responses of a command.
+ * @param command Pointer to the registered command, or \c NULL to empty the cache.
+ * @remark Called when a command is deregistered, as the entries refer to it.
+ */
+VOID command_cache_flush(Command *command)
+{
+	// nothing has been cached if the lock hasn't been created
+	if (cacheLock == NULL || !cache_acquire())
+	{
+		return;
+	}
+
+	cache_drop(cache_match_command, command, TRUE);
+	cache_release();
+}
+
+/*!
+ * @brief Handler for the `core_cache` command.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Pointer to the request packet.
+ * @return Indication of success or failure.
+ * @details Responds with the cache's hit and miss counters and the number of cached
+ *          responses. If TLV_TYPE_CACHE_FLUSH is set, the cache is emptied and the
+ *          counters are reset after they have been reported.
+ */
+DWORD request_core_cache(Remote *remote, Packet *packet)
+{
+	Packet* response = packet_create_response(packet);
+
+	if (!response)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if (!cache_acquire())
+	{
+		packet_transmit_response(ERROR_NOT_ENOUGH_MEMORY, remote, response);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	packet_add_tlv_uint(response, TLV_TYPE_CACHE_HITS, cacheHits);
+	packet_add_tlv_uint(response, TLV_TYPE_CACHE_MISSES, cacheMisses);
+	packet_add_tlv_uint(response, TLV_TYPE_CACHE_ENTRIES, cacheEntries);
+
+	if (packet_get_tlv_value_bool(packet, TLV_TYPE_CACHE_FLUSH))
+	{
+		cache_drop(cache_match_command, NULL, TRUE);
+		cacheHits = cacheMisses = 0;
+	}
+
+	cache_release();
+
+	packet_transmit_response(ERROR_SUCCESS, remote, response);
+
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,33 @@
+/*!
+ * @file command_cache.h
+ * @brief Declarations for caching the responses of idempotent commands.
+ * @details Commands registered with \c COMMAND_REQ_CACHED have their successful
+ *          responses kept for the command's TTL. The cache is keyed by the
+ *          request's TLVs, without the request identifier, so a repeat of a request
+ *          with the same arguments is answered by \c command_handle without running
+ *          the handler at all.
+ *
+ *          Responses are captured on their way out: \c packet_transmit hands every
+ *          outbound packet to \c command_cache_response, which picks out the
+ *          responses to requests that missed the cache.
+ */
+#ifndef _METERPRETER_LIB_COMMAND_CACHE_H
+#define _METERPRETER_LIB_COMMAND_CACHE_H
+
+#include "linkage.h"
+
+/*! @brief Number of hash buckets in the command cache. */
+#define COMMAND_CACHE_BUCKETS      64
+/*! @brief Maximum number of responses held in the command cache. */
+#define COMMAND_CACHE_MAX_ENTRIES  256
+/*! @brief Number of seconds a cache miss waits for its handler's response before it is dropped. */
+#define COMMAND_CACHE_PENDING_TTL  300
+
+LINKAGE BOOL command_cache_answer(Remote *remote, Command *command, Packet *packet);
+LINKAGE VOID command_cache_response(Remote *remote, Packet *packet);
+LINKAGE VOID command_cache_invalidate(LPCSTR method);
+LINKAGE VOID command_cache_flush(Command *command);
+
+LINKAGE DWORD request_core_cache(Remote *remote, Packet *packet);
+
+#endif
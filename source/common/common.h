@@ -162,6 +162,10 @@ void real_dprintf(char *filename, int line, const char *function, char *format,
 #include "base.h"
 #include "core.h"
 #include "remote.h"
+#include "recorder.h"
+#include "command_cache.h"
+#include "lz4.h"
+#include "token_bucket.h"
 
 #include "channel.h"
 #include "scheduler.h"
@@ -178,6 +182,14 @@ void real_dprintf(char *filename, int line, const char *function, char *format,
 #define METERPRETER_TRANSPORT_HTTP  1
 /*! @brief Indication that the Meterpreter transport is using HTTPS. */
 #define METERPRETER_TRANSPORT_HTTPS 2
+/*! @brief Indication that the Meterpreter transport is using WebSockets. */
+#define METERPRETER_TRANSPORT_WS    3
+/*! @brief Indication that the Meterpreter transport is using WebSockets over SSL. */
+#define METERPRETER_TRANSPORT_WSS   4
+/*! @brief Indication that the Meterpreter transport is using reliable UDP. */
+#define METERPRETER_TRANSPORT_UDP   5
+/*! @brief Indication that the Meterpreter transport is using reliable UDP over DTLS. */
+#define METERPRETER_TRANSPORT_DTLS  6
 
 #ifdef _WIN32
 
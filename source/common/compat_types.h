@@ -184,6 +184,8 @@ typedef	long		DWORD;
 typedef	DWORD *		LPDWORD;
 typedef	int32_t		LONG;
 typedef	LONG *		LPLONG;
+typedef	int64_t		LONGLONG;
+typedef	LONGLONG *	PLONGLONG;
 typedef	unsigned int	UINT;
 typedef	int		HANDLE;
 typedef	int		SOCKET;
@@ -207,7 +209,9 @@ typedef uint64_t	QWORD;
 #define ERROR_INVALID_HANDLE   	EINVAL
 #define ERROR_INVALID_DATA     	EINVAL
 #define ERROR_UNSUPPORTED_COMPRESSION	EINVAL
+#define ERROR_WRITE_FAULT	EIO
 #define	ERROR_NOT_SUPPORTED	EOPNOTSUPP
+#define ERROR_TIMEOUT		ETIMEDOUT
 
 #if defined(__FreeBSD__)
  #define	ERROR_INSTALL_USEREXIT	EPROGUNAVAIL
@@ -22,14 +22,6 @@ typedef struct _PacketCompletionRoutineEntry
 	struct _PacketCompletionRoutineEntry *next;       ///< Pointer to the next compleiont routine entry.
 } PacketCompletionRoutineEntry;
 
-/*!
- * @brief Reference to the list of packet completion routines.
- * @details This pointer is a singularly-linked list which contains references
- *          to PacketCompletionRouteEntry items, each of which is processed
- *          when packet_call_completion_handlers is invoked.
- */
-PacketCompletionRoutineEntry *packetCompletionRoutineList = NULL;
-
 /*!
  * @todo I have no idea why this is here, need someone else to explain.
  */
@@ -288,6 +280,9 @@ Packet *packet_create_response(Packet *request)
 		// Add the request identifier to the packet
 		packet_add_tlv_string(response, TLV_TYPE_REQUEST_ID, (PCHAR)requestId.buffer);
 
+		// Remember the request's channel, as not every response repeats it
+		response->channelId = packet_get_tlv_value_uint(request, TLV_TYPE_CHANNEL_ID);
+
 		success = TRUE;
 
 	} while (0);
@@ -345,6 +340,11 @@ VOID packet_destroy(Packet * packet)
 		list_destroy(packet->decompressed_buffers);
 	}
 
+	if (packet->decoded)
+	{
+		free(packet->decoded);
+	}
+
 	memset(packet, 0, sizeof(Packet));
 
 	free(packet);
@@ -630,6 +630,12 @@ DWORD packet_add_tlv_raw(Packet *packet, TlvType type, LPVOID buf, DWORD length)
 	DWORD newPayloadLength = packet->payloadLength + realLength;
 	PUCHAR newPayload = NULL;
 
+	// a reserved TLV must be committed before anything else is appended
+	if (packet->reserved)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
 	// check if this TLV is to be compressed...
 	if ((type & TLV_META_TYPE_COMPRESSED) == TLV_META_TYPE_COMPRESSED)
 	{
@@ -665,6 +671,138 @@ DWORD packet_add_tlv_raw(Packet *packet, TlvType type, LPVOID buf, DWORD length)
 	return ERROR_SUCCESS;
 }
 
+/*!
+ * @brief Reserve space for a TLV value so that it can be written directly into the packet.
+ * @details The TLV header is written immediately and the packet payload is grown by
+ *          \c maxLength bytes. The caller writes up to \c maxLength bytes of value data
+ *          into \c buffer and then calls \c packet_commit_tlv with the number of bytes
+ *          that were actually written, or \c packet_cancel_tlv to drop the TLV. This
+ *          avoids staging the value in a temporary buffer that is then copied in with
+ *          \c packet_add_tlv_raw.
+ * @param packet Pointer to the packet to add the value to.
+ * @param type TLV type for the value.
+ * @param maxLength Maximum number of value bytes that will be written.
+ * @param buffer Pointer that receives the address of the writable value area.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS The operation completed successfully.
+ * @retval ERROR_NOT_ENOUGH_MEMORY Insufficient memory available.
+ * @retval ERROR_INVALID_PARAMETER The packet already has an outstanding reservation.
+ * @remark The returned buffer is only valid until the reservation is committed or
+ *         cancelled. No other TLVs may be added to the packet in the meantime.
+ */
+DWORD packet_reserve_tlv(Packet *packet, TlvType type, DWORD maxLength, PUCHAR *buffer)
+{
+	DWORD headerLength = sizeof(TlvHeader);
+	DWORD newPayloadLength = packet->payloadLength + headerLength + maxLength;
+	PUCHAR newPayload = NULL;
+
+	if (packet->reserved)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	// Allocate/Reallocate the packet's payload
+	if (packet->payload)
+	{
+		newPayload = (PUCHAR)realloc(packet->payload, newPayloadLength);
+	}
+	else
+	{
+		newPayload = (PUCHAR)malloc(newPayloadLength);
+	}
+
+	if (!newPayload)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	// The length is fixed up when the TLV is committed
+	((LPDWORD)(newPayload + packet->payloadLength))[0] = htonl(headerLength + maxLength);
+	((LPDWORD)(newPayload + packet->payloadLength))[1] = htonl((DWORD)type);
+
+	packet->reservedOffset = packet->payloadLength;
+	packet->reservedLength = maxLength;
+	packet->reserved = TRUE;
+	packet->payload = newPayload;
+	packet->payloadLength = newPayloadLength;
+
+	*buffer = newPayload + packet->reservedOffset + headerLength;
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Finalise a TLV that was opened with \c packet_reserve_tlv.
+ * @details The unused tail of the reservation is trimmed from the payload. If the
+ *          reserved type carries \c TLV_META_TYPE_COMPRESSED the written value is
+ *          compressed on the way in, as \c packet_add_tlv_raw would have done.
+ * @param packet Pointer to the packet holding the reservation.
+ * @param actualLength Number of value bytes that were written into the reservation.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS The operation completed successfully.
+ * @retval ERROR_INVALID_PARAMETER There is no reservation, or \c actualLength exceeds it.
+ * @retval ERROR_NOT_ENOUGH_MEMORY Insufficient memory available to compress the value.
+ */
+DWORD packet_commit_tlv(Packet *packet, DWORD actualLength)
+{
+	DWORD headerLength = sizeof(TlvHeader);
+	DWORD realLength = actualLength + headerLength;
+	PUCHAR current = NULL;
+	TlvType type;
+	LPVOID value = NULL;
+	DWORD result = ERROR_SUCCESS;
+
+	if (!packet->reserved || actualLength > packet->reservedLength)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	current = packet->payload + packet->reservedOffset;
+	type = (TlvType)ntohl(((LPDWORD)current)[1]);
+
+	if ((type & TLV_META_TYPE_COMPRESSED) == TLV_META_TYPE_COMPRESSED)
+	{
+		// compression needs its own output buffer anyway, so lift the value out and
+		// let the regular compressed path append it in place of the reservation
+		if (!(value = malloc(actualLength ? actualLength : 1)))
+		{
+			packet_cancel_tlv(packet);
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		memcpy(value, current + headerLength, actualLength);
+		packet_cancel_tlv(packet);
+
+		result = packet_add_tlv_raw_compressed(packet, type, value, actualLength);
+
+		free(value);
+
+		return result;
+	}
+
+	((LPDWORD)current)[0] = htonl(realLength);
+
+	// Drop whatever was not used, the payload buffer itself is left as-is
+	packet->payloadLength = packet->reservedOffset + realLength;
+	packet->header.length = htonl(ntohl(packet->header.length) + realLength);
+	packet->reserved = FALSE;
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Abandon a TLV that was opened with \c packet_reserve_tlv.
+ * @param packet Pointer to the packet holding the reservation.
+ */
+VOID packet_cancel_tlv(Packet *packet)
+{
+	if (packet->reserved)
+	{
+		packet->payloadLength = packet->reservedOffset;
+		packet->reserved = FALSE;
+	}
+}
+
 /*!
  * @brief Check if a TLV is NULL-terminated.
  * @details The function checks the data within the range of bytes specified by
@@ -685,6 +823,203 @@ DWORD packet_is_tlv_null_terminated( Tlv *tlv )
 	return ERROR_SUCCESS;
 }
 
+/*!
+ * @brief Decode a single TLV value into the member described by a schema field.
+ * @param field Pointer to the schema field that matched the TLV.
+ * @param tlv Pointer to the (decompressed) TLV to decode.
+ * @param decoded Pointer to the start of the decoded structure.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS The value was decoded.
+ * @retval ERROR_INVALID_PARAMETER The value is too short for, or not valid as, the field kind.
+ */
+static DWORD packet_decode_field(const TlvSchemaField *field, Tlv *tlv, PUCHAR decoded)
+{
+	PUCHAR member = decoded + field->offset;
+
+	switch (field->kind)
+	{
+	case TLV_SCHEMA_KIND_STRING:
+		if (!tlv->header.length || packet_is_tlv_null_terminated(tlv) != ERROR_SUCCESS)
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+		*(PCHAR *)member = (PCHAR)tlv->buffer;
+		break;
+	case TLV_SCHEMA_KIND_UINT:
+		if (tlv->header.length < sizeof(UINT))
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+		*(UINT *)member = ntohl(*(LPDWORD)tlv->buffer);
+		break;
+	case TLV_SCHEMA_KIND_QWORD:
+		if (tlv->header.length < sizeof(QWORD))
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+		*(QWORD *)member = ntohq(*(QWORD *)tlv->buffer);
+		break;
+	case TLV_SCHEMA_KIND_BOOL:
+		if (tlv->header.length < 1)
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+		*(BOOL *)member = (BOOL)(*(PCHAR)tlv->buffer);
+		break;
+	default:
+		memcpy(member, tlv, sizeof(Tlv));
+		break;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Decode the TLVs described by a schema into a structure with a single pass over the packet.
+ * @details Every TLV in the packet is visited exactly once. String TLVs are checked for
+ *          NULL-termination whether or not they are part of the schema (this matches the
+ *          validation done by the command dispatcher), and the first instance of each schema
+ *          TLV is decoded into the corresponding member of \c decoded. Members for TLVs that
+ *          are not present are left zeroed. Compressed TLVs are decompressed transparently.
+ *          If the packet has already been validated against the same schema by the dispatcher
+ *          then the cached result is copied out instead of walking the packet again.
+ * @param packet Pointer to the packet to decode.
+ * @param schema Pointer to the schema that describes the structure.
+ * @param decoded Pointer to a structure of \c schema->size bytes which receives the values.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS The packet was decoded.
+ * @retval ERROR_INVALID_PARAMETER The packet is malformed or a required TLV is missing.
+ * @remark Pointers stored in the decoded structure refer to the packet, and are only valid
+ *         for as long as the packet is.
+ */
+DWORD packet_decode(Packet *packet, TlvSchema *schema, LPVOID decoded)
+{
+	DWORD offset = 0, length = 0, index;
+	ULONG found = 0;
+
+	if (schema->numFields > TLV_SCHEMA_MAX_FIELDS)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (packet->decoded && packet->decodedSchema == schema)
+	{
+		memcpy(decoded, packet->decoded, schema->size);
+		return ERROR_SUCCESS;
+	}
+
+	memset(decoded, 0, schema->size);
+
+	for (offset = 0; offset + sizeof(TlvHeader) <= packet->payloadLength; offset += length)
+	{
+		TlvHeader *header = (TlvHeader *)(packet->payload + offset);
+		TlvType type = (TlvType)ntohl(header->type);
+		BOOL compressed = (type & TLV_META_TYPE_COMPRESSED) == TLV_META_TYPE_COMPRESSED;
+		Tlv current;
+
+		length = ntohl(header->length);
+
+		if (length < sizeof(TlvHeader) || length > packet->payloadLength - offset)
+		{
+			dprintf("[SCHEMA] %s: malformed TLV at offset %u", schema->name, offset);
+			return ERROR_INVALID_PARAMETER;
+		}
+
+		if (compressed)
+		{
+			type = (TlvType)(type ^ TLV_META_TYPE_COMPRESSED);
+		}
+
+		current.header.type = type;
+		current.header.length = length - sizeof(TlvHeader);
+		current.buffer = packet->payload + offset + sizeof(TlvHeader);
+
+		if (!compressed && TLV_META_TYPE_MASK(type) == TLV_META_TYPE_STRING
+			&& packet_is_tlv_null_terminated(&current) != ERROR_SUCCESS)
+		{
+			dprintf("[SCHEMA] %s: unterminated string TLV %u", schema->name, type);
+			return ERROR_INVALID_PARAMETER;
+		}
+
+		for (index = 0; index < schema->numFields; index++)
+		{
+			if ((found & (1U << index)) || schema->fields[index].type != type)
+			{
+				continue;
+			}
+
+			// decompression is confined to this TLV, so pass the find routine just its bytes
+			if (compressed && packet_find_tlv_buf(packet, packet->payload + offset, length, 0, type, &current) != ERROR_SUCCESS)
+			{
+				return ERROR_INVALID_PARAMETER;
+			}
+
+			if (packet_decode_field(&schema->fields[index], &current, (PUCHAR)decoded) != ERROR_SUCCESS)
+			{
+				dprintf("[SCHEMA] %s: invalid value for TLV %u", schema->name, type);
+				return ERROR_INVALID_PARAMETER;
+			}
+
+			found |= 1U << index;
+			break;
+		}
+	}
+
+	for (index = 0; index < schema->numFields; index++)
+	{
+		if ((schema->fields[index].flags & TLV_SCHEMA_REQUIRED) && !(found & (1U << index)))
+		{
+			dprintf("[SCHEMA] %s: required TLV %u is missing", schema->name, schema->fields[index].type);
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Validate a packet against a schema, caching the decoded result on the packet.
+ * @details Used by the command dispatcher so that a handler's subsequent call to
+ *          \c packet_decode with the same schema doesn't need to walk the packet again.
+ * @param packet Pointer to the packet to validate.
+ * @param schema Pointer to the schema to validate against.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS The packet matches the schema.
+ * @retval ERROR_NOT_ENOUGH_MEMORY Unable to allocate the decoded structure.
+ * @retval ERROR_INVALID_PARAMETER The packet does not match the schema.
+ */
+DWORD packet_validate_schema(Packet *packet, TlvSchema *schema)
+{
+	LPVOID decoded = NULL;
+	DWORD result;
+
+	if (packet->decoded && packet->decodedSchema == schema)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	if (!(decoded = malloc(schema->size)))
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if ((result = packet_decode(packet, schema, decoded)) != ERROR_SUCCESS)
+	{
+		free(decoded);
+		return result;
+	}
+
+	if (packet->decoded)
+	{
+		free(packet->decoded);
+	}
+
+	packet->decoded = decoded;
+	packet->decodedSchema = schema;
+
+	return ERROR_SUCCESS;
+}
+
 /*!
  * @brief Get the TLV type of the packet.
  * @param packet Pointer to the packet to get the type from.
@@ -1083,11 +1418,17 @@ DWORD packet_find_tlv_buf(Packet *packet, PUCHAR payload, DWORD payloadLength, D
 
 /*!
  * @brief Add a completion routine for a given request identifier.
+ * @details Each \c Remote keeps its own singularly-linked list of
+ *          \c PacketCompletionRoutineEntry items, each of which is processed
+ *          when packet_call_completion_handlers is invoked for that \c Remote.
+ * @param remote Pointer to the \c Remote the request is sent to.
+ * @param requestId ID of the request.
+ * @param completion Pointer to the completion routine to call.
  * @return Indication of success or failure.
  * @retval ERROR_NOT_ENOUGH_MEMORY Unable to allocate memory for the \c PacketCompletionRouteEntry instance.
  * @retval ERROR_SUCCESS Addition was successful.
  */
-DWORD packet_add_completion_handler(LPCSTR requestId, PacketRequestCompletion *completion)
+DWORD packet_add_completion_handler(Remote *remote, LPCSTR requestId, PacketRequestCompletion *completion)
 {
 	PacketCompletionRoutineEntry *entry;
 	DWORD res = ERROR_SUCCESS;
@@ -1115,8 +1456,8 @@ DWORD packet_add_completion_handler(LPCSTR requestId, PacketRequestCompletion *c
 		}
 
 		// Add the entry to the list
-		entry->next = packetCompletionRoutineList;
-		packetCompletionRoutineList = entry;
+		entry->next = remote->completion_routines;
+		remote->completion_routines = entry;
 
 	} while (0);
 
@@ -1148,7 +1489,7 @@ DWORD packet_call_completion_handlers( Remote *remote, Packet *response, LPCSTR
 	}
 
 	// Enumerate the completion routine list
-	for (current = packetCompletionRoutineList; current; current = current->next)
+	for (current = remote->completion_routines; current; current = current->next)
 	{
 		// Does the request id of the completion entry match the packet's request
 		// id?
@@ -1166,7 +1507,7 @@ DWORD packet_call_completion_handlers( Remote *remote, Packet *response, LPCSTR
 
 	if (matches)
 	{
-		packet_remove_completion_handler(requestId);
+		packet_remove_completion_handler(remote, requestId);
 	}
 
 	return (matches > 0) ? ERROR_SUCCESS : ERROR_NOT_FOUND;
@@ -1174,15 +1515,16 @@ DWORD packet_call_completion_handlers( Remote *remote, Packet *response, LPCSTR
 
 /*!
  * @brief Remove a set of completion routine handlers for a given request identifier.
+ * @param remote Pointer to the \c Remote the request was sent to.
  * @param requestId ID of the request.
  * @return \c ERROR_SUCCESS is always returned.
  */
-DWORD packet_remove_completion_handler( LPCSTR requestId )
+DWORD packet_remove_completion_handler( Remote *remote, LPCSTR requestId )
 {
 	PacketCompletionRoutineEntry *current, *next, *prev;
 
 	// Enumerate the list, removing entries that match
-	for (current = packetCompletionRoutineList, next = NULL, prev = NULL;
+	for (current = remote->completion_routines, next = NULL, prev = NULL;
 	     current;
 		  prev = current, current = next)
 	{
@@ -1200,7 +1542,7 @@ DWORD packet_remove_completion_handler( LPCSTR requestId )
 		}
 		else
 		{
-			packetCompletionRoutineList = next;
+			remote->completion_routines = next;
 		}
 
 		// Deallocate it
@@ -1211,6 +1553,39 @@ DWORD packet_remove_completion_handler( LPCSTR requestId )
 	return ERROR_SUCCESS;
 }
 
+/*!
+ * @brief Remove every completion routine handler, for requests that will never be answered.
+ * @param remote Pointer to the \c Remote whose handlers are to be removed.
+ */
+VOID packet_clear_completion_handlers( Remote *remote )
+{
+	PacketCompletionRoutineEntry *current;
+
+	while ((current = remote->completion_routines) != NULL)
+	{
+		remote->completion_routines = current->next;
+
+		free((PCHAR)current->requestId);
+		free(current);
+	}
+}
+
+/*!
+ * @brief Transmit a packet over the transport of a session.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Pointer to the \c Packet that is to be sent.
+ * @param completion Pointer to the completion routine for a request, or \c NULL.
+ * @return An indication of the result of processing the transmission request.
+ * @remark Every outbound packet passes through here, whichever transport is in use,
+ *         so this is where the responses to cache misses are picked out.
+ */
+DWORD packet_transmit(Remote *remote, Packet *packet, PacketRequestCompletion *completion)
+{
+	command_cache_response(remote, packet);
+
+	return remote->transport->packet_transmit(remote, packet, completion);
+}
+
 /*!
  * @brief Transmit a response with just a result code to the remote endpoint.
  * @param remote Pointer to the \c Remote instance.
@@ -86,11 +86,24 @@ typedef enum
  */
 #define LOAD_LIBRARY_FLAG_LOCAL     (1 << 2)
 
+/*!
+ * @brief Indicates that the client answers \c core_loadlib_request.
+ * @detail Sent in \c TLV_TYPE_CLIENT_CAPABILITIES with a \c core_loadlib request. Only
+ *         clients that advertise it are asked for the images of command groups that
+ *         are loaded on demand, everyone else has to load those images themselves.
+ */
+#define CLIENT_CAPABILITY_LOADLIB_REQUEST (1 << 0)
+
 /*! @brief An indication of whether the challen is synchronous or asynchronous. */
 #define CHANNEL_FLAG_SYNCHRONOUS    (1 << 0)
 /*! @brief An indication of whether the content written to the channel should be compressed. */
 #define CHANNEL_FLAG_COMPRESS       (1 << 1)
 
+/*! @brief Indication that the server sends the data of a bandwidth test. */
+#define BWTEST_DIRECTION_DOWNLOAD   0
+/*! @brief Indication that the server receives the data of a bandwidth test. */
+#define BWTEST_DIRECTION_UPLOAD     1
+
 /*! @brief Type definition with defines `TlvMetaType` as an double-word. */
 typedef DWORD TlvMetaType;
 
@@ -127,6 +140,8 @@ typedef enum
 	TLV_TYPE_SEEK_WHENCE         = TLV_VALUE(TLV_META_TYPE_UINT,       70),
 	TLV_TYPE_SEEK_OFFSET         = TLV_VALUE(TLV_META_TYPE_UINT,       71),
 	TLV_TYPE_SEEK_POS            = TLV_VALUE(TLV_META_TYPE_UINT,       72),
+	TLV_TYPE_SEEK_OFFSET64       = TLV_VALUE(TLV_META_TYPE_QWORD,      73),   ///! Represents a signed 64-bit seek offset, used instead of TLV_TYPE_SEEK_OFFSET when present.
+	TLV_TYPE_SEEK_POS64          = TLV_VALUE(TLV_META_TYPE_QWORD,      74),   ///! Represents the full 64-bit position returned by a tell.
 
 	// Grouped identifiers
 	TLV_TYPE_EXCEPTION_CODE      = TLV_VALUE(TLV_META_TYPE_UINT,      300),   ///! Represents an exception code value (unsigned in).
@@ -143,6 +158,7 @@ typedef enum
 	TLV_TYPE_MIGRATE_BASE_ADDR   = TLV_VALUE(TLV_META_TYPE_UINT,      407),   ///! Represents a migration payload base address (unsigned int).
 	TLV_TYPE_MIGRATE_ENTRY_POINT = TLV_VALUE(TLV_META_TYPE_UINT,      408),   ///! Represents a migration payload entry point (unsigned int).
 	TLV_TYPE_MIGRATE_SOCKET_PATH = TLV_VALUE(TLV_META_TYPE_STRING,    409),   ///! Represents a unix domain socket path, used to migrate on linux (string)
+	TLV_TYPE_CLIENT_CAPABILITIES = TLV_VALUE(TLV_META_TYPE_UINT,      410),   ///! Represents the capabilities of the client (CLIENT_CAPABILITY_*).
 
 	// Transport switching
 	TLV_TYPE_TRANS_TYPE          = TLV_VALUE(TLV_META_TYPE_UINT,      430),   ///! Represents the type of transport to switch to.
@@ -164,6 +180,56 @@ typedef enum
 	TLV_TYPE_CIPHER_NAME         = TLV_VALUE(TLV_META_TYPE_STRING,    500),   ///! Represents the name of a cipher.
 	TLV_TYPE_CIPHER_PARAMETERS   = TLV_VALUE(TLV_META_TYPE_GROUP,     501),   ///! Represents parameters for a cipher.
 
+	// Profiling
+	TLV_TYPE_PROFILE_ACTION      = TLV_VALUE(TLV_META_TYPE_UINT,      520),   ///! Represents the profiler action to perform (PROFILE_ACTION_*).
+	TLV_TYPE_PROFILE_INTERVAL    = TLV_VALUE(TLV_META_TYPE_UINT,      521),   ///! Represents the sampling interval in microseconds.
+	TLV_TYPE_PROFILE_ENTRY       = TLV_VALUE(TLV_META_TYPE_GROUP,     522),   ///! Represents a single aggregated profile entry.
+	TLV_TYPE_PROFILE_COUNT       = TLV_VALUE(TLV_META_TYPE_UINT,      523),   ///! Represents the number of samples for an entry.
+	TLV_TYPE_PROFILE_THREAD      = TLV_VALUE(TLV_META_TYPE_UINT,      524),   ///! Represents the thread identifier for an entry.
+	TLV_TYPE_PROFILE_FRAME       = TLV_VALUE(TLV_META_TYPE_STRING,    525),   ///! Represents a symbolised stack frame, innermost first.
+	TLV_TYPE_PROFILE_DROPPED     = TLV_VALUE(TLV_META_TYPE_UINT,      526),   ///! Represents the number of samples that were dropped.
+	TLV_TYPE_PROFILE_BYTES       = TLV_VALUE(TLV_META_TYPE_QWORD,     527),   ///! Represents the number of bytes allocated for an entry.
+	TLV_TYPE_PROFILE_LIVE_COUNT  = TLV_VALUE(TLV_META_TYPE_UINT,      528),   ///! Represents the number of allocations for an entry that are still live.
+	TLV_TYPE_PROFILE_LIVE_BYTES  = TLV_VALUE(TLV_META_TYPE_QWORD,     529),   ///! Represents the number of bytes for an entry that are still live.
+	TLV_TYPE_PROFILE_LIMIT       = TLV_VALUE(TLV_META_TYPE_UINT,      530),   ///! Represents the maximum number of entries to return.
+
+	// Command cache
+	TLV_TYPE_CACHE_HITS          = TLV_VALUE(TLV_META_TYPE_UINT,      540),   ///! Represents the number of requests answered from the command cache.
+	TLV_TYPE_CACHE_MISSES        = TLV_VALUE(TLV_META_TYPE_UINT,      541),   ///! Represents the number of cacheable requests that ran their handler.
+	TLV_TYPE_CACHE_ENTRIES       = TLV_VALUE(TLV_META_TYPE_UINT,      542),   ///! Represents the number of responses held in the command cache.
+	TLV_TYPE_CACHE_FLUSH         = TLV_VALUE(TLV_META_TYPE_BOOL,      543),   ///! Indicates that the command cache should be emptied.
+
+	// Channel rate limits
+	TLV_TYPE_LIMIT_RATE          = TLV_VALUE(TLV_META_TYPE_UINT,      550),   ///! Represents a rate limit in bytes per second, zero for none.
+	TLV_TYPE_LIMIT_BURST         = TLV_VALUE(TLV_META_TYPE_UINT,      551),   ///! Represents the number of bytes that can be sent in a burst.
+	TLV_TYPE_LIMIT_BYTES         = TLV_VALUE(TLV_META_TYPE_QWORD,     552),   ///! Represents the number of bytes sent since the limit was first set.
+	TLV_TYPE_LIMIT_THROTTLED     = TLV_VALUE(TLV_META_TYPE_UINT,      553),   ///! Represents the number of sends that were held back by the limit.
+	TLV_TYPE_LIMIT_DELAY         = TLV_VALUE(TLV_META_TYPE_QWORD,     554),   ///! Represents the total time in milliseconds that sends were held back.
+
+	// Channel statistics
+	TLV_TYPE_CHANNEL_STATS       = TLV_VALUE(TLV_META_TYPE_GROUP,     560),   ///! Represents the traffic counters of a single channel.
+	TLV_TYPE_CHANNEL_BYTES_IN    = TLV_VALUE(TLV_META_TYPE_QWORD,     561),   ///! Represents the number of bytes written to the channel by the remote side.
+	TLV_TYPE_CHANNEL_PACKETS_IN  = TLV_VALUE(TLV_META_TYPE_UINT,      562),   ///! Represents the number of writes to the channel by the remote side.
+	TLV_TYPE_CHANNEL_BYTES_OUT   = TLV_VALUE(TLV_META_TYPE_QWORD,     563),   ///! Represents the number of bytes sent from the channel to the remote side.
+	TLV_TYPE_CHANNEL_PACKETS_OUT = TLV_VALUE(TLV_META_TYPE_UINT,      564),   ///! Represents the number of sends from the channel to the remote side.
+	TLV_TYPE_CHANNEL_BUFFERED    = TLV_VALUE(TLV_META_TYPE_UINT,      565),   ///! Represents the number of bytes waiting in the channel's buffer.
+	TLV_TYPE_CHANNEL_BLOCKED     = TLV_VALUE(TLV_META_TYPE_QWORD,     566),   ///! Represents the total time in milliseconds the channel's reads and writes were blocked.
+	TLV_TYPE_CHANNEL_ERRORS      = TLV_VALUE(TLV_META_TYPE_UINT,      567),   ///! Represents the number of reads and writes on the channel that failed.
+	TLV_TYPE_CHANNEL_IDLE        = TLV_VALUE(TLV_META_TYPE_UINT,      568),   ///! Represents the time in milliseconds since the channel last read or wrote.
+
+	// Link diagnostics
+	TLV_TYPE_PING_DATA           = TLV_VALUE(TLV_META_TYPE_RAW,       570),   ///! Represents data that is echoed back by a ping.
+	TLV_TYPE_PING_TIMESTAMP      = TLV_VALUE(TLV_META_TYPE_QWORD,     571),   ///! Represents the requester's time, echoed back by a ping.
+	TLV_TYPE_PING_RECEIVED       = TLV_VALUE(TLV_META_TYPE_QWORD,     572),   ///! Represents the server time in microseconds at which a ping was handled.
+	TLV_TYPE_PING_SENT           = TLV_VALUE(TLV_META_TYPE_QWORD,     573),   ///! Represents the server time in microseconds at which a ping was answered.
+	TLV_TYPE_BWTEST_DIRECTION    = TLV_VALUE(TLV_META_TYPE_UINT,      574),   ///! Represents the direction of a bandwidth test (BWTEST_DIRECTION_*).
+	TLV_TYPE_BWTEST_LENGTH       = TLV_VALUE(TLV_META_TYPE_QWORD,     575),   ///! Represents the number of bytes moved by a bandwidth test.
+	TLV_TYPE_BWTEST_CHUNK        = TLV_VALUE(TLV_META_TYPE_UINT,      576),   ///! Represents the number of bytes in each write of a bandwidth test.
+	TLV_TYPE_BWTEST_ELAPSED      = TLV_VALUE(TLV_META_TYPE_QWORD,     577),   ///! Represents the time in microseconds a bandwidth test took on the server.
+
+	// Pipelined channel requests
+	TLV_TYPE_CHANNEL_SEQUENCE    = TLV_VALUE(TLV_META_TYPE_UINT,      580),   ///! Represents the position of a read or write among a channel's pipelined requests.
+
 	TLV_TYPE_EXTENSIONS          = TLV_VALUE(TLV_META_TYPE_COMPLEX, 20000),   ///! Represents an extension value.
 	TLV_TYPE_USER                = TLV_VALUE(TLV_META_TYPE_COMPLEX, 40000),   ///! Represents a user value.
 	TLV_TYPE_TEMP                = TLV_VALUE(TLV_META_TYPE_COMPLEX, 60000),   ///! Represents a temporary value.
@@ -192,6 +258,77 @@ typedef struct
 	PUCHAR    buffer;
 } Tlv;
 
+/*! @brief Maximum number of fields that a single TLV schema may describe. */
+#define TLV_SCHEMA_MAX_FIELDS   32
+
+/*! @brief Schema field flag indicating the TLV must be present for the packet to be valid. */
+#define TLV_SCHEMA_REQUIRED     (1 << 0)
+
+/*!
+ * @brief Enumeration of the value kinds a TLV schema field can be decoded into.
+ */
+typedef enum
+{
+	TLV_SCHEMA_KIND_STRING = 0,   ///< Decoded into a `PCHAR` pointing at the NULL-terminated value.
+	TLV_SCHEMA_KIND_UINT   = 1,   ///< Decoded into a host-order `UINT`.
+	TLV_SCHEMA_KIND_QWORD  = 2,   ///< Decoded into a host-order `QWORD`.
+	TLV_SCHEMA_KIND_BOOL   = 3,   ///< Decoded into a `BOOL`.
+	TLV_SCHEMA_KIND_RAW    = 4,   ///< Decoded into a `Tlv` referencing the value.
+} TlvSchemaKind;
+
+/*! @brief Describes a single TLV that is extracted by a schema decode. */
+typedef struct _TlvSchemaField
+{
+	TlvType       type;     ///< Type of the TLV to extract.
+	TlvSchemaKind kind;     ///< The kind of value the TLV is decoded into.
+	DWORD         flags;    ///< Combination of TLV_SCHEMA_* flags.
+	DWORD         offset;   ///< Offset of the destination member in the decoded structure.
+} TlvSchemaField;
+
+/*! @brief Describes the set of TLVs a packet is expected to carry, and where they are decoded to. */
+typedef struct _TlvSchema
+{
+	LPCSTR                name;        ///< Name of the schema, used for diagnostics.
+	const TlvSchemaField* fields;      ///< Array of field descriptions.
+	DWORD                 numFields;   ///< Number of entries in \c fields.
+	DWORD                 size;        ///< Size of the decoded structure.
+} TlvSchema;
+
+/*! @brief Maps a schema field kind to the C type of the decoded structure member. */
+#define TLV_SCHEMA_CTYPE_STRING PCHAR
+#define TLV_SCHEMA_CTYPE_UINT   UINT
+#define TLV_SCHEMA_CTYPE_QWORD  QWORD
+#define TLV_SCHEMA_CTYPE_BOOL   BOOL
+#define TLV_SCHEMA_CTYPE_RAW    Tlv
+
+/*! @brief Field expander that emits a structure member for a schema field. */
+#define TLV_SCHEMA_MEMBER(schema, kind, name, type, flags) TLV_SCHEMA_CTYPE_##kind name;
+/*! @brief Field expander that emits a \c TlvSchemaField entry for a schema field. */
+#define TLV_SCHEMA_ENTRY(schema, kind, name, type, flags) { type, TLV_SCHEMA_KIND_##kind, flags, (DWORD)offsetof(schema, name) },
+
+/*!
+ * @brief Declares the decoded structure and the schema object for a field list.
+ * @details \c fields is a macro taking an expander and the schema name, and invoking
+ *          the expander once per field as `F(S, KIND, member, TLV_TYPE_..., flags)`:
+ *
+ *          #define FS_STAT_FIELDS(F, S) \
+ *              F(S, STRING, path, TLV_TYPE_FILE_PATH, TLV_SCHEMA_REQUIRED)
+ *          TLV_SCHEMA_DECLARE(FsStatRequest, FS_STAT_FIELDS)
+ *
+ *          This results in a `FsStatRequest` structure with a `PCHAR path` member and an
+ *          `FsStatRequestSchema` object that describes it.
+ */
+#define TLV_SCHEMA_DECLARE(schema, fields) \
+	typedef struct _##schema { fields(TLV_SCHEMA_MEMBER, schema) } schema; \
+	extern TlvSchema schema##Schema;
+
+/*!
+ * @brief Defines the schema object for a field list previously passed to \c TLV_SCHEMA_DECLARE.
+ */
+#define TLV_SCHEMA_DEFINE(schema, fields) \
+	static const TlvSchemaField schema##Fields[] = { fields(TLV_SCHEMA_ENTRY, schema) }; \
+	TlvSchema schema##Schema = { #schema, schema##Fields, sizeof(schema##Fields) / sizeof(TlvSchemaField), sizeof(schema) };
+
 /*! @brief Packet definition. */
 typedef struct _Packet
 {
@@ -201,6 +338,15 @@ typedef struct _Packet
 	ULONG     payloadLength;
 
 	LIST *    decompressed_buffers;
+
+	ULONG     reservedOffset;     ///< Payload offset of the TLV opened by packet_reserve_tlv.
+	ULONG     reservedLength;     ///< Maximum value length of the reserved TLV.
+	BOOL      reserved;           ///< Indicates that a reserved TLV is awaiting commit.
+
+	TlvSchema* decodedSchema;     ///< Schema that \c decoded was produced from, if any.
+	LPVOID    decoded;            ///< Cached result of the last validated schema decode.
+
+	DWORD     channelId;          ///< Channel of the request that a response answers, zero if none.
 } Packet;
 
 typedef struct _DECOMPRESSED_BUFFER
@@ -239,7 +385,12 @@ LINKAGE DWORD packet_add_tlv_bool(Packet *packet, TlvType type, BOOL val);
 LINKAGE DWORD packet_add_tlv_group(Packet *packet, TlvType type, Tlv *entries, DWORD numEntries);
 LINKAGE DWORD packet_add_tlvs(Packet *packet, Tlv *entries, DWORD numEntries);
 LINKAGE DWORD packet_add_tlv_raw(Packet *packet, TlvType type, LPVOID buf, DWORD length);
+LINKAGE DWORD packet_reserve_tlv(Packet *packet, TlvType type, DWORD maxLength, PUCHAR *buffer);
+LINKAGE DWORD packet_commit_tlv(Packet *packet, DWORD actualLength);
+LINKAGE VOID packet_cancel_tlv(Packet *packet);
 LINKAGE DWORD packet_is_tlv_null_terminated(Tlv *tlv);
+LINKAGE DWORD packet_decode(Packet *packet, TlvSchema *schema, LPVOID decoded);
+LINKAGE DWORD packet_validate_schema(Packet *packet, TlvSchema *schema);
 LINKAGE PacketTlvType packet_get_type(Packet *packet);
 LINKAGE TlvMetaType packet_get_tlv_meta(Packet *packet, Tlv *tlv);
 LINKAGE DWORD packet_get_tlv(Packet *packet, TlvType type, Tlv *tlv);
@@ -261,8 +412,9 @@ LINKAGE DWORD packet_get_result(Packet *packet);
 /*
  * Packet transmission
  */
+LINKAGE DWORD packet_transmit(Remote *remote, Packet *packet, PacketRequestCompletion *completion);
 LINKAGE DWORD packet_transmit_empty_response(Remote *remote, Packet *packet, DWORD res);
-#define PACKET_TRANSMIT(remote, packet, completion) (remote->transport->packet_transmit(remote, packet, completion))
+#define PACKET_TRANSMIT(remote, packet, completion) packet_transmit(remote, packet, completion)
 
 /*!
  * @brief Transmit a `TLV_TYPE_RESULT` response if `response` is present.
@@ -279,9 +431,10 @@ LINKAGE DWORD packet_transmit_empty_response(Remote *remote, Packet *packet, DWO
 /*
  * Packet completion notification
  */
-LINKAGE DWORD packet_add_completion_handler(LPCSTR requestId, PacketRequestCompletion *completion);
+LINKAGE DWORD packet_add_completion_handler(Remote *remote, LPCSTR requestId, PacketRequestCompletion *completion);
 LINKAGE DWORD packet_call_completion_handlers(Remote *remote, Packet *response,LPCSTR requestId);
-LINKAGE DWORD packet_remove_completion_handler(LPCSTR requestId);
+LINKAGE DWORD packet_remove_completion_handler(Remote *remote, LPCSTR requestId);
+LINKAGE VOID packet_clear_completion_handlers(Remote *remote);
 
 /*
  * Core API
@@ -0,0 +1,269 @@
+/*!
+ * @file lz4.c
+ * @brief Definitions for the LZ4 block codec.
+ */
+#include "common.h"
+
+/*! @brief Number of bits in the hash of the four byte sequences that are matched. */
+#define LZ4_HASH_BITS      12
+/*! @brief Shortest match that can be encoded. */
+#define LZ4_MIN_MATCH      4
+/*! @brief Matches must start at least this many bytes before the end of the input. */
+#define LZ4_MATCH_LIMIT    12
+/*! @brief The last this many bytes of the input are always literals. */
+#define LZ4_LAST_LITERALS  5
+/*! @brief Furthest back a match can refer to. */
+#define LZ4_MAX_DISTANCE   65535
+
+/*!
+ * @brief Read four bytes that may not be aligned.
+ * @param p Pointer to the bytes.
+ * @return The bytes, in host order.
+ */
+static DWORD lz4_read32(PUCHAR p)
+{
+	DWORD value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+/*!
+ * @brief Write a length that doesn't fit in a token nibble.
+ * @param op Pointer to the output position.
+ * @param length The length, less the 15 that is in the token.
+ * @return The updated output position.
+ */
+static PUCHAR lz4_write_length(PUCHAR op, DWORD length)
+{
+	while (length >= 255)
+	{
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (UCHAR)length;
+	return op;
+}
+
+/*!
+ * @brief Write a sequence of literals, optionally followed by a match.
+ * @param op Pointer to the output position.
+ * @param oend Pointer to the end of the output buffer.
+ * @param literals Pointer to the literals.
+ * @param literalLength Number of literals.
+ * @param offset Distance back to the match, or zero for the final, literal only, sequence.
+ * @param matchLength Length of the match.
+ * @return The updated output position, or \c NULL if the sequence doesn't fit.
+ */
+static PUCHAR lz4_write_sequence(PUCHAR op, PUCHAR oend, PUCHAR literals, DWORD literalLength,
+	DWORD offset, DWORD matchLength)
+{
+	PUCHAR token = op++;
+
+	// worst case size of the sequence
+	if ((DWORD)(oend - op) < literalLength + literalLength / 255 + matchLength / 255 + 8)
+	{
+		return NULL;
+	}
+
+	if (literalLength >= 15)
+	{
+		*token = 15 << 4;
+		op = lz4_write_length(op, literalLength - 15);
+	}
+	else
+	{
+		*token = (UCHAR)(literalLength << 4);
+	}
+
+	memcpy(op, literals, literalLength);
+	op += literalLength;
+
+	if (offset == 0)
+	{
+		return op;
+	}
+
+	*op++ = (UCHAR)offset;
+	*op++ = (UCHAR)(offset >> 8);
+
+	matchLength -= LZ4_MIN_MATCH;
+	if (matchLength >= 15)
+	{
+		*token |= 15;
+		op = lz4_write_length(op, matchLength - 15);
+	}
+	else
+	{
+		*token |= (UCHAR)matchLength;
+	}
+
+	return op;
+}
+
+/*!
+ * @brief Compress a block of data.
+ * @param source Pointer to the data to compress.
+ * @param sourceLength Number of bytes to compress.
+ * @param dest Pointer to the buffer that receives the compressed data.
+ * @param destSize Size of the \c dest buffer. \c LZ4_COMPRESS_BOUND(sourceLength) always suffices.
+ * @return The size of the compressed data, or zero if it doesn't fit in \c dest.
+ * @remark Matches are found greedily through a small hash table of recent positions,
+ *         and stretches without matches are skipped over at an increasing pace.
+ */
+DWORD lz4_compress(PUCHAR source, DWORD sourceLength, PUCHAR dest, DWORD destSize)
+{
+	DWORD table[1 << LZ4_HASH_BITS];
+	PUCHAR ip = source;
+	PUCHAR anchor = source;
+	PUCHAR iend = source + sourceLength;
+	PUCHAR mflimit = iend - LZ4_MATCH_LIMIT;
+	PUCHAR matchlimit = iend - LZ4_LAST_LITERALS;
+	PUCHAR op = dest;
+	PUCHAR oend = dest + destSize;
+	PUCHAR ref;
+	PUCHAR match;
+	DWORD sequence;
+	DWORD hash;
+
+	if (sourceLength > LZ4_MATCH_LIMIT)
+	{
+		memset(table, 0, sizeof(table));
+
+		while (ip < mflimit)
+		{
+			sequence = lz4_read32(ip);
+			hash = (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+			ref = source + table[hash];
+			table[hash] = (DWORD)(ip - source);
+
+			if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE || lz4_read32(ref) != sequence)
+			{
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			for (match = ip + LZ4_MIN_MATCH, ref += LZ4_MIN_MATCH; match < matchlimit && *match == *ref; match++, ref++)
+			{
+			}
+
+			if (!(op = lz4_write_sequence(op, oend, anchor, (DWORD)(ip - anchor),
+				(DWORD)(match - ref), (DWORD)(match - ip))))
+			{
+				return 0;
+			}
+
+			ip = anchor = match;
+		}
+	}
+
+	if (!(op = lz4_write_sequence(op, oend, anchor, (DWORD)(iend - anchor), 0, 0)))
+	{
+		return 0;
+	}
+
+	return (DWORD)(op - dest);
+}
+
+/*!
+ * @brief Decompress a block of data.
+ * @param source Pointer to the compressed data.
+ * @param sourceLength Size of the compressed data.
+ * @param dest Pointer to the buffer that receives the decompressed data.
+ * @param destSize Size of the \c dest buffer.
+ * @param destLength Pointer that receives the size of the decompressed data.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS The block was decompressed.
+ * @retval ERROR_INVALID_DATA The block is corrupt, or doesn't fit in \c dest.
+ */
+DWORD lz4_decompress(PUCHAR source, DWORD sourceLength, PUCHAR dest, DWORD destSize, DWORD* destLength)
+{
+	PUCHAR ip = source;
+	PUCHAR iend = source + sourceLength;
+	PUCHAR op = dest;
+	PUCHAR oend = dest + destSize;
+	PUCHAR match;
+	DWORD length;
+	DWORD offset;
+	UCHAR token;
+
+	while (ip < iend)
+	{
+		token = *ip++;
+
+		length = token >> 4;
+		if (length == 15)
+		{
+			do
+			{
+				if (ip >= iend)
+				{
+					return ERROR_INVALID_DATA;
+				}
+				length += *ip;
+			} while (*ip++ == 255);
+		}
+
+		if (length > (DWORD)(iend - ip) || length > (DWORD)(oend - op))
+		{
+			return ERROR_INVALID_DATA;
+		}
+
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+
+		// the last sequence only has literals
+		if (ip == iend)
+		{
+			break;
+		}
+
+		if (iend - ip < 2)
+		{
+			return ERROR_INVALID_DATA;
+		}
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (DWORD)(op - dest))
+		{
+			return ERROR_INVALID_DATA;
+		}
+
+		length = token & 15;
+		if (length == 15)
+		{
+			do
+			{
+				if (ip >= iend)
+				{
+					return ERROR_INVALID_DATA;
+				}
+				length += *ip;
+			} while (*ip++ == 255);
+		}
+		length += LZ4_MIN_MATCH;
+
+		if (length > (DWORD)(oend - op))
+		{
+			return ERROR_INVALID_DATA;
+		}
+
+		match = op - offset;
+		if (offset >= length)
+		{
+			memcpy(op, match, length);
+			op += length;
+		}
+		else
+		{
+			while (length--)
+			{
+				*op++ = *match++;
+			}
+		}
+	}
+
+	*destLength = (DWORD)(op - dest);
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,20 @@
+/*!
+ * @file lz4.h
+ * @brief Declarations for the LZ4 block codec.
+ * @details LZ4 trades compression ratio for speed, it compresses at hundreds of
+ *          megabytes a second and decompresses several times faster than that,
+ *          which suits data that is compressed as it is produced. The output is
+ *          the standard LZ4 block format.
+ */
+#ifndef _METERPRETER_LIB_LZ4_H
+#define _METERPRETER_LIB_LZ4_H
+
+#include "linkage.h"
+
+/*! @brief Size of the buffer that is always large enough to hold the compressed form of \c n bytes. */
+#define LZ4_COMPRESS_BOUND(n)  ((n) + (n) / 255 + 16)
+
+LINKAGE DWORD lz4_compress(PUCHAR source, DWORD sourceLength, PUCHAR dest, DWORD destSize);
+LINKAGE DWORD lz4_decompress(PUCHAR source, DWORD sourceLength, PUCHAR dest, DWORD destSize, DWORD* destLength);
+
+#endif
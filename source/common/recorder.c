@@ -0,0 +1,277 @@
+/*!
+ * @file recorder.c
+ * @brief Definitions for recording session traffic for offline replay.
+ */
+#include "common.h"
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+/*! @brief State of an active recording. */
+struct _PacketRecorder
+{
+	FILE* file;       ///< Handle to the file that the packets are written to.
+	LOCK* lock;       ///< Serialises writes from the transmit and receive paths.
+	QWORD start;      ///< Time at which the recording began, in microseconds.
+	BOOL failed;      ///< Set once a write has failed, after which nothing more is recorded.
+};
+
+/*!
+ * @brief Get the current time in microseconds.
+ * @return The current time, relative to an arbitrary epoch.
+ */
+static QWORD recorder_now()
+{
+#ifdef _WIN32
+	return (QWORD)GetTickCount() * 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/*!
+ * @brief Start recording the decrypted traffic of the given session.
+ * @param remote Pointer to the \c Remote instance to record.
+ * @param path Path of the file to write the recording to. Existing files are overwritten.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS Recording has started.
+ * @retval ERROR_INVALID_PARAMETER The session is already being recorded.
+ * @retval ERROR_NOT_ENOUGH_MEMORY Unable to allocate the recorder.
+ */
+DWORD recorder_start(Remote *remote, LPCSTR path)
+{
+	PacketRecorder* recorder = NULL;
+	DWORD result = ERROR_SUCCESS;
+
+	do
+	{
+		if (remote->recorder)
+		{
+			result = ERROR_INVALID_PARAMETER;
+			break;
+		}
+
+		if (!(recorder = (PacketRecorder*)calloc(1, sizeof(PacketRecorder))))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		if (!(recorder->lock = lock_create()))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		if (!(recorder->file = fopen(path, "wb")))
+		{
+#ifdef _WIN32
+			result = GetLastError();
+#else
+			result = errno;
+#endif
+			break;
+		}
+
+		if (fwrite(RECORDER_MAGIC, 1, RECORDER_MAGIC_SIZE, recorder->file) != RECORDER_MAGIC_SIZE)
+		{
+			result = ERROR_WRITE_FAULT;
+			break;
+		}
+
+		recorder->start = recorder_now();
+		remote->recorder = recorder;
+
+		dprintf("[RECORDER] recording session to %s", path);
+		return ERROR_SUCCESS;
+	} while (0);
+
+	dprintf("[RECORDER] failed to start recording to %s: %u", path, result);
+
+	if (recorder)
+	{
+		if (recorder->file)
+		{
+			fclose(recorder->file);
+		}
+		if (recorder->lock)
+		{
+			lock_destroy(recorder->lock);
+		}
+		free(recorder);
+	}
+
+	return result;
+}
+
+/*!
+ * @brief Stop recording the given session, flushing any buffered records.
+ * @param remote Pointer to the \c Remote instance being recorded.
+ * @remark Only called when the session is torn down, as the transmit and
+ *         dispatch threads use the recorder without holding a reference.
+ */
+VOID recorder_stop(Remote *remote)
+{
+	PacketRecorder* recorder = remote->recorder;
+
+	if (!recorder)
+	{
+		return;
+	}
+
+	remote->recorder = NULL;
+
+	lock_acquire(recorder->lock);
+	fclose(recorder->file);
+	lock_release(recorder->lock);
+
+	lock_destroy(recorder->lock);
+	free(recorder);
+
+	dprintf("[RECORDER] recording stopped");
+}
+
+/*!
+ * @brief Append a packet to the session's recording, if there is one.
+ * @param remote Pointer to the \c Remote instance the packet belongs to.
+ * @param direction The direction the packet is travelling (RECORDER_DIRECTION_*).
+ * @param packet Pointer to the decrypted packet.
+ * @remark Failing to write the record is not fatal to the session, but nothing
+ *         more is recorded after it, so the file ends at the last whole record.
+ *         The recorder itself stays until the session is torn down.
+ */
+VOID recorder_packet(Remote *remote, DWORD direction, Packet *packet)
+{
+	PacketRecorder* recorder = remote->recorder;
+	BYTE prefix[sizeof(QWORD) + sizeof(ULONG)];
+	QWORD timestamp;
+	ULONG directionNbo;
+
+	if (!recorder)
+	{
+		return;
+	}
+
+	lock_acquire(recorder->lock);
+
+	if (recorder->failed)
+	{
+		lock_release(recorder->lock);
+		return;
+	}
+
+	timestamp = htonq(recorder_now() - recorder->start);
+	directionNbo = htonl(direction);
+	memcpy(prefix, &timestamp, sizeof(QWORD));
+	memcpy(prefix + sizeof(QWORD), &directionNbo, sizeof(ULONG));
+
+	if (fwrite(prefix, 1, sizeof(prefix), recorder->file) != sizeof(prefix)
+		|| fwrite(&packet->header, 1, sizeof(TlvHeader), recorder->file) != sizeof(TlvHeader)
+		|| fwrite(packet->payload, 1, packet->payloadLength, recorder->file) != packet->payloadLength)
+	{
+		dprintf("[RECORDER] failed to write record, no longer recording");
+		recorder->failed = TRUE;
+	}
+
+	lock_release(recorder->lock);
+}
+
+/*!
+ * @brief Open a recording for reading.
+ * @param path Path of the recording.
+ * @param file Pointer that receives the handle of the opened file.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS The file was opened and is positioned at the first record.
+ * @retval ERROR_INVALID_DATA The file is not a recording.
+ */
+DWORD recorder_open(LPCSTR path, FILE **file)
+{
+	char magic[RECORDER_MAGIC_SIZE];
+	FILE* fd;
+
+	if (!(fd = fopen(path, "rb")))
+	{
+#ifdef _WIN32
+		return GetLastError();
+#else
+		return errno;
+#endif
+	}
+
+	if (fread(magic, 1, sizeof(magic), fd) != sizeof(magic)
+		|| memcmp(magic, RECORDER_MAGIC, RECORDER_MAGIC_SIZE) != 0)
+	{
+		fclose(fd);
+		return ERROR_INVALID_DATA;
+	}
+
+	*file = fd;
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Read the next packet from a recording.
+ * @param file Handle to the recording, as returned by \c recorder_open.
+ * @param timestamp Pointer that receives the packet's timestamp, in microseconds.
+ * @param direction Pointer that receives the direction of the packet.
+ * @param packet Pointer that receives the packet. The caller owns the packet.
+ * @return Indication of success or failure.
+ * @retval ERROR_SUCCESS A packet was read.
+ * @retval ERROR_NOT_FOUND There are no more records.
+ * @retval ERROR_INVALID_DATA The record is truncated or malformed.
+ * @retval ERROR_NOT_ENOUGH_MEMORY Unable to allocate the packet.
+ */
+DWORD recorder_read_packet(FILE *file, QWORD *timestamp, DWORD *direction, Packet **packet)
+{
+	BYTE prefix[sizeof(QWORD) + sizeof(ULONG)];
+	TlvHeader header;
+	Packet* localPacket = NULL;
+	ULONG payloadLength;
+	QWORD timestampNbo;
+	ULONG directionNbo;
+	size_t bytesRead;
+
+	if ((bytesRead = fread(prefix, 1, sizeof(prefix), file)) != sizeof(prefix))
+	{
+		return bytesRead ? ERROR_INVALID_DATA : ERROR_NOT_FOUND;
+	}
+
+	if (fread(&header, 1, sizeof(header), file) != sizeof(header)
+		|| ntohl(header.length) < sizeof(TlvHeader))
+	{
+		return ERROR_INVALID_DATA;
+	}
+
+	memcpy(&timestampNbo, prefix, sizeof(QWORD));
+	memcpy(&directionNbo, prefix + sizeof(QWORD), sizeof(ULONG));
+	payloadLength = ntohl(header.length) - sizeof(TlvHeader);
+
+	if (!(localPacket = (Packet*)calloc(1, sizeof(Packet))))
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if (payloadLength && !(localPacket->payload = (PUCHAR)malloc(payloadLength)))
+	{
+		free(localPacket);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if (fread(localPacket->payload, 1, payloadLength, file) != payloadLength)
+	{
+		packet_destroy(localPacket);
+		return ERROR_INVALID_DATA;
+	}
+
+	localPacket->header = header;
+	localPacket->payloadLength = payloadLength;
+
+	*timestamp = ntohq(timestampNbo);
+	*direction = ntohl(directionNbo);
+	*packet = localPacket;
+
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,44 @@
+/*!
+ * @file recorder.h
+ * @brief Declarations for recording session traffic for offline replay.
+ * @details When enabled, each transport hands every decrypted packet it sends or
+ *          receives to the recorder, which appends it to a file along with a
+ *          timestamp and the direction of travel. The resulting file can be fed
+ *          back into the dispatcher by the replay driver.
+ *
+ *          File layout (all integers in network byte order):
+ *
+ *          - `RECORDER_MAGIC` (8 bytes)
+ *          - zero or more records, each consisting of:
+ *            - timestamp in microseconds since recording began (8 bytes)
+ *            - direction, one of RECORDER_DIRECTION_* (4 bytes)
+ *            - the packet's TLV header followed by its decrypted payload
+ */
+#ifndef _METERPRETER_LIB_RECORDER_H
+#define _METERPRETER_LIB_RECORDER_H
+
+#include "linkage.h"
+
+/*! @brief Name of the environment variable that enables recording to the given path. */
+#define RECORDER_ENV_PATH            "METERPRETER_RECORD"
+
+/*! @brief Marker written at the start of every recording. */
+#define RECORDER_MAGIC               "METREC01"
+/*! @brief Size of the marker written at the start of every recording. */
+#define RECORDER_MAGIC_SIZE          8
+
+/*! @brief Indicates the packet was received from the remote endpoint. */
+#define RECORDER_DIRECTION_INBOUND   0
+/*! @brief Indicates the packet was sent to the remote endpoint. */
+#define RECORDER_DIRECTION_OUTBOUND  1
+
+typedef struct _PacketRecorder PacketRecorder;
+
+LINKAGE DWORD recorder_start(Remote *remote, LPCSTR path);
+LINKAGE VOID recorder_stop(Remote *remote);
+LINKAGE VOID recorder_packet(Remote *remote, DWORD direction, Packet *packet);
+
+LINKAGE DWORD recorder_open(LPCSTR path, FILE **file);
+LINKAGE DWORD recorder_read_packet(FILE *file, QWORD *timestamp, DWORD *direction, Packet **packet);
+
+#endif
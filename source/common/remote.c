@@ -27,6 +27,16 @@ Remote* remote_allocate()
 		memset(remote, 0, sizeof(Remote));
 		remote->lock = lock;
 
+		if ((remote->channel_lock = lock_create()) == NULL)
+		{
+			break;
+		}
+
+		if ((remote->command_threads = list_create()) == NULL)
+		{
+			break;
+		}
+
 		dprintf("[REMOTE] remote created %p", remote);
 		return remote;
 	} while (0);
@@ -38,6 +48,11 @@ Remote* remote_allocate()
 
 	if (remote)
 	{
+		if (remote->channel_lock)
+		{
+			lock_destroy(remote->channel_lock);
+		}
+
 		free(remote);
 	}
 
@@ -51,6 +66,22 @@ Remote* remote_allocate()
  */
 VOID remote_deallocate(Remote * remote)
 {
+	recorder_stop(remote);
+
+	packet_clear_completion_handlers(remote);
+
+	token_bucket_destroy(remote->channel_limit);
+
+	if (remote->command_threads)
+	{
+		list_destroy(remote->command_threads);
+	}
+
+	if (remote->channel_lock)
+	{
+		lock_destroy(remote->channel_lock);
+	}
+
 	if (remote->lock)
 	{
 		lock_destroy(remote->lock);
@@ -75,6 +75,7 @@ typedef struct _TcpTransportContext
 	struct sockaddr_storage sock_desc;    ///! Details of the current socket.
 	int sock_desc_size;                   ///! Details of the current socket.
 	BOOL bound;                           ///! Flag to indicate if the socket was a bound socket.
+	struct _PacketPipeline* pipeline;     ///! Outbound packet pipeline, if one is running.
 } TcpTransportContext;
 
 typedef struct _HttpTransportContext
@@ -91,6 +92,31 @@ typedef struct _HttpTransportContext
 	STRTYPE proxy_pass;                   ///! Proxy password.
 } HttpTransportContext;
 
+typedef struct _WebSocketTransportContext
+{
+	SOCKET fd;                            ///! Remote socket file descriptor.
+	BOOL secure;                          ///! Flag indicating whether the connection uses SSL (wss).
+	SSL_CTX* ctx;                         ///! SSL-specific context information, if secure.
+	SSL* ssl;                             ///! Pointer to the SSL detail/version/etc, if secure.
+	LOCK* ssl_lock;                       ///! Held for the duration of each SSL call.
+	LOCK* write_lock;                     ///! Keeps frames from different threads from interleaving.
+	PUCHAR message;                       ///! Fragments of the data message that is being received.
+	DWORD message_length;                 ///! Number of bytes in \c message.
+	int last_received;                    ///! Unix timestamp of the last frame received.
+	int ping_sent;                        ///! Unix timestamp of the unanswered keepalive ping, or zero.
+	struct _PacketPipeline* pipeline;     ///! Outbound packet pipeline, if one is running.
+} WebSocketTransportContext;
+
+typedef struct _UdpTransportContext
+{
+	SOCKET fd;                            ///! Connected UDP socket.
+	BOOL secure;                          ///! Flag indicating whether the datagrams are protected with DTLS.
+	SSL_CTX* ctx;                         ///! SSL-specific context information, if secure.
+	SSL* ssl;                             ///! DTLS session, if secure.
+	struct _RudpConnection* connection;   ///! Reliable datagram connection that carries the packets.
+	struct _UdpTransportWorker* worker;   ///! Thread that does the socket I/O, if one is running.
+} UdpTransportContext;
+
 typedef struct _Transport
 {
 	DWORD type;                           ///! The type of transport in use.
@@ -145,6 +171,15 @@ typedef struct _Remote
 
 	PTransCreateTcp trans_create_tcp;     ///! Pointer to a function that creates TCP transports.
 	PTransCreateHttp trans_create_http;   ///! Pointer to a function that creates HTTP transports.
+
+	struct _PacketRecorder* recorder;     ///! Traffic recorder for this session, if recording is enabled.
+	struct _TokenBucket* channel_limit;   ///! Limit on the rate of this session's outbound channel data, if one has been set.
+
+	struct _Channel* channel_list;        ///! Channels that belong to this session.
+	LOCK* channel_lock;                   ///! Guards \c channel_list, which command threads walk concurrently.
+	struct _PacketCompletionRoutineEntry* completion_routines; ///! Completion routines for requests sent by this session.
+	struct _LIST* command_threads;        ///! Command threads that are running on behalf of this session.
+	DWORD client_capabilities;            ///! Capabilities the client has advertised (CLIENT_CAPABILITY_*).
 } Remote;
 
 Remote* remote_allocate();
@@ -2,349 +2,851 @@
 
 #ifndef _WIN32
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #endif
 
+/*
+ * The maximum number of shards, including overflow shards that are added when
+ * every shard is full.
+ */
+#define SCHEDULER_MAX_SHARDS        64
+
+/*
+ * The number of waitables a single shard can service. On Windows one of the
+ * wait slots is taken by the shard's wake event.
+ */
+#ifdef _WIN32
+#define SCHEDULER_SHARD_CAPACITY    ( MAXIMUM_WAIT_OBJECTS - 1 )
+#else
+#define SCHEDULER_SHARD_CAPACITY    1024
+#endif
+
+/*
+ * The timeout a shard waits with when none of its waitables are delayed, the
+ * same value as INFINITE on Windows.
+ */
+#define SCHEDULER_WAIT_FOREVER      0xFFFFFFFF
+
 typedef struct _WaitableEntry
 {
+        struct _WaitableEntry* next;
         Remote *               remote;
 #ifdef _WIN32
         HANDLE                 waitable;
 #else
         int                    waitable;
 #endif
-        EVENT*                 pause;
-        EVENT*                 resume;
         LPVOID                 context;
+        LPVOID                 threadContext;
         BOOL                   running;
+        BOOL                   stopping;
+        QWORD                  resumeAt;
         WaitableNotifyRoutine  routine;
         WaitableDestroyRoutine destroy;
 } WaitableEntry;
 
 /*
- * The list of all currenltly running threads in the scheduler subsystem.
+ * A reactor thread and the waitables that are pinned to it. Everything about a
+ * waitable is only ever touched by its shard's thread, other threads hand their
+ * requests (pause, resume, stop) over by flagging the entry and waking the shard.
+ */
+typedef struct _SchedulerShard
+{
+        DWORD                  index;
+        THREAD *               thread;
+        LOCK *                 lock;
+        WaitableEntry *        entries;
+        DWORD                  count;
+        DWORD                  reaping;
+        BOOL                   terminate;
+#ifdef _WIN32
+        EVENT *                wake;
+#else
+        int                    wake[2];
+#endif
+} SchedulerShard;
+
+/*
+ * All of the shards that currently exist.
  */
-LIST * schedulerThreadList = NULL;
+SchedulerShard * schedulerShards[SCHEDULER_MAX_SHARDS] = {0};
 
 /*
- * The Remote that is associated with the scheduler subsystem
+ * The number of shards that exist, and the number that waitables are pinned to.
  */
-Remote * schedulerRemote   = NULL;
+DWORD schedulerShardCount = 0;
+DWORD schedulerPinnedShards = 0;
 
 /*
- * Initialize the scheduler subsystem. Must be called before any calls to scheduler_insert_waitable.
+ * Guards the creation of shards and the session count. Created by the first
+ * session to start and kept for the lifetime of the process.
  */
-DWORD scheduler_initialize( Remote * remote )
+LOCK * schedulerLock = NULL;
+
+/*
+ * The number of sessions that are using the shards. The shards are shared by
+ * every session in the process and are torn down when the last one ends.
+ */
+DWORD schedulerSessions = 0;
+
+/*
+ * A thread in scheduler_stop_session waiting for the shards to reap its session's
+ * waitables. Guarded by schedulerLock.
+ */
+typedef struct _SchedulerWaiter
 {
-	DWORD result = ERROR_SUCCESS;
+        EVENT *                    reaped;
+        struct _SchedulerWaiter *  next;
+} SchedulerWaiter;
 
-	dprintf( "[SCHEDULER] entering scheduler_initialize." );
+SchedulerWaiter * schedulerWaiters = NULL;
 
-	if( remote == NULL )
-		return ERROR_INVALID_HANDLE;
+/*
+ * Get the number of processors available to the process.
+ */
+static DWORD scheduler_processor_count( VOID )
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf( _SC_NPROCESSORS_ONLN );
+	return count > 0 ? (DWORD)count : 1;
+#endif
+}
 
-	schedulerThreadList = list_create();
-	if( schedulerThreadList == NULL )
-		return ERROR_INVALID_HANDLE;
+/*
+ * Pin the calling thread to a single processor.
+ */
+static VOID scheduler_pin_thread( DWORD processor )
+{
+	processor %= scheduler_processor_count();
+#ifdef _WIN32
+	if( processor < sizeof( DWORD_PTR ) * 8 )
+		SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR)1 << processor );
+#else
+	{
+		unsigned long mask[4] = {0};
+		if( processor < sizeof( mask ) * 8 )
+		{
+			mask[processor / ( sizeof( unsigned long ) * 8 )] = 1UL << ( processor % ( sizeof( unsigned long ) * 8 ) );
+			syscall( __NR_sched_setaffinity, 0, sizeof( mask ), mask );
+		}
+	}
+#endif
+}
 
-	schedulerRemote = remote;
+/*
+ * Get the current time in milliseconds, relative to an arbitrary epoch.
+ */
+static QWORD scheduler_now( VOID )
+{
+#ifdef _WIN32
+	return (QWORD)GetTickCount();
+#else
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return (QWORD)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
 
-	dprintf( "[SCHEDULER] leaving scheduler_initialize." );
+/*
+ * Wake a shard so that it picks up changes to its waitables.
+ */
+static VOID scheduler_shard_wake( SchedulerShard * shard )
+{
+#ifdef _WIN32
+	event_signal( shard->wake );
+#else
+	char byte = 0;
+	// the pipe is non-blocking, if it's full the shard is already due to wake
+	write( shard->wake[1], &byte, 1 );
+#endif
+}
 
-	return result;
+/*
+ * Release a waitable that has been stopped. Called on the waitable's shard thread.
+ */
+static VOID scheduler_entry_destroy( WaitableEntry * entry )
+{
+	if( entry->destroy ) {
+		entry->destroy( (HANDLE)entry->waitable, entry->context, entry->threadContext );
+	}
+#ifdef _WIN32
+	else if( entry->waitable ) {
+		dprintf( "[SCHEDULER] scheduler_entry_destroy closing handle 0x%08X", entry->waitable );
+		CloseHandle( entry->waitable );
+	}
+#endif
+
+	free( entry );
 }
 
 /*
- * Destroy the scheduler subsystem. All waitable threads at signaled to terminate.
- * this function blocks untill all waitable threads have terminated.
+ * The reactor thread for a shard. Waits on every running waitable pinned to the
+ * shard at once, calling the notify routine of each one that is signaled.
  */
-DWORD scheduler_destroy( VOID )
+DWORD THREADCALL scheduler_shard_thread( THREAD * thread )
 {
-	DWORD result    = ERROR_SUCCESS;
-	DWORD index     = 0;
-	DWORD count     = 0;
-	LIST * jlist    = list_create();
-	THREAD * thread = NULL;
-	WaitableEntry * entry = NULL;
+	SchedulerShard * shard                          = NULL;
+	WaitableEntry * active[SCHEDULER_SHARD_CAPACITY];
+	WaitableEntry * reaped                          = NULL;
+	WaitableEntry * entry                           = NULL;
+	WaitableEntry ** link                           = NULL;
+	SchedulerWaiter * waiter                        = NULL;
+	BOOL terminate                                  = FALSE;
+	QWORD now                                       = 0;
+	DWORD timeout                                   = SCHEDULER_WAIT_FOREVER;
+	DWORD count                                     = 0;
+	DWORD reapCount                                 = 0;
+	DWORD index                                     = 0;
+#ifdef _WIN32
+	HANDLE handles[SCHEDULER_SHARD_CAPACITY + 1];
+	DWORD result                                    = 0;
+#else
+	struct pollfd fds[SCHEDULER_SHARD_CAPACITY + 1];
+	char drain[64];
+#endif
 
-	dprintf( "[SCHEDULER] entering scheduler_destroy." );
+	if( thread == NULL )
+		return ERROR_INVALID_HANDLE;
+
+	shard = (SchedulerShard *)thread->parameter1;
+	if( shard == NULL )
+		return ERROR_INVALID_HANDLE;
 
-	lock_acquire( schedulerThreadList->lock );
+	scheduler_pin_thread( shard->index );
 
-	count = list_count( schedulerThreadList );
+	dprintf( "[SCHEDULER] entering scheduler_shard_thread( %u )", shard->index );
 
-	for( index=0 ; index < count ; index++ )
+	while( !terminate )
 	{
-		thread = (THREAD *)list_get( schedulerThreadList, index );
-		if( thread == NULL )
-			continue;
-		
-		list_push( jlist, thread );
+		lock_acquire( shard->lock );
+
+		terminate = shard->terminate;
+
+		// pull out everything that has been stopped (or everything, if the
+		// shard is going away), and gather up the waitables that are running,
+		// resuming the delayed ones that are due and waking up for the rest
+		count   = 0;
+		timeout = SCHEDULER_WAIT_FOREVER;
+		now     = scheduler_now();
+		link    = &shard->entries;
+		while( ( entry = *link ) != NULL )
+		{
+			if( terminate || entry->stopping )
+			{
+				*link         = entry->next;
+				entry->next   = reaped;
+				reaped        = entry;
+				shard->count--;
+				shard->reaping++;
+				reapCount++;
+				continue;
+			}
 
-		entry = (WaitableEntry *)thread->parameter1;
+			if( entry->resumeAt && entry->resumeAt <= now )
+			{
+				entry->resumeAt = 0;
+				entry->running  = TRUE;
+			}
 
-		if( !entry->running )
-			event_signal( entry->resume );
+			if( entry->running )
+				active[count++] = entry;
+			else if( entry->resumeAt && entry->resumeAt - now < timeout )
+				timeout = (DWORD)( entry->resumeAt - now );
 
-		thread_sigterm( thread );
-	}
+			link = &entry->next;
+		}
 
-	lock_release( schedulerThreadList->lock );
+		lock_release( shard->lock );
 
-	dprintf( "[SCHEDULER] scheduler_destroy, joining all waitable threads..." );
+		// destroy routines run without the lock held as they often signal
+		// other waitables on their way out
+		while( ( entry = reaped ) != NULL )
+		{
+			reaped = entry->next;
+			scheduler_entry_destroy( entry );
+		}
 
-	while( TRUE )
-	{
-		dprintf( "[SCHEDULER] scheduler_destroy, popping off another item from thread list..." );
-		
-		thread = (THREAD *)list_pop( jlist );
-		if( thread == NULL )
+		if( reapCount )
+		{
+			lock_acquire( shard->lock );
+			shard->reaping -= reapCount;
+			lock_release( shard->lock );
+			reapCount = 0;
+
+			// let anyone stopping a session check whether its waitables are gone
+			lock_acquire( schedulerLock );
+			for( waiter = schedulerWaiters ; waiter ; waiter = waiter->next )
+				event_signal( waiter->reaped );
+			lock_release( schedulerLock );
+		}
+
+		if( terminate )
 			break;
 
-		dprintf( "[SCHEDULER] scheduler_destroy, joining thread 0x%08X...", thread );
+#ifdef _WIN32
+		handles[0] = shard->wake->handle;
+		for( index = 0 ; index < count ; index++ )
+			handles[index + 1] = active[index]->waitable;
 
-		thread_join( thread );
-	}
+		result = WaitForMultipleObjects( count + 1, handles, FALSE, timeout );
+		if( result == WAIT_TIMEOUT )
+			continue;
 
-	dprintf( "[SCHEDULER] scheduler_destroy, destroying lists..." );
+		if( result == WAIT_FAILED || result > WAIT_OBJECT_0 + count )
+		{
+			dprintf( "[SCHEDULER] scheduler_shard_thread( %u ), wait failed %u", shard->index, GetLastError() );
+			Sleep( 100 );
+			continue;
+		}
 
-	list_destroy( jlist );
-	
-	list_destroy( schedulerThreadList );
+		// WaitForMultipleObjects only reports the lowest signaled handle, so
+		// check the rest as well so that no waitable can starve the others
+		for( index = result - WAIT_OBJECT_0 ; index > 0 && index <= count ; index++ )
+		{
+			entry = active[index - 1];
+			if( entry->stopping || !entry->running )
+				continue;
 
-	schedulerThreadList = NULL;
+			if( index == result - WAIT_OBJECT_0 || WaitForSingleObject( entry->waitable, 0 ) == WAIT_OBJECT_0 )
+				entry->routine( entry->remote, entry->context, entry->threadContext );
+		}
+#else
+		fds[0].fd      = shard->wake[0];
+		fds[0].events  = POLLIN;
+		fds[0].revents = 0;
+		for( index = 0 ; index < count ; index++ )
+		{
+			fds[index + 1].fd      = active[index]->waitable;
+			fds[index + 1].events  = POLLRDNORM;
+			fds[index + 1].revents = 0;
+		}
 
-	dprintf( "[SCHEDULER] leaving scheduler_destroy." );
+		if( poll( fds, count + 1, timeout == SCHEDULER_WAIT_FOREVER ? -1 : (int)timeout ) <= 0 )
+			continue;
 
-	return result;
+		if( fds[0].revents )
+			while( read( shard->wake[0], drain, sizeof( drain ) ) > 0 );
+
+		for( index = 0 ; index < count ; index++ )
+		{
+			entry = active[index];
+			if( !fds[index + 1].revents || entry->stopping || !entry->running )
+				continue;
+
+			entry->routine( entry->remote, entry->context, entry->threadContext );
+		}
+#endif
+	}
+
+	dprintf( "[SCHEDULER] leaving scheduler_shard_thread( %u )", shard->index );
+
+	return ERROR_SUCCESS;
 }
 
 /*
- * Insert a new waitable thread for checking and processing.
+ * Create a new shard and start its reactor thread. Must be called with schedulerLock held.
  */
-DWORD scheduler_insert_waitable( HANDLE waitable, LPVOID entryContext, LPVOID threadContext, WaitableNotifyRoutine routine, WaitableDestroyRoutine destroy )
+static SchedulerShard * scheduler_shard_create( VOID )
 {
-	DWORD result = ERROR_SUCCESS;
-	THREAD * swt = NULL;
+	SchedulerShard * shard = NULL;
 
-	WaitableEntry * entry = (WaitableEntry *)malloc( sizeof( WaitableEntry ) );
-	if( entry == NULL )
-		return ERROR_NOT_ENOUGH_MEMORY;
+	if( schedulerShardCount == SCHEDULER_MAX_SHARDS )
+		return NULL;
 
-	dprintf( "[SCHEDULER] entering scheduler_insert_waitable( 0x%08X, 0x%08X, 0x%08X, 0x%08X, 0x%08X )",
-		waitable, entryContext, threadContext, routine, destroy );
+	shard = (SchedulerShard *)malloc( sizeof( SchedulerShard ) );
+	if( shard == NULL )
+		return NULL;
 
-	memset( entry, 0, sizeof( WaitableEntry ) );
-	
-	entry->remote   = schedulerRemote;
-	entry->waitable = waitable;
-	entry->destroy  = destroy;
-	entry->context  = entryContext;
-	entry->routine  = routine;
-	entry->pause    = event_create();
-	entry->resume   = event_create();
-
-	swt = thread_create( scheduler_waitable_thread, entry, threadContext, NULL );
-	if( swt != NULL )
-	{
-		dprintf( "[SCHEDULER] created scheduler_waitable_thread 0x%08X", swt );
-		thread_run( swt );
-	}
-	else
+	memset( shard, 0, sizeof( SchedulerShard ) );
+
+	shard->index = schedulerShardCount;
+	shard->lock  = lock_create();
+
+#ifdef _WIN32
+	shard->wake  = event_create();
+	if( shard->lock == NULL || shard->wake == NULL )
+#else
+	shard->wake[0] = shard->wake[1] = -1;
+	if( shard->lock == NULL || pipe( shard->wake ) != 0 )
+#endif
 	{
-		free( entry );
-		result = ERROR_INVALID_HANDLE;
+		goto fail;
 	}
 
-	dprintf( "[SCHEDULER] leaving scheduler_insert_waitable" );
+#ifndef _WIN32
+	fcntl( shard->wake[0], F_SETFL, fcntl( shard->wake[0], F_GETFL ) | O_NONBLOCK );
+	fcntl( shard->wake[1], F_SETFL, fcntl( shard->wake[1], F_GETFL ) | O_NONBLOCK );
+#endif
 
-	return result;
+	shard->thread = thread_create( scheduler_shard_thread, shard, NULL, NULL );
+	if( shard->thread == NULL )
+		goto fail;
+
+	dprintf( "[SCHEDULER] created shard %u", shard->index );
+
+	thread_run( shard->thread );
+
+	schedulerShards[schedulerShardCount++] = shard;
+
+	return shard;
+
+fail:
+	if( shard->lock )
+		lock_destroy( shard->lock );
+#ifdef _WIN32
+	if( shard->wake )
+		event_destroy( shard->wake );
+#else
+	if( shard->wake[0] != -1 )
+	{
+		close( shard->wake[0] );
+		close( shard->wake[1] );
+	}
+#endif
+	free( shard );
+	return NULL;
 }
 
 /*
- * Signal a waitable object.
+ * Create the scheduler lock, if no other session has done so yet.
  */
-DWORD scheduler_signal_waitable( HANDLE waitable, SchedularSignal signal )
+static LOCK * scheduler_lock( VOID )
 {
-	DWORD index           = 0;
-	DWORD count           = 0;
-	THREAD * thread       = NULL;
-	WaitableEntry * entry = NULL;
-	DWORD result          = ERROR_NOT_FOUND;
+	LOCK * lock = NULL;
 
-	dprintf( "[SCHEDULER] entering scheduler_signal_waitable( 0x%08X )", waitable );
+	if( schedulerLock != NULL )
+		return schedulerLock;
 
-	if( schedulerThreadList == NULL || !waitable )
-		return ERROR_INVALID_HANDLE;
+	lock = lock_create();
+	if( lock == NULL )
+		return NULL;
 
-	lock_acquire( schedulerThreadList->lock );
+	// sessions may start in parallel, so only one of them gets to install its lock
+#ifdef _WIN32
+	if( InterlockedCompareExchangePointer( (PVOID *)&schedulerLock, lock, NULL ) != NULL )
+#else
+	if( __atomic_cmpxchg( 0, (int)lock, (volatile int *)&schedulerLock ) != 0 )
+#endif
+		lock_destroy( lock );
 
-	count = list_count( schedulerThreadList );
+	return schedulerLock;
+}
 
-	for( index=0 ; index < count ; index++ )
+/*
+ * Stop every waitable that belongs to the given session, and wait for the shards to
+ * destroy them. Must not be called on a shard thread.
+ */
+static VOID scheduler_stop_session( Remote * remote )
+{
+	SchedulerShard * shard   = NULL;
+	WaitableEntry * entry    = NULL;
+	SchedulerWaiter ** link  = NULL;
+	SchedulerWaiter waiter;
+	DWORD remaining          = 0;
+	DWORD index              = 0;
+
+	// without an event this still works, the wait below just doesn't block
+	waiter.reaped = event_create();
+
+	lock_acquire( schedulerLock );
+	waiter.next      = schedulerWaiters;
+	schedulerWaiters = &waiter;
+	lock_release( schedulerLock );
+
+	do
 	{
-		thread = (THREAD *)list_get( schedulerThreadList, index );
-		if( thread == NULL )
-			continue;
-	
-		entry = (WaitableEntry *)thread->parameter1;
-		if( entry == NULL )
-			continue;
+		remaining = 0;
 
-		if( entry->waitable == waitable )
+		lock_acquire( schedulerLock );
+
+		for( index = 0 ; index < schedulerShardCount ; index++ )
 		{
-			dprintf( "[SCHEDULER] scheduler_signal_waitable: signaling waitable = 0x%08X, thread = 0x%08X", waitable, thread );
-			if( signal == Pause )
+			shard = schedulerShards[index];
+
+			lock_acquire( shard->lock );
+
+			for( entry = shard->entries ; entry ; entry = entry->next )
 			{
-				if( entry->running ) {
-					dprintf( "[SCHEDULER] scheduler_signal_waitable: thread running, pausing. waitable = 0x%08X, thread = 0x%08X, handle = 0x%X", waitable, thread, entry->pause->handle );
-					event_signal( entry->pause );
-				} else {
-					dprintf( "[SCHEDULER] scheduler_signal_waitable: thread already paused. waitable = 0x%08X, thread = 0x%08X", waitable, thread );
+				if( entry->remote == remote )
+				{
+					entry->stopping = TRUE;
+					remaining++;
 				}
 			}
-			else
-			{
-				if( !entry->running ) {
-					dprintf( "[SCHEDULER] scheduler_signal_waitable: thread paused, resuming. waitable = 0x%08X, thread = 0x%08X, handle = 0x%X", waitable, thread, entry->resume->handle );
-					event_signal( entry->resume );
-				}
 
-				if( signal == Stop ) {
-					dprintf( "[SCHEDULER] scheduler_signal_waitable: stopping thread. waitable = 0x%08X, thread = 0x%08X, handle = 0x%X", waitable, thread, thread->sigterm->handle );
-					thread_sigterm( thread );
-				} else {
-					dprintf( "[SCHEDULER] scheduler_signal_waitable: thread already running. waitable = 0x%08X, thread = 0x%08X", waitable, thread );
-				}
-			}
+			// entries that have been pulled out may still be running their destroy routines
+			remaining += shard->reaping;
 
-			result = ERROR_SUCCESS;
+			lock_release( shard->lock );
+
+			scheduler_shard_wake( shard );
+		}
+
+		lock_release( schedulerLock );
+
+		// the shards reap stopped entries as soon as they wake and signal every
+		// waiter when they are done. We joined the waiters before counting, so a
+		// reap that finishes after the count can't go unnoticed
+		if( remaining )
+			event_poll( waiter.reaped, SCHEDULER_WAIT_FOREVER );
+	} while( remaining );
+
+	lock_acquire( schedulerLock );
+	for( link = &schedulerWaiters ; *link ; link = &(*link)->next )
+	{
+		if( *link == &waiter )
+		{
+			*link = waiter.next;
 			break;
 		}
 	}
+	lock_release( schedulerLock );
 
-	lock_release( schedulerThreadList->lock );
+	event_destroy( waiter.reaped );
+}
 
-	dprintf( "[SCHEDULER] leaving scheduler_signal_waitable" );
+/*
+ * Initialize the scheduler subsystem for a session. Must be called before the session makes
+ * any calls to scheduler_insert_waitable. The shards are shared by every session; one shard
+ * is used per processor, unless the SCHEDULER_ENV_SHARDS environment variable says otherwise.
+ * Shards are only started once a waitable is pinned to them.
+ */
+DWORD scheduler_initialize( Remote * remote )
+{
+	char * shards = NULL;
 
-	return result;
+	dprintf( "[SCHEDULER] entering scheduler_initialize( 0x%08X )", remote );
+
+	if( remote == NULL )
+		return ERROR_INVALID_HANDLE;
+
+	if( scheduler_lock() == NULL )
+		return ERROR_INVALID_HANDLE;
+
+	lock_acquire( schedulerLock );
+
+	if( schedulerSessions++ == 0 )
+	{
+		schedulerPinnedShards = scheduler_processor_count();
+
+		shards = getenv( SCHEDULER_ENV_SHARDS );
+		if( shards && atoi( shards ) > 0 )
+			schedulerPinnedShards = (DWORD)atoi( shards );
+
+		if( schedulerPinnedShards > SCHEDULER_MAX_SHARDS )
+			schedulerPinnedShards = SCHEDULER_MAX_SHARDS;
+	}
+
+	lock_release( schedulerLock );
+
+	dprintf( "[SCHEDULER] leaving scheduler_initialize, %u shards, %u sessions.", schedulerPinnedShards, schedulerSessions );
+
+	return ERROR_SUCCESS;
 }
 
 /*
- * The schedulers waitable thread. Each scheduled item will have its own thread which 
- * waits for either data to process or the threads signal to terminate.
+ * Destroy the scheduler subsystem for a session. The session's waitables are destroyed, and
+ * if it was the last session all shards are signaled to terminate, destroying their waitables
+ * as they go. This function blocks untill the waitables have been destroyed.
  */
-DWORD THREADCALL scheduler_waitable_thread( THREAD * thread )
+DWORD scheduler_destroy( Remote * remote )
 {
+	SchedulerShard * shards[SCHEDULER_MAX_SHARDS];
+	SchedulerShard * shard = NULL;
+	DWORD count            = 0;
+	DWORD index            = 0;
+
+	dprintf( "[SCHEDULER] entering scheduler_destroy( 0x%08X )", remote );
+
+	if( schedulerLock == NULL )
+		return ERROR_SUCCESS;
+
+	lock_acquire( schedulerLock );
+
+	if( schedulerSessions == 0 || --schedulerSessions > 0 )
+	{
+		lock_release( schedulerLock );
+
+		// other sessions still need the shards
+		scheduler_stop_session( remote );
+
+		dprintf( "[SCHEDULER] leaving scheduler_destroy, %u sessions remain.", schedulerSessions );
+
+		return ERROR_SUCCESS;
+	}
+
+	// take the shards out of circulation first, as destroy routines that run while
+	// the shards wind down may still try to signal other waitables
+	count = schedulerShardCount;
+	memcpy( shards, schedulerShards, sizeof( SchedulerShard * ) * count );
+	memset( schedulerShards, 0, sizeof( schedulerShards ) );
+	schedulerShardCount = 0;
+	lock_release( schedulerLock );
+
+	for( index = 0 ; index < count ; index++ )
+	{
+		shard = shards[index];
+
+		lock_acquire( shard->lock );
+		shard->terminate = TRUE;
+		lock_release( shard->lock );
+
+		scheduler_shard_wake( shard );
+	}
+
+	dprintf( "[SCHEDULER] scheduler_destroy, joining all shards..." );
+
+	for( index = 0 ; index < count ; index++ )
+	{
+		shard = shards[index];
+
+		dprintf( "[SCHEDULER] scheduler_destroy, joining shard %u...", index );
+
+		thread_join( shard->thread );
+		thread_destroy( shard->thread );
+		lock_destroy( shard->lock );
 #ifdef _WIN32
-	HANDLE waitableHandles[3] = {0};
+		event_destroy( shard->wake );
 #else
-	struct pollfd pollDetail = {0};
+		close( shard->wake[0] );
+		close( shard->wake[1] );
 #endif
+		free( shard );
+	}
 
-	WaitableEntry * entry     = NULL;
-	DWORD result              = 0;
-	BOOL terminate            = FALSE;
-	UINT signalIndex          = 0;
+	dprintf( "[SCHEDULER] leaving scheduler_destroy." );
 
-	if( thread == NULL )
-		return ERROR_INVALID_HANDLE;
+	return ERROR_SUCCESS;
+}
 
-	entry = (WaitableEntry *)thread->parameter1;
-	if( entry == NULL )
-		return ERROR_INVALID_HANDLE;
+/*
+ * Insert a new waitable, pinned to the shard selected by the affinity value (typically
+ * a channel identifier) so that everything to do with it stays on the same thread and core.
+ * If that shard is full the waitable goes to another one.
+ */
+DWORD scheduler_insert_pinned_waitable( Remote * remote, HANDLE waitable, LPVOID entryContext, LPVOID threadContext, WaitableNotifyRoutine routine, WaitableDestroyRoutine destroy, DWORD affinity )
+{
+	SchedulerShard * shard = NULL;
+	WaitableEntry * entry  = NULL;
+	DWORD target           = 0;
+	DWORD index            = 0;
 
-	if( entry->routine == NULL )
-		return ERROR_INVALID_HANDLE;
+	dprintf( "[SCHEDULER] entering scheduler_insert_pinned_waitable( 0x%08X, 0x%08X, 0x%08X, 0x%08X, 0x%08X, 0x%08X, %u )",
+		remote, waitable, entryContext, threadContext, routine, destroy, affinity );
 
-	if( schedulerThreadList == NULL )
+	if( schedulerLock == NULL || remote == NULL || routine == NULL )
 		return ERROR_INVALID_HANDLE;
 
-	list_add( schedulerThreadList, thread );
+	entry = (WaitableEntry *)malloc( sizeof( WaitableEntry ) );
+	if( entry == NULL )
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	memset( entry, 0, sizeof( WaitableEntry ) );
 
+	entry->remote        = remote;
 #ifdef _WIN32
-	waitableHandles[0] = thread->sigterm->handle;
-	waitableHandles[1] = entry->pause->handle;
-	waitableHandles[2] = entry->waitable;
+	entry->waitable      = waitable;
 #else
-	pollDetail.fd      = entry->waitable;
-	pollDetail.events  = POLLRDNORM;
-	pollDetail.revents = 0;
+	entry->waitable      = (int)(uintptr_t)waitable;
 #endif
+	entry->destroy       = destroy;
+	entry->context       = entryContext;
+	entry->threadContext = threadContext;
+	entry->routine       = routine;
+	entry->running       = TRUE;
 
-	dprintf( "[SCHEDULER] entering scheduler_waitable_thread( 0x%08X )", thread );
+	lock_acquire( schedulerLock );
 
-	entry->running = TRUE;
-	while( !terminate )
+	if( schedulerSessions == 0 )
 	{
-#ifdef _WIN32
-		dprintf( "[SCHEDULER] About to wait ( 0x%08X )", thread );
-		result = WaitForMultipleObjects( 3, waitableHandles, FALSE, INFINITE );
-		dprintf( "[SCHEDULER] Wait returned ( 0x%08X )", thread );
-		signalIndex = result - WAIT_OBJECT_0;
-		switch( signalIndex )
+		lock_release( schedulerLock );
+		free( entry );
+		return ERROR_INVALID_HANDLE;
+	}
+
+	target = affinity % schedulerPinnedShards;
+
+	// start the pinned shard if need be, then fall back to any shard with room,
+	// and finally to a new overflow shard
+	while( schedulerShardCount <= target && scheduler_shard_create() );
+
+	if( target < schedulerShardCount && schedulerShards[target]->count < SCHEDULER_SHARD_CAPACITY )
+	{
+		shard = schedulerShards[target];
+	}
+	else
+	{
+		for( index = 0 ; index < schedulerShardCount ; index++ )
 		{
-			case 0:
-				dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ), signaled to terminate...", thread );
-				terminate = TRUE;
-				break;
-			case 1:
-				dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ), signaled to pause...", thread );
-				entry->running = FALSE;
-				event_poll( entry->resume, INFINITE );
-				entry->running = TRUE;
-				dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ), signaled to resume...", thread );
-			case 2:
-				//dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ), signaled on waitable...", thread );
-				entry->routine( entry->remote, entry->context, thread->parameter2 );
-				break;
-			default:
+			if( schedulerShards[index]->count < SCHEDULER_SHARD_CAPACITY )
+			{
+				shard = schedulerShards[index];
 				break;
+			}
 		}
+
+		if( shard == NULL )
+			shard = scheduler_shard_create();
+	}
+
+	if( shard != NULL )
+	{
+		lock_acquire( shard->lock );
+		entry->next    = shard->entries;
+		shard->entries = entry;
+		shard->count++;
+		lock_release( shard->lock );
+
+		scheduler_shard_wake( shard );
+	}
+
+	lock_release( schedulerLock );
+
+	if( shard == NULL )
+	{
+		free( entry );
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	dprintf( "[SCHEDULER] leaving scheduler_insert_pinned_waitable, shard %u", shard->index );
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Insert a new waitable for checking and processing, spreading waitables that
+ * have no natural affinity across the shards.
+ */
+DWORD scheduler_insert_waitable( Remote * remote, HANDLE waitable, LPVOID entryContext, LPVOID threadContext, WaitableNotifyRoutine routine, WaitableDestroyRoutine destroy )
+{
+	static DWORD next = 0;
+
+	return scheduler_insert_pinned_waitable( remote, waitable, entryContext, threadContext, routine, destroy, next++ );
+}
+
+/*
+ * Signal a waitable object. The request is handed over to the shard that owns the
+ * waitable, so a stopped waitable is destroyed on its own shard's thread.
+ */
+DWORD scheduler_signal_waitable( HANDLE waitable, SchedularSignal signal )
+{
+	SchedulerShard * shard = NULL;
+	WaitableEntry * entry  = NULL;
+	DWORD index            = 0;
+	DWORD result           = ERROR_NOT_FOUND;
+#ifdef _WIN32
+	HANDLE target          = waitable;
 #else
-		if( event_poll( thread->sigterm, 0 ) ) {
-			dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ), signaled to terminate...", thread );
-			terminate = TRUE;
-		}
-		else if( event_poll( entry->pause, 0 ) ) {
-			dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ), signaled to pause...", thread );
-			entry->running = FALSE;
-			while( !event_poll( entry->resume, 1000 ) );
-			entry->running = TRUE;
-			dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ), signaled to resume...", thread );
-		}
-		else if( poll( &pollDetail, 1, 100 ) == POLLIN ) {
-			//dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ), signaled on waitable...", thread );
-			entry->routine( entry->remote, entry->context, (LPVOID)thread->parameter2 );
-		}
+	int target             = (int)(uintptr_t)waitable;
 #endif
-	}
 
-	dprintf( "[SCHEDULER] leaving scheduler_waitable_thread( 0x%08X )", thread );
-	
-	// we acquire the lock for this block as we are freeing 'entry' which may be accessed 
-	// in a second call to scheduler_signal_waitable for this thread (unlikely but best practice).
-	lock_acquire( schedulerThreadList->lock );
-	if( list_remove( schedulerThreadList, thread ) )
+	dprintf( "[SCHEDULER] entering scheduler_signal_waitable( 0x%08X )", waitable );
+
+	if( schedulerLock == NULL || !waitable )
+		return ERROR_INVALID_HANDLE;
+
+	lock_acquire( schedulerLock );
+
+	for( index = 0 ; index < schedulerShardCount && result == ERROR_NOT_FOUND ; index++ )
 	{
-		if( entry->destroy ) {
-			entry->destroy( entry->waitable, entry->context, thread->parameter2 );
+		shard = schedulerShards[index];
+
+		lock_acquire( shard->lock );
+
+		for( entry = shard->entries ; entry ; entry = entry->next )
+		{
+			if( entry->waitable != target || entry->stopping )
+				continue;
+
+			dprintf( "[SCHEDULER] scheduler_signal_waitable: signaling waitable = 0x%08X, shard = %u, signal = %u", waitable, shard->index, signal );
+
+			entry->resumeAt = 0;
+
+			if( signal == Pause )
+				entry->running = FALSE;
+			else if( signal == Resume )
+				entry->running = TRUE;
+			else if( signal == Stop )
+				entry->stopping = TRUE;
+
+			result = ERROR_SUCCESS;
+			break;
 		}
-		else if( entry->waitable ) {
-			dprintf( "[SCHEDULER] scheduler_waitable_thread( 0x%08X ) closing handle 0x%08X", thread, entry->waitable);
+
+		lock_release( shard->lock );
+
+		if( result == ERROR_SUCCESS )
+			scheduler_shard_wake( shard );
+	}
+
+	lock_release( schedulerLock );
+
+	dprintf( "[SCHEDULER] leaving scheduler_signal_waitable" );
+
+	return result;
+}
+
+/*
+ * Pause a waitable for the given number of milliseconds, after which its shard
+ * resumes it. Used to hold back the producers of rate limited channel data, and
+ * by notify routines that have to back off for a while, as sleeping would hold
+ * up every other waitable on the shard. A waitable that is explicitly paused or
+ * resumed in the meantime stays that way.
+ */
+DWORD scheduler_delay_waitable( HANDLE waitable, DWORD milliseconds )
+{
+	SchedulerShard * shard = NULL;
+	WaitableEntry * entry  = NULL;
+	DWORD index            = 0;
+	DWORD result           = ERROR_NOT_FOUND;
+	QWORD resumeAt         = scheduler_now() + milliseconds;
 #ifdef _WIN32
-			CloseHandle( entry->waitable );
+	HANDLE target          = waitable;
 #else
-			close( entry->waitable );
+	int target             = (int)(uintptr_t)waitable;
 #endif
+
+	if( schedulerLock == NULL || !waitable )
+		return ERROR_INVALID_HANDLE;
+
+	lock_acquire( schedulerLock );
+
+	for( index = 0 ; index < schedulerShardCount && result == ERROR_NOT_FOUND ; index++ )
+	{
+		shard = schedulerShards[index];
+
+		lock_acquire( shard->lock );
+
+		for( entry = shard->entries ; entry ; entry = entry->next )
+		{
+			if( entry->waitable != target || entry->stopping )
+				continue;
+
+			// a waitable that has been paused outright isn't resumed by a delay
+			if( entry->running || entry->resumeAt )
+			{
+				entry->running = FALSE;
+				if( entry->resumeAt < resumeAt )
+					entry->resumeAt = resumeAt;
+			}
+
+			result = ERROR_SUCCESS;
+			break;
 		}
 
-		event_destroy( entry->resume );
-		event_destroy( entry->pause );
-		thread_destroy( thread );
-		free( entry );
+		lock_release( shard->lock );
+
+		if( result == ERROR_SUCCESS )
+			scheduler_shard_wake( shard );
 	}
-	lock_release( schedulerThreadList->lock );
 
-	return ERROR_SUCCESS;
-}
+	lock_release( schedulerLock );
 
+	return result;
+}
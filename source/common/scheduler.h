@@ -14,10 +14,15 @@ typedef enum
 typedef DWORD (*WaitableNotifyRoutine)(Remote *remote, LPVOID entryContext, LPVOID threadContext);
 typedef DWORD (*WaitableDestroyRoutine)(HANDLE waitable, LPVOID entryContext, LPVOID threadContext);
 
+/*! @brief Name of the environment variable that overrides the number of scheduler shards (one per processor by default). */
+#define SCHEDULER_ENV_SHARDS "METERPRETER_SCHEDULER_SHARDS"
+
 LINKAGE DWORD scheduler_initialize( Remote * remote );
-LINKAGE DWORD scheduler_destroy( VOID );
-LINKAGE DWORD scheduler_insert_waitable( HANDLE waitable, LPVOID entryContext, LPVOID threadContext, WaitableNotifyRoutine routine, WaitableDestroyRoutine destroy );
+LINKAGE DWORD scheduler_destroy( Remote * remote );
+LINKAGE DWORD scheduler_insert_waitable( Remote * remote, HANDLE waitable, LPVOID entryContext, LPVOID threadContext, WaitableNotifyRoutine routine, WaitableDestroyRoutine destroy );
+LINKAGE DWORD scheduler_insert_pinned_waitable( Remote * remote, HANDLE waitable, LPVOID entryContext, LPVOID threadContext, WaitableNotifyRoutine routine, WaitableDestroyRoutine destroy, DWORD affinity );
 LINKAGE DWORD scheduler_signal_waitable( HANDLE waitable, SchedularSignal signal );
-LINKAGE DWORD THREADCALL scheduler_waitable_thread( THREAD * thread );
+LINKAGE DWORD scheduler_delay_waitable( HANDLE waitable, DWORD milliseconds );
+LINKAGE DWORD THREADCALL scheduler_shard_thread( THREAD * thread );
 
 #endif
@@ -20,6 +20,9 @@ int __futex_wake(volatile void *ftx, int count);
  * Create a new lock. We choose Mutex's over CriticalSections as their appears to be an issue
  * when using CriticalSections with OpenSSL on some Windows systems. Mutex's are not as optimal
  * as CriticalSections but they appear to resolve the OpenSSL deadlock issue.
+ *
+ * On POSIX the mutex is made recursive, so a lock behaves the same as a Windows mutex does
+ * when the thread holding it acquires it again.
  */
 LOCK * lock_create( VOID )
 {
@@ -31,7 +34,26 @@ LOCK * lock_create( VOID )
 #ifdef _WIN32
 		lock->handle = CreateMutex( NULL, FALSE, NULL );
 #else
-		pthread_mutex_init(lock->handle, NULL);
+		lock->handle = (pthread_mutex_t *)malloc( sizeof( pthread_mutex_t ) );
+		if( lock->handle != NULL )
+		{
+			pthread_mutexattr_t attr;
+
+			pthread_mutexattr_init( &attr );
+			pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+			if( pthread_mutex_init( lock->handle, &attr ) != 0 )
+			{
+				free( lock->handle );
+				lock->handle = NULL;
+			}
+			pthread_mutexattr_destroy( &attr );
+		}
+
+		if( lock->handle == NULL )
+		{
+			free( lock );
+			lock = NULL;
+		}
 #endif
 	}
 	return lock;
@@ -50,6 +72,7 @@ VOID lock_destroy( LOCK * lock )
 		CloseHandle( lock->handle );
 #else
 		pthread_mutex_destroy(lock->handle);
+		free(lock->handle);
 #endif
 
 		free( lock );
@@ -426,12 +449,15 @@ BOOL thread_run( THREAD * thread )
 #else
 	struct thread_conditional *tc;
 	tc = (struct thread_conditional *)thread->suspend_thread_data;
+
+	// the thread may run to completion and destroy itself as soon as it is
+	// signalled, so it must not be touched after that
+	thread->thread_started = TRUE;
+
 	pthread_mutex_lock(&tc->suspend_mutex);
 	tc->engine_running = TRUE;
-	pthread_mutex_unlock(&tc->suspend_mutex);
 	pthread_cond_signal(&tc->suspend_cond);
-
-	thread->thread_started = TRUE;
+	pthread_mutex_unlock(&tc->suspend_mutex);
 #endif
 	return TRUE;
 }
@@ -510,7 +536,10 @@ BOOL thread_join( THREAD * thread )
 	return FALSE;
 #else
 	if(pthread_join(thread->pid, NULL) == 0)
+	{
+		thread->thread_joined = TRUE;
 		return TRUE;
+	}
 
 	return FALSE;
 #endif
@@ -530,7 +559,9 @@ BOOL thread_destroy( THREAD * thread )
 #ifdef _WIN32
 	CloseHandle( thread->handle );
 #else
-	pthread_detach(thread->pid);
+	// a joined thread is already gone, detaching it is undefined
+	if( !thread->thread_joined )
+		pthread_detach(thread->pid);
 #endif
 
 	free( thread );
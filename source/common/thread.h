@@ -65,6 +65,7 @@ typedef struct _THREAD
 	void *suspend_thread_data;
 	pthread_t pid;
 	int thread_started;
+	int thread_joined;
 #endif
 } THREAD, * LPTHREAD;
 
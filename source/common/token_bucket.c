@@ -0,0 +1,161 @@
+/*!
+ * @file token_bucket.c
+ * @brief Definitions for the token buckets that limit the rate of outbound channel data.
+ */
+#include "common.h"
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+/*!
+ * @brief Get the current time in milliseconds.
+ * @return The current time, relative to an arbitrary epoch.
+ */
+static QWORD token_bucket_now()
+{
+#ifdef _WIN32
+	return (QWORD)GetTickCount();
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+/*!
+ * @brief Create a token bucket.
+ * @param rate Refill rate in bytes a second, zero for no limit.
+ * @param burst Most tokens the bucket holds, zero for a second's worth.
+ * @return Pointer to the new bucket, or \c NULL on failure.
+ */
+TokenBucket* token_bucket_create(DWORD rate, DWORD burst)
+{
+	TokenBucket* bucket = (TokenBucket*)malloc(sizeof(TokenBucket));
+
+	if (bucket)
+	{
+		memset(bucket, 0, sizeof(TokenBucket));
+
+		if (!(bucket->lock = lock_create()))
+		{
+			free(bucket);
+			return NULL;
+		}
+
+		token_bucket_set(bucket, rate, burst);
+	}
+
+	return bucket;
+}
+
+/*!
+ * @brief Destroy a token bucket.
+ * @param bucket Pointer to the bucket, may be \c NULL.
+ */
+VOID token_bucket_destroy(TokenBucket* bucket)
+{
+	if (bucket)
+	{
+		lock_destroy(bucket->lock);
+		free(bucket);
+	}
+}
+
+/*!
+ * @brief Change the limits of a token bucket. The bucket starts out full, and its counters are kept.
+ * @param bucket Pointer to the bucket.
+ * @param rate Refill rate in bytes a second, zero for no limit.
+ * @param burst Most tokens the bucket holds, zero for a second's worth.
+ */
+VOID token_bucket_set(TokenBucket* bucket, DWORD rate, DWORD burst)
+{
+	if (!burst)
+	{
+		burst = rate;
+	}
+
+	if ((ULONG)burst > 0x7FFFFFFF)
+	{
+		burst = 0x7FFFFFFF;
+	}
+
+	lock_acquire(bucket->lock);
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = (LONG)burst;
+	bucket->refilled = token_bucket_now();
+	lock_release(bucket->lock);
+}
+
+/*!
+ * @brief Take tokens for data that is about to be sent out of a bucket.
+ * @param bucket Pointer to the bucket.
+ * @param bytes Number of bytes that are being sent.
+ * @return Number of milliseconds the sender should wait before sending more, zero if it needn't.
+ * @remark The data is always let through, an overdrawn bucket carries its debt over to later sends.
+ */
+DWORD token_bucket_consume(TokenBucket* bucket, DWORD bytes)
+{
+	QWORD now, refill, room;
+	DWORD delay = 0;
+
+	lock_acquire(bucket->lock);
+
+	bucket->bytes += bytes;
+
+	if (bucket->rate)
+	{
+		now = token_bucket_now();
+
+		// only the time that went into whole tokens is used up, so slow rates still refill
+		refill = (now - bucket->refilled) * bucket->rate / 1000;
+		// DWORD is signed on POSIX, so the arithmetic on tokens is done in 64 bits
+		room = (QWORD)((LONGLONG)bucket->burst - bucket->tokens);
+		if (refill >= room)
+		{
+			bucket->tokens = (LONG)bucket->burst;
+			bucket->refilled = now;
+		}
+		else if (refill)
+		{
+			bucket->tokens += (LONG)refill;
+			bucket->refilled += refill * 1000 / bucket->rate;
+		}
+
+		// the debt is capped so that the bucket can't wrap around
+		if ((LONGLONG)bucket->tokens - (ULONG)bytes < -0x7FFFFFFF)
+		{
+			bucket->tokens = -0x7FFFFFFF;
+		}
+		else
+		{
+			bucket->tokens -= (LONG)bytes;
+		}
+
+		if (bucket->tokens < 0)
+		{
+			refill = ((QWORD)(DWORD)-bucket->tokens * 1000 + bucket->rate - 1) / bucket->rate;
+			delay = refill > TOKEN_BUCKET_MAX_DELAY ? TOKEN_BUCKET_MAX_DELAY : (DWORD)refill;
+			bucket->throttled++;
+			bucket->delayed += delay;
+		}
+	}
+
+	lock_release(bucket->lock);
+
+	return delay;
+}
+
+/*!
+ * @brief Take a consistent copy of a bucket's limits and counters.
+ * @param bucket Pointer to the bucket.
+ * @param snapshot Pointer to the structure that receives the copy.
+ */
+VOID token_bucket_snapshot(TokenBucket* bucket, TokenBucket* snapshot)
+{
+	lock_acquire(bucket->lock);
+	memcpy(snapshot, bucket, sizeof(TokenBucket));
+	lock_release(bucket->lock);
+	snapshot->lock = NULL;
+}
@@ -0,0 +1,36 @@
+/*!
+ * @file token_bucket.h
+ * @brief Declarations for the token buckets that limit the rate of outbound channel data.
+ * @details A bucket holds up to \c burst bytes worth of tokens and is refilled at
+ *          \c rate bytes a second. Sending data takes tokens out of the bucket, and
+ *          a send that overdraws it is allowed through, with the debt telling the
+ *          caller how long to hold off before sending any more.
+ */
+#ifndef _METERPRETER_LIB_TOKEN_BUCKET_H
+#define _METERPRETER_LIB_TOKEN_BUCKET_H
+
+#include "linkage.h"
+#include "thread.h"
+
+/*! @brief Longest delay, in milliseconds, that a single send is asked to wait out. Any debt beyond that is carried over to the next send. */
+#define TOKEN_BUCKET_MAX_DELAY  1000
+
+typedef struct _TokenBucket
+{
+	LOCK* lock;               ///< Guards the bucket.
+	DWORD rate;               ///< Refill rate in bytes a second, zero when there is no limit.
+	DWORD burst;              ///< Most tokens the bucket holds.
+	LONG tokens;              ///< Tokens in the bucket, negative when the bucket is overdrawn.
+	QWORD refilled;           ///< Time of the last refill, in milliseconds.
+	QWORD bytes;              ///< Number of bytes sent through the bucket.
+	DWORD throttled;          ///< Number of sends that were asked to wait.
+	QWORD delayed;            ///< Total number of milliseconds that sends were asked to wait.
+} TokenBucket;
+
+LINKAGE TokenBucket* token_bucket_create(DWORD rate, DWORD burst);
+LINKAGE VOID token_bucket_destroy(TokenBucket* bucket);
+LINKAGE VOID token_bucket_set(TokenBucket* bucket, DWORD rate, DWORD burst);
+LINKAGE DWORD token_bucket_consume(TokenBucket* bucket, DWORD bytes);
+LINKAGE VOID token_bucket_snapshot(TokenBucket* bucket, TokenBucket* snapshot);
+
+#endif
@@ -331,7 +331,7 @@ DWORD request_networkpug_start(Remote *remote, Packet *packet)
 		chops.native.close = networkpug_channel_close;
 		// interact, read don't need to be implemented.
 
-		np->channel = channel_create_pool(0, CHANNEL_FLAG_SYNCHRONOUS, &chops);
+		np->channel = channel_create_pool(remote, 0, CHANNEL_FLAG_SYNCHRONOUS, &chops);
 
 		if(np->pcap) {
 			char *final_filter = NULL;
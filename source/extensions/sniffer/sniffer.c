@@ -197,6 +197,9 @@ DWORD PktGetTimeStamp(void *handle, DWORD *thi)
 
 #define AdpCfgGetMaxPacketSize(x) (1514)
 
+#define SNIFFER_BLOCK_SIZE (256 * 1024) // must hold a 65535 byte packet and its header
+#define SNIFFER_RECORD_SIZE(caplen) ((sizeof(PeterPacket) + (caplen) + 7) & ~7)
+
 #endif
 
 struct sockaddr peername;
@@ -528,10 +531,85 @@ void __stdcall sniffer_receive(DWORD_PTR Param, DWORD_PTR ThParam, HANDLE hPacke
 
 #else
 
+/*
+ * Seal the staged packets into a new block at the end of the job's list,
+ * compressing them unless they don't compress. Called with snifferm held.
+ */
+void sniffer_seal_block(CaptureJob *j)
+{
+	CaptureBlock *block, *shrunk;
+	unsigned int len;
+
+	block = malloc(sizeof(CaptureBlock) + j->stage_len);
+	if(! block)
+	{
+		dprintf("no memory to seal a block, dropping %d packets", j->stage_pkts);
+		j->cur_pkts -= j->stage_pkts;
+		j->cur_bytes -= j->stage_bytes;
+	}
+	else
+	{
+		len = lz4_compress(j->stage, j->stage_len, block->data, j->stage_len - 1);
+		if(! len)
+		{
+			memcpy(block->data, j->stage, j->stage_len);
+			len = j->stage_len;
+		}
+		else if((shrunk = realloc(block, sizeof(CaptureBlock) + len)))
+		{
+			block = shrunk;
+		}
+
+		dprintf("sealed block of %d packets, %d bytes into %d bytes", j->stage_pkts, j->stage_len, len);
+
+		block->next = NULL;
+		block->pkts = j->stage_pkts;
+		block->bytes = j->stage_bytes;
+		block->rawlen = j->stage_len;
+		block->len = len;
+
+		if(j->lastblock)
+		{
+			j->lastblock->next = block;
+		}
+		else
+		{
+			j->blocks = block;
+		}
+		j->lastblock = block;
+	}
+
+	j->stage_len = 0;
+	j->stage_pkts = 0;
+	j->stage_bytes = 0;
+}
+
+/*
+ * Free all of the job's captured packets, keeping the stage buffer for reuse.
+ */
+void sniffer_drop_blocks(CaptureJob *j)
+{
+	CaptureBlock *block;
+
+	while(j->blocks)
+	{
+		block = j->blocks;
+		j->blocks = block->next;
+		free(block);
+	}
+
+	j->lastblock = NULL;
+	j->stage_len = 0;
+	j->stage_pkts = 0;
+	j->stage_bytes = 0;
+}
+
 void packet_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
 {
 	CaptureJob *j = (CaptureJob *)(user);
+	CaptureBlock *block;
 	PeterPacket *pkt;
+	unsigned int size;
 
 	if(! j->active)
 	{
@@ -540,37 +618,43 @@ void packet_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *byt
 		return;
 	}
 
-	pkt = calloc(sizeof(PeterPacket) + h->caplen, 1);
-	if(! pkt)
+	size = SNIFFER_RECORD_SIZE(h->caplen);
+
+	// PKS, so tempted to implement per job locks.
+	// must fight temptation. :-)
+
+	lock_acquire(snifferm);
+
+	if(j->stage_len + size > SNIFFER_BLOCK_SIZE)
 	{
-		dprintf("ho hum, no memory. maybe a pcap_breakloop / stop running?");
-		return;
+		sniffer_seal_block(j);
 	}
 
+	pkt = (PeterPacket *)(j->stage + j->stage_len);
 	memcpy(&(pkt->h), h, sizeof(struct pcap_pkthdr));
 	memcpy(&(pkt->bytes), bytes, h->caplen);
 
-	// PKS, so tempted to implement per job locks.
-	// must fight temptation. :-)
-
-	// could be interesting to try and find a lockless way of implementing it.
-	// though the j->idx_pkts >= j->max_pkts is annoying :p
-
-	lock_acquire(snifferm);
+	j->stage_len += size;
+	j->stage_pkts++;
+	j->stage_bytes += h->caplen;
 
 	j->cur_pkts ++;
 	j->cur_bytes += h->caplen;
 
-	if(j->idx_pkts >= j->max_pkts) j->idx_pkts = 0;
-
-	if(j->pkts[j->idx_pkts])
+	// whole blocks are dropped, once the newer packets alone fill the queue
+	while(j->blocks && j->cur_pkts - j->blocks->pkts >= j->max_pkts)
 	{
-		j->cur_pkts--;
-		j->cur_bytes -= ((PeterPacket *)(j->pkts[j->idx_pkts]))->h.caplen;
-		free((void*)(j->pkts[j->idx_pkts]));
-	}
+		block = j->blocks;
+		j->blocks = block->next;
+		if(! j->blocks)
+		{
+			j->lastblock = NULL;
+		}
 
-	j->pkts[j->idx_pkts++] = pkt;
+		j->cur_pkts -= block->pkts;
+		j->cur_bytes -= block->bytes;
+		free(block);
+	}
 
 	lock_release(snifferm);
 
@@ -627,6 +711,31 @@ DWORD sniffer_thread(THREAD *thread)
 
 #endif
 
+/*
+ * Free all of the packets captured by a job.
+ */
+void sniffer_free_packets(CaptureJob *j)
+{
+#ifdef _WIN32
+	unsigned int i;
+
+	for (i = 0; i < j->max_pkts; i++)
+	{
+		if (!j->pkts[i]) break;
+
+		PktDestroy(j->pkts[i]);
+		j->pkts[i] = NULL;
+	}
+
+	free(j->pkts);
+	j->pkts = NULL;
+#else
+	sniffer_drop_blocks(j);
+	free(j->stage);
+	j->stage = NULL;
+#endif
+}
+
 DWORD request_sniffer_capture_start(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
@@ -780,12 +889,14 @@ DWORD request_sniffer_capture_start(Remote *remote, Packet *packet)
 
 #endif
 
+#ifdef _WIN32
 		j->pkts = calloc(maxp, sizeof(*(j->pkts)));
 		if (j->pkts == NULL) {
-#ifdef _WIN32
 			AdpCloseAdapter(j->adp);
 			AdpDestroy(j->adp);
 #else
+		j->stage = malloc(SNIFFER_BLOCK_SIZE);
+		if (j->stage == NULL) {
 			pcap_close(j->pcap);
 #endif
 			result = ERROR_ACCESS_DENIED;
@@ -875,7 +986,7 @@ DWORD request_sniffer_capture_stop(Remote *remote, Packet *packet)
 DWORD request_sniffer_capture_release(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
-	unsigned int ifid, i;
+	unsigned int ifid;
 	CaptureJob *j;
 	DWORD result;
 
@@ -915,15 +1026,7 @@ DWORD request_sniffer_capture_release(Remote *remote, Packet *packet)
 		packet_add_tlv_uint(response, TLV_TYPE_SNIFFER_BYTE_COUNT, (unsigned int)j->cur_bytes);
 		dprintf("sniffer>> release_capture() interface %d released %d packets/%d bytes", j->intf, j->cur_pkts, j->cur_bytes);
 
-		for (i = 0; i < j->max_pkts; i++)
-		{
-			if (!j->pkts[i]) break;
-
-			PktDestroy(j->pkts[i]);
-			j->pkts[i] = NULL;
-		}
-
-		free(j->pkts);
+		sniffer_free_packets(j);
 		memset(j, 0, sizeof(CaptureJob));
 
 		lock_release(snifferm);
@@ -985,7 +1088,7 @@ DWORD request_sniffer_capture_stats(Remote *remote, Packet *packet)
 DWORD request_sniffer_capture_dump_read(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
-	unsigned int ifid, i;
+	unsigned int ifid;
 	unsigned int bcnt;
 	CaptureJob *j;
 	DWORD result;
@@ -1040,14 +1143,7 @@ DWORD request_sniffer_capture_dump_read(Remote *remote, Packet *packet)
 		{
 			dprintf("sniffer>> capture_dump_read, release CaptureJob");
 			lock_acquire(snifferm);
-			for (i = 0; i < j->max_pkts; i++)
-			{
-				if (!j->pkts[i]) break;
-				PktDestroy(j->pkts[i]);
-				j->pkts[i] = NULL;
-			}
-
-			free(j->pkts);
+			sniffer_free_packets(j);
 			memset(j, 0, sizeof(CaptureJob));
 			lock_release(snifferm);
 		}
@@ -1059,19 +1155,114 @@ fail:
 }
 
 
+/*
+ * Append a packet's dump record to the job's dump buffer, growing it as needed.
+ */
+DWORD sniffer_dump_packet(CaptureJob *j, void *pkt, unsigned int *mbuf)
+{
+	unsigned int *tmp;
+	unsigned char *dbuf;
+#ifdef _WIN64
+	ULONGLONG thilo;
+#endif
+	DWORD thi, tlo;
+
+	if (*mbuf < j->dlen + 8 + 8 + 4 + PktGetPacketSize(pkt))
+	{
+		*mbuf += (1024 * 1024);
+		dbuf = realloc(j->dbuf, *mbuf);
+
+		if (!dbuf)
+		{
+			dprintf("sniffer>> realloc of %d bytes failed!", *mbuf);
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		j->dbuf = dbuf;
+	}
+
+	tmp = (unsigned int *)(j->dbuf + j->dlen);
+#ifdef _WIN64
+	thilo = PktGetId(pkt);
+	thi = (DWORD)(thilo >> 32);
+	tlo = (DWORD)(thilo & 0xFFFFFFFF);
+#else
+	tlo = PktGetId(pkt, &thi);
+#endif
+	*tmp = htonl(thi); tmp++;
+	*tmp = htonl(tlo); tmp++;
+
+#ifdef _WIN64
+	thilo = PktGetTimeStamp(pkt);
+	thi = (DWORD)(thilo >> 32);
+	tlo = (DWORD)(thilo & 0xFFFFFFFF);
+#else
+	tlo = PktGetTimeStamp(pkt, &thi);
+#endif
+	*tmp = htonl(thi); tmp++;
+	*tmp = htonl(tlo); tmp++;
+
+	tlo = PktGetPacketSize(pkt);
+	*tmp = htonl(tlo); tmp++;
+
+	memcpy(j->dbuf + j->dlen + 20, PktGetPacketData(pkt), tlo);
+
+	j->dlen += 20 + tlo;
+	return ERROR_SUCCESS;
+}
+
+#ifndef _WIN32
+/*
+ * Append the dump records of a block's worth of PeterPacket records, after
+ * skipping the first *skip of them.
+ */
+DWORD sniffer_dump_records(CaptureJob *j, unsigned char *data, unsigned int len, unsigned int *skip,
+	DWORD *pcnt, unsigned int *mbuf)
+{
+	PeterPacket *pkt;
+	unsigned int offset = 0;
+	DWORD result;
+
+	while (offset < len)
+	{
+		pkt = (PeterPacket *)(data + offset);
+		offset += SNIFFER_RECORD_SIZE(pkt->h.caplen);
+
+		if (*skip)
+		{
+			(*skip)--;
+			continue;
+		}
+
+		result = sniffer_dump_packet(j, pkt, mbuf);
+		if (result != ERROR_SUCCESS)
+		{
+			return result;
+		}
+
+		(*pcnt)++;
+	}
+
+	return ERROR_SUCCESS;
+}
+#endif
+
 DWORD request_sniffer_capture_dump(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
 	unsigned int ifid;
-	unsigned int rbuf, mbuf;
-	unsigned int *tmp;
+	unsigned int mbuf;
 
 	CaptureJob *j;
-	DWORD result, pcnt, rcnt, i;
-#ifdef _WIN64
-	ULONGLONG thilo;
+	DWORD result, pcnt;
+#ifdef _WIN32
+	DWORD i;
+#else
+	CaptureBlock *block;
+	unsigned char *scratch, *data;
+	unsigned int skip;
+	DWORD len;
 #endif
-	DWORD thi, tlo;
 
 	check_pssdk();
 	dprintf("sniffer>> capture_dump()");
@@ -1116,67 +1307,78 @@ DWORD request_sniffer_capture_dump(Remote *remote, Packet *packet)
 
 		// Add basic stats
 		pcnt = 0;
-		rcnt = 0;
 
 		mbuf = (1024 * 1024);
 		j->dbuf = malloc(mbuf);
-		rbuf = 0;
+		if (!j->dbuf)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
 
+#ifdef _WIN32
 		for (i = 0; i < j->max_pkts; i++)
 		{
 			if (!j->pkts[i]) break;
 
-			rbuf += (8 + 8 + 4 + PktGetPacketSize(j->pkts[i]));
-			if (mbuf < rbuf)
-			{
-				mbuf += (1024 * 1024);
-				j->dbuf = realloc(j->dbuf, mbuf);
+			result = sniffer_dump_packet(j, j->pkts[i], &mbuf);
+			if (result != ERROR_SUCCESS) break;
 
-				if (!j->dbuf)
+			pcnt++;
+
+			PktDestroy(j->pkts[i]);
+			j->pkts[i] = NULL;
+		}
+#else
+		// blocks are dropped whole, so the oldest block may hold more than the queue length
+		skip = j->cur_pkts > j->max_pkts ? j->cur_pkts - j->max_pkts : 0;
+		scratch = NULL;
+
+		for (block = j->blocks; block && result == ERROR_SUCCESS; block = block->next)
+		{
+			data = block->data;
+
+			if (block->len < block->rawlen)
+			{
+				if (!scratch && !(scratch = malloc(SNIFFER_BLOCK_SIZE)))
 				{
-					dprintf("sniffer>> realloc of %d bytes failed!", rbuf);
 					result = ERROR_NOT_ENOUGH_MEMORY;
 					break;
 				}
-			}
-
-			tmp = (unsigned int *)(j->dbuf + rcnt);
-#ifdef _WIN64
-			thilo = PktGetId(j->pkts[i]);
-			thi = (DWORD)(thilo >> 32);
-			tlo = (DWORD)(thilo & 0xFFFFFFFF);
-#else
-			tlo = PktGetId(j->pkts[i], &thi);
-#endif
-			*tmp = htonl(thi); tmp++;
-			*tmp = htonl(tlo); tmp++;
 
-#ifdef _WIN64
-			thilo = PktGetTimeStamp(j->pkts[i]);
-			thi = (DWORD)(thilo >> 32);
-			tlo = (DWORD)(thilo & 0xFFFFFFFF);
-#else
-			tlo = PktGetTimeStamp(j->pkts[i], &thi);
-#endif
-			*tmp = htonl(thi); tmp++;
-			*tmp = htonl(tlo); tmp++;
+				result = lz4_decompress(block->data, block->len, scratch, SNIFFER_BLOCK_SIZE, &len);
+				if (result != ERROR_SUCCESS)
+				{
+					dprintf("sniffer>> block of %d packets failed to decompress", block->pkts);
+					break;
+				}
 
-			tlo = PktGetPacketSize(j->pkts[i]);
-			*tmp = htonl(tlo); tmp++;
+				data = scratch;
+			}
 
-			memcpy(j->dbuf + rcnt + 20, PktGetPacketData(j->pkts[i]), tlo);
+			result = sniffer_dump_records(j, data, block->rawlen, &skip, &pcnt, &mbuf);
+		}
 
-			rcnt += 20 + tlo;
-			pcnt++;
+		free(scratch);
 
-			PktDestroy(j->pkts[i]);
-			j->pkts[i] = NULL;
+		if (result == ERROR_SUCCESS)
+		{
+			result = sniffer_dump_records(j, j->stage, j->stage_len, &skip, &pcnt, &mbuf);
 		}
 
-		j->dlen = rcnt;
+		sniffer_drop_blocks(j);
+#endif
+
+		if (result != ERROR_SUCCESS)
+		{
+			free(j->dbuf);
+			j->dbuf = NULL;
+			j->dlen = 0;
+			pcnt = 0;
+		}
 
 		packet_add_tlv_uint(response, TLV_TYPE_SNIFFER_PACKET_COUNT, pcnt);
-		packet_add_tlv_uint(response, TLV_TYPE_SNIFFER_BYTE_COUNT, rcnt);
+		packet_add_tlv_uint(response, TLV_TYPE_SNIFFER_BYTE_COUNT, j->dlen);
 		// add capture datalink, needed when saving capture file, use TLV_TYPE_SNIFFER_INTERFACE_ID not to create a new TLV type
 		packet_add_tlv_uint(response, TLV_TYPE_SNIFFER_INTERFACE_ID, j->capture_linktype);
 
@@ -23,6 +23,20 @@
 
 #include "../../common/common.h"
 
+#ifndef _WIN32
+// Captured packets are kept as a list of blocks of PeterPacket records, each
+// block LZ4 compressed when it fills up, or stored as is if that doesn't shrink it.
+typedef struct CaptureBlock
+{
+	struct CaptureBlock *next;
+	unsigned int pkts;
+	unsigned int bytes;
+	unsigned int rawlen;	// size of the records in the block
+	unsigned int len;		// size of data, less than rawlen if the block is compressed
+	unsigned char data[0];
+} CaptureBlock;
+#endif
+
 typedef struct capturejob
 {
 	unsigned int active;
@@ -36,7 +50,12 @@ typedef struct capturejob
 #ifdef _WIN32
 	HANDLE *pkts;
 #else
-	struct PeterPacket **pkts;
+	struct CaptureBlock *blocks;	// sealed blocks, oldest first
+	struct CaptureBlock *lastblock;
+	unsigned char *stage;			// packets not yet sealed into a block
+	unsigned int stage_len;
+	unsigned int stage_pkts;
+	unsigned int stage_bytes;
 #endif
 	unsigned char *dbuf;
 	unsigned int dlen;
@@ -6,6 +6,7 @@ void request_fs_ls_cb(void *arg, char *name, char *short_name, char *path)
 {
 	Packet *response = arg;
 	struct meterp_stat s;
+	uint64_t size;
 
 	/*
 	 * Add the file name, full path and stat information
@@ -15,8 +16,9 @@ void request_fs_ls_cb(void *arg, char *name, char *short_name, char *path)
 	if (short_name) {
 		packet_add_tlv_string(response, TLV_TYPE_FILE_SHORT_NAME, short_name);
 	}
-	if (fs_stat(path, &s) >= 0) {
+	if (fs_stat(path, &s, &size) >= 0) {
 		packet_add_tlv_raw(response, TLV_TYPE_STAT_BUF, &s, sizeof(s));
+		packet_add_tlv_qword(response, TLV_TYPE_STAT_SIZE, size);
 	}
 }
 
@@ -110,9 +112,11 @@ DWORD request_fs_mkdir(Remote * remote, Packet * packet)
 }
 
 /*
- * Removes the supplied directory from disk if it's empty
+ * Removes the supplied directory from disk if it's empty, or along with
+ * everything below it when TLV_TYPE_FS_RECURSIVE is set
  *
  * req: TLV_TYPE_DIRECTORY_PATH - The directory that is to be removed.
+ * opt: TLV_TYPE_FS_RECURSIVE   - Remove the directory's contents as well.
  */
 DWORD request_fs_delete_dir(Remote * remote, Packet * packet)
 {
@@ -123,6 +127,9 @@ DWORD request_fs_delete_dir(Remote * remote, Packet * packet)
 
 	if (directory == NULL) {
 		result = ERROR_INVALID_PARAMETER;
+	} else if (packet_get_tlv_value_bool(packet, TLV_TYPE_FS_RECURSIVE)) {
+		FsProgressContext progress = { remote, packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID) };
+		result = fs_delete_tree(directory, fs_progress_notify, &progress);
 	} else {
 		result = fs_delete_dir(directory);
 	}
@@ -6,14 +6,23 @@
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
+TLV_SCHEMA_DEFINE(FsPathRequest, FS_PATH_FIELDS)
+TLV_SCHEMA_DEFINE(FsMoveRequest, FS_MOVE_FIELDS)
+TLV_SCHEMA_DEFINE(FsCopyRequest, FS_COPY_FIELDS)
+
 /***************************
  * File Channel Operations *
  ***************************/
 
+/*
+ * The file is read, written and positioned with the fs_f* calls so that
+ * offsets past 2GB work on every platform.
+ */
 typedef struct
 {
 	FILE  *fd;
 	DWORD mode;
+	BOOL  eof;
 } FileContext;
 
 /*
@@ -29,10 +38,7 @@ static DWORD file_channel_write(Channel *channel, Packet *request,
 
 	// Write a chunk
 	if (bufferSize) {
-		written = fwrite(buffer, 1, bufferSize, ctx->fd);
-		if (written < bufferSize) {
-			result  = GetLastError();
-		}
+		result = fs_fwrite(ctx->fd, buffer, bufferSize, &written);
 	}
 
 	if (bytesWritten) {
@@ -67,11 +73,11 @@ static DWORD file_channel_read(Channel *channel, Packet *request,
 	DWORD result = ERROR_SUCCESS;
 	size_t bytes = 0;
 
-	// Read a chunk
+	// Read a chunk, coming up short means the end of the file was reached
 	if (bufferSize) {
-	       	bytes = fread(buffer, 1, bufferSize, ctx->fd);
-		if (bytes < bufferSize) {
-			result = GetLastError();
+		result = fs_fread(ctx->fd, buffer, bufferSize, &bytes);
+		if (result == ERROR_SUCCESS && bytes < bufferSize) {
+			ctx->eof = TRUE;
 		}
 	}
 
@@ -79,7 +85,7 @@ static DWORD file_channel_read(Channel *channel, Packet *request,
 		*bytesRead = (DWORD)bytes;
 	}
 
-	return ERROR_SUCCESS;
+	return result;
 }
 
 /*
@@ -89,7 +95,7 @@ static DWORD file_channel_eof(Channel *channel, Packet *request,
 		LPVOID context, LPBOOL isEof)
 {
 	FileContext *ctx = (FileContext *)context;
-	*isEof = feof(ctx->fd) ? TRUE : FALSE;
+	*isEof = ctx->eof;
 	return ERROR_SUCCESS;
 }
 
@@ -97,26 +103,29 @@ static DWORD file_channel_eof(Channel *channel, Packet *request,
  * Changes the current file pointer position in the file
  */
 static DWORD file_channel_seek(Channel *channel, Packet *request,
-		LPVOID context, LONG offset, DWORD whence)
+		LPVOID context, LONGLONG offset, DWORD whence)
 {
 	FileContext *ctx = (FileContext *)context;
+	DWORD result = fs_fseek(ctx->fd, offset, whence);
+
+	if (result == ERROR_SUCCESS) {
+		ctx->eof = FALSE;
+	}
 
-	return fseek(ctx->fd, offset, whence);
+	return result;
 }
 
 /*
  * Returns the current offset in the file to the requestor
  */
 static DWORD file_channel_tell(Channel *channel, Packet *request,
-		LPVOID context, LPLONG offset)
+		LPVOID context, PLONGLONG offset)
 {
 	FileContext *ctx = (FileContext *)context;
 	DWORD result = ERROR_SUCCESS;
-	LONG pos = 0;
+	int64_t pos = 0;
 
-	if ((pos = ftell(ctx->fd)) < 0) {
-		result = GetLastError();
-	}
+	result = fs_ftell(ctx->fd, &pos);
 
 	if (offset)
 		*offset = pos;
@@ -127,6 +136,8 @@ static DWORD file_channel_tell(Channel *channel, Packet *request,
 /*
  * Handles the open request for a file channel and returns a valid channel
  * identifier to the requestor if the file is opened successfully
+ *
+ * opt: TLV_TYPE_FS_FOLLOW - Push data appended to the file instead (POSIX only)
  */
 DWORD request_fs_file_channel_open(Remote *remote, Packet *packet)
 {
@@ -139,6 +150,16 @@ DWORD request_fs_file_channel_open(Remote *remote, Packet *packet)
 	FileContext *ctx;
 	LPSTR expandedFilePath = NULL;
 
+	if (packet_get_tlv_value_bool(packet, TLV_TYPE_FS_FOLLOW)) {
+#ifdef _WIN32
+		response = packet_create_response(packet);
+		packet_transmit_response(ERROR_NOT_SUPPORTED, remote, response);
+		return ERROR_NOT_SUPPORTED;
+#else
+		return request_fs_file_follow_channel_open(remote, packet);
+#endif
+	}
+
 	// Allocate a response
 	response = packet_create_response(packet);
 
@@ -177,7 +198,7 @@ DWORD request_fs_file_channel_open(Remote *remote, Packet *packet)
 
 	// Check the response allocation & allocate a un-connected
 	// channel
-	if ((!response) || (!(newChannel = channel_create_pool(0, flags, &chops)))) {
+	if ((!response) || (!(newChannel = channel_create_pool(remote, 0, flags, &chops)))) {
 		res = ERROR_NOT_ENOUGH_MEMORY;
 		goto out;
 	}
@@ -217,7 +238,8 @@ DWORD request_fs_separator(Remote *remote, Packet *packet)
 
 /*
  * Gets information about the file path that is supplied and returns it to the
- * requestor
+ * requestor. The stat buffer only has room for 32 bits of the size, the
+ * whole of it is returned as TLV_TYPE_STAT_SIZE.
  *
  * req: TLV_TYPE_FILE_PATH - The file path that is to be stat'd
  */
@@ -225,11 +247,16 @@ DWORD request_fs_stat(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
 	struct meterp_stat buf;
+	uint64_t size;
+	FsPathRequest args;
 	char *filePath;
 	char *expanded = NULL;
 	DWORD result = ERROR_SUCCESS;
 
-	filePath = packet_get_tlv_value_string(packet, TLV_TYPE_FILE_PATH);
+	if ((result = packet_decode(packet, &FsPathRequestSchema, &args)) != ERROR_SUCCESS) {
+		goto out;
+	}
+	filePath = args.path;
 
 	if (!filePath) {
 		result = ERROR_INVALID_PARAMETER;
@@ -242,9 +269,10 @@ DWORD request_fs_stat(Remote *remote, Packet *packet)
 		goto out;
 	}
 
-	result = fs_stat(expanded, &buf);
+	result = fs_stat(expanded, &buf, &size);
 	if (0 == result) {
 		packet_add_tlv_raw(response, TLV_TYPE_STAT_BUF, &buf, sizeof(buf));
+		packet_add_tlv_qword(response, TLV_TYPE_STAT_SIZE, size);
 	}
 
 	free(expanded);
@@ -262,10 +290,14 @@ out:
 DWORD request_fs_delete_file(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
+	FsPathRequest args;
 	char *path;
 	DWORD result = ERROR_SUCCESS;
 
-	path = packet_get_tlv_value_string(packet, TLV_TYPE_FILE_PATH);
+	if ((result = packet_decode(packet, &FsPathRequestSchema, &args)) != ERROR_SUCCESS) {
+		goto out;
+	}
+	path = args.path;
 
 	if (!path) {
 		result = ERROR_INVALID_PARAMETER;
@@ -273,6 +305,7 @@ DWORD request_fs_delete_file(Remote *remote, Packet *packet)
 		result = fs_delete_file(path);
 	}
 
+out:
 	packet_add_tlv_uint(response, TLV_TYPE_RESULT, result);
 	return PACKET_TRANSMIT(remote, response, NULL);
 }
@@ -287,9 +320,13 @@ DWORD request_fs_file_expand_path(Remote *remote, Packet *packet)
 	Packet *response = packet_create_response(packet);
 	DWORD result = ERROR_SUCCESS;
 	char *expanded = NULL;
+	FsPathRequest args;
 	char *regular;
 
-	regular = packet_get_tlv_value_string(packet, TLV_TYPE_FILE_PATH);
+	if ((result = packet_decode(packet, &FsPathRequestSchema, &args)) != ERROR_SUCCESS) {
+		goto out;
+	}
+	regular = args.path;
 	if (regular == NULL) {
 		result = ERROR_INVALID_PARAMETER;
 		goto out;
@@ -318,6 +355,7 @@ out:
 DWORD request_fs_md5(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
+	FsPathRequest args;
 	char *filePath;
 	DWORD result = ERROR_SUCCESS;
 	MD5_CTX context;
@@ -327,7 +365,10 @@ DWORD request_fs_md5(Remote *remote, Packet *packet)
 	unsigned char buff[16384];
 	unsigned char hash[MD5_DIGEST_LENGTH + 1] = {0};
 
-	filePath = packet_get_tlv_value_string(packet, TLV_TYPE_FILE_PATH);
+	if ((result = packet_decode(packet, &FsPathRequestSchema, &args)) != ERROR_SUCCESS) {
+		goto out;
+	}
+	filePath = args.path;
 
 	result = fs_fopen(filePath, "rb", &fd);
 	if (result == ERROR_SUCCESS) {
@@ -345,6 +386,7 @@ DWORD request_fs_md5(Remote *remote, Packet *packet)
 		fclose(fd);
 	}
 
+out:
 	packet_add_tlv_uint(response, TLV_TYPE_RESULT, result);
 	return PACKET_TRANSMIT(remote, response, NULL);
 }
@@ -358,6 +400,7 @@ DWORD request_fs_md5(Remote *remote, Packet *packet)
 DWORD request_fs_sha1(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
+	FsPathRequest args;
 	char *filePath;
 	DWORD result = ERROR_SUCCESS;
 	SHA_CTX context;
@@ -367,7 +410,10 @@ DWORD request_fs_sha1(Remote *remote, Packet *packet)
 	unsigned char buff[16384];
 	unsigned char hash[SHA_DIGEST_LENGTH + 1] = {0};
 
-	filePath = packet_get_tlv_value_string(packet, TLV_TYPE_FILE_PATH);
+	if ((result = packet_decode(packet, &FsPathRequestSchema, &args)) != ERROR_SUCCESS) {
+		goto out;
+	}
+	filePath = args.path;
 
 	result = fs_fopen(filePath, "rb", &fd);
 	if (result == ERROR_SUCCESS) {
@@ -383,6 +429,7 @@ DWORD request_fs_sha1(Remote *remote, Packet *packet)
 		packet_add_tlv_raw(response, TLV_TYPE_FILE_NAME, hash, sizeof(hash));
 	}
 
+out:
 	packet_add_tlv_uint(response, TLV_TYPE_RESULT, result);
 	return PACKET_TRANSMIT(remote, response, NULL);
 }
@@ -396,18 +443,97 @@ DWORD request_fs_file_move(Remote *remote, Packet *packet)
 {
 	Packet *response = packet_create_response(packet);
 	DWORD result = ERROR_SUCCESS;
+	FsMoveRequest args;
 	char *oldpath;
 	char *newpath;
 
-	oldpath = packet_get_tlv_value_string(packet, TLV_TYPE_FILE_NAME);
-	newpath = packet_get_tlv_value_string(packet, TLV_TYPE_FILE_PATH);
+	if ((result = packet_decode(packet, &FsMoveRequestSchema, &args)) != ERROR_SUCCESS) {
+		goto out;
+	}
+	oldpath = args.oldPath;
+	newpath = args.newPath;
 
 	if (!oldpath) {
 		result = ERROR_INVALID_PARAMETER;
 	} else {
 		result = fs_move(oldpath, newpath);
+#ifndef _WIN32
+		/*
+		 * rename() can't cross file systems, so fall back to copying the
+		 * tree on the target and removing the original.
+		 */
+		if (result == EXDEV) {
+			FsProgressContext progress = { remote, packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID) };
+			struct meterp_stat buf;
+
+			result = fs_stat(oldpath, &buf, NULL);
+			if (result == ERROR_SUCCESS) {
+				result = fs_copy(oldpath, newpath, TRUE, fs_progress_notify, &progress);
+			}
+			if (result == ERROR_SUCCESS) {
+				result = S_ISDIR(buf.st_mode)
+					? fs_delete_tree(oldpath, NULL, NULL)
+					: fs_delete_file(oldpath);
+			}
+		}
+#endif
+	}
+
+out:
+	packet_add_tlv_uint(response, TLV_TYPE_RESULT, result);
+	return PACKET_TRANSMIT(remote, response, NULL);
+}
+
+/*
+ * Sends an unsolicited stdapi_fs_progress request for a running tree operation
+ */
+void fs_progress_notify(void *arg, uint32_t entries, uint64_t bytes)
+{
+	FsProgressContext *progress = arg;
+	Packet *request = packet_create(PACKET_TLV_TYPE_REQUEST, "stdapi_fs_progress");
+
+	if (request == NULL) {
+		return;
+	}
+
+	if (progress->requestId) {
+		packet_add_tlv_string(request, TLV_TYPE_FS_PROGRESS_REQUEST, progress->requestId);
+	}
+	packet_add_tlv_uint(request, TLV_TYPE_FS_PROGRESS_ENTRIES, entries);
+	packet_add_tlv_qword(request, TLV_TYPE_FS_PROGRESS_BYTES, bytes);
+
+	PACKET_TRANSMIT(progress->remote, request, NULL);
+}
+
+/*
+ * Copies a file or directory tree on the target
+ *
+ * req: TLV_TYPE_FILE_NAME    - The source path
+ * req: TLV_TYPE_FILE_PATH    - The destination path
+ * opt: TLV_TYPE_FS_RECURSIVE - Copy directories and their contents
+ */
+DWORD request_fs_copy(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	DWORD result = ERROR_SUCCESS;
+	FsCopyRequest args;
+	FsProgressContext progress;
+
+	if ((result = packet_decode(packet, &FsCopyRequestSchema, &args)) != ERROR_SUCCESS) {
+		goto out;
+	}
+
+	progress.remote = remote;
+	progress.requestId = packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID);
+
+	if (!args.source || !args.destination) {
+		result = ERROR_INVALID_PARAMETER;
+	} else {
+		result = fs_copy(args.source, args.destination, args.recursive,
+				fs_progress_notify, &progress);
 	}
 
+out:
 	packet_add_tlv_uint(response, TLV_TYPE_RESULT, result);
 	return PACKET_TRANSMIT(remote, response, NULL);
 }
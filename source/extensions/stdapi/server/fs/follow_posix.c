@@ -0,0 +1,383 @@
+/*
+ * Follow mode ("tail -f") file channels
+ *
+ * A follow channel is a stream channel that pushes data to the client as it
+ * is appended to a file. The file and its parent directory are watched with
+ * inotify. The channel's scheduler waitable is an epoll descriptor holding the
+ * inotify descriptor and the read end of a pipe, so nothing runs until the
+ * file changes.
+ *
+ * Each pass sends at most FOLLOW_PASS_SIZE bytes, so a file that grows
+ * faster than it can be sent doesn't starve the other waitables on the
+ * shard. When a pass leaves data behind, a byte is written to the pipe,
+ * which keeps the waitable readable and gets the channel another pass once
+ * the shard has been round the rest of its waitables.
+ *
+ * Truncation (copytruncate style rotation) is noticed when the file becomes
+ * shorter than the amount already sent, and following restarts from the
+ * beginning. When the file is renamed or deleted, the old file keeps being
+ * followed until a new file with the same name appears; the rest of the old
+ * file is then sent and the new file is followed from its beginning.
+ */
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "precomp.h"
+#include "fs_local.h"
+
+#define FOLLOW_READ_SIZE   16384
+#define FOLLOW_PASS_SIZE   (16 * FOLLOW_READ_SIZE)
+#define FOLLOW_EVENT_SIZE  4096
+
+#define FOLLOW_FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define FOLLOW_DIR_EVENTS  (IN_CREATE | IN_MOVED_TO)
+
+typedef struct
+{
+	Remote *remote;
+	Channel *channel;
+	LOCK *lock;
+	char *path;
+	const char *name;  /* last component of path, for directory events */
+	int waitable;      /* epoll descriptor holding notify and kick[0], the scheduler waitable */
+	int notify;        /* inotify descriptor */
+	int kick[2];       /* pipe that holds a byte while there's more to send */
+	int fd;            /* followed file, -1 while it doesn't exist */
+	int fileWatch;
+	int dirWatch;
+	off_t offset;
+	BOOL renamed;      /* the file may have been replaced, checked once the old one is sent */
+} FollowContext;
+
+/*
+ * Starts following the file currently at ctx->path, either from its end or
+ * from its beginning
+ */
+static int follow_attach(FollowContext *ctx, BOOL fromStart)
+{
+	struct stat st;
+
+	ctx->fd = open(ctx->path, O_RDONLY);
+	if (ctx->fd == -1) {
+		return errno;
+	}
+
+	ctx->fileWatch = inotify_add_watch(ctx->notify, ctx->path, FOLLOW_FILE_EVENTS);
+	if (ctx->fileWatch == -1 || fstat(ctx->fd, &st) == -1) {
+		int result = errno;
+		close(ctx->fd);
+		ctx->fd = -1;
+		return result;
+	}
+
+	ctx->offset = fromStart ? 0 : st.st_size;
+	return ERROR_SUCCESS;
+}
+
+static void follow_detach(FollowContext *ctx)
+{
+	if (ctx->fileWatch != -1) {
+		inotify_rm_watch(ctx->notify, ctx->fileWatch);
+		ctx->fileWatch = -1;
+	}
+	if (ctx->fd != -1) {
+		close(ctx->fd);
+		ctx->fd = -1;
+	}
+}
+
+/*
+ * Sends what has been appended since the last offset sent, up to
+ * FOLLOW_PASS_SIZE bytes. Returns TRUE if the pass stopped short of the end
+ * of the file.
+ */
+static BOOL follow_drain(FollowContext *ctx)
+{
+	char buffer[FOLLOW_READ_SIZE];
+	struct stat st;
+	ssize_t bytes;
+	size_t sent = 0;
+
+	if (ctx->fd == -1 || fstat(ctx->fd, &st) == -1) {
+		return FALSE;
+	}
+
+	if (st.st_size < ctx->offset) {
+		dprintf("[FOLLOW] %s was truncated, restarting", ctx->path);
+		ctx->offset = 0;
+	}
+
+	while ((bytes = pread(ctx->fd, buffer, sizeof(buffer), ctx->offset)) > 0) {
+		if (channel_write(ctx->channel, ctx->remote, NULL, 0, buffer, (DWORD)bytes, NULL) != ERROR_SUCCESS) {
+			return FALSE;
+		}
+		ctx->offset += bytes;
+		sent += bytes;
+
+		if (sent >= FOLLOW_PASS_SIZE) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Checks whether the file being followed is still the one at ctx->path
+ */
+static BOOL follow_is_current(FollowContext *ctx)
+{
+	struct stat current, followed;
+
+	return ctx->fd != -1
+		&& stat(ctx->path, &current) == 0
+		&& fstat(ctx->fd, &followed) == 0
+		&& current.st_dev == followed.st_dev
+		&& current.st_ino == followed.st_ino;
+}
+
+static DWORD follow_notify(Remote *remote, FollowContext *ctx)
+{
+	char events[FOLLOW_EVENT_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	BOOL more;
+	ssize_t length;
+	char *current;
+	char drain[16];
+
+	lock_acquire(ctx->lock);
+
+	while (read(ctx->kick[0], drain, sizeof(drain)) > 0);
+
+	while ((length = read(ctx->notify, events, sizeof(events))) > 0) {
+		for (current = events; current < events + length;
+			current += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *)current;
+
+			if (event->wd == ctx->fileWatch && (event->mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF))) {
+				ctx->renamed = TRUE;
+			} else if (event->wd == ctx->dirWatch && event->len
+				&& strcmp(event->name, ctx->name) == 0) {
+				ctx->renamed = TRUE;
+			}
+		}
+	}
+
+	if (ctx->channel) {
+		more = follow_drain(ctx);
+
+		// the rest of the old file goes out before the new one is followed
+		if (!more && ctx->renamed) {
+			ctx->renamed = FALSE;
+			if (!follow_is_current(ctx) && access(ctx->path, F_OK) == 0) {
+				follow_detach(ctx);
+				if (follow_attach(ctx, TRUE) == ERROR_SUCCESS) {
+					dprintf("[FOLLOW] %s was replaced, following the new file", ctx->path);
+					more = follow_drain(ctx);
+				}
+			}
+		}
+
+		if (more) {
+			write(ctx->kick[1], "", 1);
+		}
+	}
+
+	lock_release(ctx->lock);
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Releases a follow context and everything it holds. Also used to clean up
+ * after a failed open, so any of the descriptors may not have been opened.
+ */
+static void follow_free(FollowContext *ctx)
+{
+	follow_detach(ctx);
+	if (ctx->waitable != -1) {
+		close(ctx->waitable);
+	}
+	if (ctx->notify != -1) {
+		close(ctx->notify);
+	}
+	if (ctx->kick[0] != -1) {
+		close(ctx->kick[0]);
+		close(ctx->kick[1]);
+	}
+	if (ctx->lock) {
+		lock_destroy(ctx->lock);
+	}
+	free(ctx->path);
+	free(ctx);
+}
+
+static DWORD follow_destroy(HANDLE waitable, FollowContext *ctx, LPVOID threadContext)
+{
+	follow_free(ctx);
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD follow_channel_write(Channel *channel, Packet *request,
+		LPVOID context, LPVOID buffer, DWORD bufferSize,
+		LPDWORD bytesWritten)
+{
+	return ERROR_NOT_SUPPORTED;
+}
+
+/*
+ * Stops following. The context is released by follow_destroy once the
+ * scheduler has let go of it.
+ */
+static DWORD follow_channel_close(Channel *channel, Packet *request,
+		LPVOID context)
+{
+	FollowContext *ctx = (FollowContext *)context;
+
+	if (ctx) {
+		lock_acquire(ctx->lock);
+		ctx->channel = NULL;
+		lock_release(ctx->lock);
+
+		channel_set_native_io_context(channel, NULL);
+
+		scheduler_signal_waitable((HANDLE)ctx->waitable, Stop);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Handles the open request for a file channel opened with TLV_TYPE_FS_FOLLOW.
+ * Data appended to the file from now on is written to the channel as it
+ * arrives.
+ *
+ * req: TLV_TYPE_FILE_PATH - The file to follow
+ */
+DWORD request_fs_file_follow_channel_open(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	StreamChannelOps chops;
+	FollowContext *ctx = NULL;
+	Channel *channel = NULL;
+	struct epoll_event event;
+	char *filePath;
+	char *slash;
+	DWORD res = ERROR_SUCCESS;
+
+	filePath = packet_get_tlv_value_string(packet, TLV_TYPE_FILE_PATH);
+
+	if (!response || !(ctx = calloc(1, sizeof(FollowContext)))) {
+		res = ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	ctx->remote = remote;
+	ctx->fd = ctx->notify = ctx->waitable = ctx->fileWatch = ctx->dirWatch = -1;
+	ctx->kick[0] = ctx->kick[1] = -1;
+
+	if (!(ctx->lock = lock_create())) {
+		res = ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	if (filePath == NULL) {
+		res = ERROR_INVALID_PARAMETER;
+		goto out;
+	}
+
+	if (!(ctx->path = fs_expand_path(filePath))) {
+		res = ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	if ((ctx->notify = inotify_init()) == -1
+		|| fcntl(ctx->notify, F_SETFL, O_NONBLOCK) == -1) {
+		res = errno;
+		goto out;
+	}
+
+	if (pipe(ctx->kick) == -1) {
+		ctx->kick[0] = ctx->kick[1] = -1;
+		res = errno;
+		goto out;
+	}
+
+	if (fcntl(ctx->kick[0], F_SETFL, O_NONBLOCK) == -1
+		|| fcntl(ctx->kick[1], F_SETFL, O_NONBLOCK) == -1
+		|| (ctx->waitable = epoll_create(2)) == -1) {
+		res = errno;
+		goto out;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	if (epoll_ctl(ctx->waitable, EPOLL_CTL_ADD, ctx->notify, &event) == -1
+		|| epoll_ctl(ctx->waitable, EPOLL_CTL_ADD, ctx->kick[0], &event) == -1) {
+		res = errno;
+		goto out;
+	}
+
+	/*
+	 * Watch the parent directory for a new file taking the followed name.
+	 */
+	slash = strrchr(ctx->path, '/');
+	if (slash == NULL) {
+		ctx->name = ctx->path;
+		ctx->dirWatch = inotify_add_watch(ctx->notify, ".", FOLLOW_DIR_EVENTS);
+	} else {
+		ctx->name = slash + 1;
+		*slash = '\0';
+		ctx->dirWatch = inotify_add_watch(ctx->notify, slash == ctx->path ? "/" : ctx->path, FOLLOW_DIR_EVENTS);
+		*slash = '/';
+	}
+	if (ctx->dirWatch == -1) {
+		res = errno;
+		goto out;
+	}
+
+	if ((res = follow_attach(ctx, FALSE)) != ERROR_SUCCESS) {
+		goto out;
+	}
+
+	memset(&chops, 0, sizeof(chops));
+	chops.native.context = ctx;
+	chops.native.write   = follow_channel_write;
+	chops.native.close   = follow_channel_close;
+
+	if (!(channel = channel_create_stream(remote, 0, 0, &chops))) {
+		res = ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	ctx->channel = channel;
+	channel_set_waitable(channel, (HANDLE)ctx->waitable);
+
+	if ((res = scheduler_insert_pinned_waitable(remote, (HANDLE)ctx->waitable, ctx, NULL,
+		(WaitableNotifyRoutine)follow_notify, (WaitableDestroyRoutine)follow_destroy,
+		channel_get_id(channel))) != ERROR_SUCCESS) {
+		goto out;
+	}
+
+	packet_add_tlv_uint(response, TLV_TYPE_CHANNEL_ID, channel_get_id(channel));
+
+out:
+	if (res != ERROR_SUCCESS && ctx) {
+		if (channel) {
+			channel_set_native_io_context(channel, NULL);
+			channel_destroy(channel, NULL);
+		}
+		follow_free(ctx);
+	}
+
+	packet_transmit_response(res, remote, response);
+
+	return res;
+}
@@ -5,6 +5,46 @@
 
 LPSTR fs_expand_path(LPCSTR regular);
 
+/*
+ * Request argument schemas
+ */
+#define FS_PATH_FIELDS(F, S) \
+	F(S, STRING, path, TLV_TYPE_FILE_PATH, 0)
+TLV_SCHEMA_DECLARE(FsPathRequest, FS_PATH_FIELDS)
+
+#define FS_MOVE_FIELDS(F, S) \
+	F(S, STRING, oldPath, TLV_TYPE_FILE_NAME, 0) \
+	F(S, STRING, newPath, TLV_TYPE_FILE_PATH, 0)
+TLV_SCHEMA_DECLARE(FsMoveRequest, FS_MOVE_FIELDS)
+
+#define FS_COPY_FIELDS(F, S) \
+	F(S, STRING, source, TLV_TYPE_FILE_NAME, 0) \
+	F(S, STRING, destination, TLV_TYPE_FILE_PATH, 0) \
+	F(S, BOOL, recursive, TLV_TYPE_FS_RECURSIVE, 0)
+TLV_SCHEMA_DECLARE(FsCopyRequest, FS_COPY_FIELDS)
+
+#define FS_GREP_FIELDS(F, S) \
+	F(S, STRING, path, TLV_TYPE_FILE_PATH, 0) \
+	F(S, STRING, pattern, TLV_TYPE_FS_GREP_PATTERN, 0) \
+	F(S, BOOL, regex, TLV_TYPE_FS_GREP_REGEX, 0) \
+	F(S, BOOL, ignoreCase, TLV_TYPE_FS_GREP_IGNORE_CASE, 0) \
+	F(S, BOOL, recursive, TLV_TYPE_FS_RECURSIVE, 0) \
+	F(S, UINT, maxMatches, TLV_TYPE_FS_GREP_MAX_MATCHES, 0)
+TLV_SCHEMA_DECLARE(FsGrepRequest, FS_GREP_FIELDS)
+
+/*
+ * Progress reporting for long running tree operations. Progress is sent as
+ * unsolicited stdapi_fs_progress requests tagged with the originating request
+ * identifier.
+ */
+typedef struct
+{
+	Remote *remote;
+	PCHAR requestId;
+} FsProgressContext;
+
+void fs_progress_notify(void *arg, uint32_t entries, uint64_t bytes);
+
 /*
  * File system interaction
  */
@@ -21,10 +61,17 @@ DWORD request_fs_search( Remote * remote, Packet * packet );
 DWORD request_fs_md5(Remote *remote, Packet *packet);
 DWORD request_fs_sha1(Remote *remote, Packet *packet);
 DWORD request_fs_file_move(Remote *remote, Packet *packet);
+DWORD request_fs_copy(Remote *remote, Packet *packet);
+#ifndef _WIN32
+DWORD request_fs_grep(Remote *remote, Packet *packet);
+#endif
 
 /*
  * Channel allocation
  */
 DWORD request_fs_file_channel_open(Remote *remote, Packet *packet);
+#ifndef _WIN32
+DWORD request_fs_file_follow_channel_open(Remote *remote, Packet *packet);
+#endif
 
 #endif
@@ -38,12 +38,30 @@ struct meterp_stat {
 
 typedef void (*fs_ls_cb_t)(void *arg, char *name, char *short_name, char *path);
 
+/*
+ * Called periodically by long running tree operations with the number of
+ * entries processed and bytes copied so far
+ */
+typedef void (*fs_progress_cb_t)(void *arg, uint32_t entries, uint64_t bytes);
+
 int fs_chdir(const char *directory);
 
+/*
+ * Copies a file, or a directory tree when recursive is set, to destination.
+ * The copy is made entirely on the target; cb may be NULL.
+ */
+int fs_copy(const char *source, const char *destination, int recursive,
+		fs_progress_cb_t cb, void *arg);
+
 int fs_delete_dir(const char *directory);
 
 int fs_delete_file(const char *path);
 
+/*
+ * Removes a directory and everything below it; cb may be NULL.
+ */
+int fs_delete_tree(const char *directory, fs_progress_cb_t cb, void *arg);
+
 /*
  * Returns an expanded file path that must be freed
  */
@@ -51,6 +69,19 @@ char * fs_expand_path(const char *regular);
 
 int fs_fopen(const char *path, const char *mode, FILE **f);
 
+/*
+ * Read, write and position a file opened by fs_fopen using 64-bit offsets.
+ * On POSIX these work on the file's descriptor, as stdio only has 32-bit
+ * offsets there, so they mustn't be mixed with stdio calls on the same file.
+ */
+int fs_fread(FILE *f, void *buffer, size_t length, size_t *bytesRead);
+
+int fs_fwrite(FILE *f, const void *buffer, size_t length, size_t *bytesWritten);
+
+int fs_fseek(FILE *f, int64_t offset, int whence);
+
+int fs_ftell(FILE *f, int64_t *offset);
+
 int fs_ls(const char *directory, fs_ls_cb_t cb, void *arg);
 
 int fs_getwd(char **directory);
@@ -61,8 +92,9 @@ int fs_move(const char *oldpath, const char *newpath);
 
 /*
  * Fills the platform-independent meterp_stat buf with data from the
- * platform-dependent stat()
+ * platform-dependent stat(). Sizes too big for st_size are clipped to
+ * 0xFFFFFFFF there; the full size goes in size unless it is NULL.
  */
-int fs_stat(char *filename, struct meterp_stat *buf);
+int fs_stat(char *filename, struct meterp_stat *buf, uint64_t *size);
 
 #endif
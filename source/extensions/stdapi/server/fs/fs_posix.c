@@ -1,9 +1,17 @@
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "precomp.h"
@@ -78,20 +86,71 @@ int fs_mkdir(const char *directory)
 	return ERROR_SUCCESS;
 }
 
+/*
+ * Map an fopen mode to the flags open takes.
+ */
+static int fs_mode_flags(const char *mode, int *flags)
+{
+	int access;
+
+	switch (*mode) {
+	case 'r':
+		access = O_RDONLY;
+		*flags = 0;
+		break;
+	case 'w':
+		access = O_WRONLY;
+		*flags = O_CREAT | O_TRUNC;
+		break;
+	case 'a':
+		access = O_WRONLY;
+		*flags = O_CREAT | O_APPEND;
+		break;
+	default:
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	while (*++mode) {
+		if (*mode == '+') {
+			access = O_RDWR;
+		} else if (*mode != 'b') {
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	*flags |= access;
+	return ERROR_SUCCESS;
+}
+
 int fs_fopen(const char *path, const char *mode, FILE **f)
 {
-	int rc = 0;
+	int flags, fd, rc;
 
-	if (path == NULL || f == NULL) {
+	if (path == NULL || mode == NULL || f == NULL) {
 		return ERROR_INVALID_PARAMETER;
 	}
 
-	*f = fopen(path, mode);
+	if ((rc = fs_mode_flags(mode, &flags)) != ERROR_SUCCESS) {
+		return rc;
+	}
+
+	/*
+	 * bionic's open only adds O_LARGEFILE off i386, and fopen doesn't ask for
+	 * it either, so without it files past 2GB can't be opened or written there.
+	 */
+	fd = open(path, flags | O_LARGEFILE, 0666);
+	if (fd == -1) {
+		return errno;
+	}
+
+	*f = fdopen(fd, mode);
 	if (*f == NULL) {
 		rc = errno;
+		close(fd);
+		return rc;
 	}
 
-	return rc;
+	return ERROR_SUCCESS;
 }
 
 int fs_move(const char *oldpath, const char *newpath)
@@ -102,7 +161,73 @@ int fs_move(const char *oldpath, const char *newpath)
 	return ERROR_SUCCESS;
 }
 
-int fs_stat(char *filename, struct meterp_stat *buf)
+int fs_fread(FILE *f, void *buffer, size_t length, size_t *bytesRead)
+{
+	size_t total = 0;
+	ssize_t bytes;
+	int rc = ERROR_SUCCESS;
+
+	while (total < length) {
+		bytes = read(fileno(f), (char *)buffer + total, length - total);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes == -1) {
+			rc = errno;
+			break;
+		}
+		if (bytes == 0) {
+			break;
+		}
+		total += bytes;
+	}
+
+	*bytesRead = total;
+	return rc;
+}
+
+int fs_fwrite(FILE *f, const void *buffer, size_t length, size_t *bytesWritten)
+{
+	size_t total = 0;
+	ssize_t bytes;
+	int rc = ERROR_SUCCESS;
+
+	while (total < length) {
+		bytes = write(fileno(f), (const char *)buffer + total, length - total);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes == -1) {
+			rc = errno;
+			break;
+		}
+		total += bytes;
+	}
+
+	*bytesWritten = total;
+	return rc;
+}
+
+int fs_fseek(FILE *f, int64_t offset, int whence)
+{
+	if (lseek64(fileno(f), offset, whence) == -1) {
+		return errno;
+	}
+	return ERROR_SUCCESS;
+}
+
+int fs_ftell(FILE *f, int64_t *offset)
+{
+	loff_t pos = lseek64(fileno(f), 0, SEEK_CUR);
+
+	if (pos == -1) {
+		return errno;
+	}
+	*offset = pos;
+	return ERROR_SUCCESS;
+}
+
+int fs_stat(char *filename, struct meterp_stat *buf, uint64_t *size)
 {
 	struct stat sbuf;
 
@@ -117,10 +242,512 @@ int fs_stat(char *filename, struct meterp_stat *buf)
 	buf->st_uid   = sbuf.st_uid;
 	buf->st_gid   = sbuf.st_gid;
 	buf->st_rdev  = sbuf.st_rdev;
-	buf->st_size  = sbuf.st_size;
+	buf->st_size  = sbuf.st_size > UINT32_MAX ? UINT32_MAX : sbuf.st_size;
 	buf->st_atime = sbuf.st_atime;
 	buf->st_mtime = sbuf.st_mtime;
 	buf->st_ctime = sbuf.st_ctime;
 
+	if (size) {
+		*size = sbuf.st_size;
+	}
+
 	return ERROR_SUCCESS;
 }
+
+/*
+ * Tree operations (copy / recursive delete)
+ *
+ * Trees are walked with directory file descriptors (openat, fstatat, unlinkat)
+ * so that no path is ever rebuilt, and the entries of the top-level directory
+ * are shared out between a small pool of worker threads. File data is cloned
+ * when the file system supports it and otherwise copied in the kernel.
+ */
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#ifndef __NR_copy_file_range
+#if defined(__i386__)
+#define __NR_copy_file_range 377
+#elif defined(__x86_64__)
+#define __NR_copy_file_range 326
+#elif defined(__arm__)
+#define __NR_copy_file_range 391
+#endif
+#endif
+
+#define FS_TREE_WORKERS       4
+#define FS_PROGRESS_INTERVAL  500
+#define FS_COPY_CHUNK         (1 << 20)
+
+struct fs_tree;
+typedef int (*fs_tree_op_t)(struct fs_tree *tree, int src_dir, int dst_dir, const char *name);
+
+struct fs_tree {
+	fs_tree_op_t op;
+	int src_dir;
+	int dst_dir;
+	dev_t dst_dev;
+	ino_t dst_ino;
+	char **names;
+	size_t count;
+	size_t next;
+	int running;
+	int result;
+	uint32_t entries;
+	uint64_t bytes;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+static void fs_tree_account(struct fs_tree *tree, uint64_t bytes)
+{
+	pthread_mutex_lock(&tree->lock);
+	tree->entries++;
+	tree->bytes += bytes;
+	pthread_mutex_unlock(&tree->lock);
+}
+
+static int fs_tree_failed(struct fs_tree *tree)
+{
+	int result;
+	pthread_mutex_lock(&tree->lock);
+	result = tree->result;
+	pthread_mutex_unlock(&tree->lock);
+	return result != ERROR_SUCCESS;
+}
+
+/*
+ * Copies everything from the current offset of in to the current offset of
+ * out, preferring a reflink, then copy_file_range, then sendfile and finally
+ * a plain read/write loop. Each step picks up where the previous one stopped.
+ */
+static int fs_copy_data(int in, int out, off_t size, uint64_t *copied)
+{
+	char buf[8192];
+	ssize_t n;
+	off_t done = 0;
+
+	*copied = 0;
+
+	if (size > 0 && ioctl(out, FICLONE, in) == 0) {
+		*copied = size;
+		return ERROR_SUCCESS;
+	}
+
+#ifdef __NR_copy_file_range
+	while (done < size) {
+		n = syscall(__NR_copy_file_range, in, NULL, out, NULL, FS_COPY_CHUNK, 0);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+#endif
+
+	while (done < size) {
+		n = sendfile(out, in, NULL, FS_COPY_CHUNK);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		for (ssize_t off = 0; off < n; ) {
+			ssize_t w = write(out, buf + off, n - off);
+			if (w == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return errno;
+			}
+			off += w;
+		}
+		done += n;
+	}
+
+	*copied = done;
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Calls op on every entry of the open directory dir_fd, which is consumed.
+ */
+static int fs_tree_each(struct fs_tree *tree, int dir_fd, int dst_dir)
+{
+	struct dirent *data;
+	int result = ERROR_SUCCESS;
+	DIR *dir = fdopendir(dir_fd);
+
+	if (dir == NULL) {
+		result = errno;
+		close(dir_fd);
+		return result;
+	}
+
+	while (result == ERROR_SUCCESS && (data = readdir(dir)) != NULL) {
+		if (strcmp(data->d_name, ".") == 0 || strcmp(data->d_name, "..") == 0) {
+			continue;
+		}
+		result = tree->op(tree, dirfd(dir), dst_dir, data->d_name);
+	}
+
+	closedir(dir);
+	return result;
+}
+
+/*
+ * bionic has no readlinkat/symlinkat wrappers, so symbolic links are handled
+ * through the /proc view of the directory descriptor instead.
+ */
+static int fs_copy_link(int src_dir, int dst_dir, const char *name)
+{
+	char src[64 + NAME_MAX];
+	char dst[64 + NAME_MAX];
+	char target[FS_MAX_PATH];
+	ssize_t len;
+
+	snprintf(src, sizeof(src), "/proc/self/fd/%d/%s", src_dir, name);
+	snprintf(dst, sizeof(dst), "/proc/self/fd/%d/%s", dst_dir, name);
+
+	len = readlink(src, target, sizeof(target) - 1);
+	if (len == -1) {
+		return errno;
+	}
+	target[len] = '\0';
+
+	if (symlink(target, dst) == -1) {
+		return errno;
+	}
+	return ERROR_SUCCESS;
+}
+
+static int fs_copy_at(struct fs_tree *tree, int src_dir, int dst_dir, const char *name)
+{
+	struct stat st;
+	uint64_t copied = 0;
+	int result = ERROR_SUCCESS;
+	int in, out;
+
+	if (fs_tree_failed(tree)) {
+		return ERROR_SUCCESS;
+	}
+
+	if (fstatat(src_dir, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+		return errno;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		/* Don't descend into the copy when it is created inside the source. */
+		if (st.st_dev == tree->dst_dev && st.st_ino == tree->dst_ino) {
+			return ERROR_SUCCESS;
+		}
+		if (mkdirat(dst_dir, name, 0700) == -1 && errno != EEXIST) {
+			return errno;
+		}
+		in = openat(src_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (in == -1) {
+			return errno;
+		}
+		out = openat(dst_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (out == -1) {
+			result = errno;
+			close(in);
+			return result;
+		}
+		result = fs_tree_each(tree, in, out);
+		fchmod(out, st.st_mode & 07777);
+		close(out);
+	} else if (S_ISREG(st.st_mode)) {
+		in = openat(src_dir, name, O_RDONLY | O_NOFOLLOW);
+		if (in == -1) {
+			return errno;
+		}
+		out = openat(dst_dir, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, st.st_mode & 07777);
+		if (out == -1) {
+			result = errno;
+			close(in);
+			return result;
+		}
+		result = fs_copy_data(in, out, st.st_size, &copied);
+		close(in);
+		close(out);
+	} else if (S_ISLNK(st.st_mode)) {
+		result = fs_copy_link(src_dir, dst_dir, name);
+	} else {
+		/* Devices, fifos and sockets are not copied. */
+		return ERROR_SUCCESS;
+	}
+
+	if (result == ERROR_SUCCESS) {
+		fs_tree_account(tree, copied);
+	}
+	return result;
+}
+
+static int fs_delete_at(struct fs_tree *tree, int src_dir, int dst_dir, const char *name)
+{
+	int result;
+	int fd;
+
+	if (fs_tree_failed(tree)) {
+		return ERROR_SUCCESS;
+	}
+
+	/*
+	 * Most entries are files, so try that first and only descend when the
+	 * kernel tells us that this is a directory.
+	 */
+	if (unlinkat(src_dir, name, 0) == 0) {
+		fs_tree_account(tree, 0);
+		return ERROR_SUCCESS;
+	}
+	if (errno != EISDIR && errno != EPERM) {
+		return errno;
+	}
+
+	fd = openat(src_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1) {
+		return errno;
+	}
+	result = fs_tree_each(tree, fd, -1);
+	if (result == ERROR_SUCCESS) {
+		if (unlinkat(src_dir, name, AT_REMOVEDIR) == -1) {
+			return errno;
+		}
+		fs_tree_account(tree, 0);
+	}
+	return result;
+}
+
+static void *fs_tree_worker(void *arg)
+{
+	struct fs_tree *tree = arg;
+	size_t index;
+	int result;
+
+	for (;;) {
+		pthread_mutex_lock(&tree->lock);
+		index = tree->next++;
+		if (index >= tree->count || tree->result != ERROR_SUCCESS) {
+			break;
+		}
+		pthread_mutex_unlock(&tree->lock);
+
+		result = tree->op(tree, tree->src_dir, tree->dst_dir, tree->names[index]);
+
+		if (result != ERROR_SUCCESS) {
+			pthread_mutex_lock(&tree->lock);
+			if (tree->result == ERROR_SUCCESS) {
+				tree->result = result;
+			}
+			pthread_mutex_unlock(&tree->lock);
+		}
+	}
+
+	tree->running--;
+	pthread_cond_signal(&tree->done);
+	pthread_mutex_unlock(&tree->lock);
+	return NULL;
+}
+
+/*
+ * Runs tree->op over the entries of tree->src_dir with up to FS_TREE_WORKERS
+ * threads, reporting progress from the calling thread as they work.
+ */
+static int fs_tree_run(struct fs_tree *tree, fs_progress_cb_t cb, void *arg)
+{
+	pthread_t workers[FS_TREE_WORKERS];
+	struct dirent *data;
+	struct timeval now;
+	struct timespec deadline;
+	size_t capacity = 0;
+	int started = 0;
+	int result = ERROR_SUCCESS;
+	int fd;
+	DIR *dir;
+
+	pthread_mutex_init(&tree->lock, NULL);
+	pthread_cond_init(&tree->done, NULL);
+
+	/* Snapshot the top level so that deletes don't disturb the listing. */
+	fd = dup(tree->src_dir);
+	if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+		result = errno;
+		if (fd != -1) {
+			close(fd);
+		}
+		goto out;
+	}
+	while ((data = readdir(dir)) != NULL) {
+		if (strcmp(data->d_name, ".") == 0 || strcmp(data->d_name, "..") == 0) {
+			continue;
+		}
+		if (tree->count == capacity) {
+			char **names;
+			capacity = capacity ? capacity * 2 : 64;
+			names = realloc(tree->names, capacity * sizeof(char *));
+			if (names == NULL) {
+				result = ERROR_NOT_ENOUGH_MEMORY;
+				break;
+			}
+			tree->names = names;
+		}
+		if ((tree->names[tree->count] = strdup(data->d_name)) == NULL) {
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+		tree->count++;
+	}
+	closedir(dir);
+	if (result != ERROR_SUCCESS) {
+		goto out;
+	}
+
+	pthread_mutex_lock(&tree->lock);
+	for (; started < FS_TREE_WORKERS && (size_t)started < tree->count; started++) {
+		if (pthread_create(&workers[started], NULL, fs_tree_worker, tree) != 0) {
+			break;
+		}
+		tree->running++;
+	}
+	if (started == 0 && tree->count > 0) {
+		tree->result = ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	while (tree->running > 0) {
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + FS_PROGRESS_INTERVAL / 1000;
+		deadline.tv_nsec = now.tv_usec * 1000 + (FS_PROGRESS_INTERVAL % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (pthread_cond_timedwait(&tree->done, &tree->lock, &deadline) == ETIMEDOUT && cb) {
+			uint32_t entries = tree->entries;
+			uint64_t bytes = tree->bytes;
+			pthread_mutex_unlock(&tree->lock);
+			cb(arg, entries, bytes);
+			pthread_mutex_lock(&tree->lock);
+		}
+	}
+	result = tree->result;
+	pthread_mutex_unlock(&tree->lock);
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+out:
+	for (size_t i = 0; i < tree->count; i++) {
+		free(tree->names[i]);
+	}
+	free(tree->names);
+	pthread_cond_destroy(&tree->done);
+	pthread_mutex_destroy(&tree->lock);
+	return result;
+}
+
+int fs_copy(const char *source, const char *destination, int recursive,
+		fs_progress_cb_t cb, void *arg)
+{
+	struct fs_tree tree;
+	struct stat st, dst_st;
+	uint64_t copied;
+	int result = ERROR_SUCCESS;
+	int in, out;
+
+	if (stat(source, &st) == -1) {
+		return errno;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		in = open(source, O_RDONLY);
+		if (in == -1) {
+			return errno;
+		}
+		out = open(destination, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+		if (out == -1) {
+			result = errno;
+			close(in);
+			return result;
+		}
+		result = fs_copy_data(in, out, st.st_size, &copied);
+		close(in);
+		close(out);
+		if (result == ERROR_SUCCESS && cb) {
+			cb(arg, 1, copied);
+		}
+		return result;
+	}
+
+	if (!recursive) {
+		return EISDIR;
+	}
+
+	if (mkdir(destination, 0700) == -1 && errno != EEXIST) {
+		return errno;
+	}
+
+	memset(&tree, 0, sizeof(tree));
+	tree.op = fs_copy_at;
+	tree.src_dir = open(source, O_RDONLY | O_DIRECTORY);
+	tree.dst_dir = open(destination, O_RDONLY | O_DIRECTORY);
+
+	if (tree.src_dir == -1 || tree.dst_dir == -1) {
+		result = errno;
+	} else if (fstat(tree.dst_dir, &dst_st) == -1) {
+		result = errno;
+	} else {
+		tree.dst_dev = dst_st.st_dev;
+		tree.dst_ino = dst_st.st_ino;
+		result = fs_tree_run(&tree, cb, arg);
+		fchmod(tree.dst_dir, st.st_mode & 07777);
+		if (result == ERROR_SUCCESS && cb) {
+			cb(arg, tree.entries + 1, tree.bytes);
+		}
+	}
+
+	if (tree.src_dir != -1) {
+		close(tree.src_dir);
+	}
+	if (tree.dst_dir != -1) {
+		close(tree.dst_dir);
+	}
+	return result;
+}
+
+int fs_delete_tree(const char *directory, fs_progress_cb_t cb, void *arg)
+{
+	struct fs_tree tree;
+	int result;
+
+	memset(&tree, 0, sizeof(tree));
+	tree.op = fs_delete_at;
+	tree.dst_dir = -1;
+	tree.src_dir = open(directory, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (tree.src_dir == -1) {
+		return errno;
+	}
+
+	result = fs_tree_run(&tree, cb, arg);
+	close(tree.src_dir);
+
+	if (result == ERROR_SUCCESS) {
+		if (rmdir(directory) == -1) {
+			return errno;
+		}
+		if (cb) {
+			cb(arg, tree.entries + 1, 0);
+		}
+	}
+	return result;
+}
@@ -266,21 +266,61 @@ out:
 	return rc;
 }
 
-int fs_stat(char *filename, struct meterp_stat *buf)
+int fs_fread(FILE *f, void *buffer, size_t length, size_t *bytesRead)
 {
-	struct _stat64i32 sbuf;
+	*bytesRead = fread(buffer, 1, length, f);
+	if (*bytesRead < length && ferror(f)) {
+		return GetLastError();
+	}
+	return ERROR_SUCCESS;
+}
+
+int fs_fwrite(FILE *f, const void *buffer, size_t length, size_t *bytesWritten)
+{
+	*bytesWritten = fwrite(buffer, 1, length, f);
+	if (*bytesWritten < length) {
+		return GetLastError();
+	}
+	return ERROR_SUCCESS;
+}
+
+int fs_fseek(FILE *f, int64_t offset, int whence)
+{
+	if (_fseeki64(f, offset, whence) != 0) {
+		// A bad offset or whence is only reported through errno
+		int rc = GetLastError();
+		return rc ? rc : ERROR_INVALID_PARAMETER;
+	}
+	return ERROR_SUCCESS;
+}
+
+int fs_ftell(FILE *f, int64_t *offset)
+{
+	__int64 pos = _ftelli64(f);
+
+	if (pos < 0) {
+		return GetLastError();
+	}
+	*offset = pos;
+	return ERROR_SUCCESS;
+}
+
+int fs_stat(char *filename, struct meterp_stat *buf, uint64_t *size)
+{
+	struct _stat64 sbuf;
+	int rc;
 
 	wchar_t *filename_w = utf8_to_wchar(filename);
 	if (filename_w == NULL) {
 		return -1;
 	}
 
-	if (_wstat(filename_w, &sbuf) == -1) {
+	rc = _wstat64(filename_w, &sbuf);
+	free(filename_w);
+	if (rc == -1) {
 		return GetLastError();
 	}
 
-	free(filename_w);
-
 	buf->st_dev   = sbuf.st_dev;
 	buf->st_ino   = sbuf.st_ino;
 	buf->st_mode  = sbuf.st_mode;
@@ -288,10 +328,229 @@ int fs_stat(char *filename, struct meterp_stat *buf)
 	buf->st_uid   = sbuf.st_uid;
 	buf->st_gid   = sbuf.st_gid;
 	buf->st_rdev  = sbuf.st_rdev;
-	buf->st_size  = sbuf.st_size;
+	buf->st_size  = sbuf.st_size > UINT32_MAX ? UINT32_MAX : (uint32_t)sbuf.st_size;
 	buf->st_atime = sbuf.st_atime;
 	buf->st_mtime = sbuf.st_mtime;
 	buf->st_ctime = sbuf.st_ctime;
 
+	if (size) {
+		*size = sbuf.st_size;
+	}
+
 	return ERROR_SUCCESS;
 }
+
+/*
+ * Tree operations (copy / recursive delete)
+ */
+
+#define FS_PROGRESS_INTERVAL 500
+
+struct fs_tree {
+	fs_progress_cb_t cb;
+	void *arg;
+	uint32_t entries;
+	uint64_t bytes;
+	DWORD last;
+};
+
+static void fs_tree_account(struct fs_tree *tree, uint64_t bytes)
+{
+	tree->entries++;
+	tree->bytes += bytes;
+
+	if (tree->cb && GetTickCount() - tree->last >= FS_PROGRESS_INTERVAL) {
+		tree->last = GetTickCount();
+		tree->cb(tree->arg, tree->entries, tree->bytes);
+	}
+}
+
+static int fs_copy_w(struct fs_tree *tree, const wchar_t *src, const wchar_t *dst)
+{
+	WIN32_FIND_DATAW data;
+	wchar_t *pattern = NULL, *src_child = NULL, *dst_child = NULL;
+	size_t src_len, dst_len;
+	HANDLE ctx;
+	int rc = ERROR_SUCCESS;
+	DWORD attributes = GetFileAttributesW(src);
+
+	if (attributes == INVALID_FILE_ATTRIBUTES) {
+		return GetLastError();
+	}
+
+	if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		if (CopyFileW(src, dst, FALSE) == 0) {
+			return GetLastError();
+		}
+		if (GetFileAttributesExW(src, GetFileExInfoStandard, &info)) {
+			fs_tree_account(tree, ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow);
+		} else {
+			fs_tree_account(tree, 0);
+		}
+		return ERROR_SUCCESS;
+	}
+
+	if (CreateDirectoryW(dst, NULL) == 0 && GetLastError() != ERROR_ALREADY_EXISTS) {
+		return GetLastError();
+	}
+
+	src_len = wcslen(src);
+	dst_len = wcslen(dst);
+	pattern = malloc((src_len + 3) * sizeof(wchar_t));
+	src_child = malloc(FS_MAX_PATH * sizeof(wchar_t));
+	dst_child = malloc(FS_MAX_PATH * sizeof(wchar_t));
+	if (pattern == NULL || src_child == NULL || dst_child == NULL) {
+		rc = ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	_snwprintf(pattern, src_len + 3, L"%s\\*", src);
+
+	ctx = FindFirstFileW(pattern, &data);
+	if (ctx == INVALID_HANDLE_VALUE) {
+		rc = GetLastError();
+		goto out;
+	}
+
+	do {
+		if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0) {
+			continue;
+		}
+		_snwprintf(src_child, FS_MAX_PATH, L"%s\\%s", src, data.cFileName);
+		_snwprintf(dst_child, FS_MAX_PATH, L"%s\\%s", dst, data.cFileName);
+		rc = fs_copy_w(tree, src_child, dst_child);
+	} while (rc == ERROR_SUCCESS && FindNextFileW(ctx, &data));
+
+	FindClose(ctx);
+
+	if (rc == ERROR_SUCCESS) {
+		fs_tree_account(tree, 0);
+	}
+
+out:
+	free(pattern);
+	free(src_child);
+	free(dst_child);
+	return rc;
+}
+
+static int fs_delete_w(struct fs_tree *tree, const wchar_t *path)
+{
+	WIN32_FIND_DATAW data;
+	wchar_t *pattern = NULL, *child = NULL;
+	size_t len = wcslen(path);
+	HANDLE ctx;
+	int rc = ERROR_SUCCESS;
+
+	pattern = malloc((len + 3) * sizeof(wchar_t));
+	child = malloc(FS_MAX_PATH * sizeof(wchar_t));
+	if (pattern == NULL || child == NULL) {
+		rc = ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	_snwprintf(pattern, len + 3, L"%s\\*", path);
+
+	ctx = FindFirstFileW(pattern, &data);
+	if (ctx == INVALID_HANDLE_VALUE) {
+		rc = GetLastError();
+		goto out;
+	}
+
+	do {
+		if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0) {
+			continue;
+		}
+		_snwprintf(child, FS_MAX_PATH, L"%s\\%s", path, data.cFileName);
+
+		/* Junctions and directory symlinks are removed, not followed. */
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			&& !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+			rc = fs_delete_w(tree, child);
+		} else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			rc = RemoveDirectoryW(child) ? ERROR_SUCCESS : GetLastError();
+			if (rc == ERROR_SUCCESS) {
+				fs_tree_account(tree, 0);
+			}
+		} else {
+			if (data.dwFileAttributes & FILE_ATTRIBUTE_READONLY) {
+				SetFileAttributesW(child, data.dwFileAttributes & ~FILE_ATTRIBUTE_READONLY);
+			}
+			rc = DeleteFileW(child) ? ERROR_SUCCESS : GetLastError();
+			if (rc == ERROR_SUCCESS) {
+				fs_tree_account(tree, 0);
+			}
+		}
+	} while (rc == ERROR_SUCCESS && FindNextFileW(ctx, &data));
+
+	FindClose(ctx);
+
+	if (rc == ERROR_SUCCESS) {
+		if (RemoveDirectoryW(path) == 0) {
+			rc = GetLastError();
+		} else {
+			fs_tree_account(tree, 0);
+		}
+	}
+
+out:
+	free(pattern);
+	free(child);
+	return rc;
+}
+
+int fs_copy(const char *source, const char *destination, int recursive,
+		fs_progress_cb_t cb, void *arg)
+{
+	struct fs_tree tree = { cb, arg, 0, 0, GetTickCount() };
+	int rc = ERROR_SUCCESS;
+	DWORD attributes;
+	wchar_t *src_w = utf8_to_wchar(source);
+	wchar_t *dst_w = utf8_to_wchar(destination);
+
+	if ((src_w == NULL) || (dst_w == NULL)) {
+		rc = GetLastError();
+		goto out;
+	}
+
+	attributes = GetFileAttributesW(src_w);
+	if (attributes == INVALID_FILE_ATTRIBUTES) {
+		rc = GetLastError();
+		goto out;
+	}
+
+	if (!recursive && (attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		rc = ERROR_DIRECTORY;
+		goto out;
+	}
+
+	rc = fs_copy_w(&tree, src_w, dst_w);
+	if (rc == ERROR_SUCCESS && cb) {
+		cb(arg, tree.entries, tree.bytes);
+	}
+
+out:
+	free(src_w);
+	free(dst_w);
+	return rc;
+}
+
+int fs_delete_tree(const char *directory, fs_progress_cb_t cb, void *arg)
+{
+	struct fs_tree tree = { cb, arg, 0, 0, GetTickCount() };
+	int rc = ERROR_SUCCESS;
+	wchar_t *dir_w = utf8_to_wchar(directory);
+
+	if (dir_w == NULL) {
+		rc = GetLastError();
+		goto out;
+	}
+
+	rc = fs_delete_w(&tree, dir_w);
+	if (rc == ERROR_SUCCESS && cb) {
+		cb(arg, tree.entries, 0);
+	}
+
+out:
+	free(dir_w);
+	return rc;
+}
@@ -0,0 +1,492 @@
+/*
+ * Server side content search (stdapi_fs_grep)
+ *
+ * The request's path is walked with fs_ls and every regular file found is
+ * handed to a small pool of worker threads through a bounded queue. Workers
+ * read files in large preads and scan whole buffers at a time: literal
+ * patterns are located with memchr (vectorized in libc) followed by memcmp,
+ * and regular expressions are run over the buffer with REG_STARTEND and
+ * REG_NEWLINE so that no per-line copies are needed. Only the lines that
+ * match are ever looked at individually.
+ *
+ * Matches are sent back as they are found in unsolicited
+ * stdapi_fs_grep_results requests, each carrying up to GREP_BATCH_MATCHES
+ * TLV_TYPE_FS_GREP_MATCH groups tagged with the originating request id. The
+ * response is sent once every file has been scanned.
+ */
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <regex.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "precomp.h"
+#include "fs_local.h"
+
+#define GREP_MAX_WORKERS    4
+#define GREP_QUEUE_DEPTH    256
+#define GREP_BUFFER_SIZE    (1 << 20)
+#define GREP_BATCH_MATCHES  128
+#define GREP_MAX_LINE       1024
+#define GREP_MAX_MATCHES    100000
+
+TLV_SCHEMA_DEFINE(FsGrepRequest, FS_GREP_FIELDS)
+
+typedef struct
+{
+	Remote *remote;
+	PCHAR requestId;
+
+	/* pattern */
+	const char *pattern;
+	size_t patternLength;
+	BOOL ignoreCase;
+	BOOL useRegex;
+	regex_t regex;
+
+	/* work queue, guarded by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+	char *queue[GREP_QUEUE_DEPTH];
+	size_t head;
+	size_t queued;
+	BOOL walked;
+	BOOL stopped;
+
+	/* results, guarded by lock */
+	Packet *batch;
+	DWORD batchMatches;
+	DWORD matches;
+	DWORD maxMatches;
+	uint32_t files;
+	uint64_t bytes;
+
+	BOOL recursive;
+} GrepContext;
+
+/*
+ * Sends the pending batch of matches, if any. Called without the lock held.
+ */
+static void grep_send(GrepContext *grep, Packet *batch)
+{
+	if (batch) {
+		if (grep->requestId) {
+			packet_add_tlv_string(batch, TLV_TYPE_FS_PROGRESS_REQUEST, grep->requestId);
+		}
+		PACKET_TRANSMIT(grep->remote, batch, NULL);
+	}
+}
+
+static void grep_emit(GrepContext *grep, const char *path, uint64_t offset,
+		uint32_t lineNumber, const char *line, size_t length)
+{
+	char text[GREP_MAX_LINE + 1];
+	Packet *group;
+	Packet *full = NULL;
+
+	if (length > GREP_MAX_LINE) {
+		length = GREP_MAX_LINE;
+	}
+	memcpy(text, line, length);
+	text[length] = '\0';
+
+	if ((group = packet_create_group()) == NULL) {
+		return;
+	}
+	packet_add_tlv_string(group, TLV_TYPE_FILE_PATH, path);
+	packet_add_tlv_qword(group, TLV_TYPE_FS_GREP_OFFSET, offset);
+	packet_add_tlv_uint(group, TLV_TYPE_FS_GREP_LINE_NUMBER, lineNumber);
+	packet_add_tlv_string(group, TLV_TYPE_FS_GREP_LINE, text);
+
+	pthread_mutex_lock(&grep->lock);
+	if (grep->stopped) {
+		pthread_mutex_unlock(&grep->lock);
+		packet_destroy(group);
+		return;
+	}
+	if (grep->batch == NULL) {
+		grep->batch = packet_create(PACKET_TLV_TYPE_REQUEST, "stdapi_fs_grep_results");
+	}
+	if (grep->batch) {
+		packet_add_group(grep->batch, TLV_TYPE_FS_GREP_MATCH, group);
+		grep->batchMatches++;
+	} else {
+		packet_destroy(group);
+	}
+	if (++grep->matches >= grep->maxMatches) {
+		grep->stopped = TRUE;
+		pthread_cond_broadcast(&grep->space);
+	}
+	if (grep->batchMatches >= GREP_BATCH_MATCHES) {
+		full = grep->batch;
+		grep->batch = NULL;
+		grep->batchMatches = 0;
+	}
+	pthread_mutex_unlock(&grep->lock);
+
+	grep_send(grep, full);
+}
+
+/*
+ * Finds the next occurrence of a case-insensitive literal by searching for
+ * both cases of its first character with memchr
+ */
+static const char *grep_find_nocase(GrepContext *grep, const char *p, const char *end)
+{
+	int lower = tolower((unsigned char)grep->pattern[0]);
+	int upper = toupper((unsigned char)grep->pattern[0]);
+	const char *last = end - grep->patternLength;
+	const char *a, *b, *candidate;
+
+	if (p > last) {
+		return NULL;
+	}
+
+	a = memchr(p, lower, last - p + 1);
+	b = lower == upper ? NULL : memchr(p, upper, last - p + 1);
+
+	while (a || b) {
+		candidate = (a && (!b || a < b)) ? a : b;
+		if (strncasecmp(candidate, grep->pattern, grep->patternLength) == 0) {
+			return candidate;
+		}
+		if (candidate == a) {
+			a = candidate < last ? memchr(candidate + 1, lower, last - candidate) : NULL;
+		} else {
+			b = candidate < last ? memchr(candidate + 1, upper, last - candidate) : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Finds the first match at or after p, which is always the start of a line
+ */
+static const char *grep_find(GrepContext *grep, const char *p, const char *end)
+{
+	const char *last = end - grep->patternLength;
+	const char *candidate;
+	regmatch_t match;
+
+	if (grep->useRegex) {
+		match.rm_so = 0;
+		match.rm_eo = end - p;
+		if (regexec(&grep->regex, p, 1, &match, REG_STARTEND) != 0) {
+			return NULL;
+		}
+		return p + match.rm_so;
+	}
+
+	if (grep->ignoreCase) {
+		return grep_find_nocase(grep, p, end);
+	}
+
+	while (p <= last && (candidate = memchr(p, grep->pattern[0], last - p + 1)) != NULL) {
+		if (memcmp(candidate, grep->pattern, grep->patternLength) == 0) {
+			return candidate;
+		}
+		p = candidate + 1;
+	}
+	return NULL;
+}
+
+static uint32_t grep_count_lines(const char *p, const char *end)
+{
+	uint32_t lines = 0;
+
+	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+		lines++;
+		p++;
+	}
+	return lines;
+}
+
+/*
+ * Scans a buffer of complete lines, returning the number of the line that
+ * follows it. buffer[length] must be writable: regexec needs the buffer
+ * terminated, so the byte there is replaced for the duration of the scan.
+ */
+static uint32_t grep_buffer(GrepContext *grep, const char *path, char *buffer,
+		size_t length, uint64_t base, uint32_t lineNumber)
+{
+	const char *end = buffer + length;
+	const char *counted = buffer;
+	const char *p = buffer;
+	const char *match, *start, *stop;
+	char saved = buffer[length];
+
+	buffer[length] = '\0';
+
+	while (p < end && !grep->stopped && (match = grep_find(grep, p, end)) != NULL) {
+		start = match;
+		while (start > p && start[-1] != '\n') {
+			start--;
+		}
+		if ((stop = memchr(match, '\n', end - match)) == NULL) {
+			stop = end;
+		}
+
+		lineNumber += grep_count_lines(counted, start);
+		counted = start;
+
+		grep_emit(grep, path, base + (start - buffer), lineNumber, start, stop - start);
+
+		p = stop + 1;
+	}
+
+	buffer[length] = saved;
+
+	return lineNumber + grep_count_lines(counted, end);
+}
+
+static void grep_file(GrepContext *grep, const char *path, char *buffer)
+{
+	uint64_t offset = 0;
+	uint32_t lineNumber = 1;
+	size_t used = 0;
+	size_t length;
+	ssize_t bytes;
+	const char *newline;
+	BOOL eof = FALSE;
+	FILE *f;
+	int fd;
+
+	if (fs_fopen(path, "rb", &f) != ERROR_SUCCESS) {
+		return;
+	}
+	fd = fileno(f);
+
+	while (!eof && !grep->stopped) {
+		bytes = pread(fd, buffer + used, GREP_BUFFER_SIZE - used, offset + used);
+		if (bytes == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		used += bytes;
+		eof = bytes == 0;
+
+		/*
+		 * Scan up to the last complete line, keeping the partial line that
+		 * follows it for the next read. A full buffer without a newline is
+		 * scanned as a single line.
+		 */
+		if (eof || used == GREP_BUFFER_SIZE) {
+			newline = eof ? NULL : memrchr(buffer, '\n', used);
+			length = newline ? (size_t)(newline - buffer) + 1 : used;
+		} else if ((newline = memrchr(buffer + used - bytes, '\n', bytes)) != NULL) {
+			length = (newline - buffer) + 1;
+		} else {
+			continue;
+		}
+
+		if (length) {
+			lineNumber = grep_buffer(grep, path, buffer, length, offset, lineNumber);
+			memmove(buffer, buffer + length, used - length);
+			offset += length;
+			used -= length;
+		}
+	}
+
+	fclose(f);
+
+	pthread_mutex_lock(&grep->lock);
+	grep->files++;
+	grep->bytes += offset;
+	pthread_mutex_unlock(&grep->lock);
+}
+
+static void *grep_worker(void *arg)
+{
+	GrepContext *grep = arg;
+	char *buffer;
+	char *path;
+
+	/* One spare byte so that grep_buffer can terminate a full buffer. */
+	buffer = malloc(GREP_BUFFER_SIZE + 1);
+
+	for (;;) {
+		pthread_mutex_lock(&grep->lock);
+		while (grep->queued == 0 && !grep->walked && !grep->stopped) {
+			pthread_cond_wait(&grep->ready, &grep->lock);
+		}
+		if (grep->queued == 0 || grep->stopped) {
+			pthread_mutex_unlock(&grep->lock);
+			break;
+		}
+		path = grep->queue[grep->head];
+		grep->head = (grep->head + 1) % GREP_QUEUE_DEPTH;
+		grep->queued--;
+		pthread_cond_signal(&grep->space);
+		pthread_mutex_unlock(&grep->lock);
+
+		if (buffer) {
+			grep_file(grep, path, buffer);
+		}
+		free(path);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static void grep_enqueue(GrepContext *grep, const char *path)
+{
+	char *copy = strdup(path);
+
+	if (copy == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&grep->lock);
+	while (grep->queued == GREP_QUEUE_DEPTH && !grep->stopped) {
+		pthread_cond_wait(&grep->space, &grep->lock);
+	}
+	if (grep->stopped) {
+		pthread_mutex_unlock(&grep->lock);
+		free(copy);
+		return;
+	}
+	grep->queue[(grep->head + grep->queued) % GREP_QUEUE_DEPTH] = copy;
+	grep->queued++;
+	pthread_cond_signal(&grep->ready);
+	pthread_mutex_unlock(&grep->lock);
+}
+
+static void grep_walk_cb(void *arg, char *name, char *short_name, char *path)
+{
+	GrepContext *grep = arg;
+	struct stat st;
+
+	if (grep->stopped || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return;
+	}
+
+	/* Symbolic links are never followed, which also keeps the walk finite. */
+	if (lstat(path, &st) == -1) {
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		if (grep->recursive) {
+			fs_ls(path, grep_walk_cb, grep);
+		}
+	} else if (S_ISREG(st.st_mode)) {
+		grep_enqueue(grep, path);
+	}
+}
+
+/*
+ * Searches the contents of a file, or of the files in a directory, for a
+ * literal string or a POSIX extended regular expression
+ *
+ * req: TLV_TYPE_FILE_PATH            - The file or directory to search
+ * req: TLV_TYPE_FS_GREP_PATTERN      - The string or expression to search for
+ * opt: TLV_TYPE_FS_GREP_REGEX        - The pattern is a regular expression
+ * opt: TLV_TYPE_FS_GREP_IGNORE_CASE  - Match without regard to case
+ * opt: TLV_TYPE_FS_RECURSIVE         - Descend into subdirectories
+ * opt: TLV_TYPE_FS_GREP_MAX_MATCHES  - Stop after this many matching lines
+ */
+DWORD request_fs_grep(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	pthread_t workers[GREP_MAX_WORKERS];
+	GrepContext grep;
+	FsGrepRequest args;
+	struct stat st;
+	DWORD result = ERROR_SUCCESS;
+	long processors;
+	int count = 0;
+	int started = 0;
+
+	memset(&grep, 0, sizeof(grep));
+	grep.remote = remote;
+	grep.requestId = packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID);
+	pthread_mutex_init(&grep.lock, NULL);
+	pthread_cond_init(&grep.ready, NULL);
+	pthread_cond_init(&grep.space, NULL);
+
+	do {
+		if ((result = packet_decode(packet, &FsGrepRequestSchema, &args)) != ERROR_SUCCESS) {
+			break;
+		}
+
+		if (!args.path || !args.pattern || !args.pattern[0]) {
+			result = ERROR_INVALID_PARAMETER;
+			break;
+		}
+		grep.pattern = args.pattern;
+		grep.patternLength = strlen(args.pattern);
+		grep.ignoreCase = args.ignoreCase;
+		grep.useRegex = args.regex;
+		grep.recursive = args.recursive;
+		grep.maxMatches = args.maxMatches ? args.maxMatches : GREP_MAX_MATCHES;
+
+		if (grep.useRegex && regcomp(&grep.regex, args.pattern,
+				REG_EXTENDED | REG_NEWLINE | (grep.ignoreCase ? REG_ICASE : 0)) != 0) {
+			grep.useRegex = FALSE;
+			result = ERROR_INVALID_PARAMETER;
+			break;
+		}
+
+		if (stat(args.path, &st) == -1) {
+			result = errno;
+			break;
+		}
+
+		processors = sysconf(_SC_NPROCESSORS_ONLN);
+		count = processors < 1 ? 1 : processors > GREP_MAX_WORKERS ? GREP_MAX_WORKERS : (int)processors;
+		for (; started < count; started++) {
+			if (pthread_create(&workers[started], NULL, grep_worker, &grep) != 0) {
+				break;
+			}
+		}
+		if (started == 0) {
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			fs_ls(args.path, grep_walk_cb, &grep);
+		} else {
+			grep_enqueue(&grep, args.path);
+		}
+	} while (0);
+
+	pthread_mutex_lock(&grep.lock);
+	grep.walked = TRUE;
+	pthread_cond_broadcast(&grep.ready);
+	pthread_mutex_unlock(&grep.lock);
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	/* Anything left in the queue was abandoned when the match limit was hit. */
+	while (grep.queued) {
+		free(grep.queue[grep.head]);
+		grep.head = (grep.head + 1) % GREP_QUEUE_DEPTH;
+		grep.queued--;
+	}
+
+	grep_send(&grep, grep.batch);
+
+	if (grep.useRegex) {
+		regfree(&grep.regex);
+	}
+	pthread_cond_destroy(&grep.space);
+	pthread_cond_destroy(&grep.ready);
+	pthread_mutex_destroy(&grep.lock);
+
+	if (result == ERROR_SUCCESS) {
+		packet_add_tlv_uint(response, TLV_TYPE_FS_PROGRESS_ENTRIES, grep.files);
+		packet_add_tlv_qword(response, TLV_TYPE_FS_PROGRESS_BYTES, grep.bytes);
+	}
+	packet_add_tlv_uint(response, TLV_TYPE_RESULT, result);
+	return PACKET_TRANSMIT(remote, response, NULL);
+}
@@ -3,6 +3,7 @@
 extern DWORD request_net_tcp_client_channel_open(Remote *remote, Packet *packet);
 extern DWORD request_net_tcp_server_channel_open(Remote *remote, Packet *packet);
 extern DWORD request_net_udp_channel_open(Remote *remote, Packet *packet);
+extern DWORD request_net_tcp_tunnel_channel_open(Remote *remote, Packet *packet);
 
 // Channel type dispatch table
 struct
@@ -15,6 +16,7 @@ struct
 	{ "stdapi_net_tcp_client", request_net_tcp_client_channel_open },
 	{ "stdapi_net_tcp_server", request_net_tcp_server_channel_open },
 	{ "stdapi_net_udp_client", request_net_udp_channel_open        },
+	{ "stdapi_net_tcp_tunnel", request_net_tcp_tunnel_channel_open },
 	{ NULL,                    NULL                                },
 };
 
@@ -189,8 +189,10 @@ DWORD tcp_channel_client_local_notify(Remote * remote, TcpClientContext * ctx)
 			// Set the native channel operations context to NULL
 			channel_set_native_io_context(ctx->channel, NULL);
 
-			// Sleep for a quarter second
-			Sleep(250);
+			// Wait out any core_channel_write still inside the native write with
+			// this context rather than sleeping, which would stall the whole shard
+			lock_acquire(ctx->channel->lock);
+			lock_release(ctx->channel->lock);
 
 			// Free the context
 			free_tcp_client_context(ctx);
@@ -352,7 +354,7 @@ DWORD create_tcp_client_channel(Remote *remote, LPCSTR remoteHost, USHORT remote
 
 		dprintf("[TCP] create_tcp_client_channel. host=%s, port=%d creating the channel", remoteHost, remotePort);
 		// Allocate an uninitialized channel for associated with this connection
-		if (!(channel = channel_create_stream(0, 0, &chops)))
+		if (!(channel = channel_create_stream(remote, 0, 0, &chops)))
 		{
 			result = ERROR_NOT_ENOUGH_MEMORY;
 			break;
@@ -364,12 +366,18 @@ DWORD create_tcp_client_channel(Remote *remote, LPCSTR remoteHost, USHORT remote
 		// Finally, create a waitable event and insert it into the scheduler's 
 		// waitable list
 		dprintf("[TCP] create_tcp_client_channel. host=%s, port=%d creating the notify", remoteHost, remotePort);
+#ifdef _WIN32
 		if ((ctx->notify = WSACreateEvent()))
+#else
+		// the scheduler polls the socket itself
+		if ((ctx->notify = ctx->fd))
+#endif
 		{
 			WSAEventSelect(ctx->fd, ctx->notify, FD_READ | FD_CLOSE);
 			dprintf("[TCP] create_tcp_client_channel. host=%s, port=%d created the notify %.8x", remoteHost, remotePort, ctx->notify);
 
-			scheduler_insert_waitable(ctx->notify, ctx, NULL, (WaitableNotifyRoutine)tcp_channel_client_local_notify, NULL);
+			channel_set_waitable(channel, ctx->notify);
+			scheduler_insert_pinned_waitable(remote, ctx->notify, ctx, NULL, (WaitableNotifyRoutine)tcp_channel_client_local_notify, NULL, channel_get_id(channel));
 		}
 
 	} while (0);
@@ -409,7 +417,17 @@ VOID free_socket_context(SocketContext *ctx)
 {
 	dprintf("[TCP] free_socket_context. ctx=0x%08X", ctx);
 
-	// Close the socket and notification handle
+	// Stop the waitable before the socket goes, as on POSIX the waitable is the
+	// socket's descriptor, which could otherwise be reused by the time we signal it
+	if (ctx->notify)
+	{
+		dprintf("[TCP] free_socket_context. remove_waitable ctx=0x%08X notify=0x%08X", ctx, ctx->notify);
+		// The scheduler calls CloseHandle on our WSACreateEvent() for us
+		scheduler_signal_waitable(ctx->notify, Stop);
+		ctx->notify = NULL;
+	}
+
+	// Close the socket
 	if (ctx->fd)
 	{
 		closesocket(ctx->fd);
@@ -422,14 +440,6 @@ VOID free_socket_context(SocketContext *ctx)
 		ctx->channel = NULL;
 	}
 
-	if (ctx->notify)
-	{
-		dprintf("[TCP] free_socket_context. remove_waitable ctx=0x%08X notify=0x%08X", ctx, ctx->notify);
-		// The scheduler calls CloseHandle on our WSACreateEvent() for us
-		scheduler_signal_waitable(ctx->notify, Stop);
-		ctx->notify = NULL;
-	}
-
 	// Free the context
 	free(ctx);
 }
@@ -463,8 +473,8 @@ DWORD request_net_socket_tcp_shutdown(Remote *remote, Packet *packet)
 		cid = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID);
 		how = packet_get_tlv_value_uint(packet, TLV_TYPE_SHUTDOWN_HOW);
 
-		channel = channel_find_by_id(cid);
-		if (!response)
+		channel = channel_find_by_id(remote, cid);
+		if (!channel)
 		{
 			BREAK_WITH_ERROR("[TCP] request_net_socket_tcp_shutdown. channel == NULL", ERROR_INVALID_HANDLE);
 		}
@@ -490,6 +500,11 @@ DWORD request_net_socket_tcp_shutdown(Remote *remote, Packet *packet)
 
 	} while (0);
 
+	if (channel)
+	{
+		channel_release(channel);
+	}
+
 	packet_transmit_response(dwResult, remote, response);
 
 	dprintf("[TCP] leaving request_net_socket_tcp_shutdown");
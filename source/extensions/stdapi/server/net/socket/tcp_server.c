@@ -20,6 +20,13 @@ VOID free_tcp_server_context(TcpServerContext * ctx)
 
 		dprintf("[TCP-SERVER] free_tcp_server_context. ctx=0x%08X", ctx);
 
+		// on POSIX the waitable is the socket's descriptor, so stop it before the socket goes
+		if (ctx->notify)
+		{
+			scheduler_signal_waitable(ctx->notify, Stop);
+			ctx->notify = NULL;
+		}
+
 		if (ctx->fd)
 		{
 			closesocket(ctx->fd);
@@ -32,12 +39,6 @@ VOID free_tcp_server_context(TcpServerContext * ctx)
 			ctx->channel = NULL;
 		}
 
-		if (ctx->notify)
-		{
-			scheduler_signal_waitable(ctx->notify, Stop);
-			ctx->notify = NULL;
-		}
-
 		free(ctx);
 
 	} while (0);
@@ -109,7 +110,12 @@ TcpClientContext * tcp_channel_server_create_client(TcpServerContext * serverCtx
 		clientctx->remote = serverCtx->remote;
 		clientctx->fd = sock;
 
+#ifdef _WIN32
 		clientctx->notify = WSACreateEvent();
+#else
+		// the scheduler polls the socket itself
+		clientctx->notify = clientctx->fd;
+#endif
 		if (clientctx->notify == WSA_INVALID_EVENT)
 		{
 			BREAK_ON_WSAERROR("[TCP-SERVER] tcp_channel_server_create_client. WSACreateEvent failed");
@@ -126,13 +132,14 @@ TcpClientContext * tcp_channel_server_create_client(TcpServerContext * serverCtx
 		chops.native.write = tcp_channel_client_write;
 		chops.native.close = tcp_channel_client_close;
 
-		clientctx->channel = channel_create_stream(0, 0, &chops);
+		clientctx->channel = channel_create_stream(serverCtx->remote, 0, 0, &chops);
 		if (!clientctx->channel)
 		{
 			BREAK_WITH_ERROR("[TCP-SERVER] tcp_channel_server_create_client. clientctx->channel == NULL", ERROR_INVALID_HANDLE);
 		}
 
-		dwResult = scheduler_insert_waitable(clientctx->notify, clientctx, NULL, (WaitableNotifyRoutine)tcp_channel_client_local_notify, NULL);
+		channel_set_waitable(clientctx->channel, clientctx->notify);
+		dwResult = scheduler_insert_pinned_waitable(clientctx->remote, clientctx->notify, clientctx, NULL, (WaitableNotifyRoutine)tcp_channel_client_local_notify, NULL, channel_get_id(clientctx->channel));
 
 	} while (0);
 
@@ -185,7 +192,8 @@ DWORD tcp_channel_server_notify(Remote * remote, TcpServerContext * serverCtx)
 		{
 			if (WSAGetLastError() == WSAEWOULDBLOCK)
 			{
-				Sleep(100);
+				// back off without holding up the other waitables on this shard
+				scheduler_delay_waitable(serverCtx->notify, 100);
 				break;
 			}
 
@@ -332,7 +340,12 @@ DWORD request_net_tcp_server_channel_open(Remote * remote, Packet * packet)
 			BREAK_ON_WSAERROR("[TCP-SERVER] request_net_tcp_server_channel_open. listen failed");
 		}
 
+#ifdef _WIN32
 		ctx->notify = WSACreateEvent();
+#else
+		// the scheduler polls the socket itself
+		ctx->notify = ctx->fd;
+#endif
 		if (ctx->notify == WSA_INVALID_EVENT)
 		{
 			BREAK_ON_WSAERROR("[TCP-SERVER] request_net_tcp_server_channel_open. WSACreateEvent failed");
@@ -347,13 +360,13 @@ DWORD request_net_tcp_server_channel_open(Remote * remote, Packet * packet)
 		chops.native.context = ctx;
 		chops.native.close = tcp_channel_server_close;
 
-		ctx->channel = channel_create_stream(0, CHANNEL_FLAG_SYNCHRONOUS, &chops);
+		ctx->channel = channel_create_stream(remote, 0, CHANNEL_FLAG_SYNCHRONOUS, &chops);
 		if (!ctx->channel)
 		{
 			BREAK_WITH_ERROR("[TCP-SERVER] request_net_tcp_server_channel_open. channel_create_stream failed", ERROR_INVALID_HANDLE);
 		}
 
-		scheduler_insert_waitable(ctx->notify, ctx, NULL, (WaitableNotifyRoutine)tcp_channel_server_notify, NULL);
+		scheduler_insert_pinned_waitable(remote, ctx->notify, ctx, NULL, (WaitableNotifyRoutine)tcp_channel_server_notify, NULL, channel_get_id(ctx->channel));
 
 		packet_add_tlv_uint(response, TLV_TYPE_CHANNEL_ID, channel_get_id(ctx->channel));
 
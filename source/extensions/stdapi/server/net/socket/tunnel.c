@@ -0,0 +1,968 @@
+/*!
+ * @file tunnel.c
+ * @brief Definitions for the multiplexed TCP stream tunnel channel.
+ * @details Every stream in a tunnel shares the tunnel's channel, its lock and a
+ *          single scheduler waitable. On POSIX the waitable is an epoll descriptor
+ *          that every stream socket is registered with, and on Windows it's an
+ *          event that every stream socket is associated with via WSAEventSelect.
+ *          Either way, one scheduler thread drives all of the sockets, and the data
+ *          it reads is batched into as few channel writes as possible.
+ */
+#include "precomp.h"
+#include "tunnel.h"
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/epoll.h>
+#include <netdb.h>
+#endif
+
+/*! @brief Largest frame that will be accepted from the remote. */
+#define TUNNEL_MAX_FRAME        0x100000
+/*! @brief Largest amount of unsent data held for a stream before it is closed. */
+#define TUNNEL_MAX_PENDING      0x100000
+/*! @brief Size of the buffer used to read from stream sockets. */
+#define TUNNEL_READ_SIZE        16384
+/*! @brief Amount of queued frame data that triggers a write to the channel. */
+#define TUNNEL_FLUSH_SIZE       0x10000
+/*! @brief Number of hash buckets used to look up streams. */
+#define TUNNEL_BUCKETS          64
+/*! @brief Maximum number of socket events handled in a single pass. */
+#define TUNNEL_MAX_EVENTS       64
+
+#ifdef _WIN32
+#define TUNNEL_SEND_FLAGS       0
+#define TUNNEL_SOCKET_ERROR     WSAGetLastError()
+#define TUNNEL_WOULD_BLOCK      WSAEWOULDBLOCK
+#define TUNNEL_CONNECT_PENDING  WSAEWOULDBLOCK
+#else
+#define TUNNEL_SEND_FLAGS       MSG_NOSIGNAL
+#define TUNNEL_SOCKET_ERROR     errno
+#define TUNNEL_WOULD_BLOCK      EWOULDBLOCK
+#define TUNNEL_CONNECT_PENDING  EINPROGRESS
+#endif
+
+/*! @brief A single logical connection carried by a tunnel. */
+typedef struct _TunnelStream
+{
+	struct _TunnelStream* next;     ///< Next stream in the same hash bucket.
+	UINT id;                        ///< Identifier chosen by the client.
+	SOCKET fd;                      ///< The stream's socket.
+	BOOL connected;                 ///< Indication of whether the connect has completed.
+	PUCHAR pending;                 ///< Data from the remote not yet written to the socket.
+	DWORD pendingLength;            ///< Number of bytes in \c pending.
+	DWORD pendingSize;              ///< Allocated size of \c pending.
+} TunnelStream;
+
+/*! @brief State of a tunnel channel. */
+typedef struct _TunnelContext
+{
+	Remote* remote;                         ///< The remote the tunnel belongs to.
+	Channel* channel;                       ///< The tunnel's channel, \c NULL once it's closed.
+	LOCK* lock;                             ///< Guards everything below.
+	DWORD references;                       ///< Holders of the context, it's released when this drops to zero.
+	TunnelStream* streams[TUNNEL_BUCKETS];  ///< Stream hash table.
+	PUCHAR inbound;                         ///< Partial frame data received from the remote.
+	DWORD inboundLength;                    ///< Number of bytes in \c inbound.
+	DWORD inboundSize;                      ///< Allocated size of \c inbound.
+	PUCHAR outbound;                        ///< Frames waiting to be written to the channel.
+	DWORD outboundLength;                   ///< Number of bytes in \c outbound.
+	DWORD outboundSize;                     ///< Allocated size of \c outbound.
+#ifdef _WIN32
+	WSAEVENT notify;                        ///< Event shared by every stream socket.
+#else
+	int notify;                             ///< epoll descriptor every stream socket is registered with.
+#endif
+} TunnelContext;
+
+/*!
+ * @brief Append data to a growable buffer.
+ * @returns Indication of success or failure.
+ */
+static DWORD tunnel_buffer_append(PUCHAR* buffer, DWORD* length, DWORD* size, LPVOID data, DWORD dataLength)
+{
+	PUCHAR grown;
+	DWORD newSize;
+
+	if (*length + dataLength > *size)
+	{
+		for (newSize = *size ? *size : 4096; newSize < *length + dataLength; newSize *= 2);
+
+		if (!(grown = (PUCHAR)realloc(*buffer, newSize)))
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		*buffer = grown;
+		*size = newSize;
+	}
+
+	memcpy(*buffer + *length, data, dataLength);
+	*length += dataLength;
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Drop a reference to a tunnel, releasing it if that was the last one.
+ * @remark Must be called with the tunnel's lock held, which this releases.
+ */
+static VOID tunnel_release(TunnelContext* ctx)
+{
+	BOOL last = --ctx->references == 0;
+
+	lock_release(ctx->lock);
+
+	if (!last)
+	{
+		return;
+	}
+
+	dprintf("[TUNNEL] tunnel_release. releasing ctx=0x%08X", ctx);
+
+#ifdef _WIN32
+	WSACloseEvent(ctx->notify);
+#else
+	close(ctx->notify);
+#endif
+
+	if (ctx->inbound)
+	{
+		free(ctx->inbound);
+	}
+
+	if (ctx->outbound)
+	{
+		free(ctx->outbound);
+	}
+
+	lock_destroy(ctx->lock);
+	free(ctx);
+}
+
+/*!
+ * @brief Write any queued frames to the channel.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static VOID tunnel_flush(TunnelContext* ctx)
+{
+	if (ctx->channel && ctx->outboundLength)
+	{
+		channel_write(ctx->channel, ctx->remote, NULL, 0, ctx->outbound, ctx->outboundLength, NULL);
+	}
+
+	ctx->outboundLength = 0;
+}
+
+/*!
+ * @brief Queue a frame to be written to the channel.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static VOID tunnel_queue_frame(TunnelContext* ctx, UINT stream, UINT type, LPVOID payload, DWORD length)
+{
+	TunnelFrameHeader header;
+
+	header.stream = htonl(stream);
+	header.type = htonl(type);
+	header.length = htonl(length);
+
+	if (tunnel_buffer_append(&ctx->outbound, &ctx->outboundLength, &ctx->outboundSize, &header, sizeof(header)) != ERROR_SUCCESS
+		|| (length && tunnel_buffer_append(&ctx->outbound, &ctx->outboundLength, &ctx->outboundSize, payload, length) != ERROR_SUCCESS))
+	{
+		dprintf("[TUNNEL] tunnel_queue_frame. unable to queue frame for stream %u", stream);
+		return;
+	}
+
+	if (ctx->outboundLength >= TUNNEL_FLUSH_SIZE)
+	{
+		tunnel_flush(ctx);
+	}
+}
+
+/*!
+ * @brief Queue the result of a stream's connect.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static VOID tunnel_queue_opened(TunnelContext* ctx, UINT stream, DWORD result)
+{
+	UINT resultNbo = htonl((UINT)result);
+	tunnel_queue_frame(ctx, stream, TUNNEL_FRAME_OPENED, &resultNbo, sizeof(resultNbo));
+}
+
+/*!
+ * @brief Find a stream by its identifier.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static TunnelStream* tunnel_stream_find(TunnelContext* ctx, UINT id)
+{
+	TunnelStream* stream;
+
+	for (stream = ctx->streams[id % TUNNEL_BUCKETS]; stream; stream = stream->next)
+	{
+		if (stream->id == id)
+		{
+			return stream;
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * @brief Close a stream's socket and release it.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static VOID tunnel_stream_destroy(TunnelContext* ctx, TunnelStream* stream)
+{
+	TunnelStream** link;
+
+	for (link = &ctx->streams[stream->id % TUNNEL_BUCKETS]; *link; link = &(*link)->next)
+	{
+		if (*link == stream)
+		{
+			*link = stream->next;
+			break;
+		}
+	}
+
+#ifndef _WIN32
+	epoll_ctl(ctx->notify, EPOLL_CTL_DEL, stream->fd, NULL);
+#endif
+	closesocket(stream->fd);
+
+	if (stream->pending)
+	{
+		free(stream->pending);
+	}
+
+	free(stream);
+}
+
+/*!
+ * @brief Close a stream and let the client know.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static VOID tunnel_stream_shutdown(TunnelContext* ctx, TunnelStream* stream)
+{
+	dprintf("[TUNNEL] tunnel_stream_shutdown. stream=%u", stream->id);
+	tunnel_queue_frame(ctx, stream->id, TUNNEL_FRAME_CLOSE, NULL, 0);
+	tunnel_stream_destroy(ctx, stream);
+}
+
+/*!
+ * @brief Set whether the reactor should be told when the stream's socket becomes writable.
+ * @remark On Windows, FD_WRITE is always selected and is only signalled after a send
+ *         has failed with WSAEWOULDBLOCK, so there's nothing to change.
+ */
+static VOID tunnel_stream_watch(TunnelContext* ctx, TunnelStream* stream, BOOL writable)
+{
+#ifndef _WIN32
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+	event.data.u32 = stream->id;
+
+	epoll_ctl(ctx->notify, EPOLL_CTL_MOD, stream->fd, &event);
+#endif
+}
+
+/*!
+ * @brief Write as much of a stream's pending data to its socket as it will take.
+ * @returns Indication of success or failure. On failure the stream should be shut down.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static DWORD tunnel_stream_send_pending(TunnelContext* ctx, TunnelStream* stream)
+{
+	LONG sent;
+	DWORD result;
+
+	while (stream->pendingLength)
+	{
+		if ((sent = send(stream->fd, stream->pending, stream->pendingLength, TUNNEL_SEND_FLAGS)) == SOCKET_ERROR)
+		{
+			result = TUNNEL_SOCKET_ERROR;
+			if (result == TUNNEL_WOULD_BLOCK)
+			{
+				tunnel_stream_watch(ctx, stream, TRUE);
+				return ERROR_SUCCESS;
+			}
+			return result;
+		}
+
+		stream->pendingLength -= sent;
+		memmove(stream->pending, stream->pending + sent, stream->pendingLength);
+	}
+
+	tunnel_stream_watch(ctx, stream, FALSE);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Handle data from the remote that is destined for a stream.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static VOID tunnel_stream_write(TunnelContext* ctx, TunnelStream* stream, PUCHAR data, DWORD length)
+{
+	if (stream->pendingLength + length > TUNNEL_MAX_PENDING)
+	{
+		dprintf("[TUNNEL] tunnel_stream_write. stream=%u has too much unsent data", stream->id);
+		tunnel_stream_shutdown(ctx, stream);
+		return;
+	}
+
+	// data is always queued behind anything already pending so that it stays in order
+	if (tunnel_buffer_append(&stream->pending, &stream->pendingLength, &stream->pendingSize, data, length) != ERROR_SUCCESS)
+	{
+		tunnel_stream_shutdown(ctx, stream);
+		return;
+	}
+
+	if (stream->connected && tunnel_stream_send_pending(ctx, stream) != ERROR_SUCCESS)
+	{
+		tunnel_stream_shutdown(ctx, stream);
+	}
+}
+
+/*!
+ * @brief Handle the completion of a stream's connect.
+ * @returns Indication of whether the stream still exists.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static BOOL tunnel_stream_connected(TunnelContext* ctx, TunnelStream* stream, DWORD result)
+{
+	dprintf("[TUNNEL] tunnel_stream_connected. stream=%u result=%u", stream->id, result);
+
+	tunnel_queue_opened(ctx, stream->id, result);
+
+	if (result != ERROR_SUCCESS)
+	{
+		tunnel_stream_destroy(ctx, stream);
+		return FALSE;
+	}
+
+	stream->connected = TRUE;
+
+	// anything the client sent before the connect completed can go now
+	if (tunnel_stream_send_pending(ctx, stream) != ERROR_SUCCESS)
+	{
+		tunnel_stream_shutdown(ctx, stream);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*!
+ * @brief Read from a stream's socket and queue the data for the remote.
+ * @param ctx Pointer to the tunnel.
+ * @param stream The stream to read from.
+ * @param blocked Optional pointer that is set if the socket had nothing to read.
+ * @returns Indication of whether the stream still exists.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static BOOL tunnel_stream_read(TunnelContext* ctx, TunnelStream* stream, BOOL* blocked)
+{
+	UCHAR buf[TUNNEL_READ_SIZE];
+	LONG bytesRead = recv(stream->fd, buf, sizeof(buf), 0);
+
+	if (bytesRead > 0)
+	{
+		tunnel_queue_frame(ctx, stream->id, TUNNEL_FRAME_DATA, buf, bytesRead);
+		return TRUE;
+	}
+
+	if (bytesRead == SOCKET_ERROR && TUNNEL_SOCKET_ERROR == TUNNEL_WOULD_BLOCK)
+	{
+		if (blocked)
+		{
+			*blocked = TRUE;
+		}
+		return TRUE;
+	}
+
+	tunnel_stream_shutdown(ctx, stream);
+	return FALSE;
+}
+
+/*!
+ * @brief Work out the address a new stream should connect to.
+ * @param ctx Pointer to the tunnel.
+ * @param payload The port followed by the NULL-terminated host.
+ * @param length Size of \c payload.
+ * @param s Pointer to the address that receives the result.
+ * @returns Indication of success or failure.
+ * @remark Must be called with the tunnel's lock held, and with a reference to
+ *         the tunnel so it outlives the lookup. The lock is dropped while a host
+ *         name is looked up, as that can block for a long time, so the caller
+ *         must check that the tunnel is still open afterwards.
+ */
+static DWORD tunnel_stream_resolve(TunnelContext* ctx, PUCHAR payload, DWORD length, struct sockaddr_in* s)
+{
+	struct addrinfo hints, *addresses;
+	USHORT port;
+	LPCSTR host;
+	DWORD result = ERROR_SUCCESS;
+
+	if (length < sizeof(USHORT) + 1 || payload[length - 1] != 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memcpy(&port, payload, sizeof(USHORT));
+	host = (LPCSTR)(payload + sizeof(USHORT));
+
+	memset(s, 0, sizeof(*s));
+	s->sin_family = AF_INET;
+	s->sin_port = port;
+	s->sin_addr.s_addr = inet_addr(host);
+
+	if (s->sin_addr.s_addr != (DWORD)-1)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	// the payload stays put, as only channel writes touch the inbound buffer and
+	// the channel lets one of those run at a time
+	lock_release(ctx->lock);
+
+	// getaddrinfo is safe to call from several scheduler threads at once, unlike gethostbyname
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, NULL, &hints, &addresses) == 0)
+	{
+		s->sin_addr = ((struct sockaddr_in*)addresses->ai_addr)->sin_addr;
+		freeaddrinfo(addresses);
+	}
+	else
+	{
+		result = ERROR_NOT_FOUND;
+	}
+
+	lock_acquire(ctx->lock);
+
+	return result;
+}
+
+/*!
+ * @brief Start connecting a new stream.
+ * @param ctx Pointer to the tunnel.
+ * @param id Identifier of the new stream.
+ * @param s The address to connect to.
+ * @remark Must be called with the tunnel's lock held. The connect completes
+ *         asynchronously, so a slow peer doesn't hold up other streams.
+ */
+static VOID tunnel_stream_open(TunnelContext* ctx, UINT id, struct sockaddr_in* s)
+{
+	TunnelStream* stream = NULL;
+	DWORD result = ERROR_SUCCESS;
+	SOCKET fd = INVALID_SOCKET;
+#ifndef _WIN32
+	struct epoll_event event;
+#endif
+
+	do
+	{
+		if (tunnel_stream_find(ctx, id))
+		{
+			result = ERROR_INVALID_PARAMETER;
+			break;
+		}
+
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET)
+		{
+			result = TUNNEL_SOCKET_ERROR;
+			break;
+		}
+
+		if (!(stream = (TunnelStream*)calloc(1, sizeof(TunnelStream))))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		stream->id = id;
+		stream->fd = fd;
+
+#ifdef _WIN32
+		// this also puts the socket in non-blocking mode
+		if (WSAEventSelect(fd, ctx->notify, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE) == SOCKET_ERROR)
+		{
+			result = WSAGetLastError();
+			break;
+		}
+#else
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLOUT;
+		event.data.u32 = id;
+
+		if (epoll_ctl(ctx->notify, EPOLL_CTL_ADD, fd, &event) != 0)
+		{
+			result = errno;
+			break;
+		}
+#endif
+
+		stream->next = ctx->streams[id % TUNNEL_BUCKETS];
+		ctx->streams[id % TUNNEL_BUCKETS] = stream;
+
+		dprintf("[TUNNEL] tunnel_stream_open. stream=%u connecting to %s:%u", id, inet_ntoa(s->sin_addr), ntohs(s->sin_port));
+
+		if (connect(fd, (struct sockaddr *)s, sizeof(*s)) == SOCKET_ERROR)
+		{
+			result = TUNNEL_SOCKET_ERROR;
+			if (result != TUNNEL_CONNECT_PENDING)
+			{
+				tunnel_queue_opened(ctx, id, result);
+				tunnel_stream_destroy(ctx, stream);
+			}
+			return;
+		}
+
+		tunnel_stream_connected(ctx, stream, ERROR_SUCCESS);
+		return;
+	} while (0);
+
+	dprintf("[TUNNEL] tunnel_stream_open. stream=%u failed: %u", id, result);
+
+	tunnel_queue_opened(ctx, id, result);
+
+	if (stream)
+	{
+		free(stream);
+	}
+
+	if (fd != INVALID_SOCKET)
+	{
+		closesocket(fd);
+	}
+}
+
+/*!
+ * @brief Handle a complete frame received from the remote.
+ * @remark Must be called with the tunnel's lock held.
+ */
+static VOID tunnel_dispatch_frame(TunnelContext* ctx, UINT id, UINT type, PUCHAR payload, DWORD length)
+{
+	TunnelStream* stream;
+	struct sockaddr_in s;
+	DWORD result;
+
+	switch (type)
+	{
+	case TUNNEL_FRAME_OPEN:
+		result = tunnel_stream_resolve(ctx, payload, length, &s);
+
+		// the tunnel may have been closed while the host was being looked up
+		if (!ctx->channel)
+		{
+			break;
+		}
+
+		if (result == ERROR_SUCCESS)
+		{
+			tunnel_stream_open(ctx, id, &s);
+		}
+		else
+		{
+			dprintf("[TUNNEL] tunnel_dispatch_frame. stream=%u failed to resolve: %u", id, result);
+			tunnel_queue_opened(ctx, id, result);
+		}
+		break;
+	case TUNNEL_FRAME_DATA:
+		// data may still be in flight for a stream that has just closed
+		if ((stream = tunnel_stream_find(ctx, id)) != NULL)
+		{
+			tunnel_stream_write(ctx, stream, payload, length);
+		}
+		break;
+	case TUNNEL_FRAME_CLOSE:
+		if ((stream = tunnel_stream_find(ctx, id)) != NULL)
+		{
+			tunnel_stream_destroy(ctx, stream);
+		}
+		break;
+	default:
+		dprintf("[TUNNEL] tunnel_dispatch_frame. ignoring unknown frame type %u for stream %u", type, id);
+		break;
+	}
+}
+
+/*!
+ * @brief Handles frames written to the tunnel by the remote.
+ * @param channel Pointer to the tunnel channel.
+ * @param request Pointer to the request packet.
+ * @param context Pointer to the tunnel's context.
+ * @param buffer Buffer containing the frame data.
+ * @param bufferSize Size of the buffer.
+ * @param bytesWritten Pointer that receives the number of bytes consumed.
+ * @returns Indication of success or failure.
+ * @retval ERROR_INVALID_DATA A frame was too large. All buffered frame data is discarded.
+ */
+DWORD tunnel_channel_write(Channel *channel, Packet *request, LPVOID context, LPVOID buffer, DWORD bufferSize, LPDWORD bytesWritten)
+{
+	TunnelContext* ctx = (TunnelContext*)context;
+	TunnelFrameHeader header;
+	DWORD result = ERROR_SUCCESS;
+	DWORD offset = 0;
+	DWORD length;
+
+	if (!ctx)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	lock_acquire(ctx->lock);
+
+	// opening a stream can drop the lock, and the tunnel mustn't be released under it
+	ctx->references++;
+
+	do
+	{
+		if ((result = tunnel_buffer_append(&ctx->inbound, &ctx->inboundLength, &ctx->inboundSize, buffer, bufferSize)) != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		while (ctx->inboundLength - offset >= sizeof(TunnelFrameHeader))
+		{
+			memcpy(&header, ctx->inbound + offset, sizeof(header));
+			length = ntohl(header.length);
+
+			if (length > TUNNEL_MAX_FRAME)
+			{
+				dprintf("[TUNNEL] tunnel_channel_write. frame of %u bytes is too large", length);
+				result = ERROR_INVALID_DATA;
+				offset = ctx->inboundLength;
+				break;
+			}
+
+			if (ctx->inboundLength - offset - sizeof(TunnelFrameHeader) < length)
+			{
+				break;
+			}
+
+			tunnel_dispatch_frame(ctx, ntohl(header.stream), ntohl(header.type),
+				ctx->inbound + offset + sizeof(TunnelFrameHeader), length);
+
+			offset += sizeof(TunnelFrameHeader) + length;
+
+			// the tunnel was closed while a host was being looked up
+			if (!ctx->channel)
+			{
+				offset = ctx->inboundLength;
+				break;
+			}
+		}
+
+		// keep any partial frame for the next write
+		ctx->inboundLength -= offset;
+		memmove(ctx->inbound, ctx->inbound + offset, ctx->inboundLength);
+
+		tunnel_flush(ctx);
+	} while (0);
+
+	tunnel_release(ctx);
+
+	if (bytesWritten)
+	{
+		*bytesWritten = result == ERROR_SUCCESS ? bufferSize : 0;
+	}
+
+	return result;
+}
+
+/*!
+ * @brief Scheduler routine that services every stream socket in the tunnel.
+ * @param remote Pointer to the remote instance.
+ * @param ctx Pointer to the tunnel's context.
+ * @returns Indication of success or failure.
+ * @retval ERROR_SUCCESS This value is always returned.
+ */
+DWORD tunnel_notify(Remote *remote, TunnelContext *ctx)
+{
+#ifdef _WIN32
+	WSANETWORKEVENTS events;
+	TunnelStream* stream;
+	TunnelStream* next;
+	DWORD bucket;
+
+	lock_acquire(ctx->lock);
+
+	// reset first, so activity that happens while the sockets are being checked isn't lost
+	ResetEvent(ctx->notify);
+
+	for (bucket = 0; bucket < TUNNEL_BUCKETS; bucket++)
+	{
+		for (stream = ctx->streams[bucket]; stream; stream = next)
+		{
+			next = stream->next;
+
+			if (WSAEnumNetworkEvents(stream->fd, NULL, &events) == SOCKET_ERROR || !events.lNetworkEvents)
+			{
+				continue;
+			}
+
+			if ((events.lNetworkEvents & FD_CONNECT)
+				&& !tunnel_stream_connected(ctx, stream, events.iErrorCode[FD_CONNECT_BIT]))
+			{
+				continue;
+			}
+
+			if ((events.lNetworkEvents & FD_WRITE) && stream->connected
+				&& tunnel_stream_send_pending(ctx, stream) != ERROR_SUCCESS)
+			{
+				tunnel_stream_shutdown(ctx, stream);
+				continue;
+			}
+
+			if (events.lNetworkEvents & FD_READ)
+			{
+				if (!tunnel_stream_read(ctx, stream, NULL))
+				{
+					continue;
+				}
+			}
+
+			// drain whatever is left once the peer has closed; reading stops when the
+			// stream goes, or when the socket has nothing more to give for now
+			if (events.lNetworkEvents & FD_CLOSE)
+			{
+				BOOL blocked = FALSE;
+
+				while (!blocked && tunnel_stream_read(ctx, stream, &blocked));
+			}
+		}
+	}
+#else
+	struct epoll_event events[TUNNEL_MAX_EVENTS];
+	TunnelStream* stream;
+	int count, index, error;
+	socklen_t errorLength;
+
+	lock_acquire(ctx->lock);
+
+	count = epoll_wait(ctx->notify, events, TUNNEL_MAX_EVENTS, 0);
+
+	for (index = 0; index < count; index++)
+	{
+		if (!(stream = tunnel_stream_find(ctx, events[index].data.u32)))
+		{
+			continue;
+		}
+
+		if (!stream->connected)
+		{
+			if (events[index].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			{
+				error = 0;
+				errorLength = sizeof(error);
+				getsockopt(stream->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+				tunnel_stream_connected(ctx, stream, error);
+			}
+			continue;
+		}
+
+		if ((events[index].events & EPOLLOUT) && tunnel_stream_send_pending(ctx, stream) != ERROR_SUCCESS)
+		{
+			tunnel_stream_shutdown(ctx, stream);
+			continue;
+		}
+
+		if (events[index].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		{
+			tunnel_stream_read(ctx, stream, NULL);
+		}
+	}
+#endif
+
+	tunnel_flush(ctx);
+
+	lock_release(ctx->lock);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Releases a tunnel once its scheduler thread has stopped.
+ * @param waitable The tunnel's notification handle.
+ * @param ctx Pointer to the tunnel's context.
+ * @param threadContext Unused.
+ * @returns Indication of success or failure.
+ * @remark A channel write that is looking up a host holds its own reference,
+ *         in which case the context goes when that write is done with it.
+ */
+DWORD tunnel_destroy(HANDLE waitable, TunnelContext *ctx, LPVOID threadContext)
+{
+	dprintf("[TUNNEL] tunnel_destroy. ctx=0x%08X", ctx);
+
+	lock_acquire(ctx->lock);
+	tunnel_release(ctx);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Closes every stream in the tunnel.
+ * @param channel Pointer to the channel to be closed.
+ * @param request Pointer to the request packet.
+ * @param context Pointer to the tunnel's context.
+ * @returns Indication of success or failure.
+ * @retval ERROR_SUCCESS This value is always returned.
+ * @remark The context itself is released by \c tunnel_destroy once the scheduler
+ *         thread has stopped, as it may be in the middle of servicing the sockets.
+ */
+DWORD tunnel_channel_close(Channel *channel, Packet *request, LPVOID context)
+{
+	TunnelContext* ctx = (TunnelContext*)context;
+	TunnelStream* stream;
+	DWORD bucket;
+
+	dprintf("[TUNNEL] tunnel_channel_close. channel=0x%08X, ctx=0x%08X", channel, ctx);
+
+	if (ctx)
+	{
+		lock_acquire(ctx->lock);
+
+		ctx->channel = NULL;
+
+		for (bucket = 0; bucket < TUNNEL_BUCKETS; bucket++)
+		{
+			while ((stream = ctx->streams[bucket]) != NULL)
+			{
+				tunnel_stream_destroy(ctx, stream);
+			}
+		}
+
+		lock_release(ctx->lock);
+
+		channel_set_native_io_context(channel, NULL);
+
+		scheduler_signal_waitable((HANDLE)ctx->notify, Stop);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Allocates a multiplexed TCP stream tunnel channel.
+ * @param remote Pointer to the remote instance.
+ * @param packet Pointer to the request packet.
+ * @returns Indication of success or failure.
+ * @retval ERROR_SUCCESS Opening of the channel succeeded.
+ * @remarks The request takes no parameters; streams are opened with frames
+ *          written to the channel (see tunnel.h).
+ */
+DWORD request_net_tcp_tunnel_channel_open(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	StreamChannelOps chops;
+	TunnelContext *ctx = NULL;
+	Channel *channel = NULL;
+	DWORD result = ERROR_SUCCESS;
+
+	do
+	{
+		if (!response)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		if (!(ctx = (TunnelContext *)calloc(1, sizeof(TunnelContext))))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		ctx->remote = remote;
+		ctx->references = 1;
+#ifndef _WIN32
+		ctx->notify = -1;
+#endif
+
+		if (!(ctx->lock = lock_create()))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+#ifdef _WIN32
+		if ((ctx->notify = WSACreateEvent()) == WSA_INVALID_EVENT)
+		{
+			ctx->notify = NULL;
+			result = WSAGetLastError();
+			break;
+		}
+#else
+		if ((ctx->notify = epoll_create(TUNNEL_MAX_EVENTS)) < 0)
+		{
+			result = errno;
+			break;
+		}
+#endif
+
+		memset(&chops, 0, sizeof(chops));
+		chops.native.context = ctx;
+		chops.native.write = tunnel_channel_write;
+		chops.native.close = tunnel_channel_close;
+
+		if (!(channel = channel_create_stream(remote, 0, 0, &chops)))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		ctx->channel = channel;
+		channel_set_waitable(channel, (HANDLE)ctx->notify);
+
+		if ((result = scheduler_insert_pinned_waitable(remote, (HANDLE)ctx->notify, ctx, NULL,
+			(WaitableNotifyRoutine)tunnel_notify, (WaitableDestroyRoutine)tunnel_destroy, channel_get_id(channel))) != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		dprintf("[TUNNEL] request_net_tcp_tunnel_channel_open. channel=%u", channel_get_id(channel));
+
+		packet_add_tlv_uint(response, TLV_TYPE_CHANNEL_ID, channel_get_id(channel));
+	} while (0);
+
+	if (result != ERROR_SUCCESS && ctx)
+	{
+		if (channel)
+		{
+			// the channel mustn't call back into the context that's about to go
+			channel_set_native_io_context(channel, NULL);
+			channel_destroy(channel, NULL);
+		}
+
+#ifdef _WIN32
+		if (ctx->notify)
+		{
+			WSACloseEvent(ctx->notify);
+		}
+#else
+		if (ctx->notify >= 0)
+		{
+			close(ctx->notify);
+		}
+#endif
+
+		if (ctx->lock)
+		{
+			lock_destroy(ctx->lock);
+		}
+
+		free(ctx);
+	}
+
+	packet_transmit_response(result, remote, response);
+
+	return ERROR_SUCCESS;
+}
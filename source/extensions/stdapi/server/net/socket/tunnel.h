@@ -0,0 +1,43 @@
+/*!
+ * @file tunnel.h
+ * @brief Declarations for the multiplexed TCP stream tunnel channel.
+ * @details A tunnel is a single stream channel that carries any number of logical
+ *          TCP connections. Both halves of the channel exchange frames, each of
+ *          which starts with a \c TunnelFrameHeader (all fields in network byte
+ *          order) and is followed by \c length bytes of payload. Frames may be
+ *          batched into a single channel write, and may be split across writes.
+ *
+ *          Frames sent to the tunnel:
+ *          - TUNNEL_FRAME_OPEN: connect a new stream. The payload is the port
+ *            (2 bytes) followed by the NULL-terminated host to connect to.
+ *          - TUNNEL_FRAME_DATA: data to send on the stream's socket.
+ *          - TUNNEL_FRAME_CLOSE: close the stream. No reply is sent.
+ *
+ *          Frames sent by the tunnel:
+ *          - TUNNEL_FRAME_OPENED: the result of a connect (4 bytes). Streams whose
+ *            result is not ERROR_SUCCESS no longer exist.
+ *          - TUNNEL_FRAME_DATA: data that was received on the stream's socket.
+ *          - TUNNEL_FRAME_CLOSE: the stream's connection was closed or failed.
+ *
+ *          Stream identifiers are chosen by the client and are only meaningful
+ *          within the tunnel.
+ */
+#ifndef _METERPRETER_SOURCE_EXTENSION_STDAPI_STDAPI_SERVER_NET_TUNNEL_H
+#define _METERPRETER_SOURCE_EXTENSION_STDAPI_STDAPI_SERVER_NET_TUNNEL_H
+
+#define TUNNEL_FRAME_OPEN       1
+#define TUNNEL_FRAME_OPENED     2
+#define TUNNEL_FRAME_DATA       3
+#define TUNNEL_FRAME_CLOSE      4
+
+/*! @brief Header that precedes every frame in a tunnel. */
+typedef struct _TunnelFrameHeader
+{
+	UINT stream;    ///< Identifier of the stream the frame belongs to.
+	UINT type;      ///< One of the TUNNEL_FRAME_* values.
+	UINT length;    ///< Number of payload bytes that follow the header.
+} TunnelFrameHeader;
+
+DWORD request_net_tcp_tunnel_channel_open(Remote *remote, Packet *packet);
+
+#endif
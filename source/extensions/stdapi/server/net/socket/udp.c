@@ -112,7 +112,16 @@ VOID free_udp_context( UdpSocketContext * ctx )
 {
 	dprintf( "[UDP] free_udp_context. ctx=0x%08X", ctx );
 
-	// Close the socket and notification handle
+	// Stop the notification handle first, as on POSIX it's the socket's descriptor
+	if( ctx->sock.notify )
+	{
+		dprintf( "[UDP] free_udp_context. remove_waitable ctx=0x%08X notify=0x%08X", ctx, ctx->sock.notify );
+		// The scheduler calls CloseHandle on our WSACreateEvent() for us
+		scheduler_signal_waitable( ctx->sock.notify, Stop );
+		ctx->sock.notify = NULL;
+	}
+
+	// Close the socket
 	if( ctx->sock.fd )
 	{
 		closesocket( ctx->sock.fd );
@@ -125,14 +134,6 @@ VOID free_udp_context( UdpSocketContext * ctx )
 		ctx->sock.channel = NULL;
 	}
 
-	if( ctx->sock.notify )
-	{
-		dprintf( "[UDP] free_udp_context. remove_waitable ctx=0x%08X notify=0x%08X", ctx, ctx->sock.notify );
-		// The scheduler calls CloseHandle on our WSACreateEvent() for us
-		scheduler_signal_waitable( ctx->sock.notify, Stop );
-		ctx->sock.notify = NULL;
-	}
-
 	// Free the context
 	free( ctx );
 }
@@ -179,7 +180,9 @@ DWORD udp_channel_notify( Remote * remote, UdpClientContext * ctx )
 
 			channel_set_native_io_context( ctx->sock.channel, NULL );
 			
-			Sleep( 250 );
+			// wait out any in flight native write instead of stalling the shard
+			lock_acquire( ctx->sock.channel->lock );
+			lock_release( ctx->sock.channel->lock );
 
 			free_udp_context( ctx );
 
@@ -307,7 +310,12 @@ DWORD request_net_udp_channel_open( Remote * remote, Packet * packet )
 		if( bind( ctx->sock.fd, (SOCKADDR *)&saddr, sizeof(SOCKADDR_IN) ) == SOCKET_ERROR )
 			BREAK_ON_WSAERROR( "[UDP] request_net_udp_channel_open. bind failed" );
 		
+#ifdef _WIN32
 		ctx->sock.notify = WSACreateEvent();
+#else
+		// the scheduler polls the socket itself
+		ctx->sock.notify = ctx->sock.fd;
+#endif
 		if( ctx->sock.notify == WSA_INVALID_EVENT )
 			BREAK_ON_WSAERROR( "[UDP] request_net_udp_channel_open. WSACreateEvent failed" );
 
@@ -319,11 +327,12 @@ DWORD request_net_udp_channel_open( Remote * remote, Packet * packet )
 		chops.native.write   = udp_channel_write;
 		chops.native.close   = udp_channel_close;
 
-		ctx->sock.channel = channel_create_datagram( 0, 0, &chops );
+		ctx->sock.channel = channel_create_datagram( remote, 0, 0, &chops );
 		if( !ctx->sock.channel )
 			BREAK_WITH_ERROR( "[UDP] request_net_udp_channel_open. channel_create_stream failed", ERROR_INVALID_HANDLE );
 
-		scheduler_insert_waitable( ctx->sock.notify, ctx, NULL, (WaitableNotifyRoutine)udp_channel_notify, NULL );
+		channel_set_waitable( ctx->sock.channel, ctx->sock.notify );
+		scheduler_insert_pinned_waitable( remote, ctx->sock.notify, ctx, NULL, (WaitableNotifyRoutine)udp_channel_notify, NULL, channel_get_id( ctx->sock.channel ) );
 
 		packet_add_tlv_uint( response, TLV_TYPE_CHANNEL_ID, channel_get_id(ctx->sock.channel) );
 
@@ -3,6 +3,7 @@
  * regards
  */
 #include "precomp.h"
+#include "stdapi_groups.h"
 
 // include the Reflectiveloader() function, we end up linking back to the metsrv.dll's Init function
 // but this doesnt matter as we wont ever call DLL_METASPLOIT_ATTACH as that is only used by the
@@ -18,6 +19,20 @@ EnableDelayLoadMetSrv();
 // General
 extern DWORD request_general_channel_open(Remote *remote, Packet *packet);
 
+// Methods that change what stdapi_fs_stat reports
+LPCSTR fsChangeMethods[] =
+{
+	"stdapi_fs_delete_dir",
+	"stdapi_fs_delete_file",
+	"stdapi_fs_file_move",
+	"stdapi_fs_copy",
+	"stdapi_fs_mkdir",
+	"core_channel_open",
+	"core_channel_write",
+	"core_channel_close",
+	NULL
+};
+
 Command customCommands[] =
 {
 	// General
@@ -37,26 +52,25 @@ Command customCommands[] =
 	COMMAND_REQ("stdapi_fs_chdir", request_fs_chdir),
 	COMMAND_REQ("stdapi_fs_mkdir", request_fs_mkdir),
 	COMMAND_REQ("stdapi_fs_delete_dir", request_fs_delete_dir),
-	COMMAND_REQ("stdapi_fs_delete_file", request_fs_delete_file),
+	COMMAND_REQ_SCHEMA("stdapi_fs_delete_file", request_fs_delete_file, FsPathRequestSchema),
 	COMMAND_REQ("stdapi_fs_separator", request_fs_separator),
-	COMMAND_REQ("stdapi_fs_stat", request_fs_stat),
-	COMMAND_REQ("stdapi_fs_file_expand_path", request_fs_file_expand_path),
-	COMMAND_REQ("stdapi_fs_file_move", request_fs_file_move),
-	COMMAND_REQ("stdapi_fs_md5", request_fs_md5),
-	COMMAND_REQ("stdapi_fs_sha1", request_fs_sha1),
+	COMMAND_REQ_SCHEMA_CACHED("stdapi_fs_stat", request_fs_stat, FsPathRequestSchema, 2, fsChangeMethods),
+	COMMAND_REQ_SCHEMA("stdapi_fs_file_expand_path", request_fs_file_expand_path, FsPathRequestSchema),
+	COMMAND_REQ_SCHEMA("stdapi_fs_file_move", request_fs_file_move, FsMoveRequestSchema),
+	COMMAND_REQ_SCHEMA("stdapi_fs_copy", request_fs_copy, FsCopyRequestSchema),
+	COMMAND_REQ_SCHEMA("stdapi_fs_md5", request_fs_md5, FsPathRequestSchema),
+	COMMAND_REQ_SCHEMA("stdapi_fs_sha1", request_fs_sha1, FsPathRequestSchema),
 #ifdef _WIN32
 	COMMAND_REQ("stdapi_fs_search", request_fs_search),
+#else
+	COMMAND_REQ_SCHEMA("stdapi_fs_grep", request_fs_grep, FsGrepRequestSchema),
 #endif
 
-	// Process
-	COMMAND_REQ("stdapi_sys_process_attach", request_sys_process_attach),
-	COMMAND_REQ("stdapi_sys_process_close", request_sys_process_close),
-	COMMAND_REQ("stdapi_sys_process_execute", request_sys_process_execute),
-	COMMAND_REQ("stdapi_sys_process_kill", request_sys_process_kill),
-	COMMAND_REQ("stdapi_sys_process_get_processes", request_sys_process_get_processes),
-	COMMAND_REQ("stdapi_sys_process_getpid", request_sys_process_getpid),
-	COMMAND_REQ("stdapi_sys_process_get_info", request_sys_process_get_info),
-	COMMAND_REQ("stdapi_sys_process_wait", request_sys_process_wait),
+#ifndef STDAPI_ON_DEMAND
+	// Process, Sys/config and Net/config, loaded on demand by the STDAPI_ON_DEMAND build
+	STDAPI_SYS_COMMANDS(STDAPI_COMMAND)
+	STDAPI_NET_COMMANDS(STDAPI_COMMAND)
+#endif
 
 #ifdef _WIN32
 	// Image
@@ -107,26 +121,13 @@ Command customCommands[] =
 	COMMAND_REQ("stdapi_registry_set_value_direct", request_registry_set_value_direct),
 #endif
 
-	// Sys/config
-	COMMAND_REQ("stdapi_sys_config_getuid", request_sys_config_getuid),
-	COMMAND_REQ("stdapi_sys_config_sysinfo", request_sys_config_sysinfo),
-	COMMAND_REQ("stdapi_sys_config_rev2self", request_sys_config_rev2self),
-	COMMAND_REQ("stdapi_sys_config_getprivs", request_sys_config_getprivs),
-	COMMAND_REQ("stdapi_sys_config_getenv", request_sys_config_getenv),
 #ifdef _WIN32
+	// Sys/config
 	COMMAND_REQ("stdapi_sys_config_steal_token", request_sys_config_steal_token),
 	COMMAND_REQ("stdapi_sys_config_drop_token", request_sys_config_drop_token),
 	COMMAND_REQ("stdapi_sys_config_getsid", request_sys_config_getsid),
 #endif
 
-	// Net
-	COMMAND_REQ("stdapi_net_config_get_routes", request_net_config_get_routes),
-	COMMAND_REQ("stdapi_net_config_add_route", request_net_config_add_route),
-	COMMAND_REQ("stdapi_net_config_remove_route", request_net_config_remove_route),
-	COMMAND_REQ("stdapi_net_config_get_interfaces", request_net_config_get_interfaces),
-	COMMAND_REQ("stdapi_net_config_get_arp_table", request_net_config_get_arp_table),
-	COMMAND_REQ("stdapi_net_config_get_netstat", request_net_config_get_netstat),
-
 #ifdef WIN32
 	// Proxy
 	COMMAND_REQ("stdapi_net_config_get_proxy", request_net_config_get_proxy_config),
@@ -175,6 +176,18 @@ Command customCommands[] =
 	COMMAND_TERMINATOR
 };
 
+#ifdef STDAPI_ON_DEMAND
+LPCSTR sysMethods[] = { STDAPI_SYS_COMMANDS(STDAPI_METHOD) NULL };
+LPCSTR netMethods[] = { STDAPI_NET_COMMANDS(STDAPI_METHOD) NULL };
+
+/*! @brief Commands that are implemented by images loaded on demand. */
+CommandGroup stdapiGroups[] =
+{
+	{ "stdapi_sys", "ext_server_stdapi_sys", sysMethods },
+	{ "stdapi_net", "ext_server_stdapi_net", netMethods },
+};
+#endif
+
 /*!
  * @brief Initialize the server extension.
  * @param remote Pointer to the remote instance.
@@ -190,6 +203,10 @@ DWORD InitServerExtension(Remote *remote)
 	hMetSrv = remote->met_srv;
 #endif
 	command_register_all(customCommands);
+#ifdef STDAPI_ON_DEMAND
+	command_register_group(&stdapiGroups[0]);
+	command_register_group(&stdapiGroups[1]);
+#endif
 
 	return ERROR_SUCCESS;
 }
@@ -205,6 +222,10 @@ DWORD __declspec(dllexport) DeinitServerExtension(Remote *remote)
 DWORD DeinitServerExtension(Remote *remote)
 #endif
 {
+#ifdef STDAPI_ON_DEMAND
+	command_deregister_group(&stdapiGroups[0]);
+	command_deregister_group(&stdapiGroups[1]);
+#endif
 	command_deregister_all(customCommands);
 
 	return ERROR_SUCCESS;
@@ -0,0 +1,65 @@
+/*!
+ * @file stdapi_groups.h
+ * @brief Commands that stdapi can load on demand.
+ * @remark The system and network configuration commands are also built into
+ *         images of their own on POSIX. ext_server_stdapi carries every command,
+ *         as it always has. ext_server_stdapi_ondemand, built with
+ *         STDAPI_ON_DEMAND, leaves these out and registers stubs that ask for
+ *         their images the first time one of their commands is used. Clients
+ *         only load it if they answer core_loadlib_request, and say so with
+ *         CLIENT_CAPABILITY_LOADLIB_REQUEST. Each list is used to build both the
+ *         command table of an image and the method names the stubs are for.
+ */
+#ifndef _METERPRETER_SOURCE_EXTENSION_STDAPI_STDAPI_GROUPS_H
+#define _METERPRETER_SOURCE_EXTENSION_STDAPI_STDAPI_GROUPS_H
+
+/*!
+ * @brief Builds a \c Command entry from a group list.
+ * @remark Commands with a non-zero \c ttl have their responses cached for that many
+ *         seconds, and \c invalidatedBy lists the methods that flush them.
+ */
+#define STDAPI_COMMAND(name, handler, ttl, invalidatedBy) COMMAND_REQ_CACHED(name, handler, ttl, invalidatedBy),
+/*! @brief Builds a method name entry from a group list. */
+#define STDAPI_METHOD(name, handler, ttl, invalidatedBy) name,
+
+/*!
+ * @brief Methods that change the identity reported by stdapi_sys_config_getuid.
+ * @remark Commands of other extensions that impersonate or elevate the session's
+ *         thread have to be listed here as well, as they flush the cached identity.
+ */
+static LPCSTR stdapiTokenMethods[] =
+{
+	"stdapi_sys_config_rev2self",
+	"stdapi_sys_config_steal_token",
+	"stdapi_sys_config_drop_token",
+	"priv_elevate_getsystem",
+	"incognito_impersonate_token",
+	NULL
+};
+
+/*! @brief Process and system configuration commands, found in ext_server_stdapi_sys. */
+#define STDAPI_SYS_COMMANDS(C) \
+	C("stdapi_sys_process_attach", request_sys_process_attach, 0, NULL) \
+	C("stdapi_sys_process_close", request_sys_process_close, 0, NULL) \
+	C("stdapi_sys_process_execute", request_sys_process_execute, 0, NULL) \
+	C("stdapi_sys_process_kill", request_sys_process_kill, 0, NULL) \
+	C("stdapi_sys_process_get_processes", request_sys_process_get_processes, 0, NULL) \
+	C("stdapi_sys_process_getpid", request_sys_process_getpid, 0, NULL) \
+	C("stdapi_sys_process_get_info", request_sys_process_get_info, 0, NULL) \
+	C("stdapi_sys_process_wait", request_sys_process_wait, 0, NULL) \
+	C("stdapi_sys_config_getuid", request_sys_config_getuid, 30, stdapiTokenMethods) \
+	C("stdapi_sys_config_sysinfo", request_sys_config_sysinfo, 60, NULL) \
+	C("stdapi_sys_config_rev2self", request_sys_config_rev2self, 0, NULL) \
+	C("stdapi_sys_config_getprivs", request_sys_config_getprivs, 0, NULL) \
+	C("stdapi_sys_config_getenv", request_sys_config_getenv, 0, NULL)
+
+/*! @brief Network configuration commands, found in ext_server_stdapi_net. */
+#define STDAPI_NET_COMMANDS(C) \
+	C("stdapi_net_config_get_routes", request_net_config_get_routes, 0, NULL) \
+	C("stdapi_net_config_add_route", request_net_config_add_route, 0, NULL) \
+	C("stdapi_net_config_remove_route", request_net_config_remove_route, 0, NULL) \
+	C("stdapi_net_config_get_interfaces", request_net_config_get_interfaces, 10, NULL) \
+	C("stdapi_net_config_get_arp_table", request_net_config_get_arp_table, 0, NULL) \
+	C("stdapi_net_config_get_netstat", request_net_config_get_netstat, 0, NULL)
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Entry points of the stdapi network configuration image. stdapi registers
+ * stubs for these commands and asks for this image the first time one of
+ * them is used.
+ */
+#include "precomp.h"
+#include "stdapi_groups.h"
+
+Command customCommands[] =
+{
+	STDAPI_NET_COMMANDS(STDAPI_COMMAND)
+	COMMAND_TERMINATOR
+};
+
+/*!
+ * @brief Initialize the server extension.
+ * @param remote Pointer to the remote instance.
+ * @return Indication of success or failure.
+ */
+DWORD InitServerExtension(Remote *remote)
+{
+	command_register_all(customCommands);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Deinitialize the server extension.
+ * @param remote Pointer to the remote instance.
+ * @return Indication of success or failure.
+ */
+DWORD DeinitServerExtension(Remote *remote)
+{
+	command_deregister_all(customCommands);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Get the name of the extension.
+ * @param buffer Pointer to the buffer to write the name to.
+ * @param bufferSize Size of the \c buffer parameter.
+ * @return Indication of success or failure.
+ */
+DWORD GetExtensionName(char* buffer, int bufferSize)
+{
+	strncpy(buffer, "stdapi_net", bufferSize - 1);
+	return ERROR_SUCCESS;
+}
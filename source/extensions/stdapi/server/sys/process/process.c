@@ -280,7 +280,7 @@ DWORD request_sys_process_execute(Remote *remote, Packet *packet)
 			chops.read = process_channel_read;
 
 			// Allocate the pool channel
-			if (!(newChannel = channel_create_pool(0, CHANNEL_FLAG_SYNCHRONOUS, &chops)))
+			if (!(newChannel = channel_create_pool(remote, 0, CHANNEL_FLAG_SYNCHRONOUS, &chops)))
 			{
 				result = ERROR_NOT_ENOUGH_MEMORY;
 				break;
@@ -684,7 +684,7 @@ DWORD request_sys_process_execute(Remote *remote, Packet *packet)
 			chops.read            = process_channel_read;
 
 			// Allocate the pool channel
-			if (!(newChannel = channel_create_pool(0, CHANNEL_FLAG_SYNCHRONOUS, &chops)))
+			if (!(newChannel = channel_create_pool(remote, 0, CHANNEL_FLAG_SYNCHRONOUS, &chops)))
 			{
 				result = ERROR_NOT_ENOUGH_MEMORY;
 				break;
@@ -1147,6 +1147,41 @@ DWORD process_channel_interact_destroy( HANDLE waitable, LPVOID entryContext, LP
 	return dwResult;
 }
 
+/*
+ * Reads pending output from the standard output handle of a process straight
+ * into the channel data of an outgoing core_channel_write packet
+ */
+static DWORD process_channel_output_fill(Channel *channel, LPVOID context,
+	PUCHAR buffer, ULONG bufferSize, PULONG bytesFilled)
+{
+	ProcessChannelContext *ctx = (ProcessChannelContext *)context;
+	DWORD result = ERROR_SUCCESS;
+#ifdef _WIN32
+	DWORD bytesRead = 0;
+
+	if( !ReadFile( ctx->pStdout, buffer, bufferSize, &bytesRead, NULL ) )
+		result = GetLastError();
+
+	*bytesFilled = bytesRead;
+#else
+	int bytesRead = read( ctx->pStdout, buffer, bufferSize );
+
+	*bytesFilled = 0;
+
+	if( bytesRead > 0 ) {
+		dprintf("bytesRead: %d, errno: %d", bytesRead, errno);
+		*bytesFilled = bytesRead;
+	}
+	else if( bytesRead == 0 ) {
+		result = ECONNRESET;
+	}
+	else if( errno != EINTR && errno != EWOULDBLOCK && errno != EAGAIN ) {
+		result = errno;
+	}
+#endif
+	return result;
+}
+
 /*
  * Callback for when data is available on the standard output handle of
  * a process channel that is interactive mode
@@ -1155,8 +1190,7 @@ DWORD process_channel_interact_notify(Remote *remote, LPVOID entryContext, LPVOI
 {
 	Channel *channel = (Channel*)entryContext;
 	ProcessChannelContext *ctx = (ProcessChannelContext *)threadContext;
-	DWORD bytesRead, bytesAvail = 0;
-	CHAR buffer[16384];
+	DWORD bytesAvail = 0;
 	DWORD result = ERROR_SUCCESS;
 
 #ifdef _WIN32
@@ -1164,45 +1198,28 @@ DWORD process_channel_interact_notify(Remote *remote, LPVOID entryContext, LPVOI
 	{
 		if( bytesAvail )
 		{
-			if( ReadFile( ctx->pStdout, buffer, sizeof(buffer) - 1, &bytesRead, NULL ) )
-			{
-				return channel_write( channel, remote, NULL, 0, buffer, bytesRead, NULL );
-			}
+			result = channel_write_fill( channel, remote, PROCESS_CHANNEL_OUTPUT_SIZE,
+				process_channel_output_fill, ctx, NULL );
 		}
 		else
 		{
-			// sf: if no data is available on the pipe we sleep to avoid running a tight loop
-			// in this thread, as anonymous pipes won't block for data to arrive.
-			Sleep( 100 );
+			// sf: if no data is available on the pipe we back off to avoid running a tight loop,
+			// as anonymous pipes won't block for data to arrive. The waitable shares its shard
+			// with others, so rather than sleeping here the scheduler polls it again later.
+			scheduler_delay_waitable( ctx->pStdout, 100 );
 		}
 	}
-#else
-	bytesRead = read ( ctx->pStdout, buffer, sizeof(buffer) - 1);
-
-	if ( bytesRead > 0 )
-
+	else
 	{
-		dprintf("bytesRead: %d, errno: %d", bytesRead, errno);
-
-		result = channel_write ( channel, remote, NULL, 0, buffer, bytesRead, NULL );
-	}
-
-	if(bytesRead == -1) {
-		if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
-			errno = ERROR_SUCCESS;
-		}
-	}
-
-	if(bytesRead == 0) {
-		errno = ECONNRESET;
+		result = GetLastError();
 	}
-
-	if(bytesRead <= 0) result = errno;
-
+#else
+	result = channel_write_fill( channel, remote, PROCESS_CHANNEL_OUTPUT_SIZE,
+		process_channel_output_fill, ctx, NULL );
 #endif
-	if( GetLastError() != ERROR_SUCCESS )
+	if( result != ERROR_SUCCESS )
 	{
-		dprintf("Closing down socket: errno: %d\n", errno);
+		dprintf("Closing down socket: result: %d\n", result);
 		process_channel_close( channel, NULL, ctx );
 		channel_close( channel, remote, NULL, 0, NULL );
 	}
@@ -1225,9 +1242,10 @@ DWORD process_channel_interact(Channel *channel, Packet *request, LPVOID context
 	if (interact) {
 		// try to resume it first, if it's not there, we can create a new entry
 		if( (result = scheduler_signal_waitable( ctx->pStdout, Resume )) == ERROR_NOT_FOUND ) {
-			result = scheduler_insert_waitable( ctx->pStdout, channel, context,
+			channel_set_waitable( channel, ctx->pStdout );
+			result = scheduler_insert_pinned_waitable( channel_get_remote( channel ), ctx->pStdout, channel, context,
 				(WaitableNotifyRoutine)process_channel_interact_notify,
-				(WaitableDestroyRoutine)process_channel_interact_destroy );
+				(WaitableDestroyRoutine)process_channel_interact_destroy, channel_get_id( channel ) );
 		}
 	} else { // Otherwise, pause it
 		result = scheduler_signal_waitable( ctx->pStdout, Pause );
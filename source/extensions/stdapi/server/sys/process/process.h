@@ -11,6 +11,11 @@ typedef struct _ProcessChannelContext
 	HANDLE pProcess;
 } ProcessChannelContext;
 
+/*
+ * Maximum amount of process output forwarded per interactive notification
+ */
+#define PROCESS_CHANNEL_OUTPUT_SIZE 16384
+
 DWORD process_channel_read(Channel *channel, Packet *request, 
 		LPVOID context, LPVOID buffer, DWORD bufferSize, LPDWORD bytesRead);
 DWORD process_channel_write(Channel *channel, Packet *request, 
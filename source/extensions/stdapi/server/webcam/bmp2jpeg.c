@@ -126,14 +126,11 @@ int ReadOK(bmp_source_ptr sinfo, char* buffer,int len)
 /*
  * Like ReadOK, this would read from a file. But we aren't reading a file.
  * So, return the current byte in the buf and inc the pointer.
- * WARNING: I don't think this function is working. (My guess: read_offset++)
- * However, it just so happens since Windows 7 (and I think all the windows)
- * screenshots always return a 32 bit BMP, the code never calls this function.
- *
+ * Only the colormap of 8 bit BMPs is read this way.
  */
 int read_byte (bmp_source_ptr sinfo)
 {
-	return (int)sinfo->pub.input_buf + sinfo->pub.read_offset++;
+	return ((PBYTE)sinfo->pub.input_buf)[sinfo->pub.read_offset++];
 }
 
 /*
@@ -251,10 +248,34 @@ return (r << 16) | (b << 8) | g;
 
 
 /*
- * Read one row of pixels.
- * The image has been read into the whole_image array, but is otherwise
- * unprocessed.  We must read it out in top-to-bottom row order, and if
- * it is an 8-bit image, we must expand colormapped pixels to 24bit format.
+ * Work out how many rows the next call to get_pixel_rows hands over. The
+ * image is read straight out of the BMP, as many rows at a time as fit in
+ * the buffer, so nothing is copied besides the conversion to RGB.
+ */
+static JDIMENSION bmp_row_count (j_compress_ptr cinfo, bmp_source_ptr source)
+{
+  JDIMENSION rows = cinfo->image_height - cinfo->next_scanline;
+
+  if (rows > source->pub.buffer_height)
+    rows = source->pub.buffer_height;
+
+  return rows;
+}
+
+/*
+ * Get the next row of the BMP. Rows are stored bottom-up, so they are
+ * read backwards from the row the image (or strip of it) starts at.
+ */
+static JSAMPROW bmp_next_row (bmp_source_ptr source)
+{
+  source->source_row--;
+
+  return (JSAMPROW) ((PBYTE)source->pub.input_buf + source->pub.read_offset +
+    (size_t)source->source_row * source->row_width);
+}
+
+/*
+ * Read some rows of pixels, expanding colormapped pixels to 24bit format.
  *
  * NOTE: Again, windows might only ever use 32bit BMP's making this function
  * useless. However, I'll leave it here until I can confirm that.
@@ -267,28 +288,25 @@ JDIMENSION get_8bit_row (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
 {
   bmp_source_ptr source = (bmp_source_ptr) sinfo;
   register JSAMPARRAY colormap = source->colormap;
-  JSAMPARRAY image_ptr;
   register int t;
   register JSAMPROW inptr, outptr;
   register JDIMENSION col;
+  JDIMENSION rows = bmp_row_count(cinfo, source);
+  JDIMENSION row;
 
-  /* Fetch next row from virtual array */
-  source->source_row--;
-  image_ptr = (*cinfo->mem->access_virt_sarray)
-    ((j_common_ptr) cinfo, source->whole_image,
-     source->source_row, (JDIMENSION) 1, FALSE);
-
-  /* Expand the colormap indexes to real data */
-  inptr = image_ptr[0];
-  outptr = source->pub.buffer[0];
-  for (col = cinfo->image_width; col > 0; col--) {
-    t = GETJSAMPLE(*inptr++);
-    *outptr++ = colormap[0][t];	/* can omit GETJSAMPLE() safely */
-    *outptr++ = colormap[1][t];
-    *outptr++ = colormap[2][t];
+  for (row = 0; row < rows; row++) {
+    /* Expand the colormap indexes to real data */
+    inptr = bmp_next_row(source);
+    outptr = source->pub.buffer[row];
+    for (col = cinfo->image_width; col > 0; col--) {
+      t = GETJSAMPLE(*inptr++);
+      *outptr++ = colormap[0][t];	/* can omit GETJSAMPLE() safely */
+      *outptr++ = colormap[1][t];
+      *outptr++ = colormap[2][t];
+    }
   }
 
-  return 1;
+  return rows;
 }
 
 /*
@@ -298,6 +316,12 @@ JDIMENSION get_8bit_row (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
  *  True Color (32 bit)
  *  Who the hell would use High Color? PDA's?
  *
+ * The colors come out exactly as rgb16_to_rgb32 has always made them,
+ * without calling it for every pixel: its 0RBG result lands in the output
+ * as R, B, G. The bytes of each pixel are also still put together the way
+ * they were as signed chars, so a low byte of 0x80 or more wipes out the
+ * high one.
+ *
  * NOTE: cjpeg_source_ptr sinfo is really a BMP ptr.
  *
  * Dev notes:
@@ -309,44 +333,33 @@ JDIMENSION get_8bit_row (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
 JDIMENSION get_16bit_row (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
 {
   bmp_source_ptr source = (bmp_source_ptr) sinfo;
-  JSAMPARRAY image_ptr;
   register JSAMPROW inptr, outptr;
   register JDIMENSION col;
-  unsigned long bit32_pix;
-  char a,b;
-  char *pix_ptr;
-  /* Fetch next row from virtual array */
-  source->source_row--;
-  image_ptr = (*cinfo->mem->access_virt_sarray)
-    ((j_common_ptr) cinfo, source->whole_image,
-     source->source_row, (JDIMENSION) 1, FALSE);
+  register unsigned int pix;
+  JDIMENSION rows = bmp_row_count(cinfo, source);
+  JDIMENSION row;
 
-  /* Transfer data.  Note source values are in BGR order
-   * (even though Microsoft's own documents say the opposite).
-   */
-  inptr = image_ptr[0];
-  outptr = source->pub.buffer[0];
-  for (col = cinfo->image_width; col > 0; col--) {
-    // Need to pull 16 bits at a time.
-	a = *inptr++; // First 8
-	b = *inptr++; // Second 8
-	bit32_pix = rgb16_to_rgb32( a << 8 | b ); //Send all 16bits to be converted
-	pix_ptr = (char *)&bit32_pix;
-    outptr[2] = *pix_ptr++;
-    outptr[1] = *pix_ptr++;
-    outptr[0] = *pix_ptr++;
-    outptr += 3;
+  for (row = 0; row < rows; row++) {
+    inptr = bmp_next_row(source);
+    outptr = source->pub.buffer[row];
+    for (col = cinfo->image_width; col > 0; col--) {
+      pix = (inptr[1] & 0x80) ? (0xFF00 | inptr[1]) : ((inptr[0] << 8) | inptr[1]);
+      outptr[0] = (JSAMPLE) ((pix & 0x003E) << 2);
+      outptr[1] = (JSAMPLE) ((pix & 0xF800) >> 8);
+      outptr[2] = (JSAMPLE) ((pix & 0x07C0) >> 3);
+      inptr += 2;
+      outptr += 3;
+    }
   }
 
-  return 1;
+  return rows;
 }
 
 
 
 /*
  *
- * NOTE: Again, windows might only ever use 32bit BMP's making this function
- * useless. However, I'll leave it here until I can confirm that.
+ * This is what the webcam hands us.
  *
  * NOTE: cjpeg_source_ptr sinfo is really a BMP ptr.
  */
@@ -355,35 +368,40 @@ JDIMENSION get_24bit_row (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
 /* This version is for reading 24-bit pixels */
 {
   bmp_source_ptr source = (bmp_source_ptr) sinfo;
-  JSAMPARRAY image_ptr;
-  register JSAMPROW inptr, outptr;
-  register JDIMENSION col;
-
-  /* Fetch next row from virtual array */
-  source->source_row--;
-  image_ptr = (*cinfo->mem->access_virt_sarray)
-    ((j_common_ptr) cinfo, source->whole_image,
-     source->source_row, (JDIMENSION) 1, FALSE);
+  register JSAMPROW inptr, outptr, end;
+  JDIMENSION rows = bmp_row_count(cinfo, source);
+  JDIMENSION row;
 
   /* Transfer data.  Note source values are in BGR order
    * (even though Microsoft's own documents say the opposite).
    */
-  inptr = image_ptr[0];
-  outptr = source->pub.buffer[0];
-  for (col = cinfo->image_width; col > 0; col--) {
-    outptr[2] = *inptr++;	/* can omit GETJSAMPLE() safely */
-    outptr[1] = *inptr++;
-    outptr[0] = *inptr++;
-    outptr += 3;
+  for (row = 0; row < rows; row++) {
+    inptr = bmp_next_row(source);
+    outptr = source->pub.buffer[row];
+    end = outptr + cinfo->image_width * 3;
+    while (outptr < end) {
+      outptr[0] = inptr[2];	/* can omit GETJSAMPLE() safely */
+      outptr[1] = inptr[1];
+      outptr[2] = inptr[0];
+      inptr += 3;
+      outptr += 3;
+    }
   }
 
-  return 1;
+  return rows;
 }
 
+/*
+ * Swap a BGRX pixel, read as a little endian DWORD, around to RGB in the
+ * low three bytes.
+ */
+#define BGRX_TO_RGB(p) ((((p) & 0xFF) << 16) | ((p) & 0xFF00) | (((p) >> 16) & 0xFF))
+
 /*
  *
- * NOTE: Again, windows might only ever use 32bit BMP's making this function
- * useless. However, I'll leave it here until I can confirm that.
+ * NOTE: This is the one GDI gives screenshots in. Four pixels at a time
+ * are read as DWORDs and written back out as three, dropping the alpha
+ * channel as they go.
  *
  * NOTE: cjpeg_source_ptr sinfo is really a BMP ptr.
  */
@@ -391,81 +409,37 @@ JDIMENSION get_32bit_row (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
 /* This version is for reading 32-bit pixels */
 {
   bmp_source_ptr source = (bmp_source_ptr) sinfo;
-  JSAMPARRAY image_ptr;
   register JSAMPROW inptr, outptr;
   register JDIMENSION col;
-
-  /* Fetch next row from virtual array */
-  source->source_row--;
-  image_ptr = (*cinfo->mem->access_virt_sarray)
-    ((j_common_ptr) cinfo, source->whole_image,
-     source->source_row, (JDIMENSION) 1, FALSE);
-  /* Transfer data.  Note source values are in BGR order
-   * (even though Microsoft's own documents say the opposite).
-   */
-  inptr = image_ptr[0];
-  outptr = source->pub.buffer[0];
-  for (col = cinfo->image_width; col > 0; col--) {
-    outptr[2] = *inptr++;	/* can omit GETJSAMPLE() safely */
-    outptr[1] = *inptr++;
-    outptr[0] = *inptr++;
-	*inptr++; // Skip the 4th bit (Alpha Channel)
-    outptr += 3;
-  }
-  return 1;
-}
-
-
-/*
- * This method loads the image into whole_image during the first call on
- * get_pixel_rows.  The get_pixel_rows pointer is then adjusted to call
- * get_8bit_row, get_24bit_row or get_32bit_row on subsequent calls.
- * This will not copy the image header info. Just the raw image data.
- */
-JDIMENSION preload_image (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
-{
-  bmp_source_ptr source = (bmp_source_ptr) sinfo;
-//  register FILE *infile = source->pub.input_file;
-//  register int c;
-  register JSAMPROW out_ptr;
-  JSAMPARRAY image_ptr;
+  DWORD in[4], out[3];
+  JDIMENSION rows = bmp_row_count(cinfo, source);
   JDIMENSION row;
 
-  /* Read the data into a virtual array in input-file row order. */
-
-
-  for (row = 0; row < cinfo->image_height; row++) {
-    image_ptr = (*cinfo->mem->access_virt_sarray)
-      ((j_common_ptr) cinfo, source->whole_image,
-       row, (JDIMENSION) 1, TRUE);
-    out_ptr = image_ptr[0];
-
-	// Copy the bmp data
-	memcpy(out_ptr, source->pub.input_buf + source->pub.read_offset, source->row_width);
-	source->pub.read_offset += source->row_width;
-  }
-
-  /* Set up to read from the virtual array in top-to-bottom order */
-  switch (source->bits_per_pixel) {
-  case 8:
-    source->pub.get_pixel_rows = get_8bit_row;
-    break;
-  case 16:
-    source->pub.get_pixel_rows = get_16bit_row;
-    break;
-  case 24:
-    source->pub.get_pixel_rows = get_24bit_row;
-    break;
-  case 32:
-    source->pub.get_pixel_rows = get_32bit_row;
-    break;
-  default:
-    return 0; //ERREXIT(cinfo, JERR_BMP_BADDEPTH);
+  for (row = 0; row < rows; row++) {
+    inptr = bmp_next_row(source);
+    outptr = source->pub.buffer[row];
+    for (col = cinfo->image_width; col >= 4; col -= 4) {
+      memcpy(in, inptr, sizeof(in));
+      in[0] = BGRX_TO_RGB(in[0]);
+      in[1] = BGRX_TO_RGB(in[1]);
+      in[2] = BGRX_TO_RGB(in[2]);
+      in[3] = BGRX_TO_RGB(in[3]);
+      out[0] = in[0] | (in[1] << 24);
+      out[1] = (in[1] >> 8) | (in[2] << 16);
+      out[2] = (in[2] >> 16) | (in[3] << 8);
+      memcpy(outptr, out, sizeof(out));
+      inptr += sizeof(in);
+      outptr += sizeof(out);
+    }
+    for (; col > 0; col--) {
+      outptr[0] = inptr[2];
+      outptr[1] = inptr[1];
+      outptr[2] = inptr[0];
+      inptr += 4; // Skip the 4th byte (Alpha Channel)
+      outptr += 3;
+    }
   }
-  source->source_row = cinfo->image_height;
-
-  /* And read the first row */
-  return (*source->pub.get_pixel_rows) (cinfo, sinfo);
+  return rows;
 }
 
 
@@ -555,6 +529,8 @@ void start_input_bmp (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
     biYPelsPerMeter = GET_4B(bmpinfoheader,28);
     biClrUsed = GET_4B(bmpinfoheader,32);
 
+    if (source->bits_per_pixel == 8)
+      mapentrysize = 4;		/* Windows uses RGBQUAD colormap */
     if (biCompression != 0)
       return;
 
@@ -654,17 +630,30 @@ void start_input_bmp (j_compress_ptr cinfo, cjpeg_source_ptr sinfo)
   while ((row_width & 3) != 0) row_width++;
   source->row_width = row_width;
 
-  /* Allocate space for inversion array, prepare for preload pass */
-  source->whole_image = (*cinfo->mem->request_virt_sarray)
-    ((j_common_ptr) cinfo, JPOOL_IMAGE, FALSE,
-     row_width, (JDIMENSION) biHeight, (JDIMENSION) 1);
-  source->pub.get_pixel_rows = preload_image;
+  /* Rows are read straight out of buf, starting from the top one */
+  switch (source->bits_per_pixel) {
+  case 8:
+    source->pub.get_pixel_rows = get_8bit_row;
+    break;
+  case 16:
+    source->pub.get_pixel_rows = get_16bit_row;
+    break;
+  case 24:
+    source->pub.get_pixel_rows = get_24bit_row;
+    break;
+  case 32:
+    source->pub.get_pixel_rows = get_32bit_row;
+    break;
+  default:
+    return; //ERREXIT(cinfo, JERR_BMP_BADDEPTH);
+  }
+  source->source_row = (JDIMENSION) biHeight;
 
-  /* Allocate one-row buffer for returned data */
+  /* Allocate a buffer for a batch of returned rows */
   source->pub.buffer = (*cinfo->mem->alloc_sarray)
     ((j_common_ptr) cinfo, JPOOL_IMAGE,
-     (JDIMENSION) (biWidth * 3), (JDIMENSION) 1);
-  source->pub.buffer_height = 1;
+     (JDIMENSION) (biWidth * 3), (JDIMENSION) BMP_ROWS_PER_CALL);
+  source->pub.buffer_height = BMP_ROWS_PER_CALL;
 
   cinfo->in_color_space = JCS_RGB;
   cinfo->input_components = 3;
@@ -699,6 +688,7 @@ cjpeg_source_ptr jinit_read_bmp (j_compress_ptr cinfo)
   source->cinfo = cinfo;	/* make back link for subroutines */
   /* Fill in method ptrs, except get_pixel_rows which start_input sets */
   source->pub.start_input = start_input_bmp;
+  source->pub.get_pixel_rows = NULL;
   source->pub.finish_input = finish_input_bmp;
 
   return (cjpeg_source_ptr) source;
@@ -706,56 +696,66 @@ cjpeg_source_ptr jinit_read_bmp (j_compress_ptr cinfo)
 
 
 /*
- * See: http://msdn.microsoft.com/en-us/library/dd145119%28VS.85%29.aspx
- * This function was copied from the MSDN example.
- * It was then modified to send the BMP data rather than save to disk
- * It was then modified to conver the BMP to JPEG and send
- * Now its realy big.
+ * One horizontal strip of the image, compressed on its own. Every strip
+ * but the last is a whole number of MCU rows high and restart_interval is
+ * set to one strip's worth of MCUs, so the strips' entropy coded data can
+ * be spliced together with RSTn markers in between. The result is exactly
+ * what libjpeg would produce for the whole image with the same restart
+ * interval.
  */
-int bmp2jpeg(PBYTE buf, int quality, BYTE ** buf_jpeg, DWORD * buf_jpeg_size )
+typedef struct _BmpStrip
 {
+	PBYTE buf;
+	int quality;
+	JDIMENSION first_row;
+	JDIMENSION rows;
+	unsigned int restart_interval;
+	BYTE * jpeg;
+	DWORD jpeg_size;
+	THREAD * thread;
+} BmpStrip;
 
-	// Convert to JPEG stuff
+/*
+ * Compress the rows of strip->buf from first_row on into strip->jpeg.
+ */
+static int bmp2jpeg_strip(BmpStrip * strip)
+{
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
-    cjpeg_source_ptr src_mgr;
-    JDIMENSION num_scanlines;
-
-
-	// JPEG conversion start here..'
-	// buf is a pointer to a BMP in memory.
-
-	/* Initialize JPEG parameters.
-     * Much of this may be overridden later.
-     * We need to provide some value for jpeg_set_defaults() to work.
-     */
+	cjpeg_source_ptr src_mgr;
+	JDIMENSION num_scanlines;
 
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
-    cinfo.in_color_space = JCS_RGB; /* arbitrary guess */
-    jpeg_set_defaults(&cinfo);
+	cinfo.in_color_space = JCS_RGB; /* arbitrary guess */
+	jpeg_set_defaults(&cinfo);
 
 	src_mgr = jinit_read_bmp(&cinfo); //Returns a cjpeg_source_ptr but is really bmp_source_ptr...
 
-	src_mgr->input_buf = buf;
+	src_mgr->input_buf = strip->buf;
 	src_mgr->read_offset = 0;
-    /* Read the input file header to obtain file size & colorspace. */
 
+	/* Read the input file header to obtain file size & colorspace. */
 	start_input_bmp(&cinfo, src_mgr);
+	if (src_mgr->get_pixel_rows == NULL) {
+		jpeg_destroy_compress(&cinfo);
+		return 0;
+	}
 
-    jpeg_default_colorspace(&cinfo);
+	if (strip->rows) {
+		((bmp_source_ptr)src_mgr)->source_row -= strip->first_row;
+		cinfo.image_height = strip->rows;
+	}
 
-	// TODO: accept options from the command line for grayscale and quality.
-	/* Go GRAYSCALE */
-	//jpeg_set_colorspace(&cinfo, JCS_GRAYSCALE);
-	/* Quality */
-	jpeg_set_quality(&cinfo, quality, FALSE);
+	jpeg_default_colorspace(&cinfo);
+	jpeg_set_quality(&cinfo, strip->quality, FALSE);
+	cinfo.restart_interval = strip->restart_interval;
 
-	// Write the compressed JPEG to memory: bug_jpeg
-	jpeg_mem_dest(&cinfo, buf_jpeg, buf_jpeg_size);
+	// Write the compressed JPEG to memory: buf_jpeg
+	jpeg_mem_dest(&cinfo, &strip->jpeg, &strip->jpeg_size);
 
-    /* Start compressor */
-    jpeg_start_compress(&cinfo, TRUE);
+	/* Start compressor */
+	jpeg_start_compress(&cinfo, TRUE);
 
 	/* Process data */
 	while (cinfo.next_scanline < cinfo.image_height) {
@@ -768,5 +768,258 @@ int bmp2jpeg(PBYTE buf, int quality, BYTE ** buf_jpeg, DWORD * buf_jpeg_size )
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
 
-    return 1;
+	return 1;
+}
+
+/*
+ * Thread entry point for the strips after the first one.
+ */
+static DWORD THREADCALL bmp2jpeg_strip_thread(THREAD * thread)
+{
+	BmpStrip * strip = (BmpStrip *)thread->parameter1;
+
+	return bmp2jpeg_strip(strip) ? ERROR_SUCCESS : ERROR_INVALID_DATA;
+}
+
+/*
+ * Find where the entropy coded data of a JPEG starts, that is just after
+ * its SOS segment.
+ */
+static DWORD jpeg_scan_offset(BYTE * jpeg, DWORD size)
+{
+	DWORD offset = 2;
+
+	while (offset + 4 <= size && jpeg[offset] == 0xFF) {
+		BYTE marker = jpeg[offset + 1];
+		DWORD length = (jpeg[offset + 2] << 8) | jpeg[offset + 3];
+
+		offset += 2 + length;
+		if (marker == 0xDA)
+			return offset <= size ? offset : 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Set the image height in the SOF segment of a JPEG.
+ */
+static BOOL jpeg_set_height(BYTE * jpeg, DWORD size, JDIMENSION height)
+{
+	DWORD offset = 2;
+
+	while (offset + 9 <= size && jpeg[offset] == 0xFF) {
+		BYTE marker = jpeg[offset + 1];
+
+		if (marker >= 0xC0 && marker <= 0xC2) {
+			jpeg[offset + 5] = (BYTE)(height >> 8);
+			jpeg[offset + 6] = (BYTE)height;
+			return TRUE;
+		}
+		if (marker == 0xDA)
+			break;
+		offset += 2 + ((jpeg[offset + 2] << 8) | jpeg[offset + 3]);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Join the compressed strips into one JPEG: the headers and data of the
+ * first strip, then the data of each of the others behind an RSTn marker.
+ */
+static int bmp2jpeg_splice(BmpStrip * strips, int count, JDIMENSION height,
+	BYTE ** buf_jpeg, DWORD * buf_jpeg_size)
+{
+	DWORD offsets[BMP_MAX_STRIPS];
+	DWORD size;
+	BYTE * jpeg;
+	int i;
+
+	// Everything but the EOI marker of every strip, an RSTn marker in front
+	// of every strip but the first, and one EOI marker at the end.
+	size = strips[0].jpeg_size - 2;
+	for (i = 1; i < count; i++) {
+		offsets[i] = jpeg_scan_offset(strips[i].jpeg, strips[i].jpeg_size);
+		if (offsets[i] == 0 || offsets[i] + 2 > strips[i].jpeg_size)
+			return 0;
+		size += 2 + strips[i].jpeg_size - offsets[i] - 2;
+	}
+	size += 2;
+
+	jpeg = (BYTE *)malloc(size);
+	if (jpeg == NULL)
+		return 0;
+
+	memcpy(jpeg, strips[0].jpeg, strips[0].jpeg_size - 2);
+	if (!jpeg_set_height(jpeg, size, height)) {
+		free(jpeg);
+		return 0;
+	}
+	size = strips[0].jpeg_size - 2;
+
+	for (i = 1; i < count; i++) {
+		jpeg[size++] = 0xFF;
+		jpeg[size++] = (BYTE)(0xD0 + ((i - 1) & 7));
+		memcpy(jpeg + size, strips[i].jpeg + offsets[i], strips[i].jpeg_size - offsets[i] - 2);
+		size += strips[i].jpeg_size - offsets[i] - 2;
+	}
+
+	jpeg[size++] = 0xFF;
+	jpeg[size++] = 0xD9;
+
+	*buf_jpeg = jpeg;
+	*buf_jpeg_size = size;
+
+	return 1;
+}
+
+/*
+ * Work out how many strips an image is worth splitting into, one per
+ * processor but none less than BMP_MIN_STRIP_ROWS high.
+ */
+static int bmp2jpeg_auto_strips(PBYTE buf)
+{
+	SYSTEM_INFO si;
+	PBITMAPINFOHEADER bmi = (PBITMAPINFOHEADER)(buf + sizeof(BITMAPFILEHEADER));
+	LONG height = bmi->biHeight;
+	int strips;
+
+	GetSystemInfo(&si);
+	strips = (int)si.dwNumberOfProcessors;
+
+	if (bmi->biSize < sizeof(BITMAPINFOHEADER) || height < BMP_MIN_STRIP_ROWS * 2)
+		return 1;
+	if (strips > height / BMP_MIN_STRIP_ROWS)
+		strips = height / BMP_MIN_STRIP_ROWS;
+	if (strips > BMP_MAX_STRIPS)
+		strips = BMP_MAX_STRIPS;
+
+	return strips < 1 ? 1 : strips;
+}
+
+/*
+ * See: http://msdn.microsoft.com/en-us/library/dd145119%28VS.85%29.aspx
+ * This function was copied from the MSDN example.
+ * It was then modified to send the BMP data rather than save to disk
+ * It was then modified to conver the BMP to JPEG and send
+ * Now its realy big.
+ *
+ * The image is split into as many strips as there are processors to
+ * compress them on, see bmp2jpeg_strips.
+ */
+int bmp2jpeg(PBYTE buf, int quality, BYTE ** buf_jpeg, DWORD * buf_jpeg_size )
+{
+	return bmp2jpeg_strips(buf, quality, bmp2jpeg_auto_strips(buf), buf_jpeg, buf_jpeg_size);
+}
+
+/*
+ * Convert the BMP in buf to a JPEG, compressing up to strips horizontal
+ * strips of it at once on their own threads. With a single strip (or one
+ * that is too small to split) the image is compressed in one go as it
+ * always was. The JPEG is allocated with malloc either way.
+ */
+int bmp2jpeg_strips(PBYTE buf, int quality, int strips, BYTE ** buf_jpeg, DWORD * buf_jpeg_size )
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cjpeg_source_ptr src_mgr;
+	BmpStrip strip[BMP_MAX_STRIPS];
+	JDIMENSION height, mcu_height, mcu_width, mcus_per_row, rows;
+	unsigned long interval;
+	int count, i, result = 1;
+
+	memset(strip, 0, sizeof(strip));
+	for (i = 0; i < BMP_MAX_STRIPS; i++) {
+		strip[i].buf = buf;
+		strip[i].quality = quality;
+	}
+
+	if (strips > BMP_MAX_STRIPS)
+		strips = BMP_MAX_STRIPS;
+
+	if (strips <= 1) {
+		if (!bmp2jpeg_strip(&strip[0]))
+			return 0;
+		*buf_jpeg = strip[0].jpeg;
+		*buf_jpeg_size = strip[0].jpeg_size;
+		return 1;
+	}
+
+	// Set up a compressor the way the strips will be set up, just to find
+	// out how big the image and its MCUs are.
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	src_mgr = jinit_read_bmp(&cinfo);
+	src_mgr->input_buf = buf;
+	src_mgr->read_offset = 0;
+	start_input_bmp(&cinfo, src_mgr);
+	if (src_mgr->get_pixel_rows == NULL) {
+		jpeg_destroy_compress(&cinfo);
+		return 0;
+	}
+	jpeg_default_colorspace(&cinfo);
+	mcu_width = mcu_height = 0;
+	for (i = 0; i < cinfo.num_components; i++) {
+		if ((JDIMENSION)cinfo.comp_info[i].h_samp_factor > mcu_width)
+			mcu_width = cinfo.comp_info[i].h_samp_factor;
+		if ((JDIMENSION)cinfo.comp_info[i].v_samp_factor > mcu_height)
+			mcu_height = cinfo.comp_info[i].v_samp_factor;
+	}
+	mcu_width *= DCTSIZE;
+	mcu_height *= DCTSIZE;
+	height = cinfo.image_height;
+	mcus_per_row = (cinfo.image_width + mcu_width - 1) / mcu_width;
+	jpeg_destroy_compress(&cinfo);
+
+	// Strips are whole MCU rows high, and the restart interval a strip's
+	// worth of MCUs, which it has to fit in.
+	rows = (height + strips - 1) / strips;
+	rows = (rows + mcu_height - 1) / mcu_height * mcu_height;
+	interval = (unsigned long)mcus_per_row * (rows / mcu_height);
+	if (interval > 65535 || rows >= height)
+		return bmp2jpeg_strips(buf, quality, 1, buf_jpeg, buf_jpeg_size);
+
+	count = (height + rows - 1) / rows;
+	for (i = 0; i < count; i++) {
+		strip[i].first_row = i * rows;
+		strip[i].rows = (i == count - 1) ? height - strip[i].first_row : rows;
+		strip[i].restart_interval = (unsigned int)interval;
+	}
+
+	for (i = 1; i < count; i++) {
+		strip[i].thread = thread_create(bmp2jpeg_strip_thread, &strip[i], NULL, NULL);
+		if (strip[i].thread && !thread_run(strip[i].thread)) {
+			thread_destroy(strip[i].thread);
+			strip[i].thread = NULL;
+		}
+	}
+
+	// The first strip is done on this thread, along with any that couldn't
+	// get one of their own.
+	for (i = 0; i < count; i++) {
+		if (strip[i].thread == NULL && !bmp2jpeg_strip(&strip[i]))
+			result = 0;
+	}
+
+	for (i = 1; i < count; i++) {
+		if (strip[i].thread) {
+			thread_join(strip[i].thread);
+			thread_destroy(strip[i].thread);
+		}
+		if (strip[i].jpeg == NULL)
+			result = 0;
+	}
+
+	if (result)
+		result = bmp2jpeg_splice(strip, count, height, buf_jpeg, buf_jpeg_size);
+
+	for (i = 0; i < count; i++) {
+		if (strip[i].jpeg)
+			free(strip[i].jpeg);
+	}
+
+	return result;
 }
@@ -46,8 +46,7 @@ typedef struct _bmp_source_struct {
 
   JSAMPARRAY colormap;		/* BMP colormap (converted to my format) */
 
-  jvirt_sarray_ptr whole_image;	/* Needed to reverse row order */
-  JDIMENSION source_row;	/* Current source row number */
+  JDIMENSION source_row;	/* Row after the next one to read, rows are bottom-up */
   JDIMENSION row_width;		/* Physical width of scanlines in file */
 
   int bits_per_pixel;		/* remembers 8- or 24-bit format */
@@ -62,12 +61,19 @@ JDIMENSION get_8bit_row (j_compress_ptr, cjpeg_source_ptr);
 JDIMENSION get_16bit_row (j_compress_ptr, cjpeg_source_ptr);
 JDIMENSION get_24bit_row (j_compress_ptr, cjpeg_source_ptr);
 JDIMENSION get_32bit_row (j_compress_ptr, cjpeg_source_ptr);
-JDIMENSION preload_image (j_compress_ptr, cjpeg_source_ptr);
 void start_input_bmp (j_compress_ptr, cjpeg_source_ptr);
 void finish_input_bmp (j_compress_ptr, cjpeg_source_ptr);
 cjpeg_source_ptr jinit_read_bmp (j_compress_ptr);
 
+// Rows handed to the compressor by each get_pixel_rows call
+#define BMP_ROWS_PER_CALL	16
+// Most strips an image is compressed in at once
+#define BMP_MAX_STRIPS		8
+// Fewest rows worth giving a strip of their own
+#define BMP_MIN_STRIP_ROWS	128
+
 // BMP-screenshot related functions
 int bmp2jpeg(PBYTE buf, int quality, BYTE ** buf_jpeg, DWORD * buf_jpeg_size );
+int bmp2jpeg_strips(PBYTE buf, int quality, int strips, BYTE ** buf_jpeg, DWORD * buf_jpeg_size );
 
 #endif
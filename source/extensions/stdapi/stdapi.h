@@ -26,12 +26,27 @@
 #define TLV_TYPE_FILE_SHORT_NAME                      MAKE_CUSTOM_TLV( TLV_META_TYPE_STRING,  TLV_TYPE_EXTENSION_STDAPI, 1205 )
 
 #define TLV_TYPE_STAT_BUF                             MAKE_CUSTOM_TLV( TLV_META_TYPE_COMPLEX, TLV_TYPE_EXTENSION_STDAPI, 1220 )
+#define TLV_TYPE_STAT_SIZE                            MAKE_CUSTOM_TLV( TLV_META_TYPE_QWORD,   TLV_TYPE_EXTENSION_STDAPI, 1221 )
 
 #define TLV_TYPE_SEARCH_RECURSE                       MAKE_CUSTOM_TLV( TLV_META_TYPE_BOOL,    TLV_TYPE_EXTENSION_STDAPI, 1230 )
 #define TLV_TYPE_SEARCH_GLOB                          MAKE_CUSTOM_TLV( TLV_META_TYPE_STRING,  TLV_TYPE_EXTENSION_STDAPI, 1231 )
 #define TLV_TYPE_SEARCH_ROOT                          MAKE_CUSTOM_TLV( TLV_META_TYPE_STRING,  TLV_TYPE_EXTENSION_STDAPI, 1232 )
 #define TLV_TYPE_SEARCH_RESULTS                       MAKE_CUSTOM_TLV( TLV_META_TYPE_GROUP,   TLV_TYPE_EXTENSION_STDAPI, 1233 )
 
+#define TLV_TYPE_FS_RECURSIVE                         MAKE_CUSTOM_TLV( TLV_META_TYPE_BOOL,    TLV_TYPE_EXTENSION_STDAPI, 1240 )
+#define TLV_TYPE_FS_PROGRESS_ENTRIES                  MAKE_CUSTOM_TLV( TLV_META_TYPE_UINT,    TLV_TYPE_EXTENSION_STDAPI, 1241 )
+#define TLV_TYPE_FS_PROGRESS_BYTES                    MAKE_CUSTOM_TLV( TLV_META_TYPE_QWORD,   TLV_TYPE_EXTENSION_STDAPI, 1242 )
+#define TLV_TYPE_FS_PROGRESS_REQUEST                  MAKE_CUSTOM_TLV( TLV_META_TYPE_STRING,  TLV_TYPE_EXTENSION_STDAPI, 1243 )
+#define TLV_TYPE_FS_FOLLOW                            MAKE_CUSTOM_TLV( TLV_META_TYPE_BOOL,    TLV_TYPE_EXTENSION_STDAPI, 1244 )
+#define TLV_TYPE_FS_GREP_PATTERN                      MAKE_CUSTOM_TLV( TLV_META_TYPE_STRING,  TLV_TYPE_EXTENSION_STDAPI, 1245 )
+#define TLV_TYPE_FS_GREP_REGEX                        MAKE_CUSTOM_TLV( TLV_META_TYPE_BOOL,    TLV_TYPE_EXTENSION_STDAPI, 1246 )
+#define TLV_TYPE_FS_GREP_IGNORE_CASE                  MAKE_CUSTOM_TLV( TLV_META_TYPE_BOOL,    TLV_TYPE_EXTENSION_STDAPI, 1247 )
+#define TLV_TYPE_FS_GREP_MAX_MATCHES                  MAKE_CUSTOM_TLV( TLV_META_TYPE_UINT,    TLV_TYPE_EXTENSION_STDAPI, 1248 )
+#define TLV_TYPE_FS_GREP_MATCH                        MAKE_CUSTOM_TLV( TLV_META_TYPE_GROUP,   TLV_TYPE_EXTENSION_STDAPI, 1249 )
+#define TLV_TYPE_FS_GREP_OFFSET                       MAKE_CUSTOM_TLV( TLV_META_TYPE_QWORD,   TLV_TYPE_EXTENSION_STDAPI, 1250 )
+#define TLV_TYPE_FS_GREP_LINE_NUMBER                  MAKE_CUSTOM_TLV( TLV_META_TYPE_UINT,    TLV_TYPE_EXTENSION_STDAPI, 1251 )
+#define TLV_TYPE_FS_GREP_LINE                         MAKE_CUSTOM_TLV( TLV_META_TYPE_STRING,  TLV_TYPE_EXTENSION_STDAPI, 1252 )
+
 // Process
 
 #define PROCESS_EXECUTE_FLAG_HIDDEN             (1 << 0)
@@ -11,6 +11,7 @@
 #define JPEG_INTERNALS
 #include "jinclude.h"
 #include "jpeglib.h"
+#include "jsimd.h"
 
 
 /* Private subobject */
@@ -420,6 +421,12 @@ jinit_color_converter (j_compress_ptr cinfo)
     if (cinfo->num_components != 3)
       ERREXIT(cinfo, JERR_BAD_J_COLORSPACE);
     if (cinfo->in_color_space == JCS_RGB) {
+#ifdef JSIMD_SUPPORTED
+      if (jsimd_can_rgb_ycc()) {
+	cconvert->pub.color_convert = jsimd_rgb_ycc_convert;
+	break;
+      }
+#endif
       cconvert->pub.start_pass = rgb_ycc_start;
       cconvert->pub.color_convert = rgb_ycc_convert;
     } else if (cinfo->in_color_space == JCS_YCbCr)
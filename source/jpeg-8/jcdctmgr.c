@@ -15,6 +15,7 @@
 #include "jinclude.h"
 #include "jpeglib.h"
 #include "jdct.h"		/* Private declarations for DCT subsystem */
+#include "jsimd.h"
 
 
 /* Private subobject for this module */
@@ -31,6 +32,11 @@ typedef struct {
    */
   DCTELEM * divisors[NUM_QUANT_TBLS];
 
+#ifdef JSIMD_SUPPORTED
+  /* Same as above in the form the SSE2 quantizer uses, see jsimd.c. */
+  UINT16 * simd_divisors[NUM_QUANT_TBLS];
+#endif
+
 #ifdef DCT_FLOAT_SUPPORTED
   /* Same as above for the floating-point case. */
   float_DCT_method_ptr do_float_dct[MAX_COMPONENTS];
@@ -122,6 +128,29 @@ forward_DCT (j_compress_ptr cinfo, jpeg_component_info * compptr,
 }
 
 
+#ifdef JSIMD_SUPPORTED
+
+METHODDEF(void)
+forward_DCT_simd (j_compress_ptr cinfo, jpeg_component_info * compptr,
+		  JSAMPARRAY sample_data, JBLOCKROW coef_blocks,
+		  JDIMENSION start_row, JDIMENSION start_col,
+		  JDIMENSION num_blocks)
+/* This version is used for the SSE2 islow DCT, which quantizes as well. */
+{
+  my_fdct_ptr fdct = (my_fdct_ptr) cinfo->fdct;
+  UINT16 * divisors = fdct->simd_divisors[compptr->quant_tbl_no];
+  JDIMENSION bi;
+
+  sample_data += start_row;	/* fold in the vertical offset once */
+
+  for (bi = 0; bi < num_blocks; bi++, start_col += DCTSIZE)
+    jsimd_fdct_islow_quantize(coef_blocks[bi], sample_data, start_col,
+			      divisors);
+}
+
+#endif /* JSIMD_SUPPORTED */
+
+
 #ifdef DCT_FLOAT_SUPPORTED
 
 METHODDEF(void)
@@ -370,6 +399,18 @@ start_pass_fdctmgr (j_compress_ptr cinfo)
 	dtbl[i] = ((DCTELEM) qtbl->quantval[i]) << 3;
       }
       fdct->pub.forward_DCT[ci] = forward_DCT;
+#ifdef JSIMD_SUPPORTED
+      /* Use SSE2 for plain 8x8 blocks, if the table suits it */
+      if (fdct->do_dct[ci] == jpeg_fdct_islow && jsimd_can_fdct_islow()) {
+	if (fdct->simd_divisors[qtblno] == NULL) {
+	  fdct->simd_divisors[qtblno] = (UINT16 *)
+	    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+					JSIMD_DIVISORS_SIZE * SIZEOF(UINT16));
+	}
+	if (jsimd_compute_divisors(qtbl, fdct->simd_divisors[qtblno]))
+	  fdct->pub.forward_DCT[ci] = forward_DCT_simd;
+      }
+#endif
       break;
 #endif
 #ifdef DCT_IFAST_SUPPORTED
@@ -475,6 +516,9 @@ jinit_forward_dct (j_compress_ptr cinfo)
   /* Mark divisor tables unallocated */
   for (i = 0; i < NUM_QUANT_TBLS; i++) {
     fdct->divisors[i] = NULL;
+#ifdef JSIMD_SUPPORTED
+    fdct->simd_divisors[i] = NULL;
+#endif
 #ifdef DCT_FLOAT_SUPPORTED
     fdct->float_divisors[i] = NULL;
 #endif
@@ -0,0 +1,467 @@
+/*
+ * jsimd.c
+ *
+ * This file is part of the Independent JPEG Group's software, as bundled
+ * with meterpreter.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains SSE2 versions of RGB->YCbCr color conversion
+ * (jccolor.c), the slow-but-accurate integer forward DCT (jfdctint.c) and
+ * coefficient quantization (jcdctmgr.c).  Each one is an exact
+ * reformulation of the C code it stands in for, not an approximation:
+ * the same integer constants are used and every intermediate result is
+ * kept wide enough, so the compressed data is identical either way.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jdct.h"
+#include "jsimd.h"
+
+#ifdef JSIMD_SUPPORTED
+
+#include <emmintrin.h>
+#if defined(_MSC_VER) && defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+
+/*
+ * Check once whether the processor has SSE2.  Every x86-64 processor
+ * does, and GCC only defines __SSE2__ when it was told it may assume it,
+ * so only 32-bit Visual C++ builds need to ask.
+ */
+
+LOCAL(int)
+jsimd_have_sse2 (void)
+{
+#if defined(_MSC_VER) && defined(_M_IX86)
+  static int sse2 = -1;
+  int info[4];
+
+  if (sse2 < 0) {
+    __cpuid(info, 1);
+    sse2 = (info[3] >> 26) & 1;
+  }
+  return sse2;
+#else
+  return 1;
+#endif
+}
+
+
+GLOBAL(int)
+jsimd_can_rgb_ycc (void)
+{
+  return jsimd_have_sse2();
+}
+
+
+GLOBAL(int)
+jsimd_can_fdct_islow (void)
+{
+  return jsimd_have_sse2();
+}
+
+
+/**************** RGB -> YCbCr conversion **************/
+
+/*
+ * The constants are those of rgb_ycc_start() in jccolor.c.  PMADDWD
+ * multiplies pairs of 16-bit values and adds the two products, so each
+ * sum is split into pairs of terms, with the constants that don't fit in
+ * a signed 16-bit value (0.58700 and 0.50000) split in half across two
+ * of them.
+ */
+
+#define SCALEBITS	16
+#define CBCR_OFFSET	((INT32) CENTERJSAMPLE << SCALEBITS)
+#define ONE_HALF	((INT32) 1 << (SCALEBITS-1))
+#define YCC_FIX(x)	((INT32) ((x) * (1L<<SCALEBITS) + 0.5))
+
+#define FIX_Y_R		YCC_FIX(0.29900)
+#define FIX_Y_G1	(YCC_FIX(0.58700) / 2)
+#define FIX_Y_G2	(YCC_FIX(0.58700) - FIX_Y_G1)
+#define FIX_Y_B		YCC_FIX(0.11400)
+#define FIX_CB_R	(-YCC_FIX(0.16874))
+#define FIX_CB_G	(-YCC_FIX(0.33126))
+#define FIX_HALF1	(YCC_FIX(0.50000) / 2)
+#define FIX_HALF2	(YCC_FIX(0.50000) - FIX_HALF1)
+#define FIX_CR_G	(-YCC_FIX(0.41869))
+#define FIX_CR_B	(-YCC_FIX(0.08131))
+
+/* Build a vector of (lo, hi) pairs of 16-bit values */
+#define PAIRS(lo,hi)	_mm_setr_epi16((short) (lo), (short) (hi), \
+				       (short) (lo), (short) (hi), \
+				       (short) (lo), (short) (hi), \
+				       (short) (lo), (short) (hi))
+
+/* Read the four bytes starting at p, whatever their alignment */
+LOCAL(int)
+load_dword (JSAMPROW p)
+{
+  int value;
+
+  MEMCOPY(&value, p, SIZEOF(int));
+  return value;
+}
+
+
+/*
+ * Convert four pixels, one per 32-bit lane with R, G and B in the low
+ * three bytes, leaving Y, Cb and Cr in the low 16 bits of each lane.
+ */
+
+LOCAL(void)
+rgb_ycc_4 (__m128i pixels, __m128i * y, __m128i * cb, __m128i * cr)
+{
+  const __m128i byte0 = _mm_set1_epi32(0x000000FF);
+  const __m128i byte1 = _mm_set1_epi32(0x0000FF00);
+  const __m128i byte2 = _mm_set1_epi32(0x00FF0000);
+  __m128i r, b, rg, gb, rr, bb;
+
+  /* Gather (R,G), (G,B), (R,R) and (B,B) pairs of 16-bit values */
+  r = _mm_and_si128(pixels, byte0);
+  b = _mm_and_si128(_mm_srli_epi32(pixels, 16), byte0);
+  rg = _mm_or_si128(r, _mm_slli_epi32(_mm_and_si128(pixels, byte1), 8));
+  gb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(pixels, 8), byte0),
+		    _mm_and_si128(pixels, byte2));
+  rr = _mm_or_si128(r, _mm_slli_epi32(r, 16));
+  bb = _mm_or_si128(b, _mm_slli_epi32(b, 16));
+
+  *y = _mm_add_epi32(_mm_madd_epi16(rg, PAIRS(FIX_Y_R, FIX_Y_G1)),
+		     _mm_madd_epi16(gb, PAIRS(FIX_Y_G2, FIX_Y_B)));
+  *y = _mm_srli_epi32(_mm_add_epi32(*y, _mm_set1_epi32(ONE_HALF)),
+		      SCALEBITS);
+
+  *cb = _mm_add_epi32(_mm_madd_epi16(rg, PAIRS(FIX_CB_R, FIX_CB_G)),
+		      _mm_madd_epi16(bb, PAIRS(FIX_HALF1, FIX_HALF2)));
+  *cb = _mm_srli_epi32(_mm_add_epi32(*cb,
+		       _mm_set1_epi32(CBCR_OFFSET + ONE_HALF-1)), SCALEBITS);
+
+  *cr = _mm_add_epi32(_mm_madd_epi16(rr, PAIRS(FIX_HALF1, FIX_HALF2)),
+		      _mm_madd_epi16(gb, PAIRS(FIX_CR_G, FIX_CR_B)));
+  *cr = _mm_srli_epi32(_mm_add_epi32(*cr,
+		       _mm_set1_epi32(CBCR_OFFSET + ONE_HALF-1)), SCALEBITS);
+}
+
+
+/*
+ * Convert some rows of samples to the JPEG colorspace, eight pixels at a
+ * time.  Each pixel is fetched as a 32-bit load that takes in the first
+ * byte of the next pixel too, so the last pixel of each row, and any that
+ * don't make up a group of eight, are converted one at a time.
+ */
+
+GLOBAL(void)
+jsimd_rgb_ycc_convert (j_compress_ptr cinfo,
+		       JSAMPARRAY input_buf, JSAMPIMAGE output_buf,
+		       JDIMENSION output_row, int num_rows)
+{
+  JSAMPROW inptr;
+  JSAMPROW outptr0, outptr1, outptr2;
+  JDIMENSION col;
+  JDIMENSION num_cols = cinfo->image_width;
+  __m128i lo, hi, y0, y1, cb0, cb1, cr0, cr1;
+  INT32 r, g, b;
+
+  while (--num_rows >= 0) {
+    inptr = *input_buf++;
+    outptr0 = output_buf[0][output_row];
+    outptr1 = output_buf[1][output_row];
+    outptr2 = output_buf[2][output_row];
+    output_row++;
+
+    for (col = 0; col + 8 < num_cols; col += 8, inptr += 8 * RGB_PIXELSIZE) {
+      lo = _mm_setr_epi32(load_dword(inptr), load_dword(inptr + 3),
+			  load_dword(inptr + 6), load_dword(inptr + 9));
+      hi = _mm_setr_epi32(load_dword(inptr + 12), load_dword(inptr + 15),
+			  load_dword(inptr + 18), load_dword(inptr + 21));
+
+      rgb_ycc_4(lo, &y0, &cb0, &cr0);
+      rgb_ycc_4(hi, &y1, &cb1, &cr1);
+
+      /* Every result is 0..MAXJSAMPLE, so packing can't saturate */
+      y0 = _mm_packs_epi32(y0, y1);
+      cb0 = _mm_packs_epi32(cb0, cb1);
+      cr0 = _mm_packs_epi32(cr0, cr1);
+      _mm_storel_epi64((__m128i *) (outptr0 + col), _mm_packus_epi16(y0, y0));
+      _mm_storel_epi64((__m128i *) (outptr1 + col), _mm_packus_epi16(cb0, cb0));
+      _mm_storel_epi64((__m128i *) (outptr2 + col), _mm_packus_epi16(cr0, cr0));
+    }
+
+    for (; col < num_cols; col++, inptr += RGB_PIXELSIZE) {
+      r = GETJSAMPLE(inptr[RGB_RED]);
+      g = GETJSAMPLE(inptr[RGB_GREEN]);
+      b = GETJSAMPLE(inptr[RGB_BLUE]);
+      outptr0[col] = (JSAMPLE)
+	((YCC_FIX(0.29900) * r + YCC_FIX(0.58700) * g + YCC_FIX(0.11400) * b
+	  + ONE_HALF) >> SCALEBITS);
+      outptr1[col] = (JSAMPLE)
+	((-YCC_FIX(0.16874) * r - YCC_FIX(0.33126) * g + YCC_FIX(0.50000) * b
+	  + CBCR_OFFSET + ONE_HALF-1) >> SCALEBITS);
+      outptr2[col] = (JSAMPLE)
+	((YCC_FIX(0.50000) * r - YCC_FIX(0.41869) * g - YCC_FIX(0.08131) * b
+	  + CBCR_OFFSET + ONE_HALF-1) >> SCALEBITS);
+    }
+  }
+}
+
+
+/**************** Forward DCT and quantization **************/
+
+/*
+ * This is jpeg_fdct_islow() worked on all eight rows (pass 1) or columns
+ * (pass 2) at once, with one 16-bit lane per row or column.  For 8-bit
+ * samples every intermediate sum fits in 16 bits, and every product is
+ * formed by PMADDWD as a 32-bit sum of two products, with the rotations
+ * distributed over those pairs so that no operand exceeds 16 bits.
+ */
+
+#define CONST_BITS  13
+#define PASS1_BITS  2
+
+#define FIX_0_298631336  ((INT32)  2446)
+#define FIX_0_390180644  ((INT32)  3196)
+#define FIX_0_541196100  ((INT32)  4433)
+#define FIX_0_765366865  ((INT32)  6270)
+#define FIX_0_899976223  ((INT32)  7373)
+#define FIX_1_175875602  ((INT32)  9633)
+#define FIX_1_501321110  ((INT32)  12299)
+#define FIX_1_847759065  ((INT32)  15137)
+#define FIX_1_961570560  ((INT32)  16069)
+#define FIX_2_053119869  ((INT32)  16819)
+#define FIX_2_562915447  ((INT32)  20995)
+#define FIX_3_072711026  ((INT32)  25172)
+
+/* Transpose an 8x8 matrix of 16-bit values held one row per register */
+LOCAL(void)
+transpose_8x8 (__m128i * m)
+{
+  __m128i a0, a1, a2, a3, a4, a5, a6, a7;
+  __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+
+  a0 = _mm_unpacklo_epi16(m[0], m[1]);
+  a1 = _mm_unpackhi_epi16(m[0], m[1]);
+  a2 = _mm_unpacklo_epi16(m[2], m[3]);
+  a3 = _mm_unpackhi_epi16(m[2], m[3]);
+  a4 = _mm_unpacklo_epi16(m[4], m[5]);
+  a5 = _mm_unpackhi_epi16(m[4], m[5]);
+  a6 = _mm_unpacklo_epi16(m[6], m[7]);
+  a7 = _mm_unpackhi_epi16(m[6], m[7]);
+
+  b0 = _mm_unpacklo_epi32(a0, a2);
+  b1 = _mm_unpackhi_epi32(a0, a2);
+  b2 = _mm_unpacklo_epi32(a1, a3);
+  b3 = _mm_unpackhi_epi32(a1, a3);
+  b4 = _mm_unpacklo_epi32(a4, a6);
+  b5 = _mm_unpackhi_epi32(a4, a6);
+  b6 = _mm_unpacklo_epi32(a5, a7);
+  b7 = _mm_unpackhi_epi32(a5, a7);
+
+  m[0] = _mm_unpacklo_epi64(b0, b4);
+  m[1] = _mm_unpackhi_epi64(b0, b4);
+  m[2] = _mm_unpacklo_epi64(b1, b5);
+  m[3] = _mm_unpackhi_epi64(b1, b5);
+  m[4] = _mm_unpacklo_epi64(b2, b6);
+  m[5] = _mm_unpackhi_epi64(b2, b6);
+  m[6] = _mm_unpacklo_epi64(b3, b7);
+  m[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+/*
+ * Compute (a * ka + b * kb + fudge) >> shift for each lane, as 32-bit
+ * sums, and narrow the results back to 16 bits.
+ */
+LOCAL(__m128i)
+rotate (__m128i a, __m128i b, __m128i k, __m128i fudge, int shift)
+{
+  __m128i lo, hi;
+
+  lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+  hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+  lo = _mm_srai_epi32(_mm_add_epi32(lo, fudge), shift);
+  hi = _mm_srai_epi32(_mm_add_epi32(hi, fudge), shift);
+  return _mm_packs_epi32(lo, hi);
+}
+
+/*
+ * Same again, for a sum of two such pairs of products.
+ */
+LOCAL(__m128i)
+rotate2 (__m128i a, __m128i b, __m128i k, __m128i c, __m128i d, __m128i l,
+	 __m128i fudge, int shift)
+{
+  __m128i lo, hi;
+
+  lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k),
+		     _mm_madd_epi16(_mm_unpacklo_epi16(c, d), l));
+  hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), k),
+		     _mm_madd_epi16(_mm_unpackhi_epi16(c, d), l));
+  lo = _mm_srai_epi32(_mm_add_epi32(lo, fudge), shift);
+  hi = _mm_srai_epi32(_mm_add_epi32(hi, fudge), shift);
+  return _mm_packs_epi32(lo, hi);
+}
+
+/*
+ * One 1-D pass of the DCT over the eight registers in m, in place.  The
+ * even and odd parts follow jpeg_fdct_islow(), with z1 folded into the
+ * products it is added to.  Pass 1 applies the unsigned->signed
+ * conversion and scales up by PASS1_BITS, pass 2 takes it back out.
+ */
+LOCAL(void)
+fdct_pass (__m128i * m, int pass)
+{
+  __m128i tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+  __m128i fudge;
+  int shift;
+
+  if (pass == 1) {
+    shift = CONST_BITS-PASS1_BITS;
+  } else {
+    shift = CONST_BITS+PASS1_BITS;
+  }
+  fudge = _mm_set1_epi32(ONE << (shift-1));
+
+  /* Even part */
+
+  tmp0 = _mm_add_epi16(m[0], m[7]);
+  tmp1 = _mm_add_epi16(m[1], m[6]);
+  tmp2 = _mm_add_epi16(m[2], m[5]);
+  tmp3 = _mm_add_epi16(m[3], m[4]);
+
+  tmp10 = _mm_add_epi16(tmp0, tmp3);
+  tmp12 = _mm_sub_epi16(tmp0, tmp3);
+  tmp11 = _mm_add_epi16(tmp1, tmp2);
+  tmp13 = _mm_sub_epi16(tmp1, tmp2);
+
+  tmp0 = _mm_sub_epi16(m[0], m[7]);
+  tmp1 = _mm_sub_epi16(m[1], m[6]);
+  tmp2 = _mm_sub_epi16(m[2], m[5]);
+  tmp3 = _mm_sub_epi16(m[3], m[4]);
+
+  if (pass == 1) {
+    m[0] = _mm_slli_epi16(_mm_sub_epi16(_mm_add_epi16(tmp10, tmp11),
+		_mm_set1_epi16(8 * CENTERJSAMPLE)), PASS1_BITS);
+    m[4] = _mm_slli_epi16(_mm_sub_epi16(tmp10, tmp11), PASS1_BITS);
+  } else {
+    tmp10 = _mm_add_epi16(tmp10, _mm_set1_epi16(ONE << (PASS1_BITS-1)));
+    m[0] = _mm_srai_epi16(_mm_add_epi16(tmp10, tmp11), PASS1_BITS);
+    m[4] = _mm_srai_epi16(_mm_sub_epi16(tmp10, tmp11), PASS1_BITS);
+  }
+
+  m[2] = rotate(tmp12, tmp13,
+		PAIRS(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100),
+		fudge, shift);
+  m[6] = rotate(tmp12, tmp13,
+		PAIRS(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065),
+		fudge, shift);
+
+  /* Odd part */
+
+  tmp10 = _mm_add_epi16(tmp0, tmp3);
+  tmp11 = _mm_add_epi16(tmp1, tmp2);
+  tmp12 = _mm_add_epi16(tmp0, tmp2);
+  tmp13 = _mm_add_epi16(tmp1, tmp3);
+
+  m[1] = rotate2(tmp0, tmp10, PAIRS(FIX_1_501321110, - FIX_0_899976223),
+		 tmp12, tmp13,
+		 PAIRS(FIX_1_175875602 - FIX_0_390180644, FIX_1_175875602),
+		 fudge, shift);
+  m[3] = rotate2(tmp1, tmp11, PAIRS(FIX_3_072711026, - FIX_2_562915447),
+		 tmp12, tmp13,
+		 PAIRS(FIX_1_175875602, FIX_1_175875602 - FIX_1_961570560),
+		 fudge, shift);
+  m[5] = rotate2(tmp2, tmp11, PAIRS(FIX_2_053119869, - FIX_2_562915447),
+		 tmp12, tmp13,
+		 PAIRS(FIX_1_175875602 - FIX_0_390180644, FIX_1_175875602),
+		 fudge, shift);
+  m[7] = rotate2(tmp3, tmp10, PAIRS(FIX_0_298631336, - FIX_0_899976223),
+		 tmp12, tmp13,
+		 PAIRS(FIX_1_175875602, FIX_1_175875602 - FIX_1_961570560),
+		 fudge, shift);
+}
+
+
+/*
+ * Compute the table used to quantize by multiplication.  For each divisor
+ * d, the quotient (x + d/2) / d of the C code is ((x + c) * q) >> r, with
+ * the shift split into a high-half multiply by 2^16 and another by
+ * 2^(32-r).  This gives the same quotient for every x up to 32768 and every
+ * d from 3 to 32767; islow divisors are eight times the quantization
+ * values, so only tables with values above 4095 can't use it.
+ */
+
+GLOBAL(boolean)
+jsimd_compute_divisors (JQUANT_TBL * qtbl, UINT16 * dtbl)
+{
+  UINT16 divisor, correction;
+  unsigned long reciprocal, remainder;
+  int i, r;
+
+  for (i = 0; i < DCTSIZE2; i++) {
+    if (qtbl->quantval[i] < 1 || qtbl->quantval[i] > 4095)
+      return FALSE;
+    divisor = (UINT16) (qtbl->quantval[i] << 3);
+
+    for (r = 0; (divisor >> r) > 1; r++)
+      ;
+    r += 16;
+    reciprocal = (1UL << r) / divisor;
+    remainder = (1UL << r) % divisor;
+    correction = (UINT16) (divisor / 2);
+
+    if (remainder == 0) {	/* power of two, keep the reciprocal in 16 bits */
+      reciprocal >>= 1;
+      r--;
+    } else if (remainder <= (unsigned long) divisor / 2) {
+      correction++;
+    } else {
+      reciprocal++;
+    }
+
+    dtbl[i] = (UINT16) reciprocal;
+    dtbl[i + DCTSIZE2] = correction;
+    dtbl[i + DCTSIZE2*2] = (UINT16) (1UL << (32 - r));
+  }
+  return TRUE;
+}
+
+
+GLOBAL(void)
+jsimd_fdct_islow_quantize (JCOEFPTR coef_block, JSAMPARRAY sample_data,
+			   JDIMENSION start_col, UINT16 * dtbl)
+{
+  __m128i m[DCTSIZE];
+  __m128i zero = _mm_setzero_si128();
+  __m128i sign, value;
+  int i;
+
+  for (i = 0; i < DCTSIZE; i++) {
+    m[i] = _mm_loadl_epi64((const __m128i *) (sample_data[i] + start_col));
+    m[i] = _mm_unpacklo_epi8(m[i], zero);
+  }
+
+  /* Pass 1 works on rows and pass 2 on columns, each one lane apiece */
+  transpose_8x8(m);
+  fdct_pass(m, 1);
+  transpose_8x8(m);
+  fdct_pass(m, 2);
+
+  /* Quantize the magnitudes, rounding as forward_DCT() does */
+  for (i = 0; i < DCTSIZE; i++) {
+    sign = _mm_srai_epi16(m[i], 15);
+    value = _mm_sub_epi16(_mm_xor_si128(m[i], sign), sign);
+    value = _mm_add_epi16(value,
+	_mm_loadu_si128((const __m128i *) (dtbl + DCTSIZE2 + i*DCTSIZE)));
+    value = _mm_mulhi_epu16(value,
+	_mm_loadu_si128((const __m128i *) (dtbl + i*DCTSIZE)));
+    value = _mm_mulhi_epu16(value,
+	_mm_loadu_si128((const __m128i *) (dtbl + DCTSIZE2*2 + i*DCTSIZE)));
+    value = _mm_sub_epi16(_mm_xor_si128(value, sign), sign);
+    _mm_storeu_si128((__m128i *) (coef_block + i*DCTSIZE), value);
+  }
+}
+
+#endif /* JSIMD_SUPPORTED */
@@ -0,0 +1,58 @@
+/*
+ * jsimd.h
+ *
+ * This file is part of the Independent JPEG Group's software, as bundled
+ * with meterpreter.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file contains declarations for the SSE2 versions of the routines
+ * that dominate compression time: RGB->YCbCr color conversion and the
+ * slow-but-accurate integer forward DCT together with quantization.
+ * They compute exactly what the portable C code computes, so the output
+ * doesn't depend on which version ran.  The C code is still used wherever
+ * the SSE2 versions can't be: on other processors, for scaled DCTs, and
+ * for quantization tables too coarse for 16-bit arithmetic.
+ *
+ * They are only built when WITH_SIMD is defined.  The prebuilt libraries
+ * under lib/win that ext_server_stdapi links against were built without
+ * it, so define WITH_SIMD when rebuilding them from jpeg.vcxproj to make
+ * bmp2jpeg use these routines.
+ */
+
+#ifdef WITH_SIMD
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#if BITS_IN_JSAMPLE == 8 && RGB_RED == 0 && RGB_GREEN == 1 && RGB_BLUE == 2 && RGB_PIXELSIZE == 3
+#define JSIMD_SUPPORTED
+#endif
+#endif
+#endif
+
+#ifdef JSIMD_SUPPORTED
+
+/* Short forms of external names for systems with brain-damaged linkers. */
+
+#ifdef NEED_SHORT_EXTERNAL_NAMES
+#define jsimd_can_rgb_ycc		jSCanRGBYCC
+#define jsimd_can_fdct_islow		jSCanFDislow
+#define jsimd_rgb_ycc_convert		jSRGBYCC
+#define jsimd_compute_divisors		jSDivisors
+#define jsimd_fdct_islow_quantize	jSFDislowQ
+#endif /* NEED_SHORT_EXTERNAL_NAMES */
+
+/* Number of UINT16 entries in a divisor table for jsimd_fdct_islow_quantize */
+#define JSIMD_DIVISORS_SIZE  (DCTSIZE2 * 3)
+
+EXTERN(int) jsimd_can_rgb_ycc JPP((void));
+EXTERN(int) jsimd_can_fdct_islow JPP((void));
+
+EXTERN(void) jsimd_rgb_ycc_convert
+	JPP((j_compress_ptr cinfo, JSAMPARRAY input_buf, JSAMPIMAGE output_buf,
+	     JDIMENSION output_row, int num_rows));
+
+EXTERN(boolean) jsimd_compute_divisors
+	JPP((JQUANT_TBL * qtbl, UINT16 * dtbl));
+EXTERN(void) jsimd_fdct_islow_quantize
+	JPP((JCOEFPTR coef_block, JSAMPARRAY sample_data, JDIMENSION start_col,
+	     UINT16 * dtbl));
+
+#endif /* JSIMD_SUPPORTED */
@@ -23,6 +23,14 @@
 #include "remote_dispatch.h"
 #include "libloader.h"
 
+#ifndef _WIN32
+#include "profiler.h"
+#include "pipeline.h"
+#include "server_transport_websocket.h"
+#include "rudp.h"
+#include "server_transport_udp.h"
+#endif
+
 #ifdef _WIN32
 #include "../ReflectiveDLLInjection/inject/src/GetProcAddressR.h"
 #include "../ReflectiveDLLInjection/inject/src/LoadLibraryR.h"
@@ -30,6 +38,10 @@
 #endif
 
 DWORD server_setup(SOCKET fd);
+#ifndef _WIN32
+int server_initialize_ssl(Remote *remote);
+VOID server_shutdown_ssl(Remote *remote);
+#endif
 typedef DWORD (*PSRVINIT)(Remote *remote);
 typedef DWORD (*PSRVDEINIT)(Remote *remote);
 typedef DWORD (*PSRVGETNAME)(char* buffer, int bufferSize);
@@ -0,0 +1,37 @@
+/*!
+ * @file pipeline.h
+ * @brief Declarations for the outbound packet pipeline.
+ * @details Without the pipeline, a transport encrypts and writes each packet on
+ *          the calling thread, so the cipher work for one packet can't overlap the
+ *          socket write of the previous one. When the pipeline is running, packets
+ *          are queued in the order they are transmitted, large packets are encrypted
+ *          and framed by a pool of worker threads, and a single writer thread hands
+ *          the finished frames to the transport in the original order.
+ */
+#ifndef _METERPRETER_SERVER_PIPELINE_H
+#define _METERPRETER_SERVER_PIPELINE_H
+
+/*! @brief Name of the environment variable that overrides the number of workers (0 disables the pipeline). */
+#define PIPELINE_ENV_WORKERS    "METERPRETER_PIPELINE_WORKERS"
+/*! @brief Maximum number of worker threads. */
+#define PIPELINE_MAX_WORKERS    8
+/*! @brief Packets with a payload smaller than this are framed on the calling thread. */
+#define PIPELINE_MIN_PAYLOAD    (16 * 1024)
+/*! @brief Number of queued bytes at which callers block until the writer catches up. */
+#define PIPELINE_MAX_PENDING    (4 * 1024 * 1024)
+
+typedef struct _PacketPipeline PacketPipeline;
+
+/*!
+ * @brief Writes a finished frame (TLV header followed by the payload) to the transport.
+ * @return Indication of success or failure. Once a write fails, nothing else is written.
+ */
+typedef DWORD (*PPipelineWrite)(Remote* remote, PUCHAR frame, DWORD frameLength);
+
+PacketPipeline* pipeline_create(Remote* remote, PPipelineWrite write);
+VOID pipeline_acquire(PacketPipeline* pipeline);
+VOID pipeline_release(PacketPipeline* pipeline);
+DWORD pipeline_transmit(PacketPipeline* pipeline, Packet* packet, CryptoContext* crypto);
+VOID pipeline_destroy(PacketPipeline* pipeline);
+
+#endif
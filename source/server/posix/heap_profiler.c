@@ -0,0 +1,673 @@
+/*!
+ * @file heap_profiler.c
+ * @brief Built-in allocation profiler for the POSIX meterpreter.
+ * @details While running, bionic's malloc dispatch table is pointed at a set of
+ *          hooks which forward to the real allocator and record the call stack,
+ *          size and generation of every allocation that is still live. Allocations
+ *          are aggregated per call site (the full captured stack), so a report can
+ *          show where the allocation volume comes from, and where the memory that
+ *          is still held was allocated.
+ *
+ *          Leak hunting works on generations: a snapshot starts a new generation,
+ *          and a leak report lists the call sites of allocations made since that
+ *          snapshot which have not yet been freed. Taking a snapshot, running a
+ *          workload that should be memory-neutral, and then asking for leaks gives
+ *          the candidates.
+ */
+#include "metsrv.h"
+
+#include <pthread.h>
+
+/*! @brief Maximum number of frames captured per allocation. */
+#define HEAP_MAX_DEPTH          8
+/*! @brief Maximum number of distinct call sites that can be tracked. */
+#define HEAP_MAX_SITES          4096
+/*! @brief Number of hash buckets used to look up call sites. */
+#define HEAP_SITE_BUCKETS       1024
+/*! @brief Number of hash buckets used to look up live allocations. */
+#define HEAP_ALLOC_BUCKETS      16384
+
+/*!
+ * @brief Allocator dispatch table.
+ * @remark This mirrors \c MallocDebug in bionic's malloc_debug_common.h. libc is built
+ *         with USE_DL_PREFIX, so every call to malloc and friends is routed through
+ *         the table that \c __libc_malloc_dispatch points at.
+ */
+typedef struct _HeapDispatch
+{
+	void* (*malloc)(size_t bytes);
+	void  (*free)(void* mem);
+	void* (*calloc)(size_t n_elements, size_t elem_size);
+	void* (*realloc)(void* oldMem, size_t bytes);
+	void* (*memalign)(size_t alignment, size_t bytes);
+} HeapDispatch;
+
+extern const HeapDispatch* __libc_malloc_dispatch;
+
+/*! @brief Allocation statistics for a single call site. */
+typedef struct _HeapSite
+{
+	struct _HeapSite* next;                 ///< Next site in the same hash bucket.
+	DWORD hash;                             ///< Hash of \c frames.
+	DWORD depth;                            ///< Number of valid entries in \c frames.
+	uintptr_t frames[HEAP_MAX_DEPTH];       ///< Return addresses, innermost first.
+	DWORD count;                            ///< Number of allocations made from this site.
+	QWORD bytes;                            ///< Number of bytes allocated from this site.
+	DWORD liveCount;                        ///< Number of allocations from this site that are still live.
+	QWORD liveBytes;                        ///< Number of bytes from this site that are still live.
+	DWORD leakCount;                        ///< Live allocations made in the current generation (leak reports only).
+	QWORD leakBytes;                        ///< Live bytes allocated in the current generation (leak reports only).
+} HeapSite;
+
+/*! @brief A live allocation. */
+typedef struct _HeapAllocation
+{
+	struct _HeapAllocation* next;           ///< Next allocation in the same hash bucket.
+	void* ptr;                              ///< Address returned to the caller.
+	size_t size;                            ///< Size requested by the caller.
+	HeapSite* site;                         ///< Site the allocation was made from.
+	DWORD generation;                       ///< Generation the allocation was made in.
+} HeapAllocation;
+
+/*! @brief State of the allocation profiler. */
+typedef struct _HeapProfile
+{
+	HeapSite sites[HEAP_MAX_SITES];                     ///< Storage for the call sites.
+	DWORD numSites;                                     ///< Number of entries of \c sites in use.
+	HeapSite* siteBuckets[HEAP_SITE_BUCKETS];           ///< Call site hash table.
+	HeapAllocation* allocBuckets[HEAP_ALLOC_BUCKETS];   ///< Live allocation hash table.
+	HeapAllocation* spare;                              ///< Allocation records available for reuse.
+	DWORD generation;                                   ///< Current generation.
+	DWORD dropped;                                      ///< Allocations that could not be tracked.
+	DWORD liveCount;                                    ///< Number of tracked allocations that are live.
+	QWORD liveBytes;                                    ///< Number of tracked bytes that are live.
+} HeapProfile;
+
+static void* heap_malloc(size_t bytes);
+static void heap_free(void* mem);
+static void* heap_calloc(size_t count, size_t size);
+static void* heap_realloc(void* mem, size_t bytes);
+static void* heap_memalign(size_t alignment, size_t bytes);
+
+static const HeapDispatch heapDispatch = { heap_malloc, heap_free, heap_calloc, heap_realloc, heap_memalign };
+
+/*! @brief Guards \c heapProfile and everything it points to. Taken by every hook. */
+static pthread_mutex_t heapMutex = PTHREAD_MUTEX_INITIALIZER;
+/*! @brief Serialises the command handler. */
+static pthread_mutex_t heapControlMutex = PTHREAD_MUTEX_INITIALIZER;
+/*! @brief The dispatch table that was in use before profiling started. */
+static const HeapDispatch* heapOriginal = NULL;
+static HeapProfile* heapProfile = NULL;
+static BOOL heapRunning = FALSE;
+
+/*!
+ * @brief Capture the stack of the current allocation.
+ * @remark This must be expanded directly in the hook so that the walk starts at
+ *         the hook's own frame. Depending on how libc was built, the innermost frame
+ *         is either the caller of malloc or libc's malloc wrapper.
+ */
+#define HEAP_CAPTURE(frames, depth) \
+	depth = profiler_walk_stack((uintptr_t)__builtin_frame_address(0), (uintptr_t)__builtin_frame_address(0), frames, HEAP_MAX_DEPTH)
+
+/*!
+ * @brief Find or create the site for the given stack.
+ * @remark Must be called with \c heapMutex held.
+ * @return Pointer to the site, or \c NULL if the site table is full.
+ */
+static HeapSite* heap_site(uintptr_t* frames, DWORD depth)
+{
+	HeapSite* site;
+	DWORD hash = depth;
+	DWORD index;
+
+	for (index = 0; index < depth; index++)
+	{
+		hash = (hash * 31) ^ (DWORD)frames[index];
+	}
+
+	for (site = heapProfile->siteBuckets[hash % HEAP_SITE_BUCKETS]; site; site = site->next)
+	{
+		if (site->hash == hash && site->depth == depth
+			&& memcmp(site->frames, frames, depth * sizeof(uintptr_t)) == 0)
+		{
+			return site;
+		}
+	}
+
+	if (heapProfile->numSites == HEAP_MAX_SITES)
+	{
+		return NULL;
+	}
+
+	site = &heapProfile->sites[heapProfile->numSites++];
+	site->hash = hash;
+	site->depth = depth;
+	memcpy(site->frames, frames, depth * sizeof(uintptr_t));
+	site->next = heapProfile->siteBuckets[hash % HEAP_SITE_BUCKETS];
+	heapProfile->siteBuckets[hash % HEAP_SITE_BUCKETS] = site;
+
+	return site;
+}
+
+/*!
+ * @brief Add a live allocation record to the tables.
+ * @remark Must be called with \c heapMutex held.
+ */
+static VOID heap_insert(HeapAllocation* allocation)
+{
+	HeapAllocation** bucket = &heapProfile->allocBuckets[((uintptr_t)allocation->ptr >> 3) % HEAP_ALLOC_BUCKETS];
+
+	allocation->next = *bucket;
+	*bucket = allocation;
+
+	allocation->site->liveCount++;
+	allocation->site->liveBytes += allocation->size;
+	heapProfile->liveCount++;
+	heapProfile->liveBytes += allocation->size;
+}
+
+/*!
+ * @brief Start tracking a new allocation.
+ * @param ptr Address of the allocation.
+ * @param size Size of the allocation.
+ * @param frames The stack the allocation was made from.
+ * @param depth Number of entries in \c frames.
+ */
+static VOID heap_track(void* ptr, size_t size, uintptr_t* frames, DWORD depth)
+{
+	HeapAllocation* allocation;
+	HeapSite* site;
+
+	pthread_mutex_lock(&heapMutex);
+
+	do
+	{
+		// the profiler may have been torn down since the hook was entered
+		if (!heapProfile)
+		{
+			break;
+		}
+
+		if (!(site = heap_site(frames, depth)))
+		{
+			heapProfile->dropped++;
+			break;
+		}
+
+		if ((allocation = heapProfile->spare) != NULL)
+		{
+			heapProfile->spare = allocation->next;
+		}
+		else if (!(allocation = (HeapAllocation*)heapOriginal->malloc(sizeof(HeapAllocation))))
+		{
+			heapProfile->dropped++;
+			break;
+		}
+
+		allocation->ptr = ptr;
+		allocation->size = size;
+		allocation->site = site;
+		allocation->generation = heapProfile->generation;
+
+		site->count++;
+		site->bytes += size;
+
+		heap_insert(allocation);
+	} while (0);
+
+	pthread_mutex_unlock(&heapMutex);
+}
+
+/*!
+ * @brief Stop tracking an allocation that is about to be released.
+ * @param ptr Address of the allocation.
+ * @param saved Optional pointer that receives a copy of the allocation's record,
+ *              so that it can be restored if the release fails.
+ * @return Indication of whether the allocation was being tracked.
+ */
+static BOOL heap_untrack(void* ptr, HeapAllocation* saved)
+{
+	HeapAllocation** link;
+	HeapAllocation* allocation;
+	BOOL found = FALSE;
+
+	pthread_mutex_lock(&heapMutex);
+
+	for (link = heapProfile ? &heapProfile->allocBuckets[((uintptr_t)ptr >> 3) % HEAP_ALLOC_BUCKETS] : NULL;
+		link && *link; link = &(*link)->next)
+	{
+		if ((*link)->ptr == ptr)
+		{
+			allocation = *link;
+			*link = allocation->next;
+
+			allocation->site->liveCount--;
+			allocation->site->liveBytes -= allocation->size;
+			heapProfile->liveCount--;
+			heapProfile->liveBytes -= allocation->size;
+
+			if (saved)
+			{
+				*saved = *allocation;
+			}
+
+			allocation->next = heapProfile->spare;
+			heapProfile->spare = allocation;
+			found = TRUE;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&heapMutex);
+
+	return found;
+}
+
+static void* heap_malloc(size_t bytes)
+{
+	uintptr_t frames[HEAP_MAX_DEPTH];
+	DWORD depth;
+	void* mem = heapOriginal->malloc(bytes);
+
+	if (mem)
+	{
+		HEAP_CAPTURE(frames, depth);
+		heap_track(mem, bytes, frames, depth);
+	}
+
+	return mem;
+}
+
+static void heap_free(void* mem)
+{
+	// the record has to go before the memory does, or another thread could be
+	// handed the same address and track it first
+	if (mem)
+	{
+		heap_untrack(mem, NULL);
+	}
+
+	heapOriginal->free(mem);
+}
+
+static void* heap_calloc(size_t count, size_t size)
+{
+	uintptr_t frames[HEAP_MAX_DEPTH];
+	DWORD depth;
+	void* mem = heapOriginal->calloc(count, size);
+
+	if (mem)
+	{
+		HEAP_CAPTURE(frames, depth);
+		heap_track(mem, count * size, frames, depth);
+	}
+
+	return mem;
+}
+
+static void* heap_realloc(void* mem, size_t bytes)
+{
+	uintptr_t frames[HEAP_MAX_DEPTH];
+	HeapAllocation saved;
+	DWORD depth;
+	BOOL tracked = mem ? heap_untrack(mem, &saved) : FALSE;
+	void* result = heapOriginal->realloc(mem, bytes);
+
+	if (result)
+	{
+		HEAP_CAPTURE(frames, depth);
+		heap_track(result, bytes, frames, depth);
+	}
+	else if (tracked && bytes)
+	{
+		// the original block is untouched when a resize fails
+		pthread_mutex_lock(&heapMutex);
+		if (heapProfile && heapProfile->spare)
+		{
+			HeapAllocation* allocation = heapProfile->spare;
+			heapProfile->spare = allocation->next;
+			*allocation = saved;
+			heap_insert(allocation);
+		}
+		pthread_mutex_unlock(&heapMutex);
+	}
+
+	return result;
+}
+
+static void* heap_memalign(size_t alignment, size_t bytes)
+{
+	uintptr_t frames[HEAP_MAX_DEPTH];
+	DWORD depth;
+	void* mem = heapOriginal->memalign(alignment, bytes);
+
+	if (mem)
+	{
+		HEAP_CAPTURE(frames, depth);
+		heap_track(mem, bytes, frames, depth);
+	}
+
+	return mem;
+}
+
+/*!
+ * @brief Release every allocation record held by the profile.
+ * @remark Must only be called when the hooks are not installed.
+ */
+static VOID heap_profile_clear(HeapProfile* profile)
+{
+	HeapAllocation* allocation;
+	DWORD index;
+
+	for (index = 0; index < HEAP_ALLOC_BUCKETS; index++)
+	{
+		while ((allocation = profile->allocBuckets[index]) != NULL)
+		{
+			profile->allocBuckets[index] = allocation->next;
+			free(allocation);
+		}
+	}
+
+	while ((allocation = profile->spare) != NULL)
+	{
+		profile->spare = allocation->next;
+		free(allocation);
+	}
+
+	memset(profile, 0, sizeof(HeapProfile));
+}
+
+/*!
+ * @brief Start tracking allocations, discarding the results of any previous run.
+ */
+static DWORD heap_profiler_start()
+{
+	HeapProfile* profile = heapProfile;
+
+	if (heapRunning)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (profile)
+	{
+		// detach the profile first so that stray hooks leave it alone
+		pthread_mutex_lock(&heapMutex);
+		heapProfile = NULL;
+		pthread_mutex_unlock(&heapMutex);
+
+		heap_profile_clear(profile);
+	}
+	else if (!(profile = (HeapProfile*)calloc(1, sizeof(HeapProfile))))
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	pthread_mutex_lock(&heapMutex);
+	heapProfile = profile;
+	if (!heapOriginal)
+	{
+		heapOriginal = __libc_malloc_dispatch;
+	}
+	__libc_malloc_dispatch = &heapDispatch;
+	heapRunning = TRUE;
+	pthread_mutex_unlock(&heapMutex);
+
+	dprintf("[HEAP] allocation profiling started");
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Stop tracking allocations. The statistics gathered so far are kept.
+ * @remark Frees that happen after this point aren't seen, so the live figures
+ *         reflect the heap at the time profiling stopped.
+ */
+static DWORD heap_profiler_stop()
+{
+	if (heapRunning)
+	{
+		pthread_mutex_lock(&heapMutex);
+		__libc_malloc_dispatch = heapOriginal;
+		heapRunning = FALSE;
+		pthread_mutex_unlock(&heapMutex);
+
+		dprintf("[HEAP] allocation profiling stopped");
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Sort sites by descending live bytes, then by descending total bytes.
+ */
+static int heap_compare_live(const void* a, const void* b)
+{
+	const HeapSite* left = (const HeapSite*)a;
+	const HeapSite* right = (const HeapSite*)b;
+
+	if (left->liveBytes != right->liveBytes)
+	{
+		return left->liveBytes > right->liveBytes ? -1 : 1;
+	}
+	if (left->bytes != right->bytes)
+	{
+		return left->bytes > right->bytes ? -1 : 1;
+	}
+	return 0;
+}
+
+/*!
+ * @brief Sort sites by descending bytes leaked in the current generation.
+ */
+static int heap_compare_leaks(const void* a, const void* b)
+{
+	const HeapSite* left = (const HeapSite*)a;
+	const HeapSite* right = (const HeapSite*)b;
+
+	if (left->leakBytes != right->leakBytes)
+	{
+		return left->leakBytes > right->leakBytes ? -1 : 1;
+	}
+	return (int)right->leakCount - (int)left->leakCount;
+}
+
+/*!
+ * @brief Add the top call sites to the response.
+ * @param response The response packet to add the entries to.
+ * @param leaks Set to \c TRUE to report allocations from the current generation that are still live.
+ * @param limit Maximum number of entries to return.
+ */
+static DWORD heap_profiler_report(Packet* response, BOOL leaks, DWORD limit)
+{
+	HeapSite* sites = NULL;
+	HeapAllocation* allocation;
+	DWORD numSites, index, frame, dropped, liveCount;
+	QWORD liveBytes;
+	char symbol[256];
+
+	if (!heapProfile)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	// the copy is allocated before the lock is taken, as the allocation goes
+	// through the hooks; the site table only ever grows, so it can't be outgrown
+	// by the time the lock is held
+	if (!(sites = (HeapSite*)malloc(sizeof(HeapSite) * HEAP_MAX_SITES)))
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	pthread_mutex_lock(&heapMutex);
+
+	if (leaks)
+	{
+		for (index = 0; index < heapProfile->numSites; index++)
+		{
+			heapProfile->sites[index].leakCount = 0;
+			heapProfile->sites[index].leakBytes = 0;
+		}
+
+		for (index = 0; index < HEAP_ALLOC_BUCKETS; index++)
+		{
+			for (allocation = heapProfile->allocBuckets[index]; allocation; allocation = allocation->next)
+			{
+				if (allocation->generation == heapProfile->generation)
+				{
+					allocation->site->leakCount++;
+					allocation->site->leakBytes += allocation->size;
+				}
+			}
+		}
+	}
+
+	numSites = heapProfile->numSites;
+	memcpy(sites, heapProfile->sites, numSites * sizeof(HeapSite));
+	dropped = heapProfile->dropped;
+	liveCount = heapProfile->liveCount;
+	liveBytes = heapProfile->liveBytes;
+
+	pthread_mutex_unlock(&heapMutex);
+
+	qsort(sites, numSites, sizeof(HeapSite), leaks ? heap_compare_leaks : heap_compare_live);
+
+	for (index = 0; index < numSites && index < limit; index++)
+	{
+		Packet* group;
+
+		if (leaks && !sites[index].leakCount)
+		{
+			break;
+		}
+
+		if (!(group = packet_create_group()))
+		{
+			break;
+		}
+
+		packet_add_tlv_uint(group, TLV_TYPE_PROFILE_COUNT, leaks ? sites[index].leakCount : sites[index].count);
+		packet_add_tlv_qword(group, TLV_TYPE_PROFILE_BYTES, leaks ? sites[index].leakBytes : sites[index].bytes);
+		packet_add_tlv_uint(group, TLV_TYPE_PROFILE_LIVE_COUNT, sites[index].liveCount);
+		packet_add_tlv_qword(group, TLV_TYPE_PROFILE_LIVE_BYTES, sites[index].liveBytes);
+
+		for (frame = 0; frame < sites[index].depth; frame++)
+		{
+			profiler_symbolise(sites[index].frames[frame], symbol, sizeof(symbol));
+			packet_add_tlv_string(group, TLV_TYPE_PROFILE_FRAME, symbol);
+		}
+
+		packet_add_group(response, TLV_TYPE_PROFILE_ENTRY, group);
+	}
+
+	packet_add_tlv_uint(response, TLV_TYPE_PROFILE_LIVE_COUNT, liveCount);
+	packet_add_tlv_qword(response, TLV_TYPE_PROFILE_LIVE_BYTES, liveBytes);
+	packet_add_tlv_uint(response, TLV_TYPE_PROFILE_DROPPED, dropped);
+
+	free(sites);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Start a new generation, returning the current live totals.
+ * @param response The response packet to add the totals to.
+ */
+static DWORD heap_profiler_snapshot(Packet* response)
+{
+	DWORD liveCount;
+	QWORD liveBytes;
+
+	if (!heapRunning)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&heapMutex);
+	heapProfile->generation++;
+	liveCount = heapProfile->liveCount;
+	liveBytes = heapProfile->liveBytes;
+	pthread_mutex_unlock(&heapMutex);
+
+	packet_add_tlv_uint(response, TLV_TYPE_PROFILE_LIVE_COUNT, liveCount);
+	packet_add_tlv_qword(response, TLV_TYPE_PROFILE_LIVE_BYTES, liveBytes);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Stop the allocation profiler if it's running and release its resources.
+ */
+VOID heap_profiler_destroy()
+{
+	HeapProfile* profile;
+
+	pthread_mutex_lock(&heapControlMutex);
+
+	heap_profiler_stop();
+
+	pthread_mutex_lock(&heapMutex);
+	profile = heapProfile;
+	heapProfile = NULL;
+	pthread_mutex_unlock(&heapMutex);
+
+	if (profile)
+	{
+		heap_profile_clear(profile);
+		free(profile);
+	}
+
+	pthread_mutex_unlock(&heapControlMutex);
+}
+
+/*!
+ * @brief Handler for the `core_heap_profile` command.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Pointer to the request packet.
+ * @return Indication of success or failure.
+ * @details Takes a TLV_TYPE_PROFILE_ACTION of:
+ *          - PROFILE_ACTION_START to start tracking allocations.
+ *          - PROFILE_ACTION_STOP to stop tracking allocations.
+ *          - PROFILE_ACTION_REPORT to list call sites by live bytes, then total bytes.
+ *          - PROFILE_ACTION_SNAPSHOT to start a new generation.
+ *          - PROFILE_ACTION_LEAKS to list the call sites of live allocations made
+ *            since the last snapshot, by bytes.
+ *
+ *          Reports return up to TLV_TYPE_PROFILE_LIMIT TLV_TYPE_PROFILE_ENTRY groups,
+ *          each holding the allocation count and bytes, the live count and bytes, and
+ *          the symbolised frames of the site, innermost first.
+ */
+DWORD request_core_heap_profile(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	DWORD action = packet_get_tlv_value_uint(packet, TLV_TYPE_PROFILE_ACTION);
+	DWORD limit = packet_get_tlv_value_uint(packet, TLV_TYPE_PROFILE_LIMIT);
+	DWORD result = ERROR_SUCCESS;
+
+	pthread_mutex_lock(&heapControlMutex);
+
+	switch (action)
+	{
+	case PROFILE_ACTION_START:
+		result = heap_profiler_start();
+		break;
+	case PROFILE_ACTION_STOP:
+		result = heap_profiler_stop();
+		break;
+	case PROFILE_ACTION_REPORT:
+	case PROFILE_ACTION_LEAKS:
+		result = heap_profiler_report(response, action == PROFILE_ACTION_LEAKS, limit ? limit : PROFILE_DEFAULT_LIMIT);
+		break;
+	case PROFILE_ACTION_SNAPSHOT:
+		result = heap_profiler_snapshot(response);
+		break;
+	default:
+		result = ERROR_INVALID_PARAMETER;
+		break;
+	}
+
+	pthread_mutex_unlock(&heapControlMutex);
+
+	packet_transmit_response(result, remote, response);
+
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,1022 @@
+/*!
+ * @file metsrv_bench.c
+ * @brief Microbenchmarks for the server's hot paths.
+ * @details Each benchmark runs in process against the same code the server
+ *          links, and prints how long one operation takes under each of the
+ *          approaches it compares, so a change can be measured before and
+ *          after it is made.
+ *
+ *          usage: metsrv_bench decode|scheduler|pipeline [iterations]
+ *                 metsrv_bench stage <image> [capabilities]
+ *
+ *          decode  Extract the arguments of a typical request by calling the
+ *                  packet_get_tlv_value_* getters once per argument, each of
+ *                  which walks the packet again, versus a single pass of
+ *                  packet_decode. The whole of a dispatch is measured too:
+ *                  the argument walk of command_validate_arguments followed
+ *                  by the getters, as commands without a schema are handled,
+ *                  versus validating against the schema and serving the
+ *                  handler's decode from the cached result.
+ *
+ *          scheduler  Push notifications through a set of always ready pipes,
+ *                  each doing a fixed amount of handler work, and report the
+ *                  aggregate throughput of the scheduler with 1, 2, 4 and 8
+ *                  shards against a thread per waitable, the way waitables
+ *                  were serviced before they were sharded.
+ *
+ *          pipeline  Send a download's worth of large XOR encrypted packets
+ *                  through a transport whose writes cost what SSL_write does,
+ *                  encrypting each TLS record with AES-128-GCM before writing
+ *                  it to a pipe that another thread drains. The throughput of
+ *                  the inline path, where the sending thread encrypts, frames
+ *                  and writes each packet, is reported against the outbound
+ *                  pipeline with 1, 2 and 4 workers.
+ *
+ *          stage   Load a stdapi image the way a client stages it and time the
+ *                  first call into each of its command groups. The client's
+ *                  side answers core_loadlib_request with the image named,
+ *                  read from the directory the staged image is in, so with
+ *                  ext_server_stdapi_ondemand the time of the first system
+ *                  and network command includes loading their images. The
+ *                  capabilities are advertised with the staged image; without
+ *                  CLIENT_CAPABILITY_LOADLIB_REQUEST (1) those commands should
+ *                  fail at once. Groups only load once, so run each image in a
+ *                  fresh process.
+ */
+#include "metsrv.h"
+
+#include <poll.h>
+#include <sys/time.h>
+#include <openssl/evp.h>
+
+/*! @brief Number of iterations each benchmark runs for if none is given. */
+#define BENCH_DEFAULT_ITERATIONS  1000000
+/*! @brief Number of distinct packets the decode benchmark cycles through. */
+#define BENCH_DECODE_PACKETS      64
+/*! @brief Size of the raw argument carried by the decode benchmark's requests. */
+#define BENCH_DECODE_DATA         256
+/*! @brief Number of waitables the scheduler benchmark spreads its notifications over. */
+#define BENCH_SCHEDULER_WAITABLES 64
+/*! @brief Rounds of work each notification of the scheduler benchmark does, standing in for a handler. */
+#define BENCH_SCHEDULER_WORK      2000
+/*! @brief Size of the data carried by each packet of the pipeline benchmark, a download's chunk. */
+#define BENCH_PIPELINE_CHUNK      (1024 * 1024)
+/*! @brief Size of the records the pipeline benchmark's transport encrypts, as TLS does. */
+#define BENCH_PIPELINE_RECORD     16384
+/*! @brief Longest time the stage benchmark waits for a response, in milliseconds. */
+#define BENCH_STAGE_TIMEOUT       10000
+
+extern DWORD command_validate_arguments(Command *command, Packet *packet);
+
+/*! @brief Arguments of the request the decode benchmark extracts, shaped like a stdapi request. */
+#define BENCH_DECODE_FIELDS(F, S) \
+	F(S, STRING, path, TLV_TYPE_LIBRARY_PATH, TLV_SCHEMA_REQUIRED) \
+	F(S, STRING, target, TLV_TYPE_TARGET_PATH, 0) \
+	F(S, UINT, flags, TLV_TYPE_FLAGS, 0) \
+	F(S, UINT, length, TLV_TYPE_LENGTH, 0) \
+	F(S, QWORD, offset, TLV_TYPE_SEEK_OFFSET64, 0) \
+	F(S, BOOL, recursive, TLV_TYPE_BOOL, 0) \
+	F(S, RAW, data, TLV_TYPE_DATA, 0)
+TLV_SCHEMA_DECLARE(BenchDecodeRequest, BENCH_DECODE_FIELDS)
+TLV_SCHEMA_DEFINE(BenchDecodeRequest, BENCH_DECODE_FIELDS)
+
+/*!
+ * @brief Get the current time in microseconds.
+ */
+static QWORD bench_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*!
+ * @brief Print the time one operation of a benchmark took.
+ */
+static VOID bench_report(const char* name, QWORD elapsed, DWORD iterations, DWORD checksum)
+{
+	printf("%-28s %10.1f ns/op  (%u ops in %llu us, checksum %u)\n", name,
+		(double)elapsed * 1000.0 / iterations, iterations, (unsigned long long)elapsed, checksum);
+}
+
+/*!
+ * @brief A waitable of the scheduler benchmark: a pipe that is kept readable
+ *        until it has been notified the required number of times.
+ */
+typedef struct _BenchWaitable
+{
+	int fds[2];
+	DWORD remaining;
+	DWORD checksum;
+	volatile int* outstanding;
+	EVENT* done;
+} BenchWaitable;
+
+/*!
+ * @brief Handle one notification of a scheduler benchmark waitable.
+ * @details Consumes the pending byte, does a handler's worth of work and makes
+ *          the pipe readable again, until the waitable has had all of its
+ *          notifications. The last waitable to finish signals the benchmark.
+ */
+static DWORD bench_scheduler_notify(Remote* remote, LPVOID entryContext, LPVOID threadContext)
+{
+	BenchWaitable* waitable = (BenchWaitable*)entryContext;
+	DWORD hash = waitable->checksum;
+	DWORD round;
+	char token;
+
+	if (read(waitable->fds[0], &token, 1) != 1)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	for (round = 0; round < BENCH_SCHEDULER_WORK; round++)
+	{
+		hash = (hash ^ round) * 16777619;
+	}
+	waitable->checksum = hash;
+
+	if (--waitable->remaining > 0)
+	{
+		write(waitable->fds[1], &token, 1);
+	}
+	else if (__atomic_dec(waitable->outstanding) == 1)
+	{
+		event_signal(waitable->done);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Service a single scheduler benchmark waitable on its own thread.
+ */
+static DWORD THREADCALL bench_scheduler_thread(THREAD* thread)
+{
+	BenchWaitable* waitable = (BenchWaitable*)thread->parameter1;
+	struct pollfd fd;
+
+	fd.fd = waitable->fds[0];
+	fd.events = POLLRDNORM;
+
+	while (waitable->remaining > 0)
+	{
+		if (poll(&fd, 1, -1) > 0)
+		{
+			bench_scheduler_notify(NULL, waitable, NULL);
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Run one round of the scheduler benchmark.
+ * @param shards Number of shards to run the waitables on, or zero for a thread per waitable.
+ * @returns Indication of success or failure.
+ */
+static DWORD bench_scheduler_run(DWORD shards, DWORD iterations)
+{
+	BenchWaitable waitables[BENCH_SCHEDULER_WAITABLES];
+	THREAD* threads[BENCH_SCHEDULER_WAITABLES];
+	volatile int outstanding = BENCH_SCHEDULER_WAITABLES;
+	Remote* remote = NULL;
+	EVENT* done = NULL;
+	DWORD result = ERROR_SUCCESS;
+	DWORD index, checksum = 0;
+	char name[32], count[16];
+	QWORD start;
+
+	memset(waitables, 0, sizeof(waitables));
+	memset(threads, 0, sizeof(threads));
+
+	do
+	{
+		if (!(done = event_create()))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		for (index = 0; index < BENCH_SCHEDULER_WAITABLES; index++)
+		{
+			if (pipe(waitables[index].fds) != 0)
+			{
+				waitables[index].fds[0] = waitables[index].fds[1] = -1;
+				result = errno;
+				break;
+			}
+			waitables[index].remaining = iterations / BENCH_SCHEDULER_WAITABLES + 1;
+			waitables[index].outstanding = &outstanding;
+			waitables[index].done = done;
+		}
+
+		if (result != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		if (shards)
+		{
+			// the shard count is read when the first session starts
+			snprintf(count, sizeof(count), "%u", (unsigned int)shards);
+			setenv(SCHEDULER_ENV_SHARDS, count, 1);
+
+			if (!(remote = remote_allocate()) || (result = scheduler_initialize(remote)) != ERROR_SUCCESS)
+			{
+				result = remote ? result : ERROR_NOT_ENOUGH_MEMORY;
+				break;
+			}
+
+			for (index = 0; index < BENCH_SCHEDULER_WAITABLES && result == ERROR_SUCCESS; index++)
+			{
+				result = scheduler_insert_pinned_waitable(remote, (HANDLE)(uintptr_t)waitables[index].fds[0],
+					&waitables[index], NULL, bench_scheduler_notify, NULL, index);
+			}
+		}
+		else
+		{
+			for (index = 0; index < BENCH_SCHEDULER_WAITABLES && result == ERROR_SUCCESS; index++)
+			{
+				if (!(threads[index] = thread_create(bench_scheduler_thread, &waitables[index], NULL, NULL))
+					|| !thread_run(threads[index]))
+				{
+					result = ERROR_NOT_ENOUGH_MEMORY;
+				}
+			}
+		}
+
+		if (result != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		start = bench_now();
+		for (index = 0; index < BENCH_SCHEDULER_WAITABLES; index++)
+		{
+			write(waitables[index].fds[1], "x", 1);
+		}
+		while (!event_poll(done, 1000));
+
+		for (index = 0; index < BENCH_SCHEDULER_WAITABLES; index++)
+		{
+			checksum += waitables[index].checksum;
+		}
+
+		if (shards)
+		{
+			snprintf(name, sizeof(name), "scheduler, %u shard%s", (unsigned int)shards, shards > 1 ? "s" : "");
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "thread per waitable");
+		}
+		bench_report(name, bench_now() - start, (iterations / BENCH_SCHEDULER_WAITABLES + 1) * BENCH_SCHEDULER_WAITABLES, checksum);
+	} while (0);
+
+	if (remote)
+	{
+		scheduler_destroy(remote);
+		remote_deallocate(remote);
+	}
+
+	for (index = 0; index < BENCH_SCHEDULER_WAITABLES; index++)
+	{
+		if (threads[index])
+		{
+			// a thread that never got going is still blocked waiting for its first byte
+			if (waitables[index].remaining > 0)
+			{
+				thread_kill(threads[index]);
+			}
+			thread_join(threads[index]);
+			thread_destroy(threads[index]);
+		}
+		if (waitables[index].fds[0] > 0)
+		{
+			close(waitables[index].fds[0]);
+			close(waitables[index].fds[1]);
+		}
+	}
+
+	if (done)
+	{
+		event_destroy(done);
+	}
+
+	return result;
+}
+
+/*!
+ * @brief Compare the aggregate throughput of the scheduler's shards with a thread per waitable.
+ */
+static int bench_scheduler(DWORD iterations)
+{
+	static const DWORD shards[] = { 0, 1, 2, 4, 8 };
+	DWORD index, result;
+
+	// the handler work dominates, so a tenth of the decode benchmark's iterations is plenty
+	iterations = iterations / 10 + 1;
+
+	for (index = 0; index < sizeof(shards) / sizeof(shards[0]); index++)
+	{
+		if ((result = bench_scheduler_run(shards[index], iterations)) != ERROR_SUCCESS)
+		{
+			fprintf(stderr, "scheduler benchmark failed: %u\n", (unsigned int)result);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*! @brief The transport of the pipeline benchmark. */
+static struct
+{
+	EVP_CIPHER_CTX* cipher;     ///< Stands in for the SSL session's record cipher.
+	PUCHAR record;              ///< Encrypted record, written to \c fds[1].
+	int fds[2];                 ///< Pipe the frames are written to, drained by another thread.
+	QWORD written;              ///< Bytes the transport has been asked to write.
+} benchPipeline;
+
+/*!
+ * @brief Write a frame the way SSL_write would, a record at a time.
+ * @remark Only ever called by one thread at a time, as the transports serialise writes.
+ */
+static DWORD bench_pipeline_write(Remote* remote, PUCHAR frame, DWORD frameLength)
+{
+	DWORD offset, length;
+	int recordLength, written;
+
+	for (offset = 0; offset < frameLength; offset += length)
+	{
+		length = frameLength - offset < BENCH_PIPELINE_RECORD ? frameLength - offset : BENCH_PIPELINE_RECORD;
+
+		if (!EVP_EncryptUpdate(benchPipeline.cipher, benchPipeline.record, &recordLength, frame + offset, length))
+		{
+			return ERROR_WRITE_FAULT;
+		}
+
+		for (written = 0; written < recordLength; )
+		{
+			int result = write(benchPipeline.fds[1], benchPipeline.record + written, recordLength - written);
+
+			if (result <= 0)
+			{
+				return ERROR_WRITE_FAULT;
+			}
+			written += result;
+		}
+	}
+
+	benchPipeline.written += frameLength;
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Read and discard everything written to the pipeline benchmark's transport.
+ */
+static DWORD THREADCALL bench_pipeline_drain(THREAD* thread)
+{
+	char buffer[65536];
+
+	while (read(benchPipeline.fds[0], buffer, sizeof(buffer)) > 0);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Build a packet of the pipeline benchmark, shaped like a channel write of a download.
+ */
+static Packet* bench_pipeline_packet(PUCHAR chunk)
+{
+	Packet* packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_write");
+
+	if (packet)
+	{
+		packet_add_tlv_string(packet, TLV_TYPE_REQUEST_ID, "bench");
+		packet_add_tlv_uint(packet, TLV_TYPE_CHANNEL_ID, 1);
+		packet_add_tlv_raw(packet, TLV_TYPE_CHANNEL_DATA, chunk, BENCH_PIPELINE_CHUNK);
+	}
+
+	return packet;
+}
+
+/*!
+ * @brief Send every packet of one round of the pipeline benchmark.
+ * @param workers Number of pipeline workers, or zero for the inline path.
+ * @returns Indication of success or failure.
+ */
+static DWORD bench_pipeline_run(DWORD workers, DWORD packets, PUCHAR chunk, CryptoContext* crypto)
+{
+	PacketPipeline* pipeline = NULL;
+	DWORD index, result = ERROR_SUCCESS;
+	char name[32], count[16];
+	QWORD start, elapsed;
+
+	if (workers)
+	{
+		snprintf(count, sizeof(count), "%u", (unsigned int)workers);
+		setenv(PIPELINE_ENV_WORKERS, count, 1);
+
+		if (!(pipeline = pipeline_create(NULL, bench_pipeline_write)))
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	benchPipeline.written = 0;
+	start = bench_now();
+
+	for (index = 0; index < packets && result == ERROR_SUCCESS; index++)
+	{
+		Packet* packet = bench_pipeline_packet(chunk);
+		PUCHAR origPayload;
+
+		if (!packet)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		if (pipeline)
+		{
+			result = pipeline_transmit(pipeline, packet, crypto);
+			continue;
+		}
+
+		// what packet_transmit_via_ssl does without a pipeline: the header and the
+		// payload are written separately, straight out of the packet
+		origPayload = packet->payload;
+		if ((result = crypto->handlers.encrypt(crypto, packet->payload, packet->payloadLength,
+			&packet->payload, &packet->payloadLength)) == ERROR_SUCCESS)
+		{
+			free(origPayload);
+			packet->header.length = htonl(packet->payloadLength + sizeof(TlvHeader));
+
+			if ((result = bench_pipeline_write(NULL, (PUCHAR)&packet->header, sizeof(TlvHeader))) == ERROR_SUCCESS)
+			{
+				result = bench_pipeline_write(NULL, packet->payload, packet->payloadLength);
+			}
+		}
+
+		packet_destroy(packet);
+	}
+
+	// the pipeline has only finished once everything queued has been written
+	pipeline_destroy(pipeline);
+	elapsed = bench_now() - start;
+
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	if (workers)
+	{
+		snprintf(name, sizeof(name), "pipeline, %u worker%s", (unsigned int)workers, workers > 1 ? "s" : "");
+	}
+	else
+	{
+		snprintf(name, sizeof(name), "inline");
+	}
+
+	printf("%-28s %10.1f MB/s  (%llu bytes in %llu us)\n", name,
+		(double)benchPipeline.written / elapsed, (unsigned long long)benchPipeline.written,
+		(unsigned long long)elapsed);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Compare download throughput with and without the outbound pipeline.
+ */
+static int bench_pipeline(DWORD iterations)
+{
+	static const DWORD workers[] = { 0, 1, 2, 4 };
+	static const UCHAR key[16] = { 0 };
+	CryptoContext crypto;
+	THREAD* drain = NULL;
+	PUCHAR chunk = NULL;
+	DWORD index, packets, result = ERROR_SUCCESS;
+
+	// each packet carries a megabyte, so a few hundred of them is plenty
+	packets = iterations / 4000 + 1;
+
+	memset(&benchPipeline, 0, sizeof(benchPipeline));
+	benchPipeline.fds[0] = benchPipeline.fds[1] = -1;
+
+	memset(&crypto, 0, sizeof(crypto));
+	xor_populate_handlers(&crypto);
+	crypto.extension = (LPVOID)0x5a5a5a5a;
+
+	do
+	{
+		if (!(chunk = (PUCHAR)malloc(BENCH_PIPELINE_CHUNK))
+			|| !(benchPipeline.record = (PUCHAR)malloc(BENCH_PIPELINE_RECORD + EVP_MAX_BLOCK_LENGTH))
+			|| !(benchPipeline.cipher = EVP_CIPHER_CTX_new()))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		for (index = 0; index < BENCH_PIPELINE_CHUNK; index++)
+		{
+			chunk[index] = (UCHAR)(index * 31);
+		}
+
+		if (!EVP_EncryptInit_ex(benchPipeline.cipher, EVP_aes_128_gcm(), NULL, key, key))
+		{
+			result = ERROR_NOT_SUPPORTED;
+			break;
+		}
+
+		if (pipe(benchPipeline.fds) != 0)
+		{
+			benchPipeline.fds[0] = benchPipeline.fds[1] = -1;
+			result = errno;
+			break;
+		}
+
+		if (!(drain = thread_create(bench_pipeline_drain, NULL, NULL, NULL)) || !thread_run(drain))
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		for (index = 0; index < sizeof(workers) / sizeof(workers[0]) && result == ERROR_SUCCESS; index++)
+		{
+			result = bench_pipeline_run(workers[index], packets, chunk, &crypto);
+		}
+	} while (0);
+
+	// closing the write end lets the drain thread finish
+	if (benchPipeline.fds[1] >= 0)
+	{
+		close(benchPipeline.fds[1]);
+	}
+
+	if (drain)
+	{
+		thread_join(drain);
+		thread_destroy(drain);
+	}
+
+	if (benchPipeline.fds[0] >= 0)
+	{
+		close(benchPipeline.fds[0]);
+	}
+
+	if (benchPipeline.cipher)
+	{
+		EVP_CIPHER_CTX_free(benchPipeline.cipher);
+	}
+
+	free(benchPipeline.record);
+	free(chunk);
+
+	if (result != ERROR_SUCCESS)
+	{
+		fprintf(stderr, "pipeline benchmark failed: %u\n", (unsigned int)result);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*!
+ * @brief Build a request carrying every argument of the decode benchmark's schema.
+ * @details The arguments come after the method and request identifier, the way a
+ *          client lays them out, so the getters have to skip over those first.
+ */
+static Packet* bench_decode_request(DWORD index)
+{
+	static BYTE data[BENCH_DECODE_DATA];
+	char value[64];
+	Packet* packet = packet_create(PACKET_TLV_TYPE_REQUEST, "stdapi_fs_bench");
+
+	if (!packet)
+	{
+		return NULL;
+	}
+
+	snprintf(value, sizeof(value), "bench%u", (unsigned int)index);
+	packet_add_tlv_string(packet, TLV_TYPE_REQUEST_ID, value);
+	snprintf(value, sizeof(value), "/var/tmp/metsrv_bench/%u/file.bin", (unsigned int)index);
+	packet_add_tlv_string(packet, TLV_TYPE_LIBRARY_PATH, value);
+	packet_add_tlv_string(packet, TLV_TYPE_TARGET_PATH, "/var/tmp/metsrv_bench/target.bin");
+	packet_add_tlv_uint(packet, TLV_TYPE_FLAGS, index);
+	packet_add_tlv_uint(packet, TLV_TYPE_LENGTH, 4096);
+	packet_add_tlv_qword(packet, TLV_TYPE_SEEK_OFFSET64, (QWORD)index << 32);
+	packet_add_tlv_bool(packet, TLV_TYPE_BOOL, TRUE);
+	packet_add_tlv_raw(packet, TLV_TYPE_DATA, data, sizeof(data));
+
+	return packet;
+}
+
+/*!
+ * @brief Compare per-argument getters with a single schema decode.
+ */
+static int bench_decode(DWORD iterations)
+{
+	Packet* packets[BENCH_DECODE_PACKETS];
+	BenchDecodeRequest args;
+	Command command;
+	DWORD index, checksum;
+	QWORD start;
+
+	// a command without a schema or argument types, so every TLV is walked
+	memset(&command, 0, sizeof(command));
+
+	for (index = 0; index < BENCH_DECODE_PACKETS; index++)
+	{
+		if (!(packets[index] = bench_decode_request(index)))
+		{
+			fprintf(stderr, "unable to build the requests\n");
+			return 1;
+		}
+	}
+
+	checksum = 0;
+	start = bench_now();
+	for (index = 0; index < iterations; index++)
+	{
+		Packet* packet = packets[index % BENCH_DECODE_PACKETS];
+		Tlv data;
+
+		args.path = packet_get_tlv_value_string(packet, TLV_TYPE_LIBRARY_PATH);
+		args.target = packet_get_tlv_value_string(packet, TLV_TYPE_TARGET_PATH);
+		args.flags = packet_get_tlv_value_uint(packet, TLV_TYPE_FLAGS);
+		args.length = packet_get_tlv_value_uint(packet, TLV_TYPE_LENGTH);
+		args.offset = packet_get_tlv_value_qword(packet, TLV_TYPE_SEEK_OFFSET64);
+		args.recursive = packet_get_tlv_value_bool(packet, TLV_TYPE_BOOL);
+		packet_get_tlv(packet, TLV_TYPE_DATA, &data);
+
+		checksum += args.flags + args.length + (DWORD)(args.offset >> 32) + args.recursive
+			+ (args.path ? args.path[0] : 0) + (args.target ? args.target[0] : 0) + data.header.length;
+	}
+	bench_report("getters", bench_now() - start, iterations, checksum);
+
+	checksum = 0;
+	start = bench_now();
+	for (index = 0; index < iterations; index++)
+	{
+		Packet* packet = packets[index % BENCH_DECODE_PACKETS];
+		Tlv data;
+
+		if (command_validate_arguments(&command, packet) != ERROR_SUCCESS)
+		{
+			fprintf(stderr, "validation failed\n");
+			return 1;
+		}
+
+		args.path = packet_get_tlv_value_string(packet, TLV_TYPE_LIBRARY_PATH);
+		args.target = packet_get_tlv_value_string(packet, TLV_TYPE_TARGET_PATH);
+		args.flags = packet_get_tlv_value_uint(packet, TLV_TYPE_FLAGS);
+		args.length = packet_get_tlv_value_uint(packet, TLV_TYPE_LENGTH);
+		args.offset = packet_get_tlv_value_qword(packet, TLV_TYPE_SEEK_OFFSET64);
+		args.recursive = packet_get_tlv_value_bool(packet, TLV_TYPE_BOOL);
+		packet_get_tlv(packet, TLV_TYPE_DATA, &data);
+
+		checksum += args.flags + args.length + (DWORD)(args.offset >> 32) + args.recursive
+			+ (args.path ? args.path[0] : 0) + (args.target ? args.target[0] : 0) + data.header.length;
+	}
+	bench_report("argument walk + getters", bench_now() - start, iterations, checksum);
+
+	checksum = 0;
+	start = bench_now();
+	for (index = 0; index < iterations; index++)
+	{
+		Packet* packet = packets[index % BENCH_DECODE_PACKETS];
+
+		if (packet_decode(packet, &BenchDecodeRequestSchema, &args) != ERROR_SUCCESS)
+		{
+			fprintf(stderr, "decode failed\n");
+			return 1;
+		}
+
+		checksum += args.flags + args.length + (DWORD)(args.offset >> 32) + args.recursive
+			+ args.path[0] + args.target[0] + args.data.header.length;
+	}
+	bench_report("packet_decode", bench_now() - start, iterations, checksum);
+
+	checksum = 0;
+	start = bench_now();
+	for (index = 0; index < iterations; index++)
+	{
+		Packet* packet = packets[index % BENCH_DECODE_PACKETS];
+
+		// each packet is only dispatched once, so start every iteration without the cached decode
+		free(packet->decoded);
+		packet->decoded = NULL;
+		packet->decodedSchema = NULL;
+
+		if (packet_validate_schema(packet, &BenchDecodeRequestSchema) != ERROR_SUCCESS
+			|| packet_decode(packet, &BenchDecodeRequestSchema, &args) != ERROR_SUCCESS)
+		{
+			fprintf(stderr, "decode failed\n");
+			return 1;
+		}
+
+		checksum += args.flags + args.length + (DWORD)(args.offset >> 32) + args.recursive
+			+ args.path[0] + args.target[0] + args.data.header.length;
+	}
+	bench_report("schema validate + decode", bench_now() - start, iterations, checksum);
+
+	for (index = 0; index < BENCH_DECODE_PACKETS; index++)
+	{
+		packet_destroy(packets[index]);
+	}
+
+	return 0;
+}
+
+/*! @brief The client's side of the stage benchmark. */
+typedef struct _BenchStage
+{
+	Remote* remote;                 ///< The server side the image is staged into.
+	Transport transport;            ///< Stub transport the server talks to the client through.
+	LOCK* lock;                     ///< Guards the awaited response.
+	EVENT* answered;                ///< Signalled when the awaited response arrives.
+	char waiting[32];               ///< Request identifier of the awaited response.
+	Packet* response;               ///< The awaited response, once it has arrived.
+	DWORD sequence;                 ///< Number of requests made.
+	char directory[PATH_MAX];       ///< Directory the images are read from.
+	DWORD requested;                ///< Number of images the server asked for.
+} BenchStage;
+
+static BenchStage benchStage;
+
+/*!
+ * @brief Build a core_loadlib request for an image on disk, the way a client stages an extension.
+ * @returns The request, or \c NULL if the image couldn't be read.
+ */
+static Packet* bench_stage_loadlib(const char* path, const char* name, DWORD capabilities, DWORD* size)
+{
+	Packet* request = NULL;
+	FILE* file = NULL;
+	PUCHAR data = NULL;
+	long length;
+
+	do
+	{
+		if (!(file = fopen(path, "rb")) || fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) <= 0
+			|| fseek(file, 0, SEEK_SET) != 0)
+		{
+			break;
+		}
+
+		if (!(data = (PUCHAR)malloc(length)) || fread(data, 1, length, file) != (size_t)length)
+		{
+			break;
+		}
+
+		if (!(request = packet_create(PACKET_TLV_TYPE_REQUEST, "core_loadlib")))
+		{
+			break;
+		}
+
+		packet_add_tlv_string(request, TLV_TYPE_LIBRARY_PATH, name);
+		packet_add_tlv_string(request, TLV_TYPE_TARGET_PATH, name);
+		packet_add_tlv_uint(request, TLV_TYPE_FLAGS, LOAD_LIBRARY_FLAG_EXTENSION);
+		packet_add_tlv_raw(request, TLV_TYPE_DATA, data, length);
+		if (capabilities)
+		{
+			packet_add_tlv_uint(request, TLV_TYPE_CLIENT_CAPABILITIES, capabilities);
+		}
+
+		if (size)
+		{
+			*size = (DWORD)length;
+		}
+	} while (0);
+
+	if (data)
+	{
+		free(data);
+	}
+	if (file)
+	{
+		fclose(file);
+	}
+
+	return request;
+}
+
+/*!
+ * @brief Stub transport routine of the stage benchmark.
+ * @details Answers the server asking for an image by staging it, and hands the
+ *          awaited response to the benchmark.
+ */
+static DWORD bench_stage_transmit(Remote* remote, Packet* packet, PacketRequestCompletion* completion)
+{
+	PCHAR method = packet_get_tlv_value_string(packet, TLV_TYPE_METHOD);
+	PCHAR requestId = packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID);
+	PCHAR image;
+	Packet* request;
+	char path[PATH_MAX];
+
+	if (packet_get_type(packet) == PACKET_TLV_TYPE_REQUEST && method && strcmp(method, "core_loadlib_request") == 0)
+	{
+		if ((image = packet_get_tlv_value_string(packet, TLV_TYPE_LIBRARY_PATH)))
+		{
+			benchStage.requested++;
+			snprintf(path, sizeof(path), "%s/%s.lso", benchStage.directory, image);
+			if ((request = bench_stage_loadlib(path, image, 0, NULL)))
+			{
+				packet_add_tlv_string(request, TLV_TYPE_REQUEST_ID, "stage-requested");
+				command_handle(remote, request);
+			}
+			else
+			{
+				fprintf(stderr, "unable to read %s\n", path);
+			}
+		}
+		packet_destroy(packet);
+		return ERROR_SUCCESS;
+	}
+
+	lock_acquire(benchStage.lock);
+	if (!benchStage.response && requestId && strcmp(benchStage.waiting, requestId) == 0)
+	{
+		benchStage.response = packet;
+		packet = NULL;
+		event_signal(benchStage.answered);
+	}
+	lock_release(benchStage.lock);
+
+	if (packet)
+	{
+		packet_destroy(packet);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Make a request of the server and time how long its response takes.
+ * @returns The result of the request, or \c ERROR_TIMEOUT if no response came.
+ */
+static DWORD bench_stage_call(Packet* request, QWORD* elapsed)
+{
+	Packet* response = NULL;
+	DWORD result = ERROR_TIMEOUT;
+	QWORD start, deadline;
+
+	if (!request)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	lock_acquire(benchStage.lock);
+	snprintf(benchStage.waiting, sizeof(benchStage.waiting), "stage-%u", (unsigned int)++benchStage.sequence);
+	benchStage.response = NULL;
+	lock_release(benchStage.lock);
+
+	packet_add_tlv_string(request, TLV_TYPE_REQUEST_ID, benchStage.waiting);
+
+	start = bench_now();
+	deadline = start + (QWORD)BENCH_STAGE_TIMEOUT * 1000;
+
+	// command_handle takes ownership of the packet
+	command_handle(benchStage.remote, request);
+
+	while (TRUE)
+	{
+		lock_acquire(benchStage.lock);
+		response = benchStage.response;
+		benchStage.response = NULL;
+		if (response || bench_now() >= deadline)
+		{
+			benchStage.waiting[0] = 0;
+			lock_release(benchStage.lock);
+			break;
+		}
+		lock_release(benchStage.lock);
+
+		event_poll(benchStage.answered, 100);
+	}
+
+	*elapsed = bench_now() - start;
+
+	if (response)
+	{
+		result = packet_get_tlv_value_uint(response, TLV_TYPE_RESULT);
+		packet_destroy(response);
+	}
+
+	return result;
+}
+
+/*!
+ * @brief Stage an image and time the first call into each of its command groups.
+ */
+static int bench_stage(const char* path, DWORD capabilities)
+{
+	static const char* methods[] =
+	{
+		"stdapi_fs_getwd",
+		"stdapi_sys_config_getuid",
+		"stdapi_net_config_get_interfaces",
+		"stdapi_sys_config_getuid",
+	};
+	const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	char image[PATH_MAX];
+	DWORD index, result, size = 0;
+	QWORD elapsed, total;
+
+	memset(&benchStage, 0, sizeof(benchStage));
+
+	strncpy(benchStage.directory, path, sizeof(benchStage.directory) - 1);
+	if (strrchr(benchStage.directory, '/'))
+	{
+		*strrchr(benchStage.directory, '/') = 0;
+	}
+	else
+	{
+		strcpy(benchStage.directory, ".");
+	}
+
+	// extensions name themselves, the loader only needs something to call the image
+	strncpy(image, name, sizeof(image) - 1);
+	image[sizeof(image) - 1] = 0;
+	if (strrchr(image, '.'))
+	{
+		*strrchr(image, '.') = 0;
+	}
+
+	if (!(benchStage.lock = lock_create()) || !(benchStage.answered = event_create())
+		|| !(benchStage.remote = remote_allocate()))
+	{
+		fprintf(stderr, "unable to allocate the local server\n");
+		return 1;
+	}
+
+	benchStage.transport.type = METERPRETER_TRANSPORT_SSL;
+	benchStage.transport.packet_transmit = bench_stage_transmit;
+	benchStage.remote->transport = &benchStage.transport;
+
+	register_dispatch_routines();
+
+	result = bench_stage_call(bench_stage_loadlib(path, image, capabilities, &size), &elapsed);
+	printf("%-34s %10llu us  (%u bytes, result %u)\n", "core_loadlib", (unsigned long long)elapsed,
+		size, (unsigned int)result);
+	if (result != ERROR_SUCCESS)
+	{
+		return 1;
+	}
+	total = elapsed;
+
+	for (index = 0; index < sizeof(methods) / sizeof(methods[0]); index++)
+	{
+		result = bench_stage_call(packet_create(PACKET_TLV_TYPE_REQUEST, methods[index]), &elapsed);
+		total += elapsed;
+		printf("%-34s %10llu us  (result %u, %llu us since staging)\n", methods[index], (unsigned long long)elapsed,
+			(unsigned int)result, (unsigned long long)total);
+	}
+
+	printf("images requested by the server:    %u\n", benchStage.requested);
+
+	command_join_threads(benchStage.remote);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	DWORD iterations = BENCH_DEFAULT_ITERATIONS;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s decode|scheduler|pipeline [iterations]\n"
+			"       %s stage <image> [capabilities]\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "stage") == 0 && argc > 2)
+	{
+		return bench_stage(argv[2], argc > 3 ? strtoul(argv[3], NULL, 10) : 0);
+	}
+
+	if (argc > 2 && !(iterations = strtoul(argv[2], NULL, 10)))
+	{
+		iterations = BENCH_DEFAULT_ITERATIONS;
+	}
+
+	if (strcmp(argv[1], "decode") == 0)
+	{
+		return bench_decode(iterations);
+	}
+
+	if (strcmp(argv[1], "scheduler") == 0)
+	{
+		return bench_scheduler(iterations);
+	}
+
+	if (strcmp(argv[1], "pipeline") == 0)
+	{
+		return bench_pipeline(iterations);
+	}
+
+	fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+	return 1;
+}
@@ -0,0 +1,281 @@
+/*!
+ * @file metsrv_replay.c
+ * @brief Offline replay driver for recorded sessions.
+ * @details Reads a recording made with METERPRETER_RECORD set (see recorder.h),
+ *          and feeds each inbound packet into command_handle against a local
+ *          server instance. Responses are swallowed by a stub transport, which
+ *          matches them back to their requests so that per-request latency and
+ *          overall throughput can be reported. This turns a recorded session into
+ *          a repeatable benchmark without needing a live handler.
+ *
+ *          usage: metsrv_replay [-r] <recording>
+ *
+ *          -r  Honour the recorded inter-packet timing rather than replaying
+ *              as fast as possible.
+ */
+#include "metsrv.h"
+
+#include <sys/time.h>
+
+/*! @brief Maximum number of requests that can be awaiting a response at once. */
+#define REPLAY_MAX_PENDING    1024
+
+/*!
+ * @brief Methods that are not replayed because their side effects would
+ *        terminate or detach the local server.
+ */
+static const char* replaySkipMethods[] =
+{
+	"core_shutdown",
+	"core_migrate",
+	"core_transport_change",
+	"core_crypto_negotiate",
+	NULL
+};
+
+/*! @brief A request that has been dispatched and is awaiting its response. */
+typedef struct _ReplayPending
+{
+	char requestId[64];   ///< Request identifier of the dispatched packet.
+	QWORD start;          ///< Time the request was dispatched, in microseconds.
+} ReplayPending;
+
+/*! @brief Counters gathered over the course of a replay. */
+typedef struct _ReplayStats
+{
+	LOCK* lock;                               ///< Guards everything below.
+	ReplayPending pending[REPLAY_MAX_PENDING];///< Requests awaiting responses.
+	DWORD dispatched;                         ///< Number of requests dispatched.
+	DWORD skipped;                            ///< Number of requests not replayed.
+	DWORD recordedOutbound;                   ///< Number of outbound packets in the recording.
+	DWORD outbound;                           ///< Number of outbound packets sent during replay.
+	DWORD matched;                            ///< Number of responses matched to a request.
+	QWORD latencyTotal;                       ///< Sum of matched request latencies.
+	QWORD latencyMin;                         ///< Smallest matched request latency.
+	QWORD latencyMax;                         ///< Largest matched request latency.
+	QWORD dispatchTotal;                      ///< Time spent inside command_handle.
+} ReplayStats;
+
+static ReplayStats stats;
+
+/*!
+ * @brief Get the current time in microseconds.
+ */
+static QWORD replay_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*!
+ * @brief Determine whether a method should be skipped during replay.
+ */
+static BOOL replay_should_skip(const char* method)
+{
+	DWORD index;
+
+	for (index = 0; replaySkipMethods[index]; index++)
+	{
+		if (strcmp(method, replaySkipMethods[index]) == 0)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*!
+ * @brief Track a dispatched request so its response can be matched to it.
+ */
+static VOID replay_track_request(Packet* packet, QWORD start)
+{
+	PCHAR requestId = packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID);
+	DWORD index;
+
+	if (!requestId)
+	{
+		return;
+	}
+
+	lock_acquire(stats.lock);
+
+	for (index = 0; index < REPLAY_MAX_PENDING; index++)
+	{
+		if (!stats.pending[index].requestId[0])
+		{
+			strncpy(stats.pending[index].requestId, requestId, sizeof(stats.pending[index].requestId) - 1);
+			stats.pending[index].start = start;
+			break;
+		}
+	}
+
+	lock_release(stats.lock);
+}
+
+/*!
+ * @brief Stub transport routine that swallows outbound packets, recording
+ *        the latency of any that answer a tracked request.
+ */
+static DWORD replay_packet_transmit(Remote* remote, Packet* packet, PacketRequestCompletion* completion)
+{
+	PCHAR requestId = packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID);
+	QWORD now = replay_now();
+	QWORD latency;
+	DWORD index;
+
+	lock_acquire(stats.lock);
+
+	stats.outbound++;
+
+	for (index = 0; requestId && index < REPLAY_MAX_PENDING; index++)
+	{
+		if (strcmp(stats.pending[index].requestId, requestId) == 0)
+		{
+			latency = now - stats.pending[index].start;
+			stats.pending[index].requestId[0] = 0;
+
+			stats.matched++;
+			stats.latencyTotal += latency;
+			if (!stats.latencyMin || latency < stats.latencyMin)
+			{
+				stats.latencyMin = latency;
+			}
+			if (latency > stats.latencyMax)
+			{
+				stats.latencyMax = latency;
+			}
+			break;
+		}
+	}
+
+	lock_release(stats.lock);
+
+	packet_destroy(packet);
+
+	return ERROR_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	Transport transport;
+	Remote* remote = NULL;
+	Packet* packet = NULL;
+	FILE* recording = NULL;
+	BOOL realtime = FALSE;
+	QWORD timestamp, replayStart, elapsed;
+	DWORD direction, result;
+	const char* path = NULL;
+	PCHAR method;
+	int arg;
+
+	for (arg = 1; arg < argc; arg++)
+	{
+		if (strcmp(argv[arg], "-r") == 0)
+		{
+			realtime = TRUE;
+		}
+		else
+		{
+			path = argv[arg];
+		}
+	}
+
+	if (!path)
+	{
+		fprintf(stderr, "usage: %s [-r] <recording>\n", argv[0]);
+		return 1;
+	}
+
+	if ((result = recorder_open(path, &recording)) != ERROR_SUCCESS)
+	{
+		fprintf(stderr, "unable to open recording %s: %u\n", path, result);
+		return 1;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&transport, 0, sizeof(transport));
+
+	if (!(stats.lock = lock_create()) || !(remote = remote_allocate()))
+	{
+		fprintf(stderr, "unable to allocate the local server\n");
+		return 1;
+	}
+
+	transport.type = METERPRETER_TRANSPORT_SSL;
+	transport.packet_transmit = replay_packet_transmit;
+	remote->transport = &transport;
+
+	register_dispatch_routines();
+	scheduler_initialize(remote);
+
+	replayStart = replay_now();
+
+	while ((result = recorder_read_packet(recording, &timestamp, &direction, &packet)) == ERROR_SUCCESS)
+	{
+		QWORD start;
+
+		if (direction == RECORDER_DIRECTION_OUTBOUND)
+		{
+			stats.recordedOutbound++;
+			packet_destroy(packet);
+			continue;
+		}
+
+		method = packet_get_tlv_value_string(packet, TLV_TYPE_METHOD);
+		if (!method || replay_should_skip(method))
+		{
+			stats.skipped++;
+			packet_destroy(packet);
+			continue;
+		}
+
+		if (realtime)
+		{
+			QWORD now = replay_now() - replayStart;
+			if (timestamp > now)
+			{
+				usleep((useconds_t)(timestamp - now));
+			}
+		}
+
+		start = replay_now();
+		replay_track_request(packet, start);
+		stats.dispatched++;
+
+		// command_handle takes ownership of the packet
+		command_handle(remote, packet);
+
+		stats.dispatchTotal += replay_now() - start;
+	}
+
+	if (result != ERROR_NOT_FOUND)
+	{
+		fprintf(stderr, "recording is truncated or corrupt: %u\n", result);
+	}
+
+	// wait for every threaded command to finish before taking the final measurements
+	command_join_threads(remote);
+	elapsed = replay_now() - replayStart;
+
+	scheduler_destroy(remote);
+	deregister_dispatch_routines(remote);
+	fclose(recording);
+
+	printf("requests dispatched:  %u (%u skipped)\n", stats.dispatched, stats.skipped);
+	printf("outbound packets:     %u sent, %u recorded, %u matched to requests\n", stats.outbound, stats.recordedOutbound, stats.matched);
+	printf("elapsed:              %llu us\n", (unsigned long long)elapsed);
+	printf("throughput:           %.1f requests/s\n", elapsed ? (double)stats.dispatched * 1000000 / elapsed : 0.0);
+	printf("dispatch time (avg):  %llu us\n", (unsigned long long)(stats.dispatched ? stats.dispatchTotal / stats.dispatched : 0));
+	printf("latency min/avg/max:  %llu/%llu/%llu us\n",
+		(unsigned long long)stats.latencyMin,
+		(unsigned long long)(stats.matched ? stats.latencyTotal / stats.matched : 0),
+		(unsigned long long)stats.latencyMax);
+
+	remote->transport = NULL;
+	remote_deallocate(remote);
+	lock_destroy(stats.lock);
+
+	return 0;
+}
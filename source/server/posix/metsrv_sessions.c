@@ -0,0 +1,640 @@
+/*!
+ * @file metsrv_sessions.c
+ * @brief Loopback driver that runs two sessions in one local server at once.
+ * @details Sets up two \c Remote instances, each with a stub transport like
+ *          metsrv_replay's, and drives both from threads of their own at the
+ *          same time. Every round a session opens a synchronous buffered
+ *          channel, writes to it and reads the data back, tries to write to
+ *          and close the channel the other session currently has open, closes
+ *          its own channel and pokes one of its waitables.
+ *
+ *          Session state is isolated if:
+ *            - a channel can only be found through the session that opened it,
+ *              and every request naming the other session's channel fails
+ *              with ERROR_NOT_FOUND while the owner's own close succeeds;
+ *            - data read back from a channel is the data its session wrote;
+ *            - every response goes out through the session it answers;
+ *            - a completion handler only fires for responses its session gets;
+ *            - waitables are only notified with the \c Remote they were
+ *              inserted for, and ending a session destroys exactly its own
+ *              waitables while the other session's keep being serviced.
+ *
+ *          usage: metsrv_sessions [rounds]
+ *
+ *          The exit code is 0 if the sessions stayed isolated, 2 if they
+ *          didn't and 1 if the local server couldn't be set up.
+ */
+#include "metsrv.h"
+
+#include <sys/time.h>
+
+/*! @brief Number of sessions driven at once. */
+#define SESSIONS_COUNT             2
+/*! @brief Number of rounds each session runs if none is given. */
+#define SESSIONS_DEFAULT_ROUNDS    2000
+/*! @brief Number of waitables each session inserts into the scheduler. */
+#define SESSIONS_WAITABLES         8
+/*! @brief Longest time to wait for a response or for waitables to catch up, in milliseconds. */
+#define SESSIONS_TIMEOUT           10000
+/*! @brief Number of failed checks that are described before the rest are only counted. */
+#define SESSIONS_MAX_REPORTED      20
+
+/*! @brief State of one of the sessions being driven. */
+typedef struct _SessionState
+{
+	char name[8];                                ///< Name of the session, prefixes its request identifiers.
+	Remote* remote;                              ///< The session's server side.
+	Transport transport;                         ///< Stub transport the server responds through.
+	LOCK* lock;                                  ///< Guards everything below that changes.
+	EVENT* answered;                             ///< Signalled when the awaited response arrives.
+	char waiting[64];                            ///< Request identifier of the awaited response.
+	Packet* response;                            ///< The awaited response, once it has arrived.
+	DWORD sequence;                              ///< Number of requests made.
+	DWORD rounds;                                ///< Number of rounds completed.
+	volatile DWORD liveChannel;                  ///< Channel currently open on the session, zero if none.
+	int pipes[SESSIONS_WAITABLES][2];            ///< The session's waitables.
+	DWORD poked;                                 ///< Bytes written to the waitables.
+	DWORD notified;                              ///< Notifications of the session's waitables.
+	DWORD destroyed;                             ///< Waitables of the session that have been destroyed.
+	DWORD completions;                           ///< Completion handlers of the session that have fired.
+	struct _SessionState* peer;                  ///< The other session.
+} SessionState;
+
+static SessionState sessions[SESSIONS_COUNT];
+static LOCK* failureLock = NULL;
+static DWORD failures = 0;
+
+/*!
+ * @brief Get the current time in milliseconds.
+ */
+static QWORD sessions_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*!
+ * @brief Record the outcome of a check, describing the first few that fail.
+ * @return The outcome of the check.
+ */
+static BOOL sessions_check(BOOL passed, SessionState* session, const char* what, DWORD value)
+{
+	if (passed)
+	{
+		return TRUE;
+	}
+
+	lock_acquire(failureLock);
+	if (++failures <= SESSIONS_MAX_REPORTED)
+	{
+		printf("FAIL: session %s: %s (%u)\n", session->name, what, value);
+	}
+	lock_release(failureLock);
+
+	return FALSE;
+}
+
+/*!
+ * @brief Find the session a \c Remote belongs to.
+ */
+static SessionState* sessions_find(Remote* remote)
+{
+	DWORD index;
+
+	for (index = 0; index < SESSIONS_COUNT; index++)
+	{
+		if (sessions[index].remote == remote)
+		{
+			return &sessions[index];
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * @brief Stub transport routine that hands each response to the session awaiting it.
+ * @details The request identifiers a session uses start with its name, so a
+ *          response that goes out through the wrong session is caught here.
+ */
+static DWORD sessions_packet_transmit(Remote* remote, Packet* packet, PacketRequestCompletion* completion)
+{
+	SessionState* session = sessions_find(remote);
+	PCHAR requestId = packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID);
+
+	if (!session || !requestId)
+	{
+		sessions_check(FALSE, session ? session : &sessions[0], "packet without a request identifier sent", 0);
+		packet_destroy(packet);
+		return ERROR_SUCCESS;
+	}
+
+	lock_acquire(session->lock);
+
+	if (!session->response && strcmp(session->waiting, requestId) == 0)
+	{
+		session->response = packet;
+		packet = NULL;
+		event_signal(session->answered);
+	}
+
+	lock_release(session->lock);
+
+	if (packet)
+	{
+		if (strncmp(requestId, session->name, strlen(session->name)) != 0)
+		{
+			sessions_check(FALSE, session, "response to another session's request sent", 0);
+		}
+		else
+		{
+			sessions_check(FALSE, session, "unexpected response sent", 0);
+		}
+		packet_destroy(packet);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Make a request of a session's server side and wait for its response.
+ * @return The response, which the caller destroys, or \c NULL if none came.
+ */
+static Packet* sessions_call(SessionState* session, Packet* request)
+{
+	Packet* response = NULL;
+	char requestId[64];
+	QWORD deadline;
+
+	if (!request)
+	{
+		return NULL;
+	}
+
+	snprintf(requestId, sizeof(requestId), "%s-%u", session->name, (unsigned int)++session->sequence);
+	packet_add_tlv_string(request, TLV_TYPE_REQUEST_ID, requestId);
+
+	lock_acquire(session->lock);
+	strncpy(session->waiting, requestId, sizeof(session->waiting) - 1);
+	session->response = NULL;
+	lock_release(session->lock);
+
+	// command_handle takes ownership of the packet
+	command_handle(session->remote, request);
+
+	deadline = sessions_now() + SESSIONS_TIMEOUT;
+	while (TRUE)
+	{
+		lock_acquire(session->lock);
+		response = session->response;
+		session->response = NULL;
+		if (response || sessions_now() >= deadline)
+		{
+			session->waiting[0] = 0;
+			lock_release(session->lock);
+			break;
+		}
+		lock_release(session->lock);
+
+		event_poll(session->answered, 100);
+	}
+
+	sessions_check(response != NULL, session, "no response", session->sequence);
+
+	return response;
+}
+
+/*!
+ * @brief Make a request of a session and get the result its response carries.
+ */
+static DWORD sessions_call_result(SessionState* session, Packet* request)
+{
+	Packet* response = sessions_call(session, request);
+	DWORD result = ERROR_TIMEOUT;
+
+	if (response)
+	{
+		result = packet_get_tlv_value_uint(response, TLV_TYPE_RESULT);
+		packet_destroy(response);
+	}
+
+	return result;
+}
+
+/*!
+ * @brief Check whether a session lists a channel, without keeping hold of it.
+ */
+static BOOL sessions_channel_listed(Remote* remote, DWORD channelId)
+{
+	Channel* channel = channel_find_by_id(remote, channelId);
+
+	if (channel)
+	{
+		channel_release(channel);
+	}
+
+	return channel != NULL;
+}
+
+/*!
+ * @brief Build a request that names a channel.
+ */
+static Packet* sessions_channel_request(const char* method, DWORD channelId)
+{
+	Packet* request = packet_create(PACKET_TLV_TYPE_REQUEST, method);
+
+	if (request)
+	{
+		packet_add_tlv_uint(request, TLV_TYPE_CHANNEL_ID, channelId);
+	}
+
+	return request;
+}
+
+/*!
+ * @brief Build a request that writes data to a channel.
+ */
+static Packet* sessions_write_request(DWORD channelId, const char* data)
+{
+	Packet* request = sessions_channel_request("core_channel_write", channelId);
+
+	if (request)
+	{
+		packet_add_tlv_raw(request, TLV_TYPE_CHANNEL_DATA, (PUCHAR)data, (DWORD)strlen(data));
+		packet_add_tlv_uint(request, TLV_TYPE_LENGTH, (DWORD)strlen(data));
+	}
+
+	return request;
+}
+
+/*!
+ * @brief Waitable notify routine, consumes the byte that woke it.
+ */
+static DWORD sessions_waitable_notify(Remote* remote, LPVOID entryContext, LPVOID threadContext)
+{
+	SessionState* session = (SessionState*)entryContext;
+	int fd = session->pipes[(uintptr_t)threadContext][0];
+	char token;
+
+	sessions_check(remote == session->remote, session, "waitable notified with another session's remote", 0);
+
+	if (read(fd, &token, 1) == 1)
+	{
+		lock_acquire(session->lock);
+		session->notified++;
+		lock_release(session->lock);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Waitable destroy routine, counts the session's destroyed waitables.
+ */
+static DWORD sessions_waitable_destroy(HANDLE waitable, LPVOID entryContext, LPVOID threadContext)
+{
+	SessionState* session = (SessionState*)entryContext;
+
+	lock_acquire(session->lock);
+	session->destroyed++;
+	lock_release(session->lock);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Completion handler registered by the completion isolation check.
+ */
+static DWORD sessions_completion(Remote* remote, Packet* response, LPVOID context, LPCSTR method, DWORD result)
+{
+	SessionState* session = (SessionState*)context;
+
+	sessions_check(remote == session->remote, session, "completion handler fired for another session", 0);
+
+	lock_acquire(session->lock);
+	session->completions++;
+	lock_release(session->lock);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Wait for every byte written to a session's waitables to be consumed.
+ */
+static BOOL sessions_wait_notified(SessionState* session)
+{
+	QWORD deadline = sessions_now() + SESSIONS_TIMEOUT;
+	BOOL caughtUp = FALSE;
+
+	while (!caughtUp && sessions_now() < deadline)
+	{
+		lock_acquire(session->lock);
+		caughtUp = session->notified >= session->poked;
+		lock_release(session->lock);
+
+		if (!caughtUp)
+		{
+			usleep(1000);
+		}
+	}
+
+	return sessions_check(caughtUp && session->notified == session->poked, session,
+		"waitable notifications missing", session->poked - session->notified);
+}
+
+/*!
+ * @brief Run one round of channel and waitable traffic on a session.
+ */
+static VOID sessions_round(SessionState* session)
+{
+	Packet* request;
+	Packet* response;
+	DWORD channelId = 0, peerChannel;
+	Channel* channel;
+	Tlv data;
+	char marker[32];
+
+	if ((request = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_open")))
+	{
+		packet_add_tlv_uint(request, TLV_TYPE_FLAGS, CHANNEL_FLAG_SYNCHRONOUS);
+	}
+
+	if ((response = sessions_call(session, request)))
+	{
+		channelId = packet_get_tlv_value_uint(response, TLV_TYPE_CHANNEL_ID);
+		packet_destroy(response);
+	}
+
+	if (!sessions_check(channelId != 0, session, "channel open failed", 0))
+	{
+		return;
+	}
+
+	channel = channel_find_by_id(session->remote, channelId);
+	sessions_check(channel && channel_get_remote(channel) == session->remote, session, "own channel not found", channelId);
+	if (channel)
+	{
+		channel_release(channel);
+	}
+	sessions_check(!sessions_channel_listed(session->peer->remote, channelId), session, "channel visible to the other session", channelId);
+
+	session->liveChannel = channelId;
+
+	// the data has to come back from this session's channel, whatever the other one is writing
+	snprintf(marker, sizeof(marker), "%s:%u", session->name, (unsigned int)session->rounds);
+	sessions_check(sessions_call_result(session, sessions_write_request(channelId, marker)) == ERROR_SUCCESS,
+		session, "channel write failed", channelId);
+
+	if ((request = sessions_channel_request("core_channel_read", channelId)))
+	{
+		packet_add_tlv_uint(request, TLV_TYPE_LENGTH, sizeof(marker));
+	}
+
+	if ((response = sessions_call(session, request)))
+	{
+		sessions_check(packet_get_tlv(response, TLV_TYPE_CHANNEL_DATA, &data) == ERROR_SUCCESS
+			&& data.header.length == strlen(marker) && memcmp(data.buffer, marker, data.header.length) == 0,
+			session, "channel read returned other data", channelId);
+		packet_destroy(response);
+	}
+
+	// the other session's channel must be out of reach from this one
+	if ((peerChannel = session->peer->liveChannel))
+	{
+		sessions_check(sessions_call_result(session, sessions_write_request(peerChannel, marker)) == ERROR_NOT_FOUND,
+			session, "wrote to the other session's channel", peerChannel);
+		sessions_check(sessions_call_result(session, sessions_channel_request("core_channel_close", peerChannel)) == ERROR_NOT_FOUND,
+			session, "closed the other session's channel", peerChannel);
+	}
+
+	lock_acquire(session->lock);
+	session->poked++;
+	lock_release(session->lock);
+	write(session->pipes[session->rounds % SESSIONS_WAITABLES][1], "x", 1);
+
+	session->liveChannel = 0;
+	sessions_check(sessions_call_result(session, sessions_channel_request("core_channel_close", channelId)) == ERROR_SUCCESS,
+		session, "own channel close failed", channelId);
+	sessions_check(!sessions_channel_listed(session->remote, channelId), session, "closed channel still listed", channelId);
+}
+
+/*!
+ * @brief Thread that drives one session for the requested number of rounds.
+ */
+static DWORD THREADCALL sessions_thread(THREAD* thread)
+{
+	SessionState* session = (SessionState*)thread->parameter1;
+	DWORD rounds = (DWORD)(uintptr_t)thread->parameter2;
+
+	while (session->rounds < rounds)
+	{
+		sessions_round(session);
+		session->rounds++;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Check that a completion handler only fires for the session it was registered on.
+ */
+static VOID sessions_check_completions(SessionState* session)
+{
+	PacketRequestCompletion completion;
+	Packet* response;
+	DWORD index, fired;
+	QWORD deadline;
+
+	memset(&completion, 0, sizeof(completion));
+	completion.routine = sessions_completion;
+	completion.context = session;
+
+	if (!sessions_check(packet_add_completion_handler(session->remote, "sessions-shared", &completion) == ERROR_SUCCESS,
+		session, "unable to add a completion handler", 0))
+	{
+		return;
+	}
+
+	// the other session getting a response with the same identifier mustn't fire it,
+	// the response is to a channel close like those the server makes of the client
+	for (index = 0; index < 2; index++)
+	{
+		SessionState* target = index ? session : session->peer;
+
+		if ((response = packet_create(PACKET_TLV_TYPE_RESPONSE, "core_channel_close")))
+		{
+			packet_add_tlv_string(response, TLV_TYPE_REQUEST_ID, "sessions-shared");
+			packet_add_tlv_uint(response, TLV_TYPE_RESULT, ERROR_SUCCESS);
+			command_handle(target->remote, response);
+		}
+	}
+
+	// responses are handled on threads of their own, so give the handler time to fire
+	deadline = sessions_now() + SESSIONS_TIMEOUT;
+	do
+	{
+		usleep(1000);
+		lock_acquire(session->lock);
+		fired = session->completions;
+		lock_release(session->lock);
+	} while (!fired && sessions_now() < deadline);
+
+	// anything from the other session's response would have been dispatched first
+	usleep(100000);
+	command_join_threads(session->remote);
+	command_join_threads(session->peer->remote);
+
+	sessions_check(session->completions == 1, session, "completion handler fired the wrong number of times", session->completions);
+}
+
+int main(int argc, char **argv)
+{
+	THREAD* threads[SESSIONS_COUNT];
+	DWORD rounds = SESSIONS_DEFAULT_ROUNDS;
+	DWORD index, waitable;
+	QWORD start, elapsed;
+
+	if (argc > 1 && !(rounds = strtoul(argv[1], NULL, 10)))
+	{
+		fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	memset(sessions, 0, sizeof(sessions));
+	memset(threads, 0, sizeof(threads));
+
+	if (!(failureLock = lock_create()))
+	{
+		fprintf(stderr, "unable to allocate the local server\n");
+		return 1;
+	}
+
+	register_dispatch_routines();
+
+	for (index = 0; index < SESSIONS_COUNT; index++)
+	{
+		SessionState* session = &sessions[index];
+
+		snprintf(session->name, sizeof(session->name), "s%u", (unsigned int)index);
+		session->peer = &sessions[(index + 1) % SESSIONS_COUNT];
+
+		if (!(session->lock = lock_create()) || !(session->answered = event_create())
+			|| !(session->remote = remote_allocate()))
+		{
+			fprintf(stderr, "unable to allocate the local server\n");
+			return 1;
+		}
+
+		session->transport.type = METERPRETER_TRANSPORT_SSL;
+		session->transport.packet_transmit = sessions_packet_transmit;
+		session->remote->transport = &session->transport;
+
+		scheduler_initialize(session->remote);
+
+		for (waitable = 0; waitable < SESSIONS_WAITABLES; waitable++)
+		{
+			if (pipe(session->pipes[waitable]) != 0
+				|| scheduler_insert_pinned_waitable(session->remote, (HANDLE)(uintptr_t)session->pipes[waitable][0],
+					session, (LPVOID)(uintptr_t)waitable, sessions_waitable_notify, sessions_waitable_destroy,
+					index * SESSIONS_WAITABLES + waitable) != ERROR_SUCCESS)
+			{
+				fprintf(stderr, "unable to insert the waitables\n");
+				return 1;
+			}
+		}
+	}
+
+	for (index = 0; index < SESSIONS_COUNT; index++)
+	{
+		sessions_check_completions(&sessions[index]);
+	}
+
+	printf("driving %u sessions for %u rounds each\n", SESSIONS_COUNT, rounds);
+	start = sessions_now();
+
+	for (index = 0; index < SESSIONS_COUNT; index++)
+	{
+		if (!(threads[index] = thread_create(sessions_thread, &sessions[index], (LPVOID)(uintptr_t)rounds, NULL))
+			|| !thread_run(threads[index]))
+		{
+			fprintf(stderr, "unable to start the session threads\n");
+			return 1;
+		}
+	}
+
+	for (index = 0; index < SESSIONS_COUNT; index++)
+	{
+		thread_join(threads[index]);
+		thread_destroy(threads[index]);
+	}
+
+	elapsed = sessions_now() - start;
+
+	for (index = 0; index < SESSIONS_COUNT; index++)
+	{
+		SessionState* session = &sessions[index];
+
+		command_join_threads(session->remote);
+		sessions_wait_notified(session);
+
+		printf("session %s: %u rounds, %u requests, %u waitable notifications\n", session->name,
+			session->rounds, session->sequence, session->notified);
+	}
+
+	printf("elapsed:              %llu ms\n", (unsigned long long)elapsed);
+
+	// ending one session must take down its own waitables and leave the others running
+	for (index = 0; index < SESSIONS_COUNT; index++)
+	{
+		SessionState* session = &sessions[index];
+
+		scheduler_destroy(session->remote);
+
+		sessions_check(session->destroyed == SESSIONS_WAITABLES, session, "waitables destroyed when the session ended", session->destroyed);
+
+		for (waitable = index + 1; waitable < SESSIONS_COUNT; waitable++)
+		{
+			SessionState* other = &sessions[waitable];
+			DWORD pipe;
+
+			sessions_check(other->destroyed == 0, other, "waitables destroyed when another session ended", other->destroyed);
+
+			for (pipe = 0; pipe < SESSIONS_WAITABLES; pipe++)
+			{
+				lock_acquire(other->lock);
+				other->poked++;
+				lock_release(other->lock);
+				write(other->pipes[pipe][1], "x", 1);
+			}
+			sessions_wait_notified(other);
+		}
+	}
+
+	deregister_dispatch_routines(sessions[SESSIONS_COUNT - 1].remote);
+
+	for (index = 0; index < SESSIONS_COUNT; index++)
+	{
+		SessionState* session = &sessions[index];
+
+		for (waitable = 0; waitable < SESSIONS_WAITABLES; waitable++)
+		{
+			close(session->pipes[waitable][0]);
+			close(session->pipes[waitable][1]);
+		}
+
+		session->remote->transport = NULL;
+		remote_deallocate(session->remote);
+		event_destroy(session->answered);
+		lock_destroy(session->lock);
+	}
+
+	if (failures)
+	{
+		printf("FAIL: %u checks failed, the sessions are not isolated\n", failures);
+		return 2;
+	}
+
+	printf("PASS: channels, responses, completion handlers and waitables stayed with their session\n");
+	return 0;
+}
@@ -0,0 +1,1645 @@
+/*!
+ * @file metsrv_soak.c
+ * @brief Soak test driver that watches a local server for resource growth.
+ * @details Runs a local server instance, like metsrv_replay, and keeps it busy
+ *          with a looping mix of requests for as long as asked: pings with
+ *          plain and compressed payloads, threaded commands, channels that are
+ *          opened and closed again, buffered channels that are written to and
+ *          read back with pipelined requests, bandwidth tests and unknown
+ *          methods. The stub transport plays the client's part, answering any
+ *          request the server makes so that its completion handlers get to
+ *          fire and the channels it closes get released. Compressed payloads are built the way a client sends them, so
+ *          the server decompresses them into buffers hung off the packet.
+ *
+ *          Given a stdapi image, it is staged first with the client advertising
+ *          CLIENT_CAPABILITY_LOADLIB_REQUEST, and a third of the mix becomes
+ *          stdapi traffic: cached and uncached file system, system and network
+ *          commands, file channels that are written to and read from, tcp
+ *          server channels that the driver connects to, so their sockets go
+ *          through the scheduler's shards, and tcp tunnels whose streams
+ *          connect back to a listener of the driver's, by address and by name.
+ *          Command groups the server asks for are read from the directory the
+ *          staged image is in.
+ *
+ *          Every sample interval the driver lets the requests in flight
+ *          finish, then prints the process RSS, thread count, descriptor
+ *          count, command thread list length, outstanding completion
+ *          handlers and the latency percentiles of the interval. The sample
+ *          taken once the warm up is over is the baseline, and the run
+ *          fails as soon as any of them has grown past its threshold for
+ *          SOAK_CONFIRM_SAMPLES samples in a row. Slow leaks that never show
+ *          up in a short run are caught this way.
+ *
+ *          usage: metsrv_soak [-d seconds] [-i seconds] [-w seconds]
+ *                             [-m KB] [-t threads] [-f fds] [-l percent]
+ *                             [-s image]
+ *
+ *          -d  How long to run for, an hour if not given.
+ *          -i  Seconds between samples, 10 if not given.
+ *          -w  Seconds of warm up before the baseline is taken, 60 if not given.
+ *          -m  RSS growth allowed, in KB, 8192 if not given.
+ *          -t  Thread growth allowed, 2 if not given.
+ *          -f  Descriptor growth allowed, 2 if not given.
+ *          -l  p99 latency growth allowed, in percent, 200 if not given.
+ *          -s  stdapi image to stage, e.g. ext_server_stdapi_ondemand.lso.
+ *
+ *          The exit code is 0 if nothing grew, 2 if something did or a
+ *          buffered channel didn't give back what was written to it, and 1
+ *          if the local server couldn't be set up.
+ */
+#include "metsrv.h"
+#include "../../extensions/stdapi/stdapi.h"
+#include "../../extensions/stdapi/server/net/socket/tunnel.h"
+
+#include <sys/time.h>
+#include <dirent.h>
+
+/*! @brief Maximum number of requests that can be awaiting a response at once. */
+#define SOAK_MAX_PENDING       256
+/*! @brief Number of latencies kept per sample interval, a random subset is kept past this. */
+#define SOAK_MAX_LATENCIES     65536
+/*! @brief Number of samples in a row that have to be over a threshold to fail the run. */
+#define SOAK_CONFIRM_SAMPLES   3
+/*! @brief p99 latency growth that is never treated as a regression, however large in percent. */
+#define SOAK_LATENCY_FLOOR     1000
+/*! @brief Longest time to wait for outstanding requests once the run is over, in microseconds. */
+#define SOAK_DRAIN_TIMEOUT     30000000
+/*! @brief Number of pipelined reads or writes made on each channel the workload uses. */
+#define SOAK_CHANNEL_REQUESTS  4
+/*! @brief Number of bytes each pipelined read or write asks for. */
+#define SOAK_CHANNEL_CHUNK     4096
+/*! @brief Maximum number of channels the workload has in use at once. */
+#define SOAK_MAX_CHANNELS      64
+/*! @brief Number of streams opened in each tunnel the workload uses. */
+#define SOAK_TUNNEL_STREAMS    2
+
+/*! @brief What the workload does with a channel once it is open. */
+typedef enum
+{
+	SoakChannelNone = 0,      ///< The request doesn't open a channel.
+	SoakChannelClose,         ///< The channel is closed straight away.
+	SoakChannelBuffered,      ///< Buffered core channel, written to and read back in one pipeline.
+	SoakChannelFileWrite,     ///< stdapi file channel, written to.
+	SoakChannelFileRead,      ///< stdapi file channel, read from.
+	SoakChannelTcpServer,     ///< stdapi tcp server channel, connected to by the driver.
+	SoakChannelTunnel,        ///< stdapi tcp tunnel, its streams opened, written to and closed.
+} SoakChannelKind;
+
+/*! @brief A request that has been dispatched and is awaiting its response. */
+typedef struct _SoakPending
+{
+	char requestId[64];         ///< Request identifier of the dispatched packet.
+	QWORD start;                ///< Time the request was dispatched, in microseconds.
+	SoakChannelKind kind;       ///< What to do with the channel the request opens.
+} SoakPending;
+
+/*! @brief A channel that has pipelined requests in flight. */
+typedef struct _SoakChannel
+{
+	DWORD id;                   ///< Channel identifier, 0 if the entry is free.
+	SoakChannelKind kind;       ///< What the channel is being used for.
+	DWORD unanswered;           ///< Pipelined requests still awaiting their response.
+	DWORD received;             ///< Bytes of channel data the server has sent back, or streams opened for a tunnel.
+} SoakChannel;
+
+/*! @brief Completion handler of a server request, wrapped so its firing can be counted. */
+typedef struct _SoakCompletion
+{
+	PacketRequestCompletion completion;   ///< The handler the server registered.
+} SoakCompletion;
+
+/*! @brief One sample of the server's resource usage. */
+typedef struct _SoakSample
+{
+	QWORD rss;             ///< Resident set size, in KB.
+	DWORD threads;         ///< Threads in the process.
+	DWORD fds;             ///< Open descriptors in the process.
+	DWORD commandThreads;  ///< Entries in the session's command thread list.
+	DWORD completions;     ///< Completion handlers registered but not yet fired.
+	QWORD p50;             ///< Median request latency over the interval.
+	QWORD p90;             ///< 90th percentile request latency over the interval.
+	QWORD p99;             ///< 99th percentile request latency over the interval.
+	QWORD max;             ///< Largest request latency over the interval.
+} SoakSample;
+
+/*! @brief State shared between the driver and the stub transport. */
+typedef struct _SoakState
+{
+	LOCK* lock;                               ///< Guards everything below.
+	SoakPending pending[SOAK_MAX_PENDING];    ///< Requests awaiting responses.
+	DWORD outstanding;                        ///< Number of entries in use in \c pending.
+	QWORD* latencies;                         ///< Latencies seen in the current interval.
+	DWORD latencyCount;                       ///< Number of entries in use in \c latencies.
+	QWORD latencySeen;                        ///< Number of latencies seen in the current interval.
+	QWORD dispatched;                         ///< Number of requests dispatched.
+	QWORD completed;                          ///< Number of responses matched to a request.
+	DWORD completionsAdded;                   ///< Completion handlers registered by the server.
+	DWORD completionsFired;                   ///< Completion handlers that have been called.
+	PLIST inject;                             ///< Packets the client side has yet to send.
+	QWORD failed;                             ///< Responses matched to a request that carried an error.
+	SoakChannel channels[SOAK_MAX_CHANNELS];  ///< Channels with pipelined requests in flight.
+	QWORD channelsUsed;                       ///< Channels whose pipelined requests have all been answered.
+	QWORD channelBytes;                       ///< Bytes of channel data the server has sent back.
+	DWORD channelsShort;                      ///< Buffered channels that gave back less than was written.
+	BOOL stdapi;                              ///< Set once the stdapi image has been staged.
+	DWORD stageResult;                        ///< Result of staging the stdapi image.
+	DWORD imagesRequested;                    ///< Number of images the server asked for.
+	char imageDirectory[PATH_MAX];            ///< Directory images are read from.
+	char filePath[PATH_MAX];                  ///< File the file channels write to and read from.
+	USHORT tcpPort;                           ///< Loopback port the tcp server channel listens on.
+	BOOL tcpListening;                        ///< Set while a tcp server channel is open, or being opened.
+	DWORD tcpChannel;                         ///< Identifier of the open tcp server channel.
+	DWORD tcpAccepted;                        ///< Connections the tcp server channels have accepted.
+	int tunnelListener;                       ///< Loopback listener the tunnel streams connect to, -1 if there is none.
+	USHORT tunnelPort;                        ///< Port \c tunnelListener is bound to.
+	DWORD tunnelStreams;                      ///< Tunnel streams the server has reported as opened.
+	DWORD tunnelFailed;                       ///< Tunnel streams that failed to open.
+	DWORD serverRequests;                     ///< Requests the server has made of the client.
+	DWORD serverCloses;                       ///< Channels the server has closed on its own.
+} SoakState;
+
+static SoakState soak;
+
+/*!
+ * @brief Get the current time in microseconds.
+ */
+static QWORD soak_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (QWORD)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*!
+ * @brief Count the entries of a directory under /proc/self, less . and ..
+ */
+static DWORD soak_count_entries(const char* path)
+{
+	DIR* dir = opendir(path);
+	struct dirent* entry;
+	DWORD count = 0;
+
+	if (!dir)
+	{
+		return 0;
+	}
+
+	while ((entry = readdir(dir)))
+	{
+		if (entry->d_name[0] != '.')
+		{
+			count++;
+		}
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+/*!
+ * @brief Get the resident set size of the process, in KB.
+ */
+static QWORD soak_rss()
+{
+	FILE* statm = fopen("/proc/self/statm", "r");
+	unsigned long size = 0, resident = 0;
+
+	if (!statm)
+	{
+		return 0;
+	}
+
+	if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+	{
+		resident = 0;
+	}
+	fclose(statm);
+
+	return (QWORD)resident * getpagesize() / 1024;
+}
+
+/*!
+ * @brief Record the latency of a request that has been answered.
+ * @remark Called with the lock held. Once the interval's buffer is full, each
+ *         latency replaces a random one, so the percentiles stay unbiased.
+ */
+static VOID soak_record_latency(QWORD latency)
+{
+	QWORD slot;
+
+	soak.latencySeen++;
+
+	if (soak.latencyCount < SOAK_MAX_LATENCIES)
+	{
+		soak.latencies[soak.latencyCount++] = latency;
+		return;
+	}
+
+	slot = (QWORD)rand() * ((QWORD)RAND_MAX + 1) + rand();
+	slot %= soak.latencySeen;
+	if (slot < SOAK_MAX_LATENCIES)
+	{
+		soak.latencies[slot] = latency;
+	}
+}
+
+/*!
+ * @brief Queue a packet to be handed to the server by the driver.
+ */
+static VOID soak_inject(Packet* packet)
+{
+	if (packet && !list_push(soak.inject, packet))
+	{
+		packet_destroy(packet);
+	}
+}
+
+/*!
+ * @brief Add a TLV compressed the way a client sends it.
+ * @details Clients prefix the compressed data with its length once it is
+ *          decompressed, which \c packet_add_tlv_raw doesn't, so the value is
+ *          written into a plain reservation and the type only marked as
+ *          compressed once it has been committed.
+ */
+static DWORD soak_add_tlv_compressed(Packet* packet, TlvType type, LPVOID buffer, DWORD length)
+{
+	uLong compressedLength = (uLong)(1.01 * (length + 12) + 1);
+	PUCHAR value = NULL;
+	DWORD result;
+
+	if ((result = packet_reserve_tlv(packet, type, sizeof(DWORD) + compressedLength, &value)) != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	*(LPDWORD)value = htonl(length);
+
+	if (compress2(value + sizeof(DWORD), &compressedLength, buffer, length, Z_BEST_COMPRESSION) != Z_OK)
+	{
+		packet_cancel_tlv(packet);
+		return ERROR_UNSUPPORTED_COMPRESSION;
+	}
+
+	if ((result = packet_commit_tlv(packet, sizeof(DWORD) + compressedLength)) == ERROR_SUCCESS)
+	{
+		value = packet->payload + packet->payloadLength - sizeof(DWORD) - compressedLength - sizeof(TlvHeader);
+		((TlvHeader*)value)->type = htonl((DWORD)type | TLV_META_TYPE_COMPRESSED);
+	}
+
+	return result;
+}
+
+/*!
+ * @brief Build a core_loadlib request for an image on disk, the way a client stages an extension.
+ * @returns The request, or \c NULL if the image couldn't be read.
+ */
+static Packet* soak_loadlib(const char* image, DWORD capabilities)
+{
+	Packet* request = NULL;
+	char path[PATH_MAX];
+	FILE* file = NULL;
+	PUCHAR data = NULL;
+	long length;
+
+	snprintf(path, sizeof(path), "%s/%s.lso", soak.imageDirectory, image);
+
+	do
+	{
+		if (!(file = fopen(path, "rb")) || fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) <= 0
+			|| fseek(file, 0, SEEK_SET) != 0)
+		{
+			break;
+		}
+
+		if (!(data = (PUCHAR)malloc(length)) || fread(data, 1, length, file) != (size_t)length)
+		{
+			break;
+		}
+
+		if (!(request = packet_create(PACKET_TLV_TYPE_REQUEST, "core_loadlib")))
+		{
+			break;
+		}
+
+		packet_add_tlv_string(request, TLV_TYPE_LIBRARY_PATH, image);
+		packet_add_tlv_string(request, TLV_TYPE_TARGET_PATH, image);
+		packet_add_tlv_uint(request, TLV_TYPE_FLAGS, LOAD_LIBRARY_FLAG_EXTENSION);
+		packet_add_tlv_raw(request, TLV_TYPE_DATA, data, length);
+		if (capabilities)
+		{
+			packet_add_tlv_uint(request, TLV_TYPE_CLIENT_CAPABILITIES, capabilities);
+		}
+	} while (0);
+
+	if (!request)
+	{
+		fprintf(stderr, "unable to read %s\n", path);
+	}
+
+	if (data)
+	{
+		free(data);
+	}
+	if (file)
+	{
+		fclose(file);
+	}
+
+	return request;
+}
+
+/*!
+ * @brief Build a request that closes a channel.
+ * @remark The request identifier is what gets it a response.
+ */
+static Packet* soak_channel_close(DWORD channelId)
+{
+	Packet* close = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_close");
+	char requestId[64];
+
+	if (close)
+	{
+		snprintf(requestId, sizeof(requestId), "soak-close-%u", (unsigned int)channelId);
+		packet_add_tlv_string(close, TLV_TYPE_REQUEST_ID, requestId);
+		packet_add_tlv_uint(close, TLV_TYPE_CHANNEL_ID, channelId);
+	}
+
+	return close;
+}
+
+/*!
+ * @brief Build a pipelined read or write of a channel.
+ */
+static Packet* soak_channel_request(DWORD channelId, BOOL write, DWORD sequence)
+{
+	static BYTE data[SOAK_CHANNEL_CHUNK];
+	char requestId[64];
+	Packet* packet = packet_create(PACKET_TLV_TYPE_REQUEST, write ? "core_channel_write" : "core_channel_read");
+
+	if (packet)
+	{
+		snprintf(requestId, sizeof(requestId), "soak-channel-%u-%u", (unsigned int)channelId, (unsigned int)sequence);
+		packet_add_tlv_string(packet, TLV_TYPE_REQUEST_ID, requestId);
+		packet_add_tlv_uint(packet, TLV_TYPE_CHANNEL_ID, channelId);
+		packet_add_tlv_uint(packet, TLV_TYPE_CHANNEL_SEQUENCE, sequence);
+		if (write)
+		{
+			packet_add_tlv_raw(packet, TLV_TYPE_CHANNEL_DATA, data, sizeof(data));
+		}
+		else
+		{
+			packet_add_tlv_uint(packet, TLV_TYPE_LENGTH, sizeof(data));
+		}
+	}
+
+	return packet;
+}
+
+/*!
+ * @brief Append a frame to a tunnel write.
+ * @return Offset of the end of the frame.
+ */
+static DWORD soak_tunnel_frame(PUCHAR buffer, DWORD offset, UINT stream, UINT type, LPVOID payload, DWORD length)
+{
+	TunnelFrameHeader header;
+
+	header.stream = htonl(stream);
+	header.type = htonl(type);
+	header.length = htonl(length);
+
+	memcpy(buffer + offset, &header, sizeof(header));
+	if (length)
+	{
+		memcpy(buffer + offset + sizeof(header), payload, length);
+	}
+
+	return offset + sizeof(header) + length;
+}
+
+/*!
+ * @brief Build a pipelined write of a tunnel.
+ * @details The first write opens every stream, one by address and the rest by
+ *          name, and sends data on the first. The second closes them all.
+ */
+static Packet* soak_tunnel_request(DWORD channelId, DWORD sequence)
+{
+	static const char* hosts[SOAK_TUNNEL_STREAMS] = { "127.0.0.1", "localhost" };
+	UCHAR frames[SOAK_TUNNEL_STREAMS * (sizeof(TunnelFrameHeader) + 32) + sizeof(TunnelFrameHeader) + 4];
+	UCHAR open[32];
+	USHORT port = htons(soak.tunnelPort);
+	DWORD length = 0, stream;
+	char requestId[64];
+	Packet* packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_write");
+
+	if (!packet)
+	{
+		return NULL;
+	}
+
+	for (stream = 1; stream <= SOAK_TUNNEL_STREAMS; stream++)
+	{
+		if (sequence)
+		{
+			length = soak_tunnel_frame(frames, length, stream, TUNNEL_FRAME_CLOSE, NULL, 0);
+			continue;
+		}
+
+		memcpy(open, &port, sizeof(port));
+		strcpy((char*)open + sizeof(port), hosts[stream - 1]);
+		length = soak_tunnel_frame(frames, length, stream, TUNNEL_FRAME_OPEN, open,
+			sizeof(port) + strlen(hosts[stream - 1]) + 1);
+	}
+
+	if (!sequence)
+	{
+		length = soak_tunnel_frame(frames, length, 1, TUNNEL_FRAME_DATA, (LPVOID)"soak", 4);
+	}
+
+	snprintf(requestId, sizeof(requestId), "soak-channel-%u-%u", (unsigned int)channelId, (unsigned int)sequence);
+	packet_add_tlv_string(packet, TLV_TYPE_REQUEST_ID, requestId);
+	packet_add_tlv_uint(packet, TLV_TYPE_CHANNEL_ID, channelId);
+	packet_add_tlv_uint(packet, TLV_TYPE_CHANNEL_SEQUENCE, sequence);
+	packet_add_tlv_raw(packet, TLV_TYPE_CHANNEL_DATA, frames, length);
+
+	return packet;
+}
+
+/*!
+ * @brief Accept and drop the connections the tunnel streams have made to the listener.
+ */
+static VOID soak_tunnel_accept()
+{
+	int fd;
+
+	while (soak.tunnelListener >= 0 && (fd = accept(soak.tunnelListener, NULL, NULL)) >= 0)
+	{
+		close(fd);
+	}
+}
+
+/*!
+ * @brief Start using a channel the workload has opened.
+ * @details Buffered channels are written to and read back, file channels are
+ *          either written to or read from, and the pipelined requests are
+ *          queued last first so the server has to put them back in order. A
+ *          tcp server channel is connected to, and closed once the server
+ *          tells the client about the connection. A tunnel's streams are
+ *          opened, and closed again once the server has reported on all of them.
+ */
+static VOID soak_channel_opened(DWORD channelId, SoakChannelKind kind)
+{
+	DWORD index, first = 0, count = 0, sequence;
+	struct sockaddr_in address;
+	int fd;
+
+	if (kind == SoakChannelTcpServer)
+	{
+		lock_acquire(soak.lock);
+		soak.tcpChannel = channelId;
+		lock_release(soak.lock);
+
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(soak.tcpPort);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		{
+			soak_inject(soak_channel_close(channelId));
+			return;
+		}
+
+		if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || send(fd, "soak", 4, 0) != 4)
+		{
+			soak_inject(soak_channel_close(channelId));
+		}
+
+		close(fd);
+		return;
+	}
+
+	if (kind == SoakChannelBuffered)
+	{
+		count = SOAK_CHANNEL_REQUESTS * 2;
+	}
+	else if (kind == SoakChannelFileWrite || kind == SoakChannelFileRead)
+	{
+		count = SOAK_CHANNEL_REQUESTS;
+	}
+	else if (kind == SoakChannelTunnel)
+	{
+		// the opening write, and the frame reporting on each stream
+		count = SOAK_TUNNEL_STREAMS + 1;
+	}
+
+	lock_acquire(soak.lock);
+
+	for (index = 0; count && index < SOAK_MAX_CHANNELS; index++)
+	{
+		if (!soak.channels[index].id)
+		{
+			soak.channels[index].id = channelId;
+			soak.channels[index].kind = kind;
+			soak.channels[index].unanswered = count;
+			soak.channels[index].received = 0;
+			break;
+		}
+	}
+
+	lock_release(soak.lock);
+
+	if (!count || index == SOAK_MAX_CHANNELS)
+	{
+		soak_inject(soak_channel_close(channelId));
+		return;
+	}
+
+	if (kind == SoakChannelTunnel)
+	{
+		soak_inject(soak_tunnel_request(channelId, 0));
+		return;
+	}
+
+	// a buffered channel's reads come after its writes
+	if (kind == SoakChannelFileRead)
+	{
+		first = SOAK_CHANNEL_REQUESTS;
+	}
+
+	for (sequence = count; sequence-- > 0;)
+	{
+		soak_inject(soak_channel_request(channelId, first + sequence < SOAK_CHANNEL_REQUESTS, sequence));
+	}
+}
+
+/*!
+ * @brief Count the streams a tunnel's frames report on, tallying the ones that failed.
+ * @remark Called with the lock held. The tunnel writes whole frames at a time.
+ */
+static DWORD soak_tunnel_count_opened(PUCHAR frames, DWORD length)
+{
+	TunnelFrameHeader header;
+	DWORD offset = 0, reported = 0;
+	UINT result;
+
+	while (length - offset >= sizeof(header))
+	{
+		memcpy(&header, frames + offset, sizeof(header));
+		offset += sizeof(header);
+
+		if (ntohl(header.length) > length - offset)
+		{
+			break;
+		}
+
+		if (ntohl(header.type) == TUNNEL_FRAME_OPENED && ntohl(header.length) == sizeof(result))
+		{
+			memcpy(&result, frames + offset, sizeof(result));
+			if (ntohl(result) == ERROR_SUCCESS)
+			{
+				soak.tunnelStreams++;
+			}
+			else
+			{
+				soak.tunnelFailed++;
+			}
+			reported++;
+		}
+
+		offset += ntohl(header.length);
+	}
+
+	return reported;
+}
+
+/*!
+ * @brief Account for an answer to a pipelined request, closing the channel after the last one.
+ */
+static VOID soak_channel_answered(DWORD channelId)
+{
+	DWORD index;
+	BOOL done = FALSE, tunnel = FALSE;
+
+	lock_acquire(soak.lock);
+
+	for (index = 0; index < SOAK_MAX_CHANNELS; index++)
+	{
+		if (soak.channels[index].id == channelId)
+		{
+			if (--soak.channels[index].unanswered == 0)
+			{
+				if (soak.channels[index].kind == SoakChannelBuffered
+					&& soak.channels[index].received != SOAK_CHANNEL_REQUESTS * SOAK_CHANNEL_CHUNK)
+				{
+					soak.channelsShort++;
+				}
+				tunnel = soak.channels[index].kind == SoakChannelTunnel;
+				soak.channels[index].id = 0;
+				soak.channelsUsed++;
+				done = TRUE;
+			}
+			break;
+		}
+	}
+
+	lock_release(soak.lock);
+
+	if (done)
+	{
+		soak_inject(soak_channel_close(channelId));
+	}
+
+	// every stream has connected or failed by now, so their connections are waiting to be accepted
+	if (tunnel)
+	{
+		soak_tunnel_accept();
+	}
+}
+
+/*!
+ * @brief Account for the streams a tunnel has reported as opened, or failed to open.
+ * @details Once every stream has been reported on, the tunnel is told to close
+ *          them, and its channel is closed after that write is answered.
+ */
+static VOID soak_tunnel_reported(DWORD channelId, DWORD reported)
+{
+	DWORD index;
+	BOOL close = FALSE;
+
+	lock_acquire(soak.lock);
+
+	for (index = 0; index < SOAK_MAX_CHANNELS; index++)
+	{
+		if (soak.channels[index].id == channelId)
+		{
+			soak.channels[index].received += reported;
+			if (soak.channels[index].received == SOAK_TUNNEL_STREAMS)
+			{
+				// the closing write has to be answered as well
+				soak.channels[index].unanswered++;
+				close = TRUE;
+			}
+			break;
+		}
+	}
+
+	lock_release(soak.lock);
+
+	if (close)
+	{
+		soak_inject(soak_tunnel_request(channelId, 1));
+	}
+
+	while (reported--)
+	{
+		soak_channel_answered(channelId);
+	}
+}
+
+/*!
+ * @brief Count the channels that still have pipelined requests in flight.
+ */
+static DWORD soak_channels_busy()
+{
+	DWORD index, busy = 0;
+
+	lock_acquire(soak.lock);
+
+	for (index = 0; index < SOAK_MAX_CHANNELS; index++)
+	{
+		if (soak.channels[index].id)
+		{
+			busy++;
+		}
+	}
+
+	if (soak.tcpListening)
+	{
+		busy++;
+	}
+
+	lock_release(soak.lock);
+
+	return busy;
+}
+
+/*!
+ * @brief Completion routine that counts a server request's handler firing, then calls it.
+ */
+static DWORD soak_completion(Remote* remote, Packet* response, LPVOID context, LPCSTR method, DWORD result)
+{
+	SoakCompletion* wrapper = (SoakCompletion*)context;
+	DWORD rc = ERROR_SUCCESS;
+
+	lock_acquire(soak.lock);
+	soak.completionsFired++;
+	lock_release(soak.lock);
+
+	if (wrapper->completion.routine)
+	{
+		rc = wrapper->completion.routine(remote, response, wrapper->completion.context, method, result);
+	}
+
+	free(wrapper);
+
+	return rc;
+}
+
+/*!
+ * @brief Stub transport routine standing in for the client.
+ * @details Responses to tracked requests have their latency recorded, and
+ *          channels opened by the workload are used and closed again. Requests
+ *          made by the server are answered, after their completion handler has
+ *          been registered the same way the real transports do it, except for
+ *          core_loadlib_request, which is answered by staging the image.
+ */
+static DWORD soak_packet_transmit(Remote* remote, Packet* packet, PacketRequestCompletion* completion)
+{
+	PCHAR requestId = packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID);
+	PCHAR method = packet_get_tlv_value_string(packet, TLV_TYPE_METHOD);
+	PacketTlvType type = packet_get_type(packet);
+	DWORD channelId = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID);
+	DWORD result = packet_get_tlv_value_uint(packet, TLV_TYPE_RESULT);
+	SoakChannelKind kind = SoakChannelNone;
+	BOOL tracked = FALSE;
+	QWORD now = soak_now();
+	DWORD index;
+	Tlv data;
+
+	if (type == PACKET_TLV_TYPE_REQUEST || type == PACKET_TLV_TYPE_PLAIN_REQUEST)
+	{
+		// the real transports give every request an identifier the client can answer
+		if (!requestId)
+		{
+			char serverId[32];
+
+			lock_acquire(soak.lock);
+			snprintf(serverId, sizeof(serverId), "soak-server-%u", (unsigned int)++soak.serverRequests);
+			lock_release(soak.lock);
+
+			// adding the TLV can move the payload
+			packet_add_tlv_string(packet, TLV_TYPE_REQUEST_ID, serverId);
+			requestId = packet_get_tlv_value_string(packet, TLV_TYPE_REQUEST_ID);
+			method = packet_get_tlv_value_string(packet, TLV_TYPE_METHOD);
+		}
+
+		if (method && strcmp(method, "core_loadlib_request") == 0)
+		{
+			PCHAR image = packet_get_tlv_value_string(packet, TLV_TYPE_LIBRARY_PATH);
+			Packet* request;
+
+			if (image && (request = soak_loadlib(image, 0)))
+			{
+				lock_acquire(soak.lock);
+				soak.imagesRequested++;
+				lock_release(soak.lock);
+
+				packet_add_tlv_string(request, TLV_TYPE_REQUEST_ID, "soak-stage-requested");
+				soak_inject(request);
+			}
+
+			packet_destroy(packet);
+			return ERROR_SUCCESS;
+		}
+
+		// data read from a channel is written back to the client
+		if (method && strcmp(method, "core_channel_write") == 0
+			&& packet_get_tlv(packet, TLV_TYPE_CHANNEL_DATA, &data) == ERROR_SUCCESS)
+		{
+			DWORD reported = 0;
+
+			lock_acquire(soak.lock);
+			for (index = 0; index < SOAK_MAX_CHANNELS; index++)
+			{
+				if (soak.channels[index].id == channelId)
+				{
+					if (soak.channels[index].kind == SoakChannelTunnel)
+					{
+						reported = soak_tunnel_count_opened(data.buffer, data.header.length);
+					}
+					else
+					{
+						soak.channels[index].received += data.header.length;
+					}
+					soak.channelBytes += data.header.length;
+					break;
+				}
+			}
+			lock_release(soak.lock);
+
+			if (reported)
+			{
+				soak_tunnel_reported(channelId, reported);
+			}
+		}
+
+		// the connection the driver made has been accepted, the listener can go
+		if (method && strcmp(method, "tcp_channel_open") == 0)
+		{
+			DWORD parentId = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_PARENTID);
+
+			lock_acquire(soak.lock);
+			soak.tcpAccepted++;
+			if (parentId != soak.tcpChannel)
+			{
+				parentId = 0;
+			}
+			lock_release(soak.lock);
+
+			if (parentId)
+			{
+				soak_inject(soak_channel_close(parentId));
+			}
+		}
+
+		if (completion && requestId)
+		{
+			SoakCompletion* wrapper = (SoakCompletion*)malloc(sizeof(SoakCompletion));
+			PacketRequestCompletion counted;
+
+			if (wrapper)
+			{
+				wrapper->completion = *completion;
+				counted.context = wrapper;
+				counted.routine = soak_completion;
+				counted.timeout = completion->timeout;
+
+				if (packet_add_completion_handler(remote, requestId, &counted) == ERROR_SUCCESS)
+				{
+					lock_acquire(soak.lock);
+					soak.completionsAdded++;
+					lock_release(soak.lock);
+				}
+				else
+				{
+					free(wrapper);
+				}
+			}
+		}
+
+		// channel data the server sends needs no answer
+		if (requestId && !(method && strcmp(method, "core_channel_write") == 0))
+		{
+			Packet* response = packet_create_response(packet);
+			if (response)
+			{
+				// the server only lets go of a channel it closed once the client confirms it
+				if (method && strcmp(method, "core_channel_close") == 0 && channelId)
+				{
+					lock_acquire(soak.lock);
+					soak.serverCloses++;
+					lock_release(soak.lock);
+
+					packet_add_tlv_uint(response, TLV_TYPE_CHANNEL_ID, channelId);
+				}
+
+				packet_add_tlv_uint(response, TLV_TYPE_RESULT, ERROR_SUCCESS);
+				soak_inject(response);
+			}
+		}
+
+		packet_destroy(packet);
+		return ERROR_SUCCESS;
+	}
+
+	lock_acquire(soak.lock);
+
+	for (index = 0; requestId && index < SOAK_MAX_PENDING; index++)
+	{
+		if (strcmp(soak.pending[index].requestId, requestId) == 0)
+		{
+			soak_record_latency(now - soak.pending[index].start);
+			kind = soak.pending[index].kind;
+			tracked = TRUE;
+			soak.pending[index].requestId[0] = 0;
+			soak.outstanding--;
+			soak.completed++;
+			break;
+		}
+	}
+
+	// unknown methods are meant to fail
+	if (tracked && result != ERROR_SUCCESS && method && strcmp(method, "core_soak_unknown") != 0)
+	{
+		soak.failed++;
+	}
+
+	if (requestId && strcmp(requestId, "soak-stage") == 0)
+	{
+		soak.stageResult = result;
+	}
+
+	if (method && strcmp(method, "core_channel_close") == 0 && channelId && channelId == soak.tcpChannel)
+	{
+		soak.tcpChannel = 0;
+		soak.tcpListening = FALSE;
+	}
+
+	// a tcp server channel that failed to open leaves nothing to close
+	if (kind == SoakChannelTcpServer && (result != ERROR_SUCCESS || !channelId))
+	{
+		soak.tcpListening = FALSE;
+	}
+
+	lock_release(soak.lock);
+
+	if (tracked && method && strcmp(method, "core_channel_open") == 0 && channelId && result == ERROR_SUCCESS)
+	{
+		soak_channel_opened(channelId, kind);
+	}
+	else if (method && channelId && (strcmp(method, "core_channel_write") == 0 || strcmp(method, "core_channel_read") == 0))
+	{
+		soak_channel_answered(channelId);
+	}
+
+	packet_destroy(packet);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Pick a free loopback port for the tcp server channels to listen on.
+ */
+static USHORT soak_pick_port()
+{
+	struct sockaddr_in address;
+	socklen_t length = sizeof(address);
+	USHORT port = 0;
+	int fd;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		return 0;
+	}
+
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == 0
+		&& getsockname(fd, (struct sockaddr*)&address, &length) == 0)
+	{
+		port = ntohs(address.sin_port);
+	}
+
+	close(fd);
+
+	return port;
+}
+
+/*!
+ * @brief Open the non-blocking loopback listener the tunnel streams connect to.
+ * @return The listener, or -1 if it couldn't be opened.
+ */
+static int soak_tunnel_listen(USHORT* port)
+{
+	struct sockaddr_in address;
+	socklen_t length = sizeof(address);
+	int fd;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0
+		|| listen(fd, SOMAXCONN) != 0
+		|| getsockname(fd, (struct sockaddr*)&address, &length) != 0
+		|| fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	*port = ntohs(address.sin_port);
+
+	return fd;
+}
+
+/*!
+ * @brief Build the next stdapi request of the workload.
+ * @remark Called with the lock held.
+ */
+static Packet* soak_build_stdapi_request(SoakChannelKind* kind)
+{
+	Packet* packet = NULL;
+	int pick = rand() % 100;
+
+	if (pick < 20)
+	{
+		packet = packet_create(PACKET_TLV_TYPE_REQUEST, "stdapi_fs_getwd");
+	}
+	else if (pick < 40)
+	{
+		// cached, for as long as nobody changes the token
+		packet = packet_create(PACKET_TLV_TYPE_REQUEST, "stdapi_sys_config_getuid");
+	}
+	else if (pick < 50)
+	{
+		packet = packet_create(PACKET_TLV_TYPE_REQUEST, "stdapi_sys_config_sysinfo");
+	}
+	else if (pick < 60)
+	{
+		packet = packet_create(PACKET_TLV_TYPE_REQUEST, "stdapi_net_config_get_interfaces");
+	}
+	else if (pick < 72)
+	{
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "stdapi_fs_stat")))
+		{
+			packet_add_tlv_string(packet, TLV_TYPE_FILE_PATH, "/");
+		}
+	}
+	else if (pick >= 84 && pick < 90 && soak.tunnelListener >= 0)
+	{
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_open")))
+		{
+			*kind = SoakChannelTunnel;
+			packet_add_tlv_string(packet, TLV_TYPE_CHANNEL_TYPE, "stdapi_net_tcp_tunnel");
+		}
+	}
+	else if (pick < 90 || soak.tcpListening || !(soak.tcpPort = soak_pick_port()))
+	{
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_open")))
+		{
+			*kind = pick % 2 ? SoakChannelFileWrite : SoakChannelFileRead;
+			packet_add_tlv_string(packet, TLV_TYPE_CHANNEL_TYPE, "stdapi_fs_file");
+			packet_add_tlv_string(packet, TLV_TYPE_FILE_PATH, soak.filePath);
+			packet_add_tlv_string(packet, TLV_TYPE_FILE_MODE, *kind == SoakChannelFileWrite ? "r+b" : "rb");
+		}
+	}
+	else
+	{
+		// one listener at a time, on a fresh port as the last one's connection may still hold its own
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_open")))
+		{
+			*kind = SoakChannelTcpServer;
+			soak.tcpListening = TRUE;
+			packet_add_tlv_string(packet, TLV_TYPE_CHANNEL_TYPE, "stdapi_net_tcp_server");
+			packet_add_tlv_string(packet, TLV_TYPE_LOCAL_HOST, "127.0.0.1");
+			packet_add_tlv_uint(packet, TLV_TYPE_LOCAL_PORT, soak.tcpPort);
+		}
+	}
+
+	return packet;
+}
+
+/*!
+ * @brief Build the next request of the workload.
+ * @details The mix is weighted towards cheap inline requests, with enough of
+ *          the heavier ones in it to cycle threads, channels and decompressed
+ *          buffers many times over in the course of a run. Once stdapi has
+ *          been staged, a third of the requests are stdapi ones.
+ * @remark Called with the lock held.
+ */
+static Packet* soak_build_request(QWORD sequence, SoakChannelKind* kind)
+{
+	static BYTE data[65536];
+	Packet* packet = NULL;
+	int pick = rand() % 100;
+
+	*kind = SoakChannelNone;
+
+	if (soak.stdapi && rand() % 3 == 0)
+	{
+		return soak_build_stdapi_request(kind);
+	}
+
+	if (pick < 40)
+	{
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_ping")))
+		{
+			packet_add_tlv_raw(packet, TLV_TYPE_PING_DATA, data, rand() % 4096);
+			packet_add_tlv_qword(packet, TLV_TYPE_PING_TIMESTAMP, sequence);
+		}
+	}
+	else if (pick < 55)
+	{
+		// compressed data is decompressed into a buffer hung off the packet
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_ping")))
+		{
+			soak_add_tlv_compressed(packet, TLV_TYPE_PING_DATA, data, sizeof(data));
+		}
+	}
+	else if (pick < 65)
+	{
+		packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_stats");
+	}
+	else if (pick < 72)
+	{
+		packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_machine_id");
+	}
+	else if (pick < 77)
+	{
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_enumextcmd")))
+		{
+			packet_add_tlv_string(packet, TLV_TYPE_STRING, "stdapi");
+		}
+	}
+	else if (pick < 90)
+	{
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_channel_open")))
+		{
+			*kind = pick < 83 ? SoakChannelClose : SoakChannelBuffered;
+			packet_add_tlv_uint(packet, TLV_TYPE_CHANNEL_CLASS, CHANNEL_CLASS_BUFFERED);
+		}
+	}
+	else if (pick < 95)
+	{
+		if ((packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_bwtest")))
+		{
+			packet_add_tlv_qword(packet, TLV_TYPE_BWTEST_LENGTH, 65536);
+			packet_add_tlv_uint(packet, TLV_TYPE_BWTEST_CHUNK, 8192);
+		}
+	}
+	else
+	{
+		packet = packet_create(PACKET_TLV_TYPE_REQUEST, "core_soak_unknown");
+	}
+
+	return packet;
+}
+
+/*!
+ * @brief Track a request so its response can be matched.
+ * @remark Called with the lock held, there has to be room in \c pending.
+ */
+static VOID soak_track(Packet* packet, const char* requestId, SoakChannelKind kind)
+{
+	DWORD index;
+
+	for (index = 0; index < SOAK_MAX_PENDING; index++)
+	{
+		if (!soak.pending[index].requestId[0])
+		{
+			break;
+		}
+	}
+
+	packet_add_tlv_string(packet, TLV_TYPE_REQUEST_ID, requestId);
+
+	strncpy(soak.pending[index].requestId, requestId, sizeof(soak.pending[index].requestId) - 1);
+	soak.pending[index].start = soak_now();
+	soak.pending[index].kind = kind;
+	soak.outstanding++;
+	soak.dispatched++;
+}
+
+/*!
+ * @brief Dispatch a request of the workload, tracking it so its response can be matched.
+ * @return \c FALSE if there was no room to track it.
+ */
+static BOOL soak_dispatch(Remote* remote, QWORD sequence)
+{
+	char requestId[64];
+	SoakChannelKind kind;
+	Packet* packet;
+
+	lock_acquire(soak.lock);
+
+	if (soak.outstanding == SOAK_MAX_PENDING || !(packet = soak_build_request(sequence, &kind)))
+	{
+		lock_release(soak.lock);
+		return FALSE;
+	}
+
+	snprintf(requestId, sizeof(requestId), "soak%llu", (unsigned long long)sequence);
+	soak_track(packet, requestId, kind);
+
+	lock_release(soak.lock);
+
+	// command_handle takes ownership of the packet
+	command_handle(remote, packet);
+
+	return TRUE;
+}
+
+/*!
+ * @brief Hand the server every packet the client side has queued up.
+ * @return Number of packets handed over.
+ */
+static DWORD soak_drain_injected(Remote* remote)
+{
+	Packet* packet;
+	DWORD count = 0;
+
+	while ((packet = (Packet*)list_shift(soak.inject)))
+	{
+		command_handle(remote, packet);
+		count++;
+	}
+
+	return count;
+}
+
+/*!
+ * @brief Stop dispatching until the requests in flight are answered and their threads are gone.
+ * @details A command thread that never finishes still gets counted, since the
+ *          wait gives up after SOAK_DRAIN_TIMEOUT.
+ */
+static VOID soak_quiesce(Remote* remote)
+{
+	QWORD start = soak_now();
+
+	while ((soak.outstanding || soak_channels_busy() || list_count(remote->command_threads))
+		&& soak_now() - start < SOAK_DRAIN_TIMEOUT)
+	{
+		if (!soak_drain_injected(remote))
+		{
+			usleep(1000);
+		}
+	}
+}
+
+/*!
+ * @brief Stage the stdapi image, advertising that the client answers core_loadlib_request.
+ * @return \c TRUE if the image loaded.
+ */
+static BOOL soak_stage(Remote* remote, const char* path)
+{
+	char image[PATH_MAX];
+	Packet* request;
+	QWORD start;
+	PCHAR name;
+
+	strncpy(soak.imageDirectory, path, sizeof(soak.imageDirectory) - 1);
+	if ((name = strrchr(soak.imageDirectory, '/')))
+	{
+		*name = 0;
+	}
+	else
+	{
+		strcpy(soak.imageDirectory, ".");
+	}
+
+	// extensions name themselves, the loader only needs something to call the image
+	strncpy(image, strrchr(path, '/') ? strrchr(path, '/') + 1 : path, sizeof(image) - 1);
+	image[sizeof(image) - 1] = 0;
+	if ((name = strrchr(image, '.')))
+	{
+		*name = 0;
+	}
+
+	if (!(request = soak_loadlib(image, CLIENT_CAPABILITY_LOADLIB_REQUEST)))
+	{
+		return FALSE;
+	}
+
+	lock_acquire(soak.lock);
+	soak.stageResult = ERROR_TIMEOUT;
+	soak_track(request, "soak-stage", SoakChannelNone);
+	lock_release(soak.lock);
+
+	command_handle(remote, request);
+
+	start = soak_now();
+	while (soak.outstanding && soak_now() - start < SOAK_DRAIN_TIMEOUT)
+	{
+		if (!soak_drain_injected(remote))
+		{
+			usleep(1000);
+		}
+	}
+
+	printf("staged %s from %s, result %u\n", image, soak.imageDirectory, (unsigned int)soak.stageResult);
+
+	return soak.stageResult == ERROR_SUCCESS;
+}
+
+/*!
+ * @brief qsort comparison for latencies.
+ */
+static int soak_compare_latency(const void* a, const void* b)
+{
+	QWORD left = *(const QWORD*)a;
+	QWORD right = *(const QWORD*)b;
+
+	return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+/*!
+ * @brief Take a sample of the process, and start a new latency interval.
+ */
+static VOID soak_take_sample(Remote* remote, SoakSample* sample)
+{
+	DWORD count;
+
+	memset(sample, 0, sizeof(*sample));
+
+	sample->rss = soak_rss();
+	sample->threads = soak_count_entries("/proc/self/task");
+	// less the descriptor opendir holds while counting
+	sample->fds = soak_count_entries("/proc/self/fd");
+	if (sample->fds)
+	{
+		sample->fds--;
+	}
+	sample->commandThreads = list_count(remote->command_threads);
+
+	lock_acquire(soak.lock);
+
+	sample->completions = soak.completionsAdded - soak.completionsFired;
+
+	count = soak.latencyCount;
+	if (count)
+	{
+		qsort(soak.latencies, count, sizeof(QWORD), soak_compare_latency);
+		sample->p50 = soak.latencies[count * 50 / 100];
+		sample->p90 = soak.latencies[count * 90 / 100];
+		sample->p99 = soak.latencies[count * 99 / 100];
+		sample->max = soak.latencies[count - 1];
+	}
+	soak.latencyCount = 0;
+	soak.latencySeen = 0;
+
+	lock_release(soak.lock);
+}
+
+/*!
+ * @brief Print a sample as a line of the report.
+ */
+static VOID soak_print_sample(QWORD elapsed, SoakSample* sample)
+{
+	printf("%8llu %10llu %9llu %7u %5u %7u %7u %8llu %8llu %8llu %8llu\n",
+		(unsigned long long)(elapsed / 1000000),
+		(unsigned long long)soak.dispatched,
+		(unsigned long long)sample->rss,
+		sample->threads, sample->fds, sample->commandThreads, sample->completions,
+		(unsigned long long)sample->p50, (unsigned long long)sample->p90,
+		(unsigned long long)sample->p99, (unsigned long long)sample->max);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	Transport transport;
+	Remote* remote = NULL;
+	SoakSample baseline, sample;
+	QWORD duration = 3600, interval = 10, warmup = 60;
+	QWORD rssLimit = 8192, latencyLimit = 200;
+	DWORD threadLimit = 2, fdLimit = 2;
+	QWORD start, now, nextSample, sequence = 0;
+	BOOL haveBaseline = FALSE;
+	DWORD overRss = 0, overThreads = 0, overFds = 0, overCommands = 0, overCompletions = 0, overLatency = 0;
+	const char* failure = NULL;
+	const char* stage = NULL;
+	static BYTE fill[SOAK_CHANNEL_REQUESTS * SOAK_CHANNEL_CHUNK];
+	FILE* file;
+	Packet* request;
+	int arg;
+
+	for (arg = 1; arg + 1 < argc; arg += 2)
+	{
+		QWORD value = strtoull(argv[arg + 1], NULL, 10);
+
+		if (strcmp(argv[arg], "-s") == 0)
+		{
+			stage = argv[arg + 1];
+		}
+		else if (strcmp(argv[arg], "-d") == 0)
+		{
+			duration = value;
+		}
+		else if (strcmp(argv[arg], "-i") == 0 && value)
+		{
+			interval = value;
+		}
+		else if (strcmp(argv[arg], "-w") == 0)
+		{
+			warmup = value;
+		}
+		else if (strcmp(argv[arg], "-m") == 0)
+		{
+			rssLimit = value;
+		}
+		else if (strcmp(argv[arg], "-t") == 0)
+		{
+			threadLimit = (DWORD)value;
+		}
+		else if (strcmp(argv[arg], "-f") == 0)
+		{
+			fdLimit = (DWORD)value;
+		}
+		else if (strcmp(argv[arg], "-l") == 0)
+		{
+			latencyLimit = value;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if (arg < argc)
+	{
+		fprintf(stderr, "usage: %s [-d seconds] [-i seconds] [-w seconds] [-m KB] [-t threads] [-f fds] [-l percent] [-s image]\n", argv[0]);
+		return 1;
+	}
+
+	memset(&soak, 0, sizeof(soak));
+	memset(&transport, 0, sizeof(transport));
+	soak.tunnelListener = -1;
+
+	if (!(soak.lock = lock_create())
+		|| !(soak.inject = list_create())
+		|| !(soak.latencies = (QWORD*)malloc(SOAK_MAX_LATENCIES * sizeof(QWORD)))
+		|| !(remote = remote_allocate()))
+	{
+		fprintf(stderr, "unable to allocate the local server\n");
+		return 1;
+	}
+
+	transport.type = METERPRETER_TRANSPORT_SSL;
+	transport.packet_transmit = soak_packet_transmit;
+	remote->transport = &transport;
+
+	register_dispatch_routines();
+	scheduler_initialize(remote);
+
+	srand(1);
+
+	if (stage)
+	{
+		// the file channels read back what is there, so there has to be enough of it
+		snprintf(soak.filePath, sizeof(soak.filePath), "/tmp/metsrv_soak.%u", (unsigned int)getpid());
+		if (!(file = fopen(soak.filePath, "wb")) || fwrite(fill, 1, sizeof(fill), file) != sizeof(fill))
+		{
+			fprintf(stderr, "unable to create %s\n", soak.filePath);
+			return 1;
+		}
+		fclose(file);
+
+		if (!soak_stage(remote, stage))
+		{
+			fprintf(stderr, "unable to stage %s\n", stage);
+			unlink(soak.filePath);
+			return 1;
+		}
+		soak.stdapi = TRUE;
+
+		// tunnels are left out of the mix if there's nothing for their streams to connect to
+		soak.tunnelListener = soak_tunnel_listen(&soak.tunnelPort);
+	}
+
+	printf("soaking for %llu s, sampling every %llu s after %llu s of warm up\n",
+		(unsigned long long)duration, (unsigned long long)interval, (unsigned long long)warmup);
+	printf("%8s %10s %9s %7s %5s %7s %7s %8s %8s %8s %8s\n",
+		"time(s)", "requests", "rss(KB)", "threads", "fds", "cmdthr", "compl",
+		"p50(us)", "p90(us)", "p99(us)", "max(us)");
+
+	start = soak_now();
+	nextSample = start + interval * 1000000;
+
+	while ((now = soak_now()) - start < duration * 1000000 && !failure)
+	{
+		soak_drain_injected(remote);
+
+		if (!soak_dispatch(remote, sequence))
+		{
+			// everything is in flight, give the threaded commands a moment
+			if (!soak_drain_injected(remote))
+			{
+				usleep(100);
+			}
+		}
+		else
+		{
+			sequence++;
+		}
+
+		if (now < nextSample)
+		{
+			continue;
+		}
+
+		// sample what the server holds on to, not what it happens to be busy with
+		nextSample += interval * 1000000;
+		soak_quiesce(remote);
+		soak_take_sample(remote, &sample);
+		soak_print_sample(now - start, &sample);
+
+		if (now - start < warmup * 1000000)
+		{
+			continue;
+		}
+
+		if (!haveBaseline)
+		{
+			baseline = sample;
+			haveBaseline = TRUE;
+			continue;
+		}
+
+		// a threshold has to be exceeded several samples in a row, transient spikes don't count
+		overRss = sample.rss > baseline.rss + rssLimit ? overRss + 1 : 0;
+		overThreads = sample.threads > baseline.threads + threadLimit ? overThreads + 1 : 0;
+		overFds = sample.fds > baseline.fds + fdLimit ? overFds + 1 : 0;
+		overCommands = sample.commandThreads > baseline.commandThreads + threadLimit ? overCommands + 1 : 0;
+		overCompletions = sample.completions > baseline.completions + SOAK_MAX_PENDING ? overCompletions + 1 : 0;
+		overLatency = (sample.p99 > baseline.p99 + SOAK_LATENCY_FLOOR
+			&& sample.p99 * 100 > baseline.p99 * (100 + latencyLimit)) ? overLatency + 1 : 0;
+
+		if (overRss >= SOAK_CONFIRM_SAMPLES)
+		{
+			failure = "RSS";
+		}
+		else if (overThreads >= SOAK_CONFIRM_SAMPLES)
+		{
+			failure = "thread count";
+		}
+		else if (overFds >= SOAK_CONFIRM_SAMPLES)
+		{
+			failure = "descriptor count";
+		}
+		else if (overCommands >= SOAK_CONFIRM_SAMPLES)
+		{
+			failure = "command thread list";
+		}
+		else if (overCompletions >= SOAK_CONFIRM_SAMPLES)
+		{
+			failure = "outstanding completion handlers";
+		}
+		else if (overLatency >= SOAK_CONFIRM_SAMPLES)
+		{
+			failure = "p99 latency";
+		}
+	}
+
+	// let the requests still in flight finish before tearing the server down
+	soak_quiesce(remote);
+
+	// answers to the last requests can start command threads of their own
+	do
+	{
+		command_join_threads(remote);
+	} while (soak_drain_injected(remote));
+
+	printf("requests dispatched:  %llu, %llu answered, %u unanswered\n",
+		(unsigned long long)soak.dispatched, (unsigned long long)soak.completed, soak.outstanding);
+	printf("completion handlers:  %u registered, %u fired\n", soak.completionsAdded, soak.completionsFired);
+	printf("failed responses:     %llu\n", (unsigned long long)soak.failed);
+	printf("channels used:        %llu, %llu bytes read back, %u buffered channels short\n",
+		(unsigned long long)soak.channelsUsed, (unsigned long long)soak.channelBytes, soak.channelsShort);
+	if (soak.stdapi)
+	{
+		printf("stdapi:               %u images requested, %u tcp connections accepted\n",
+			soak.imagesRequested, soak.tcpAccepted);
+		printf("server closes:        %u channels closed by the server and confirmed\n", soak.serverCloses);
+		printf("tunnel streams:       %u opened, %u failed to open\n", soak.tunnelStreams, soak.tunnelFailed);
+	}
+
+	if (!failure && soak.channelsShort)
+	{
+		printf("FAIL: %u buffered channels gave back less than was written to them\n", soak.channelsShort);
+		failure = "channel data";
+	}
+	else if (failure)
+	{
+		printf("FAIL: %s grew past its threshold for %u samples in a row\n", failure, SOAK_CONFIRM_SAMPLES);
+		printf("baseline: rss %llu KB, %u threads, %u fds, %u command threads, %u completions, p99 %llu us\n",
+			(unsigned long long)baseline.rss, baseline.threads, baseline.fds, baseline.commandThreads,
+			baseline.completions, (unsigned long long)baseline.p99);
+		printf("last:     rss %llu KB, %u threads, %u fds, %u command threads, %u completions, p99 %llu us\n",
+			(unsigned long long)sample.rss, sample.threads, sample.fds, sample.commandThreads,
+			sample.completions, (unsigned long long)sample.p99);
+	}
+	else if (!haveBaseline)
+	{
+		printf("PASS: run was too short to take a baseline after the warm up\n");
+	}
+	else
+	{
+		printf("PASS: nothing grew past its threshold\n");
+	}
+
+	scheduler_destroy(remote);
+	deregister_dispatch_routines(remote);
+
+	// anything the server sent after the last drain is never handed over
+	while ((request = (Packet*)list_shift(soak.inject)))
+	{
+		packet_destroy(request);
+	}
+
+	remote->transport = NULL;
+	remote_deallocate(remote);
+	list_destroy(soak.inject);
+	free(soak.latencies);
+	lock_destroy(soak.lock);
+
+	if (soak.filePath[0])
+	{
+		unlink(soak.filePath);
+	}
+
+	if (soak.tunnelListener >= 0)
+	{
+		close(soak.tunnelListener);
+	}
+
+	return failure ? 2 : 0;
+}
@@ -0,0 +1,451 @@
+/*!
+ * @file pipeline.c
+ * @brief Outbound packet pipeline for the POSIX meterpreter.
+ * @details Every transmitted packet becomes a job on a single queue, which keeps
+ *          the order the packets were handed to the transport in. Small packets
+ *          are framed straight away on the calling thread because handing them to
+ *          a worker costs more than the work itself. Large packets are claimed by
+ *          the workers, which encrypt them and build the frame in parallel. The
+ *          writer only ever writes the job at the head of the queue, so frames
+ *          hit the wire in order no matter which worker finishes first.
+ *
+ *          The queue is bounded by the number of bytes it holds, so a bulk
+ *          transfer blocks the producer instead of buffering the whole file.
+ */
+#include "metsrv.h"
+
+#include <pthread.h>
+
+/*! @brief A packet waiting to be framed or written. */
+typedef struct _PipelineJob
+{
+	struct _PipelineJob* next;              ///< Next job in transmit order.
+	Packet* packet;                         ///< Packet to frame, owned by the job until it has been framed.
+	CryptoContext* crypto;                  ///< Cipher to encrypt the payload with, if any.
+	PUCHAR frame;                           ///< Framed packet, ready to be written.
+	DWORD frameLength;                      ///< Number of bytes in \c frame.
+	DWORD size;                             ///< Number of bytes the job counts against \c PIPELINE_MAX_PENDING.
+	BOOL done;                              ///< Indication of whether the job has been framed.
+} PipelineJob;
+
+/*! @brief State of an outbound pipeline. */
+struct _PacketPipeline
+{
+	Remote* remote;                         ///< Remote the packets are sent to.
+	PPipelineWrite write;                   ///< Transport function that writes a frame.
+	pthread_mutex_t mutex;                  ///< Guards everything below.
+	pthread_cond_t work;                    ///< Signalled when there is a job for the workers.
+	pthread_cond_t ready;                   ///< Signalled when the job at the head of the queue is framed.
+	pthread_cond_t space;                   ///< Signalled when the writer has freed up room in the queue.
+	pthread_cond_t idle;                    ///< Signalled when the last reference taken by pipeline_acquire is released.
+	pthread_t workers[PIPELINE_MAX_WORKERS];///< Worker threads.
+	DWORD workerCount;                      ///< Number of entries of \c workers in use.
+	pthread_t writer;                       ///< Writer thread.
+	PipelineJob* head;                      ///< Oldest job, the next one to be written.
+	PipelineJob* tail;                      ///< Newest job.
+	PipelineJob* unclaimed;                 ///< Oldest job that hasn't been framed or claimed by a worker.
+	DWORD pendingBytes;                     ///< Number of bytes held by the queue.
+	DWORD result;                           ///< Result of the first failed write, or ERROR_SUCCESS.
+	DWORD users;                            ///< Number of references taken by pipeline_acquire.
+	BOOL stopping;                          ///< Set when the pipeline is being destroyed.
+};
+
+/*!
+ * @brief Get the number of worker threads to run.
+ * @return The number of workers, zero if the pipeline shouldn't run.
+ * @remark By default there's one worker per processor, leaving one processor for
+ *         the writer. A single processor gains nothing from the pipeline.
+ */
+static DWORD pipeline_worker_count()
+{
+	char* env = getenv(PIPELINE_ENV_WORKERS);
+	long count;
+
+	if (env != NULL)
+	{
+		count = strtol(env, NULL, 10);
+	}
+	else
+	{
+		count = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	}
+
+	if (count <= 0)
+	{
+		return 0;
+	}
+
+	return count > PIPELINE_MAX_WORKERS ? PIPELINE_MAX_WORKERS : (DWORD)count;
+}
+
+/*!
+ * @brief Encrypt a job's packet and build its frame.
+ * @param job Pointer to the job to frame.
+ * @remark The packet is destroyed, whether or not framing succeeded. A job that
+ *         couldn't be framed is done but has no frame, and is skipped by the writer.
+ */
+static VOID pipeline_frame(PipelineJob* job)
+{
+	Packet* packet = job->packet;
+
+	do
+	{
+		if (job->crypto)
+		{
+			PUCHAR origPayload = packet->payload;
+
+			if (job->crypto->handlers.encrypt(job->crypto, packet->payload, packet->payloadLength,
+				&packet->payload, &packet->payloadLength) != ERROR_SUCCESS)
+			{
+				dprintf("[PIPELINE] failed to encrypt packet of length %u", packet->payloadLength);
+				break;
+			}
+
+			free(origPayload);
+			packet->header.length = htonl(packet->payloadLength + sizeof(TlvHeader));
+		}
+
+		// Header and payload go out in a single write, and so in a single SSL record
+		job->frameLength = sizeof(packet->header) + packet->payloadLength;
+		if ((job->frame = (PUCHAR)malloc(job->frameLength)) == NULL)
+		{
+			break;
+		}
+
+		memcpy(job->frame, &packet->header, sizeof(packet->header));
+		memcpy(job->frame + sizeof(packet->header), packet->payload, packet->payloadLength);
+	} while (0);
+
+	packet_destroy(packet);
+	job->packet = NULL;
+}
+
+/*!
+ * @brief Move \c unclaimed past the jobs that no longer need a worker.
+ * @param pipeline Pointer to the pipeline, with its mutex held.
+ * @param job The first job that could be unclaimed.
+ */
+static VOID pipeline_set_unclaimed(PacketPipeline* pipeline, PipelineJob* job)
+{
+	while (job != NULL && job->done)
+	{
+		job = job->next;
+	}
+	pipeline->unclaimed = job;
+}
+
+/*!
+ * @brief Worker thread, frames the jobs that are too large to frame inline.
+ * @param param Pointer to the pipeline.
+ */
+static void* pipeline_worker_thread(void* param)
+{
+	PacketPipeline* pipeline = (PacketPipeline*)param;
+	PipelineJob* job;
+
+	pthread_mutex_lock(&pipeline->mutex);
+
+	while (TRUE)
+	{
+		while (pipeline->unclaimed == NULL && !pipeline->stopping)
+		{
+			pthread_cond_wait(&pipeline->work, &pipeline->mutex);
+		}
+
+		if ((job = pipeline->unclaimed) == NULL)
+		{
+			break;
+		}
+
+		pipeline_set_unclaimed(pipeline, job->next);
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		pipeline_frame(job);
+
+		pthread_mutex_lock(&pipeline->mutex);
+		job->done = TRUE;
+		if (job == pipeline->head)
+		{
+			pthread_cond_signal(&pipeline->ready);
+		}
+	}
+
+	pthread_mutex_unlock(&pipeline->mutex);
+	return NULL;
+}
+
+/*!
+ * @brief Writer thread, writes framed jobs to the transport in transmit order.
+ * @param param Pointer to the pipeline.
+ * @remark When the pipeline is stopping, the writer drains the queue before exiting
+ *         so that responses queued during shutdown still go out.
+ */
+static void* pipeline_writer_thread(void* param)
+{
+	PacketPipeline* pipeline = (PacketPipeline*)param;
+	PipelineJob* job;
+	DWORD result;
+
+	pthread_mutex_lock(&pipeline->mutex);
+
+	while (TRUE)
+	{
+		while ((pipeline->head == NULL || !pipeline->head->done) &&
+			!(pipeline->head == NULL && pipeline->stopping))
+		{
+			pthread_cond_wait(&pipeline->ready, &pipeline->mutex);
+		}
+
+		if ((job = pipeline->head) == NULL)
+		{
+			break;
+		}
+
+		result = pipeline->result;
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		if (result == ERROR_SUCCESS && job->frame != NULL)
+		{
+			result = pipeline->write(pipeline->remote, job->frame, job->frameLength);
+		}
+
+		pthread_mutex_lock(&pipeline->mutex);
+
+		if (pipeline->result == ERROR_SUCCESS && result != ERROR_SUCCESS)
+		{
+			dprintf("[PIPELINE] write failed with %u, dropping further packets", result);
+			pipeline->result = result;
+		}
+
+		if ((pipeline->head = job->next) == NULL)
+		{
+			pipeline->tail = NULL;
+		}
+		pipeline->pendingBytes -= job->size;
+		pthread_cond_broadcast(&pipeline->space);
+
+		free(job->frame);
+		free(job);
+	}
+
+	pthread_mutex_unlock(&pipeline->mutex);
+	return NULL;
+}
+
+/*!
+ * @brief Create an outbound pipeline and start its threads.
+ * @param remote Pointer to the remote the packets are sent to.
+ * @param write Transport function that writes a finished frame.
+ * @return Pointer to the pipeline, or \c NULL if the pipeline is disabled or
+ *         couldn't be started, in which case the transport should write inline.
+ */
+PacketPipeline* pipeline_create(Remote* remote, PPipelineWrite write)
+{
+	PacketPipeline* pipeline = NULL;
+	DWORD workers = pipeline_worker_count();
+	DWORD index;
+
+	if (workers == 0)
+	{
+		dprintf("[PIPELINE] disabled");
+		return NULL;
+	}
+
+	if ((pipeline = (PacketPipeline*)calloc(1, sizeof(PacketPipeline))) == NULL)
+	{
+		return NULL;
+	}
+
+	pipeline->remote = remote;
+	pipeline->write = write;
+	pipeline->result = ERROR_SUCCESS;
+	pthread_mutex_init(&pipeline->mutex, NULL);
+	pthread_cond_init(&pipeline->work, NULL);
+	pthread_cond_init(&pipeline->ready, NULL);
+	pthread_cond_init(&pipeline->space, NULL);
+	pthread_cond_init(&pipeline->idle, NULL);
+
+	if (pthread_create(&pipeline->writer, NULL, pipeline_writer_thread, pipeline) != 0)
+	{
+		pthread_cond_destroy(&pipeline->idle);
+		pthread_cond_destroy(&pipeline->space);
+		pthread_cond_destroy(&pipeline->ready);
+		pthread_cond_destroy(&pipeline->work);
+		pthread_mutex_destroy(&pipeline->mutex);
+		free(pipeline);
+		return NULL;
+	}
+
+	for (index = 0; index < workers; index++)
+	{
+		if (pthread_create(&pipeline->workers[pipeline->workerCount], NULL, pipeline_worker_thread, pipeline) == 0)
+		{
+			pipeline->workerCount++;
+		}
+	}
+
+	dprintf("[PIPELINE] started with %u workers", pipeline->workerCount);
+	return pipeline;
+}
+
+/*!
+ * @brief Keep a pipeline from being freed while it is used outside the lock it was found under.
+ * @param pipeline Pointer to the pipeline.
+ * @remark Must be called while the pipeline can't be destroyed, i.e. under the lock
+ *         that guards the pointer to it. pipeline_destroy waits for the matching
+ *         pipeline_release.
+ */
+VOID pipeline_acquire(PacketPipeline* pipeline)
+{
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->users++;
+	pthread_mutex_unlock(&pipeline->mutex);
+}
+
+/*!
+ * @brief Drop a reference taken by pipeline_acquire.
+ * @param pipeline Pointer to the pipeline.
+ */
+VOID pipeline_release(PacketPipeline* pipeline)
+{
+	pthread_mutex_lock(&pipeline->mutex);
+	if (--pipeline->users == 0)
+	{
+		pthread_cond_broadcast(&pipeline->idle);
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+}
+
+/*!
+ * @brief Queue a packet for transmission.
+ * @param pipeline Pointer to the pipeline.
+ * @param packet Pointer to the packet to transmit. The pipeline takes ownership and
+ *               destroys it once it has been framed.
+ * @param crypto Cipher to encrypt the packet's payload with, or \c NULL.
+ * @return Indication of success or failure. Success means that the packet has been
+ *         queued, not that it has been written.
+ * @remark Blocks while the queue is full. Must not be called with the lock the
+ *         transport's write function takes held.
+ */
+DWORD pipeline_transmit(PacketPipeline* pipeline, Packet* packet, CryptoContext* crypto)
+{
+	PipelineJob* job;
+	DWORD result;
+
+	if ((job = (PipelineJob*)calloc(1, sizeof(PipelineJob))) == NULL)
+	{
+		packet_destroy(packet);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	job->packet = packet;
+	job->crypto = crypto;
+	job->size = sizeof(packet->header) + packet->payloadLength;
+
+	// Nothing to gain from a worker when there's only a little to do, or no worker to do it
+	if (pipeline->workerCount == 0 || packet->payloadLength < PIPELINE_MIN_PAYLOAD)
+	{
+		pipeline_frame(job);
+		job->done = TRUE;
+	}
+
+	pthread_mutex_lock(&pipeline->mutex);
+
+	while (pipeline->pendingBytes >= PIPELINE_MAX_PENDING &&
+		pipeline->result == ERROR_SUCCESS && !pipeline->stopping)
+	{
+		pthread_cond_wait(&pipeline->space, &pipeline->mutex);
+	}
+
+	if ((result = pipeline->result) == ERROR_SUCCESS && pipeline->stopping)
+	{
+		result = ERROR_WRITE_FAULT;
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		pthread_mutex_unlock(&pipeline->mutex);
+		if (job->packet)
+		{
+			packet_destroy(job->packet);
+		}
+		free(job->frame);
+		free(job);
+		return result;
+	}
+
+	if (pipeline->tail)
+	{
+		pipeline->tail->next = job;
+	}
+	else
+	{
+		pipeline->head = job;
+	}
+	pipeline->tail = job;
+	pipeline->pendingBytes += job->size;
+
+	if (job->done)
+	{
+		if (job == pipeline->head)
+		{
+			pthread_cond_signal(&pipeline->ready);
+		}
+	}
+	else
+	{
+		if (pipeline->unclaimed == NULL)
+		{
+			pipeline->unclaimed = job;
+		}
+		pthread_cond_signal(&pipeline->work);
+	}
+
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Write out everything that has been queued, then stop and free the pipeline.
+ * @param pipeline Pointer to the pipeline to destroy.
+ * @remark Must be called before the transport that the frames are written to is torn down.
+ */
+VOID pipeline_destroy(PacketPipeline* pipeline)
+{
+	DWORD index;
+
+	if (pipeline == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->stopping = TRUE;
+	pthread_cond_broadcast(&pipeline->work);
+	pthread_cond_broadcast(&pipeline->ready);
+	pthread_cond_broadcast(&pipeline->space);
+
+	// Callers that found the pipeline before it was detached are turned away
+	// once they see stopping, wait for them before the pipeline goes away
+	while (pipeline->users > 0)
+	{
+		pthread_cond_wait(&pipeline->idle, &pipeline->mutex);
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	// Workers frame whatever is left before they exit, and the writer doesn't exit
+	// until the queue is empty
+	for (index = 0; index < pipeline->workerCount; index++)
+	{
+		pthread_join(pipeline->workers[index], NULL);
+	}
+	pthread_join(pipeline->writer, NULL);
+
+	pthread_cond_destroy(&pipeline->idle);
+	pthread_cond_destroy(&pipeline->space);
+	pthread_cond_destroy(&pipeline->ready);
+	pthread_cond_destroy(&pipeline->work);
+	pthread_mutex_destroy(&pipeline->mutex);
+	free(pipeline);
+}
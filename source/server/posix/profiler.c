@@ -0,0 +1,482 @@
+/*!
+ * @file profiler.c
+ * @brief Built-in sampling profiler for the POSIX meterpreter.
+ * @details An ITIMER_PROF timer delivers SIGPROF to whichever thread is consuming
+ *          CPU. The signal handler records that thread's id along with a stack
+ *          captured by walking the frame pointer chain from the interrupted context,
+ *          and stores it in a preallocated sample buffer (no allocation or locking
+ *          happens in the handler). When a report is requested the samples are
+ *          aggregated by thread and stack, and each frame is symbolised with dladdr,
+ *          which the linker resolves against its own soinfo records. That means
+ *          frames inside reflectively loaded extensions come back with names that
+ *          external profilers can't see.
+ */
+#include "metsrv.h"
+
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <asm/sigcontext.h>
+#include <asm/ucontext.h>
+#include <dlfcn.h>
+
+/*! @brief Maximum number of frames captured per sample. */
+#define PROFILE_MAX_DEPTH       16
+/*! @brief Number of samples that can be held before further samples are dropped. */
+#define PROFILE_MAX_SAMPLES     8192
+/*! @brief Largest distance between two frames that is considered believable. */
+#define PROFILE_MAX_FRAME_STEP  0x10000
+/*! @brief Smallest sampling interval that can be requested (microseconds). */
+#define PROFILE_MIN_INTERVAL    1000
+/*! @brief Largest sampling interval that can be requested (microseconds). */
+#define PROFILE_MAX_INTERVAL    1000000
+
+/*! @brief A single captured stack. */
+typedef struct _ProfileSample
+{
+	pid_t tid;                              ///< Thread that was interrupted.
+	DWORD depth;                            ///< Number of valid entries in \c frames.
+	uintptr_t frames[PROFILE_MAX_DEPTH];    ///< Return addresses, innermost first.
+} ProfileSample;
+
+/*! @brief A unique thread/stack pair and the number of times it was seen. */
+typedef struct _ProfileEntry
+{
+	ProfileSample* sample;                  ///< First sample that had this stack.
+	DWORD count;                            ///< Number of samples that had this stack.
+} ProfileEntry;
+
+static LOCK* profileLock = NULL;
+static ProfileSample* profileSamples = NULL;
+static volatile int profileNext = 0;        ///< Index of the next free sample slot.
+static volatile int profileDropped = 0;     ///< Samples lost because the buffer was full.
+static volatile int profileInHandler = 0;   ///< Number of handlers currently running.
+static volatile int profilePaused = 0;      ///< Set while a report reads the buffer, handlers leave it alone then.
+static BOOL profileRunning = FALSE;
+static DWORD profileInterval = PROFILE_DEFAULT_INTERVAL;  ///< Interval of the current run, in microseconds.
+static struct sigaction profilePrevious;
+
+/*!
+ * @brief Walk a chain of frame pointers, collecting return addresses.
+ * @param fp The frame pointer to start from.
+ * @param low The lowest address the first frame may live at (usually the stack pointer).
+ * @param frames Array that receives the return addresses, innermost first.
+ * @param maxFrames Number of entries available in \c frames.
+ * @return The number of return addresses collected.
+ * @remark Code that was built without frame pointers leaves arbitrary values in
+ *         \c ebp, so each frame is checked for plausibility, and the pages it
+ *         lives on are checked with mincore before it's followed. This is safe to
+ *         call from a signal handler.
+ */
+DWORD profiler_walk_stack(uintptr_t fp, uintptr_t low, uintptr_t* frames, DWORD maxFrames)
+{
+	uintptr_t next, ret, page, checkedPage = 0;
+	unsigned char vec;
+	DWORD depth = 0;
+
+	while (depth < maxFrames)
+	{
+		if (fp & (sizeof(uintptr_t) - 1) || fp < low || fp - low > PROFILE_MAX_FRAME_STEP)
+		{
+			break;
+		}
+
+		// frames only ever move up the stack, so pages at or below the last one
+		// that was checked don't need checking again
+		for (page = fp & ~(PAGE_SIZE - 1); page <= ((fp + 2 * sizeof(uintptr_t) - 1) & ~(PAGE_SIZE - 1)); page += PAGE_SIZE)
+		{
+			if (page > checkedPage)
+			{
+				if (mincore((void*)page, PAGE_SIZE, &vec) != 0)
+				{
+					return depth;
+				}
+				checkedPage = page;
+			}
+		}
+
+		next = ((uintptr_t*)fp)[0];
+		ret = ((uintptr_t*)fp)[1];
+
+		if (!ret)
+		{
+			break;
+		}
+
+		frames[depth++] = ret;
+
+		// frames must move towards the base of the stack
+		if (next <= fp)
+		{
+			break;
+		}
+
+		low = fp + 2 * sizeof(uintptr_t);
+		fp = next;
+	}
+
+	return depth;
+}
+
+/*!
+ * @brief SIGPROF handler that captures the stack of the interrupted thread.
+ * @remark Only async-signal-safe operations are permitted in here.
+ */
+static void profiler_signal(int sig, siginfo_t* info, void* context)
+{
+	struct ucontext* uc = (struct ucontext*)context;
+	ProfileSample* sample;
+	int savedErrno = errno;
+	int slot;
+
+	__atomic_inc(&profileInHandler);
+
+	// a signal that was already pending when a report disarmed the timer is dropped
+	if (profilePaused)
+	{
+		__atomic_dec(&profileInHandler);
+		return;
+	}
+
+	if ((slot = __atomic_inc(&profileNext)) >= PROFILE_MAX_SAMPLES)
+	{
+		__atomic_inc(&profileDropped);
+	}
+	else
+	{
+		sample = &profileSamples[slot];
+		sample->tid = gettid();
+		sample->frames[0] = uc->uc_mcontext.eip;
+		sample->depth = 1 + profiler_walk_stack(uc->uc_mcontext.ebp, uc->uc_mcontext.esp,
+			sample->frames + 1, PROFILE_MAX_DEPTH - 1);
+	}
+
+	__atomic_dec(&profileInHandler);
+
+	errno = savedErrno;
+}
+
+/*!
+ * @brief Arm or disarm the profiling timer.
+ * @param interval Sampling interval in microseconds, or zero to disarm.
+ */
+static int profiler_set_timer(DWORD interval)
+{
+	struct itimerval timer;
+
+	timer.it_interval.tv_sec = interval / 1000000;
+	timer.it_interval.tv_usec = interval % 1000000;
+	timer.it_value = timer.it_interval;
+
+	return setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+/*!
+ * @brief Wait for any signal handlers that are still running on other threads.
+ */
+static VOID profiler_quiesce()
+{
+	while (profileInHandler)
+	{
+		usleep(1000);
+	}
+}
+
+/*!
+ * @brief Start sampling.
+ * @param interval Sampling interval in microseconds.
+ */
+static DWORD profiler_start(DWORD interval)
+{
+	struct sigaction action;
+
+	if (profileRunning)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (!profileSamples && !(profileSamples = (ProfileSample*)malloc(sizeof(ProfileSample) * PROFILE_MAX_SAMPLES)))
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	profileNext = 0;
+	profileDropped = 0;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = profiler_signal;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	if (sigaction(SIGPROF, &action, &profilePrevious) != 0)
+	{
+		return errno;
+	}
+
+	if (profiler_set_timer(interval) != 0)
+	{
+		sigaction(SIGPROF, &profilePrevious, NULL);
+		return errno;
+	}
+
+	profileRunning = TRUE;
+
+	dprintf("[PROFILE] sampling every %u us", interval);
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Stop sampling, keeping the gathered samples for a later report.
+ * @remark SIGPROF is ignored from here on rather than given back to its previous
+ *         handler, as a signal that was already pending when the timer was
+ *         disarmed would otherwise be delivered with the default action, which
+ *         terminates the process.
+ */
+static DWORD profiler_stop()
+{
+	if (!profileRunning)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	profiler_set_timer(0);
+	profiler_quiesce();
+	signal(SIGPROF, SIG_IGN);
+	profileRunning = FALSE;
+
+	dprintf("[PROFILE] stopped after %d samples", profileNext);
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Convert a code address into a readable frame description.
+ * @param address The address to describe.
+ * @param buffer Buffer that receives the description.
+ * @param bufferSize Size of \c buffer.
+ */
+VOID profiler_symbolise(uintptr_t address, char* buffer, size_t bufferSize)
+{
+	Dl_info info;
+	const char* name;
+
+	memset(&info, 0, sizeof(info));
+
+	if (!dladdr((void*)address, &info) || !info.dli_fname)
+	{
+		snprintf(buffer, bufferSize, "0x%08x", (unsigned int)address);
+		return;
+	}
+
+	name = strrchr(info.dli_fname, '/') ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname;
+
+	if (info.dli_sname)
+	{
+		snprintf(buffer, bufferSize, "%s!%s+0x%x", name, info.dli_sname,
+			(unsigned int)(address - (uintptr_t)info.dli_saddr));
+	}
+	else
+	{
+		snprintf(buffer, bufferSize, "%s+0x%x", name,
+			(unsigned int)(address - (uintptr_t)info.dli_fbase));
+	}
+}
+
+/*!
+ * @brief Aggregate the samples gathered so far into the response, then discard them.
+ * @param response The response packet to add the entries to.
+ */
+static DWORD profiler_report(Packet* response)
+{
+	ProfileEntry* entries = NULL;
+	DWORD numSamples, numEntries = 0, index, entry, frame;
+	BOOL wasRunning = profileRunning;
+	char symbol[256];
+
+	if (!profileSamples)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	// the buffer can only be read while no handler is writing to it, and the handler
+	// stays installed, so it's told to keep out before the timer is disarmed
+	if (wasRunning)
+	{
+		__atomic_swap(1, &profilePaused);
+		profiler_set_timer(0);
+		profiler_quiesce();
+	}
+
+	numSamples = profileNext < PROFILE_MAX_SAMPLES ? profileNext : PROFILE_MAX_SAMPLES;
+
+	if (numSamples && !(entries = (ProfileEntry*)calloc(numSamples, sizeof(ProfileEntry))))
+	{
+		// the samples are kept for another attempt
+		if (wasRunning)
+		{
+			profilePaused = 0;
+			profiler_set_timer(profileInterval);
+		}
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for (index = 0; index < numSamples; index++)
+	{
+		ProfileSample* sample = &profileSamples[index];
+
+		for (entry = 0; entry < numEntries; entry++)
+		{
+			if (entries[entry].sample->tid == sample->tid
+				&& entries[entry].sample->depth == sample->depth
+				&& memcmp(entries[entry].sample->frames, sample->frames, sample->depth * sizeof(uintptr_t)) == 0)
+			{
+				break;
+			}
+		}
+
+		if (entry == numEntries)
+		{
+			entries[numEntries++].sample = sample;
+		}
+
+		entries[entry].count++;
+	}
+
+	for (entry = 0; entry < numEntries; entry++)
+	{
+		Packet* group = packet_create_group();
+
+		if (!group)
+		{
+			break;
+		}
+
+		packet_add_tlv_uint(group, TLV_TYPE_PROFILE_COUNT, entries[entry].count);
+		packet_add_tlv_uint(group, TLV_TYPE_PROFILE_THREAD, entries[entry].sample->tid);
+
+		for (frame = 0; frame < entries[entry].sample->depth; frame++)
+		{
+			profiler_symbolise(entries[entry].sample->frames[frame], symbol, sizeof(symbol));
+			packet_add_tlv_string(group, TLV_TYPE_PROFILE_FRAME, symbol);
+		}
+
+		packet_add_group(response, TLV_TYPE_PROFILE_ENTRY, group);
+	}
+
+	packet_add_tlv_uint(response, TLV_TYPE_PROFILE_DROPPED, profileDropped);
+
+	dprintf("[PROFILE] reported %u samples in %u entries, %d dropped", numSamples, numEntries, profileDropped);
+
+	profileNext = 0;
+	profileDropped = 0;
+
+	if (entries)
+	{
+		free(entries);
+	}
+
+	if (wasRunning)
+	{
+		profilePaused = 0;
+		profiler_set_timer(profileInterval);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Prepare the profiler for use.
+ */
+VOID profiler_initialize()
+{
+	profileLock = lock_create();
+}
+
+/*!
+ * @brief Stop the profiler if it's running and release its resources.
+ */
+VOID profiler_destroy()
+{
+	if (profileLock)
+	{
+		lock_acquire(profileLock);
+		profiler_stop();
+		lock_release(profileLock);
+		lock_destroy(profileLock);
+		profileLock = NULL;
+	}
+
+	if (profileSamples)
+	{
+		free(profileSamples);
+		profileSamples = NULL;
+	}
+}
+
+/*!
+ * @brief Handler for the `core_profile` command.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Pointer to the request packet.
+ * @return Indication of success or failure.
+ * @details Takes a TLV_TYPE_PROFILE_ACTION of PROFILE_ACTION_START (with an optional
+ *          TLV_TYPE_PROFILE_INTERVAL in microseconds, which is clamped to between
+ *          PROFILE_MIN_INTERVAL and PROFILE_MAX_INTERVAL), PROFILE_ACTION_STOP or
+ *          PROFILE_ACTION_REPORT. A report contains one TLV_TYPE_PROFILE_ENTRY group
+ *          per unique thread and stack, holding the sample count, the thread id and
+ *          the symbolised frames, innermost first.
+ */
+DWORD request_core_profile(Remote *remote, Packet *packet)
+{
+	Packet *response = packet_create_response(packet);
+	DWORD action = packet_get_tlv_value_uint(packet, TLV_TYPE_PROFILE_ACTION);
+	DWORD interval = packet_get_tlv_value_uint(packet, TLV_TYPE_PROFILE_INTERVAL);
+	DWORD result = ERROR_SUCCESS;
+
+	if (!profileLock)
+	{
+		result = ERROR_INVALID_HANDLE;
+	}
+	else
+	{
+		lock_acquire(profileLock);
+
+		switch (action)
+		{
+		case PROFILE_ACTION_START:
+			if (!interval)
+			{
+				interval = PROFILE_DEFAULT_INTERVAL;
+			}
+			else if (interval < PROFILE_MIN_INTERVAL)
+			{
+				interval = PROFILE_MIN_INTERVAL;
+			}
+			else if (interval > PROFILE_MAX_INTERVAL)
+			{
+				interval = PROFILE_MAX_INTERVAL;
+			}
+
+			// a run that's already going keeps the interval it was started with
+			if (!profileRunning)
+			{
+				profileInterval = interval;
+			}
+			result = profiler_start(interval);
+			break;
+		case PROFILE_ACTION_STOP:
+			result = profiler_stop();
+			break;
+		case PROFILE_ACTION_REPORT:
+			result = profiler_report(response);
+			break;
+		default:
+			result = ERROR_INVALID_PARAMETER;
+			break;
+		}
+
+		lock_release(profileLock);
+	}
+
+	packet_transmit_response(result, remote, response);
+
+	return ERROR_SUCCESS;
+}
@@ -27,6 +27,9 @@ DWORD request_core_loadlib(Remote *remote, Packet *packet)
 		libraryPath = packet_get_tlv_value_string(packet, TLV_TYPE_LIBRARY_PATH);
 		flags = packet_get_tlv_value_uint(packet, TLV_TYPE_FLAGS);
 
+		// the extension may want to know what the client can do before it initializes
+		remote->client_capabilities |= packet_get_tlv_value_uint(packet, TLV_TYPE_CLIENT_CAPABILITIES);
+
 		// Invalid library path?
 		if (!libraryPath)
 		{
@@ -89,6 +92,7 @@ DWORD request_core_loadlib(Remote *remote, Packet *packet)
 				if (pExtension->getname)
 				{
 					pExtension->getname(pExtension->name, sizeof(pExtension->name));
+					command_group_loaded(pExtension->name);
 				}
 				list_push(gExtensionList, pExtension);
 			}
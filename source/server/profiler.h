@@ -0,0 +1,35 @@
+/*!
+ * @file profiler.h
+ * @brief Declarations for the built-in sampling and heap profilers.
+ */
+#ifndef _METERPRETER_SERVER_PROFILER_H
+#define _METERPRETER_SERVER_PROFILER_H
+
+/*! @brief Start sampling, discarding any samples from a previous run. */
+#define PROFILE_ACTION_START    1
+/*! @brief Stop sampling, keeping the samples gathered so far. */
+#define PROFILE_ACTION_STOP     2
+/*! @brief Return the aggregated samples gathered so far. Sampling continues if it was running. */
+#define PROFILE_ACTION_REPORT   3
+
+/*! @brief Mark the start of a new heap generation, for use with PROFILE_ACTION_LEAKS. */
+#define PROFILE_ACTION_SNAPSHOT 4
+/*! @brief Return the call sites of allocations made since the last snapshot that are still live. */
+#define PROFILE_ACTION_LEAKS    5
+
+/*! @brief Sampling interval used when the request doesn't specify one (microseconds). */
+#define PROFILE_DEFAULT_INTERVAL  10000
+/*! @brief Number of heap profile entries returned when the request doesn't specify a limit. */
+#define PROFILE_DEFAULT_LIMIT     20
+
+VOID profiler_initialize();
+VOID profiler_destroy();
+DWORD profiler_walk_stack(uintptr_t fp, uintptr_t low, uintptr_t* frames, DWORD maxFrames);
+VOID profiler_symbolise(uintptr_t address, char* buffer, size_t bufferSize);
+
+VOID heap_profiler_destroy();
+
+DWORD request_core_profile(Remote *remote, Packet *packet);
+DWORD request_core_heap_profile(Remote *remote, Packet *packet);
+
+#endif
@@ -21,6 +21,9 @@ Command customCommands[] =
 	COMMAND_REQ("core_machine_id", request_core_machine_id),
 #ifdef _WIN32
 	COMMAND_INLINE_REP("core_patch_url", request_core_patch_url),
+#else
+	COMMAND_REQ("core_profile", request_core_profile),
+	COMMAND_REQ("core_heap_profile", request_core_heap_profile),
 #endif
 	COMMAND_TERMINATOR
 };
@@ -111,6 +114,10 @@ VOID register_dispatch_routines()
 {
 	gExtensionList = list_create();
 
+#ifndef _WIN32
+	profiler_initialize();
+#endif
+
 	command_register_all(customCommands);
 }
 
@@ -137,5 +144,10 @@ VOID deregister_dispatch_routines(Remote * remote)
 
 	command_deregister_all(customCommands);
 
+#ifndef _WIN32
+	heap_profiler_destroy();
+	profiler_destroy();
+#endif
+
 	list_destroy(gExtensionList);
 }
@@ -175,6 +175,7 @@ int dlclose(void *handle)
 }
 
 #include "zlib.h"
+#include "unpack.h"
 
 // PKS, begin part of libloader.c :)
 
@@ -343,13 +344,33 @@ void zfree(void *opaque, void *addr)
 	}
 }
 
+/*
+ * Checks for the tag of an image packed with a codec picked by the packer, see
+ * unpack.h. Returns the codec, or 0 if the image isn't tagged.
+ */
+static int check_image_tag(unsigned char **input_buffer, int *input_length, size_t *output_size)
+{
+	unsigned char *inbuf = *input_buffer;
+
+	if (*input_length < IMAGE_HEADER_SIZE || strncmp((char *)inbuf, IMAGE_MAGIC, 4) != 0)
+		return 0;
+
+	*output_size = inbuf[8] | (inbuf[9] << 8) | (inbuf[10] << 16) | ((size_t)inbuf[11] << 24);
+	*input_buffer = inbuf + IMAGE_HEADER_SIZE;
+	*input_length -= IMAGE_HEADER_SIZE;
+
+	return inbuf[4];
+}
+
 void *dlopenbuf(const char *name, void *data, size_t len)
 {
 	unsigned char *input_buffer, *output_buffer = NULL;;
 	int input_size;
+	size_t output_size = TMPLIBSIZE;
 	z_stream stream;
 	void *ret = NULL;
 	int status;
+	int codec;
 
 	TRACE("[ dlopenbuf() called with %s/%08x/%08x ]\n", name, data, len);
 
@@ -360,13 +381,34 @@ void *dlopenbuf(const char *name, void *data, size_t len)
 	input_buffer = (unsigned char *)(data);
 	input_size = len;
 
-	output_buffer = mmap(0, TMPLIBSIZE, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-	
-	if(check_header(&input_buffer, &input_size) != Z_OK) {
-		TRACE("[ dlopenbuf(), we have an uncompressed file ]\n");
-		goto uncompressed;
+	codec = check_image_tag(&input_buffer, &input_size, &output_size);
+
+	output_buffer = mmap(0, output_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if(output_buffer == MAP_FAILED) {
+		output_buffer = NULL;
+		goto out;
 	}
-	
+
+	switch(codec) {
+	case 0:
+		if(check_header(&input_buffer, &input_size) != Z_OK) {
+			TRACE("[ dlopenbuf(), we have an uncompressed file ]\n");
+			goto uncompressed;
+		}
+		break;
+	case IMAGE_CODEC_DEFLATE:
+		break;
+	case IMAGE_CODEC_LZ4:
+		status = lz4_unpack(input_buffer, input_size, output_buffer, output_size);
+		goto unpacked;
+	case IMAGE_CODEC_LZMA:
+		status = lzma_unpack(input_buffer, input_size, output_buffer, output_size);
+		goto unpacked;
+	default:
+		TRACE("[ dlopenbuf(), unknown codec %d ]\n", codec);
+		goto out;
+	}
+
 	zalloc_next = zalloc_buffer = mmap(0, ZALLOC_BUFFER_SIZE, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
 	if(zalloc_buffer == MAP_FAILED) {
 		TRACE("[ falling back to paged mechanism ]\n");
@@ -377,7 +419,7 @@ void *dlopenbuf(const char *name, void *data, size_t len)
 	stream.zfree = zfree;
 	stream.avail_in = input_size;
 	stream.next_in = input_buffer;
-	stream.avail_out = TMPLIBSIZE;
+	stream.avail_out = output_size;
 	stream.next_out = output_buffer;
 	inflateInit2(&stream, -MAX_WBITS);
 	status = inflate(&stream, Z_FINISH);
@@ -389,13 +431,23 @@ void *dlopenbuf(const char *name, void *data, size_t len)
 
 	input_buffer = output_buffer;
 	// TRACE("[ dlopenbuf(), decompressed. stream.avail_out = %d/%08x ]\n", stream.avail_out, stream.avail_out);
-	input_size = TMPLIBSIZE - stream.avail_out;
+	input_size = output_size - stream.avail_out;
+	goto uncompressed;
+
+unpacked:
+	if(status == -1) {
+		TRACE("[ dlopenbuf(), failed to unpack codec %d image ]\n", codec);
+		goto out;
+	}
+
+	input_buffer = output_buffer;
+	input_size = status;
 
 uncompressed:
 	ret = find_library_buf(name, input_buffer, input_size);	
 out:
 	if(output_buffer) {
-		munmap(output_buffer, TMPLIBSIZE);
+		munmap(output_buffer, output_size);
 	}
 
 	if(zalloc_buffer) {
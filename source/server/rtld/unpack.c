@@ -0,0 +1,479 @@
+/*
+ * metasploit
+ *
+ * Decoders for the fast (LZ4) and high ratio (LZMA) image codecs. Images are
+ * always unpacked in one go into a buffer that holds the whole image, so the
+ * output doubles as the history window and neither decoder keeps one of its
+ * own.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <string.h>
+
+#include "linker.h"
+#include "linker_debug.h"
+#include "unpack.h"
+
+static unsigned int get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/*
+ * LZ4
+ */
+
+#define LZ4_MAGIC         0x184D2204
+#define LZ4_FLG_VERSION   0xC0
+#define LZ4_FLG_BLOCK_SUM 0x10
+#define LZ4_FLG_SIZE      0x08
+#define LZ4_FLG_SUM       0x04
+#define LZ4_FLG_DICT_ID   0x01
+#define LZ4_RAW_BLOCK     0x80000000
+#define LZ4_MIN_MATCH     4
+
+/*
+ * Decodes one block. out is the start of the image, op is where the block
+ * goes. Matches may reach back into earlier blocks, which covers frames with
+ * linked as well as independent blocks.
+ */
+static unsigned char *lz4_block(const unsigned char *ip, const unsigned char *iend,
+		unsigned char *out, unsigned char *op, unsigned char *oend)
+{
+	unsigned int length, offset;
+	unsigned char *match;
+	unsigned char token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		length = token >> 4;
+		if (length == 15) {
+			do {
+				if (ip >= iend)
+					return NULL;
+				length += *ip;
+			} while (*ip++ == 255);
+		}
+
+		if (length > (unsigned int)(iend - ip) || length > (unsigned int)(oend - op))
+			return NULL;
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+
+		/* the last sequence only has literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return NULL;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (unsigned int)(op - out))
+			return NULL;
+
+		length = token & 15;
+		if (length == 15) {
+			do {
+				if (ip >= iend)
+					return NULL;
+				length += *ip;
+			} while (*ip++ == 255);
+		}
+		length += LZ4_MIN_MATCH;
+
+		if (length > (unsigned int)(oend - op))
+			return NULL;
+
+		match = op - offset;
+		if (offset >= length) {
+			memcpy(op, match, length);
+			op += length;
+		} else {
+			while (length--)
+				*op++ = *match++;
+		}
+	}
+
+	return op;
+}
+
+int lz4_unpack(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len)
+{
+	const unsigned char *ip = in, *iend = in + in_len;
+	unsigned char *op = out, *oend = out + out_len;
+	unsigned int flags, size;
+
+	if (in_len < 7 || get_le32(ip) != LZ4_MAGIC)
+		return -1;
+
+	flags = ip[4];
+	if ((flags & LZ4_FLG_VERSION) != 0x40)
+		return -1;
+
+	/* magic, FLG, BD, optional content size and dictionary id, HC */
+	ip += 6;
+	if (flags & LZ4_FLG_SIZE)
+		ip += 8;
+	if (flags & LZ4_FLG_DICT_ID)
+		ip += 4;
+	ip++;
+
+	for (;;) {
+		if (iend - ip < 4)
+			return -1;
+		size = get_le32(ip);
+		ip += 4;
+
+		if (size == 0)
+			break;
+
+		if ((size & ~LZ4_RAW_BLOCK) > (unsigned int)(iend - ip))
+			return -1;
+
+		if (size & LZ4_RAW_BLOCK) {
+			size &= ~LZ4_RAW_BLOCK;
+			if (size > (unsigned int)(oend - op))
+				return -1;
+			memcpy(op, ip, size);
+			op += size;
+		} else if ((op = lz4_block(ip, ip + size, out, op, oend)) == NULL) {
+			TRACE("[ lz4_unpack(), corrupt block at %d ]\n", ip - in);
+			return -1;
+		}
+
+		ip += size;
+		if (flags & LZ4_FLG_BLOCK_SUM)
+			ip += 4;
+	}
+
+	return op - out;
+}
+
+/*
+ * LZMA
+ */
+
+#define LZMA_HEADER_SIZE   13
+#define LZMA_PROB_BITS     11
+#define LZMA_PROB_INIT     (1 << (LZMA_PROB_BITS - 1))
+#define LZMA_MOVE_BITS     5
+#define LZMA_TOP           (1 << 24)
+
+#define LZMA_STATES        12
+#define LZMA_POS_STATES    (1 << 4)
+#define LZMA_LEN_STATES    4
+#define LZMA_END_POS_INDEX 14
+#define LZMA_FULL_DISTANCES (1 << (LZMA_END_POS_INDEX >> 1))
+#define LZMA_ALIGN_BITS    4
+#define LZMA_MATCH_MIN_LEN 2
+
+typedef unsigned short lzma_prob;
+
+struct lzma_rc {
+	const unsigned char *in;
+	const unsigned char *end;
+	unsigned int range;
+	unsigned int code;
+	int corrupted;
+};
+
+struct lzma_len {
+	lzma_prob choice;
+	lzma_prob choice2;
+	lzma_prob low[LZMA_POS_STATES << 3];
+	lzma_prob mid[LZMA_POS_STATES << 3];
+	lzma_prob high[256];
+};
+
+struct lzma_model {
+	lzma_prob is_match[LZMA_STATES << 4];
+	lzma_prob is_rep[LZMA_STATES];
+	lzma_prob is_rep_g0[LZMA_STATES];
+	lzma_prob is_rep_g1[LZMA_STATES];
+	lzma_prob is_rep_g2[LZMA_STATES];
+	lzma_prob is_rep0_long[LZMA_STATES << 4];
+	lzma_prob pos_slot[LZMA_LEN_STATES][1 << 6];
+	lzma_prob pos[1 + LZMA_FULL_DISTANCES - LZMA_END_POS_INDEX];
+	lzma_prob align[1 << LZMA_ALIGN_BITS];
+	struct lzma_len len;
+	struct lzma_len rep_len;
+	lzma_prob literal[];	/* 0x300 << (lc + lp) */
+};
+
+static inline unsigned char rc_byte(struct lzma_rc *rc)
+{
+	if (rc->in == rc->end) {
+		rc->corrupted = 1;
+		return 0;
+	}
+	return *rc->in++;
+}
+
+static inline void rc_normalize(struct lzma_rc *rc)
+{
+	if (rc->range < LZMA_TOP) {
+		rc->range <<= 8;
+		rc->code = (rc->code << 8) | rc_byte(rc);
+	}
+}
+
+static inline unsigned int rc_bit(struct lzma_rc *rc, lzma_prob *prob)
+{
+	unsigned int bound = (rc->range >> LZMA_PROB_BITS) * *prob;
+	unsigned int bit;
+
+	if (rc->code < bound) {
+		*prob += ((1 << LZMA_PROB_BITS) - *prob) >> LZMA_MOVE_BITS;
+		rc->range = bound;
+		bit = 0;
+	} else {
+		*prob -= *prob >> LZMA_MOVE_BITS;
+		rc->code -= bound;
+		rc->range -= bound;
+		bit = 1;
+	}
+	rc_normalize(rc);
+
+	return bit;
+}
+
+static unsigned int rc_direct(struct lzma_rc *rc, unsigned int count)
+{
+	unsigned int result = 0;
+	unsigned int mask;
+
+	while (count--) {
+		rc->range >>= 1;
+		rc->code -= rc->range;
+		mask = 0 - (rc->code >> 31);
+		rc->code += rc->range & mask;
+		if (rc->code == rc->range)
+			rc->corrupted = 1;
+		rc_normalize(rc);
+		result = (result << 1) + (mask + 1);
+	}
+
+	return result;
+}
+
+static unsigned int rc_tree(struct lzma_rc *rc, lzma_prob *probs, unsigned int bits)
+{
+	unsigned int m = 1;
+	unsigned int i;
+
+	for (i = 0; i < bits; i++)
+		m = (m << 1) + rc_bit(rc, &probs[m]);
+
+	return m - (1 << bits);
+}
+
+static unsigned int rc_tree_reverse(struct lzma_rc *rc, lzma_prob *probs, unsigned int bits)
+{
+	unsigned int m = 1;
+	unsigned int symbol = 0;
+	unsigned int bit;
+	unsigned int i;
+
+	for (i = 0; i < bits; i++) {
+		bit = rc_bit(rc, &probs[m]);
+		m = (m << 1) + bit;
+		symbol |= bit << i;
+	}
+
+	return symbol;
+}
+
+static unsigned int lzma_len(struct lzma_rc *rc, struct lzma_len *len, unsigned int pos_state)
+{
+	if (!rc_bit(rc, &len->choice))
+		return rc_tree(rc, &len->low[pos_state << 3], 3);
+	if (!rc_bit(rc, &len->choice2))
+		return 8 + rc_tree(rc, &len->mid[pos_state << 3], 3);
+	return 16 + rc_tree(rc, len->high, 8);
+}
+
+static unsigned int lzma_distance(struct lzma_rc *rc, struct lzma_model *model, unsigned int len)
+{
+	unsigned int slot, bits, distance;
+
+	slot = rc_tree(rc, model->pos_slot[len < LZMA_LEN_STATES ? len : LZMA_LEN_STATES - 1], 6);
+	if (slot < 4)
+		return slot;
+
+	bits = (slot >> 1) - 1;
+	distance = (2 | (slot & 1)) << bits;
+	if (slot < LZMA_END_POS_INDEX)
+		return distance + rc_tree_reverse(rc, model->pos + distance - slot, bits);
+
+	distance += rc_direct(rc, bits - LZMA_ALIGN_BITS) << LZMA_ALIGN_BITS;
+	return distance + rc_tree_reverse(rc, model->align, LZMA_ALIGN_BITS);
+}
+
+static int lzma_decode(struct lzma_rc *rc, struct lzma_model *model,
+		unsigned int lc, unsigned int lp, unsigned int pb,
+		unsigned char *out, size_t out_len, int size_known)
+{
+	unsigned int rep0 = 0, rep1 = 0, rep2 = 0, rep3 = 0;
+	unsigned int state = 0;
+	unsigned int pos_state, len, symbol, bit, match_bit, match_byte;
+	lzma_prob *probs;
+	size_t pos = 0;
+
+	for (;;) {
+		if (rc->corrupted)
+			return -1;
+
+		if (size_known && pos == out_len && rc->code == 0)
+			break;
+
+		pos_state = pos & ((1 << pb) - 1);
+
+		if (!rc_bit(rc, &model->is_match[(state << 4) + pos_state])) {
+			if (pos == out_len)
+				return -1;
+
+			probs = &model->literal[0x300 * (((pos & ((1 << lp) - 1)) << lc)
+				+ ((pos ? out[pos - 1] : 0) >> (8 - lc)))];
+			symbol = 1;
+
+			if (state >= 7) {
+				match_byte = out[pos - rep0 - 1];
+				do {
+					match_bit = (match_byte >> 7) & 1;
+					match_byte <<= 1;
+					bit = rc_bit(rc, &probs[((1 + match_bit) << 8) + symbol]);
+					symbol = (symbol << 1) | bit;
+				} while (match_bit == bit && symbol < 0x100);
+			}
+			while (symbol < 0x100)
+				symbol = (symbol << 1) | rc_bit(rc, &probs[symbol]);
+
+			out[pos++] = symbol - 0x100;
+			state = state < 4 ? 0 : (state < 10 ? state - 3 : state - 6);
+			continue;
+		}
+
+		if (rc_bit(rc, &model->is_rep[state])) {
+			if (pos == 0)
+				return -1;
+
+			if (!rc_bit(rc, &model->is_rep_g0[state])) {
+				if (!rc_bit(rc, &model->is_rep0_long[(state << 4) + pos_state])) {
+					/* short rep, one byte at rep0 */
+					if (pos == out_len)
+						return -1;
+					state = state < 7 ? 9 : 11;
+					out[pos] = out[pos - rep0 - 1];
+					pos++;
+					continue;
+				}
+			} else {
+				unsigned int distance;
+
+				if (!rc_bit(rc, &model->is_rep_g1[state])) {
+					distance = rep1;
+				} else {
+					if (!rc_bit(rc, &model->is_rep_g2[state])) {
+						distance = rep2;
+					} else {
+						distance = rep3;
+						rep3 = rep2;
+					}
+					rep2 = rep1;
+				}
+				rep1 = rep0;
+				rep0 = distance;
+			}
+
+			len = lzma_len(rc, &model->rep_len, pos_state);
+			state = state < 7 ? 8 : 11;
+		} else {
+			rep3 = rep2;
+			rep2 = rep1;
+			rep1 = rep0;
+			len = lzma_len(rc, &model->len, pos_state);
+			state = state < 7 ? 7 : 10;
+			rep0 = lzma_distance(rc, model, len);
+
+			if (rep0 == 0xFFFFFFFF) {
+				/* end marker */
+				if (rc->code != 0)
+					return -1;
+				break;
+			}
+			if (rep0 >= pos)
+				return -1;
+		}
+
+		len += LZMA_MATCH_MIN_LEN;
+		if (len > out_len - pos)
+			return -1;
+
+		while (len--) {
+			out[pos] = out[pos - rep0 - 1];
+			pos++;
+		}
+	}
+
+	return rc->corrupted ? -1 : (int)pos;
+}
+
+int lzma_unpack(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len)
+{
+	struct lzma_model *model;
+	struct lzma_rc rc;
+	unsigned int props, lc, lp, pb, size_low, size_high;
+	size_t model_size, i;
+	int size_known;
+	int result;
+
+	if (in_len < LZMA_HEADER_SIZE + 5)
+		return -1;
+
+	props = in[0];
+	if (props >= 9 * 5 * 5)
+		return -1;
+	lc = props % 9;
+	props /= 9;
+	lp = props % 5;
+	pb = props / 5;
+
+	/* in[1..4] is the dictionary size, which the whole image covers anyway */
+	size_low = get_le32(in + 5);
+	size_high = get_le32(in + 9);
+	size_known = !(size_low == 0xFFFFFFFF && size_high == 0xFFFFFFFF);
+	if (size_known) {
+		if (size_high != 0 || size_low > out_len)
+			return -1;
+		out_len = size_low;
+	}
+
+	model_size = sizeof(struct lzma_model) + (sizeof(lzma_prob) * 0x300 << (lc + lp));
+	model = mmap(0, model_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if (model == MAP_FAILED)
+		return -1;
+
+	for (i = 0; i < model_size / sizeof(lzma_prob); i++)
+		((lzma_prob *)model)[i] = LZMA_PROB_INIT;
+
+	rc.in = in + LZMA_HEADER_SIZE;
+	rc.end = in + in_len;
+	rc.range = 0xFFFFFFFF;
+	rc.code = 0;
+	rc.corrupted = rc_byte(&rc) != 0;
+	for (i = 0; i < 4; i++)
+		rc.code = (rc.code << 8) | rc_byte(&rc);
+	if (rc.code == rc.range)
+		rc.corrupted = 1;
+
+	result = lzma_decode(&rc, model, lc, lp, pb, out, out_len, size_known);
+	if (result == -1)
+		TRACE("[ lzma_unpack(), corrupt stream at %d ]\n", rc.in - in);
+
+	munmap(model, model_size);
+
+	return result;
+}
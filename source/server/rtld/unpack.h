@@ -0,0 +1,29 @@
+/*
+ * metasploit
+ */
+
+#ifndef _UNPACK_H
+#define _UNPACK_H
+
+#include <sys/types.h>
+
+/*
+ * Tagged images start with IMAGE_MAGIC, a codec byte, three reserved bytes
+ * and the little endian size of the unpacked image, followed by the packed
+ * image. Images without the tag are either gzip'd or not packed at all.
+ */
+#define IMAGE_MAGIC        "MIMG"
+#define IMAGE_HEADER_SIZE  12
+
+#define IMAGE_CODEC_DEFLATE 1	/* raw deflate stream */
+#define IMAGE_CODEC_LZ4     2	/* LZ4 frame, as written by lz4(1) */
+#define IMAGE_CODEC_LZMA    3	/* .lzma stream, as written by xz --format=lzma */
+
+/*
+ * Both return the number of bytes unpacked into out, or -1 if the input is
+ * corrupt or doesn't fit in out_len bytes.
+ */
+int lz4_unpack(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len);
+int lzma_unpack(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len);
+
+#endif
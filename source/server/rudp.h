@@ -0,0 +1,86 @@
+/*!
+ * @file rudp.h
+ * @brief Declarations for the reliable datagram layer used by the UDP transport.
+ * @details Messages are sent on one of a handful of streams. Each stream is
+ *          delivered in order, but independently of the others, so a lost
+ *          datagram only holds up the stream it belongs to. Every datagram has
+ *          a fresh number, including retransmissions, and the receiver acknowledges
+ *          ranges of numbers, so the sender knows exactly which datagrams
+ *          arrived. The congestion window either follows Reno, halving on loss,
+ *          or stays fixed, which suits links where loss isn't a sign of congestion.
+ *          Optionally, a parity datagram follows every few data datagrams, which
+ *          lets the receiver rebuild a single lost datagram without waiting for
+ *          a retransmission.
+ *
+ *          The layer doesn't do any I/O itself. Datagrams are handed to it as they
+ *          arrive, and it hands the ones it wants sent to a callback, so whatever
+ *          carries them (a plain socket or DTLS) is up to the caller.
+ */
+#ifndef _METERPRETER_SERVER_RUDP_H
+#define _METERPRETER_SERVER_RUDP_H
+
+/*! @brief Largest number of message bytes carried by a single datagram. */
+#define RUDP_MSS                1200
+/*! @brief Largest datagram the layer sends or accepts. */
+#define RUDP_MAX_DATAGRAM       1500
+/*! @brief Number of streams. Stream zero is meant for packets that don't belong to a channel. */
+#define RUDP_STREAMS            8
+/*! @brief Largest number of parity groups, in data datagrams. */
+#define RUDP_MAX_FEC            16
+
+/*! @brief Reno congestion control, the window halves on loss. */
+#define RUDP_CC_RENO            0
+/*! @brief A fixed congestion window, loss doesn't shrink it. */
+#define RUDP_CC_FIXED           1
+
+/*! @brief Indication that the connection is being set up. */
+#define RUDP_STATE_CONNECTING   0
+/*! @brief Indication that the connection is up. */
+#define RUDP_STATE_ESTABLISHED  1
+/*! @brief Indication that the connection is closed or has failed. */
+#define RUDP_STATE_CLOSED       2
+
+typedef struct _RudpOptions
+{
+	DWORD congestion;                       ///< Congestion control, one of the \c RUDP_CC_ values.
+	DWORD window;                           ///< Largest congestion window in datagrams, and the fixed window for \c RUDP_CC_FIXED.
+	DWORD fec;                              ///< Number of data datagrams covered by each parity datagram, zero for none.
+} RudpOptions;
+
+/*! @brief Counters that describe how a connection has fared. */
+typedef struct _RudpStats
+{
+	DWORD sent;                             ///< Number of data datagrams sent, including retransmissions.
+	DWORD retransmitted;                    ///< Number of data datagrams that were retransmissions.
+	DWORD parity;                           ///< Number of parity datagrams sent.
+	DWORD received;                         ///< Number of data datagrams received, including duplicates.
+	DWORD recovered;                        ///< Number of lost data datagrams rebuilt from parity.
+	DWORD timeouts;                         ///< Number of retransmission timeouts.
+	DWORD cwnd;                             ///< Current congestion window, in datagrams.
+	DWORD srtt;                             ///< Smoothed round trip time, in milliseconds.
+} RudpStats;
+
+typedef struct _RudpConnection RudpConnection;
+
+/*!
+ * @brief Sends a datagram.
+ * @return Indication of success or failure. A failed send is treated like a lost datagram.
+ */
+typedef DWORD (*PRudpOutput)(LPVOID context, PUCHAR datagram, DWORD length);
+/*!
+ * @brief Lets the caller know that the connection has something to send, so that \c rudp_tick should be called.
+ */
+typedef VOID (*PRudpNotify)(LPVOID context);
+
+RudpConnection* rudp_create(RudpOptions* options, BOOL server, PRudpOutput output, PRudpNotify notify, LPVOID context);
+VOID rudp_destroy(RudpConnection* connection);
+DWORD rudp_send(RudpConnection* connection, DWORD stream, PUCHAR message, DWORD length);
+DWORD rudp_receive(RudpConnection* connection, PUCHAR* message, DWORD* length, DWORD timeout);
+VOID rudp_input(RudpConnection* connection, PUCHAR datagram, DWORD length);
+DWORD rudp_tick(RudpConnection* connection);
+VOID rudp_close(RudpConnection* connection);
+DWORD rudp_state(RudpConnection* connection);
+VOID rudp_stats(RudpConnection* connection, RudpStats* stats);
+DWORD rudp_unacked(RudpConnection* connection);
+
+#endif
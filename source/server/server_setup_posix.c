@@ -429,7 +429,7 @@ static LONG server_socket_poll(Remote * remote, long timeout)
  * @param remote Pointer to the remote instance.
  * @return Indication of success or failure.
  */
-static int server_initialize_ssl(Remote * remote)
+int server_initialize_ssl(Remote * remote)
 {
 	int i;
 
@@ -462,6 +462,30 @@ static int server_initialize_ssl(Remote * remote)
 	return 0;
 }
 
+/*!
+ * @brief Remove the OpenSSL multi-threading callbacks and free their locks.
+ * @param remote Pointer to the remote instance.
+ */
+VOID server_shutdown_ssl(Remote * remote)
+{
+	int i;
+
+	lock_acquire(remote->lock);
+	CRYPTO_set_locking_callback(NULL);
+	CRYPTO_set_id_callback(NULL);
+	CRYPTO_set_dynlock_create_callback(NULL);
+	CRYPTO_set_dynlock_lock_callback(NULL);
+	CRYPTO_set_dynlock_destroy_callback(NULL);
+
+	for (i = 0; i < CRYPTO_num_locks(); i++) {
+		lock_destroy(ssl_locks[i]);
+	}
+
+	free(ssl_locks);
+	ssl_locks = NULL;
+	lock_release(remote->lock);
+}
+
 /*!
  * @brief Bring down the OpenSSL subsystem
  * @param remote Pointer to the remote instance.
@@ -470,28 +494,33 @@ static int server_initialize_ssl(Remote * remote)
 BOOL server_destroy_ssl(Remote * remote)
 {
 	TcpTransportContext* ctx = NULL;
-	int i;
+	PacketPipeline* pipeline = NULL;
 
 	if (remote) {
 		dprintf("[SERVER] Destroying SSL");
+
+		// Detach the pipeline so no new packets are handed to it, then flush
+		// whatever it still holds while the connection is up. The writer takes
+		// the lock, so the flush has to happen outside of it.
+		lock_acquire(remote->lock);
+		if (remote->transport && remote->transport->ctx) {
+			ctx = (TcpTransportContext*)remote->transport->ctx;
+			pipeline = ctx->pipeline;
+			ctx->pipeline = NULL;
+		}
+		lock_release(remote->lock);
+
+		pipeline_destroy(pipeline);
+
 		lock_acquire(remote->lock);
 		if (remote->transport && remote->transport->ctx) {
 			ctx = (TcpTransportContext*)remote->transport->ctx;
 			SSL_free(ctx->ssl);
 			SSL_CTX_free(ctx->ctx);
 		}
-		CRYPTO_set_locking_callback(NULL);
-		CRYPTO_set_id_callback(NULL);
-		CRYPTO_set_dynlock_create_callback(NULL);
-		CRYPTO_set_dynlock_lock_callback(NULL);
-		CRYPTO_set_dynlock_destroy_callback(NULL);
-
-		for (i = 0; i < CRYPTO_num_locks(); i++) {
-			lock_destroy(ssl_locks[i]);
-		}
-
-		free(ssl_locks);
 		lock_release(remote->lock);
+
+		server_shutdown_ssl(remote);
 	}
 
 	return TRUE;
@@ -553,6 +582,39 @@ out:
 	return success;
 }
 
+/*!
+ * @brief Write a frame that was built by the outbound pipeline.
+ * @param remote Pointer to the \c Remote instance.
+ * @param frame The packet's header followed by its (encrypted) payload.
+ * @param frameLength Number of bytes in \c frame.
+ * @return Indication of success or failure.
+ */
+static DWORD packet_write_frame_via_ssl(Remote* remote, PUCHAR frame, DWORD frameLength)
+{
+	TcpTransportContext* ctx = (TcpTransportContext*)remote->transport->ctx;
+	DWORD idx = 0;
+	int res;
+
+	lock_acquire(remote->lock);
+
+	while (idx < frameLength)
+	{
+		res = SSL_write(ctx->ssl, frame + idx, frameLength - idx);
+
+		if (res <= 0)
+		{
+			dprintf("[PACKET] transmit frame failed with return %d at index %d\n", res, idx);
+			break;
+		}
+
+		idx += res;
+	}
+
+	lock_release(remote->lock);
+
+	return idx == frameLength ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
+}
+
 /*!
  * @brief Transmit a packet via SSL _and_ destroy it.
  * @param remote Pointer to the \c Remote instance.
@@ -568,6 +630,7 @@ DWORD packet_transmit_via_ssl(Remote* remote, Packet* packet, PacketRequestCompl
 	DWORD res;
 	DWORD idx;
 	TcpTransportContext* ctx = (TcpTransportContext*)remote->transport->ctx;
+	PacketPipeline* pipeline = NULL;
 
 	lock_acquire(remote->lock);
 
@@ -595,14 +658,31 @@ DWORD packet_transmit_via_ssl(Remote* remote, Packet* packet, PacketRequestCompl
 			(packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID,
 			&requestId) == ERROR_SUCCESS))
 		{
-			packet_add_completion_handler((LPCSTR)requestId.buffer, completion);
+			packet_add_completion_handler(remote, (LPCSTR)requestId.buffer, completion);
 		}
 
+		recorder_packet(remote, RECORDER_DIRECTION_OUTBOUND, packet);
+
 		// If the endpoint has a cipher established and this is not a plaintext
 		// packet, we encrypt
-		if ((crypto = remote_get_cipher(remote)) &&
-			(packet_get_type(packet) != PACKET_TLV_TYPE_PLAIN_REQUEST) &&
-			(packet_get_type(packet) != PACKET_TLV_TYPE_PLAIN_RESPONSE))
+		crypto = remote_get_cipher(remote);
+		if ((packet_get_type(packet) == PACKET_TLV_TYPE_PLAIN_REQUEST) ||
+			(packet_get_type(packet) == PACKET_TLV_TYPE_PLAIN_RESPONSE))
+		{
+			crypto = NULL;
+		}
+
+		// The pipeline encrypts and writes the packet on its own threads, the cipher
+		// is picked here so that packets keep the cipher that was current when they
+		// were transmitted
+		if (ctx->pipeline)
+		{
+			pipeline = ctx->pipeline;
+			pipeline_acquire(pipeline);
+			break;
+		}
+
+		if (crypto)
 		{
 			ULONG origPayloadLength = packet->payloadLength;
 			PUCHAR origPayload = packet->payload;
@@ -674,6 +754,15 @@ DWORD packet_transmit_via_ssl(Remote* remote, Packet* packet, PacketRequestCompl
 		SetLastError(ERROR_SUCCESS);
 	} while (0);
 
+	// The pipeline may block until the writer catches up, which needs the lock
+	if (pipeline)
+	{
+		lock_release(remote->lock);
+		res = pipeline_transmit(pipeline, packet, crypto);
+		pipeline_release(pipeline);
+		return res;
+	}
+
 	res = GetLastError();
 
 	// Destroy the packet
@@ -821,6 +910,8 @@ static DWORD packet_receive_via_ssl(Remote *remote, Packet **packet)
 		localPacket->payload = payload;
 		localPacket->payloadLength = payloadLength;
 
+		recorder_packet(remote, RECORDER_DIRECTION_INBOUND, localPacket);
+
 		*packet = localPacket;
 
 		SetLastError(ERROR_SUCCESS);
@@ -888,10 +979,10 @@ static BOOL server_dispatch_tcp(Remote * remote, THREAD* dispatchThread)
 	}
 
 	dprintf("[DISPATCH] calling scheduler_destroy...")
-	scheduler_destroy();
+	scheduler_destroy(remote);
 
 	dprintf("[DISPATCH] calling command_join_threads...")
-	command_join_threads();
+	command_join_threads(remote);
 
 	dprintf("[DISPATCH] leaving server_dispatch.");
 	return result;
@@ -1181,6 +1272,8 @@ static BOOL configure_tcp_connection(Remote* remote, SOCKET sock)
 		return FALSE;
 	}
 
+	ctx->pipeline = pipeline_create(remote, packet_write_frame_via_ssl);
+
 	return TRUE;
 }
 
@@ -1253,6 +1346,14 @@ static Transport* transport_create(MetsrvConfigData* config, BOOL stageless)
 	{
 		t = transport_create_tcp(url, &config->timeouts.values);
 	}
+	else if (strcmp(transport, "WS") == 0 || strcmp(transport, "WSS") == 0)
+	{
+		t = transport_create_websocket(url, &config->timeouts.values);
+	}
+	else if (strcmp(transport, "UDP") == 0 || strcmp(transport, "DTLS") == 0)
+	{
+		t = transport_create_udp(url, &config->timeouts.values);
+	}
 	else
 	{
 		// one day we'll have http(s)
@@ -1278,6 +1379,7 @@ DWORD server_setup(SOCKET fd)
 {
 	THREAD * dispatchThread = NULL;
 	Remote *remote = NULL;
+	char *recordPath = NULL;
 	char cStationName[256] = { 0 };
 	char cDesktopName[256] = { 0 };
 	DWORD res = 0;
@@ -1302,6 +1404,11 @@ DWORD server_setup(SOCKET fd)
 	// Set up the transport creation function pointers.
 	remote->trans_create_tcp = transport_create_tcp;
 
+	// Record the session's traffic if it has been requested
+	if ((recordPath = getenv(RECORDER_ENV_PATH)) != NULL) {
+		recorder_start(remote, recordPath);
+	}
+
 	// Store our thread handle
 	remote->server_thread = dispatchThread->handle;
 
@@ -145,6 +145,7 @@ DWORD server_setup(SOCKET fd)
 {
 	THREAD* serverThread = NULL;
 	Remote* remote = NULL;
+	char* recordPath = NULL;
 	char stationName[256] = { 0 };
 	char desktopName[256] = { 0 };
 	DWORD res = 0;
@@ -182,6 +183,12 @@ DWORD server_setup(SOCKET fd)
 			remote->trans_create_tcp = transport_create_tcp;
 			remote->trans_create_http = transport_create_http;
 
+			// Record the session's traffic if it has been requested
+			if ((recordPath = getenv(RECORDER_ENV_PATH)) != NULL)
+			{
+				recorder_start(remote, recordPath);
+			}
+
 			// Store our thread handle
 			remote->server_thread = serverThread->handle;
 
@@ -0,0 +1,16 @@
+/*!
+ * @file server_transport_udp.h
+ * @brief Declarations for the reliable UDP transport.
+ * @details The transport connects to a \c udp:// or \c dtls:// URL and carries one
+ *          TLV packet in each message of the reliable datagram layer. Channels get
+ *          their own streams, so a lost datagram only delays the channel it belongs
+ *          to, and the query string tunes the layer for the link, for example
+ *          \c udp://host:4444?cc=fixed&window=64&fec=8 on a lossy radio link.
+ *          \c dtls:// URLs encrypt the datagrams with DTLS.
+ */
+#ifndef _METERPRETER_SERVER_TRANSPORT_UDP_H
+#define _METERPRETER_SERVER_TRANSPORT_UDP_H
+
+Transport* transport_create_udp(char* url, TimeoutSettings* timeouts);
+
+#endif
@@ -0,0 +1,23 @@
+/*!
+ * @file server_transport_websocket.h
+ * @brief Declarations for the WebSocket transport.
+ * @details The transport connects to a \c ws:// or \c wss:// URL, upgrades the
+ *          connection with a HTTP/1.1 handshake and then carries one TLV packet
+ *          in each binary message, in both directions at once. Unlike the HTTP
+ *          transports there's no polling, so packets are delivered as soon as
+ *          they are sent, and proxies that understand HTTP let the traffic through.
+ *          Idle connections are kept alive with pings.
+ */
+#ifndef _METERPRETER_SERVER_TRANSPORT_WEBSOCKET_H
+#define _METERPRETER_SERVER_TRANSPORT_WEBSOCKET_H
+
+/*! @brief Number of idle seconds after which a keepalive ping is sent. */
+#define WEBSOCKET_PING_INTERVAL  30
+/*! @brief Number of seconds to wait for the answer to a keepalive ping before the connection is given up on. */
+#define WEBSOCKET_PONG_TIMEOUT   30
+/*! @brief Largest message that is accepted from the other end. */
+#define WEBSOCKET_MAX_MESSAGE    (64 * 1024 * 1024)
+
+Transport* transport_create_websocket(char* url, TimeoutSettings* timeouts);
+
+#endif
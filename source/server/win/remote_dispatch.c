@@ -58,6 +58,7 @@ DWORD initialise_extension(HMODULE hLibrary, BOOL bLibLoadedReflectivly, Remote*
 				if (pExtension->getname)
 				{
 					pExtension->getname(pExtension->name, sizeof(pExtension->name));
+					command_group_loaded(pExtension->name);
 				}
 
 				list_push(gExtensionList, pExtension);
@@ -116,6 +117,9 @@ DWORD request_core_loadlib(Remote *pRemote, Packet *pPacket)
 		libraryPath = packet_get_tlv_value_string(pPacket, TLV_TYPE_LIBRARY_PATH);
 		flags = packet_get_tlv_value_uint(pPacket, TLV_TYPE_FLAGS);
 
+		// the extension may want to know what the client can do before it initializes
+		pRemote->client_capabilities |= packet_get_tlv_value_uint(pPacket, TLV_TYPE_CLIENT_CAPABILITIES);
+
 		// Invalid library path?
 		if (!libraryPath)
 		{
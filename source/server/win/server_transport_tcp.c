@@ -713,6 +713,8 @@ static DWORD packet_receive_via_ssl(Remote *remote, Packet **packet)
 		localPacket->payload = payload;
 		localPacket->payloadLength = payloadLength;
 
+		recorder_packet(remote, RECORDER_DIRECTION_INBOUND, localPacket);
+
 		*packet = localPacket;
 
 		SetLastError(ERROR_SUCCESS);
@@ -806,10 +808,10 @@ static DWORD server_dispatch_tcp(Remote* remote, THREAD* dispatchThread)
 	}
 
 	dprintf("[DISPATCH] calling scheduler_destroy...");
-	scheduler_destroy();
+	scheduler_destroy(remote);
 
 	dprintf("[DISPATCH] calling command_join_threads...");
-	command_join_threads();
+	command_join_threads(remote);
 
 	dprintf("[DISPATCH] leaving server_dispatch.");
 
@@ -1157,9 +1159,11 @@ DWORD packet_transmit_via_ssl(Remote* remote, Packet* packet, PacketRequestCompl
 			(packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID,
 			&requestId) == ERROR_SUCCESS))
 		{
-			packet_add_completion_handler((LPCSTR)requestId.buffer, completion);
+			packet_add_completion_handler(remote, (LPCSTR)requestId.buffer, completion);
 		}
 
+		recorder_packet(remote, RECORDER_DIRECTION_OUTBOUND, packet);
+
 		// If the endpoint has a cipher established and this is not a plaintext
 		// packet, we encrypt
 		if ((crypto = remote_get_cipher(remote)) &&
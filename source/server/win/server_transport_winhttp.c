@@ -156,9 +156,11 @@ static DWORD packet_transmit_via_http(Remote *remote, Packet *packet, PacketRequ
 			(packet_get_tlv_string(packet, TLV_TYPE_REQUEST_ID,
 			&requestId) == ERROR_SUCCESS))
 		{
-			packet_add_completion_handler((LPCSTR)requestId.buffer, completion);
+			packet_add_completion_handler(remote, (LPCSTR)requestId.buffer, completion);
 		}
 
+		recorder_packet(remote, RECORDER_DIRECTION_OUTBOUND, packet);
+
 		// If the endpoint has a cipher established and this is not a plaintext
 		// packet, we encrypt
 		if ((crypto = remote_get_cipher(remote)) &&
@@ -430,6 +432,8 @@ static DWORD packet_receive_http_via_winhttp(Remote *remote, Packet **packet)
 		localPacket->payload = payload;
 		localPacket->payloadLength = payloadLength;
 
+		recorder_packet(remote, RECORDER_DIRECTION_INBOUND, localPacket);
+
 		*packet = localPacket;
 
 		SetLastError(ERROR_SUCCESS);
@@ -549,10 +553,10 @@ static DWORD server_deinit_http(Remote* remote)
 	WinHttpCloseHandle(ctx->internet);
 
 	dprintf("[DISPATCH] calling scheduler_destroy...");
-	scheduler_destroy();
+	scheduler_destroy(remote);
 
 	dprintf("[DISPATCH] calling command_join_threads...");
-	command_join_threads();
+	command_join_threads(remote);
 
 	return TRUE;
 }
@@ -0,0 +1,46 @@
+#!/usr/bin/perl -w
+#
+# Packs a library for dlopenbuf() with the codec that suits the link it will
+# be sent over:
+#
+#   deflate - the default, what gzip'd images have always used
+#   lz4     - unpacks an order of magnitude faster, for fast links
+#   lzma    - the smallest images, for slow links
+#
+# The packed image starts with the tag described in
+# source/server/rtld/unpack.h.
+
+my %codecs = (
+  "deflate" => [ 1, "gzip -9 -n -c" ],
+  "lz4"     => [ 2, "lz4 -9 -c" ],
+  "lzma"    => [ 3, "xz --format=lzma -9 -c" ],
+);
+
+if ($#ARGV != 2 || !exists $codecs{$ARGV[0]}) {
+  print "packimage.pl <deflate|lz4|lzma> <filename.so> <output>\n";
+  exit 1;
+}
+
+my ($codec, $command) = @{$codecs{$ARGV[0]}};
+my $size = -s $ARGV[1];
+die "failed to stat $ARGV[1]\n" unless defined $size;
+
+open INPUT, "$command < $ARGV[1] |" or die "failed to run $command\n";
+binmode INPUT;
+local $/;
+my $packed = <INPUT>;
+close INPUT or die "$command failed\n";
+
+#
+# dlopenbuf() takes a raw deflate stream, drop the gzip header and trailer
+#
+if ($codec == 1) {
+  $packed = substr($packed, 10, length($packed) - 18);
+}
+
+open OUTPUT, "> $ARGV[2]" or die "failed to open $ARGV[2]\n";
+binmode OUTPUT;
+print OUTPUT "MIMG" . pack("CCCCV", $codec, 0, 0, 0, $size) . $packed;
+close OUTPUT;
+
+printf "%s: %d -> %d bytes\n", $ARGV[1], $size, length($packed) + 12;